@@ -20,12 +20,18 @@
 #include "roothubs.h"
 #include "version.h"
 #include "descriptors.h"
+#include "filterprog.h"
+#include "latency.h"
+#include "top.h"
 #include "USBPcap.h"
 
 #define INPUT_BUFFER_SIZE 1024
 
 #define DEFAULT_INTERNAL_KERNEL_BUFFER_SIZE (1024*1024)
 #define DEFAULT_SNAPSHOT_LENGTH             (65535)
+#define DEFAULT_WAKEUP_LATENCY              (10000)
+#define DEFAULT_OUTSTANDING_READS           (4)
+#define MAX_OUTSTANDING_READS               (16)
 
 static BOOL IsElevated()
 {
@@ -349,6 +355,21 @@ static BOOL generate_worker_command_line(struct thread_data *data,
 #define WORKER_CMD_LINE_FORMATTER_CAPTURE_ALL L" --capture-from-all-devices"
 #define WORKER_CMD_LINE_FORMATTER_CAPTURE_NEW L" --capture-from-new-devices"
 #define WORKER_CMD_LINE_FORMATTER_INJECT_DESCRIPTORS L" --inject-descriptors"
+#define WORKER_CMD_LINE_FORMATTER_PER_CPU_BUFFERS L" --per-cpu-buffers"
+#define WORKER_CMD_LINE_FORMATTER_ZERO_COPY   L" --zero-copy"
+#define WORKER_CMD_LINE_FORMATTER_PCAPNG      L" --pcapng"
+#define WORKER_CMD_LINE_FORMATTER_COMPLETION_ONLY L" --completion-only"
+#define WORKER_CMD_LINE_FORMATTER_OVERWRITE_OLDEST L" --overwrite-oldest"
+#define WORKER_CMD_LINE_FORMATTER_WAKEUP      L" --wakeup-bytes %u --wakeup-latency %u"
+#define WORKER_CMD_LINE_FORMATTER_FLUSH       L" --flush-interval %S"
+#define WORKER_CMD_LINE_FORMATTER_OUTSTANDING_READS L" --outstanding-reads %u"
+#define WORKER_CMD_LINE_FORMATTER_STATS       L" --stats %u"
+#define WORKER_CMD_LINE_FORMATTER_RING_BUFFER L" --ring-buffer %S"
+#define WORKER_CMD_LINE_FORMATTER_FILTER_PROGRAM L" --filter-program \"%S\""
+#define WORKER_CMD_LINE_FORMATTER_ENDPOINTS   L" --endpoints %S"
+#define WORKER_CMD_LINE_FORMATTER_TRANSFER_TYPES L" --transfer-types %S"
+#define WORKER_CMD_LINE_FORMATTER_SNAPLEN_TABLE L" --snaplen-table %S"
+#define WORKER_CMD_LINE_FORMATTER_TRIGGER     L" --trigger %S"
 
     cmdLineLen = MultiByteToWideChar(CP_ACP, 0, data->device, -1, NULL, 0);
     cmdLineLen += (pipeName == NULL) ? strlen(data->filename) : wcslen(pipeName);
@@ -361,6 +382,31 @@ static BOOL generate_worker_command_line(struct thread_data *data,
     cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_CAPTURE_ALL);
     cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_CAPTURE_NEW);
     cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_INJECT_DESCRIPTORS);
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_PER_CPU_BUFFERS);
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_ZERO_COPY);
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_PCAPNG);
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_COMPLETION_ONLY);
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_OVERWRITE_OLDEST);
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_WAKEUP);
+    cmdLineLen += 20 /* maximum wakeup bytes and latency in characters */;
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_FLUSH);
+    cmdLineLen += (data->flush_arg == NULL) ? 0 : strlen(data->flush_arg);
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_OUTSTANDING_READS);
+    cmdLineLen += 2 /* maximum outstanding reads in characters */;
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_STATS);
+    cmdLineLen += 10 /* maximum stats interval in characters */;
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_RING_BUFFER);
+    cmdLineLen += (data->rotate_arg == NULL) ? 0 : strlen(data->rotate_arg);
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_FILTER_PROGRAM);
+    cmdLineLen += (data->filter_program_path == NULL) ? 0 : strlen(data->filter_program_path);
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_ENDPOINTS);
+    cmdLineLen += (data->endpoint_list == NULL) ? 0 : strlen(data->endpoint_list);
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_TRANSFER_TYPES);
+    cmdLineLen += (data->transfer_types == NULL) ? 0 : strlen(data->transfer_types);
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_SNAPLEN_TABLE);
+    cmdLineLen += (data->snaplen_table == NULL) ? 0 : strlen(data->snaplen_table);
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_TRIGGER);
+    cmdLineLen += (data->trigger == NULL) ? 0 : strlen(data->trigger);
     cmdLineLen += (data->address_list == NULL) ? 0 : strlen(data->address_list);
 
     cmdLine = (PWSTR)malloc(cmdLineLen * sizeof(WCHAR));
@@ -400,6 +446,22 @@ static BOOL generate_worker_command_line(struct thread_data *data,
                              data->snaplen);
     }
 
+    if (data->snaplen_table != NULL)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_SNAPLEN_TABLE,
+                             data->snaplen_table);
+    }
+
+    if (data->trigger != NULL)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_TRIGGER,
+                             data->trigger);
+    }
+
     if (data->address_list != NULL)
     {
         nChars += swprintf_s(&cmdLine[nChars],
@@ -408,6 +470,22 @@ static BOOL generate_worker_command_line(struct thread_data *data,
                              data->address_list);
     }
 
+    if (data->endpoint_list != NULL)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_ENDPOINTS,
+                             data->endpoint_list);
+    }
+
+    if (data->transfer_types != NULL)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_TRANSFER_TYPES,
+                             data->transfer_types);
+    }
+
     if (data->capture_all)
     {
         nChars += swprintf_s(&cmdLine[nChars],
@@ -428,9 +506,108 @@ static BOOL generate_worker_command_line(struct thread_data *data,
                              cmdLineLen - nChars,
                              WORKER_CMD_LINE_FORMATTER_INJECT_DESCRIPTORS);
     }
+
+    if (data->capture_flags & USBPCAP_CAPTURE_FLAG_PER_CPU_BUFFERS)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_PER_CPU_BUFFERS);
+    }
+
+    if (data->capture_flags & USBPCAP_CAPTURE_FLAG_MAPPED_BUFFER)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_ZERO_COPY);
+    }
+
+    if (data->capture_flags & USBPCAP_CAPTURE_FLAG_PCAPNG)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_PCAPNG);
+    }
+
+    if (data->capture_flags & USBPCAP_CAPTURE_FLAG_COMPLETION_ONLY)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_COMPLETION_ONLY);
+    }
+
+    if (data->capture_flags & USBPCAP_CAPTURE_FLAG_OVERWRITE_OLDEST)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_OVERWRITE_OLDEST);
+    }
+
+    if (data->wakeup_bytes > 1)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_WAKEUP,
+                             data->wakeup_bytes,
+                             data->wakeup_latency);
+    }
+
+    if (data->flush_arg != NULL)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_FLUSH,
+                             data->flush_arg);
+    }
+
+    if (data->outstanding_reads != DEFAULT_OUTSTANDING_READS)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_OUTSTANDING_READS,
+                             data->outstanding_reads);
+    }
+
+    if (data->stats_interval != 0)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_STATS,
+                             data->stats_interval);
+    }
+
+    if (data->rotate_arg != NULL)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_RING_BUFFER,
+                             data->rotate_arg);
+    }
+
+    if (data->filter_program_path != NULL)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_FILTER_PROGRAM,
+                             data->filter_program_path);
+    }
 #undef WORKER_CMD_LINE_FORMATTER_PIPE
 #undef WORKER_CMD_LINE_FORMATTER
 
+#undef WORKER_CMD_LINE_FORMATTER_TRIGGER
+#undef WORKER_CMD_LINE_FORMATTER_SNAPLEN_TABLE
+#undef WORKER_CMD_LINE_FORMATTER_TRANSFER_TYPES
+#undef WORKER_CMD_LINE_FORMATTER_ENDPOINTS
+#undef WORKER_CMD_LINE_FORMATTER_FILTER_PROGRAM
+#undef WORKER_CMD_LINE_FORMATTER_RING_BUFFER
+#undef WORKER_CMD_LINE_FORMATTER_STATS
+#undef WORKER_CMD_LINE_FORMATTER_OUTSTANDING_READS
+#undef WORKER_CMD_LINE_FORMATTER_FLUSH
+#undef WORKER_CMD_LINE_FORMATTER_WAKEUP
+#undef WORKER_CMD_LINE_FORMATTER_OVERWRITE_OLDEST
+#undef WORKER_CMD_LINE_FORMATTER_COMPLETION_ONLY
+#undef WORKER_CMD_LINE_FORMATTER_PCAPNG
+#undef WORKER_CMD_LINE_FORMATTER_ZERO_COPY
+#undef WORKER_CMD_LINE_FORMATTER_PER_CPU_BUFFERS
 #undef WORKER_CMD_LINE_FORMATTER_INJECT_DESCRIPTORS
 #undef WORKER_CMD_LINE_FORMATTER_CAPTURE_NEW
 #undef WORKER_CMD_LINE_FORMATTER_CAPTURE_ALL
@@ -847,6 +1024,13 @@ static void start_capture(struct thread_data *data)
         return;
     }
 
+    if (rotate_policy_enabled(&data->rotate.policy) &&
+        (strncmp("-", data->filename, 2) == 0))
+    {
+        fprintf(stderr, "--ring-buffer requires output file name.\n");
+        return;
+    }
+
     data->exit_event = CreateEvent(NULL, /* Handle cannot be inherited */
                                    TRUE, /* Manual Reset */
                                    FALSE, /* Default to not signalled */
@@ -861,6 +1045,17 @@ static void start_capture(struct thread_data *data)
         {
             data->write_handle = GetStdHandle(STD_OUTPUT_HANDLE);
         }
+        else if (rotate_policy_enabled(&data->rotate.policy))
+        {
+            struct rotate_policy policy = data->rotate.policy;
+
+            data->write_handle = INVALID_HANDLE_VALUE;
+            if (rotate_init(&data->rotate, &policy, data->filename,
+                            (data->capture_flags & USBPCAP_CAPTURE_FLAG_PCAPNG) ? TRUE : FALSE))
+            {
+                data->write_handle = writer_open_rotated(&data->rotate);
+            }
+        }
         else
         {
             data->write_handle = CreateFileA(data->filename,
@@ -872,21 +1067,37 @@ static void start_capture(struct thread_data *data)
                                              NULL);
         }
 
-        if (data->inject_descriptors)
+        if (strchr(data->device, ',') != NULL)
         {
-            data->descriptors.descriptors = descriptors_generate_pcap(data->device, &data->descriptors.descriptors_len,
-                                                                      &data->filter);
-            data->descriptors.buf_written = 0;
+            /* Multiple Root Hubs. merge_thread() opens every hub and
+             * injects the descriptors on its own.
+             */
+            thread = CreateThread(NULL, /* default security attributes */
+                                  0,    /* use default stack size */
+                                  merge_thread,
+                                  data,
+                                  0,    /* use default creation flag */
+                                  &thread_id);
         }
+        else
+        {
+            if (data->inject_descriptors)
+            {
+                data->descriptors.descriptors = descriptors_generate_pcap(data->device, &data->descriptors.descriptors_len,
+                                                                          &data->filter,
+                                                                          (data->capture_flags & USBPCAP_CAPTURE_FLAG_PCAPNG) ? TRUE : FALSE);
+                data->descriptors.buf_written = 0;
+            }
 
-        data->read_handle = create_filter_read_handle(data);
+            data->read_handle = create_filter_read_handle(data);
 
-        thread = CreateThread(NULL, /* default security attributes */
-                              0,    /* use default stack size */
-                              read_thread,
-                              data,
-                              0,    /* use default creation flag */
-                              &thread_id);
+            thread = CreateThread(NULL, /* default security attributes */
+                                  0,    /* use default stack size */
+                                  read_thread,
+                                  data,
+                                  0,    /* use default creation flag */
+                                  &thread_id);
+        }
 
         if (thread == NULL)
         {
@@ -1113,6 +1324,8 @@ static void start_capture(struct thread_data *data)
     {
         descriptors_free_pcap(data->descriptors.descriptors);
     }
+
+    rotate_free(&data->rotate);
 }
 
 static void print_extcap_version(void)
@@ -1331,10 +1544,27 @@ static void print_help(void)
            "    Prints this help.\n"
            "  -d <device>, --device <device>\n"
            "    USBPcap control device to open. Example: -d \\\\.\\USBPcap1.\n"
+           "    Comma separated list of devices captures from all of them into\n"
+           "    single time-ordered output.\n"
+           "  --all-roothubs\n"
+           "    Captures from all USBPcap control devices into single output.\n"
            "  -o <file>, --output <file>\n"
            "    Output .pcap file name.\n"
            "  -s <len>, --snaplen <len>\n"
            "    Sets snapshot length.\n"
+           "  --snaplen-table <list>\n"
+           "    Sets snapshot length per transfer type and endpoint, limited by\n"
+           "    --snaplen. List is comma separated list of <type>:<len> and\n"
+           "    <address>:<endpoint>:<len> values, where type is isochronous,\n"
+           "    interrupt, control or bulk. Lengths include USBPcap header.\n"
+           "    Example --snaplen-table bulk:64,5:0x81:512.\n"
+           "  --trigger <condition>[,device=<address>][,endpoint=<address>][,post=<count>]\n"
+           "    Keeps only the newest packets in capture buffer until condition\n"
+           "    matches, then captures count more packets and exits. Condition is\n"
+           "    stall, status:<USBD_STATUS>, setup:<hex> or payload:<offset>:<hex>,\n"
+           "    where hex bytes can be ?? to match any byte. Example\n"
+           "    --trigger setup:0009,device=5,post=100. Packets before the trigger\n"
+           "    are limited by --bufferlen.\n"
            "  -b <len>, --bufferlen <len>\n"
            "    Sets internal capture buffer length. Valid range <4096,134217728>.\n"
            "  -A, --capture-from-all-devices\n"
@@ -1342,17 +1572,148 @@ static void print_help(void)
            "  --devices <list>\n"
            "    Captures data only from devices with addresses present in list.\n"
            "    List is comma separated list of values. Example --devices 1,2,3.\n"
+           "  --endpoints <list>\n"
+           "    Captures only listed endpoints of listed devices. Other devices\n"
+           "    are captured from all endpoints. List is comma separated list of\n"
+           "    <address>:<endpoint> values, where endpoint includes direction bit.\n"
+           "    Example --endpoints 5:0x00,5:0x80,5:0x02 captures only control\n"
+           "    transfers and bulk OUT endpoint 2 of device 5.\n"
+           "  --transfer-types <list>\n"
+           "    Captures only given transfer types. List is comma separated list\n"
+           "    of isochronous, interrupt, control and bulk.\n"
            "  --inject-descriptors\n"
            "    Inject already connected devices descriptors into capture data.\n"
+           "  --per-cpu-buffers\n"
+           "    Every processor stores packets in its own part of the internal\n"
+           "    capture buffer. Reduces contention on busy Root Hubs.\n"
+           "  --zero-copy\n"
+           "    Maps internal capture buffer into USBPcapCMD and writes the data\n"
+           "    directly from it. Cannot be combined with --per-cpu-buffers.\n"
+           "  --pcapng\n"
+           "    Writes output in pcapng format with 100 ns timestamp resolution.\n"
+           "    Capture statistics are stored at the end of the file.\n"
+           "  --completion-only\n"
+           "    Captures bulk, interrupt and isochronous transfers only when they\n"
+           "    complete. Single packet holds data in both directions and the\n"
+           "    submit timestamp.\n"
+           "  --overwrite-oldest\n"
+           "    When internal capture buffer is full, removes the oldest packets\n"
+           "    instead of dropping the new ones. Cannot be combined with\n"
+           "    --per-cpu-buffers or --zero-copy.\n"
+           "  --wakeup-bytes <len>\n"
+           "    Driver delays read completion until at least len bytes are\n"
+           "    captured. Reduces number of writes on slow traffic. Valid range\n"
+           "    <1,bufferlen>.\n"
+           "  --wakeup-latency <us>\n"
+           "    Maximum time in microseconds the read completion is delayed by\n"
+           "    --wakeup-bytes. Default 10000, valid range <1,10000000>.\n"
+           "  --flush-interval <never|exit|<N>ms|<N>b>\n"
+           "    Controls when output file is flushed to disk: never, when capture\n"
+           "    ends (default), N milliseconds after write or every N bytes.\n"
+           "  --outstanding-reads <n>\n"
+           "    Number of reads kept pending while previously read data is being\n"
+           "    written. Every read uses bufferlen bytes. Default 4, valid range\n"
+           "    <1,16>.\n"
+           "  --ring-buffer filesize:<KiB>,duration:<s>,packets:<n>,files:<n>\n"
+           "    Writes output to multiple files, each with its own header and\n"
+           "    injected descriptors. Switches to next file when any of the given\n"
+           "    limits is reached and keeps only last files:<n> files. Files are\n"
+           "    named <output>_<index>_<YYYYMMDDhhmmss>.<ext>.\n"
+           "  --filter-program <file>\n"
+           "    Captures only packets accepted by the filter program. The program\n"
+           "    is evaluated by the driver on USBPcap packet header and data\n"
+           "    (multi-byte values are little endian) and returns the number of\n"
+           "    bytes to capture, 0 drops the packet. File format is the same as\n"
+           "    tcpdump -ddd output: instruction count followed by \"code jt jf k\"\n"
+           "    lines.\n"
+           "  --stats <seconds>\n"
+           "    Prints capture statistics (captured and dropped packets, buffer\n"
+           "    usage) to stderr every given number of seconds and when capture ends.\n"
+           "  --latency-report <seconds>\n"
+           "    Does not capture. Measures the time between URB submission and\n"
+           "    completion for given number of seconds (0 until Ctrl+C) and prints\n"
+           "    50th, 90th and 99th percentile and maximum for every endpoint of\n"
+           "    selected devices. Values are upper bounds of power of two\n"
+           "    microsecond buckets. Accepts -A, --devices, --endpoints and\n"
+           "    --transfer-types. Must be run as administrator.\n"
+           "  --top <seconds>\n"
+           "    Does not capture. Counts completed URBs, bytes, errors and stalls\n"
+           "    per endpoint of selected devices and redraws a table with rates\n"
+           "    every given number of seconds until Ctrl+C. Failed URBs are also\n"
+           "    listed by USBD_STATUS. Accepts the same device selection options\n"
+           "    as --latency-report.\n"
+           "  --csv\n"
+           "    Prints --top output as CSV lines instead of the table.\n"
            "  -I,  --init-non-standard-hwids\n"
            "    Initializes NonStandardHWIDs registry key used by USBPcapDriver.\n"
            "    This registry key is needed for USB 3.0 capture.\n");
 }
 
+/*
+ * Returns comma separated list of all USBPcap control devices.
+ * Returns NULL if there is no device available.
+ */
+static char *get_all_roothubs_device_list(void)
+{
+    char *list = NULL;
+    size_t len = 0;
+    int i;
+
+    filters_initialize();
+    for (i = 0; usbpcapFilters[i] != NULL; i++)
+    {
+        len += strlen(usbpcapFilters[i]->device) + 1;
+    }
+
+    if (len > 0)
+    {
+        list = (char *)malloc(len);
+    }
+
+    if (list != NULL)
+    {
+        size_t offset = 0;
+
+        for (i = 0; usbpcapFilters[i] != NULL; i++)
+        {
+            size_t device_len = strlen(usbpcapFilters[i]->device);
+
+            memcpy(&list[offset], usbpcapFilters[i]->device, device_len);
+            offset += device_len;
+            list[offset++] = ',';
+        }
+        /* Replace trailing comma */
+        list[offset - 1] = '\0';
+    }
+
+    filters_free();
+    return list;
+}
+
 /* Commandline arguments without short option */
 #define ARG_DEVICES                    900
 #define ARG_CAPTURE_FROM_NEW_DEVICES   901
 #define ARG_INJECT_DESCRIPTORS         902
+#define ARG_PER_CPU_BUFFERS            903
+#define ARG_ZERO_COPY                  904
+#define ARG_WAKEUP_BYTES               905
+#define ARG_WAKEUP_LATENCY             906
+#define ARG_FLUSH_INTERVAL             907
+#define ARG_OUTSTANDING_READS          908
+#define ARG_STATS                      909
+#define ARG_PCAPNG                     910
+#define ARG_ALL_ROOTHUBS               911
+#define ARG_RING_BUFFER                912
+#define ARG_FILTER_PROGRAM             913
+#define ARG_ENDPOINTS                  914
+#define ARG_TRANSFER_TYPES             915
+#define ARG_SNAPLEN_TABLE              916
+#define ARG_COMPLETION_ONLY            917
+#define ARG_LATENCY_REPORT             918
+#define ARG_TOP                        919
+#define ARG_CSV                        920
+#define ARG_TRIGGER                    921
+#define ARG_OVERWRITE_OLDEST           922
 #define ARG_EXTCAP_VERSION            1000
 #define ARG_EXTCAP_INTERFACES         1001
 #define ARG_EXTCAP_INTERFACE          1002
@@ -1369,19 +1730,44 @@ int __cdecl main(int argc, CHAR **argv)
 {
     int ret = -1;
     struct thread_data data;
+    BOOL all_roothubs = FALSE;
+    BOOL latency_mode = FALSE;
+    UINT32 latency_seconds = 0;
+    UINT32 top_interval = 0;
+    BOOL top_csv = FALSE;
     static struct option long_options[] =
     {
         {"help", no_argument, 0, 'h'},
         {"device", required_argument, 0, 'd'},
         {"output", required_argument, 0, 'o'},
         {"snaplen", required_argument, 0, 's'},
+        {"snaplen-table", required_argument, 0, ARG_SNAPLEN_TABLE},
+        {"trigger", required_argument, 0, ARG_TRIGGER},
         {"bufferlen", required_argument, 0, 'b'},
         {"init-non-standard-hwids", no_argument, 0, 'I'},
         /* Capture options. */
         {"devices", required_argument, 0, ARG_DEVICES},
+        {"endpoints", required_argument, 0, ARG_ENDPOINTS},
+        {"transfer-types", required_argument, 0, ARG_TRANSFER_TYPES},
         {"capture-from-all-devices", no_argument, 0, 'A'},
         {"capture-from-new-devices", no_argument, 0, ARG_CAPTURE_FROM_NEW_DEVICES},
         {"inject-descriptors", no_argument, 0, ARG_INJECT_DESCRIPTORS},
+        {"per-cpu-buffers", no_argument, 0, ARG_PER_CPU_BUFFERS},
+        {"zero-copy", no_argument, 0, ARG_ZERO_COPY},
+        {"pcapng", no_argument, 0, ARG_PCAPNG},
+        {"completion-only", no_argument, 0, ARG_COMPLETION_ONLY},
+        {"overwrite-oldest", no_argument, 0, ARG_OVERWRITE_OLDEST},
+        {"all-roothubs", no_argument, 0, ARG_ALL_ROOTHUBS},
+        {"ring-buffer", required_argument, 0, ARG_RING_BUFFER},
+        {"filter-program", required_argument, 0, ARG_FILTER_PROGRAM},
+        {"wakeup-bytes", required_argument, 0, ARG_WAKEUP_BYTES},
+        {"wakeup-latency", required_argument, 0, ARG_WAKEUP_LATENCY},
+        {"flush-interval", required_argument, 0, ARG_FLUSH_INTERVAL},
+        {"outstanding-reads", required_argument, 0, ARG_OUTSTANDING_READS},
+        {"stats", required_argument, 0, ARG_STATS},
+        {"latency-report", required_argument, 0, ARG_LATENCY_REPORT},
+        {"top", required_argument, 0, ARG_TOP},
+        {"csv", no_argument, 0, ARG_CSV},
         /* Extcap interface. Please note that there are no short
          * options for these and the numbers are just gopt keys.
          */
@@ -1402,11 +1788,31 @@ int __cdecl main(int argc, CHAR **argv)
     data.filename = NULL;
     data.device = NULL;
     data.address_list = NULL;
+    data.endpoint_list = NULL;
+    data.transfer_types = NULL;
     data.capture_all = FALSE;
     data.capture_new = FALSE;
     data.inject_descriptors = FALSE;
     data.snaplen = DEFAULT_SNAPSHOT_LENGTH;
+    data.snaplen_table = NULL;
+    data.trigger = NULL;
     data.bufferlen = DEFAULT_INTERNAL_KERNEL_BUFFER_SIZE;
+    data.outstanding_reads = DEFAULT_OUTSTANDING_READS;
+    data.capture_flags = 0;
+    data.wakeup_bytes = 0;
+    data.wakeup_latency = DEFAULT_WAKEUP_LATENCY;
+    data.stats_interval = 0;
+    data.flush.type = FLUSH_POLICY_ON_EXIT;
+    data.flush.interval = 0;
+    data.flush_arg = NULL;
+    memset(&data.rotate, 0, sizeof(data.rotate));
+    data.rotate_arg = NULL;
+    data.filter_program = NULL;
+    data.filter_program_size = 0;
+    data.filter_program_path = NULL;
+    data.ring_header = NULL;
+    data.ring_consumer = NULL;
+    data.ring_event = NULL;
     data.job_handle = INVALID_HANDLE_VALUE;
     data.worker_process_thread = INVALID_HANDLE_VALUE;
     data.read_handle = INVALID_HANDLE_VALUE;
@@ -1459,6 +1865,50 @@ int __cdecl main(int argc, CHAR **argv)
             case ARG_DEVICES:
                 data.address_list = optarg;
                 break;
+            case ARG_SNAPLEN_TABLE:
+            {
+                USBPCAP_IOCTL_SNAPLEN_TABLE table;
+
+                if (!USBPcapInitSnaplenTable(&table, optarg))
+                {
+                    return -1;
+                }
+                data.snaplen_table = optarg;
+                break;
+            }
+            case ARG_TRIGGER:
+            {
+                USBPCAP_IOCTL_TRIGGER trigger;
+
+                if (!USBPcapInitTrigger(&trigger, optarg))
+                {
+                    return -1;
+                }
+                data.trigger = optarg;
+                break;
+            }
+            case ARG_ENDPOINTS:
+            case ARG_TRANSFER_TYPES:
+            {
+                USBPCAP_ENDPOINT_FILTER endpoint_filter;
+
+                if (c == ARG_ENDPOINTS)
+                {
+                    data.endpoint_list = optarg;
+                }
+                else
+                {
+                    data.transfer_types = optarg;
+                }
+
+                if (!USBPcapInitEndpointFilter(&endpoint_filter,
+                                               data.endpoint_list,
+                                               data.transfer_types))
+                {
+                    return -1;
+                }
+                break;
+            }
             case 'A': /* --capture-from-all-devices */
                 data.capture_all = TRUE;
                 break;
@@ -1468,6 +1918,133 @@ int __cdecl main(int argc, CHAR **argv)
             case ARG_INJECT_DESCRIPTORS:
                 data.inject_descriptors = TRUE;
                 break;
+            case ARG_PER_CPU_BUFFERS:
+                data.capture_flags |= USBPCAP_CAPTURE_FLAG_PER_CPU_BUFFERS;
+                break;
+            case ARG_ZERO_COPY:
+                data.capture_flags |= USBPCAP_CAPTURE_FLAG_MAPPED_BUFFER;
+                break;
+            case ARG_PCAPNG:
+                data.capture_flags |= USBPCAP_CAPTURE_FLAG_PCAPNG;
+                break;
+            case ARG_COMPLETION_ONLY:
+                data.capture_flags |= USBPCAP_CAPTURE_FLAG_COMPLETION_ONLY;
+                break;
+            case ARG_OVERWRITE_OLDEST:
+                data.capture_flags |= USBPCAP_CAPTURE_FLAG_OVERWRITE_OLDEST;
+                break;
+            case ARG_ALL_ROOTHUBS:
+                all_roothubs = TRUE;
+                break;
+            case ARG_WAKEUP_BYTES:
+            {
+                char *end;
+                unsigned long value = strtoul(optarg, &end, 10);
+
+                /* Upper limit is checked against --bufferlen later */
+                if ((end == optarg) || (*end != '\0') ||
+                    (value == 0) || (value > 134217728))
+                {
+                    fprintf(stderr, "Invalid wakeup bytes! "
+                                    "Valid range <1,bufferlen>.\n");
+                    return -1;
+                }
+                data.wakeup_bytes = (UINT32)value;
+                break;
+            }
+            case ARG_OUTSTANDING_READS:
+                data.outstanding_reads = atol(optarg);
+                if (data.outstanding_reads < 1 || data.outstanding_reads > MAX_OUTSTANDING_READS)
+                {
+                    fprintf(stderr, "Invalid number of outstanding reads! "
+                                    "Valid range <1,16>.\n");
+                    return -1;
+                }
+                break;
+            case ARG_STATS:
+                data.stats_interval = atol(optarg);
+                if (data.stats_interval < 1 || data.stats_interval > 86400)
+                {
+                    fprintf(stderr, "Invalid statistics interval! "
+                                    "Valid range <1,86400>.\n");
+                    return -1;
+                }
+                break;
+            case ARG_LATENCY_REPORT:
+                latency_mode = TRUE;
+                latency_seconds = atol(optarg);
+                if (latency_seconds > 86400)
+                {
+                    fprintf(stderr, "Invalid latency report duration! "
+                                    "Valid range <0,86400>.\n");
+                    return -1;
+                }
+                break;
+            case ARG_TOP:
+                top_interval = atol(optarg);
+                if (top_interval < 1 || top_interval > 86400)
+                {
+                    fprintf(stderr, "Invalid top interval! "
+                                    "Valid range <1,86400>.\n");
+                    return -1;
+                }
+                break;
+            case ARG_CSV:
+                top_csv = TRUE;
+                break;
+            case ARG_FLUSH_INTERVAL:
+                if (!flush_policy_parse(optarg, &data.flush))
+                {
+                    fprintf(stderr, "Invalid flush interval!\n");
+                    return -1;
+                }
+                data.flush_arg = optarg;
+                break;
+            case ARG_RING_BUFFER:
+                if (!rotate_policy_parse(optarg, &data.rotate.policy))
+                {
+                    fprintf(stderr, "Invalid ring buffer specification!\n");
+                    return -1;
+                }
+                data.rotate_arg = optarg;
+                break;
+            case ARG_FILTER_PROGRAM:
+            {
+                DWORD length;
+
+                if (data.filter_program != NULL)
+                {
+                    fprintf(stderr, "Only one filter program can be used.\n");
+                    return -1;
+                }
+
+                /* Worker process can have different working directory */
+                length = GetFullPathNameA(optarg, 0, NULL, NULL);
+                data.filter_program_path = (length == 0) ? NULL : (char *)malloc(length);
+                if ((data.filter_program_path == NULL) ||
+                    (GetFullPathNameA(optarg, length, data.filter_program_path, NULL) == 0))
+                {
+                    fprintf(stderr, "Invalid filter program path!\n");
+                    return -1;
+                }
+
+                data.filter_program = filter_program_load(data.filter_program_path,
+                                                          &data.filter_program_size);
+                if (data.filter_program == NULL)
+                {
+                    return -1;
+                }
+                break;
+            }
+            case ARG_WAKEUP_LATENCY:
+                data.wakeup_latency = atol(optarg);
+                if (data.wakeup_latency == 0 || data.wakeup_latency > 10000000)
+                {
+                    fprintf(stderr, "Invalid wakeup latency! "
+                                    "Valid range <1,10000000>.\n");
+                    return -1;
+                }
+                break;
             case ARG_EXTCAP_VERSION:
                 do_extcap_version = 1;
                 wireshark_version = optarg;
@@ -1491,15 +2068,117 @@ int __cdecl main(int argc, CHAR **argv)
         }
     }
 
+    if ((data.capture_flags & USBPCAP_CAPTURE_FLAG_PER_CPU_BUFFERS) &&
+        (data.capture_flags & USBPCAP_CAPTURE_FLAG_MAPPED_BUFFER))
+    {
+        fprintf(stderr, "--zero-copy cannot be combined with --per-cpu-buffers.\n");
+        return -1;
+    }
+
+    if ((data.capture_flags & USBPCAP_CAPTURE_FLAG_OVERWRITE_OLDEST) &&
+        (data.capture_flags & (USBPCAP_CAPTURE_FLAG_PER_CPU_BUFFERS |
+                               USBPCAP_CAPTURE_FLAG_MAPPED_BUFFER)))
+    {
+        fprintf(stderr, "--overwrite-oldest cannot be combined with --per-cpu-buffers or --zero-copy.\n");
+        return -1;
+    }
+
+    if (all_roothubs)
+    {
+        if (data.device != NULL)
+        {
+            free(data.device);
+        }
+        data.device = get_all_roothubs_device_list();
+        if (data.device == NULL)
+        {
+            fprintf(stderr, "No filter control devices are available.\n");
+            return -1;
+        }
+    }
+
+    if ((data.device != NULL) && (strchr(data.device, ',') != NULL) &&
+        (data.capture_flags & USBPCAP_CAPTURE_FLAG_MAPPED_BUFFER))
+    {
+        fprintf(stderr, "--zero-copy cannot be used with multiple Root Hubs.\n");
+        return -1;
+    }
+
+    if ((data.trigger != NULL) &&
+        (data.capture_flags & (USBPCAP_CAPTURE_FLAG_PER_CPU_BUFFERS |
+                               USBPCAP_CAPTURE_FLAG_MAPPED_BUFFER)))
+    {
+        fprintf(stderr, "--trigger cannot be combined with --per-cpu-buffers or --zero-copy.\n");
+        return -1;
+    }
+
+    if ((data.device != NULL) && (strchr(data.device, ',') != NULL) &&
+        (data.trigger != NULL))
+    {
+        fprintf(stderr, "--trigger cannot be used with multiple Root Hubs.\n");
+        return -1;
+    }
+
+    if (data.wakeup_bytes > data.bufferlen)
+    {
+        fprintf(stderr, "Invalid wakeup bytes! Valid range <1,%u>.\n",
+                data.bufferlen);
+        return -1;
+    }
+
     if (data.snaplen > (data.bufferlen - sizeof(pcaprec_hdr_t)))
     {
         fprintf(stderr, "Packets larger than %u bytes won't be captured due to too small buffer.\n",
                 data.bufferlen - sizeof(pcaprec_hdr_t));
     }
 
-    /* Handle extcap options separately from standard USBPcapCMD options. */
-    if (run_as_extcap || do_extcap_version || do_extcap_interfaces || do_extcap_dlts || do_extcap_config || do_extcap_capture)
+    if (top_csv && (top_interval == 0))
+    {
+        fprintf(stderr, "--csv can be used only with --top.\n");
+        return -1;
+    }
+
+    if (latency_mode && (top_interval != 0))
     {
+        fprintf(stderr, "--latency-report cannot be combined with --top.\n");
+        return -1;
+    }
+
+    if (latency_mode || (top_interval != 0))
+    {
+        /* URBs are only counted by driver, nothing is captured */
+        if (data.device == NULL)
+        {
+            fprintf(stderr, "--latency-report and --top require -d or --all-roothubs.\n");
+            ret = -1;
+        }
+        else if (IsElevated() == FALSE)
+        {
+            fprintf(stderr, "--latency-report and --top must be run as administrator.\n");
+            ret = -1;
+        }
+        else if ((data.capture_all == FALSE) && (data.address_list == NULL))
+        {
+            fprintf(stderr, "Add command-line option -A to measure all devices.\n");
+            ret = -1;
+        }
+        else if (FALSE == USBPcapInitAddressFilter(&data.filter, data.address_list, data.capture_all))
+        {
+            fprintf(stderr, "USBPcapInitAddressFilter failed!\n");
+            ret = -1;
+        }
+        else if (latency_mode)
+        {
+            ret = latency_report(&data, latency_seconds);
+        }
+        else
+        {
+            ret = top_report(&data, top_interval, top_csv);
+        }
+    }
+    else if (run_as_extcap || do_extcap_version || do_extcap_interfaces || do_extcap_dlts || do_extcap_config || do_extcap_capture)
+    {
+        /* Handle extcap options separately from standard USBPcapCMD options. */
         ret = cmd_extcap(&data);
     }
     else
@@ -1539,6 +2218,14 @@ int __cdecl main(int argc, CHAR **argv)
     {
         free(data.filename);
     }
+    if (data.filter_program != NULL)
+    {
+        free(data.filter_program);
+    }
+    if (data.filter_program_path != NULL)
+    {
+        free(data.filter_program_path);
+    }
     if (data.worker_process_thread != INVALID_HANDLE_VALUE)
     {
         CloseHandle(data.worker_process_thread);
@@ -0,0 +1,205 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "counters.h"
+#include "iocontrol.h"
+
+/* Set by Ctrl+C to stop counting */
+static HANDLE counters_stop_event = NULL;
+
+static BOOL WINAPI counters_ctrl_handler(DWORD type)
+{
+    if ((type == CTRL_C_EVENT) || (type == CTRL_BREAK_EVENT))
+    {
+        SetEvent(counters_stop_event);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+/*
+ * Opens the filter control device, selects counted devices and issues
+ * start_ioctl. Returns INVALID_HANDLE_VALUE on failure.
+ */
+static HANDLE start_counting(struct thread_data *data,
+                             const char *device,
+                             DWORD start_ioctl)
+{
+    HANDLE filter_handle;
+    DWORD bytes_ret;
+    BOOL success;
+
+    filter_handle = CreateFileA(device,
+                                GENERIC_READ|GENERIC_WRITE,
+                                0,
+                                0,
+                                OPEN_EXISTING,
+                                0,
+                                0);
+    if (filter_handle == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "Couldn't open device %s - %d\n", device, GetLastError());
+        return INVALID_HANDLE_VALUE;
+    }
+
+    if ((data->endpoint_list != NULL) || (data->transfer_types != NULL))
+    {
+        USBPCAP_ENDPOINT_FILTER endpoint_filter;
+
+        memcpy(&endpoint_filter.address, &data->filter, sizeof(USBPCAP_ADDRESS_FILTER));
+        if (!USBPcapInitEndpointFilter(&endpoint_filter,
+                                       data->endpoint_list,
+                                       data->transfer_types))
+        {
+            CloseHandle(filter_handle);
+            return INVALID_HANDLE_VALUE;
+        }
+
+        success = DeviceIoControl(filter_handle,
+                                  IOCTL_USBPCAP_START_FILTERING,
+                                  (char*)&endpoint_filter,
+                                  sizeof(USBPCAP_ENDPOINT_FILTER),
+                                  NULL,
+                                  0,
+                                  &bytes_ret,
+                                  0);
+    }
+    else
+    {
+        success = DeviceIoControl(filter_handle,
+                                  IOCTL_USBPCAP_START_FILTERING,
+                                  (char*)&data->filter,
+                                  sizeof(USBPCAP_ADDRESS_FILTER),
+                                  NULL,
+                                  0,
+                                  &bytes_ret,
+                                  0);
+    }
+
+    if (success)
+    {
+        success = DeviceIoControl(filter_handle,
+                                  start_ioctl,
+                                  NULL,
+                                  0,
+                                  NULL,
+                                  0,
+                                  &bytes_ret,
+                                  0);
+    }
+
+    if (!success)
+    {
+        fprintf(stderr, "Failed to start counting on %s (%d)\n",
+                device, GetLastError());
+        CloseHandle(filter_handle);
+        return INVALID_HANDLE_VALUE;
+    }
+
+    return filter_handle;
+}
+
+BOOL counter_hubs_open(struct counter_hubs *hubs,
+                       struct thread_data *data,
+                       DWORD start_ioctl)
+{
+    const char *device;
+
+    hubs->count = 0;
+
+    counters_stop_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (counters_stop_event == NULL)
+    {
+        return FALSE;
+    }
+
+    for (device = data->device; device != NULL; )
+    {
+        const char *next = strchr(device, ',');
+        size_t len = (next == NULL) ? strlen(device) : (size_t)(next - device);
+        char *name;
+
+        if (hubs->count == MAXIMUM_WAIT_OBJECTS)
+        {
+            fprintf(stderr, "Too many Root Hubs (%d)\n", hubs->count);
+            counter_hubs_close(hubs);
+            return FALSE;
+        }
+
+        name = (char *)malloc(len + 1);
+        if (name == NULL)
+        {
+            counter_hubs_close(hubs);
+            return FALSE;
+        }
+        memcpy(name, device, len);
+        name[len] = '\0';
+
+        hubs->devices[hubs->count] = name;
+        hubs->handles[hubs->count] = start_counting(data, name, start_ioctl);
+        hubs->count++;
+        if (hubs->handles[hubs->count - 1] == INVALID_HANDLE_VALUE)
+        {
+            counter_hubs_close(hubs);
+            return FALSE;
+        }
+
+        device = (next == NULL) ? NULL : next + 1;
+    }
+
+    SetConsoleCtrlHandler(counters_ctrl_handler, TRUE);
+    return TRUE;
+}
+
+void counter_hubs_close(struct counter_hubs *hubs)
+{
+    int i;
+
+    SetConsoleCtrlHandler(counters_ctrl_handler, FALSE);
+
+    /* Counting stops when the handle is closed */
+    for (i = 0; i < hubs->count; i++)
+    {
+        if (hubs->handles[i] != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(hubs->handles[i]);
+        }
+        free(hubs->devices[i]);
+    }
+    hubs->count = 0;
+
+    if (counters_stop_event != NULL)
+    {
+        CloseHandle(counters_stop_event);
+        counters_stop_event = NULL;
+    }
+}
+
+BOOL counter_hubs_wait(DWORD milliseconds)
+{
+    return (WaitForSingleObject(counters_stop_event, milliseconds) == WAIT_TIMEOUT);
+}
+
+const char *counter_transfer_name(UINT8 transfer)
+{
+    switch (transfer)
+    {
+        case USBPCAP_TRANSFER_ISOCHRONOUS:
+            return "isochronous";
+        case USBPCAP_TRANSFER_INTERRUPT:
+            return "interrupt";
+        case USBPCAP_TRANSFER_CONTROL:
+            return "control";
+        case USBPCAP_TRANSFER_BULK:
+            return "bulk";
+        default:
+            return "unknown";
+    }
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef USBPCAP_CMD_COUNTERS_H
+#define USBPCAP_CMD_COUNTERS_H
+
+#include <windows.h>
+#include "thread.h"
+
+/*
+ * Root Hubs that count URBs in the driver without capturing any packets
+ * (--latency-report and --top).
+ */
+struct counter_hubs
+{
+    int count;
+    char *devices[MAXIMUM_WAIT_OBJECTS];
+    HANDLE handles[MAXIMUM_WAIT_OBJECTS];
+};
+
+/*
+ * Opens every Root Hub in data->device, selects the devices set in data
+ * and issues start_ioctl. Installs Ctrl+C handler that ends
+ * counter_hubs_wait(). On failure everything is closed.
+ */
+BOOL counter_hubs_open(struct counter_hubs *hubs,
+                       struct thread_data *data,
+                       DWORD start_ioctl);
+void counter_hubs_close(struct counter_hubs *hubs);
+
+/*
+ * Waits given number of milliseconds. Returns FALSE if Ctrl+C was pressed.
+ */
+BOOL counter_hubs_wait(DWORD milliseconds);
+
+/*
+ * Returns name of USBPCAP_TRANSFER_XXX.
+ */
+const char *counter_transfer_name(UINT8 transfer);
+
+#endif /* USBPCAP_CMD_COUNTERS_H */
@@ -13,6 +13,7 @@
 #include "enum.h"
 #include "iocontrol.h"
 #include "USBPcap.h"
+#include "pcapng.h"
 
 #define URB_SELECT_CONFIGURATION       0x0000
 #define URB_CONTROL_TRANSFER           0x0008
@@ -317,7 +318,7 @@ descriptor_callback(HANDLE hub, ULONG port, USHORT deviceAddress,
     free(request);
 }
 
-void *generate_pcap_packets(list_entry *head, int *out_len)
+void *generate_pcap_packets(list_entry *head, int *out_len, BOOL pcapng)
 {
     int total_length = 0;
     list_entry *e;
@@ -326,8 +327,15 @@ void *generate_pcap_packets(list_entry *head, int *out_len)
 
     for (e = head; e; e = e->next)
     {
-        total_length += sizeof(pcaprec_hdr_t);
-        total_length += e->length;
+        if (pcapng)
+        {
+            total_length += pcapng_epb_length(e->length);
+        }
+        else
+        {
+            total_length += sizeof(pcaprec_hdr_t);
+            total_length += e->length;
+        }
     }
 
     *out_len = total_length;
@@ -343,6 +351,14 @@ void *generate_pcap_packets(list_entry *head, int *out_len)
         timestamp.LowPart = ts.dwLowDateTime;
         timestamp.HighPart = ts.dwHighDateTime;
 
+        if (pcapng)
+        {
+            offset += pcapng_write_epb(&pcap[offset], 0,
+                                       pcapng_timestamp_from_filetime(timestamp.QuadPart),
+                                       e->data, e->length, e->length);
+            continue;
+        }
+
         hdr.ts_sec = (UINT32)(timestamp.QuadPart/10000000-11644473600);
         hdr.ts_usec = (UINT32)((timestamp.QuadPart%10000000)/10);
         hdr.incl_len = e->length;
@@ -358,7 +374,7 @@ void *generate_pcap_packets(list_entry *head, int *out_len)
     return pcap;
 }
 
-void *descriptors_generate_pcap(const char *filter, int *pcap_length, PUSBPCAP_ADDRESS_FILTER addresses)
+void *descriptors_generate_pcap(const char *filter, int *pcap_length, PUSBPCAP_ADDRESS_FILTER addresses, BOOL pcapng)
 {
     void *pcap_packets;
     int pcap_packets_length;
@@ -384,7 +400,7 @@ void *descriptors_generate_pcap(const char *filter, int *pcap_length, PUSBPCAP_A
     ctx.tail = NULL;
     enumerate_all_connected_devices(filter, descriptor_callback, &ctx);
 
-    pcap_packets = generate_pcap_packets(ctx.head, &pcap_packets_length);
+    pcap_packets = generate_pcap_packets(ctx.head, &pcap_packets_length, pcapng);
     free_list(ctx.head);
     *pcap_length = pcap_packets_length;
     return pcap_packets;
@@ -9,7 +9,7 @@
 
 #include "iocontrol.h"
 
-void *descriptors_generate_pcap(const char *filter, int *pcap_length, PUSBPCAP_ADDRESS_FILTER addresses);
+void *descriptors_generate_pcap(const char *filter, int *pcap_length, PUSBPCAP_ADDRESS_FILTER addresses, BOOL pcapng);
 void descriptors_free_pcap(void *pcap);
 
 #endif /* USBPCAP_DESCRIPTORS_H */
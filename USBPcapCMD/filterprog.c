@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "filterprog.h"
+
+/*
+ * Parses up to count whitespace separated numbers (decimal or 0x
+ * prefixed hexadecimal). Returns number of values parsed, -1 if line
+ * contains anything else.
+ */
+static int parse_numbers(char *line, unsigned long *values, int count)
+{
+    int parsed = 0;
+    char *end;
+
+    for (;;)
+    {
+        while ((*line == ' ') || (*line == '\t') ||
+               (*line == '\r') || (*line == '\n'))
+        {
+            line++;
+        }
+
+        if (*line == '\0')
+        {
+            return parsed;
+        }
+
+        if (parsed == count)
+        {
+            return -1;
+        }
+
+        values[parsed] = strtoul(line, &end, 0);
+        if (end == line)
+        {
+            return -1;
+        }
+        parsed++;
+        line = end;
+    }
+}
+
+PUSBPCAP_IOCTL_FILTER_PROGRAM filter_program_load(const char *filename,
+                                                  DWORD *size)
+{
+    PUSBPCAP_IOCTL_FILTER_PROGRAM program = NULL;
+    FILE *file;
+    char line[256];
+    unsigned long values[4];
+    UINT32 count = 0;
+    UINT32 loaded = 0;
+    int line_number = 0;
+    int parsed;
+    BOOL error = FALSE;
+
+    if (fopen_s(&file, filename, "r") != 0)
+    {
+        fprintf(stderr, "Failed to open filter program %s\n", filename);
+        return NULL;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        line_number++;
+
+        parsed = parse_numbers(line, values, 4);
+        if (parsed == 0)
+        {
+            /* Empty line */
+            continue;
+        }
+
+        if (program == NULL)
+        {
+            if ((parsed != 1) || (values[0] == 0) ||
+                (values[0] > USBPCAP_FILTER_MAX_INSNS))
+            {
+                fprintf(stderr, "%s:%d: Invalid instruction count. "
+                                "Valid range <1,%d>.\n",
+                        filename, line_number, USBPCAP_FILTER_MAX_INSNS);
+                error = TRUE;
+                break;
+            }
+
+            count = (UINT32)values[0];
+            *size = FIELD_OFFSET(USBPCAP_IOCTL_FILTER_PROGRAM, insns) +
+                    count * sizeof(USBPCAP_FILTER_INSN);
+            program = (PUSBPCAP_IOCTL_FILTER_PROGRAM)malloc(*size);
+            if (program == NULL)
+            {
+                fprintf(stderr, "Failed to allocate filter program\n");
+                error = TRUE;
+                break;
+            }
+            program->count = count;
+            program->reserved = 0;
+            continue;
+        }
+
+        if ((parsed != 4) || (values[0] > 0xFFFF) ||
+            (values[1] > 0xFF) || (values[2] > 0xFF) || (loaded == count))
+        {
+            fprintf(stderr, "%s:%d: Invalid instruction.\n",
+                    filename, line_number);
+            error = TRUE;
+            break;
+        }
+
+        program->insns[loaded].code = (UINT16)values[0];
+        program->insns[loaded].jt = (UINT8)values[1];
+        program->insns[loaded].jf = (UINT8)values[2];
+        program->insns[loaded].k = (UINT32)values[3];
+        loaded++;
+    }
+
+    fclose(file);
+
+    if (!error)
+    {
+        if (program == NULL)
+        {
+            fprintf(stderr, "%s: Empty filter program.\n", filename);
+        }
+        else if (loaded != count)
+        {
+            fprintf(stderr, "%s: Expected %u instructions, found %u.\n",
+                    filename, count, loaded);
+            error = TRUE;
+        }
+    }
+
+    if (error && (program != NULL))
+    {
+        free(program);
+        program = NULL;
+    }
+
+    return program;
+}
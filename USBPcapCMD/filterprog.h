@@ -0,0 +1,25 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef USBPCAP_CMD_FILTERPROG_H
+#define USBPCAP_CMD_FILTERPROG_H
+
+#include <windows.h>
+#include "USBPcap.h"
+
+/*
+ * Loads filter program from text file in the format printed by
+ * tcpdump -ddd: instruction count on the first line followed by one
+ * "code jt jf k" line per instruction.
+ *
+ * Returns IOCTL_USBPCAP_SET_FILTER_PROGRAM input buffer (to be released
+ * with free()) and stores its length in size. Returns NULL on error.
+ * The program is verified by the driver.
+ */
+PUSBPCAP_IOCTL_FILTER_PROGRAM filter_program_load(const char *filename,
+                                                  DWORD *size);
+
+#endif /* USBPCAP_CMD_FILTERPROG_H */
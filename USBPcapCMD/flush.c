@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "flush.h"
+
+/*
+ * Parses --flush-interval argument. Accepted values:
+ *   never    - never flush explicitly
+ *   exit     - flush when capture ends
+ *   <N>ms    - flush N milliseconds after data was written
+ *   <N>b     - flush after every N bytes
+ *
+ * Returns FALSE if arg is not valid.
+ */
+BOOL flush_policy_parse(const char *arg, struct flush_policy *policy)
+{
+    char *end;
+    unsigned long value;
+
+    if (strcmp(arg, "never") == 0)
+    {
+        policy->type = FLUSH_POLICY_NEVER;
+        policy->interval = 0;
+        return TRUE;
+    }
+
+    if (strcmp(arg, "exit") == 0)
+    {
+        policy->type = FLUSH_POLICY_ON_EXIT;
+        policy->interval = 0;
+        return TRUE;
+    }
+
+    value = strtoul(arg, &end, 10);
+    if ((end == arg) || (value == 0) || (value > MAXLONG))
+    {
+        return FALSE;
+    }
+
+    if (_stricmp(end, "ms") == 0)
+    {
+        policy->type = FLUSH_POLICY_TIME;
+    }
+    else if (_stricmp(end, "b") == 0)
+    {
+        policy->type = FLUSH_POLICY_BYTES;
+    }
+    else
+    {
+        return FALSE;
+    }
+
+    policy->interval = (UINT32)value;
+    return TRUE;
+}
+
+void flush_init(struct flush_state *state, const struct flush_policy *policy,
+                DWORD now)
+{
+    state->policy = *policy;
+    state->unflushed = 0;
+    state->last_flush = now;
+}
+
+/*
+ * Accounts written data. Returns TRUE if the caller has to flush now.
+ */
+BOOL flush_written(struct flush_state *state, DWORD bytes, DWORD now)
+{
+    state->unflushed += bytes;
+
+    switch (state->policy.type)
+    {
+        case FLUSH_POLICY_BYTES:
+            return (state->unflushed >= state->policy.interval) ? TRUE : FALSE;
+        case FLUSH_POLICY_TIME:
+            return (flush_timeout(state, now) == 0) ? TRUE : FALSE;
+        default:
+            return FALSE;
+    }
+}
+
+/*
+ * Returns number of milliseconds until the data has to be flushed or
+ * INFINITE if there is no deadline.
+ */
+DWORD flush_timeout(const struct flush_state *state, DWORD now)
+{
+    DWORD elapsed;
+
+    if ((state->policy.type != FLUSH_POLICY_TIME) ||
+        (state->unflushed == 0))
+    {
+        return INFINITE;
+    }
+
+    elapsed = now - state->last_flush;
+    if (elapsed >= state->policy.interval)
+    {
+        return 0;
+    }
+
+    return state->policy.interval - elapsed;
+}
+
+/*
+ * Returns TRUE if there is any data written since last flush.
+ */
+BOOL flush_needed(const struct flush_state *state)
+{
+    return (state->unflushed > 0) ? TRUE : FALSE;
+}
+
+/*
+ * Returns TRUE if remaining data has to be flushed when output is closed.
+ */
+BOOL flush_on_close(const struct flush_state *state)
+{
+    return (state->policy.type != FLUSH_POLICY_NEVER) ? TRUE : FALSE;
+}
+
+/*
+ * Must be called after the data was flushed (or new file was opened).
+ */
+void flush_done(struct flush_state *state, DWORD now)
+{
+    state->unflushed = 0;
+    state->last_flush = now;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef USBPCAP_CMD_FLUSH_H
+#define USBPCAP_CMD_FLUSH_H
+
+#include <windows.h>
+
+/*
+ * Output flush policy.
+ *
+ * Decides when the written data has to be flushed to disk. The caller
+ * passes the current tick count (milliseconds) and performs the flush,
+ * this module does not call any system functions.
+ */
+
+#define FLUSH_POLICY_ON_EXIT  0 /* Flush only when capture ends */
+#define FLUSH_POLICY_NEVER    1 /* Leave it up to the system */
+#define FLUSH_POLICY_BYTES    2 /* Flush once interval bytes were written */
+#define FLUSH_POLICY_TIME     3 /* Flush interval milliseconds after write */
+
+struct flush_policy
+{
+    int type;        /* FLUSH_POLICY_XXX */
+    UINT32 interval; /* Bytes or milliseconds, depending on type */
+};
+
+struct flush_state
+{
+    struct flush_policy policy;
+    UINT64 unflushed; /* Bytes written since last flush */
+    DWORD last_flush; /* Tick count at last flush */
+};
+
+BOOL flush_policy_parse(const char *arg, struct flush_policy *policy);
+
+void flush_init(struct flush_state *state, const struct flush_policy *policy,
+                DWORD now);
+BOOL flush_written(struct flush_state *state, DWORD bytes, DWORD now);
+DWORD flush_timeout(const struct flush_state *state, DWORD now);
+BOOL flush_needed(const struct flush_state *state);
+BOOL flush_on_close(const struct flush_state *state);
+void flush_done(struct flush_state *state, DWORD now);
+
+#endif /* USBPCAP_CMD_FLUSH_H */
@@ -4,6 +4,7 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -123,3 +124,410 @@ BOOLEAN USBPcapInitAddressFilter(PUSBPCAP_ADDRESS_FILTER filter, PCHAR list, BOO
     memcpy(filter, &tmp, sizeof(USBPCAP_ADDRESS_FILTER));
     return TRUE;
 }
+
+static const struct
+{
+    const char *name;
+    UCHAR transfer;
+} transfer_type_names[] =
+{
+    {"isochronous", USBPCAP_TRANSFER_ISOCHRONOUS},
+    {"interrupt", USBPCAP_TRANSFER_INTERRUPT},
+    {"control", USBPCAP_TRANSFER_CONTROL},
+    {"bulk", USBPCAP_TRANSFER_BULK},
+};
+
+/*
+ * Looks up transfer type by first len characters of name.
+ *
+ * Returns TRUE on success, FALSE if name is unknown.
+ */
+static BOOLEAN USBPcapGetTransferType(PCHAR name, size_t len, UCHAR *transfer)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(transfer_type_names) / sizeof(transfer_type_names[0]); i++)
+    {
+        if ((strlen(transfer_type_names[i].name) == len) &&
+            (strncmp(transfer_type_names[i].name, name, len) == 0))
+        {
+            *transfer = transfer_type_names[i].transfer;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/*
+ * Parses comma separated list of transfer type names.
+ *
+ * Returns TRUE on success, FALSE if list contains unknown name.
+ */
+static BOOLEAN USBPcapParseTransferTypes(PCHAR list, UINT32 *mask)
+{
+    *mask = 0;
+
+    while (*list)
+    {
+        size_t len = strcspn(list, ",");
+        UCHAR transfer;
+
+        if (USBPcapGetTransferType(list, len, &transfer) == FALSE)
+        {
+            fprintf(stderr, "Unknown transfer type: %.*s\n", (int)len, list);
+            return FALSE;
+        }
+        *mask |= USBPCAP_TRANSFER_MASK(transfer);
+
+        list += len;
+        if (*list == ',')
+        {
+            list++;
+        }
+    }
+
+    return TRUE;
+}
+
+/*
+ * Initializes endpoint filter (except address part) with given
+ * NULL-terminated, comma separated lists. endpoints is list of
+ * <address>:<endpoint> pairs, where endpoint is USB endpoint address
+ * (e.g. 0x81 for IN endpoint 1). Devices not present on the list are
+ * captured from all endpoints. transferTypes is list of transfer type
+ * names. NULL list captures everything.
+ *
+ * Returns TRUE on success, FALSE otherwise (malformed list).
+ */
+BOOLEAN USBPcapInitEndpointFilter(PUSBPCAP_ENDPOINT_FILTER filter, PCHAR endpoints, PCHAR transferTypes)
+{
+    UINT32 mask = USBPCAP_TRANSFER_MASK_ALL;
+    UINT32 listed[4];
+
+    if ((transferTypes != NULL) &&
+        (USBPcapParseTransferTypes(transferTypes, &mask) == FALSE))
+    {
+        return FALSE;
+    }
+
+    filter->transferTypes = mask;
+    memset(filter->endpoints, 0xFF, sizeof(filter->endpoints));
+    memset(listed, 0, sizeof(listed));
+
+    if (endpoints != NULL)
+    {
+        while (*endpoints)
+        {
+            unsigned long address;
+            unsigned long endpoint;
+            char *end;
+
+            address = strtoul(endpoints, &end, 10);
+            if ((end == endpoints) || (*end != ':') || (address > 127))
+            {
+                fprintf(stderr, "Malformed endpoint list: %s\n", endpoints);
+                return FALSE;
+            }
+
+            endpoints = end + 1;
+            endpoint = strtoul(endpoints, &end, 0);
+            if ((end == endpoints) || ((*end != ',') && (*end != '\0')) ||
+                (endpoint > 0xFF) || (endpoint & 0x70))
+            {
+                fprintf(stderr, "Malformed endpoint list: %s\n", endpoints);
+                return FALSE;
+            }
+
+            /* First endpoint of device removes the default of all endpoints */
+            if (!(listed[address / 32] & (1 << (address % 32))))
+            {
+                listed[address / 32] |= (1 << (address % 32));
+                filter->endpoints[address] = 0;
+            }
+            filter->endpoints[address] |= USBPCAP_ENDPOINT_BIT(endpoint);
+
+            endpoints = end;
+            if (*endpoints == ',')
+            {
+                endpoints++;
+            }
+        }
+    }
+
+    return TRUE;
+}
+
+/*
+ * Parses number taking exactly len characters.
+ *
+ * Returns TRUE on success, FALSE if there are other characters or the
+ * number is larger than max.
+ */
+static BOOLEAN USBPcapParseNumber(PCHAR str, size_t len, unsigned long max, unsigned long *value)
+{
+    char *end;
+
+    *value = strtoul(str, &end, 0);
+    return ((len > 0) && (end == str + len) && (*value <= max)) ? TRUE : FALSE;
+}
+
+/*
+ * Initializes snaplen table with given NULL-terminated, comma separated
+ * list. Every list element is either <type>:<snaplen> (where type is
+ * transfer type name) or <address>:<endpoint>:<snaplen>.
+ *
+ * Returns TRUE on success, FALSE otherwise (malformed list).
+ */
+BOOLEAN USBPcapInitSnaplenTable(PUSBPCAP_IOCTL_SNAPLEN_TABLE table, PCHAR list)
+{
+    memset(table, 0, sizeof(USBPCAP_IOCTL_SNAPLEN_TABLE));
+
+    while (*list)
+    {
+        PCHAR fields[3];
+        size_t lengths[3];
+        int count = 0;
+        PCHAR next = list;
+        unsigned long address;
+        unsigned long endpoint;
+        unsigned long snaplen;
+        UCHAR transfer;
+        BOOLEAN valid = FALSE;
+
+        /* Split element into colon separated fields */
+        for (;;)
+        {
+            fields[count] = next;
+            lengths[count] = strcspn(next, ":,");
+            next += lengths[count];
+            count++;
+
+            if ((*next != ':') || (count == 3))
+            {
+                break;
+            }
+            next++;
+        }
+
+        if ((*next != ',') && (*next != '\0'))
+        {
+            /* Too many fields */
+        }
+        else if (count == 2)
+        {
+            valid = USBPcapGetTransferType(fields[0], lengths[0], &transfer) &&
+                    USBPcapParseNumber(fields[1], lengths[1], MAXLONG, &snaplen) &&
+                    (snaplen > 0);
+            if (valid)
+            {
+                table->transfer[transfer] = snaplen;
+            }
+        }
+        else if (count == 3)
+        {
+            valid = USBPcapParseNumber(fields[0], lengths[0], 127, &address) &&
+                    USBPcapParseNumber(fields[1], lengths[1], 0xFF, &endpoint) &&
+                    !(endpoint & 0x70) &&
+                    USBPcapParseNumber(fields[2], lengths[2], MAXLONG, &snaplen) &&
+                    (snaplen > 0);
+            if (valid && (table->count == USBPCAP_SNAPLEN_MAX_ENDPOINTS))
+            {
+                fprintf(stderr, "Too many endpoints in snaplen table. Maximum is %d.\n",
+                        USBPCAP_SNAPLEN_MAX_ENDPOINTS);
+                return FALSE;
+            }
+            if (valid)
+            {
+                table->endpoints[table->count].device = (UINT16)address;
+                table->endpoints[table->count].endpoint = (UINT8)endpoint;
+                table->endpoints[table->count].snaplen = snaplen;
+                table->count++;
+            }
+        }
+
+        if (!valid)
+        {
+            fprintf(stderr, "Malformed snaplen table element: %.*s\n",
+                    (int)strcspn(list, ","), list);
+            return FALSE;
+        }
+
+        list = next;
+        if (*list == ',')
+        {
+            list++;
+        }
+    }
+
+    return TRUE;
+}
+
+/*
+ * Returns TRUE if len characters of str are equal to name.
+ */
+static BOOLEAN USBPcapIsName(PCHAR str, size_t len, const char *name)
+{
+    return ((strlen(name) == len) && (strncmp(name, str, len) == 0)) ? TRUE : FALSE;
+}
+
+/*
+ * Parses trigger pattern given as hexadecimal bytes. "??" matches any byte.
+ *
+ * Returns TRUE on success, FALSE otherwise.
+ */
+static BOOLEAN USBPcapParseTriggerPattern(PCHAR str, size_t len, PUSBPCAP_IOCTL_TRIGGER trigger)
+{
+    size_t i;
+
+    if ((len == 0) || (len % 2 != 0) || (len / 2 > USBPCAP_TRIGGER_MAX_PATTERN))
+    {
+        return FALSE;
+    }
+
+    for (i = 0; i < len / 2; i++)
+    {
+        char byte[3];
+
+        byte[0] = str[2 * i];
+        byte[1] = str[2 * i + 1];
+        byte[2] = '\0';
+
+        if (strcmp(byte, "??") == 0)
+        {
+            trigger->pattern[i] = 0;
+            trigger->mask[i] = 0;
+            continue;
+        }
+
+        if (!isxdigit((unsigned char)byte[0]) || !isxdigit((unsigned char)byte[1]))
+        {
+            return FALSE;
+        }
+
+        trigger->pattern[i] = (UINT8)strtoul(byte, NULL, 16);
+        trigger->mask[i] = 0xFF;
+    }
+
+    trigger->length = (UINT8)(len / 2);
+    return TRUE;
+}
+
+/*
+ * Initializes trigger with given NULL-terminated specification:
+ *   <condition>[,device=<address>][,endpoint=<address>][,post=<packets>]
+ * where condition is one of stall, status:<USBD_STATUS>, setup:<pattern>
+ * or payload:<offset>:<pattern>.
+ *
+ * Returns TRUE on success, FALSE otherwise (malformed specification).
+ */
+BOOLEAN USBPcapInitTrigger(PUSBPCAP_IOCTL_TRIGGER trigger, PCHAR spec)
+{
+    PCHAR fields[3];
+    size_t lengths[3];
+    int count = 0;
+    PCHAR next = spec;
+    unsigned long value;
+    BOOLEAN valid = FALSE;
+
+    memset(trigger, 0, sizeof(USBPCAP_IOCTL_TRIGGER));
+
+    /* Split condition into colon separated fields */
+    for (;;)
+    {
+        fields[count] = next;
+        lengths[count] = strcspn(next, ":,");
+        next += lengths[count];
+        count++;
+
+        if ((*next != ':') || (count == 3))
+        {
+            break;
+        }
+        next++;
+    }
+
+    if ((*next != ',') && (*next != '\0'))
+    {
+        /* Too many fields */
+    }
+    else if ((count == 1) && USBPcapIsName(fields[0], lengths[0], "stall"))
+    {
+        trigger->type = USBPCAP_TRIGGER_STALL;
+        valid = TRUE;
+    }
+    else if ((count == 2) && USBPcapIsName(fields[0], lengths[0], "status"))
+    {
+        trigger->type = USBPCAP_TRIGGER_STATUS;
+        valid = USBPcapParseNumber(fields[1], lengths[1], MAXDWORD, &value);
+        trigger->status = (UINT32)value;
+    }
+    else if ((count == 2) && USBPcapIsName(fields[0], lengths[0], "setup"))
+    {
+        trigger->type = USBPCAP_TRIGGER_SETUP;
+        valid = USBPcapParseTriggerPattern(fields[1], lengths[1], trigger) &&
+                (trigger->length <= 8);
+    }
+    else if ((count == 3) && USBPcapIsName(fields[0], lengths[0], "payload"))
+    {
+        trigger->type = USBPCAP_TRIGGER_PAYLOAD;
+        valid = USBPcapParseNumber(fields[1], lengths[1], MAXLONG, &value) &&
+                USBPcapParseTriggerPattern(fields[2], lengths[2], trigger);
+        trigger->offset = (UINT32)value;
+    }
+
+    if (!valid)
+    {
+        fprintf(stderr, "Malformed trigger condition: %.*s\n",
+                (int)strcspn(spec, ","), spec);
+        return FALSE;
+    }
+
+    /* Options narrowing down the trigger */
+    while (*next == ',')
+    {
+        PCHAR option = next + 1;
+        size_t len = strcspn(option, ",=");
+        PCHAR arg = option + len;
+        size_t argLen;
+
+        if (*arg == '=')
+        {
+            arg++;
+        }
+        argLen = strcspn(arg, ",");
+        next = arg + argLen;
+
+        if (USBPcapIsName(option, len, "device"))
+        {
+            valid = USBPcapParseNumber(arg, argLen, 127, &value);
+            trigger->flags |= USBPCAP_TRIGGER_FLAG_DEVICE;
+            trigger->device = (UINT16)value;
+        }
+        else if (USBPcapIsName(option, len, "endpoint"))
+        {
+            valid = USBPcapParseNumber(arg, argLen, 0xFF, &value) &&
+                    !(value & 0x70);
+            trigger->flags |= USBPCAP_TRIGGER_FLAG_ENDPOINT;
+            trigger->endpoint = (UINT8)value;
+        }
+        else if (USBPcapIsName(option, len, "post"))
+        {
+            valid = USBPcapParseNumber(arg, argLen, MAXLONG - 1, &value);
+            trigger->postCount = (UINT32)value;
+        }
+        else
+        {
+            valid = FALSE;
+        }
+
+        if (!valid)
+        {
+            fprintf(stderr, "Malformed trigger option: %.*s\n",
+                    (int)strcspn(option, ","), option);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
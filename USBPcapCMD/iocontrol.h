@@ -14,5 +14,8 @@
 BOOLEAN USBPcapIsDeviceFiltered(PUSBPCAP_ADDRESS_FILTER filter, int address);
 BOOLEAN USBPcapSetDeviceFiltered(PUSBPCAP_ADDRESS_FILTER filter, int address);
 BOOLEAN USBPcapInitAddressFilter(PUSBPCAP_ADDRESS_FILTER filter, PCHAR list, BOOLEAN filterAll);
+BOOLEAN USBPcapInitEndpointFilter(PUSBPCAP_ENDPOINT_FILTER filter, PCHAR endpoints, PCHAR transferTypes);
+BOOLEAN USBPcapInitSnaplenTable(PUSBPCAP_IOCTL_SNAPLEN_TABLE table, PCHAR list);
+BOOLEAN USBPcapInitTrigger(PUSBPCAP_IOCTL_TRIGGER trigger, PCHAR spec);
 
 #endif /* USBPCAP_CMD_IOCONTROL_H */
@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "latency.h"
+#include "counters.h"
+
+/*
+ * Returns the bucket the given percentile of total URBs falls into.
+ */
+static int latency_percentile(PUSBPCAP_LATENCY_HISTOGRAM histogram,
+                              UINT64 total, UINT32 percent)
+{
+    UINT64 threshold = (total * percent + 99) / 100;
+    UINT64 count = 0;
+    int bucket;
+
+    for (bucket = 0; bucket < USBPCAP_LATENCY_BUCKETS - 1; bucket++)
+    {
+        count += histogram->buckets[bucket];
+        if ((count != 0) && (count >= threshold))
+        {
+            break;
+        }
+    }
+
+    return bucket;
+}
+
+/*
+ * Prints upper bound (in microseconds) of the bucket.
+ */
+static void print_bucket_bound(int bucket)
+{
+    if (bucket == USBPCAP_LATENCY_BUCKETS - 1)
+    {
+        printf(" %10s", "overflow");
+    }
+    else
+    {
+        printf(" %10u", 1u << bucket);
+    }
+}
+
+static void print_latency(const char *device, HANDLE filter_handle)
+{
+    PUSBPCAP_IOCTL_LATENCY latency;
+    DWORD bytes_ret = 0;
+    UINT16 i;
+
+    latency = (PUSBPCAP_IOCTL_LATENCY)malloc(sizeof(USBPCAP_IOCTL_LATENCY));
+    if (latency == NULL)
+    {
+        return;
+    }
+
+    if (!DeviceIoControl(filter_handle,
+                         IOCTL_USBPCAP_GET_LATENCY,
+                         NULL,
+                         0,
+                         (char*)latency,
+                         sizeof(USBPCAP_IOCTL_LATENCY),
+                         &bytes_ret,
+                         0) ||
+        (bytes_ret != sizeof(USBPCAP_IOCTL_LATENCY)))
+    {
+        fprintf(stderr, "Failed to get latency histograms from %s (%d)\n",
+                device, GetLastError());
+        free(latency);
+        return;
+    }
+
+    printf("%s (bus %u), latency upper bounds in microseconds:\n",
+           device, latency->bus);
+    printf("device endpoint transfer          URBs        p50        p90        p99        max\n");
+
+    for (i = 0; i < latency->count; i++)
+    {
+        PUSBPCAP_LATENCY_HISTOGRAM histogram = &latency->histograms[i];
+        UINT64 total = 0;
+        int max = 0;
+        int bucket;
+
+        for (bucket = 0; bucket < USBPCAP_LATENCY_BUCKETS; bucket++)
+        {
+            total += histogram->buckets[bucket];
+            if (histogram->buckets[bucket] != 0)
+            {
+                max = bucket;
+            }
+        }
+
+        printf("%6u     0x%02x %-11s %10I64u",
+               histogram->device, histogram->endpoint,
+               counter_transfer_name(histogram->transfer), total);
+        print_bucket_bound(latency_percentile(histogram, total, 50));
+        print_bucket_bound(latency_percentile(histogram, total, 90));
+        print_bucket_bound(latency_percentile(histogram, total, 99));
+        print_bucket_bound(max);
+        printf("\n");
+    }
+
+    if (latency->untracked != 0)
+    {
+        printf("%u URBs were not measured (too many endpoints or URBs in flight)\n",
+               latency->untracked);
+    }
+
+    free(latency);
+}
+
+int latency_report(struct thread_data *data, UINT32 seconds)
+{
+    struct counter_hubs hubs;
+    int i;
+
+    if (!counter_hubs_open(&hubs, data, IOCTL_USBPCAP_START_LATENCY))
+    {
+        return -1;
+    }
+
+    counter_hubs_wait((seconds == 0) ? INFINITE : seconds * 1000);
+
+    for (i = 0; i < hubs.count; i++)
+    {
+        print_latency(hubs.devices[i], hubs.handles[i]);
+    }
+
+    counter_hubs_close(&hubs);
+    return 0;
+}
@@ -0,0 +1,23 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef USBPCAP_CMD_LATENCY_H
+#define USBPCAP_CMD_LATENCY_H
+
+#include <windows.h>
+#include "thread.h"
+
+/*
+ * Measures submit-to-completion latency of URBs on every Root Hub in
+ * data->device for given number of seconds (0 to measure until Ctrl+C)
+ * and prints per endpoint percentiles to standard output. No packets are
+ * captured. Must be called elevated.
+ *
+ * Returns 0 on success.
+ */
+int latency_report(struct thread_data *data, UINT32 seconds);
+
+#endif /* USBPCAP_CMD_LATENCY_H */
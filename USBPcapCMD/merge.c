@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "merge.h"
+
+BOOL merge_init(struct merge_heap *heap, int sources)
+{
+    heap->entries = (struct merge_entry *)
+        calloc(sources, sizeof(struct merge_entry));
+    heap->count = 0;
+    heap->capacity = (heap->entries == NULL) ? 0 : sources;
+    return (heap->entries == NULL) ? FALSE : TRUE;
+}
+
+void merge_free(struct merge_heap *heap)
+{
+    free(heap->entries);
+    memset(heap, 0, sizeof(struct merge_heap));
+}
+
+static BOOL entry_less(struct merge_entry *a, struct merge_entry *b)
+{
+    if (a->timestamp != b->timestamp)
+    {
+        return (a->timestamp < b->timestamp) ? TRUE : FALSE;
+    }
+    return (a->source < b->source) ? TRUE : FALSE;
+}
+
+static void swap_entries(struct merge_heap *heap, int a, int b)
+{
+    struct merge_entry tmp = heap->entries[a];
+    heap->entries[a] = heap->entries[b];
+    heap->entries[b] = tmp;
+}
+
+/*
+ * Adds source oldest record timestamp. Source must not be in the heap.
+ */
+void merge_push(struct merge_heap *heap, int source, UINT64 timestamp)
+{
+    int i = heap->count;
+
+    heap->entries[i].timestamp = timestamp;
+    heap->entries[i].source = source;
+    heap->count++;
+
+    while (i > 0)
+    {
+        int parent = (i - 1) / 2;
+        if (!entry_less(&heap->entries[i], &heap->entries[parent]))
+        {
+            break;
+        }
+        swap_entries(heap, i, parent);
+        i = parent;
+    }
+}
+
+/*
+ * Returns the source with the oldest record. Returns FALSE if heap is empty.
+ */
+BOOL merge_peek(struct merge_heap *heap, int *source, UINT64 *timestamp)
+{
+    if (heap->count == 0)
+    {
+        return FALSE;
+    }
+
+    *source = heap->entries[0].source;
+    *timestamp = heap->entries[0].timestamp;
+    return TRUE;
+}
+
+/*
+ * Removes the oldest entry.
+ */
+void merge_pop(struct merge_heap *heap)
+{
+    int i = 0;
+
+    if (heap->count == 0)
+    {
+        return;
+    }
+
+    heap->count--;
+    heap->entries[0] = heap->entries[heap->count];
+
+    for (;;)
+    {
+        int left = 2 * i + 1;
+        int right = left + 1;
+        int smallest = i;
+
+        if ((left < heap->count) &&
+            entry_less(&heap->entries[left], &heap->entries[smallest]))
+        {
+            smallest = left;
+        }
+        if ((right < heap->count) &&
+            entry_less(&heap->entries[right], &heap->entries[smallest]))
+        {
+            smallest = right;
+        }
+        if (smallest == i)
+        {
+            break;
+        }
+        swap_entries(heap, i, smallest);
+        i = smallest;
+    }
+}
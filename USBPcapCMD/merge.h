@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef USBPCAP_CMD_MERGE_H
+#define USBPCAP_CMD_MERGE_H
+
+#include <windows.h>
+
+/*
+ * Binary min-heap used to merge time-ordered streams.
+ *
+ * Every source has at most one entry in the heap: the timestamp of its
+ * oldest unwritten record. Once the record is written the source pushes
+ * its next record (if there is any), so memory usage is bounded by the
+ * number of sources.
+ *
+ * Entries with equal timestamps are returned in order of source index.
+ */
+struct merge_entry
+{
+    UINT64 timestamp;
+    int source;
+};
+
+struct merge_heap
+{
+    struct merge_entry *entries;
+    int count;
+    int capacity; /* Maximum number of sources */
+};
+
+BOOL merge_init(struct merge_heap *heap, int sources);
+void merge_free(struct merge_heap *heap);
+
+void merge_push(struct merge_heap *heap, int source, UINT64 timestamp);
+BOOL merge_peek(struct merge_heap *heap, int *source, UINT64 *timestamp);
+void merge_pop(struct merge_heap *heap);
+
+#endif /* USBPCAP_CMD_MERGE_H */
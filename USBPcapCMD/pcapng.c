@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <string.h>
+#include "pcapng.h"
+
+/* Difference between 1601-01-01 and 1970-01-01 in 100 ns units */
+#define EPOCH_DIFFERENCE 116444736000000000ULL
+
+#define PAD32(x) (((x) + 3) & ~3)
+
+/*
+ * Converts FILETIME (100 ns units since 1601) to timestamp in
+ * USBPCAP_PCAPNG_TSRESOL units.
+ */
+UINT64 pcapng_timestamp_from_filetime(UINT64 filetime)
+{
+    return filetime - EPOCH_DIFFERENCE;
+}
+
+static UINT32 option_length(UINT32 value_length)
+{
+    return sizeof(pcapng_option_t) + PAD32(value_length);
+}
+
+static UINT32 write_option(unsigned char *dest, UINT16 code,
+                           const void *value, UINT16 length)
+{
+    pcapng_option_t opt;
+    UINT32 padded = PAD32(length);
+
+    opt.option_code = code;
+    opt.option_length = length;
+    memcpy(dest, &opt, sizeof(opt));
+    if (length > 0)
+    {
+        memcpy(&dest[sizeof(opt)], value, length);
+    }
+    memset(&dest[sizeof(opt) + length], 0, padded - length);
+
+    return sizeof(opt) + padded;
+}
+
+static UINT32 write_trailer(unsigned char *dest, UINT32 block_total_length)
+{
+    memcpy(dest, &block_total_length, sizeof(UINT32));
+    return sizeof(UINT32);
+}
+
+UINT32 pcapng_shb_length(void)
+{
+    return sizeof(pcapng_shb_t) + sizeof(UINT32);
+}
+
+UINT32 pcapng_write_shb(void *dest)
+{
+    unsigned char *buf = (unsigned char *)dest;
+    pcapng_shb_t shb;
+
+    shb.block_type = PCAPNG_BLOCK_TYPE_SHB;
+    shb.block_total_length = pcapng_shb_length();
+    shb.byte_order_magic = PCAPNG_BYTE_ORDER_MAGIC;
+    shb.version_major = 1;
+    shb.version_minor = 0;
+    shb.section_length = -1;
+    memcpy(buf, &shb, sizeof(shb));
+    write_trailer(&buf[sizeof(shb)], shb.block_total_length);
+
+    return shb.block_total_length;
+}
+
+/*
+ * name is stored in if_name option, can be NULL.
+ */
+UINT32 pcapng_idb_length(const char *name)
+{
+    UINT32 length = sizeof(pcapng_idb_t);
+
+    length += option_length(1); /* if_tsresol */
+    if (name != NULL)
+    {
+        length += option_length((UINT32)strlen(name));
+    }
+    length += option_length(0); /* opt_endofopt */
+    length += sizeof(UINT32);
+
+    return length;
+}
+
+UINT32 pcapng_write_idb(void *dest, UINT16 linktype, UINT32 snaplen,
+                        UINT8 tsresol, const char *name)
+{
+    unsigned char *buf = (unsigned char *)dest;
+    pcapng_idb_t idb;
+    UINT32 offset;
+
+    idb.block_type = PCAPNG_BLOCK_TYPE_IDB;
+    idb.block_total_length = pcapng_idb_length(name);
+    idb.linktype = linktype;
+    idb.reserved = 0;
+    idb.snaplen = snaplen;
+    memcpy(buf, &idb, sizeof(idb));
+    offset = sizeof(idb);
+
+    offset += write_option(&buf[offset], PCAPNG_IF_TSRESOL, &tsresol, 1);
+    if (name != NULL)
+    {
+        offset += write_option(&buf[offset], PCAPNG_IF_NAME,
+                               name, (UINT16)strlen(name));
+    }
+    offset += write_option(&buf[offset], PCAPNG_OPT_ENDOFOPT, NULL, 0);
+    offset += write_trailer(&buf[offset], idb.block_total_length);
+
+    return offset;
+}
+
+UINT32 pcapng_epb_length(UINT32 captured_len)
+{
+    return sizeof(pcapng_epb_t) + PAD32(captured_len) + sizeof(UINT32);
+}
+
+UINT32 pcapng_write_epb(void *dest, UINT32 interface_id, UINT64 timestamp,
+                        const void *data, UINT32 captured_len,
+                        UINT32 packet_len)
+{
+    unsigned char *buf = (unsigned char *)dest;
+    pcapng_epb_t epb;
+    UINT32 offset;
+
+    epb.block_type = PCAPNG_BLOCK_TYPE_EPB;
+    epb.block_total_length = pcapng_epb_length(captured_len);
+    epb.interface_id = interface_id;
+    epb.timestamp_high = (UINT32)(timestamp >> 32);
+    epb.timestamp_low = (UINT32)timestamp;
+    epb.captured_len = captured_len;
+    epb.packet_len = packet_len;
+    memcpy(buf, &epb, sizeof(epb));
+    offset = sizeof(epb);
+
+    memcpy(&buf[offset], data, captured_len);
+    memset(&buf[offset + captured_len], 0, PAD32(captured_len) - captured_len);
+    offset += PAD32(captured_len);
+    offset += write_trailer(&buf[offset], epb.block_total_length);
+
+    return offset;
+}
+
+UINT32 pcapng_isb_length(void)
+{
+    return sizeof(pcapng_isb_t) +
+           option_length(sizeof(UINT64)) + /* isb_ifrecv */
+           option_length(sizeof(UINT64)) + /* isb_ifdrop */
+           option_length(0) +              /* opt_endofopt */
+           sizeof(UINT32);
+}
+
+UINT32 pcapng_write_isb(void *dest, UINT32 interface_id, UINT64 timestamp,
+                        UINT64 ifrecv, UINT64 ifdrop)
+{
+    unsigned char *buf = (unsigned char *)dest;
+    pcapng_isb_t isb;
+    UINT32 offset;
+
+    isb.block_type = PCAPNG_BLOCK_TYPE_ISB;
+    isb.block_total_length = pcapng_isb_length();
+    isb.interface_id = interface_id;
+    isb.timestamp_high = (UINT32)(timestamp >> 32);
+    isb.timestamp_low = (UINT32)timestamp;
+    memcpy(buf, &isb, sizeof(isb));
+    offset = sizeof(isb);
+
+    offset += write_option(&buf[offset], PCAPNG_ISB_IFRECV,
+                           &ifrecv, sizeof(ifrecv));
+    offset += write_option(&buf[offset], PCAPNG_ISB_IFDROP,
+                           &ifdrop, sizeof(ifdrop));
+    offset += write_option(&buf[offset], PCAPNG_OPT_ENDOFOPT, NULL, 0);
+    offset += write_trailer(&buf[offset], isb.block_total_length);
+
+    return offset;
+}
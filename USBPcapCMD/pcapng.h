@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef USBPCAP_CMD_PCAPNG_H
+#define USBPCAP_CMD_PCAPNG_H
+
+#include <windows.h>
+#include "USBPcap.h"
+
+/*
+ * pcapng block encoder.
+ *
+ * Every pcapng_write_xxx() function stores complete block (including
+ * padding and trailing block length) in host byte order to dest and
+ * returns number of bytes written. dest must be at least as large as the
+ * value returned by matching pcapng_xxx_length() function.
+ *
+ * The encoder does not call any system functions.
+ */
+
+UINT64 pcapng_timestamp_from_filetime(UINT64 filetime);
+
+UINT32 pcapng_shb_length(void);
+UINT32 pcapng_write_shb(void *dest);
+
+UINT32 pcapng_idb_length(const char *name);
+UINT32 pcapng_write_idb(void *dest, UINT16 linktype, UINT32 snaplen,
+                        UINT8 tsresol, const char *name);
+
+UINT32 pcapng_epb_length(UINT32 captured_len);
+UINT32 pcapng_write_epb(void *dest, UINT32 interface_id, UINT64 timestamp,
+                        const void *data, UINT32 captured_len,
+                        UINT32 packet_len);
+
+UINT32 pcapng_isb_length(void);
+UINT32 pcapng_write_isb(void *dest, UINT32 interface_id, UINT64 timestamp,
+                        UINT64 ifrecv, UINT64 ifdrop);
+
+#endif /* USBPCAP_CMD_PCAPNG_H */
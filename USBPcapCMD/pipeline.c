@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "pipeline.h"
+
+BOOL pipeline_init(struct pipeline *pipeline, int count, DWORD size)
+{
+    int i;
+
+    memset(pipeline, 0, sizeof(struct pipeline));
+
+    pipeline->buffers = (struct pipeline_buffer *)
+        calloc(count, sizeof(struct pipeline_buffer));
+    if (pipeline->buffers == NULL)
+    {
+        return FALSE;
+    }
+    pipeline->count = count;
+    pipeline->size = size;
+
+    pipeline->free_sem = CreateSemaphore(NULL, count, count, NULL);
+    pipeline->filled_sem = CreateSemaphore(NULL, 0, count, NULL);
+    if ((pipeline->free_sem == NULL) || (pipeline->filled_sem == NULL))
+    {
+        pipeline_free(pipeline);
+        return FALSE;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        pipeline->buffers[i].data = (unsigned char *)malloc(size);
+        pipeline->buffers[i].overlapped.hEvent =
+            CreateEvent(NULL,
+                        TRUE /* Manual Reset */,
+                        FALSE /* Default non signaled */,
+                        NULL /* No name */);
+        if ((pipeline->buffers[i].data == NULL) ||
+            (pipeline->buffers[i].overlapped.hEvent == NULL))
+        {
+            pipeline_free(pipeline);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/*
+ * Frees all buffers. There must be no read in progress.
+ */
+void pipeline_free(struct pipeline *pipeline)
+{
+    int i;
+
+    if (pipeline->buffers != NULL)
+    {
+        for (i = 0; i < pipeline->count; i++)
+        {
+            if (pipeline->buffers[i].data != NULL)
+            {
+                free(pipeline->buffers[i].data);
+            }
+            if (pipeline->buffers[i].overlapped.hEvent != NULL)
+            {
+                CloseHandle(pipeline->buffers[i].overlapped.hEvent);
+            }
+        }
+        free(pipeline->buffers);
+    }
+
+    if (pipeline->free_sem != NULL)
+    {
+        CloseHandle(pipeline->free_sem);
+    }
+
+    if (pipeline->filled_sem != NULL)
+    {
+        CloseHandle(pipeline->filled_sem);
+    }
+
+    memset(pipeline, 0, sizeof(struct pipeline));
+}
+
+/*
+ * Returns buffer to read into. Must be called only after successful
+ * wait on free_sem.
+ */
+struct pipeline_buffer *pipeline_start_read(struct pipeline *pipeline)
+{
+    struct pipeline_buffer *buffer;
+
+    buffer = &pipeline->buffers[pipeline->next_read % pipeline->count];
+    pipeline->next_read++;
+
+    buffer->length = 0;
+    ResetEvent(buffer->overlapped.hEvent);
+    return buffer;
+}
+
+/*
+ * Returns the oldest buffer with read in progress or NULL if there is
+ * no read in progress.
+ */
+struct pipeline_buffer *pipeline_pending_read(struct pipeline *pipeline)
+{
+    if (pipeline->next_complete == pipeline->next_read)
+    {
+        return NULL;
+    }
+
+    return &pipeline->buffers[pipeline->next_complete % pipeline->count];
+}
+
+/*
+ * Passes the oldest pending buffer to the writer.
+ */
+void pipeline_complete_read(struct pipeline *pipeline, DWORD length)
+{
+    struct pipeline_buffer *buffer = pipeline_pending_read(pipeline);
+
+    buffer->length = length;
+    pipeline->next_complete++;
+    ReleaseSemaphore(pipeline->filled_sem, 1, NULL);
+}
+
+/*
+ * Returns the oldest filled buffer. Must be called only after successful
+ * wait on filled_sem.
+ */
+struct pipeline_buffer *pipeline_get_filled(struct pipeline *pipeline)
+{
+    return &pipeline->buffers[pipeline->next_write % pipeline->count];
+}
+
+/*
+ * Returns buffer obtained with pipeline_get_filled() to the reader.
+ */
+void pipeline_release(struct pipeline *pipeline)
+{
+    pipeline->next_write++;
+    ReleaseSemaphore(pipeline->free_sem, 1, NULL);
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef USBPCAP_CMD_PIPELINE_H
+#define USBPCAP_CMD_PIPELINE_H
+
+#include <windows.h>
+
+struct pipeline_buffer
+{
+    OVERLAPPED overlapped; /* Used to read data into the buffer */
+    unsigned char *data;
+    DWORD length;          /* Number of valid bytes in data */
+};
+
+/*
+ * Fixed pool of buffers passed from reader to writer.
+ *
+ * Reader issues reads into free buffers in pool order and completes them
+ * in the same order. Writer takes filled buffers in pool order and returns
+ * them to the reader once written, so the data order is preserved.
+ * Reader and writer can run in separate threads, each side touches only
+ * its own indices and synchronizes via the semaphores.
+ */
+struct pipeline
+{
+    struct pipeline_buffer *buffers;
+    int count;
+    DWORD size;        /* Size of every buffer */
+    int next_read;     /* Reader only: next buffer to read into */
+    int next_complete; /* Reader only: oldest buffer with read in progress */
+    int next_write;    /* Writer only: next buffer to write out */
+    HANDLE free_sem;   /* Signalled while there are free buffers */
+    HANDLE filled_sem; /* Signalled while there are filled buffers */
+};
+
+BOOL pipeline_init(struct pipeline *pipeline, int count, DWORD size);
+void pipeline_free(struct pipeline *pipeline);
+
+/* Reader side */
+struct pipeline_buffer *pipeline_start_read(struct pipeline *pipeline);
+struct pipeline_buffer *pipeline_pending_read(struct pipeline *pipeline);
+void pipeline_complete_read(struct pipeline *pipeline, DWORD length);
+
+/* Writer side */
+struct pipeline_buffer *pipeline_get_filled(struct pipeline *pipeline);
+void pipeline_release(struct pipeline *pipeline);
+
+#endif /* USBPCAP_CMD_PIPELINE_H */
@@ -0,0 +1,357 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "rotate.h"
+
+/* Longest duration that fits into millisecond tick arithmetic */
+#define ROTATE_MAX_SECONDS 2000000
+
+/* Bytes needed to learn record length */
+#define PCAP_RECORD_HEADER_LEN   sizeof(pcaprec_hdr_t)
+#define PCAPNG_RECORD_HEADER_LEN (2 * sizeof(UINT32))
+
+/*
+ * Parses --ring-buffer argument. It is comma separated list of:
+ *   filesize:<N>  - switch file after N KiB
+ *   duration:<N>  - switch file after N seconds
+ *   packets:<N>   - switch file after N packets
+ *   files:<N>     - keep only last N files
+ *
+ * Returns FALSE if arg is not valid or does not specify when to switch.
+ */
+BOOL rotate_policy_parse(const char *arg, struct rotate_policy *policy)
+{
+    memset(policy, 0, sizeof(struct rotate_policy));
+
+    while (*arg != '\0')
+    {
+        const char *value = strchr(arg, ':');
+        unsigned long number;
+        size_t key_len;
+        char *end;
+
+        if (value == NULL)
+        {
+            return FALSE;
+        }
+        key_len = value - arg;
+        value++;
+
+        number = strtoul(value, &end, 10);
+        if ((end == value) || (number == 0) || (number > MAXLONG) ||
+            ((*end != ',') && (*end != '\0')))
+        {
+            return FALSE;
+        }
+
+        if ((key_len == 8) && (strncmp(arg, "filesize", 8) == 0))
+        {
+            policy->max_bytes = (UINT64)number * 1024;
+        }
+        else if ((key_len == 8) && (strncmp(arg, "duration", 8) == 0))
+        {
+            if (number > ROTATE_MAX_SECONDS)
+            {
+                return FALSE;
+            }
+            policy->max_seconds = (UINT32)number;
+        }
+        else if ((key_len == 7) && (strncmp(arg, "packets", 7) == 0))
+        {
+            policy->max_packets = (UINT32)number;
+        }
+        else if ((key_len == 5) && (strncmp(arg, "files", 5) == 0))
+        {
+            policy->max_files = (UINT32)number;
+        }
+        else
+        {
+            return FALSE;
+        }
+
+        arg = (*end == ',') ? end + 1 : end;
+    }
+
+    return rotate_policy_enabled(policy);
+}
+
+/*
+ * Returns TRUE if policy switches files.
+ */
+BOOL rotate_policy_enabled(const struct rotate_policy *policy)
+{
+    return ((policy->max_bytes != 0) ||
+            (policy->max_seconds != 0) ||
+            (policy->max_packets != 0)) ? TRUE : FALSE;
+}
+
+BOOL rotate_init(struct rotate_state *state, const struct rotate_policy *policy,
+                 const char *filename, BOOL pcapng)
+{
+    memset(state, 0, sizeof(struct rotate_state));
+    state->policy = *policy;
+    state->filename = filename;
+    state->pcapng = pcapng;
+
+    if (policy->max_files > 0)
+    {
+        state->files = (char **)calloc(policy->max_files, sizeof(char *));
+        if (state->files == NULL)
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+void rotate_free(struct rotate_state *state)
+{
+    UINT32 i;
+
+    for (i = 0; i < state->file_count; i++)
+    {
+        free(state->files[i]);
+    }
+    free(state->files);
+    free(state->preamble);
+    memset(state, 0, sizeof(struct rotate_state));
+}
+
+/*
+ * Stores data that has to be written at the start of every file.
+ */
+BOOL rotate_add_preamble(struct rotate_state *state, const void *data,
+                         UINT32 length)
+{
+    if (state->preamble_len + length > state->preamble_size)
+    {
+        UINT32 size = state->preamble_len + length;
+        unsigned char *preamble = (unsigned char *)realloc(state->preamble, size);
+
+        if (preamble == NULL)
+        {
+            return FALSE;
+        }
+        state->preamble = preamble;
+        state->preamble_size = size;
+    }
+
+    memcpy(&state->preamble[state->preamble_len], data, length);
+    state->preamble_len += length;
+    state->file_bytes += length;
+    return TRUE;
+}
+
+/*
+ * Marks the end of preamble. Everything written afterwards are records.
+ */
+void rotate_start_records(struct rotate_state *state)
+{
+    state->in_records = TRUE;
+}
+
+static BOOL rotate_due(struct rotate_state *state, UINT32 now)
+{
+    struct rotate_policy *policy = &state->policy;
+
+    if ((policy->max_bytes != 0) && (state->file_bytes >= policy->max_bytes))
+    {
+        return TRUE;
+    }
+
+    if ((policy->max_packets != 0) && (state->file_packets >= policy->max_packets))
+    {
+        return TRUE;
+    }
+
+    if ((policy->max_seconds != 0) &&
+        ((now - state->file_start) >= policy->max_seconds * 1000))
+    {
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+/*
+ * Parses complete record header. Returns number of bytes that follow it.
+ */
+static UINT32 rotate_record_started(struct rotate_state *state)
+{
+    if (state->pcapng)
+    {
+        UINT32 block_type;
+        UINT32 block_total_length;
+
+        memcpy(&block_type, &state->header[0], sizeof(UINT32));
+        memcpy(&block_total_length, &state->header[sizeof(UINT32)], sizeof(UINT32));
+        if (block_type == PCAPNG_BLOCK_TYPE_EPB)
+        {
+            state->file_packets++;
+        }
+
+        if (block_total_length < PCAPNG_RECORD_HEADER_LEN)
+        {
+            /* Broken block, don't wait for data that will never come */
+            return 0;
+        }
+        return block_total_length - PCAPNG_RECORD_HEADER_LEN;
+    }
+    else
+    {
+        pcaprec_hdr_t hdr;
+
+        memcpy(&hdr, state->header, sizeof(hdr));
+        state->file_packets++;
+        return hdr.incl_len;
+    }
+}
+
+/*
+ * Returns number of bytes from data that belong to current file.
+ * Sets rotate to TRUE if next file has to be opened before the rest
+ * of data is written. now is millisecond tick count.
+ */
+UINT32 rotate_scan(struct rotate_state *state, const unsigned char *data,
+                   UINT32 length, UINT32 now, BOOL *rotate)
+{
+    UINT32 header_size = state->pcapng ? PCAPNG_RECORD_HEADER_LEN :
+                                         PCAP_RECORD_HEADER_LEN;
+    UINT32 offset = 0;
+
+    *rotate = FALSE;
+    while (offset < length)
+    {
+        UINT32 take;
+
+        if (state->remaining == 0)
+        {
+            take = min(header_size - state->header_len, length - offset);
+            memcpy(&state->header[state->header_len], &data[offset], take);
+            state->header_len += take;
+            offset += take;
+            state->file_bytes += take;
+
+            if (state->header_len < header_size)
+            {
+                /* Rest of header is in next data */
+                break;
+            }
+            state->header_len = 0;
+            state->remaining = rotate_record_started(state);
+        }
+        else
+        {
+            take = min(state->remaining, length - offset);
+            state->remaining -= take;
+            offset += take;
+            state->file_bytes += take;
+        }
+
+        if ((state->remaining == 0) && rotate_due(state, now))
+        {
+            *rotate = TRUE;
+            break;
+        }
+    }
+
+    return offset;
+}
+
+/*
+ * Returns the name of next file: filename with _<index>_<timestamp>
+ * inserted before extension. The returned string has to be freed by
+ * caller.
+ *
+ * If the file count exceeds max_files, removed is set to the name of the
+ * oldest file that should be deleted (caller frees it), otherwise to NULL.
+ */
+char *rotate_next_file(struct rotate_state *state, const char *timestamp,
+                       UINT32 now, char **removed)
+{
+    const char *ext;
+    const char *sep;
+    char index[11];
+    size_t index_len = 0;
+    size_t base_len;
+    size_t len;
+    UINT32 value;
+    char *name;
+
+    *removed = NULL;
+
+    /* Extension is the part after last dot in file name (not path) */
+    ext = strrchr(state->filename, '.');
+    sep = strrchr(state->filename, '\\');
+    if ((sep == NULL) || (strrchr(state->filename, '/') > sep))
+    {
+        sep = strrchr(state->filename, '/');
+    }
+    if ((ext == NULL) || ((sep != NULL) && (ext < sep)))
+    {
+        ext = &state->filename[strlen(state->filename)];
+    }
+    base_len = ext - state->filename;
+
+    /* At least 5 digits, so the files sort by name */
+    state->file_index++;
+    value = state->file_index;
+    do
+    {
+        index[index_len++] = (char)('0' + (value % 10));
+        value /= 10;
+    }
+    while ((value != 0) || (index_len < 5));
+
+    len = base_len + 1 + index_len + 1 + strlen(timestamp) + strlen(ext) + 1;
+    name = (char *)malloc(len);
+    if (name == NULL)
+    {
+        return NULL;
+    }
+
+    memcpy(name, state->filename, base_len);
+    len = base_len;
+    name[len++] = '_';
+    while (index_len > 0)
+    {
+        name[len++] = index[--index_len];
+    }
+    name[len++] = '_';
+    memcpy(&name[len], timestamp, strlen(timestamp));
+    len += strlen(timestamp);
+    memcpy(&name[len], ext, strlen(ext) + 1);
+
+    if (state->files != NULL)
+    {
+        char *kept = (char *)malloc(strlen(name) + 1);
+
+        if (kept == NULL)
+        {
+            free(name);
+            return NULL;
+        }
+        memcpy(kept, name, strlen(name) + 1);
+
+        if (state->file_count == state->policy.max_files)
+        {
+            *removed = state->files[0];
+            memmove(&state->files[0], &state->files[1],
+                    (state->file_count - 1) * sizeof(char *));
+            state->file_count--;
+        }
+        state->files[state->file_count++] = kept;
+    }
+
+    state->file_bytes = state->preamble_len;
+    state->file_packets = 0;
+    state->file_start = now;
+
+    return name;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef USBPCAP_CMD_ROTATE_H
+#define USBPCAP_CMD_ROTATE_H
+
+#include <windows.h>
+#include "USBPcap.h"
+
+/*
+ * Output file rotation.
+ *
+ * The rotation state keeps the preamble (global header, Interface
+ * Description Blocks and injected descriptors) that is written at the
+ * start of every file and splits the record stream at record boundaries
+ * once any of the policy limits is reached.
+ *
+ * This module does not call any system functions, opening and removing
+ * the files is left to the caller.
+ */
+
+struct rotate_policy
+{
+    UINT64 max_bytes;   /* Switch file after this many bytes, 0 if unlimited */
+    UINT32 max_seconds; /* Switch file after this many seconds, 0 if unlimited */
+    UINT32 max_packets; /* Switch file after this many packets, 0 if unlimited */
+    UINT32 max_files;   /* Number of files kept, 0 keeps all */
+};
+
+struct rotate_state
+{
+    struct rotate_policy policy;
+    const char *filename;    /* Output filename, file index is added to it */
+    BOOL pcapng;             /* Records are pcapng blocks */
+
+    BOOL in_records;         /* FALSE while preamble is being written */
+    unsigned char *preamble; /* Written at the start of every file */
+    UINT32 preamble_len;
+    UINT32 preamble_size;
+
+    /* Record header being received, record length is not known before */
+    unsigned char header[sizeof(pcaprec_hdr_t)];
+    UINT32 header_len;
+    UINT32 remaining;        /* Bytes left in current record */
+
+    UINT64 file_bytes;       /* Bytes written to current file */
+    UINT32 file_packets;     /* Packets written to current file */
+    UINT32 file_start;       /* Millisecond tick when file was opened */
+    UINT32 file_index;       /* Number of files opened so far */
+
+    char **files;            /* Names of kept files, oldest first */
+    UINT32 file_count;
+};
+
+BOOL rotate_policy_parse(const char *arg, struct rotate_policy *policy);
+BOOL rotate_policy_enabled(const struct rotate_policy *policy);
+
+BOOL rotate_init(struct rotate_state *state, const struct rotate_policy *policy,
+                 const char *filename, BOOL pcapng);
+void rotate_free(struct rotate_state *state);
+
+BOOL rotate_add_preamble(struct rotate_state *state, const void *data,
+                         UINT32 length);
+void rotate_start_records(struct rotate_state *state);
+
+UINT32 rotate_scan(struct rotate_state *state, const unsigned char *data,
+                   UINT32 length, UINT32 now, BOOL *rotate);
+
+char *rotate_next_file(struct rotate_state *state, const char *timestamp,
+                       UINT32 now, char **removed);
+
+#endif /* USBPCAP_CMD_ROTATE_H */
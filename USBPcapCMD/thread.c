@@ -12,6 +12,52 @@
 #include "thread.h"
 #include "iocontrol.h"
 #include "descriptors.h"
+#include "pipeline.h"
+#include "pcapng.h"
+#include "merge.h"
+
+/*
+ * Maps the driver capture buffer into this process.
+ * Returns FALSE if the buffer could not be mapped.
+ */
+static BOOL map_capture_buffer(HANDLE filter_handle, struct thread_data *data)
+{
+    USBPCAP_IOCTL_MAP_BUFFER request;
+    USBPCAP_IOCTL_MAPPED_BUFFER mapped;
+    DWORD bytes_ret = 0;
+    HANDLE event;
+
+    event = CreateEvent(NULL,
+                        FALSE /* Auto Reset */,
+                        FALSE /* Default non signaled */,
+                        NULL /* No name */);
+    if (event == NULL)
+    {
+        return FALSE;
+    }
+
+    request.event = (UINT64)(ULONG_PTR)event;
+    if (!DeviceIoControl(filter_handle,
+                         IOCTL_USBPCAP_MAP_BUFFER,
+                         (char*)&request,
+                         sizeof(USBPCAP_IOCTL_MAP_BUFFER),
+                         (char*)&mapped,
+                         sizeof(USBPCAP_IOCTL_MAPPED_BUFFER),
+                         &bytes_ret,
+                         0) ||
+        (bytes_ret != sizeof(USBPCAP_IOCTL_MAPPED_BUFFER)))
+    {
+        fprintf(stderr, "Failed to map capture buffer (%d). Using ReadFile() instead.\n",
+                GetLastError());
+        CloseHandle(event);
+        return FALSE;
+    }
+
+    data->ring_header = (PUSBPCAP_SHARED_RING_HEADER)(ULONG_PTR)mapped.address;
+    data->ring_consumer = (PUSBPCAP_SHARED_RING_CONSUMER)(ULONG_PTR)mapped.consumer;
+    data->ring_event = event;
+    return TRUE;
+}
 
 HANDLE create_filter_read_handle(struct thread_data *data)
 {
@@ -58,6 +104,136 @@ HANDLE create_filter_read_handle(struct thread_data *data)
         goto finish;
     }
 
+    if (data->snaplen_table != NULL)
+    {
+        USBPCAP_IOCTL_SNAPLEN_TABLE table;
+
+        if (!USBPcapInitSnaplenTable(&table, data->snaplen_table))
+        {
+            goto finish;
+        }
+
+        if (!DeviceIoControl(filter_handle,
+                             IOCTL_USBPCAP_SET_SNAPLEN_TABLE,
+                             (char*)&table,
+                             sizeof(USBPCAP_IOCTL_SNAPLEN_TABLE),
+                             NULL,
+                             0,
+                             &bytes_ret,
+                             0))
+        {
+            fprintf(stderr, "Failed to set snaplen table (%d)\n",
+                    GetLastError());
+            goto finish;
+        }
+    }
+
+    data->ring_header = NULL;
+    data->ring_consumer = NULL;
+    data->ring_event = NULL;
+
+    if (data->wakeup_bytes > 1)
+    {
+        USBPCAP_IOCTL_READ_WAKEUP wakeup;
+
+        wakeup.minBytes = data->wakeup_bytes;
+        wakeup.maxLatencyUs = data->wakeup_latency;
+        if (!DeviceIoControl(filter_handle,
+                             IOCTL_USBPCAP_SET_READ_WAKEUP,
+                             (char*)&wakeup,
+                             sizeof(USBPCAP_IOCTL_READ_WAKEUP),
+                             NULL,
+                             0,
+                             &bytes_ret,
+                             0))
+        {
+            /* Not fatal, the reads just won't be batched */
+            fprintf(stderr, "Failed to set read wakeup policy (%d)\n",
+                    GetLastError());
+        }
+    }
+
+    if (data->capture_flags != 0)
+    {
+        USBPCAP_IOCTL_CAPTURE_FLAGS flags;
+        BOOL success;
+
+        flags.flags = data->capture_flags;
+        success = DeviceIoControl(filter_handle,
+                                  IOCTL_USBPCAP_SET_CAPTURE_FLAGS,
+                                  (char*)&flags,
+                                  sizeof(USBPCAP_IOCTL_CAPTURE_FLAGS),
+                                  NULL,
+                                  0,
+                                  &bytes_ret,
+                                  0);
+        if (!success && (flags.flags & USBPCAP_CAPTURE_FLAG_MAPPED_BUFFER))
+        {
+            /* Driver without mapped buffer support. Read the data instead. */
+            fprintf(stderr, "Zero-copy capture not supported by driver.\n");
+            data->capture_flags &= ~USBPCAP_CAPTURE_FLAG_MAPPED_BUFFER;
+            flags.flags = data->capture_flags;
+            success = (flags.flags == 0) ||
+                      DeviceIoControl(filter_handle,
+                                      IOCTL_USBPCAP_SET_CAPTURE_FLAGS,
+                                      (char*)&flags,
+                                      sizeof(USBPCAP_IOCTL_CAPTURE_FLAGS),
+                                      NULL,
+                                      0,
+                                      &bytes_ret,
+                                      0);
+        }
+
+        if (!success)
+        {
+            fprintf(stderr, "DeviceIoControl failed with %d status (supplimentary code %d)\n",
+                    GetLastError(),
+                    bytes_ret);
+            goto finish;
+        }
+    }
+
+    if (data->filter_program != NULL)
+    {
+        if (!DeviceIoControl(filter_handle,
+                             IOCTL_USBPCAP_SET_FILTER_PROGRAM,
+                             (char*)data->filter_program,
+                             data->filter_program_size,
+                             NULL,
+                             0,
+                             &bytes_ret,
+                             0))
+        {
+            fprintf(stderr, "Failed to set filter program (%d)\n",
+                    GetLastError());
+            goto finish;
+        }
+    }
+
+    if (data->trigger != NULL)
+    {
+        USBPCAP_IOCTL_TRIGGER trigger;
+
+        if (!USBPcapInitTrigger(&trigger, data->trigger))
+        {
+            goto finish;
+        }
+
+        if (!DeviceIoControl(filter_handle,
+                             IOCTL_USBPCAP_SET_TRIGGER,
+                             (char*)&trigger,
+                             sizeof(USBPCAP_IOCTL_TRIGGER),
+                             NULL,
+                             0,
+                             &bytes_ret,
+                             0))
+        {
+            fprintf(stderr, "Failed to set trigger (%d)\n",
+                    GetLastError());
+            goto finish;
+        }
+    }
+
     ((PUSBPCAP_IOCTL_SIZE)inBuf)->size = data->bufferlen;
 
     if (!DeviceIoControl(filter_handle,
@@ -75,14 +251,52 @@ HANDLE create_filter_read_handle(struct thread_data *data)
         goto finish;
     }
 
-    if (!DeviceIoControl(filter_handle,
-                         IOCTL_USBPCAP_START_FILTERING,
-                         (char*)&data->filter,
-                         sizeof(USBPCAP_ADDRESS_FILTER),
-                         NULL,
-                         0,
-                         &bytes_ret,
-                         0))
+    if ((data->capture_flags & USBPCAP_CAPTURE_FLAG_MAPPED_BUFFER) &&
+        map_capture_buffer(filter_handle, data))
+    {
+        if ((data->ring_header->magic != USBPCAP_SHARED_RING_MAGIC) ||
+            (data->ring_header->version != USBPCAP_SHARED_RING_VERSION))
+        {
+            fprintf(stderr, "Unsupported mapped buffer version %d\n",
+                    data->ring_header->version);
+            goto finish;
+        }
+    }
+
+    if ((data->endpoint_list != NULL) || (data->transfer_types != NULL))
+    {
+        USBPCAP_ENDPOINT_FILTER endpoint_filter;
+
+        memcpy(&endpoint_filter.address, &data->filter, sizeof(USBPCAP_ADDRESS_FILTER));
+        if (!USBPcapInitEndpointFilter(&endpoint_filter,
+                                       data->endpoint_list,
+                                       data->transfer_types))
+        {
+            goto finish;
+        }
+
+        if (!DeviceIoControl(filter_handle,
+                             IOCTL_USBPCAP_START_FILTERING,
+                             (char*)&endpoint_filter,
+                             sizeof(USBPCAP_ENDPOINT_FILTER),
+                             NULL,
+                             0,
+                             &bytes_ret,
+                             0))
+        {
+            fprintf(stderr, "Failed to set endpoint filter (%d)\n",
+                    GetLastError());
+            goto finish;
+        }
+    }
+    else if (!DeviceIoControl(filter_handle,
+                              IOCTL_USBPCAP_START_FILTERING,
+                              (char*)&data->filter,
+                              sizeof(USBPCAP_ADDRESS_FILTER),
+                              NULL,
+                              0,
+                              &bytes_ret,
+                              0))
     {
         fprintf(stderr, "DeviceIoControl failed with %d status (supplimentary code %d)\n",
                 GetLastError(),
@@ -99,6 +313,15 @@ finish:
         free(inBuf);
     }
 
+    if (data->ring_event != NULL)
+    {
+        CloseHandle(data->ring_event);
+        data->ring_event = NULL;
+    }
+    /* Mapping is removed by driver when the handle is closed */
+    data->ring_header = NULL;
+    data->ring_consumer = NULL;
+
     if (filter_handle != INVALID_HANDLE_VALUE)
     {
         CloseHandle(filter_handle);
@@ -110,42 +333,53 @@ finish:
 static void write_data(struct thread_data* data, LPOVERLAPPED write_overlapped,
                        void *buffer, DWORD bytes)
 {
-    /* Write data to the end of the file. */
-    write_overlapped->Offset = 0xFFFFFFFF;
-    write_overlapped->OffsetHigh = 0xFFFFFFFF;
-    if (!WriteFile(data->write_handle, buffer, bytes, NULL, write_overlapped))
+    if (!writer_write(&data->writer, write_overlapped, buffer, bytes))
     {
-        DWORD err = GetLastError();
-        if (err == ERROR_IO_PENDING)
-        {
-            DWORD written;
-            if (!GetOverlappedResult(data->write_handle, write_overlapped, &written, TRUE))
-            {
-                fprintf(stderr, "GetOverlappedResult() on write handle failed: %d\n", GetLastError());
-            }
-            else if (written != bytes)
-            {
-                fprintf(stderr, "Wrote %d bytes instead of %d. Stopping capture.\n", written, bytes);
-                data->process = FALSE;
-            }
-        }
-        else
-        {
-            /* Failed to write to output. Quit. */
-            fprintf(stderr, "Write failed (%d). Stopping capture.\n", err);
-            data->process = FALSE;
-        }
+        data->process = FALSE;
+    }
+}
+
+/*
+ * Returns rotation state to pass to the writer, NULL if output is single file.
+ */
+static struct rotate_state *get_rotate_state(struct thread_data *data)
+{
+    return rotate_policy_enabled(&data->rotate.policy) ? &data->rotate : NULL;
+}
+
+static int global_header_length(struct thread_data *data)
+{
+    return (data->capture_flags & USBPCAP_CAPTURE_FLAG_PCAPNG) ?
+           sizeof(USBPCAP_PCAPNG_HEADER) : sizeof(pcap_hdr_t);
+}
+
+/*
+ * Returns TRUE if global header in buf matches the capture format.
+ */
+static BOOL is_usbpcap_header(struct thread_data *data, unsigned char *buf)
+{
+    if (data->capture_flags & USBPCAP_CAPTURE_FLAG_PCAPNG)
+    {
+        PUSBPCAP_PCAPNG_HEADER hdr = (PUSBPCAP_PCAPNG_HEADER)buf;
+        return (hdr->shb.block_type == PCAPNG_BLOCK_TYPE_SHB) &&
+               (hdr->shb.byte_order_magic == PCAPNG_BYTE_ORDER_MAGIC) &&
+               (hdr->idb.linktype == DLT_USBPCAP);
+    }
+    else
+    {
+        pcap_hdr_t *hdr = (pcap_hdr_t *)buf;
+        return (hdr->magic_number == 0xA1B2C3D4) && (hdr->network == DLT_USBPCAP);
     }
-    FlushFileBuffers(data->write_handle);
-    ResetEvent(write_overlapped->hEvent);
 }
 
 static void process_data(struct thread_data* data, LPOVERLAPPED write_overlapped,
                          unsigned char *buffer, DWORD bytes)
 {
-    if (data->descriptors.buf_written < sizeof(pcap_hdr_t))
+    int header_len = global_header_length(data);
+
+    if (data->descriptors.buf_written < header_len)
     {
-        DWORD to_write = sizeof(pcap_hdr_t) - data->descriptors.buf_written;
+        DWORD to_write = header_len - data->descriptors.buf_written;
         if (to_write > bytes)
         {
             to_write = bytes;
@@ -153,14 +387,14 @@ static void process_data(struct thread_data* data, LPOVERLAPPED write_overlapped
         memcpy(&data->descriptors.buf[data->descriptors.buf_written], buffer, to_write);
         data->descriptors.buf_written += to_write;
 
-        if (data->descriptors.buf_written == sizeof(pcap_hdr_t))
+        if (data->descriptors.buf_written == header_len)
         {
-            pcap_hdr_t *hdr = (pcap_hdr_t *)data->descriptors.buf;
-            write_data(data, write_overlapped, data->descriptors.buf, sizeof(pcap_hdr_t));
-            if ((hdr->magic_number == 0xA1B2C3D4) && (hdr->network == DLT_USBPCAP) && (data->descriptors.descriptors_len > 0))
+            write_data(data, write_overlapped, data->descriptors.buf, header_len);
+            if (is_usbpcap_header(data, data->descriptors.buf) && (data->descriptors.descriptors_len > 0))
             {
                 write_data(data, write_overlapped, data->descriptors.descriptors, data->descriptors.descriptors_len);
             }
+            writer_begin_records(&data->writer);
         }
         buffer += to_write;
         bytes -= to_write;
@@ -174,30 +408,307 @@ static void process_data(struct thread_data* data, LPOVERLAPPED write_overlapped
     write_data(data, write_overlapped, buffer, bytes);
 }
 
+/*
+ * Reads writeOffset from the read-only mapping. Interlocked operations
+ * cannot be used there, they always write. Driver updates the value
+ * atomically and never decreases it, so on 32-bit systems the high part
+ * is read again to detect a torn read.
+ */
+static INT64 read_write_offset(PUSBPCAP_SHARED_RING_HEADER header)
+{
+#if defined(_WIN64)
+    INT64 value = header->writeOffset;
+    MemoryBarrier();
+    return value;
+#else
+    volatile LONG *parts = (volatile LONG *)&header->writeOffset;
+    LONG high;
+    LONG low;
+
+    do
+    {
+        high = parts[1];
+        MemoryBarrier();
+        low = parts[0];
+        MemoryBarrier();
+    }
+    while (high != parts[1]);
+
+    return ((INT64)high << 32) | (ULONG)low;
+#endif
+}
+
+/*
+ * Writes out all data available in mapped buffer.
+ * Sets consumerWaiting before returning, so driver signals ring_event
+ * once new data arrives.
+ */
+static void process_mapped_data(struct thread_data* data, LPOVERLAPPED write_overlapped)
+{
+    PUSBPCAP_SHARED_RING_HEADER header = data->ring_header;
+    PUSBPCAP_SHARED_RING_CONSUMER consumer = data->ring_consumer;
+    unsigned char *ring = (unsigned char *)header + header->dataOffset;
+    INT64 read = consumer->readOffset;
+    INT64 write;
+
+    while (data->process == TRUE)
+    {
+        write = read_write_offset(header);
+        if (write == read)
+        {
+            /* Driver checks consumerWaiting only after updating writeOffset.
+             * Check writeOffset again so the update is not missed.
+             */
+            InterlockedExchange(&consumer->consumerWaiting, 1);
+            write = read_write_offset(header);
+            if (write == read)
+            {
+                break;
+            }
+            InterlockedExchange(&consumer->consumerWaiting, 0);
+        }
+
+        while ((read != write) && (data->process == TRUE))
+        {
+            DWORD index = (DWORD)(read % header->dataSize);
+            DWORD bytes = header->dataSize - index;
+
+            if ((INT64)bytes > write - read)
+            {
+                bytes = (DWORD)(write - read);
+            }
+
+            /* Data is written straight from the mapped buffer */
+            process_data(data, write_overlapped, &ring[index], bytes);
+            read += bytes;
+        }
+
+        /* Release the space to driver. InterlockedExchange64() is not
+         * available on 32-bit Windows XP.
+         */
+        {
+            INT64 old;
+            do
+            {
+                old = InterlockedCompareExchange64(&consumer->readOffset, 0, 0);
+            }
+            while (InterlockedCompareExchange64(&consumer->readOffset, read, old) != old);
+        }
+    }
+}
+
+static BOOL get_statistics(struct thread_data *data,
+                           PUSBPCAP_IOCTL_STATISTICS stats)
+{
+    DWORD bytes_ret = 0;
+
+    if (!DeviceIoControl(data->read_handle,
+                         IOCTL_USBPCAP_GET_STATISTICS,
+                         NULL,
+                         0,
+                         (char*)stats,
+                         sizeof(USBPCAP_IOCTL_STATISTICS),
+                         &bytes_ret,
+                         0) ||
+        (bytes_ret != sizeof(USBPCAP_IOCTL_STATISTICS)))
+    {
+        fprintf(stderr, "Failed to get capture statistics (%d)\n", GetLastError());
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Prints driver capture statistics to stderr.
+ */
+static void print_statistics(struct thread_data *data)
+{
+    USBPCAP_IOCTL_STATISTICS stats;
+
+    if (!get_statistics(data, &stats))
+    {
+        return;
+    }
+
+    fprintf(stderr, "Captured %I64u packets, dropped %I64u packets (%I64u bytes), "
+                    "evicted %I64u packets (%I64u bytes), "
+                    "unpaired %I64u URBs, "
+                    "buffer high-water %u/%u bytes, pending reads %u\n",
+            stats.packetsCaptured, stats.packetsDropped, stats.bytesDropped,
+            stats.packetsEvicted, stats.bytesEvicted, stats.urbsUnpaired,
+            stats.bufferHighWater, stats.bufferSize, stats.pendingReads);
+}
+
+/*
+ * Returns current system time in FILETIME units.
+ */
+static UINT64 get_current_filetime(void)
+{
+    FILETIME ts;
+    ULARGE_INTEGER timestamp;
+
+    GetSystemTimeAsFileTime(&ts);
+    timestamp.LowPart = ts.dwLowDateTime;
+    timestamp.HighPart = ts.dwHighDateTime;
+    return timestamp.QuadPart;
+}
+
+/*
+ * Writes pcapng Interface Statistics Block with counters of the filter
+ * source is reading from.
+ */
+static void write_interface_statistics(struct thread_data *data,
+                                       struct thread_data *source,
+                                       UINT32 interface_id,
+                                       LPOVERLAPPED write_overlapped)
+{
+    USBPCAP_IOCTL_STATISTICS stats;
+    unsigned char *isb;
+    UINT32 length;
+
+    if (!get_statistics(source, &stats))
+    {
+        return;
+    }
+
+    isb = (unsigned char *)malloc(pcapng_isb_length());
+    if (isb == NULL)
+    {
+        return;
+    }
+
+    length = pcapng_write_isb(isb, interface_id,
+                              pcapng_timestamp_from_filetime(get_current_filetime()),
+                              stats.packetsCaptured,
+                              stats.packetsDropped + stats.packetsEvicted);
+    write_data(data, write_overlapped, isb, length);
+    free(isb);
+}
+
+/*
+ * Returns number of milliseconds until next statistics line is due or
+ * INFINITE if statistics are disabled.
+ */
+static DWORD statistics_timeout(DWORD interval, DWORD last_stats)
+{
+    DWORD elapsed;
+
+    if (interval == 0)
+    {
+        return INFINITE;
+    }
+
+    elapsed = GetTickCount() - last_stats;
+    if (elapsed >= interval)
+    {
+        return 0;
+    }
+
+    return interval - elapsed;
+}
+
+struct write_thread_data
+{
+    struct thread_data *data;
+    struct pipeline *pipeline;
+    HANDLE stop_event; /* Set when reader is done */
+};
+
+/*
+ * Writes out buffers filled by read_thread.
+ */
+static DWORD WINAPI write_thread(LPVOID param)
+{
+    struct write_thread_data *wdata = (struct write_thread_data*)param;
+    struct thread_data *data = wdata->data;
+    struct pipeline_buffer *buffer;
+    OVERLAPPED write_overlapped;
+    HANDLE table[2];
+    BOOL stopping = FALSE;
+
+    memset(&write_overlapped, 0, sizeof(write_overlapped));
+    write_overlapped.hEvent = CreateEvent(NULL,
+                                          TRUE /* Manual Reset */,
+                                          FALSE /* Default non signaled */,
+                                          NULL /* No name */);
+
+    table[0] = wdata->pipeline->filled_sem;
+    table[1] = wdata->stop_event;
+
+    for (;;)
+    {
+        DWORD dw;
+
+        if (stopping)
+        {
+            /* Write out what was already read, then quit */
+            dw = WaitForSingleObject(table[0], 0);
+        }
+        else
+        {
+            dw = WaitForMultipleObjects(2, table, FALSE,
+                                        writer_flush_timeout(&data->writer));
+        }
+
+        if (dw == WAIT_OBJECT_0)
+        {
+            buffer = pipeline_get_filled(wdata->pipeline);
+            if (buffer->length > 0)
+            {
+                process_data(data, &write_overlapped, buffer->data, buffer->length);
+            }
+            pipeline_release(wdata->pipeline);
+
+            if (data->writer.failed)
+            {
+                /* read_thread notices that this thread has quit */
+                break;
+            }
+        }
+        else if (dw == WAIT_OBJECT_0 + 1)
+        {
+            stopping = TRUE;
+        }
+        else if ((dw == WAIT_TIMEOUT) && !stopping)
+        {
+            /* No data written for a while, flush what is there */
+            writer_flush(&data->writer);
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    CloseHandle(write_overlapped.hEvent);
+    return 0;
+}
+
 DWORD WINAPI read_thread(LPVOID param)
 {
     struct thread_data* data = (struct thread_data*)param;
-    unsigned char* buffer;
+    struct pipeline pipeline;
+    struct pipeline_buffer *pending;
+    struct write_thread_data wdata;
+    HANDLE writer_thread = NULL;
     DWORD dummy_read;
     unsigned char dummy_buf;
-    OVERLAPPED read_overlapped;
     OVERLAPPED write_overlapped;
     OVERLAPPED connect_overlapped;
     OVERLAPPED write_handle_read_overlapped; /* Used to detect broken pipe. */
+    BOOL connected = TRUE;
+    BOOL watch_write_handle = FALSE;
     DWORD read;
     DWORD err;
-    HANDLE table[5];
-    int table_count = 0;
-
-    memset(&table, 0, sizeof(table));
+    BOOL read_from_filter = FALSE;
+    DWORD stats_interval = 0; /* in milliseconds */
+    DWORD last_stats = 0;
+    HANDLE table[6];
+    int table_count;
 
-    buffer = malloc(data->bufferlen);
-    if (buffer == NULL)
-    {
-        fprintf(stderr, "Failed to allocate user-mode buffer (length %d)\n",
-                data->bufferlen);
-        goto finish;
-    }
+    memset(&pipeline, 0, sizeof(pipeline));
+    memset(&wdata, 0, sizeof(wdata));
 
     if (data->read_handle == INVALID_HANDLE_VALUE)
     {
@@ -211,14 +722,38 @@ DWORD WINAPI read_thread(LPVOID param)
         goto finish;
     }
 
-    memset(&read_overlapped, 0, sizeof(read_overlapped));
+    writer_init(&data->writer, data->write_handle, &data->flush,
+                get_rotate_state(data));
+
+    /* Mapped buffer is written out directly by this thread */
+    if (data->ring_header == NULL)
+    {
+        if (FALSE == pipeline_init(&pipeline, data->outstanding_reads, data->bufferlen))
+        {
+            fprintf(stderr, "Failed to allocate user-mode buffers (%d x %d)\n",
+                    data->outstanding_reads, data->bufferlen);
+            goto finish;
+        }
+
+        wdata.data = data;
+        wdata.pipeline = &pipeline;
+        wdata.stop_event = CreateEvent(NULL,
+                                       TRUE /* Manual Reset */,
+                                       FALSE /* Default non signaled */,
+                                       NULL /* No name */);
+        writer_thread = CreateThread(NULL, 0, write_thread, &wdata, 0, NULL);
+        if (writer_thread == NULL)
+        {
+            fprintf(stderr, "Failed to create writer thread\n");
+            CloseHandle(wdata.stop_event);
+            pipeline_free(&pipeline);
+            goto finish;
+        }
+    }
+
     memset(&connect_overlapped, 0, sizeof(connect_overlapped));
     memset(&write_overlapped, 0, sizeof(write_overlapped));
     memset(&write_handle_read_overlapped, 0, sizeof(write_handle_read_overlapped));
-    read_overlapped.hEvent = CreateEvent(NULL,
-                                         TRUE /* Manual Reset */,
-                                         FALSE /* Default non signaled */,
-                                         NULL /* No name */);
     connect_overlapped.hEvent = CreateEvent(NULL,
                                             TRUE /* Manual Reset */,
                                             FALSE /* Default non signaled */,
@@ -231,29 +766,18 @@ DWORD WINAPI read_thread(LPVOID param)
                                                       TRUE /* Manual Reset */,
                                                       FALSE /* Default non signaled */,
                                                       NULL /* No name */);
-    table[table_count] = read_overlapped.hEvent;
-    table_count++;
-    table[table_count] = write_overlapped.hEvent;
-    table_count++;
     if (GetFileType(data->write_handle) == FILE_TYPE_PIPE)
     {
         /* Setup dummy reads from write handle so we can detect broken pipe
          * even ifthere isn't any data read from read handle.
          */
-        table[table_count] = write_handle_read_overlapped.hEvent;
-        table_count++;
+        watch_write_handle = TRUE;
         ReadFile(data->write_handle, &dummy_buf, sizeof(dummy_buf), NULL, &write_handle_read_overlapped);
     }
-    if (data->exit_event != INVALID_HANDLE_VALUE)
-    {
-        table[table_count] = data->exit_event;
-        table_count++;
-    }
 
     if (GetFileType(data->read_handle) == FILE_TYPE_PIPE)
     {
-        table[table_count] = connect_overlapped.hEvent;
-        table_count++;
+        connected = FALSE;
         if (!ConnectNamedPipe(data->read_handle, &connect_overlapped))
         {
             err = GetLastError();
@@ -266,32 +790,123 @@ DWORD WINAPI read_thread(LPVOID param)
     }
     else
     {
-        ReadFile(data->read_handle, (PVOID)buffer, data->bufferlen, NULL, &read_overlapped);
+        /* Statistics are available only on the filter handle */
+        read_from_filter = TRUE;
+        stats_interval = data->stats_interval * 1000;
+        last_stats = GetTickCount();
+
+        if (data->ring_header != NULL)
+        {
+            /* Write out data captured so far and request notification */
+            process_mapped_data(data, &write_overlapped);
+        }
     }
 
     for (; data->process == TRUE;)
     {
         DWORD dw;
+        DWORD timeout;
 
-        dw = WaitForMultipleObjects(table_count,
-                                    table,
-                                    FALSE,
-                                    INFINITE);
-#pragma warning(default : 4296)
-        if ((dw >= WAIT_OBJECT_0) && dw < (WAIT_OBJECT_0 + table_count))
+        /* Oldest pending read changes as reads complete, rebuild the table */
+        table_count = 0;
+        pending = NULL;
+        if (data->ring_header != NULL)
         {
-            int i = dw - WAIT_OBJECT_0;
-            if (table[i] == read_overlapped.hEvent)
+            table[table_count] = data->ring_event;
+            table_count++;
+        }
+        else if (connected)
+        {
+            pending = pipeline_pending_read(&pipeline);
+            if (pending != NULL)
             {
-                GetOverlappedResult(data->read_handle, &read_overlapped, &read, TRUE);
-                ResetEvent(read_overlapped.hEvent);
-                process_data(data, &write_overlapped, buffer, read);
-                /* Start new read. */
-                ReadFile(data->read_handle, (PVOID)buffer, data->bufferlen, &read, &read_overlapped);
+                table[table_count] = pending->overlapped.hEvent;
+                table_count++;
             }
-            else if (table[i] == write_overlapped.hEvent)
+            table[table_count] = pipeline.free_sem;
+            table_count++;
+        }
+        if (writer_thread != NULL)
+        {
+            table[table_count] = writer_thread;
+            table_count++;
+        }
+        if (watch_write_handle)
+        {
+            table[table_count] = write_handle_read_overlapped.hEvent;
+            table_count++;
+        }
+        if (data->exit_event != INVALID_HANDLE_VALUE)
+        {
+            table[table_count] = data->exit_event;
+            table_count++;
+        }
+        if (!connected)
+        {
+            table[table_count] = connect_overlapped.hEvent;
+            table_count++;
+        }
+
+        timeout = statistics_timeout(stats_interval, last_stats);
+        if (writer_thread == NULL)
+        {
+            timeout = min(timeout, writer_flush_timeout(&data->writer));
+        }
+
+        dw = WaitForMultipleObjects(table_count,
+                                    table,
+                                    FALSE,
+                                    timeout);
+#pragma warning(default : 4296)
+        if ((dw >= WAIT_OBJECT_0) && dw < (WAIT_OBJECT_0 + table_count))
+        {
+            int i = dw - WAIT_OBJECT_0;
+            if ((data->ring_header != NULL) && (table[i] == data->ring_event))
             {
-                ResetEvent(write_overlapped.hEvent);
+                /* Auto reset event */
+                process_mapped_data(data, &write_overlapped);
+            }
+            else if ((pending != NULL) && (table[i] == pending->overlapped.hEvent))
+            {
+                if (!GetOverlappedResult(data->read_handle, &pending->overlapped, &read, TRUE))
+                {
+                    read = 0;
+                    if (GetLastError() == ERROR_BROKEN_PIPE)
+                    {
+                        data->process = FALSE;
+                    }
+                }
+                else if ((read == 0) && read_from_filter && (data->trigger != NULL))
+                {
+                    /* Whole trigger window was read, driver stopped capturing */
+                    data->process = FALSE;
+                }
+                ResetEvent(pending->overlapped.hEvent);
+                /* Pass the data to writer thread */
+                pipeline_complete_read(&pipeline, read);
+            }
+            else if ((writer_thread != NULL) && (table[i] == pipeline.free_sem))
+            {
+                struct pipeline_buffer *buffer = pipeline_start_read(&pipeline);
+
+                /* Keep multiple reads outstanding so the driver always has
+                 * a buffer to complete while the writer is busy.
+                 */
+                if (!ReadFile(data->read_handle, (PVOID)buffer->data, pipeline.size, NULL, &buffer->overlapped))
+                {
+                    err = GetLastError();
+                    if (err != ERROR_IO_PENDING)
+                    {
+                        fprintf(stderr, "ReadFile() failed with code %d\n", err);
+                        SetEvent(buffer->overlapped.hEvent);
+                        data->process = FALSE;
+                    }
+                }
+            }
+            else if (table[i] == writer_thread)
+            {
+                /* Writer thread quits only on write failure */
+                data->process = FALSE;
             }
             else if (table[i] == write_handle_read_overlapped.hEvent)
             {
@@ -319,7 +934,22 @@ DWORD WINAPI read_thread(LPVOID param)
             {
                 ResetEvent(connect_overlapped.hEvent);
                 /* Start reading data. */
-                ReadFile(data->read_handle, (PVOID)buffer, data->bufferlen, &read, &read_overlapped);
+                connected = TRUE;
+            }
+        }
+        else if (dw == WAIT_TIMEOUT)
+        {
+            if (statistics_timeout(stats_interval, last_stats) == 0)
+            {
+                print_statistics(data);
+                last_stats = GetTickCount();
+            }
+
+            if ((writer_thread == NULL) &&
+                (writer_flush_timeout(&data->writer) == 0))
+            {
+                /* No data written for a while, flush what is there */
+                writer_flush(&data->writer);
             }
         }
         else if (dw == WAIT_FAILED)
@@ -329,19 +959,52 @@ DWORD WINAPI read_thread(LPVOID param)
         }
     }
 
+    if (stats_interval != 0)
+    {
+        /* Final counters, so drops at the end of capture are reported */
+        print_statistics(data);
+    }
+
     CancelIo(data->read_handle);
-    CancelIo(data->write_handle);
-    CloseHandle(read_overlapped.hEvent);
+    if (writer_thread != NULL)
+    {
+        /* Wait for cancelled reads, buffers cannot be freed before */
+        while ((pending = pipeline_pending_read(&pipeline)) != NULL)
+        {
+            if (!GetOverlappedResult(data->read_handle, &pending->overlapped, &read, TRUE))
+            {
+                read = 0;
+            }
+            pipeline_complete_read(&pipeline, read);
+        }
+
+        SetEvent(wdata.stop_event);
+        WaitForSingleObject(writer_thread, INFINITE);
+        CloseHandle(writer_thread);
+        CloseHandle(wdata.stop_event);
+        pipeline_free(&pipeline);
+    }
+    if (read_from_filter && (data->capture_flags & USBPCAP_CAPTURE_FLAG_PCAPNG) &&
+        (data->descriptors.buf_written == global_header_length(data)) &&
+        !data->writer.failed)
+    {
+        /* All data is written out, close the capture with statistics */
+        write_interface_statistics(data, data, 0, &write_overlapped);
+    }
+    CancelIo(data->writer.handle);
+    writer_close(&data->writer);
+    /* Rotation switches the files, the last one is closed by main thread */
+    data->write_handle = data->writer.handle;
     CloseHandle(connect_overlapped.hEvent);
     CloseHandle(write_overlapped.hEvent);
     CloseHandle(write_handle_read_overlapped.hEvent);
-
-finish:
-    if (buffer != NULL)
+    if (data->ring_event != NULL)
     {
-        free(buffer);
+        CloseHandle(data->ring_event);
+        data->ring_event = NULL;
     }
 
+finish:
     /* Notify main thread that we are done.
      * If we are exiting due to exit_event being set by another thread,
      * setting the exit_event here isn't a problem (it is already set).
@@ -353,3 +1016,653 @@ finish:
 
     return 0;
 }
+
+/* Records are held back in merged capture for this long, waiting for
+ * older records from root hubs that have no data ready.
+ */
+#define MERGE_HOLDBACK_MS 200
+
+struct hub_source
+{
+    struct thread_data data; /* Capture settings with single device */
+    OVERLAPPED overlapped;
+    unsigned char *buffer;   /* data.bufferlen bytes */
+    DWORD start;             /* First byte not written out yet */
+    DWORD end;               /* First byte not filled with data */
+    BOOL pending;            /* Read in progress */
+    BOOL active;             /* FALSE once the reads failed */
+    BOOL in_heap;            /* Oldest record is in merge heap */
+    BOOL header_skipped;     /* Global header was removed from data */
+};
+
+/*
+ * Checks if there is complete record at the start of hub data.
+ * Skips the global header first, merged output has its own.
+ */
+static BOOL hub_peek_record(struct hub_source *hub, UINT64 *timestamp, DWORD *length)
+{
+    DWORD available = hub->end - hub->start;
+    DWORD header_len = (DWORD)global_header_length(&hub->data);
+    unsigned char *record;
+
+    if (!hub->header_skipped)
+    {
+        if (available < header_len)
+        {
+            return FALSE;
+        }
+        hub->start += header_len;
+        available -= header_len;
+        hub->header_skipped = TRUE;
+    }
+
+    record = &hub->buffer[hub->start];
+    if (hub->data.capture_flags & USBPCAP_CAPTURE_FLAG_PCAPNG)
+    {
+        pcapng_epb_t epb;
+
+        if (available < sizeof(epb))
+        {
+            return FALSE;
+        }
+        memcpy(&epb, record, sizeof(epb));
+        *timestamp = ((UINT64)epb.timestamp_high << 32) | epb.timestamp_low;
+        *length = epb.block_total_length;
+    }
+    else
+    {
+        pcaprec_hdr_t hdr;
+
+        if (available < sizeof(hdr))
+        {
+            return FALSE;
+        }
+        memcpy(&hdr, record, sizeof(hdr));
+        *timestamp = ((UINT64)hdr.ts_sec * 1000000) + hdr.ts_usec;
+        *length = sizeof(hdr) + hdr.incl_len;
+    }
+
+    return (available >= *length) ? TRUE : FALSE;
+}
+
+/*
+ * Reads more data after the incomplete record.
+ */
+static void hub_start_read(struct hub_source *hub)
+{
+    DWORD err;
+
+    if (hub->start > 0)
+    {
+        memmove(hub->buffer, &hub->buffer[hub->start], hub->end - hub->start);
+        hub->end -= hub->start;
+        hub->start = 0;
+    }
+
+    if (hub->end == hub->data.bufferlen)
+    {
+        fprintf(stderr, "%s: Record does not fit into buffer. Stopping capture from this Root Hub.\n",
+                hub->data.device);
+        hub->active = FALSE;
+        return;
+    }
+
+    ResetEvent(hub->overlapped.hEvent);
+    if (!ReadFile(hub->data.read_handle, &hub->buffer[hub->end],
+                  hub->data.bufferlen - hub->end, NULL, &hub->overlapped))
+    {
+        err = GetLastError();
+        if (err != ERROR_IO_PENDING)
+        {
+            fprintf(stderr, "%s: ReadFile() failed with code %d\n",
+                    hub->data.device, err);
+            hub->active = FALSE;
+            return;
+        }
+    }
+    hub->pending = TRUE;
+}
+
+static void hub_complete_read(struct hub_source *hub, BOOL wait)
+{
+    DWORD read;
+
+    if (!GetOverlappedResult(hub->data.read_handle, &hub->overlapped, &read, wait))
+    {
+        if (hub->active && (GetLastError() != ERROR_OPERATION_ABORTED))
+        {
+            fprintf(stderr, "%s: Read failed with code %d\n",
+                    hub->data.device, GetLastError());
+        }
+        read = 0;
+        hub->active = FALSE;
+    }
+    hub->pending = FALSE;
+    hub->end += read;
+}
+
+struct merge_output
+{
+    struct thread_data *data;
+    LPOVERLAPPED write_overlapped;
+    unsigned char *buffer; /* data->bufferlen bytes */
+    DWORD length;
+};
+
+static void merge_output_flush(struct merge_output *out)
+{
+    if (out->length > 0)
+    {
+        write_data(out->data, out->write_overlapped, out->buffer, out->length);
+        out->length = 0;
+    }
+}
+
+/*
+ * Appends record to output. In pcapng mode the Enhanced Packet Blocks are
+ * moved to interface_id (every Root Hub has its own interface).
+ */
+static void merge_output_record(struct merge_output *out, BOOL pcapng,
+                                UINT32 interface_id, unsigned char *record,
+                                DWORD length)
+{
+    if (out->length + length > out->data->bufferlen)
+    {
+        merge_output_flush(out);
+    }
+
+    memcpy(&out->buffer[out->length], record, length);
+    if (pcapng)
+    {
+        pcapng_epb_t *epb = (pcapng_epb_t *)&out->buffer[out->length];
+        if (epb->block_type == PCAPNG_BLOCK_TYPE_EPB)
+        {
+            epb->interface_id = interface_id;
+        }
+    }
+    out->length += length;
+}
+
+/*
+ * Writes merged output global header: pcap header or pcapng Section
+ * Header Block followed by Interface Description Block for every hub.
+ */
+static void merge_write_header(struct merge_output *out,
+                               struct hub_source *hubs, int hub_count)
+{
+    struct thread_data *data = out->data;
+    int i;
+
+    if (data->capture_flags & USBPCAP_CAPTURE_FLAG_PCAPNG)
+    {
+        unsigned char *block;
+        UINT32 length;
+
+        length = pcapng_shb_length();
+        for (i = 0; i < hub_count; i++)
+        {
+            if (length < pcapng_idb_length(hubs[i].data.device))
+            {
+                length = pcapng_idb_length(hubs[i].data.device);
+            }
+        }
+
+        block = (unsigned char *)malloc(length);
+        if (block == NULL)
+        {
+            data->process = FALSE;
+            return;
+        }
+
+        length = pcapng_write_shb(block);
+        write_data(data, out->write_overlapped, block, length);
+        for (i = 0; i < hub_count; i++)
+        {
+            length = pcapng_write_idb(block, DLT_USBPCAP, data->snaplen,
+                                      USBPCAP_PCAPNG_TSRESOL,
+                                      hubs[i].data.device);
+            write_data(data, out->write_overlapped, block, length);
+        }
+        free(block);
+    }
+    else
+    {
+        pcap_hdr_t hdr;
+
+        hdr.magic_number = 0xA1B2C3D4;
+        hdr.version_major = 2;
+        hdr.version_minor = 4;
+        hdr.thiszone = 0;
+        hdr.sigfigs = 0;
+        hdr.snaplen = data->snaplen;
+        hdr.network = DLT_USBPCAP;
+        write_data(data, out->write_overlapped, &hdr, sizeof(hdr));
+    }
+}
+
+/*
+ * Writes descriptors of devices connected to every hub. Descriptors are
+ * generated for interface 0 and have to be moved to hub interface.
+ */
+static void merge_write_descriptors(struct merge_output *out,
+                                    struct hub_source *hubs, int hub_count)
+{
+    BOOL pcapng = (out->data->capture_flags & USBPCAP_CAPTURE_FLAG_PCAPNG) ? TRUE : FALSE;
+    int i;
+
+    for (i = 0; i < hub_count; i++)
+    {
+        unsigned char *packets;
+        int length;
+        int offset = 0;
+
+        packets = (unsigned char *)
+            descriptors_generate_pcap(hubs[i].data.device, &length,
+                                      &hubs[i].data.filter, pcapng);
+        if (packets == NULL)
+        {
+            continue;
+        }
+
+        while (offset < length)
+        {
+            DWORD record_len;
+
+            if (pcapng)
+            {
+                record_len = ((pcapng_epb_t *)&packets[offset])->block_total_length;
+            }
+            else
+            {
+                record_len = sizeof(pcaprec_hdr_t) +
+                             ((pcaprec_hdr_t *)&packets[offset])->incl_len;
+            }
+            merge_output_record(out, pcapng, i, &packets[offset], record_len);
+            offset += record_len;
+        }
+        descriptors_free_pcap(packets);
+    }
+    merge_output_flush(out);
+}
+
+/*
+ * Writes out records in timestamp order. Records are written only if every
+ * active hub has data ready or the record is older than holdback.
+ * If holdback is 0, all complete records are written.
+ *
+ * Returns number of milliseconds until the oldest held back record has to
+ * be written or INFINITE if there is no such record.
+ */
+static DWORD merge_records(struct merge_output *out, struct merge_heap *heap,
+                           struct hub_source *hubs, int hub_count,
+                           UINT64 holdback)
+{
+    BOOL pcapng = (out->data->capture_flags & USBPCAP_CAPTURE_FLAG_PCAPNG) ? TRUE : FALSE;
+    UINT64 units_per_ms = pcapng ? 10000 : 1000;
+    UINT64 now;
+    UINT64 timestamp;
+    DWORD length;
+    int waiting;
+    int source;
+    int i;
+
+    now = pcapng_timestamp_from_filetime(get_current_filetime());
+    if (!pcapng)
+    {
+        /* Classic pcap timestamps are in microseconds */
+        now /= 10;
+    }
+
+    while (merge_peek(heap, &source, &timestamp))
+    {
+        struct hub_source *hub;
+
+        waiting = 0;
+        for (i = 0; i < hub_count; i++)
+        {
+            if (hubs[i].active && !hubs[i].in_heap)
+            {
+                waiting++;
+            }
+        }
+
+        if ((holdback > 0) && (waiting > 0) && (timestamp + holdback > now))
+        {
+            return (DWORD)((timestamp + holdback - now) / units_per_ms) + 1;
+        }
+
+        hub = &hubs[source];
+        hub_peek_record(hub, &timestamp, &length);
+        merge_output_record(out, pcapng, source, &hub->buffer[hub->start], length);
+        hub->start += length;
+
+        merge_pop(heap);
+        hub->in_heap = FALSE;
+        if (hub_peek_record(hub, &timestamp, &length))
+        {
+            merge_push(heap, source, timestamp);
+            hub->in_heap = TRUE;
+        }
+    }
+
+    return INFINITE;
+}
+
+/*
+ * Captures from every device in comma separated data->device list and
+ * writes single time-ordered output.
+ */
+DWORD WINAPI merge_thread(LPVOID param)
+{
+    struct thread_data* data = (struct thread_data*)param;
+    struct hub_source *hubs = NULL;
+    int hub_count = 0;
+    struct merge_heap heap;
+    struct merge_output out;
+    OVERLAPPED write_overlapped;
+    OVERLAPPED write_handle_read_overlapped; /* Used to detect broken pipe. */
+    BOOL watch_write_handle = FALSE;
+    unsigned char dummy_buf;
+    DWORD dummy_read;
+    DWORD err;
+    HANDLE table[MAXIMUM_WAIT_OBJECTS];
+    int table_hub[MAXIMUM_WAIT_OBJECTS];
+    int table_count;
+    UINT64 holdback;
+    DWORD stats_interval = data->stats_interval * 1000;
+    DWORD last_stats = GetTickCount();
+    const char *device;
+    int i;
+
+    memset(&heap, 0, sizeof(heap));
+    memset(&out, 0, sizeof(out));
+    memset(&write_overlapped, 0, sizeof(write_overlapped));
+    memset(&write_handle_read_overlapped, 0, sizeof(write_handle_read_overlapped));
+
+    for (device = data->device; device != NULL; device = strchr(device, ','))
+    {
+        if (*device == ',')
+        {
+            device++;
+        }
+        hub_count++;
+    }
+
+    /* Exit event and write handle are waited for together with hub reads */
+    if (hub_count > MAXIMUM_WAIT_OBJECTS - 2)
+    {
+        fprintf(stderr, "Too many Root Hubs to capture from (%d)\n", hub_count);
+        goto finish;
+    }
+
+    hubs = (struct hub_source *)calloc(hub_count, sizeof(struct hub_source));
+    out.buffer = (unsigned char *)malloc(data->bufferlen);
+    write_overlapped.hEvent = CreateEvent(NULL,
+                                          TRUE /* Manual Reset */,
+                                          FALSE /* Default non signaled */,
+                                          NULL /* No name */);
+    if ((hubs == NULL) || (out.buffer == NULL) ||
+        (FALSE == merge_init(&heap, hub_count)))
+    {
+        fprintf(stderr, "Failed to allocate merge buffers\n");
+        hub_count = 0;
+        goto finish;
+    }
+    out.data = data;
+    out.write_overlapped = &write_overlapped;
+
+    device = data->device;
+    for (i = 0; i < hub_count; i++)
+    {
+        const char *next = strchr(device, ',');
+        size_t len = (next == NULL) ? strlen(device) : (size_t)(next - device);
+        struct hub_source *hub = &hubs[i];
+
+        hub->data = *data;
+        hub->data.device = (char *)malloc(len + 1);
+        hub->data.read_handle = INVALID_HANDLE_VALUE;
+        hub->buffer = (unsigned char *)malloc(data->bufferlen);
+        hub->overlapped.hEvent = CreateEvent(NULL,
+                                             TRUE /* Manual Reset */,
+                                             FALSE /* Default non signaled */,
+                                             NULL /* No name */);
+        if ((hub->data.device == NULL) || (hub->buffer == NULL))
+        {
+            fprintf(stderr, "Failed to allocate merge buffers\n");
+            hub_count = i + 1;
+            goto finish;
+        }
+        memcpy(hub->data.device, device, len);
+        hub->data.device[len] = '\0';
+
+        hub->data.read_handle = create_filter_read_handle(&hub->data);
+        if (hub->data.read_handle == INVALID_HANDLE_VALUE)
+        {
+            fprintf(stderr, "Failed to start capture on %s\n", hub->data.device);
+            hub_count = i + 1;
+            goto finish;
+        }
+        hub->active = TRUE;
+
+        device = (next == NULL) ? NULL : next + 1;
+    }
+
+    holdback = MERGE_HOLDBACK_MS;
+    if (data->wakeup_bytes > 1)
+    {
+        /* Driver may keep the data for up to wakeup_latency */
+        holdback += data->wakeup_latency / 1000;
+    }
+    holdback *= (data->capture_flags & USBPCAP_CAPTURE_FLAG_PCAPNG) ? 10000 : 1000;
+
+    write_handle_read_overlapped.hEvent = CreateEvent(NULL,
+                                                      TRUE /* Manual Reset */,
+                                                      FALSE /* Default non signaled */,
+                                                      NULL /* No name */);
+    if (GetFileType(data->write_handle) == FILE_TYPE_PIPE)
+    {
+        /* Detect broken pipe even if there is no data to write */
+        watch_write_handle = TRUE;
+        ReadFile(data->write_handle, &dummy_buf, sizeof(dummy_buf), NULL, &write_handle_read_overlapped);
+    }
+
+    writer_init(&data->writer, data->write_handle, &data->flush,
+                get_rotate_state(data));
+    merge_write_header(&out, hubs, hub_count);
+    if (data->inject_descriptors)
+    {
+        merge_write_descriptors(&out, hubs, hub_count);
+    }
+    writer_begin_records(&data->writer);
+
+    while (data->process == TRUE)
+    {
+        DWORD timeout;
+        DWORD dw;
+        BOOL any_active = FALSE;
+
+        for (i = 0; i < hub_count; i++)
+        {
+            if (hubs[i].active && !hubs[i].pending && !hubs[i].in_heap)
+            {
+                hub_start_read(&hubs[i]);
+            }
+            any_active |= hubs[i].active;
+        }
+
+        if (!any_active)
+        {
+            fprintf(stderr, "No Root Hub left to capture from.\n");
+            break;
+        }
+
+        timeout = merge_records(&out, &heap, hubs, hub_count, holdback);
+        merge_output_flush(&out);
+        timeout = min(timeout, statistics_timeout(stats_interval, last_stats));
+        timeout = min(timeout, writer_flush_timeout(&data->writer));
+
+        table_count = 0;
+        for (i = 0; i < hub_count; i++)
+        {
+            if (hubs[i].pending)
+            {
+                table[table_count] = hubs[i].overlapped.hEvent;
+                table_hub[table_count] = i;
+                table_count++;
+            }
+        }
+        if (watch_write_handle)
+        {
+            table[table_count] = write_handle_read_overlapped.hEvent;
+            table_hub[table_count] = -1;
+            table_count++;
+        }
+        if (data->exit_event != INVALID_HANDLE_VALUE)
+        {
+            table[table_count] = data->exit_event;
+            table_hub[table_count] = -1;
+            table_count++;
+        }
+
+        dw = WaitForMultipleObjects(table_count, table, FALSE, timeout);
+#pragma warning(default : 4296)
+        if ((dw >= WAIT_OBJECT_0) && dw < (WAIT_OBJECT_0 + table_count))
+        {
+            int index = dw - WAIT_OBJECT_0;
+            struct hub_source *hub;
+            UINT64 timestamp;
+            DWORD length;
+
+            if (table[index] == write_handle_read_overlapped.hEvent)
+            {
+                /* Most likely broken pipe detected */
+                GetOverlappedResult(data->write_handle, &write_handle_read_overlapped, &dummy_read, TRUE);
+                err = GetLastError();
+                ResetEvent(write_handle_read_overlapped.hEvent);
+                if (err == ERROR_BROKEN_PIPE)
+                {
+                    /* We should quit. */
+                    data->process = FALSE;
+                }
+                else
+                {
+                    /* Don't care about result. Start read again. */
+                    ReadFile(data->write_handle, &dummy_buf, sizeof(dummy_buf), NULL, &write_handle_read_overlapped);
+                }
+                continue;
+            }
+            else if (table_hub[index] < 0)
+            {
+                /* We should quit as exit_event is set. */
+                data->process = FALSE;
+                continue;
+            }
+
+            hub = &hubs[table_hub[index]];
+            hub_complete_read(hub, FALSE);
+            if (hub_peek_record(hub, &timestamp, &length))
+            {
+                merge_push(&heap, table_hub[index], timestamp);
+                hub->in_heap = TRUE;
+            }
+        }
+        else if (dw == WAIT_TIMEOUT)
+        {
+            if (statistics_timeout(stats_interval, last_stats) == 0)
+            {
+                for (i = 0; i < hub_count; i++)
+                {
+                    fprintf(stderr, "%s: ", hubs[i].data.device);
+                    print_statistics(&hubs[i].data);
+                }
+                last_stats = GetTickCount();
+            }
+
+            if (writer_flush_timeout(&data->writer) == 0)
+            {
+                writer_flush(&data->writer);
+            }
+        }
+        else if (dw == WAIT_FAILED)
+        {
+            fprintf(stderr, "WaitForMultipleObjects failed in merge_thread(): %d", GetLastError());
+            break;
+        }
+    }
+
+    /* Write out everything that was read */
+    for (i = 0; i < hub_count; i++)
+    {
+        UINT64 timestamp;
+        DWORD length;
+
+        CancelIo(hubs[i].data.read_handle);
+        if (hubs[i].pending)
+        {
+            hub_complete_read(&hubs[i], TRUE);
+        }
+        if (!hubs[i].in_heap && hub_peek_record(&hubs[i], &timestamp, &length))
+        {
+            merge_push(&heap, i, timestamp);
+            hubs[i].in_heap = TRUE;
+        }
+    }
+    merge_records(&out, &heap, hubs, hub_count, 0);
+    merge_output_flush(&out);
+
+    if ((data->capture_flags & USBPCAP_CAPTURE_FLAG_PCAPNG) && !data->writer.failed)
+    {
+        for (i = 0; i < hub_count; i++)
+        {
+            write_interface_statistics(data, &hubs[i].data, i, &write_overlapped);
+        }
+    }
+
+    if (stats_interval != 0)
+    {
+        for (i = 0; i < hub_count; i++)
+        {
+            fprintf(stderr, "%s: ", hubs[i].data.device);
+            print_statistics(&hubs[i].data);
+        }
+    }
+
+    CancelIo(data->writer.handle);
+    writer_close(&data->writer);
+    /* Rotation switches the files, the last one is closed by main thread */
+    data->write_handle = data->writer.handle;
+
+finish:
+    for (i = 0; i < hub_count; i++)
+    {
+        if (hubs[i].data.read_handle != INVALID_HANDLE_VALUE)
+        {
+            CancelIo(hubs[i].data.read_handle);
+            CloseHandle(hubs[i].data.read_handle);
+        }
+        if (hubs[i].overlapped.hEvent != NULL)
+        {
+            CloseHandle(hubs[i].overlapped.hEvent);
+        }
+        free(hubs[i].data.device);
+        free(hubs[i].buffer);
+    }
+    free(hubs);
+    free(out.buffer);
+    merge_free(&heap);
+    if (write_overlapped.hEvent != NULL)
+    {
+        CloseHandle(write_overlapped.hEvent);
+    }
+    if (write_handle_read_overlapped.hEvent != NULL)
+    {
+        CloseHandle(write_handle_read_overlapped.hEvent);
+    }
+
+    if (data->exit_event != INVALID_HANDLE_VALUE)
+    {
+        SetEvent(data->exit_event);
+    }
+
+    return 0;
+}
@@ -9,6 +9,7 @@
 
 #include <windows.h>
 #include "USBPcap.h"
+#include "writer.h"
 
 struct inject_descriptors
 {
@@ -18,8 +19,9 @@ struct inject_descriptors
     /* Buffer to keep track of pcap data read from driver. Once it is filled, the magic
      * and DLT is checked and if it matches, the the inject_packets are written after
      * the header and then the normal capture continues.
+     * In pcapng mode the header is USBPCAP_PCAPNG_HEADER.
      */
-    unsigned char buf[sizeof(pcap_hdr_t)];
+    unsigned char buf[sizeof(USBPCAP_PCAPNG_HEADER)];
     int buf_written;
 };
 
@@ -29,22 +31,44 @@ struct thread_data
     char *filename; /* Output filename */
     char *address_list; /* Comma separated list with addresses of device to capture. */
     USBPCAP_ADDRESS_FILTER filter; /* Addresses that should be filtered */
+    char *endpoint_list; /* Comma separated list of <address>:<endpoint> to capture, NULL for all endpoints. */
+    char *transfer_types; /* Comma separated list of transfer types to capture, NULL for all. */
     BOOLEAN capture_all; /* TRUE if all devices should be captured despite address_list. */
     BOOLEAN capture_new; /* TRUE if we should automatically capture from new devices. */
     UINT32 snaplen; /* Snapshot length */
+    char *snaplen_table; /* Per transfer type and endpoint snapshot lengths, NULL if not set. */
+    char *trigger; /* Capture trigger specification, NULL if not set. */
     UINT32 bufferlen; /* Internal kernel-mode buffer size */
+    UINT32 outstanding_reads; /* Number of reads kept pending on read_handle */
+    UINT32 capture_flags; /* USBPCAP_CAPTURE_FLAG_XXX passed to driver */
+    UINT32 wakeup_bytes; /* Minimum read size driver waits for, 0 to disable */
+    UINT32 wakeup_latency; /* Maximum time (in microseconds) driver delays the read */
+    UINT32 stats_interval; /* Seconds between capture statistics lines, 0 to disable */
     volatile BOOL process; /* FALSE if thread should stop */
     HANDLE read_handle; /* Handle to read data from. */
     HANDLE write_handle; /* Handle to write data to. */
+    struct flush_policy flush; /* When to flush write_handle */
+    char *flush_arg; /* --flush-interval value to pass to worker process, NULL if default. */
+    struct output_writer writer; /* Writes data to write_handle */
+    struct rotate_state rotate; /* Output file rotation, policy is all zero if disabled */
+    char *rotate_arg; /* --ring-buffer value to pass to worker process, NULL if not set. */
+    PUSBPCAP_IOCTL_FILTER_PROGRAM filter_program; /* Packet filter program, NULL if not set. */
+    DWORD filter_program_size; /* Size of filter_program in bytes */
+    char *filter_program_path; /* Full path of filter program file to pass to worker process */
     HANDLE job_handle; /* Handle to job object of worker process. */
     HANDLE worker_process_thread; /* Handle to breakaway worker process main thread. */
     HANDLE exit_event; /* Handle to event that indicates that main thread should exit. */
 
+    PUSBPCAP_SHARED_RING_HEADER ring_header; /* Mapped capture buffer (read-only), NULL if data is read with ReadFile(). */
+    PUSBPCAP_SHARED_RING_CONSUMER ring_consumer; /* Mapped consumer page of the capture buffer. */
+    HANDLE ring_event; /* Event signalled by driver when there is new data in mapped buffer. */
+
     BOOLEAN inject_descriptors; /* TRUE if descriptors should be injected into capture. */
     struct inject_descriptors descriptors;
 };
 
 HANDLE create_filter_read_handle(struct thread_data *data);
 DWORD WINAPI read_thread(LPVOID param);
+DWORD WINAPI merge_thread(LPVOID param);
 
 #endif /* USBPCAP_CMD_THREAD_H */
@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "top.h"
+#include "counters.h"
+
+/* Difference between FILETIME epoch and Unix epoch in 100 ns units */
+#define EPOCH_DIFFERENCE 116444736000000000ULL
+
+static BOOL get_endpoint_stats(const char *device,
+                               HANDLE filter_handle,
+                               PUSBPCAP_IOCTL_ENDPOINT_STATS stats)
+{
+    DWORD bytes_ret = 0;
+
+    if (!DeviceIoControl(filter_handle,
+                         IOCTL_USBPCAP_GET_ENDPOINT_STATS,
+                         NULL,
+                         0,
+                         (char*)stats,
+                         sizeof(USBPCAP_IOCTL_ENDPOINT_STATS),
+                         &bytes_ret,
+                         0) ||
+        (bytes_ret != sizeof(USBPCAP_IOCTL_ENDPOINT_STATS)))
+    {
+        fprintf(stderr, "Failed to get endpoint statistics from %s (%d)\n",
+                device, GetLastError());
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Returns counters of the same endpoint in stats, NULL if there are none.
+ */
+static PUSBPCAP_ENDPOINT_COUNTERS find_counters(PUSBPCAP_IOCTL_ENDPOINT_STATS stats,
+                                                PUSBPCAP_ENDPOINT_COUNTERS counters)
+{
+    UINT16 i;
+
+    for (i = 0; i < stats->count; i++)
+    {
+        PUSBPCAP_ENDPOINT_COUNTERS candidate = &stats->endpoints[i];
+
+        if ((candidate->device == counters->device) &&
+            (candidate->endpoint == counters->endpoint) &&
+            (candidate->transfer == counters->transfer))
+        {
+            return candidate;
+        }
+    }
+
+    return NULL;
+}
+
+/* " 0x%08x:%u" for every status and " other:%u" */
+#define FAILED_TEXT_SIZE (USBPCAP_ENDPOINT_STATUSES * 23 + 18)
+
+/*
+ * Formats failed URB counts by status as "status:count" items separated
+ * by separator, with failures of other statuses last.
+ */
+static void format_failed(PUSBPCAP_ENDPOINT_COUNTERS counters,
+                          char separator,
+                          char text[FAILED_TEXT_SIZE])
+{
+    int length = 0;
+    int i;
+
+    text[0] = '\0';
+    for (i = 0; i < USBPCAP_ENDPOINT_STATUSES; i++)
+    {
+        if (counters->failed[i].count != 0)
+        {
+            length += sprintf_s(&text[length], FAILED_TEXT_SIZE - length,
+                                "%s0x%08x:%u", (length > 0) ? " " : "",
+                                counters->failed[i].status,
+                                counters->failed[i].count);
+        }
+    }
+    if (counters->otherFailed != 0)
+    {
+        sprintf_s(&text[length], FAILED_TEXT_SIZE - length, "%sother:%u",
+                  (length > 0) ? " " : "", counters->otherFailed);
+    }
+
+    for (i = 0; text[i] != '\0'; i++)
+    {
+        if (text[i] == ' ')
+        {
+            text[i] = separator;
+        }
+    }
+}
+
+/*
+ * Clears the console so the table is redrawn in place. Does nothing if
+ * standard output is not a console.
+ */
+static void clear_console(void)
+{
+    HANDLE console = GetStdHandle(STD_OUTPUT_HANDLE);
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    COORD origin = {0, 0};
+    DWORD cells;
+    DWORD written;
+
+    if (!GetConsoleScreenBufferInfo(console, &info))
+    {
+        return;
+    }
+
+    cells = (DWORD)info.dwSize.X * (DWORD)info.dwSize.Y;
+    FillConsoleOutputCharacterA(console, ' ', cells, origin, &written);
+    FillConsoleOutputAttribute(console, info.wAttributes, cells, origin, &written);
+    SetConsoleCursorPosition(console, origin);
+}
+
+/*
+ * Prints counters of single Root Hub with rates since the previous read.
+ */
+static void print_rates(PUSBPCAP_IOCTL_ENDPOINT_STATS now,
+                        PUSBPCAP_IOCTL_ENDPOINT_STATS previous,
+                        BOOL csv)
+{
+    double seconds;
+    double unix_time;
+    UINT16 i;
+
+    seconds = (double)(INT64)(now->timestamp - previous->timestamp) / 10000000.0;
+    if (seconds <= 0.0)
+    {
+        seconds = 1.0;
+    }
+    unix_time = (double)(INT64)(now->timestamp - EPOCH_DIFFERENCE) / 10000000.0;
+
+    for (i = 0; i < now->count; i++)
+    {
+        PUSBPCAP_ENDPOINT_COUNTERS counters = &now->endpoints[i];
+        PUSBPCAP_ENDPOINT_COUNTERS old = find_counters(previous, counters);
+        UINT64 urbs = counters->urbs;
+        UINT64 bytes = counters->bytes;
+        char failed[FAILED_TEXT_SIZE];
+
+        if (old != NULL)
+        {
+            urbs -= old->urbs;
+            bytes -= old->bytes;
+        }
+
+        if (csv)
+        {
+            /* Status list is single CSV field */
+            format_failed(counters, ';', failed);
+            printf("%.3f,%u,%u,0x%02x,%s,%I64u,%I64u,%.1f,%.1f,%u,%u,%s\n",
+                   unix_time, now->bus, counters->device, counters->endpoint,
+                   counter_transfer_name(counters->transfer),
+                   counters->urbs, counters->bytes,
+                   (double)urbs / seconds, (double)bytes / seconds,
+                   counters->errors, counters->stalls, failed);
+        }
+        else
+        {
+            format_failed(counters, ' ', failed);
+            printf("%3u %6u     0x%02x %-11s %10.1f %12.1f %8u %8u %s\n",
+                   now->bus, counters->device, counters->endpoint,
+                   counter_transfer_name(counters->transfer),
+                   (double)urbs / seconds, (double)bytes / seconds,
+                   counters->errors, counters->stalls, failed);
+        }
+    }
+
+    if (!csv && (now->untracked != 0))
+    {
+        printf("Bus %u: %u URBs not counted (too many endpoints)\n",
+               now->bus, now->untracked);
+    }
+}
+
+int top_report(struct thread_data *data, UINT32 interval, BOOL csv)
+{
+    struct counter_hubs hubs;
+    PUSBPCAP_IOCTL_ENDPOINT_STATS previous;
+    PUSBPCAP_IOCTL_ENDPOINT_STATS now;
+    FILETIME ts;
+    ULARGE_INTEGER start;
+    int i;
+
+    if (!counter_hubs_open(&hubs, data, IOCTL_USBPCAP_START_ENDPOINT_STATS))
+    {
+        return -1;
+    }
+
+    previous = (PUSBPCAP_IOCTL_ENDPOINT_STATS)calloc(hubs.count, sizeof(USBPCAP_IOCTL_ENDPOINT_STATS));
+    now = (PUSBPCAP_IOCTL_ENDPOINT_STATS)malloc(sizeof(USBPCAP_IOCTL_ENDPOINT_STATS));
+    if ((previous == NULL) || (now == NULL))
+    {
+        fprintf(stderr, "Failed to allocate endpoint statistics\n");
+        free(previous);
+        free(now);
+        counter_hubs_close(&hubs);
+        return -1;
+    }
+
+    /* Counters were cleared when counting started */
+    GetSystemTimeAsFileTime(&ts);
+    start.LowPart = ts.dwLowDateTime;
+    start.HighPart = ts.dwHighDateTime;
+    for (i = 0; i < hubs.count; i++)
+    {
+        previous[i].timestamp = start.QuadPart;
+    }
+
+    if (csv)
+    {
+        printf("time,bus,device,endpoint,transfer,urbs,bytes,"
+               "urbs_per_s,bytes_per_s,errors,stalls,failed_by_status\n");
+    }
+
+    while (counter_hubs_wait(interval * 1000))
+    {
+        if (!csv)
+        {
+            clear_console();
+            printf("bus device endpoint transfer        URB/s      bytes/s   errors   stalls failed by status\n");
+        }
+
+        for (i = 0; i < hubs.count; i++)
+        {
+            if (get_endpoint_stats(hubs.devices[i], hubs.handles[i], now))
+            {
+                print_rates(now, &previous[i], csv);
+                memcpy(&previous[i], now, sizeof(USBPCAP_IOCTL_ENDPOINT_STATS));
+            }
+        }
+        fflush(stdout);
+    }
+
+    free(previous);
+    free(now);
+    counter_hubs_close(&hubs);
+    return 0;
+}
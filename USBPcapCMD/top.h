@@ -0,0 +1,23 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef USBPCAP_CMD_TOP_H
+#define USBPCAP_CMD_TOP_H
+
+#include <windows.h>
+#include "thread.h"
+
+/*
+ * Counts URBs per endpoint on every Root Hub in data->device and prints
+ * URB and byte rates every interval seconds until Ctrl+C. Output is
+ * a table redrawn in place or, if csv is TRUE, CSV lines. No packets are
+ * captured. Must be called elevated.
+ *
+ * Returns 0 on success.
+ */
+int top_report(struct thread_data *data, UINT32 interval, BOOL csv);
+
+#endif /* USBPCAP_CMD_TOP_H */
@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "writer.h"
+
+/*
+ * rotate is NULL if all data goes to handle. Otherwise handle must be
+ * the file opened with writer_open_rotated() and the writer switches to
+ * next file once rotation policy limit is reached.
+ */
+void writer_init(struct output_writer *writer, HANDLE handle,
+                 const struct flush_policy *policy,
+                 struct rotate_state *rotate)
+{
+    writer->handle = handle;
+    flush_init(&writer->flush, policy, GetTickCount());
+    writer->failed = FALSE;
+    writer->rotate = rotate;
+}
+
+/*
+ * Creates next rotated output file and removes the oldest file if there
+ * are too many of them.
+ */
+HANDLE writer_open_rotated(struct rotate_state *rotate)
+{
+    SYSTEMTIME now;
+    char timestamp[15];
+    char *removed;
+    char *name;
+    HANDLE handle;
+
+    GetLocalTime(&now);
+    sprintf_s(timestamp, sizeof(timestamp), "%04u%02u%02u%02u%02u%02u",
+              now.wYear, now.wMonth, now.wDay,
+              now.wHour, now.wMinute, now.wSecond);
+
+    name = rotate_next_file(rotate, timestamp, GetTickCount(), &removed);
+    if (name == NULL)
+    {
+        fprintf(stderr, "Failed to allocate output file name\n");
+        return INVALID_HANDLE_VALUE;
+    }
+
+    if (removed != NULL)
+    {
+        if (!DeleteFileA(removed))
+        {
+            fprintf(stderr, "Failed to remove %s (%d)\n", removed, GetLastError());
+        }
+        free(removed);
+    }
+
+    handle = CreateFileA(name,
+                         GENERIC_WRITE,
+                         0,
+                         NULL,
+                         CREATE_NEW,
+                         FILE_ATTRIBUTE_NORMAL|FILE_FLAG_OVERLAPPED,
+                         NULL);
+    if (handle == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "Failed to create %s (%d)\n", name, GetLastError());
+    }
+    free(name);
+
+    return handle;
+}
+
+/*
+ * Marks the end of global header and injected descriptors. These are
+ * written again at the start of every rotated file.
+ */
+void writer_begin_records(struct output_writer *writer)
+{
+    if (writer->rotate != NULL)
+    {
+        rotate_start_records(writer->rotate);
+    }
+}
+
+void writer_flush(struct output_writer *writer)
+{
+    if (flush_needed(&writer->flush))
+    {
+        FlushFileBuffers(writer->handle);
+    }
+    flush_done(&writer->flush, GetTickCount());
+}
+
+/*
+ * Returns number of milliseconds until the data has to be flushed or
+ * INFINITE if there is no deadline.
+ */
+DWORD writer_flush_timeout(struct output_writer *writer)
+{
+    return flush_timeout(&writer->flush, GetTickCount());
+}
+
+/*
+ * Writes data to the end of current file.
+ * Returns FALSE if the capture should be stopped.
+ */
+static BOOL writer_write_file(struct output_writer *writer, LPOVERLAPPED overlapped,
+                              void *buffer, DWORD bytes)
+{
+    BOOL success = TRUE;
+
+    overlapped->Offset = 0xFFFFFFFF;
+    overlapped->OffsetHigh = 0xFFFFFFFF;
+    if (!WriteFile(writer->handle, buffer, bytes, NULL, overlapped))
+    {
+        DWORD err = GetLastError();
+        if (err == ERROR_IO_PENDING)
+        {
+            DWORD written;
+            if (!GetOverlappedResult(writer->handle, overlapped, &written, TRUE))
+            {
+                fprintf(stderr, "GetOverlappedResult() on write handle failed: %d\n", GetLastError());
+            }
+            else if (written != bytes)
+            {
+                fprintf(stderr, "Wrote %d bytes instead of %d. Stopping capture.\n", written, bytes);
+                success = FALSE;
+            }
+        }
+        else
+        {
+            /* Failed to write to output. Quit. */
+            fprintf(stderr, "Write failed (%d). Stopping capture.\n", err);
+            success = FALSE;
+        }
+    }
+    ResetEvent(overlapped->hEvent);
+
+    if (!success)
+    {
+        writer->failed = TRUE;
+    }
+
+    if (flush_written(&writer->flush, bytes, GetTickCount()))
+    {
+        writer_flush(writer);
+    }
+
+    return success;
+}
+
+/*
+ * Closes current file and continues in the next one.
+ */
+static BOOL writer_rotate(struct output_writer *writer, LPOVERLAPPED overlapped)
+{
+    writer_close(writer);
+    CloseHandle(writer->handle);
+
+    writer->handle = writer_open_rotated(writer->rotate);
+    flush_done(&writer->flush, GetTickCount());
+    if (writer->handle == INVALID_HANDLE_VALUE)
+    {
+        writer->failed = TRUE;
+        return FALSE;
+    }
+
+    return writer_write_file(writer, overlapped, writer->rotate->preamble,
+                             writer->rotate->preamble_len);
+}
+
+/*
+ * Writes data to output. Rotated output is switched to next file only
+ * between records, every file starts with the preamble.
+ * Returns FALSE if the capture should be stopped.
+ */
+BOOL writer_write(struct output_writer *writer, LPOVERLAPPED overlapped,
+                  void *buffer, DWORD bytes)
+{
+    unsigned char *data = (unsigned char *)buffer;
+
+    if (writer->rotate == NULL)
+    {
+        return writer_write_file(writer, overlapped, buffer, bytes);
+    }
+
+    if (!writer->rotate->in_records)
+    {
+        if (!rotate_add_preamble(writer->rotate, buffer, bytes))
+        {
+            fprintf(stderr, "Failed to allocate rotated file header\n");
+            writer->failed = TRUE;
+            return FALSE;
+        }
+        return writer_write_file(writer, overlapped, buffer, bytes);
+    }
+
+    while (bytes > 0)
+    {
+        BOOL rotate;
+        DWORD length;
+
+        length = rotate_scan(writer->rotate, data, bytes, GetTickCount(), &rotate);
+        if ((length > 0) && !writer_write_file(writer, overlapped, data, length))
+        {
+            return FALSE;
+        }
+        data += length;
+        bytes -= length;
+
+        if (rotate && !writer_rotate(writer, overlapped))
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/*
+ * Flushes remaining data unless policy is FLUSH_POLICY_NEVER.
+ */
+void writer_close(struct output_writer *writer)
+{
+    if (flush_on_close(&writer->flush))
+    {
+        writer_flush(writer);
+    }
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef USBPCAP_CMD_WRITER_H
+#define USBPCAP_CMD_WRITER_H
+
+#include <windows.h>
+#include "flush.h"
+#include "rotate.h"
+
+struct output_writer
+{
+    HANDLE handle;              /* Handle to write data to. */
+    struct flush_state flush;
+    BOOL failed;                /* TRUE once a write failed */
+    struct rotate_state *rotate; /* NULL if output is not rotated */
+};
+
+void writer_init(struct output_writer *writer, HANDLE handle,
+                 const struct flush_policy *policy,
+                 struct rotate_state *rotate);
+HANDLE writer_open_rotated(struct rotate_state *rotate);
+void writer_begin_records(struct output_writer *writer);
+BOOL writer_write(struct output_writer *writer, LPOVERLAPPED overlapped,
+                  void *buffer, DWORD bytes);
+DWORD writer_flush_timeout(struct output_writer *writer);
+void writer_flush(struct output_writer *writer);
+void writer_close(struct output_writer *writer);
+
+#endif /* USBPCAP_CMD_WRITER_H */
@@ -7,387 +7,1100 @@
 #include "USBPcapMain.h"
 #include "USBPcapBuffer.h"
 #include "USBPcapHelperFunctions.h"
+#include "USBPcapFilterProgram.h"
+#include "USBPcapRecord.h"
+#include "USBPcapTrigger.h"
+#include "USBPcapWholeRecords.h"
 
 #define USBPCAP_BUFFER_TAG  (ULONG)'ffuB'
 
+/* In per-CPU mode the root hub ring holds only the global header */
+#define USBPCAP_PER_CPU_HEADER_BUFFER_SIZE  4096
+
+#define USBPCAP_SUPPORTED_CAPTURE_FLAGS  (USBPCAP_CAPTURE_FLAG_PER_CPU_BUFFERS | \
+                                          USBPCAP_CAPTURE_FLAG_MAPPED_BUFFER | \
+                                          USBPCAP_CAPTURE_FLAG_PCAPNG | \
+                                          USBPCAP_CAPTURE_FLAG_WHOLE_RECORDS | \
+                                          USBPCAP_CAPTURE_FLAG_COMPLETION_ONLY | \
+                                          USBPCAP_CAPTURE_FLAG_OVERWRITE_OLDEST)
+
+/* Difference between 1601-01-01 and 1970-01-01 in 100 ns units */
+#define USBPCAP_EPOCH_DIFFERENCE  116444736000000000LL
+
+__inline static BOOLEAN
+USBPcapBufferIsPerCpu(PUSBPCAP_ROOTHUB_DATA pData)
+{
+    return (pData->captureFlags & USBPCAP_CAPTURE_FLAG_PER_CPU_BUFFERS) ? TRUE : FALSE;
+}
+
+__inline static BOOLEAN
+USBPcapBufferIsMapped(PUSBPCAP_ROOTHUB_DATA pData)
+{
+    return (pData->captureFlags & USBPCAP_CAPTURE_FLAG_MAPPED_BUFFER) ? TRUE : FALSE;
+}
+
+__inline static BOOLEAN
+USBPcapBufferIsPcapng(PUSBPCAP_ROOTHUB_DATA pData)
+{
+    return (pData->captureFlags & USBPCAP_CAPTURE_FLAG_PCAPNG) ? TRUE : FALSE;
+}
+
+__inline static BOOLEAN
+USBPcapBufferIsWholeRecords(PUSBPCAP_ROOTHUB_DATA pData)
+{
+    return (pData->captureFlags & USBPCAP_CAPTURE_FLAG_WHOLE_RECORDS) ? TRUE : FALSE;
+}
+
+__inline static BOOLEAN
+USBPcapBufferIsTriggerSet(PUSBPCAP_ROOTHUB_DATA pData)
+{
+    return (pData->trigger.type != USBPCAP_TRIGGER_NONE) ? TRUE : FALSE;
+}
+
+/*
+ * Returns TRUE if the oldest records are evicted when the ring is full.
+ */
+__inline static BOOLEAN
+USBPcapBufferIsOverwrite(PUSBPCAP_ROOTHUB_DATA pData)
+{
+    return ((pData->captureFlags & USBPCAP_CAPTURE_FLAG_OVERWRITE_OLDEST) ||
+            USBPcapBufferIsTriggerSet(pData)) ? TRUE : FALSE;
+}
+
+/*
+ * Returns number of bytes ready to be read.
+ */
 __inline static UINT32
-USBPcapGetBufferFree(PUSBPCAP_ROOTHUB_DATA pData)
+USBPcapBufferGetUsed(PUSBPCAP_ROOTHUB_DATA pData)
 {
-    if (pData->buffer == NULL)
+    UINT32 used = USBPcapRingGetUsed(&pData->ring);
+
+    if (USBPcapBufferIsPerCpu(pData))
     {
-        /* There is no buffer, nothing can be written */
-        return 0;
+        used += USBPcapCpuRingsGetUsed(&pData->cpuRings);
     }
-    else if (pData->readOffset == pData->writeOffset)
+
+    return used;
+}
+
+static VOID USBPcapBufferCompletePendedReadIrp(PUSBPCAP_ROOTHUB_DATA pRootData,
+                                              KIRQL irql,
+                                              BOOLEAN force);
+
+/*
+ * Returns TRUE if pending read should be completed. Unless forced,
+ * the read wakeup threshold must be reached.
+ */
+__inline static BOOLEAN
+USBPcapBufferIsReadReady(PUSBPCAP_ROOTHUB_DATA pData, BOOLEAN force)
+{
+    UINT32 used;
+
+    if (USBPcapBufferIsTriggerSet(pData))
     {
-        /* readOffset is equal to writeOffset when buffer is empty
-         *
-         * At max, we can write bufferSize - 1 bytes of data
+        /* Data is held until the capture around the trigger stops. Then
+         * every read is completed, with 0 bytes once all data was read.
          */
-        return pData->bufferSize - 1;
+        return (USBPcapTriggerGetState(&pData->triggerProgress) ==
+                USBPCAP_TRIGGER_STATE_CLOSED) ?
+               TRUE : FALSE;
     }
-    else if (pData->readOffset > pData->writeOffset)
+
+    used = USBPcapBufferGetUsed(pData);
+    return (USBPcapWakeupCheck(&pData->wakeup, used, force) ==
+            USBPCAP_WAKEUP_COMPLETE) ? TRUE : FALSE;
+}
+
+/*
+ * Expands compact records to pcap (or pcapng) records.
+ *
+ * In overwrite mode producers must not evict the record being read.
+ * evictLock is held only while single record is read, so producers
+ * waiting to evict do not spin for the whole copy.
+ *
+ * Caller must hold bufferLock. Returns number of bytes read.
+ */
+static UINT32
+USBPcapBufferReadRecords(PUSBPCAP_ROOTHUB_DATA pData,
+                         PVOID destBuffer,
+                         UINT32 destBufferSize)
+{
+    PKSPIN_LOCK evictLock;
+    UINT32 bytes;
+    UINT32 tmp;
+
+    evictLock = USBPcapBufferIsOverwrite(pData) ? &pData->evictLock : NULL;
+
+    if (USBPcapBufferIsWholeRecords(pData))
     {
-        /* readOffset is bigger than writeOffset when:
-         * XXXXXXXW.............RXXXXXXX
-         *
-         * where:
-         *   X is data to be read
-         *   . is free data
-         *   R is readOffset (first byte to be read)
-         *   W is writeOffset (first empty byte)
-         */
+        /* Global header must be read before any packet */
+        return USBPcapWholeRecordsRead(&pData->ring,
+                                       USBPcapBufferIsPerCpu(pData) ?
+                                       &pData->cpuRings : NULL,
+                                       evictLock,
+                                       USBPcapBufferIsPcapng(pData),
+                                       destBuffer,
+                                       destBufferSize);
+    }
 
-        return pData->readOffset - pData->writeOffset - 1;
+    bytes = 0;
+    do
+    {
+        /* Partially read record stays pinned by recordSkip */
+        if (evictLock != NULL)
+        {
+            KeAcquireSpinLockAtDpcLevel(evictLock);
+        }
+        tmp = USBPcapRecordRead(&pData->ring,
+                                USBPcapBufferIsPcapng(pData),
+                                &((PUCHAR)destBuffer)[bytes],
+                                destBufferSize - bytes,
+                                &pData->recordSkip);
+        if (evictLock != NULL)
+        {
+            KeReleaseSpinLockFromDpcLevel(evictLock);
+        }
+        bytes += tmp;
+    }
+    while ((tmp > 0) && (bytes < destBufferSize));
+
+    if (USBPcapBufferIsPerCpu(pData) && (bytes < destBufferSize))
+    {
+        bytes += USBPcapCpuRingsRead(&pData->cpuRings,
+                                     USBPcapBufferIsPcapng(pData),
+                                     (PVOID)&((PUCHAR)destBuffer)[bytes],
+                                     destBufferSize - bytes);
+    }
+
+    return bytes;
+}
+
+/*
+ * Reads data from buffer. Global header always comes first.
+ * Unless the buffer is mapped, the ring contains compact records that
+ * are expanded to pcap (or pcapng) records here.
+ *
+ * Caller must hold bufferLock. Returns number of bytes read.
+ */
+static UINT32
+USBPcapBufferRead(PUSBPCAP_ROOTHUB_DATA pData,
+                  PVOID destBuffer,
+                  UINT32 destBufferSize)
+{
+    if (USBPcapBufferIsMapped(pData))
+    {
+        return USBPcapRingRead(&pData->ring, destBuffer, destBufferSize);
+    }
+
+    return USBPcapBufferReadRecords(pData, destBuffer, destBufferSize);
+}
+
+/*
+ * Rearms the trigger for new capture. Caller must make sure there are no
+ * producers.
+ */
+__inline static VOID
+USBPcapBufferRearmTrigger(PUSBPCAP_ROOTHUB_DATA pData)
+{
+    USBPcapTriggerRearm(&pData->triggerProgress, &pData->trigger);
+}
+
+/*
+ * Fills in pcapng Section Header Block and Interface Description Block.
+ */
+__inline static VOID
+USBPcapInitializePcapngHeader(PUSBPCAP_ROOTHUB_DATA pData,
+                              PUSBPCAP_PCAPNG_HEADER header)
+{
+    RtlZeroMemory(header, sizeof(USBPCAP_PCAPNG_HEADER));
+
+    header->shb.block_type = PCAPNG_BLOCK_TYPE_SHB;
+    header->shb.block_total_length = sizeof(pcapng_shb_t) + sizeof(UINT32);
+    header->shb.byte_order_magic = PCAPNG_BYTE_ORDER_MAGIC;
+    header->shb.version_major = 1;
+    header->shb.version_minor = 0;
+    header->shb.section_length = -1;
+    header->shbTotalLength = header->shb.block_total_length;
+
+    header->idb.block_type = PCAPNG_BLOCK_TYPE_IDB;
+    header->idb.block_total_length = sizeof(USBPCAP_PCAPNG_HEADER) -
+                                     FIELD_OFFSET(USBPCAP_PCAPNG_HEADER, idb);
+    header->idb.linktype = DLT_USBPCAP;
+    header->idb.snaplen = pData->snaplen;
+    header->tsresolOption.option_code = PCAPNG_IF_TSRESOL;
+    header->tsresolOption.option_length = 1;
+    header->tsresol = USBPCAP_PCAPNG_TSRESOL;
+    header->endOfOptions.option_code = PCAPNG_OPT_ENDOFOPT;
+    header->endOfOptions.option_length = 0;
+    header->idbTotalLength = header->idb.block_total_length;
+}
+
+/*
+ * Writes global PCAP header (or pcapng SHB and IDB) to buffer. Unless the
+ * buffer is mapped, the header is stored as raw record.
+ * Caller must have acquired buffer spin lock and frozen the ring.
+ */
+__inline static VOID
+USBPcapWriteGlobalHeader(PUSBPCAP_ROOTHUB_DATA pData)
+{
+    pcap_hdr_t                header;
+    USBPCAP_PCAPNG_HEADER     pcapngHeader;
+    PVOID                     data;
+    UINT32                    length;
+    UCHAR                     prefix[USBPCAP_RECORD_MAX_PREFIX];
+    UINT32                    prefixLength;
+    USBPCAP_RING_RESERVATION  reservation;
+    NTSTATUS                  status;
+
+    if (USBPcapBufferIsPcapng(pData))
+    {
+        USBPcapInitializePcapngHeader(pData, &pcapngHeader);
+        data = (PVOID)&pcapngHeader;
+        length = sizeof(pcapngHeader);
     }
     else
     {
-        /* readOffset is lower than writeOffset when:
-         * ........RXXXXXXXXXXW.........
-         */
+        header.magic_number = 0xA1B2C3D4;
+        header.version_major = 2;
+        header.version_minor = 4;
+        header.thiszone = 0 /* Assume UTC */;
+        header.sigfigs = 0;
+        header.snaplen = pData->snaplen;
+        header.network = DLT_USBPCAP;
+        data = (PVOID)&header;
+        length = sizeof(header);
+    }
+
+    prefixLength = 0;
+    if (!USBPcapBufferIsMapped(pData))
+    {
+        prefixLength = USBPcapRecordEncodeRaw(length, prefix);
+    }
+
+    ASSERT (USBPcapRingGetFree(&pData->ring) >= prefixLength + length);
 
-        return pData->bufferSize - pData->writeOffset +
-               pData->readOffset - 1;
+    status = USBPcapRingReserve(&pData->ring, prefixLength + length,
+                                &reservation);
+    if (NT_SUCCESS(status))
+    {
+        if (prefixLength > 0)
+        {
+            USBPcapRingWrite(&pData->ring, &reservation,
+                             (PVOID)prefix, prefixLength);
+        }
+        USBPcapRingWrite(&pData->ring, &reservation, data, length);
+        USBPcapRingCommit(&pData->ring, &reservation);
     }
 }
 
-__inline static UINT32
-USBPcapGetBufferAllocated(PUSBPCAP_ROOTHUB_DATA pData)
+/*
+ * Creates buffer that can be mapped into user process.
+ * Must be called at PASSIVE_LEVEL.
+ */
+static NTSTATUS
+USBPcapSetUpSharedBuffer(PUSBPCAP_ROOTHUB_DATA pData,
+                         UINT32 bytes)
+{
+    USBPCAP_SHARED_BUFFER  shared;
+    NTSTATUS               status;
+    KIRQL                  irql;
+
+    if (pData->ring.buffer != NULL)
+    {
+        /* Shared buffer cannot be resized */
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    /* Pages cannot be allocated with bufferLock held */
+    USBPcapSharedBufferInitialize(&shared);
+    status = USBPcapSharedBufferAllocate(&shared, bytes);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    KeAcquireSpinLock(&pData->bufferLock, &irql);
+    USBPcapRingFreeze(&pData->ring);
+    if (!USBPcapBufferIsMapped(pData))
+    {
+        /* Flags changed before we acquired the lock */
+        status = STATUS_INVALID_DEVICE_STATE;
+    }
+    else if (pData->ring.buffer != NULL)
+    {
+        status = STATUS_NOT_SUPPORTED;
+    }
+    else
+    {
+        pData->shared = shared;
+        USBPcapRingSetCommitMirror(&pData->ring,
+                                   &shared.header->writeOffset);
+        USBPcapRingAttachBuffer(&pData->ring, shared.data, bytes, 0);
+        USBPcapWriteGlobalHeader(pData);
+        InterlockedExchange(&pData->captureArmed, 1);
+        DkDbgVal("Created new shared buffer", bytes);
+    }
+    USBPcapRingThaw(&pData->ring);
+    KeReleaseSpinLock(&pData->bufferLock, irql);
+
+    if (!NT_SUCCESS(status))
+    {
+        USBPcapSharedBufferFree(&shared);
+    }
+
+    return status;
+}
+
+NTSTATUS USBPcapSetUpBuffer(PUSBPCAP_ROOTHUB_DATA pData,
+                            UINT32 bytes)
 {
-    if (pData->readOffset == pData->writeOffset)
+    NTSTATUS  status;
+    KIRQL     irql;
+    PVOID     buffer;
+    UINT32    flags;
+    BOOLEAN   perCpu;
+
+    /* Minimum buffer size is 4 KiB, maximum 128 MiB */
+    if (bytes < 4096 || bytes > 134217728)
     {
-        /* readOffset is equal to writeOffset when buffer is empty
-         */
-        return 0;
+        return STATUS_INVALID_PARAMETER;
     }
-    else if (pData->readOffset > pData->writeOffset)
+
+    if (USBPcapBufferIsMapped(pData))
     {
-        /* readOffset is bigger than writeOffset when:
-         * XXXXXXXW.............RXXXXXXX
-         */
+        return USBPcapSetUpSharedBuffer(pData, bytes);
+    }
+
+    /* captureFlags cannot change once the buffer is created. If the buffer
+     * does not exist yet, the value is verified again with lock held.
+     */
+    flags = pData->captureFlags;
+    perCpu = USBPcapBufferIsPerCpu(pData);
 
-        return pData->bufferSize - pData->readOffset +
-               pData->writeOffset;
+    buffer = ExAllocatePoolWithTag(NonPagedPool,
+                                   perCpu ? USBPCAP_PER_CPU_HEADER_BUFFER_SIZE :
+                                            (SIZE_T) bytes,
+                                   USBPCAP_BUFFER_TAG);
+
+    if (buffer == NULL)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    status = STATUS_SUCCESS;
+    KeAcquireSpinLock(&pData->bufferLock, &irql);
+    USBPcapRingFreeze(&pData->ring);
+    if (flags != pData->captureFlags)
+    {
+        /* Flags changed before we acquired the lock */
+        status = STATUS_INVALID_DEVICE_STATE;
+        ExFreePool(buffer);
+    }
+    else if (pData->ring.buffer == NULL)
+    {
+        if (perCpu)
+        {
+            status = USBPcapCpuRingsSetUpBuffers(&pData->cpuRings, bytes);
+        }
+
+        if (NT_SUCCESS(status))
+        {
+            USBPcapRingAttachBuffer(&pData->ring, buffer,
+                                    perCpu ? USBPCAP_PER_CPU_HEADER_BUFFER_SIZE :
+                                             bytes,
+                                    0);
+            pData->recordSkip = 0;
+            USBPcapBufferRearmTrigger(pData);
+            USBPcapWriteGlobalHeader(pData);
+            if (perCpu)
+            {
+                USBPcapCpuRingsThaw(&pData->cpuRings);
+            }
+            InterlockedExchange(&pData->captureArmed, 1);
+            DkDbgVal("Created new buffer", bytes);
+        }
+        else
+        {
+            ExFreePool(buffer);
+        }
+    }
+    else if (perCpu)
+    {
+        /* Per-CPU buffers cannot be resized */
+        status = STATUS_NOT_SUPPORTED;
+        ExFreePool(buffer);
     }
     else
     {
-        /* readOffset is lower than writeOffset when:
-         * ........RXXXXXXXXXXW.........
-         */
+        UINT32 allocated = USBPcapRingGetUsed(&pData->ring);
+
+        if (allocated >= bytes)
+        {
+            status = STATUS_BUFFER_TOO_SMALL;
+            ExFreePool(buffer);
+        }
+        else
+        {
+            PVOID oldBuffer = (PVOID)pData->ring.buffer;
+
+            /* Copy (if any) unread data to new buffer */
+            if (allocated > 0)
+            {
+                USBPcapRingRead(&pData->ring, buffer, bytes);
+            }
 
-        return pData->writeOffset - pData->readOffset;
+            /* Switch to the new buffer and free the old one */
+            USBPcapRingAttachBuffer(&pData->ring, buffer, bytes, allocated);
+            ExFreePool(oldBuffer);
+        }
     }
+
+    USBPcapRingThaw(&pData->ring);
+    KeReleaseSpinLock(&pData->bufferLock, irql);
+    return status;
 }
 
-__inline static void
-USBPcapBufferWriteUnsafe(PUSBPCAP_ROOTHUB_DATA pData,
-                         PVOID data,
-                         UINT32 length)
+NTSTATUS USBPcapSetSnaplenSize(PUSBPCAP_ROOTHUB_DATA pData,
+                               UINT32 bytes)
 {
-    PCHAR buffer = (PCHAR)pData->buffer;
+    NTSTATUS  status;
+    KIRQL     irql;
+
+    if (bytes == 0)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
 
-    if (pData->bufferSize - pData->writeOffset >= length)
+    status = STATUS_SUCCESS;
+    KeAcquireSpinLock(&pData->bufferLock, &irql);
+    if (pData->ring.buffer != NULL)
     {
-        /* We can write all data without looping */
-        RtlCopyMemory((PVOID)&buffer[pData->writeOffset],
-                      data,
-                      (SIZE_T)length);
-        pData->writeOffset += length;
-        pData->writeOffset %= pData->bufferSize;
+        status = STATUS_UNSUCCESSFUL;
     }
     else
     {
-        /* We need to loop */
-        PCHAR origData = (PCHAR)data;
-        UINT32 tmp;
+        pData->snaplen = bytes;
+        USBPcapSnaplenBuild(&pData->snaplenLookup, &pData->snaplenTable,
+                            bytes);
+    }
 
-        /* First copy */
-        tmp = pData->bufferSize - pData->writeOffset;
-        RtlCopyMemory((PVOID)&buffer[pData->writeOffset],
-                      data,
-                      (SIZE_T)tmp);
+    KeReleaseSpinLock(&pData->bufferLock, irql);
+    return status;
+}
+
+NTSTATUS USBPcapSetSnaplenTable(PUSBPCAP_ROOTHUB_DATA pData,
+                                PUSBPCAP_IOCTL_SNAPLEN_TABLE pTable)
+{
+    NTSTATUS  status;
+    KIRQL     irql;
 
-        /* Second copy */
-        RtlCopyMemory(pData->buffer, /* Write at beginning of buffer */
-                      (PVOID)&origData[tmp],
-                      length - tmp);
+    status = USBPcapSnaplenValidate(pTable);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
 
-        pData->writeOffset = length - tmp;
+    KeAcquireSpinLock(&pData->bufferLock, &irql);
+    if (pData->ring.buffer != NULL)
+    {
+        status = STATUS_UNSUCCESSFUL;
+    }
+    else
+    {
+        RtlCopyMemory(&pData->snaplenTable, pTable,
+                      sizeof(USBPCAP_IOCTL_SNAPLEN_TABLE));
+        USBPcapSnaplenBuild(&pData->snaplenLookup, &pData->snaplenTable,
+                            pData->snaplen);
     }
+
+    KeReleaseSpinLock(&pData->bufferLock, irql);
+    return status;
 }
 
 /*
- * Writes data to buffer.
- *
- * Caller must have acquired buffer spin lock.
+ * Removes all snaplen table limits. Caller must make sure there is no
+ * buffer.
  */
-static NTSTATUS USBPcapBufferWrite(PUSBPCAP_ROOTHUB_DATA pData,
-                                   PVOID data,
-                                   UINT32 length)
+VOID USBPcapResetSnaplenTable(PUSBPCAP_ROOTHUB_DATA pData)
 {
-    if (length == 0)
+    RtlZeroMemory(&pData->snaplenTable, sizeof(USBPCAP_IOCTL_SNAPLEN_TABLE));
+    USBPcapSnaplenBuild(&pData->snaplenLookup, &pData->snaplenTable,
+                        pData->snaplen);
+}
+
+NTSTATUS USBPcapSetReadWakeup(PUSBPCAP_ROOTHUB_DATA pData,
+                              UINT32 minBytes,
+                              UINT32 maxLatencyUs)
+{
+    KIRQL    irql;
+    NTSTATUS status;
+
+    KeAcquireSpinLock(&pData->bufferLock, &irql);
+    status = USBPcapWakeupSet(&pData->wakeup, minBytes, maxLatencyUs);
+    if (!NT_SUCCESS(status))
+    {
+        KeReleaseSpinLock(&pData->bufferLock, irql);
+        return status;
+    }
+
+    /* Pending read may be ready with the new threshold */
+    if (pData->readPending != 0)
+    {
+        USBPcapBufferCompletePendedReadIrp(pData, irql, FALSE);
+    }
+    else
+    {
+        KeReleaseSpinLock(&pData->bufferLock, irql);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS USBPcapSetCaptureFlags(PUSBPCAP_ROOTHUB_DATA pData,
+                                UINT32 flags)
+{
+    NTSTATUS  status;
+    KIRQL     irql;
+
+    if (flags & ~USBPCAP_SUPPORTED_CAPTURE_FLAGS)
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    /* Shared buffer is a single ring */
+    if ((flags & USBPCAP_CAPTURE_FLAG_PER_CPU_BUFFERS) &&
+        (flags & USBPCAP_CAPTURE_FLAG_MAPPED_BUFFER))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    /* Mapped buffer is not read with read IRPs */
+    if ((flags & USBPCAP_CAPTURE_FLAG_WHOLE_RECORDS) &&
+        (flags & USBPCAP_CAPTURE_FLAG_MAPPED_BUFFER))
     {
-        DkDbgStr("Cannot write empty data.");
         return STATUS_INVALID_PARAMETER;
     }
 
-    if (USBPcapGetBufferFree(pData) < length)
+    /* Records can be evicted only from single ring the driver reads from */
+    if ((flags & USBPCAP_CAPTURE_FLAG_OVERWRITE_OLDEST) &&
+        (flags & (USBPCAP_CAPTURE_FLAG_PER_CPU_BUFFERS |
+                  USBPCAP_CAPTURE_FLAG_MAPPED_BUFFER)))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if ((flags & USBPCAP_CAPTURE_FLAG_PER_CPU_BUFFERS) &&
+        (pData->cpuRings.count == 0))
     {
-        DkDbgStr("No free space left.");
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    USBPcapBufferWriteUnsafe(pData, data, length);
-    return STATUS_SUCCESS;
+    status = STATUS_SUCCESS;
+    KeAcquireSpinLock(&pData->bufferLock, &irql);
+    if (pData->ring.buffer != NULL)
+    {
+        status = STATUS_UNSUCCESSFUL;
+    }
+    else if (USBPcapBufferIsTriggerSet(pData) &&
+             (flags & (USBPCAP_CAPTURE_FLAG_PER_CPU_BUFFERS |
+                       USBPCAP_CAPTURE_FLAG_MAPPED_BUFFER)))
+    {
+        /* Trigger needs single ring the driver reads from */
+        status = STATUS_INVALID_PARAMETER;
+    }
+    else
+    {
+        pData->captureFlags = flags;
+    }
+
+    KeReleaseSpinLock(&pData->bufferLock, irql);
+    return status;
 }
 
 /*
- * Reads data from circular buffer.
+ * Replaces the filter program. Program with count 0 removes the filter.
  *
- * Retruns number of bytes read.
+ * Writers access the program only while they are inside the ring, so it
+ * can be safely freed when there is no buffer.
  */
-static UINT32 USBPcapBufferRead(PUSBPCAP_ROOTHUB_DATA pData,
-                                PVOID destBuffer,
-                                UINT32 destBufferSize)
+NTSTATUS USBPcapSetFilterProgram(PUSBPCAP_ROOTHUB_DATA pData,
+                                 PUSBPCAP_IOCTL_FILTER_PROGRAM pProgram)
 {
-    UINT32 available;
-    UINT32 toRead;
-
-    PCHAR srcBuffer = (PCHAR)pData->buffer;
-
-    available = USBPcapGetBufferAllocated(pData);
+    PUSBPCAP_IOCTL_FILTER_PROGRAM program = NULL;
+    NTSTATUS                      status;
+    KIRQL                         irql;
 
-    /* No data to be read or empty destination buffer */
-    if (available == 0 || destBufferSize == 0)
+    if (pProgram->count > 0)
     {
-        return 0;
+        status = USBPcapFilterProgramCreate(pProgram, &program);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
     }
 
-    /* Calculate how many bytes will fit into buffer */
-    if (available > destBufferSize)
+    status = STATUS_SUCCESS;
+    KeAcquireSpinLock(&pData->bufferLock, &irql);
+    if (pData->ring.buffer != NULL)
     {
-        toRead = destBufferSize;
+        status = STATUS_UNSUCCESSFUL;
     }
     else
     {
-        toRead = available;
+        PUSBPCAP_IOCTL_FILTER_PROGRAM old = pData->filterProgram;
+        pData->filterProgram = program;
+        program = old;
     }
 
-    if (pData->writeOffset > pData->readOffset)
+    KeReleaseSpinLock(&pData->bufferLock, irql);
+
+    /* Either the old program or the rejected new one */
+    USBPcapFilterProgramFree(program);
+    return status;
+}
+
+NTSTATUS USBPcapSetTrigger(PUSBPCAP_ROOTHUB_DATA pData,
+                           PUSBPCAP_IOCTL_TRIGGER pTrigger)
+{
+    NTSTATUS  status;
+    KIRQL     irql;
+
+    if (!USBPcapTriggerValidate(pTrigger))
     {
-        /* Simply copy the contiguous data */
-        RtlCopyMemory(destBuffer,
-                      (PVOID)&srcBuffer[pData->readOffset],
-                      (SIZE_T)toRead);
+        return STATUS_INVALID_PARAMETER;
+    }
 
-        pData->readOffset += toRead;
-        pData->readOffset %= pData->bufferSize;
+    status = STATUS_SUCCESS;
+    KeAcquireSpinLock(&pData->bufferLock, &irql);
+    if (pData->ring.buffer != NULL)
+    {
+        status = STATUS_UNSUCCESSFUL;
+    }
+    else if ((pTrigger->type != USBPCAP_TRIGGER_NONE) &&
+             (pData->captureFlags & (USBPCAP_CAPTURE_FLAG_PER_CPU_BUFFERS |
+                                     USBPCAP_CAPTURE_FLAG_MAPPED_BUFFER)))
+    {
+        /* Trigger needs single ring the driver reads from */
+        status = STATUS_INVALID_PARAMETER;
     }
     else
     {
-        UINT32 tmp;
-        UINT32 tmp2;
-        tmp = pData->bufferSize - pData->readOffset;
+        RtlCopyMemory(&pData->trigger, pTrigger, sizeof(USBPCAP_IOCTL_TRIGGER));
+        USBPcapBufferRearmTrigger(pData);
+    }
 
-        if (tmp >= toRead)
-        {
-            /* Copy contiguous data */
-            RtlCopyMemory(destBuffer,
-                          (PVOID)&srcBuffer[pData->readOffset],
-                          (SIZE_T)toRead);
+    KeReleaseSpinLock(&pData->bufferLock, irql);
+    return status;
+}
 
-            pData->readOffset += toRead;
-            pData->readOffset %= pData->bufferSize;
-        }
-        else
-        {
-            PCHAR dstBuffer = (PCHAR)destBuffer;
-            /* Copy non-contiguous data */
+/*
+ * Removes the trigger. Caller must make sure there is no buffer.
+ */
+VOID USBPcapResetTrigger(PUSBPCAP_ROOTHUB_DATA pData)
+{
+    RtlZeroMemory(&pData->trigger, sizeof(USBPCAP_IOCTL_TRIGGER));
+    USBPcapBufferRearmTrigger(pData);
+}
 
-            /* First copy */
-            RtlCopyMemory(destBuffer,
-                          (PVOID)&srcBuffer[pData->readOffset],
-                          (SIZE_T)tmp);
+VOID USBPcapBufferGetStatistics(PUSBPCAP_ROOTHUB_DATA pData,
+                                PUSBPCAP_IOCTL_STATISTICS pStats)
+{
+    PDEVICE_EXTENSION  pControlExt;
+    KIRQL              irql;
 
-            /* Second copy */
-            RtlCopyMemory((PVOID)&dstBuffer[tmp],
-                          (PVOID)srcBuffer,
-                          (SIZE_T)toRead - tmp);
+    USBPcapStatisticsGet(&pData->stats, pStats);
 
-            pData->readOffset = toRead - tmp;
-        }
+    KeAcquireSpinLock(&pData->bufferLock, &irql);
+    if (USBPcapBufferIsPerCpu(pData))
+    {
+        pStats->bufferSize = USBPcapCpuRingsGetSize(&pData->cpuRings);
+    }
+    else
+    {
+        pStats->bufferSize = pData->ring.size;
     }
+    KeReleaseSpinLock(&pData->bufferLock, irql);
 
-    return toRead;
+    pControlExt = (PDEVICE_EXTENSION)pData->controlDevice->DeviceExtension;
+    pStats->pendingReads = (UINT32)pControlExt->context.control.pendingReads;
+    pStats->reserved = 0;
 }
 
-
 /*
- * Writes global PCAP header to buffer.
- * Caller must have acquired buffer spin lock.
+ * If there is buffer allocated for given control device, frees all
+ * memory allocated to it, otherwise does nothing.
  */
-__inline static VOID
-USBPcapWriteGlobalHeader(PUSBPCAP_ROOTHUB_DATA pData)
+VOID USBPcapBufferRemoveBuffer(PDEVICE_EXTENSION pDevExt)
 {
-    pcap_hdr_t header;
+    PDEVICE_EXTENSION      pRootExt;
+    PUSBPCAP_ROOTHUB_DATA  pData;
+    USBPCAP_SHARED_BUFFER  shared;
+    KIRQL                  irql;
 
-    header.magic_number = 0xA1B2C3D4;
-    header.version_major = 2;
-    header.version_minor = 4;
-    header.thiszone = 0 /* Assume UTC */;
-    header.sigfigs = 0;
-    header.snaplen = pData->snaplen;
-    header.network = DLT_USBPCAP;
+    ASSERT(pDevExt->deviceMagic == USBPCAP_MAGIC_CONTROL);
 
-    ASSERT (USBPcapGetBufferFree(pData) >= sizeof(header));
+    pRootExt = (PDEVICE_EXTENSION)pDevExt->context.control.pRootHubObject->DeviceExtension;
+    pData = pRootExt->context.usb.pDeviceData->pRootData;
 
-    USBPcapBufferWrite(pData, (PVOID)&header, sizeof(header));
+    if (pData->ring.buffer == NULL)
+    {
+        return;
+    }
+
+    USBPcapSharedBufferInitialize(&shared);
+
+    /* Buffer found - wait for writers to leave and free it */
+    KeAcquireSpinLock(&pData->bufferLock, &irql);
+    InterlockedExchange(&pData->captureArmed, 0);
+    USBPcapRingFreeze(&pData->ring);
+    if (pData->shared.mdl != NULL)
+    {
+        /* Detach now, unmap and free once the lock is released */
+        shared = pData->shared;
+        USBPcapSharedBufferInitialize(&pData->shared);
+        USBPcapRingSetCommitMirror(&pData->ring, NULL);
+    }
+    else
+    {
+        ExFreePool((PVOID)pData->ring.buffer);
+    }
+    USBPcapRingAttachBuffer(&pData->ring, NULL, 0, 0);
+    pData->recordSkip = 0;
+    if (USBPcapBufferIsPerCpu(pData))
+    {
+        USBPcapCpuRingsRemoveBuffers(&pData->cpuRings);
+    }
+    USBPcapRingThaw(&pData->ring);
+    KeReleaseSpinLock(&pData->bufferLock, irql);
+
+    USBPcapSharedBufferUnmapFromUser(&shared);
+    USBPcapSharedBufferFree(&shared);
 }
 
-NTSTATUS USBPcapSetUpBuffer(PUSBPCAP_ROOTHUB_DATA pData,
-                            UINT32 bytes)
+/*
+ * Maps shared buffer into the calling process. Once mapped, the process
+ * becomes the only consumer of the ring.
+ * Must be called at PASSIVE_LEVEL in the context of the calling process.
+ */
+NTSTATUS USBPcapBufferMapToUser(PUSBPCAP_ROOTHUB_DATA pData,
+                                HANDLE event,
+                                PUSBPCAP_IOCTL_MAPPED_BUFFER pMapped)
 {
     NTSTATUS  status;
     KIRQL     irql;
-    PVOID     buffer;
 
-    /* Minimum buffer size is 4 KiB, maximum 128 MiB */
-    if (bytes < 4096 || bytes > 134217728)
+    if (!USBPcapBufferIsMapped(pData) || (pData->shared.mdl == NULL))
     {
-        return STATUS_INVALID_PARAMETER;
+        return STATUS_INVALID_DEVICE_STATE;
     }
 
-    buffer = ExAllocatePoolWithTag(NonPagedPool,
-                                   (SIZE_T) bytes,
-                                   USBPCAP_BUFFER_TAG);
+    /* Control device allows only one capture handle, so there is no other
+     * thread that could set up or remove the buffer at this point.
+     */
+    status = USBPcapSharedBufferMapToUser(&pData->shared, event);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
 
-    if (buffer == NULL)
+#if defined(_WIN64)
+    if (IoIs32bitProcess(NULL) &&
+        (((ULONG_PTR)pData->shared.userAddress > (ULONG_PTR)MAXULONG) ||
+         ((ULONG_PTR)pData->shared.userConsumer > (ULONG_PTR)MAXULONG)))
     {
+        USBPcapSharedBufferUnmapFromUser(&pData->shared);
         return STATUS_INSUFFICIENT_RESOURCES;
     }
+#endif
 
-    status = STATUS_SUCCESS;
+    /* Hand over the read position to the consumer */
     KeAcquireSpinLock(&pData->bufferLock, &irql);
-    if (pData->buffer == NULL)
+    USBPcapSharedBufferSetReadOffset(&pData->shared,
+                                     USBPcapRingGetReadOffset(&pData->ring));
+    InterlockedExchange(&pData->shared.mapped, 1);
+    KeReleaseSpinLock(&pData->bufferLock, irql);
+
+    pMapped->address = (UINT64)(ULONG_PTR)pData->shared.userAddress;
+    pMapped->size = pData->shared.size;
+    pMapped->reserved = 0;
+    pMapped->consumer = (UINT64)(ULONG_PTR)pData->shared.userConsumer;
+
+    DkDbgVal("Mapped shared buffer", pMapped->size);
+    return STATUS_SUCCESS;
+}
+
+/*
+ * If there is buffer allocated for given control device, writes global
+ * PCAP header to the buffer, otherwise does nothing.
+ */
+VOID USBPcapBufferInitializeBuffer(PDEVICE_EXTENSION pDevExt)
+{
+    PDEVICE_EXTENSION      pRootExt;
+    PUSBPCAP_ROOTHUB_DATA  pData;
+    KIRQL                  irql;
+
+    ASSERT(pDevExt->deviceMagic == USBPCAP_MAGIC_CONTROL);
+
+    pRootExt = (PDEVICE_EXTENSION)pDevExt->context.control.pRootHubObject->DeviceExtension;
+    pData = pRootExt->context.usb.pDeviceData->pRootData;
+
+    /* Mapped buffer offsets must never go backwards */
+    if ((pData->ring.buffer == NULL) || USBPcapBufferIsMapped(pData))
     {
-        pData->buffer = buffer;
-        pData->bufferSize = bytes;
-        pData->readOffset = 0;
-        pData->writeOffset = 0;
-        USBPcapWriteGlobalHeader(pData);
-        DkDbgVal("Created new buffer", bytes);
+        return;
     }
-    else
+
+    /* Buffer found - reset all data and write global PCAP header */
+    KeAcquireSpinLock(&pData->bufferLock, &irql);
+    USBPcapRingFreeze(&pData->ring);
+    USBPcapRingReset(&pData->ring);
+    pData->recordSkip = 0;
+    USBPcapBufferRearmTrigger(pData);
+    if (USBPcapBufferIsPerCpu(pData))
+    {
+        USBPcapCpuRingsFreeze(&pData->cpuRings);
+        USBPcapCpuRingsReset(&pData->cpuRings);
+    }
+    USBPcapWriteGlobalHeader(pData);
+    if (USBPcapBufferIsPerCpu(pData))
+    {
+        USBPcapCpuRingsThaw(&pData->cpuRings);
+    }
+    USBPcapRingThaw(&pData->ring);
+    KeReleaseSpinLock(&pData->bufferLock, irql);
+}
+
+/* called with pRootData->bufferLock held
+ * releases pRootData->bufferLock before return
+ *
+ * If force is FALSE, the read is completed only if wakeup threshold is met.
+ *
+ * Caller takes over the wakeup from writers: readPending is cleared first,
+ * so writers committing in the meantime do not contend for bufferLock.
+ * It is set again only when reads stay queued.
+ */
+static VOID USBPcapBufferCompletePendedReadIrp(PUSBPCAP_ROOTHUB_DATA pRootData,
+                                              KIRQL irql,
+                                              BOOLEAN force)
+{
+    PDEVICE_EXTENSION  pControlExt;
+    PIRP               pIrp = NULL;
+    PVOID              buffer;
+    UINT32             bytes;
+
+    pControlExt = (PDEVICE_EXTENSION)pRootData->controlDevice->DeviceExtension;
+
+    ASSERT(pControlExt->deviceMagic == USBPCAP_MAGIC_CONTROL);
+
+    InterlockedExchange(&pRootData->readPending, 0);
+
+    /* Reader can keep multiple reads pending. Complete as many as there
+     * is data for, oldest first.
+     */
+    for (;;)
     {
-        UINT32 allocated = USBPcapGetBufferAllocated(pData);
+        if (!USBPcapBufferIsReadReady(pRootData, force))
+        {
+            if (pControlExt->context.control.pendingReads == 0)
+            {
+                KeReleaseSpinLock(&pRootData->bufferLock, irql);
+                return;
+            }
+
+            /* Not enough data yet, keep the IRP queued and hand the
+             * wakeup back to writers. Data committed before the flag got
+             * set was not noticed by its writer, so look once more. Both
+             * sides use interlocked operations, thus at least one of them
+             * sees the other. If a writer claimed the flag in between, it
+             * completes the read as soon as the lock gets released.
+             */
+            InterlockedExchange(&pRootData->readPending, 1);
+            if (!USBPcapBufferIsReadReady(pRootData, FALSE) ||
+                (InterlockedCompareExchange(&pRootData->readPending,
+                                            0, 1) != 1))
+            {
+                KeReleaseSpinLock(&pRootData->bufferLock, irql);
+                return;
+            }
+            continue;
+        }
+
+        pIrp = IoCsqRemoveNextIrp(&pControlExt->context.control.ioCsq,
+                                      NULL);
+        if (pIrp == NULL)
+        {
+            /* New IRPs are queued only with bufferLock held */
+            KeReleaseSpinLock(&pRootData->bufferLock, irql);
+            return;
+        }
+
+        /*
+         * Only IRPs with non-zero buffer are being queued.
+         *
+         * Since control device has DO_DIRECT_IO bit set the MDL is already
+         * probed and locked
+         */
+        buffer = MmGetSystemAddressForMdlSafe(pIrp->MdlAddress,
+                                              NormalPagePriority);
 
-        if (allocated >= bytes)
+        if (pRootData->shared.mapped != 0)
         {
-            status = STATUS_BUFFER_TOO_SMALL;
-            ExFreePool(buffer);
+            /* Read was queued before the buffer got mapped */
+            pIrp->IoStatus.Status = STATUS_INVALID_DEVICE_STATE;
+            bytes = 0;
+        }
+        else if (buffer == NULL)
+        {
+            pIrp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+            bytes = 0;
         }
         else
         {
-            /* Copy (if any) unread data to new buffer */
-            if (allocated > 0)
+            UINT32 bufferLength = MmGetMdlByteCount(pIrp->MdlAddress);
+
+            if (bufferLength != 0)
+            {
+                bytes = USBPcapBufferRead(pRootData,
+                                          buffer, bufferLength);
+            }
+            else
             {
-                USBPcapBufferRead(pData, buffer, bytes);
+                bytes = 0;
             }
 
-            /* Free the old buffer */
-            ExFreePool(pData->buffer);
-            pData->buffer = buffer;
-            pData->bufferSize = bytes;
-            pData->readOffset = 0;
-            pData->writeOffset = allocated;
+            pIrp->IoStatus.Status = STATUS_SUCCESS;
         }
-    }
 
-    KeReleaseSpinLock(&pData->bufferLock, irql);
-    return status;
+        pIrp->IoStatus.Information = (ULONG_PTR) bytes;
+        /* release lock before completing the IRP! */
+        KeReleaseSpinLock(&pRootData->bufferLock, irql);
+        IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+
+        /* Forced completion applies only to the oldest read */
+        force = FALSE;
+        KeAcquireSpinLock(&pRootData->bufferLock, &irql);
+    }
 }
 
-NTSTATUS USBPcapSetSnaplenSize(PUSBPCAP_ROOTHUB_DATA pData,
-                               UINT32 bytes)
+/*
+ * Arms the wakeup timer unless it is already armed. The timer is not
+ * cancelled when read gets completed earlier, the DPC simply finds
+ * nothing to do or completes the next read a bit sooner.
+ */
+static VOID USBPcapBufferArmWakeupTimer(PUSBPCAP_ROOTHUB_DATA pRootData)
 {
-    NTSTATUS  status;
-    KIRQL     irql;
-
-    if (bytes == 0)
-    {
-        return STATUS_INVALID_PARAMETER;
-    }
+    LARGE_INTEGER dueTime;
 
-    status = STATUS_SUCCESS;
-    KeAcquireSpinLock(&pData->bufferLock, &irql);
-    if (pData->buffer != NULL)
+    if (InterlockedCompareExchange(&pRootData->wakeupTimerArmed, 1, 0) != 0)
     {
-        status = STATUS_UNSUCCESSFUL;
-    }
-    else
-    {
-        pData->snaplen = bytes;
+        return;
     }
 
-    KeReleaseSpinLock(&pData->bufferLock, irql);
-    return status;
+    /* Negative value is relative time in 100 ns units */
+    dueTime.QuadPart = -10 * (LONGLONG)pRootData->wakeup.maxLatencyUs;
+    KeSetTimer(&pRootData->wakeupTimer, dueTime, &pRootData->wakeupDpc);
 }
 
-/*
- * If there is buffer allocated for given control device, frees all
- * memory allocated to it, otherwise does nothing.
- */
-VOID USBPcapBufferRemoveBuffer(PDEVICE_EXTENSION pDevExt)
+static KDEFERRED_ROUTINE USBPcapBufferWakeupDpc;
+
+static VOID USBPcapBufferWakeupDpc(PKDPC Dpc,
+                                   PVOID DeferredContext,
+                                   PVOID SystemArgument1,
+                                   PVOID SystemArgument2)
 {
-    PDEVICE_EXTENSION      pRootExt;
-    PUSBPCAP_ROOTHUB_DATA  pData;
-    KIRQL                  irql;
+    PUSBPCAP_ROOTHUB_DATA pRootData = (PUSBPCAP_ROOTHUB_DATA)DeferredContext;
+    KIRQL                 irql;
 
-    ASSERT(pDevExt->deviceMagic == USBPCAP_MAGIC_CONTROL);
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
 
-    pRootExt = (PDEVICE_EXTENSION)pDevExt->context.control.pRootHubObject->DeviceExtension;
-    pData = pRootExt->context.usb.pDeviceData->pRootData;
+    InterlockedExchange(&pRootData->wakeupTimerArmed, 0);
 
-    if (pData->buffer == NULL)
+    if (pRootData->readPending == 0)
     {
         return;
     }
 
-    /* Buffer found - free it */
-    KeAcquireSpinLock(&pData->bufferLock, &irql);
-    pData->readOffset = 0;
-    pData->writeOffset = 0;
-    ExFreePool((PVOID)pData->buffer);
-    pData->buffer = NULL;
-    KeReleaseSpinLock(&pData->bufferLock, irql);
+    /* Maximum latency reached - complete the read with whatever is there */
+    KeAcquireSpinLock(&pRootData->bufferLock, &irql);
+    USBPcapBufferCompletePendedReadIrp(pRootData, irql, TRUE);
+}
+
+VOID USBPcapBufferInitializeWakeup(PUSBPCAP_ROOTHUB_DATA pRootData)
+{
+    pRootData->readPending = 0;
+    USBPcapWakeupInitialize(&pRootData->wakeup);
+    pRootData->wakeupTimerArmed = 0;
+    KeInitializeTimer(&pRootData->wakeupTimer);
+    KeInitializeDpc(&pRootData->wakeupDpc, USBPcapBufferWakeupDpc,
+                    (PVOID)pRootData);
 }
 
 /*
- * If there is buffer allocated for given control device, writes global
- * PCAP header to the buffer, otherwise does nothing.
+ * Cancels the wakeup timer and waits for the DPC to finish.
+ * Must be called at PASSIVE_LEVEL before root hub data is freed.
  */
-VOID USBPcapBufferInitializeBuffer(PDEVICE_EXTENSION pDevExt)
+VOID USBPcapBufferCancelWakeup(PUSBPCAP_ROOTHUB_DATA pRootData)
 {
-    PDEVICE_EXTENSION      pRootExt;
-    PUSBPCAP_ROOTHUB_DATA  pData;
-    KIRQL                  irql;
+    KeCancelTimer(&pRootData->wakeupTimer);
+    KeFlushQueuedDpcs();
+    InterlockedExchange(&pRootData->wakeupTimerArmed, 0);
+}
 
-    ASSERT(pDevExt->deviceMagic == USBPCAP_MAGIC_CONTROL);
+/*
+ * Completes pending read IRP (if any) after data was committed to the ring.
+ */
+static VOID USBPcapBufferWakeReader(PUSBPCAP_ROOTHUB_DATA pRootData)
+{
+    KIRQL irql;
 
-    pRootExt = (PDEVICE_EXTENSION)pDevExt->context.control.pRootHubObject->DeviceExtension;
-    pData = pRootExt->context.usb.pDeviceData->pRootData;
+    /* USBPcapRingCommit ends with interlocked operation, so this read
+     * cannot be performed before the data is visible to the reader.
+     */
+    if (pRootData->readPending == 0)
+    {
+        return;
+    }
+
+    if (USBPcapBufferIsTriggerSet(pRootData))
+    {
+        /* Reads are held until the capture stops */
+        if (USBPcapTriggerGetState(&pRootData->triggerProgress) !=
+            USBPCAP_TRIGGER_STATE_CLOSED)
+        {
+            return;
+        }
+    }
+    else
+    {
+        switch (USBPcapWakeupCheck(&pRootData->wakeup,
+                                   USBPcapBufferGetUsed(pRootData),
+                                   FALSE))
+        {
+            case USBPCAP_WAKEUP_WAIT:
+                /* Reader got the data already */
+                return;
+            case USBPCAP_WAKEUP_ARM_TIMER:
+                /* Coalesce, the timer bounds the latency */
+                USBPcapBufferArmWakeupTimer(pRootData);
+                return;
+            default:
+                break;
+        }
+    }
 
-    if (pData->buffer == NULL)
+    /* Only the writer that clears the flag takes bufferLock, the others
+     * leave completing the reads to it. This keeps the lock off the commit
+     * path while read is pending, which is the steady state of a capture.
+     */
+    if (InterlockedCompareExchange(&pRootData->readPending, 0, 1) != 1)
     {
         return;
     }
 
-    /* Buffer found - reset all data and write global PCAP header */
-    KeAcquireSpinLock(&pData->bufferLock, &irql);
-    pData->readOffset = 0;
-    pData->writeOffset = 0;
-    USBPcapWriteGlobalHeader(pData);
-    KeReleaseSpinLock(&pData->bufferLock, irql);
+    KeAcquireSpinLock(&pRootData->bufferLock, &irql);
+    USBPcapBufferCompletePendedReadIrp(pRootData, irql, FALSE);
 }
 
 NTSTATUS USBPcapBufferHandleReadIrp(PIRP pIrp,
@@ -415,11 +1128,27 @@ NTSTATUS USBPcapBufferHandleReadIrp(PIRP pIrp,
     pRootExt = (PDEVICE_EXTENSION)pDevExt->context.control.pRootHubObject->DeviceExtension;
     pRootData = pRootExt->context.usb.pDeviceData->pRootData;
 
-    if (pRootData->buffer == NULL)
+    if (pRootData->ring.buffer == NULL)
     {
         return STATUS_UNSUCCESSFUL;
     }
 
+    if (pRootData->shared.mapped != 0)
+    {
+        /* Data is available only via the mapping */
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    /* Every read must be able to hold at least one record. snaplen cannot
+     * change while there is buffer.
+     */
+    if (USBPcapBufferIsWholeRecords(pRootData) &&
+        ((UINT64)pStack->Parameters.Read.Length <
+         USBPCAP_WHOLE_RECORDS_MIN_READ((UINT64)pRootData->snaplen)))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
     /*
      * Since control device has DO_DIRECT_IO bit set the MDL is already
      * probed and locked
@@ -441,14 +1170,44 @@ NTSTATUS USBPcapBufferHandleReadIrp(PIRP pIrp,
      * otherwise complete this IRP then return SUCCESS
      */
     KeAcquireSpinLock(&pRootData->bufferLock, &irql);
-    bytesRead = USBPcapBufferRead(pRootData,
-                                  buffer, bufferLength);
+    /* Earlier reads must get the data first */
+    if ((pDevExt->context.control.pendingReads == 0) &&
+        USBPcapBufferIsReadReady(pRootData, FALSE))
+    {
+        bytesRead = USBPcapBufferRead(pRootData,
+                                      buffer, bufferLength);
+    }
+    else
+    {
+        bytesRead = 0;
+    }
     *pBytesRead = bytesRead;
     if (bytesRead == 0)
     {
         IoCsqInsertIrp(&pDevExt->context.control.ioCsq,
                        pIrp, NULL);
-        KeReleaseSpinLock(&pRootData->bufferLock, irql);
+
+        /* Writers check readPending only after committing the data.
+         * Check the ring again after setting it, so data committed
+         * in the meantime does not stay unnoticed.
+         */
+        InterlockedExchange(&pRootData->readPending, 1);
+        if (USBPcapBufferIsReadReady(pRootData, FALSE))
+        {
+            USBPcapBufferCompletePendedReadIrp(pRootData, irql, FALSE);
+        }
+        else
+        {
+            if (!USBPcapBufferIsTriggerSet(pRootData) &&
+                USBPcapWakeupCheck(&pRootData->wakeup,
+                                   USBPcapBufferGetUsed(pRootData),
+                                   FALSE) == USBPCAP_WAKEUP_ARM_TIMER)
+            {
+                /* Below the wakeup threshold */
+                USBPcapBufferArmWakeupTimer(pRootData);
+            }
+            KeReleaseSpinLock(&pRootData->bufferLock, irql);
+        }
         return STATUS_PENDING;
     }
 
@@ -456,68 +1215,37 @@ NTSTATUS USBPcapBufferHandleReadIrp(PIRP pIrp,
     return STATUS_SUCCESS;
 }
 
-/* called with pRootData->bufferLock held
- * releases pRootData->bufferLock before return
+/*
+ * Returns snapshot length for given packet.
  */
-static void USBPcapBufferCompletePendedReadIrp(PUSBPCAP_ROOTHUB_DATA pRootData, KIRQL irql)
+__inline static UINT32
+USBPcapBufferGetSnaplen(PUSBPCAP_ROOTHUB_DATA pData,
+                        PUSBPCAP_BUFFER_PACKET_HEADER header)
 {
-    PDEVICE_EXTENSION  pControlExt;
-    PIRP               pIrp = NULL;
-    PVOID              buffer;
-    UINT32             bufferLength;
-    UINT32             bytes;
-
-    pControlExt = (PDEVICE_EXTENSION)pRootData->controlDevice->DeviceExtension;
-
-    ASSERT(pControlExt->deviceMagic == USBPCAP_MAGIC_CONTROL);
-
-    pIrp = IoCsqRemoveNextIrp(&pControlExt->context.control.ioCsq,
-                                  NULL);
-    if (pIrp == NULL)
-    {
-        KeReleaseSpinLock(&pRootData->bufferLock, irql);
-        return;
-    }
+    return USBPcapSnaplenGet(&pData->snaplenLookup, header->device,
+                             header->endpoint, header->transfer);
+}
 
-    /*
-     * Only IRPs with non-zero buffer are being queued.
-     *
-     * Since control device has DO_DIRECT_IO bit set the MDL is already
-     * probed and locked
-     */
-    buffer = MmGetSystemAddressForMdlSafe(pIrp->MdlAddress,
-                                          NormalPagePriority);
+/*
+ * Returns number of payload bytes (out of header->dataLength) that will
+ * be stored for given packet. Allows the caller to map only the part of
+ * transfer buffer that is going to be captured.
+ */
+UINT32 USBPcapBufferGetCaptureLength(PUSBPCAP_ROOTHUB_DATA pRootData,
+                                     PUSBPCAP_BUFFER_PACKET_HEADER header)
+{
+    UINT32 snaplen = USBPcapBufferGetSnaplen(pRootData, header);
 
-    if (buffer == NULL)
-    {
-        pIrp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
-        bytes = 0;
-    }
-    else
+    if (snaplen <= header->headerLen)
     {
-        UINT32 bufferLength = MmGetMdlByteCount(pIrp->MdlAddress);
-
-        if (bufferLength != 0)
-        {
-            bytes = USBPcapBufferRead(pRootData,
-                                      buffer, bufferLength);
-        }
-        else
-        {
-            bytes = 0;
-        }
-
-        pIrp->IoStatus.Status = STATUS_SUCCESS;
+        return 0;
     }
 
-    pIrp->IoStatus.Information = (ULONG_PTR) bytes;
-    /* release lock before completing the IRP! */
-    KeReleaseSpinLock(&pRootData->bufferLock, irql);
-    IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+    return min(header->dataLength, snaplen - header->headerLen);
 }
 
 __inline static VOID
-USBPcapInitializePcapHeader(PUSBPCAP_ROOTHUB_DATA pData,
+USBPcapInitializePcapHeader(UINT32 snaplen,
                             LARGE_INTEGER timestamp,
                             pcaprec_hdr_t *pcapHeader,
                             UINT32 bytes)
@@ -526,9 +1254,9 @@ USBPcapInitializePcapHeader(PUSBPCAP_ROOTHUB_DATA pData,
     pcapHeader->ts_usec = (UINT32)((timestamp.QuadPart%10000000)/10);
 
     /* Obey the snaplen limit */
-    if (bytes > pData->snaplen)
+    if (bytes > snaplen)
     {
-        pcapHeader->incl_len = pData->snaplen;
+        pcapHeader->incl_len = snaplen;
     }
     else
     {
@@ -537,33 +1265,154 @@ USBPcapInitializePcapHeader(PUSBPCAP_ROOTHUB_DATA pData,
     pcapHeader->orig_len = bytes;
 }
 
-/* Caller must hold bufferLock
+/*
+ * Fills in Enhanced Packet Block header. Timestamp is kept at full
+ * 100 ns resolution (see USBPCAP_PCAPNG_TSRESOL).
+ */
+__inline static VOID
+USBPcapInitializeEnhancedPacketBlock(LARGE_INTEGER timestamp,
+                                     pcaprec_hdr_t *pcapHeader,
+                                     UINT32 blockLength,
+                                     pcapng_epb_t *epb)
+{
+    UINT64 ts = (UINT64)(timestamp.QuadPart - USBPCAP_EPOCH_DIFFERENCE);
+
+    epb->block_type = PCAPNG_BLOCK_TYPE_EPB;
+    epb->block_total_length = blockLength;
+    epb->interface_id = 0;
+    epb->timestamp_high = (UINT32)(ts >> 32);
+    epb->timestamp_low = (UINT32)ts;
+    epb->captured_len = pcapHeader->incl_len;
+    epb->packet_len = pcapHeader->orig_len;
+}
+
+/*
+ * Reserves space for record of given length, evicting the oldest records
+ * if the ring is full. Must be called at DISPATCH_LEVEL by producer that
+ * entered the ring.
+ */
+static NTSTATUS
+USBPcapBufferReserveEvicting(PUSBPCAP_ROOTHUB_DATA pData,
+                             UINT32 length,
+                             PUSBPCAP_RING_RESERVATION reservation)
+{
+    NTSTATUS  status;
+    UINT32    records;
+    UINT32    evicted;
+
+    /* Other producers can take the released space, evict until it fits */
+    KeAcquireSpinLockAtDpcLevel(&pData->evictLock);
+    do
+    {
+        records = USBPcapRecordEvict(&pData->ring, length,
+                                     pData->recordSkip, &evicted);
+        USBPcapStatisticsPacketsEvicted(&pData->stats, records, evicted);
+        status = USBPcapRingReserve(&pData->ring, length, reservation);
+    }
+    while ((!NT_SUCCESS(status)) && (records > 0));
+    KeReleaseSpinLockFromDpcLevel(&pData->evictLock);
+
+    return status;
+}
+
+/* Can be called concurrently from multiple CPUs. Does not acquire bufferLock.
  *
  * payloadEntries is array of USBPCAP_PAYLOAD_ENTRY with the last element being {0, NULL}
+ * If pTimestamp is NULL, current time is used.
  */
 static NTSTATUS
 USBPcapBufferStorePacket(PUSBPCAP_ROOTHUB_DATA pRootData,
-                         LARGE_INTEGER timestamp,
+                         PLARGE_INTEGER pTimestamp,
                          PUSBPCAP_BUFFER_PACKET_HEADER header,
                          PUSBPCAP_PAYLOAD_ENTRY payloadEntries)
 {
-    UINT32             bytes;
-    UINT32             bytesFree;
-    UINT32             tmp;
-    pcaprec_hdr_t      pcapHeader;
-    int                i;
+    LARGE_INTEGER             timestamp;
+    UINT32                    bytes;
+    UINT32                    captured;
+    UINT32                    tmp;
+    pcaprec_hdr_t             pcapHeader;
+    pcapng_epb_t              epb;
+    UCHAR                     prefix[USBPCAP_RECORD_MAX_PREFIX];
+    USBPCAP_FILTER_PACKET     packet;
+    BOOLEAN                   compact;
+    PVOID                     recordHeader;
+    UINT32                    recordHeaderLength;
+    UINT32                    recordLength;
+    UINT32                    headerSkip;
+    UINT32                    padding;
+    UINT32                    zero = 0;
+    USBPCAP_RING_RESERVATION  reservation;
+    PUSBPCAP_RING             ring;
+    LONG64                    used;
+    NTSTATUS                  status;
+    KIRQL                     irql;
+    int                       i;
+
+    /* Stay at DISPATCH_LEVEL from Enter to Leave. USBPcapRingCommit
+     * and USBPcapRingFreeze wait for reservations owned by other CPUs
+     * and would deadlock if the owning thread could be preempted.
+     */
+    KeRaiseIrql(DISPATCH_LEVEL, &irql);
+
+    if (USBPcapBufferIsPerCpu(pRootData))
+    {
+        ring = USBPcapCpuRingsGetCurrent(&pRootData->cpuRings);
+    }
+    else
+    {
+        ring = &pRootData->ring;
+    }
+
+    if (!USBPcapRingEnter(ring))
+    {
+        KeLowerIrql(irql);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    /* No other record can be reserved on this processor until we leave,
+     * so taking the timestamp only now keeps per-CPU rings in timestamp
+     * order (see USBPcapCpuRings.h).
+     */
+    if (pTimestamp == NULL)
+    {
+        timestamp = USBPcapGetCurrentTimestamp();
+    }
+    else
+    {
+        timestamp = *pTimestamp;
+    }
 
+    /* Snaplen table and filter program cannot change while we are inside
+     * the ring.
+     */
     bytes = header->headerLen + header->dataLength;
+    captured = min(bytes, USBPcapBufferGetSnaplen(pRootData, header));
 
-    USBPcapInitializePcapHeader(pRootData, timestamp, &pcapHeader, bytes);
+    packet.header = header;
+    packet.payload = payloadEntries;
 
-    /* pcapHeader.incl_len contains the number of bytes to write */
-    bytes = pcapHeader.incl_len;
+    /* Run the filter before anything is reserved so rejected packets
+     * cost no buffer space.
+     */
+    if (pRootData->filterProgram != NULL)
+    {
+        tmp = USBPcapFilterProgramRun(pRootData->filterProgram->insns, &packet);
+        if (tmp == 0)
+        {
+            USBPcapRingLeave(ring);
+            KeLowerIrql(irql);
+            return STATUS_NO_MATCH;
+        }
+        if (tmp < captured)
+        {
+            captured = tmp;
+        }
+    }
 
     /* Sanity check payload entries */
-    if (bytes > (sizeof(pcaprec_hdr_t) + header->headerLen))
+    if (captured > (sizeof(pcaprec_hdr_t) + header->headerLen))
     {
-        UINT32 bytesMissing = bytes - (sizeof(pcaprec_hdr_t) + header->headerLen);
+        UINT32 bytesMissing = captured - (sizeof(pcaprec_hdr_t) + header->headerLen);
 
         for (i = 0; (bytesMissing > 0) && (payloadEntries[i].buffer); i++)
         {
@@ -573,32 +1422,100 @@ USBPcapBufferStorePacket(PUSBPCAP_ROOTHUB_DATA pRootData,
         {
             DkDbgVal("Attempted to write invalid packet. Missing %d bytes of payload.",
                      bytesMissing);
+            USBPcapRingLeave(ring);
+            KeLowerIrql(irql);
             return STATUS_INVALID_PARAMETER;
         }
     }
 
-    bytesFree = USBPcapGetBufferFree(pRootData);
+    /* Keep the packets around the trigger until they are read */
+    if (USBPcapBufferIsTriggerSet(pRootData) &&
+        !USBPcapTriggerCheck(&pRootData->triggerProgress,
+                             &pRootData->trigger, &packet))
+    {
+        USBPcapRingLeave(ring);
+        KeLowerIrql(irql);
+        return STATUS_NO_MATCH;
+    }
+
+    /* Only the mapped buffer is read directly by user mode. Otherwise store
+     * compact record and leave the timestamp conversion to the reader.
+     */
+    compact = USBPcapBufferIsMapped(pRootData) ? FALSE : TRUE;
+    headerSkip = 0;
+    padding = 0;
+
+    if (compact)
+    {
+        recordHeaderLength = USBPcapRecordEncode(header,
+                                                 (UINT64)timestamp.QuadPart,
+                                                 captured, prefix);
+        recordLength = recordHeaderLength + USBPcapRecordGetBodyLength(captured);
+        recordHeader = (PVOID)prefix;
+        /* USBPCAP_BUFFER_PACKET_HEADER fields are part of the prefix */
+        headerSkip = min(captured, (UINT32)sizeof(USBPCAP_BUFFER_PACKET_HEADER));
+    }
+    else if (USBPcapBufferIsPcapng(pRootData))
+    {
+        USBPcapInitializePcapHeader(captured, timestamp, &pcapHeader, bytes);
+        /* Block data is padded to 32 bits and followed by block length */
+        padding = (4 - (captured & 3)) & 3;
+        recordLength = (UINT32)sizeof(pcapng_epb_t) + captured + padding +
+                       (UINT32)sizeof(UINT32);
+        USBPcapInitializeEnhancedPacketBlock(timestamp, &pcapHeader,
+                                             recordLength, &epb);
+        recordHeader = (PVOID)&epb;
+        recordHeaderLength = (UINT32)sizeof(pcapng_epb_t);
+    }
+    else
+    {
+        USBPcapInitializePcapHeader(captured, timestamp, &pcapHeader, bytes);
+        recordLength = (UINT32)sizeof(pcaprec_hdr_t) + captured;
+        recordHeader = (PVOID)&pcapHeader;
+        recordHeaderLength = (UINT32)sizeof(pcaprec_hdr_t);
+    }
+
+    /* captured contains the number of packet bytes to write */
+    bytes = captured;
 
-    if ((pRootData->buffer == NULL) ||
-        (bytesFree < sizeof(pcaprec_hdr_t)) ||
-        ((bytesFree - sizeof(pcaprec_hdr_t)) < bytes))
+    status = USBPcapRingReserve(ring, recordLength, &reservation);
+    if ((!NT_SUCCESS(status)) && (pRootData->shared.mapped != 0))
+    {
+        /* Consumer does not tell the driver when it reads the data. Pick up
+         * its read position and try again.
+         */
+        if (USBPcapRingAdvanceRead(ring,
+                USBPcapSharedBufferGetReadOffset(&pRootData->shared)))
+        {
+            status = USBPcapRingReserve(ring, recordLength, &reservation);
+        }
+    }
+    if ((!NT_SUCCESS(status)) && USBPcapBufferIsOverwrite(pRootData))
+    {
+        status = USBPcapBufferReserveEvicting(pRootData, recordLength,
+                                              &reservation);
+    }
+    if (!NT_SUCCESS(status))
     {
         DkDbgStr("No enough free space left.");
-        return STATUS_INSUFFICIENT_RESOURCES;
+        USBPcapStatisticsPacketDropped(&pRootData->stats, recordLength);
+        USBPcapRingLeave(ring);
+        KeLowerIrql(irql);
+        return status;
     }
 
-    /* Write Packet Header */
-    USBPcapBufferWriteUnsafe(pRootData,
-                             (PVOID) &pcapHeader,
-                             (UINT32) sizeof(pcaprec_hdr_t));
+    /* Write Packet Header (Enhanced Packet Block header or record prefix) */
+    USBPcapRingWrite(ring, &reservation,
+                     recordHeader,
+                     recordHeaderLength);
 
     /* Write USBPCAP_BUFFER_PACKET_HEADER */
     tmp = min(bytes, (UINT32)header->headerLen);
-    if (tmp > 0)
+    if (tmp > headerSkip)
     {
-        USBPcapBufferWriteUnsafe(pRootData,
-                                 (PVOID) header,
-                                 tmp);
+        USBPcapRingWrite(ring, &reservation,
+                         (PVOID)&((PUCHAR)header)[headerSkip],
+                         tmp - headerSkip);
     }
     bytes -= tmp;
 
@@ -608,44 +1525,70 @@ USBPcapBufferStorePacket(PUSBPCAP_ROOTHUB_DATA pRootData,
         tmp = min(bytes, payloadEntries[i].size);
         if (tmp > 0)
         {
-            USBPcapBufferWriteUnsafe(pRootData,
-                                     payloadEntries[i].buffer,
-                                     tmp);
+            USBPcapRingWrite(ring, &reservation,
+                             payloadEntries[i].buffer,
+                             tmp);
         }
         bytes -= tmp;
     }
 
+    if ((!compact) && USBPcapBufferIsPcapng(pRootData))
+    {
+        if (padding > 0)
+        {
+            USBPcapRingWrite(ring, &reservation, (PVOID)&zero, padding);
+        }
+        USBPcapRingWrite(ring, &reservation,
+                         (PVOID)&recordLength,
+                         (UINT32)sizeof(UINT32));
+    }
+
+    /* Reader cannot go past our record before it is committed */
+    used = reservation.end - USBPcapRingGetReadOffset(ring);
+    USBPcapRingCommit(ring, &reservation);
+    USBPcapStatisticsPacketCaptured(&pRootData->stats, (UINT32)used);
+    if (USBPcapBufferIsTriggerSet(pRootData))
+    {
+        USBPcapTriggerStored(&pRootData->triggerProgress);
+    }
+    /* Shared buffer is guaranteed to be mapped until Leave */
+    USBPcapSharedBufferNotify(&pRootData->shared);
+    USBPcapRingLeave(ring);
+    KeLowerIrql(irql);
+
     return STATUS_SUCCESS;
 }
 
-NTSTATUS USBPcapBufferWriteTimestampedPayload(PUSBPCAP_ROOTHUB_DATA pRootData,
-                                              LARGE_INTEGER timestamp,
-                                              PUSBPCAP_BUFFER_PACKET_HEADER header,
-                                              PUSBPCAP_PAYLOAD_ENTRY payload)
+static NTSTATUS
+USBPcapBufferWrite(PUSBPCAP_ROOTHUB_DATA pRootData,
+                   PLARGE_INTEGER pTimestamp,
+                   PUSBPCAP_BUFFER_PACKET_HEADER header,
+                   PUSBPCAP_PAYLOAD_ENTRY payload)
 {
-    KIRQL                  irql;
     NTSTATUS               status;
 
-    KeAcquireSpinLock(&pRootData->bufferLock, &irql);
-    status = USBPcapBufferStorePacket(pRootData, timestamp, header, payload);
+    status = USBPcapBufferStorePacket(pRootData, pTimestamp, header, payload);
     if (NT_SUCCESS(status))
     {
-        USBPcapBufferCompletePendedReadIrp(pRootData, irql);
-    }
-    else
-    {
-        KeReleaseSpinLock(&pRootData->bufferLock, irql);
+        USBPcapBufferWakeReader(pRootData);
     }
 
     return status;
 }
 
+NTSTATUS USBPcapBufferWriteTimestampedPayload(PUSBPCAP_ROOTHUB_DATA pRootData,
+                                              LARGE_INTEGER timestamp,
+                                              PUSBPCAP_BUFFER_PACKET_HEADER header,
+                                              PUSBPCAP_PAYLOAD_ENTRY payload)
+{
+    return USBPcapBufferWrite(pRootData, &timestamp, header, payload);
+}
+
 NTSTATUS USBPcapBufferWritePayload(PUSBPCAP_ROOTHUB_DATA pRootData,
                                    PUSBPCAP_BUFFER_PACKET_HEADER header,
                                    PUSBPCAP_PAYLOAD_ENTRY payload)
 {
-    LARGE_INTEGER timestamp = USBPcapGetCurrentTimestamp();
-    return USBPcapBufferWriteTimestampedPayload(pRootData, timestamp, header, payload);
+    return USBPcapBufferWrite(pRootData, NULL, header, payload);
 }
 
 NTSTATUS USBPcapBufferWriteTimestampedPacket(PUSBPCAP_ROOTHUB_DATA pRootData,
@@ -667,6 +1610,12 @@ NTSTATUS USBPcapBufferWritePacket(PUSBPCAP_ROOTHUB_DATA pRootData,
                                   PUSBPCAP_BUFFER_PACKET_HEADER header,
                                   PVOID buffer)
 {
-    LARGE_INTEGER timestamp = USBPcapGetCurrentTimestamp();
-    return USBPcapBufferWriteTimestampedPacket(pRootData, timestamp, header, buffer);
+    USBPCAP_PAYLOAD_ENTRY  payload[2];
+
+    payload[0].size   = header->dataLength;
+    payload[0].buffer = buffer;
+    payload[1].size   = 0;
+    payload[1].buffer = NULL;
+
+    return USBPcapBufferWrite(pRootData, NULL, header, payload);
 }
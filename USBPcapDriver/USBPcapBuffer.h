@@ -8,17 +8,34 @@
 #define USBPCAP_BUFFER_H
 
 #include "USBPcapMain.h"
-
-typedef struct
-{
-    UINT32  size;
-    PVOID   buffer;
-} USBPCAP_PAYLOAD_ENTRY, *PUSBPCAP_PAYLOAD_ENTRY;
+#include "USBPcapPayload.h"
 
 NTSTATUS USBPcapSetUpBuffer(PUSBPCAP_ROOTHUB_DATA pData,
                             UINT32 bytes);
 NTSTATUS USBPcapSetSnaplenSize(PUSBPCAP_ROOTHUB_DATA pData,
                                UINT32 bytes);
+NTSTATUS USBPcapSetSnaplenTable(PUSBPCAP_ROOTHUB_DATA pData,
+                                PUSBPCAP_IOCTL_SNAPLEN_TABLE pTable);
+VOID USBPcapResetSnaplenTable(PUSBPCAP_ROOTHUB_DATA pData);
+NTSTATUS USBPcapSetReadWakeup(PUSBPCAP_ROOTHUB_DATA pData,
+                              UINT32 minBytes,
+                              UINT32 maxLatencyUs);
+NTSTATUS USBPcapSetCaptureFlags(PUSBPCAP_ROOTHUB_DATA pData,
+                                UINT32 flags);
+NTSTATUS USBPcapSetFilterProgram(PUSBPCAP_ROOTHUB_DATA pData,
+                                 PUSBPCAP_IOCTL_FILTER_PROGRAM pProgram);
+NTSTATUS USBPcapSetTrigger(PUSBPCAP_ROOTHUB_DATA pData,
+                           PUSBPCAP_IOCTL_TRIGGER pTrigger);
+VOID USBPcapResetTrigger(PUSBPCAP_ROOTHUB_DATA pData);
+VOID USBPcapBufferGetStatistics(PUSBPCAP_ROOTHUB_DATA pData,
+                                PUSBPCAP_IOCTL_STATISTICS pStats);
+
+NTSTATUS USBPcapBufferMapToUser(PUSBPCAP_ROOTHUB_DATA pData,
+                                HANDLE event,
+                                PUSBPCAP_IOCTL_MAPPED_BUFFER pMapped);
+
+VOID USBPcapBufferInitializeWakeup(PUSBPCAP_ROOTHUB_DATA pRootData);
+VOID USBPcapBufferCancelWakeup(PUSBPCAP_ROOTHUB_DATA pRootData);
 
 VOID USBPcapBufferRemoveBuffer(PDEVICE_EXTENSION pDevExt);
 VOID USBPcapBufferInitializeBuffer(PDEVICE_EXTENSION pDevExt);
@@ -26,6 +43,9 @@ NTSTATUS USBPcapBufferHandleReadIrp(PIRP pIrp,
                                     PDEVICE_EXTENSION pDevExt,
                                     PUINT32 pBytesRead);
 
+UINT32 USBPcapBufferGetCaptureLength(PUSBPCAP_ROOTHUB_DATA pRootData,
+                                     PUSBPCAP_BUFFER_PACKET_HEADER header);
+
 /* Same as USBPcapBufferWriteTimestampedPacket but take {0, NULL} terminated
  * array of payload entries instead of single buffer pointer.
  */
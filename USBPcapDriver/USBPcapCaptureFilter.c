@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include "USBPcapCaptureFilter.h"
+
+/*
+ * Determines range and index for given address.
+ *
+ * Returns TRUE on success (address is within <0; 127>), FALSE otherwise.
+ */
+static BOOLEAN USBPcapGetAddressRangeAndIndex(int address, UINT8 *range, UINT8 *index)
+{
+    if ((address < 0) || (address > 127))
+    {
+        DkDbgVal("Invalid address!", address);
+        return FALSE;
+    }
+
+    *range = address / 32;
+    *index = address % 32;
+    return TRUE;
+}
+
+BOOLEAN USBPcapIsDeviceFiltered(PUSBPCAP_ADDRESS_FILTER filter, int address)
+{
+    BOOLEAN filtered = FALSE;
+    UINT8 range;
+    UINT8 index;
+
+    ASSERT(filter != NULL);
+
+    if (filter->filterAll == TRUE)
+    {
+        /* Do not check individual bit if all devices are filtered. */
+        return TRUE;
+    }
+
+    if (USBPcapGetAddressRangeAndIndex(address, &range, &index) == FALSE)
+    {
+        /* Assume that invalid addresses are filtered. */
+        return TRUE;
+    }
+
+    if (filter->addresses[range] & (1 << index))
+    {
+        filtered = TRUE;
+    }
+
+    return filtered;
+}
+
+BOOLEAN USBPcapSetDeviceFiltered(PUSBPCAP_ADDRESS_FILTER filter, int address)
+{
+    UINT8 range;
+    UINT8 index;
+
+    ASSERT(filter != NULL);
+
+    if (USBPcapGetAddressRangeAndIndex(address, &range, &index) == FALSE)
+    {
+        return FALSE;
+    }
+
+    filter->addresses[range] |= (1 << index);
+    return TRUE;
+}
+
+/*
+ * Initializes endpoint filter that captures every endpoint and transfer
+ * type of devices selected by address filter.
+ */
+VOID USBPcapInitEndpointFilter(PUSBPCAP_ENDPOINT_FILTER filter,
+                               PUSBPCAP_ADDRESS_FILTER address)
+{
+    ASSERT(filter != NULL);
+
+    if (address != NULL)
+    {
+        memcpy(&filter->address, address, sizeof(USBPCAP_ADDRESS_FILTER));
+    }
+    else
+    {
+        memset(&filter->address, 0, sizeof(USBPCAP_ADDRESS_FILTER));
+    }
+    filter->transferTypes = USBPCAP_TRANSFER_MASK_ALL;
+    memset(filter->endpoints, 0xFF, sizeof(filter->endpoints));
+}
+
+/*
+ * Checks endpoint and transfer type of device already accepted by
+ * USBPcapIsDeviceFiltered(). endpoint is USB endpoint address with
+ * direction bit, 0xFF if unknown.
+ *
+ * Returns TRUE if packet should be captured.
+ */
+/*
+ * Idle path check done for every submitted URB. armed is non-zero when
+ * a capture, latency measurement or traffic counting is active. Returns
+ * TRUE if URBs of device at address have to be analyzed.
+ */
+BOOLEAN USBPcapIsAddressArmed(PUSBPCAP_ENDPOINT_FILTER filter,
+                              LONG armed,
+                              int address)
+{
+    if (armed == 0)
+    {
+        return FALSE;
+    }
+
+    return USBPcapIsDeviceFiltered(&filter->address, address);
+}
+
+BOOLEAN USBPcapIsEndpointFiltered(PUSBPCAP_ENDPOINT_FILTER filter,
+                                  int address,
+                                  UCHAR endpoint,
+                                  UCHAR transfer)
+{
+    ASSERT(filter != NULL);
+
+    if ((transfer <= USBPCAP_TRANSFER_BULK) &&
+        !(filter->transferTypes & USBPCAP_TRANSFER_MASK(transfer)))
+    {
+        return FALSE;
+    }
+
+    if ((endpoint == 0xFF) || (address < 0) || (address > 127))
+    {
+        /* Nothing to check against */
+        return TRUE;
+    }
+
+    return (filter->endpoints[address] & USBPCAP_ENDPOINT_BIT(endpoint)) ?
+           TRUE : FALSE;
+}
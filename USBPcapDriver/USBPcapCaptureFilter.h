@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef USBPCAP_CAPTURE_FILTER_H
+#define USBPCAP_CAPTURE_FILTER_H
+
+#include "USBPcapPortable.h"
+#include "include/USBPcap.h"
+
+/*
+ * Device address and endpoint filter bitmaps set with
+ * IOCTL_USBPCAP_START_FILTERING. See USBPCAP_ENDPOINT_FILTER.
+ *
+ * These functions do not call any kernel functions.
+ */
+
+BOOLEAN USBPcapIsDeviceFiltered(PUSBPCAP_ADDRESS_FILTER filter, int address);
+BOOLEAN USBPcapSetDeviceFiltered(PUSBPCAP_ADDRESS_FILTER filter, int address);
+VOID USBPcapInitEndpointFilter(PUSBPCAP_ENDPOINT_FILTER filter,
+                               PUSBPCAP_ADDRESS_FILTER address);
+BOOLEAN USBPcapIsEndpointFiltered(PUSBPCAP_ENDPOINT_FILTER filter,
+                                  int address,
+                                  UCHAR endpoint,
+                                  UCHAR transfer);
+BOOLEAN USBPcapIsAddressArmed(PUSBPCAP_ENDPOINT_FILTER filter,
+                              LONG armed,
+                              int address);
+
+#endif /* USBPCAP_CAPTURE_FILTER_H */
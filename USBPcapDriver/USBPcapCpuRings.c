@@ -0,0 +1,370 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include "USBPcapCpuRings.h"
+#include "USBPcapRecord.h"
+
+#define USBPCAP_CPU_RINGS_TAG  (ULONG)'gnRC'
+
+/* Minimum size of single processor ring */
+#define USBPCAP_CPU_RING_MIN_SIZE  4096
+
+/*
+ * Allocates the rings array. Must be called at PASSIVE_LEVEL.
+ *
+ * On failure count is set to 0 and per-CPU buffers cannot be used.
+ */
+NTSTATUS USBPcapCpuRingsInitialize(PUSBPCAP_CPU_RINGS cpuRings)
+{
+    ULONG count;
+    ULONG i;
+
+#if (NTDDI_VERSION >= NTDDI_WIN7)
+    /* Rings are indexed by system-wide processor number, so processors
+     * from different groups do not share rings.
+     */
+    count = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+#elif (NTDDI_VERSION >= NTDDI_VISTA)
+    count = KeQueryActiveProcessorCount(NULL);
+#else
+    count = (ULONG)KeNumberProcessors;
+#endif
+
+    cpuRings->drainIndex = 0;
+    cpuRings->drainSkip = 0;
+    cpuRings->count = 0;
+    cpuRings->rings = ExAllocatePoolWithTag(NonPagedPool,
+                                            count * sizeof(USBPCAP_RING),
+                                            USBPCAP_CPU_RINGS_TAG);
+    if (cpuRings->rings == NULL)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        USBPcapRingInitialize(&cpuRings->rings[i]);
+    }
+    cpuRings->count = count;
+
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Frees all memory. To be called only when root hub data is being freed.
+ */
+VOID USBPcapCpuRingsFree(PUSBPCAP_CPU_RINGS cpuRings)
+{
+    ULONG i;
+
+    if (cpuRings->rings == NULL)
+    {
+        return;
+    }
+
+    for (i = 0; i < cpuRings->count; i++)
+    {
+        if (cpuRings->rings[i].buffer != NULL)
+        {
+            ExFreePool((PVOID)cpuRings->rings[i].buffer);
+        }
+    }
+
+    ExFreePool((PVOID)cpuRings->rings);
+    cpuRings->rings = NULL;
+    cpuRings->count = 0;
+}
+
+/*
+ * Allocates buffer for every ring. bytes is split evenly between rings.
+ *
+ * Caller must hold bufferLock. On success the rings are left frozen so no
+ * packet gets written before the global header. Caller has to call
+ * USBPcapCpuRingsThaw once the header is in place.
+ */
+NTSTATUS USBPcapCpuRingsSetUpBuffers(PUSBPCAP_CPU_RINGS cpuRings,
+                                     UINT32 bytes)
+{
+    UINT32 size;
+    ULONG  i;
+
+    if (cpuRings->count == 0)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    size = max(bytes / cpuRings->count, USBPCAP_CPU_RING_MIN_SIZE);
+
+    for (i = 0; i < cpuRings->count; i++)
+    {
+        PVOID buffer;
+
+        USBPcapRingFreeze(&cpuRings->rings[i]);
+        ASSERT(cpuRings->rings[i].buffer == NULL);
+
+        buffer = ExAllocatePoolWithTag(NonPagedPool,
+                                       (SIZE_T) size,
+                                       USBPCAP_CPU_RINGS_TAG);
+        if (buffer == NULL)
+        {
+            USBPcapCpuRingsRemoveBuffers(cpuRings);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        USBPcapRingAttachBuffer(&cpuRings->rings[i], buffer, size, 0);
+    }
+
+    cpuRings->drainIndex = 0;
+    cpuRings->drainSkip = 0;
+
+    DkDbgVal("Created per-CPU buffers", size);
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Frees all ring buffers. Caller must hold bufferLock.
+ */
+VOID USBPcapCpuRingsRemoveBuffers(PUSBPCAP_CPU_RINGS cpuRings)
+{
+    ULONG i;
+
+    for (i = 0; i < cpuRings->count; i++)
+    {
+        PUSBPCAP_RING ring = &cpuRings->rings[i];
+
+        USBPcapRingFreeze(ring);
+        if (ring->buffer != NULL)
+        {
+            ExFreePool((PVOID)ring->buffer);
+            USBPcapRingAttachBuffer(ring, NULL, 0, 0);
+        }
+        USBPcapRingThaw(ring);
+    }
+
+    cpuRings->drainIndex = 0;
+    cpuRings->drainSkip = 0;
+}
+
+VOID USBPcapCpuRingsFreeze(PUSBPCAP_CPU_RINGS cpuRings)
+{
+    ULONG i;
+
+    for (i = 0; i < cpuRings->count; i++)
+    {
+        USBPcapRingFreeze(&cpuRings->rings[i]);
+    }
+}
+
+VOID USBPcapCpuRingsThaw(PUSBPCAP_CPU_RINGS cpuRings)
+{
+    ULONG i;
+
+    for (i = 0; i < cpuRings->count; i++)
+    {
+        USBPcapRingThaw(&cpuRings->rings[i]);
+    }
+}
+
+/*
+ * Discards all data. Rings must be frozen.
+ */
+VOID USBPcapCpuRingsReset(PUSBPCAP_CPU_RINGS cpuRings)
+{
+    ULONG i;
+
+    for (i = 0; i < cpuRings->count; i++)
+    {
+        USBPcapRingReset(&cpuRings->rings[i]);
+    }
+
+    cpuRings->drainIndex = 0;
+    cpuRings->drainSkip = 0;
+}
+
+/*
+ * Returns ring that belongs to current processor.
+ * Must be called at DISPATCH_LEVEL.
+ */
+PUSBPCAP_RING USBPcapCpuRingsGetCurrent(PUSBPCAP_CPU_RINGS cpuRings)
+{
+    ULONG cpu;
+
+    ASSERT(cpuRings->count > 0);
+
+    /* Ring is shared only by processors added after the rings were
+     * allocated. That is safe, the ring is multi-producer, but records
+     * in the shared ring are no longer guaranteed to be in timestamp order.
+     */
+#if (NTDDI_VERSION >= NTDDI_WIN7)
+    cpu = KeGetCurrentProcessorNumberEx(NULL);
+#else
+    cpu = KeGetCurrentProcessorNumber();
+#endif
+    return &cpuRings->rings[cpu % cpuRings->count];
+}
+
+/*
+ * Returns total size of all ring buffers.
+ */
+UINT32 USBPcapCpuRingsGetSize(PUSBPCAP_CPU_RINGS cpuRings)
+{
+    UINT64 size = 0;
+    ULONG  i;
+
+    for (i = 0; i < cpuRings->count; i++)
+    {
+        size += cpuRings->rings[i].size;
+    }
+
+    return (UINT32)min(size, (UINT64)MAXULONG);
+}
+
+UINT32 USBPcapCpuRingsGetUsed(PUSBPCAP_CPU_RINGS cpuRings)
+{
+    UINT32 used = 0;
+    ULONG  i;
+
+    for (i = 0; i < cpuRings->count; i++)
+    {
+        used += USBPcapRingGetUsed(&cpuRings->rings[i]);
+    }
+
+    return used;
+}
+
+/*
+ * Finds the ring with the oldest record.
+ *
+ * Every ring is in timestamp order (see USBPcapCpuRings.h), so comparing
+ * the first records is enough for committed data. Empty ring with active
+ * producer may get record older than the ones already committed elsewhere.
+ * If holdInFlight is TRUE, FALSE is returned in such case so the caller
+ * returns what it has and the merge continues on next read.
+ *
+ * Returns FALSE if all rings are empty.
+ */
+static BOOLEAN
+USBPcapCpuRingsGetOldest(PUSBPCAP_CPU_RINGS cpuRings,
+                         BOOLEAN holdInFlight,
+                         PULONG index)
+{
+    UINT64         timestamp;
+    UINT64         oldest = 0;
+    ULONG          oldestIndex = cpuRings->count;
+    ULONG          i;
+
+    for (i = 0; i < cpuRings->count; i++)
+    {
+        if (!USBPcapRecordPeekTimestamp(&cpuRings->rings[i], &timestamp))
+        {
+            /* Producers take the timestamp after entering the ring.
+             * Producer entering after this check has timestamp newer
+             * than anything committed so far.
+             */
+            if (holdInFlight && (cpuRings->rings[i].writers != 0))
+            {
+                return FALSE;
+            }
+            continue;
+        }
+
+        if ((oldestIndex == cpuRings->count) ||
+            (timestamp < oldest))
+        {
+            oldest = timestamp;
+            oldestIndex = i;
+        }
+    }
+
+    *index = oldestIndex;
+    return (oldestIndex == cpuRings->count) ? FALSE : TRUE;
+}
+
+/*
+ * Reads records from all rings, oldest first, and expands them to pcap
+ * records (or pcapng Enhanced Packet Blocks).
+ *
+ * Records are committed as a whole, so once the prefix is visible the rest
+ * of the record is readable too. Record which does not fit into destBuffer
+ * gets split and the next call continues with it.
+ *
+ * Caller must hold bufferLock. Returns number of bytes read.
+ */
+UINT32 USBPcapCpuRingsRead(PUSBPCAP_CPU_RINGS cpuRings,
+                           BOOLEAN pcapng,
+                           PVOID destBuffer,
+                           UINT32 destBufferSize)
+{
+    PUCHAR  dest = (PUCHAR)destBuffer;
+    UINT32  total = 0;
+
+    while (total < destBufferSize)
+    {
+        UINT32 bytes;
+
+        if ((cpuRings->drainSkip == 0) &&
+            !USBPcapCpuRingsGetOldest(cpuRings, (total > 0) ? TRUE : FALSE,
+                                      &cpuRings->drainIndex))
+        {
+            /* All rings are empty or record is in flight */
+            break;
+        }
+
+        bytes = USBPcapRecordRead(&cpuRings->rings[cpuRings->drainIndex],
+                                  pcapng,
+                                  &dest[total],
+                                  destBufferSize - total,
+                                  &cpuRings->drainSkip);
+        if (bytes == 0)
+        {
+            break;
+        }
+
+        total += bytes;
+    }
+
+    return total;
+}
+
+/*
+ * Same as USBPcapCpuRingsRead but never splits records. Stops at the first
+ * record that does not fit. Number of records read is added to *records.
+ *
+ * Caller must hold bufferLock. Returns number of bytes read.
+ */
+UINT32 USBPcapCpuRingsReadWhole(PUSBPCAP_CPU_RINGS cpuRings,
+                                BOOLEAN pcapng,
+                                PVOID destBuffer,
+                                UINT32 destBufferSize,
+                                PUINT32 records)
+{
+    PUCHAR  dest = (PUCHAR)destBuffer;
+    UINT32  total = 0;
+    ULONG   index;
+
+    /* Partially read record must be finished first */
+    ASSERT(cpuRings->drainSkip == 0);
+
+    while (USBPcapCpuRingsGetOldest(cpuRings, (total > 0) ? TRUE : FALSE,
+                                    &index))
+    {
+        UINT32 bytes;
+
+        bytes = USBPcapRecordReadWhole(&cpuRings->rings[index],
+                                       pcapng,
+                                       &dest[total],
+                                       destBufferSize - total);
+        if (bytes == 0)
+        {
+            break;
+        }
+
+        total += bytes;
+        (*records)++;
+    }
+
+    return total;
+}
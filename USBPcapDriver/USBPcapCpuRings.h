@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef USBPCAP_CPU_RINGS_H
+#define USBPCAP_CPU_RINGS_H
+
+#include "USBPcapPortable.h"
+#include "USBPcapRing.h"
+
+/*
+ * Per-processor staging rings.
+ *
+ * Every processor writes compact records (see USBPcapRecord.h) to its own
+ * ring, so producers running on different processors never touch the same
+ * cache lines. The reader merges the rings by record timestamp.
+ *
+ * The merge only compares first records of the rings, so every ring must
+ * be in timestamp order. Producers guarantee it by taking the timestamp at
+ * DISPATCH_LEVEL after entering the ring of the current processor:
+ * records of one processor are reserved, and thus committed, in the order
+ * the timestamps were taken. Records written with a caller supplied
+ * (earlier) timestamp are merged at the position they were committed at,
+ * the same as with the single ring.
+ *
+ * The rings array is allocated once per root hub and is never freed while
+ * the root hub exists. Only the ring buffers come and go, guarded by the
+ * ring Enter/Freeze protocol.
+ */
+typedef struct _USBPCAP_CPU_RINGS
+{
+    PUSBPCAP_RING          rings;
+    ULONG                  count;
+
+    /* Record that was only partially read (drainSkip expanded bytes were
+     * returned). Reader resumes it before looking at other rings.
+     */
+    ULONG                  drainIndex;
+    UINT32                 drainSkip;
+} USBPCAP_CPU_RINGS, *PUSBPCAP_CPU_RINGS;
+
+NTSTATUS USBPcapCpuRingsInitialize(PUSBPCAP_CPU_RINGS cpuRings);
+VOID USBPcapCpuRingsFree(PUSBPCAP_CPU_RINGS cpuRings);
+
+NTSTATUS USBPcapCpuRingsSetUpBuffers(PUSBPCAP_CPU_RINGS cpuRings,
+                                     UINT32 bytes);
+VOID USBPcapCpuRingsRemoveBuffers(PUSBPCAP_CPU_RINGS cpuRings);
+VOID USBPcapCpuRingsFreeze(PUSBPCAP_CPU_RINGS cpuRings);
+VOID USBPcapCpuRingsThaw(PUSBPCAP_CPU_RINGS cpuRings);
+VOID USBPcapCpuRingsReset(PUSBPCAP_CPU_RINGS cpuRings);
+
+PUSBPCAP_RING USBPcapCpuRingsGetCurrent(PUSBPCAP_CPU_RINGS cpuRings);
+
+UINT32 USBPcapCpuRingsGetSize(PUSBPCAP_CPU_RINGS cpuRings);
+UINT32 USBPcapCpuRingsGetUsed(PUSBPCAP_CPU_RINGS cpuRings);
+UINT32 USBPcapCpuRingsRead(PUSBPCAP_CPU_RINGS cpuRings,
+                           BOOLEAN pcapng,
+                           PVOID destBuffer,
+                           UINT32 destBufferSize);
+UINT32 USBPcapCpuRingsReadWhole(PUSBPCAP_CPU_RINGS cpuRings,
+                                BOOLEAN pcapng,
+                                PVOID destBuffer,
+                                UINT32 destBufferSize,
+                                PUINT32 records);
+
+#endif /* USBPCAP_CPU_RINGS_H */
@@ -80,31 +80,40 @@ HandleUSBPcapControlIOCTL(PIRP pIrp, PIO_STACK_LOCATION pStack,
         case IOCTL_USBPCAP_START_FILTERING:
         {
             PUSBPCAP_ADDRESS_FILTER pAddressFilter;
+            ULONG                   length;
 
-            if (pStack->Parameters.DeviceIoControl.InputBufferLength !=
-                sizeof(USBPCAP_ADDRESS_FILTER))
+            length = pStack->Parameters.DeviceIoControl.InputBufferLength;
+            pAddressFilter = (PUSBPCAP_ADDRESS_FILTER)pIrp->AssociatedIrp.SystemBuffer;
+
+            if (length == sizeof(USBPCAP_ENDPOINT_FILTER))
+            {
+                memcpy(&pRootData->filter, pAddressFilter,
+                       sizeof(USBPCAP_ENDPOINT_FILTER));
+            }
+            else if (length == sizeof(USBPCAP_ADDRESS_FILTER))
+            {
+                USBPcapInitEndpointFilter(&pRootData->filter, pAddressFilter);
+            }
+            else
             {
                 ntStat = STATUS_INVALID_PARAMETER;
                 break;
             }
 
-            pAddressFilter = (PUSBPCAP_ADDRESS_FILTER)pIrp->AssociatedIrp.SystemBuffer;
-            memcpy(&pRootData->filter, pAddressFilter,
-                   sizeof(USBPCAP_ADDRESS_FILTER));
-
+            /* Input can be either structure, dump the filter in effect */
             DkDbgStr("IOCTL_USBPCAP_START_FILTERING");
-            DkDbgVal("", pAddressFilter->addresses[0]);
-            DkDbgVal("", pAddressFilter->addresses[1]);
-            DkDbgVal("", pAddressFilter->addresses[2]);
-            DkDbgVal("", pAddressFilter->addresses[3]);
-            DkDbgVal("", pAddressFilter->filterAll);
+            DkDbgVal("", pRootData->filter.address.addresses[0]);
+            DkDbgVal("", pRootData->filter.address.addresses[1]);
+            DkDbgVal("", pRootData->filter.address.addresses[2]);
+            DkDbgVal("", pRootData->filter.address.addresses[3]);
+            DkDbgVal("", pRootData->filter.address.filterAll);
+            DkDbgVal("", pRootData->filter.transferTypes);
             break;
         }
 
         case IOCTL_USBPCAP_STOP_FILTERING:
             DkDbgStr("IOCTL_USBPCAP_STOP_FILTERING");
-            memset(&pRootData->filter, 0,
-                   sizeof(USBPCAP_ADDRESS_FILTER));
+            USBPcapInitEndpointFilter(&pRootData->filter, NULL);
             break;
 
         case IOCTL_USBPCAP_SET_SNAPLEN_SIZE:
@@ -125,6 +134,200 @@ HandleUSBPcapControlIOCTL(PIRP pIrp, PIO_STACK_LOCATION pStack,
             break;
         }
 
+        case IOCTL_USBPCAP_SET_SNAPLEN_TABLE:
+        {
+            PUSBPCAP_IOCTL_SNAPLEN_TABLE  pTable;
+
+            if (pStack->Parameters.DeviceIoControl.InputBufferLength !=
+                sizeof(USBPCAP_IOCTL_SNAPLEN_TABLE))
+            {
+                ntStat = STATUS_INVALID_PARAMETER;
+                break;
+            }
+
+            pTable = (PUSBPCAP_IOCTL_SNAPLEN_TABLE)pIrp->AssociatedIrp.SystemBuffer;
+            DkDbgVal("IOCTL_USBPCAP_SET_SNAPLEN_TABLE", pTable->count);
+
+            ntStat = USBPcapSetSnaplenTable(pRootData, pTable);
+            break;
+        }
+
+        case IOCTL_USBPCAP_SET_READ_WAKEUP:
+        {
+            PUSBPCAP_IOCTL_READ_WAKEUP  pWakeup;
+
+            if (pStack->Parameters.DeviceIoControl.InputBufferLength !=
+                sizeof(USBPCAP_IOCTL_READ_WAKEUP))
+            {
+                ntStat = STATUS_INVALID_PARAMETER;
+                break;
+            }
+
+            pWakeup = (PUSBPCAP_IOCTL_READ_WAKEUP)pIrp->AssociatedIrp.SystemBuffer;
+            DkDbgVal("IOCTL_USBPCAP_SET_READ_WAKEUP", pWakeup->minBytes);
+
+            ntStat = USBPcapSetReadWakeup(pRootData, pWakeup->minBytes,
+                                          pWakeup->maxLatencyUs);
+            break;
+        }
+
+        case IOCTL_USBPCAP_SET_CAPTURE_FLAGS:
+        {
+            PUSBPCAP_IOCTL_CAPTURE_FLAGS  pFlags;
+
+            if (pStack->Parameters.DeviceIoControl.InputBufferLength !=
+                sizeof(USBPCAP_IOCTL_CAPTURE_FLAGS))
+            {
+                ntStat = STATUS_INVALID_PARAMETER;
+                break;
+            }
+
+            pFlags = (PUSBPCAP_IOCTL_CAPTURE_FLAGS)pIrp->AssociatedIrp.SystemBuffer;
+            DkDbgVal("IOCTL_USBPCAP_SET_CAPTURE_FLAGS", pFlags->flags);
+
+            ntStat = USBPcapSetCaptureFlags(pRootData, pFlags->flags);
+            break;
+        }
+
+        case IOCTL_USBPCAP_MAP_BUFFER:
+        {
+            USBPCAP_IOCTL_MAP_BUFFER     input;
+            PUSBPCAP_IOCTL_MAPPED_BUFFER pMapped;
+
+            if ((pStack->Parameters.DeviceIoControl.InputBufferLength !=
+                 sizeof(USBPCAP_IOCTL_MAP_BUFFER)) ||
+                (pStack->Parameters.DeviceIoControl.OutputBufferLength <
+                 sizeof(USBPCAP_IOCTL_MAPPED_BUFFER)))
+            {
+                ntStat = STATUS_INVALID_PARAMETER;
+                break;
+            }
+
+            /* Input and output share the same system buffer */
+            memcpy(&input, pIrp->AssociatedIrp.SystemBuffer,
+                   sizeof(USBPCAP_IOCTL_MAP_BUFFER));
+            pMapped = (PUSBPCAP_IOCTL_MAPPED_BUFFER)pIrp->AssociatedIrp.SystemBuffer;
+            DkDbgStr("IOCTL_USBPCAP_MAP_BUFFER");
+
+            ntStat = USBPcapBufferMapToUser(pRootData,
+                                            (HANDLE)(ULONG_PTR)input.event,
+                                            pMapped);
+            if (NT_SUCCESS(ntStat))
+            {
+                *outLength = sizeof(USBPCAP_IOCTL_MAPPED_BUFFER);
+            }
+            break;
+        }
+
+        case IOCTL_USBPCAP_SET_FILTER_PROGRAM:
+        {
+            PUSBPCAP_IOCTL_FILTER_PROGRAM pProgram;
+            ULONG                         length;
+
+            length = pStack->Parameters.DeviceIoControl.InputBufferLength;
+            if (length < FIELD_OFFSET(USBPCAP_IOCTL_FILTER_PROGRAM, insns))
+            {
+                ntStat = STATUS_INVALID_PARAMETER;
+                break;
+            }
+
+            pProgram = (PUSBPCAP_IOCTL_FILTER_PROGRAM)pIrp->AssociatedIrp.SystemBuffer;
+            DkDbgVal("IOCTL_USBPCAP_SET_FILTER_PROGRAM", pProgram->count);
+
+            if ((pProgram->count > USBPCAP_FILTER_MAX_INSNS) ||
+                (length != FIELD_OFFSET(USBPCAP_IOCTL_FILTER_PROGRAM, insns) +
+                           pProgram->count * sizeof(USBPCAP_FILTER_INSN)))
+            {
+                ntStat = STATUS_INVALID_PARAMETER;
+                break;
+            }
+
+            ntStat = USBPcapSetFilterProgram(pRootData, pProgram);
+            break;
+        }
+
+        case IOCTL_USBPCAP_SET_TRIGGER:
+        {
+            PUSBPCAP_IOCTL_TRIGGER  pTrigger;
+
+            if (pStack->Parameters.DeviceIoControl.InputBufferLength !=
+                sizeof(USBPCAP_IOCTL_TRIGGER))
+            {
+                ntStat = STATUS_INVALID_PARAMETER;
+                break;
+            }
+
+            pTrigger = (PUSBPCAP_IOCTL_TRIGGER)pIrp->AssociatedIrp.SystemBuffer;
+            DkDbgVal("IOCTL_USBPCAP_SET_TRIGGER", pTrigger->type);
+
+            ntStat = USBPcapSetTrigger(pRootData, pTrigger);
+            break;
+        }
+
+        case IOCTL_USBPCAP_GET_STATISTICS:
+        {
+            PUSBPCAP_IOCTL_STATISTICS pStats;
+
+            if (pStack->Parameters.DeviceIoControl.OutputBufferLength <
+                sizeof(USBPCAP_IOCTL_STATISTICS))
+            {
+                ntStat = STATUS_BUFFER_TOO_SMALL;
+                break;
+            }
+
+            pStats = (PUSBPCAP_IOCTL_STATISTICS)pIrp->AssociatedIrp.SystemBuffer;
+            USBPcapBufferGetStatistics(pRootData, pStats);
+            *outLength = sizeof(USBPCAP_IOCTL_STATISTICS);
+            break;
+        }
+
+        case IOCTL_USBPCAP_START_LATENCY:
+            DkDbgStr("IOCTL_USBPCAP_START_LATENCY");
+            ntStat = USBPcapLatencyStart(&pRootData->latency);
+            break;
+
+        case IOCTL_USBPCAP_GET_LATENCY:
+        {
+            PUSBPCAP_IOCTL_LATENCY pLatency;
+
+            if (pStack->Parameters.DeviceIoControl.OutputBufferLength <
+                sizeof(USBPCAP_IOCTL_LATENCY))
+            {
+                ntStat = STATUS_BUFFER_TOO_SMALL;
+                break;
+            }
+
+            pLatency = (PUSBPCAP_IOCTL_LATENCY)pIrp->AssociatedIrp.SystemBuffer;
+            USBPcapLatencyGet(&pRootData->latency, pLatency);
+            pLatency->bus = pRootData->busId;
+            *outLength = sizeof(USBPCAP_IOCTL_LATENCY);
+            break;
+        }
+
+        case IOCTL_USBPCAP_START_ENDPOINT_STATS:
+            DkDbgStr("IOCTL_USBPCAP_START_ENDPOINT_STATS");
+            ntStat = USBPcapEndpointStatsStart(&pRootData->endpointStats);
+            break;
+
+        case IOCTL_USBPCAP_GET_ENDPOINT_STATS:
+        {
+            PUSBPCAP_IOCTL_ENDPOINT_STATS pStats;
+
+            if (pStack->Parameters.DeviceIoControl.OutputBufferLength <
+                sizeof(USBPCAP_IOCTL_ENDPOINT_STATS))
+            {
+                ntStat = STATUS_BUFFER_TOO_SMALL;
+                break;
+            }
+
+            pStats = (PUSBPCAP_IOCTL_ENDPOINT_STATS)pIrp->AssociatedIrp.SystemBuffer;
+            USBPcapEndpointStatsGet(&pRootData->endpointStats, pStats);
+            pStats->bus = pRootData->busId;
+            pStats->timestamp = (UINT64)USBPcapGetCurrentTimestamp().QuadPart;
+            *outLength = sizeof(USBPCAP_IOCTL_ENDPOINT_STATS);
+            break;
+        }
+
         default:
         {
             ULONG ctlCode = IoGetFunctionCodeFromCtlCode(pStack->Parameters.DeviceIoControl.IoControlCode);
@@ -279,14 +482,28 @@ NTSTATUS DkTgtInDevCtl(PDEVICE_EXTENSION pDevExt, PIO_STACK_LOCATION pStack, PIR
     {
         /* code here should cope with DISPATCH_LEVEL */
 
-        // URB is collected BEFORE forward to bus driver or next lower object
         pUrb = (PURB) pStack->Parameters.Others.Argument1;
-        if (pUrb != NULL)
+
+        /* When nothing is being captured only SELECT_CONFIGURATION and
+         * SELECT_INTERFACE need to be seen (to keep the endpoint table
+         * up to date). Skip the completion routine for everything else.
+         */
+        if ((pUrb == NULL) ||
+            ((pUrb->UrbHeader.Function != URB_FUNCTION_SELECT_CONFIGURATION) &&
+             (pUrb->UrbHeader.Function != URB_FUNCTION_SELECT_INTERFACE) &&
+             !USBPcapIsCaptureArmed(pDevExt->context.usb.pDeviceData)))
         {
-            USBPcapAnalyzeURB(pIrp, pUrb, FALSE,
-                              pDevExt->context.usb.pDeviceData);
+            IoSkipCurrentIrpStackLocation(pIrp);
+            ntStat = IoCallDriver(pDevExt->pNextDevObj, pIrp);
+
+            IoReleaseRemoveLock(&pDevExt->removeLock, (PVOID) pIrp);
+            return ntStat;
         }
 
+        // URB is collected BEFORE forward to bus driver or next lower object
+        USBPcapAnalyzeURB(pIrp, pUrb, FALSE,
+                          pDevExt->context.usb.pDeviceData);
+
         // Forward this request to bus driver or next lower object
         // with completion routine
         IoCopyCurrentIrpStackLocationToNext(pIrp);
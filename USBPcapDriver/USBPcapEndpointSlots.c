@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include "USBPcapEndpointSlots.h"
+
+/* Valid keys have the most significant bit set, so 0 is never used */
+#define USBPCAP_ENDPOINT_SLOTS_KEY(device, endpoint, transfer) \
+    ((LONG)(0x80000000UL | (((ULONG)(device) & 0x7FFF) << 16) | \
+            ((ULONG)(endpoint) << 8) | (ULONG)(transfer)))
+
+VOID USBPcapEndpointSlotsInitialize(PUSBPCAP_ENDPOINT_SLOTS table,
+                                    ULONG slotSize,
+                                    ULONG tag)
+{
+    RtlZeroMemory((PVOID)table->keys, sizeof(table->keys));
+    table->enabled = 0;
+    table->untracked = 0;
+    table->slots = NULL;
+    table->count = 0;
+    table->slotSize = slotSize;
+    table->tag = tag;
+}
+
+/*
+ * Frees all memory. To be called only when root hub data is being freed.
+ */
+VOID USBPcapEndpointSlotsFree(PUSBPCAP_ENDPOINT_SLOTS table)
+{
+    table->enabled = 0;
+    if (table->slots != NULL)
+    {
+        ExFreePool((PVOID)table->slots);
+        table->slots = NULL;
+    }
+    table->count = 0;
+}
+
+/*
+ * Clears all slots and starts counting. Allocates the slots if needed.
+ * Must be called at PASSIVE_LEVEL.
+ */
+NTSTATUS USBPcapEndpointSlotsStart(PUSBPCAP_ENDPOINT_SLOTS table)
+{
+    ULONG count;
+
+    InterlockedExchange(&table->enabled, 0);
+
+    if (table->slots == NULL)
+    {
+        PUCHAR slots;
+
+#if (NTDDI_VERSION >= NTDDI_VISTA)
+        count = KeQueryActiveProcessorCount(NULL);
+#else
+        count = (ULONG)KeNumberProcessors;
+#endif
+
+        slots = ExAllocatePoolWithTag((POOL_TYPE)(NonPagedPool | CACHE_ALIGNED_POOL_MASK),
+                                      count * USBPCAP_ENDPOINT_SLOTS_MAX * table->slotSize,
+                                      table->tag);
+        if (slots == NULL)
+        {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        table->count = count;
+        /* Publish slots only once count is set */
+        if (InterlockedCompareExchangePointer((PVOID volatile *)&table->slots,
+                                              (PVOID)slots, NULL) != NULL)
+        {
+            /* Other start request was faster */
+            ExFreePool((PVOID)slots);
+        }
+    }
+
+    /* Completions that were already running can still update the slots
+     * while they are cleared. Such URBs are negligible.
+     */
+    RtlZeroMemory((PVOID)table->slots,
+                  table->count * USBPCAP_ENDPOINT_SLOTS_MAX * table->slotSize);
+    RtlZeroMemory((PVOID)table->keys, sizeof(table->keys));
+    table->untracked = 0;
+
+    InterlockedExchange(&table->enabled, 1);
+    return STATUS_SUCCESS;
+}
+
+VOID USBPcapEndpointSlotsStop(PUSBPCAP_ENDPOINT_SLOTS table)
+{
+    InterlockedExchange(&table->enabled, 0);
+}
+
+/*
+ * Returns index of given key, claiming free entry if the key is not
+ * in the table yet. Returns USBPCAP_ENDPOINT_SLOTS_MAX if table is full.
+ */
+static ULONG
+USBPcapEndpointSlotsGetIndex(PUSBPCAP_ENDPOINT_SLOTS table, LONG key)
+{
+    ULONG i = ((ULONG)((ULONG)key * 2654435761UL) >> 16) % USBPCAP_ENDPOINT_SLOTS_MAX;
+    ULONG probes;
+
+    for (probes = 0; probes < USBPCAP_ENDPOINT_SLOTS_MAX; probes++)
+    {
+        LONG current = table->keys[i];
+
+        if (current == 0)
+        {
+            current = InterlockedCompareExchange(&table->keys[i], key, 0);
+            if (current == 0)
+            {
+                return i;
+            }
+        }
+
+        if (current == key)
+        {
+            return i;
+        }
+
+        i = (i + 1) % USBPCAP_ENDPOINT_SLOTS_MAX;
+    }
+
+    return USBPCAP_ENDPOINT_SLOTS_MAX;
+}
+
+/*
+ * Returns slot of given endpoint on given processor. Returns NULL if not
+ * counting or if the endpoint does not fit into the table, the latter is
+ * counted as untracked.
+ */
+PVOID USBPcapEndpointSlotsFind(PUSBPCAP_ENDPOINT_SLOTS table,
+                               ULONG processor,
+                               USHORT device,
+                               UCHAR endpoint,
+                               UCHAR transfer)
+{
+    PUCHAR slots = table->slots;
+    ULONG index;
+
+    if ((table->enabled == 0) || (slots == NULL))
+    {
+        return NULL;
+    }
+
+    index = USBPcapEndpointSlotsGetIndex(table,
+                                         USBPCAP_ENDPOINT_SLOTS_KEY(device, endpoint, transfer));
+    if (index == USBPCAP_ENDPOINT_SLOTS_MAX)
+    {
+        InterlockedIncrement(&table->untracked);
+        return NULL;
+    }
+
+    return &slots[((processor % table->count) * USBPCAP_ENDPOINT_SLOTS_MAX + index) *
+                  table->slotSize];
+}
+
+/*
+ * Counts URB that could not be counted.
+ */
+VOID USBPcapEndpointSlotsUntracked(PUSBPCAP_ENDPOINT_SLOTS table)
+{
+    if (table->enabled != 0)
+    {
+        InterlockedIncrement(&table->untracked);
+    }
+}
+
+/*
+ * Returns TRUE and the endpoint if table entry index is used.
+ */
+BOOLEAN USBPcapEndpointSlotsGetKey(PUSBPCAP_ENDPOINT_SLOTS table,
+                                   ULONG index,
+                                   PUSHORT device,
+                                   PUCHAR endpoint,
+                                   PUCHAR transfer)
+{
+    ULONG key = (ULONG)table->keys[index];
+
+    if ((key == 0) || (table->slots == NULL))
+    {
+        return FALSE;
+    }
+
+    *device = (USHORT)((key >> 16) & 0x7FFF);
+    *endpoint = (UCHAR)(key >> 8);
+    *transfer = (UCHAR)key;
+    return TRUE;
+}
+
+/*
+ * Returns slot of table entry index on given processor, processor must
+ * be less than table count.
+ */
+PVOID USBPcapEndpointSlotsGetSlot(PUSBPCAP_ENDPOINT_SLOTS table,
+                                  ULONG processor,
+                                  ULONG index)
+{
+    return &table->slots[(processor * USBPCAP_ENDPOINT_SLOTS_MAX + index) *
+                         table->slotSize];
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef USBPCAP_ENDPOINT_SLOTS_H
+#define USBPCAP_ENDPOINT_SLOTS_H
+
+#include "USBPcapPortable.h"
+#include "include/USBPcap.h"
+
+/* Maximum number of endpoints in the table */
+#define USBPCAP_ENDPOINT_SLOTS_MAX  64
+
+/*
+ * Per endpoint, per processor counter slots. Used by the latency
+ * histograms and the endpoint traffic counters, which only differ in
+ * what the slot holds.
+ *
+ * Endpoint is identified by a key built from device address, endpoint
+ * address and transfer type. Keys are shared by all processors and are
+ * never removed while counting, so an endpoint is claimed with a single
+ * interlocked compare exchange. Every processor has its own slot for
+ * every endpoint, so completions on different processors never update
+ * the same cache line. Slots must still be updated with interlocked
+ * operations because more than one thread can run on the same processor
+ * slot.
+ *
+ * Slots are allocated when counting is started for the first time and
+ * freed together with root hub data.
+ */
+typedef struct _USBPCAP_ENDPOINT_SLOTS
+{
+    volatile LONG      enabled;
+    volatile LONG      untracked;
+    volatile LONG      keys[USBPCAP_ENDPOINT_SLOTS_MAX]; /* 0 if free */
+    /* count * USBPCAP_ENDPOINT_SLOTS_MAX slots of slotSize bytes */
+    PUCHAR volatile    slots;
+    ULONG              count; /* Number of processors */
+    ULONG              slotSize;
+    ULONG              tag;
+} USBPCAP_ENDPOINT_SLOTS, *PUSBPCAP_ENDPOINT_SLOTS;
+
+VOID USBPcapEndpointSlotsInitialize(PUSBPCAP_ENDPOINT_SLOTS table,
+                                    ULONG slotSize,
+                                    ULONG tag);
+VOID USBPcapEndpointSlotsFree(PUSBPCAP_ENDPOINT_SLOTS table);
+NTSTATUS USBPcapEndpointSlotsStart(PUSBPCAP_ENDPOINT_SLOTS table);
+VOID USBPcapEndpointSlotsStop(PUSBPCAP_ENDPOINT_SLOTS table);
+
+/* Can be called at any IRQL <= DISPATCH_LEVEL */
+PVOID USBPcapEndpointSlotsFind(PUSBPCAP_ENDPOINT_SLOTS table,
+                               ULONG processor,
+                               USHORT device,
+                               UCHAR endpoint,
+                               UCHAR transfer);
+VOID USBPcapEndpointSlotsUntracked(PUSBPCAP_ENDPOINT_SLOTS table);
+
+/* Snapshot side */
+BOOLEAN USBPcapEndpointSlotsGetKey(PUSBPCAP_ENDPOINT_SLOTS table,
+                                   ULONG index,
+                                   PUSHORT device,
+                                   PUCHAR endpoint,
+                                   PUCHAR transfer);
+PVOID USBPcapEndpointSlotsGetSlot(PUSBPCAP_ENDPOINT_SLOTS table,
+                                  ULONG processor,
+                                  ULONG index);
+
+#endif /* USBPCAP_ENDPOINT_SLOTS_H */
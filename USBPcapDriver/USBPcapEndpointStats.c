@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include "USBPcapEndpointStats.h"
+
+#define USBPCAP_ENDPOINT_STATS_TAG  (ULONG)'tSpE'
+
+#if (USBPCAP_ENDPOINT_STATS_MAX != USBPCAP_ENDPOINT_SLOTS_MAX)
+#error "Endpoint counters do not match endpoint slots"
+#endif
+
+__inline static UINT64
+USBPcapEndpointStatsLoad(PLARGE_INTEGER value)
+{
+    /* Plain 64-bit read can be torn on x86 */
+    return (UINT64)InterlockedCompareExchange64(&value->QuadPart, 0, 0);
+}
+
+VOID USBPcapEndpointStatsInitialize(PUSBPCAP_ENDPOINT_STATS stats)
+{
+    USBPcapEndpointSlotsInitialize(stats,
+                                   sizeof(USBPCAP_ENDPOINT_STATS_SLOT),
+                                   USBPCAP_ENDPOINT_STATS_TAG);
+}
+
+/*
+ * Frees all memory. To be called only when root hub data is being freed.
+ */
+VOID USBPcapEndpointStatsFree(PUSBPCAP_ENDPOINT_STATS stats)
+{
+    USBPcapEndpointSlotsFree(stats);
+}
+
+/*
+ * Clears the counters and starts counting. Allocates the counters
+ * if needed. Must be called at PASSIVE_LEVEL.
+ */
+NTSTATUS USBPcapEndpointStatsStart(PUSBPCAP_ENDPOINT_STATS stats)
+{
+    return USBPcapEndpointSlotsStart(stats);
+}
+
+VOID USBPcapEndpointStatsStop(PUSBPCAP_ENDPOINT_STATS stats)
+{
+    USBPcapEndpointSlotsStop(stats);
+}
+
+/*
+ * Adds count of failed URBs with given status to the endpoint.
+ */
+static VOID
+USBPcapEndpointStatsAddFailed(PUSBPCAP_ENDPOINT_COUNTERS endpoint,
+                              UINT32 status,
+                              UINT32 count)
+{
+    ULONG i;
+
+    for (i = 0; i < USBPCAP_ENDPOINT_STATUSES; i++)
+    {
+        if ((endpoint->failed[i].count == 0) ||
+            (endpoint->failed[i].status == status))
+        {
+            endpoint->failed[i].status = status;
+            endpoint->failed[i].count += count;
+            return;
+        }
+    }
+
+    endpoint->otherFailed += count;
+}
+
+/*
+ * Sums the counters of all processors. Fills all fields except bus
+ * and timestamp.
+ */
+VOID USBPcapEndpointStatsGet(PUSBPCAP_ENDPOINT_STATS stats,
+                             PUSBPCAP_IOCTL_ENDPOINT_STATS out)
+{
+    ULONG index;
+
+    /* Unused entries must not leak kernel memory */
+    RtlZeroMemory(out, sizeof(USBPCAP_IOCTL_ENDPOINT_STATS));
+    out->untracked = (UINT32)stats->untracked;
+
+    for (index = 0; index < USBPCAP_ENDPOINT_STATS_MAX; index++)
+    {
+        PUSBPCAP_ENDPOINT_COUNTERS endpoint = &out->endpoints[out->count];
+        ULONG cpu;
+
+        if (!USBPcapEndpointSlotsGetKey(stats, index, &endpoint->device,
+                                        &endpoint->endpoint,
+                                        &endpoint->transfer))
+        {
+            continue;
+        }
+        out->count++;
+
+        for (cpu = 0; cpu < stats->count; cpu++)
+        {
+            PUSBPCAP_ENDPOINT_STATS_SLOT slot;
+            ULONG i;
+
+            slot = (PUSBPCAP_ENDPOINT_STATS_SLOT)USBPcapEndpointSlotsGetSlot(stats, cpu, index);
+            endpoint->urbs += USBPcapEndpointStatsLoad(&slot->counters.urbs);
+            endpoint->bytes += USBPcapEndpointStatsLoad(&slot->counters.bytes);
+            endpoint->errors += (UINT32)slot->counters.errors;
+            endpoint->stalls += (UINT32)slot->counters.stalls;
+            endpoint->otherFailed += (UINT32)slot->counters.otherFailed;
+
+            /* Processors can have different statuses in their entries */
+            for (i = 0; i < USBPCAP_ENDPOINT_STATUSES; i++)
+            {
+                UINT32 count = (UINT32)slot->counters.failed[i];
+
+                if (count != 0)
+                {
+                    USBPcapEndpointStatsAddFailed(endpoint,
+                                                  (UINT32)slot->counters.statuses[i],
+                                                  count);
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Counts failed URB in the slot entry of its status.
+ */
+static VOID
+USBPcapEndpointStatsSlotFailed(PUSBPCAP_ENDPOINT_STATS_SLOT slot,
+                               USBD_STATUS status)
+{
+    ULONG i;
+
+    for (i = 0; i < USBPCAP_ENDPOINT_STATUSES; i++)
+    {
+        LONG current = slot->counters.statuses[i];
+
+        if (current == 0)
+        {
+            current = InterlockedCompareExchange(&slot->counters.statuses[i],
+                                                 (LONG)status, 0);
+            if (current == 0)
+            {
+                current = (LONG)status;
+            }
+        }
+
+        if (current == (LONG)status)
+        {
+            InterlockedIncrement(&slot->counters.failed[i]);
+            return;
+        }
+    }
+
+    InterlockedIncrement(&slot->counters.otherFailed);
+}
+
+/*
+ * Counts single URB completion. processor is the current processor number.
+ */
+VOID USBPcapEndpointStatsAdd(PUSBPCAP_ENDPOINT_STATS stats,
+                             ULONG processor,
+                             USHORT device,
+                             UCHAR endpoint,
+                             UCHAR transfer,
+                             ULONG bytes,
+                             USBD_STATUS status)
+{
+    PUSBPCAP_ENDPOINT_STATS_SLOT slot;
+
+    slot = (PUSBPCAP_ENDPOINT_STATS_SLOT)USBPcapEndpointSlotsFind(stats, processor,
+                                                                  device, endpoint,
+                                                                  transfer);
+    if (slot == NULL)
+    {
+        return;
+    }
+
+    ExInterlockedAddLargeStatistic(&slot->counters.urbs, 1);
+    ExInterlockedAddLargeStatistic(&slot->counters.bytes, bytes);
+
+    if (USBD_ERROR(status))
+    {
+        if ((status == USBD_STATUS_STALL_PID) ||
+            (status == USBD_STATUS_ENDPOINT_HALTED))
+        {
+            InterlockedIncrement(&slot->counters.stalls);
+        }
+        else
+        {
+            InterlockedIncrement(&slot->counters.errors);
+        }
+        USBPcapEndpointStatsSlotFailed(slot, status);
+    }
+}
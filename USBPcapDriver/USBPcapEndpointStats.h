@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef USBPCAP_ENDPOINT_STATS_H
+#define USBPCAP_ENDPOINT_STATS_H
+
+#include "USBPcapEndpointSlots.h"
+
+/*
+ * Counters of single endpoint on single processor.
+ */
+typedef union _USBPCAP_ENDPOINT_STATS_SLOT
+{
+    struct
+    {
+        LARGE_INTEGER      urbs;
+        LARGE_INTEGER      bytes;
+        volatile LONG      errors;
+        volatile LONG      stalls;
+        /* Failed URBs by status, status is 0 if entry is free */
+        volatile LONG      statuses[USBPCAP_ENDPOINT_STATUSES];
+        volatile LONG      failed[USBPCAP_ENDPOINT_STATUSES];
+        volatile LONG      otherFailed;
+    } counters;
+    UCHAR                  padding[64];
+} USBPCAP_ENDPOINT_STATS_SLOT, *PUSBPCAP_ENDPOINT_STATS_SLOT;
+
+/*
+ * Per endpoint traffic counters. Every endpoint slot holds
+ * USBPCAP_ENDPOINT_STATS_SLOT.
+ */
+typedef USBPCAP_ENDPOINT_SLOTS USBPCAP_ENDPOINT_STATS, *PUSBPCAP_ENDPOINT_STATS;
+
+VOID USBPcapEndpointStatsInitialize(PUSBPCAP_ENDPOINT_STATS stats);
+VOID USBPcapEndpointStatsFree(PUSBPCAP_ENDPOINT_STATS stats);
+NTSTATUS USBPcapEndpointStatsStart(PUSBPCAP_ENDPOINT_STATS stats);
+VOID USBPcapEndpointStatsStop(PUSBPCAP_ENDPOINT_STATS stats);
+VOID USBPcapEndpointStatsGet(PUSBPCAP_ENDPOINT_STATS stats,
+                             PUSBPCAP_IOCTL_ENDPOINT_STATS out);
+
+/* Can be called at any IRQL <= DISPATCH_LEVEL */
+VOID USBPcapEndpointStatsAdd(PUSBPCAP_ENDPOINT_STATS stats,
+                             ULONG processor,
+                             USHORT device,
+                             UCHAR endpoint,
+                             UCHAR transfer,
+                             ULONG bytes,
+                             USBD_STATUS status);
+
+#endif /* USBPCAP_ENDPOINT_STATS_H */
@@ -8,6 +8,9 @@
 #include "USBPcapHelperFunctions.h"
 #include "USBPcapTables.h"
 #include "USBPcapRootHubControl.h"
+#include "USBPcapBuffer.h"
+#include "USBPcapFilterProgram.h"
+#include "USBPcapURB.h"
 
 /*
  * Frees pDevExt.context.usb.pDeviceData
@@ -39,10 +42,23 @@ static void USBPcapFreeDeviceData(IN PDEVICE_EXTENSION pDevExt)
                  * RootHub is supposed to hold the last reference.
                  * So if we enter here, this data can be safely removed.
                  */
-                if (pDeviceData->pRootData->buffer != NULL)
+                USBPcapBufferCancelWakeup(pDeviceData->pRootData);
+                if (pDeviceData->pRootData->shared.mdl != NULL)
                 {
-                    ExFreePool((PVOID)pDeviceData->pRootData->buffer);
+                    /* Ring buffer points to the shared buffer */
+                    USBPcapSharedBufferUnmapFromUser(&pDeviceData->pRootData->shared);
+                    USBPcapSharedBufferFree(&pDeviceData->pRootData->shared);
                 }
+                else if (pDeviceData->pRootData->ring.buffer != NULL)
+                {
+                    ExFreePool((PVOID)pDeviceData->pRootData->ring.buffer);
+                }
+                USBPcapCpuRingsFree(&pDeviceData->pRootData->cpuRings);
+                USBPcapStatisticsFree(&pDeviceData->pRootData->stats);
+                USBPcapLatencyFree(&pDeviceData->pRootData->latency);
+                USBPcapEndpointStatsFree(&pDeviceData->pRootData->endpointStats);
+                USBPcapFilterProgramFree(pDeviceData->pRootData->filterProgram);
+                USBPcapDeleteIsochLookaside(pDeviceData->pRootData);
                 ExFreePool((PVOID)pDeviceData->pRootData);
                 pDeviceData->pRootData = NULL;
             }
@@ -60,6 +76,12 @@ static void USBPcapFreeDeviceData(IN PDEVICE_EXTENSION pDevExt)
             pDeviceData->URBIrpTable = NULL;
         }
 
+        if (pDeviceData->submitTable != NULL)
+        {
+            USBPcapFreeURBIRPInfoTable(pDeviceData->submitTable);
+            pDeviceData->submitTable = NULL;
+        }
+
         if (pDeviceData->previousChildren != NULL)
         {
             ExFreePool((PVOID)pDeviceData->previousChildren);
@@ -135,17 +157,34 @@ static NTSTATUS USBPcapAllocateDeviceData(IN PDEVICE_EXTENSION pDevExt,
             {
                 /* Initialize empty buffer */
                 KeInitializeSpinLock(&pDeviceData->pRootData->bufferLock);
-                pDeviceData->pRootData->buffer = NULL;
-                pDeviceData->pRootData->readOffset = 0;
-                pDeviceData->pRootData->writeOffset = 0;
-                pDeviceData->pRootData->bufferSize = 0;
+                USBPcapRingInitialize(&pDeviceData->pRootData->ring);
+                pDeviceData->pRootData->recordSkip = 0;
+                KeInitializeSpinLock(&pDeviceData->pRootData->evictLock);
+                USBPcapBufferInitializeWakeup(pDeviceData->pRootData);
+                pDeviceData->pRootData->captureArmed = 0;
+                pDeviceData->pRootData->captureFlags = 0;
+                pDeviceData->pRootData->filterProgram = NULL;
+                USBPcapResetTrigger(pDeviceData->pRootData);
+                USBPcapSharedBufferInitialize(&pDeviceData->pRootData->shared);
+
+                /* Failure is not fatal, per-CPU buffers will not be available */
+                USBPcapCpuRingsInitialize(&pDeviceData->pRootData->cpuRings);
+
+                /* Failure is not fatal, capture will not be counted */
+                USBPcapStatisticsInitialize(&pDeviceData->pRootData->stats);
+
+                /* Counters are allocated when they are started */
+                USBPcapLatencyInitialize(&pDeviceData->pRootData->latency);
+                USBPcapEndpointStatsInitialize(&pDeviceData->pRootData->endpointStats);
+
+                USBPcapInitializeIsochLookaside(pDeviceData->pRootData);
 
                 /* Initialize default snaplen size */
                 pDeviceData->pRootData->snaplen = USBPCAP_DEFAULT_SNAP_LEN;
+                USBPcapResetSnaplenTable(pDeviceData->pRootData);
 
                 /* Setup initial filtering state to FALSE */
-                memset(&pDeviceData->pRootData->filter, 0,
-                       sizeof(USBPCAP_ADDRESS_FILTER));
+                USBPcapInitEndpointFilter(&pDeviceData->pRootData->filter, NULL);
 
                 /*
                  * Set the reference count
@@ -162,8 +201,11 @@ static NTSTATUS USBPcapAllocateDeviceData(IN PDEVICE_EXTENSION pDevExt,
         }
 
         KeInitializeSpinLock(&pDeviceData->tablesSpinLock);
-        pDeviceData->endpointTable = USBPcapInitializeEndpointTable(NULL);
-        pDeviceData->URBIrpTable = USBPcapInitializeURBIRPInfoTable(NULL);
+        pDeviceData->endpointTable = USBPcapInitializeEndpointTable();
+        pDeviceData->URBIrpTable =
+            USBPcapInitializeURBIRPInfoTable(USBPCAP_URB_IRP_TABLE_SLOTS);
+        pDeviceData->submitTable =
+            USBPcapInitializeURBIRPInfoTable(USBPCAP_SUBMIT_TABLE_SLOTS);
 
         pDeviceData->descriptor = NULL;
     }
@@ -0,0 +1,382 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include "USBPcapFilterProgram.h"
+
+#define USBPCAP_FILTER_PROGRAM_TAG  (ULONG)'gorP'
+
+/*
+ * Validates input and copies it to non-paged memory so it can be run
+ * at DISPATCH_LEVEL.
+ */
+NTSTATUS USBPcapFilterProgramCreate(PUSBPCAP_IOCTL_FILTER_PROGRAM input,
+                                    PUSBPCAP_IOCTL_FILTER_PROGRAM *program)
+{
+    PUSBPCAP_IOCTL_FILTER_PROGRAM copy;
+    SIZE_T                        length;
+
+    *program = NULL;
+
+    if (!USBPcapFilterProgramValidate(input->insns, input->count))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    length = FIELD_OFFSET(USBPCAP_IOCTL_FILTER_PROGRAM, insns) +
+             input->count * sizeof(USBPCAP_FILTER_INSN);
+    copy = (PUSBPCAP_IOCTL_FILTER_PROGRAM)
+        ExAllocatePoolWithTag(NonPagedPool, length, USBPCAP_FILTER_PROGRAM_TAG);
+    if (copy == NULL)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlCopyMemory(copy, input, length);
+    *program = copy;
+    return STATUS_SUCCESS;
+}
+
+VOID USBPcapFilterProgramFree(PUSBPCAP_IOCTL_FILTER_PROGRAM program)
+{
+    if (program != NULL)
+    {
+        ExFreePool((PVOID)program);
+    }
+}
+
+/*
+ * Checks that program can be safely run: known instructions, jumps within
+ * the program, valid scratch memory indexes, no division by constant zero
+ * and return as the last instruction.
+ */
+BOOLEAN USBPcapFilterProgramValidate(PUSBPCAP_FILTER_INSN insns,
+                                     UINT32 count)
+{
+    UINT32 i;
+
+    if ((count == 0) || (count > USBPCAP_FILTER_MAX_INSNS))
+    {
+        return FALSE;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        PUSBPCAP_FILTER_INSN insn = &insns[i];
+        UINT32 remaining = count - i - 1; /* Instructions after this one */
+
+        switch (USBPCAP_FILTER_CLASS(insn->code))
+        {
+            case USBPCAP_FILTER_LD:
+            case USBPCAP_FILTER_LDX:
+                switch (USBPCAP_FILTER_MODE(insn->code))
+                {
+                    case USBPCAP_FILTER_IMM:
+                    case USBPCAP_FILTER_LEN:
+                        break;
+                    case USBPCAP_FILTER_ABS:
+                    case USBPCAP_FILTER_IND:
+                        /* LDX supports only IMM, LEN and MEM */
+                        if ((USBPCAP_FILTER_CLASS(insn->code) != USBPCAP_FILTER_LD) ||
+                            (USBPCAP_FILTER_SIZE(insn->code) == 0x18))
+                        {
+                            return FALSE;
+                        }
+                        break;
+                    case USBPCAP_FILTER_MEM:
+                        if (insn->k >= USBPCAP_FILTER_MEMWORDS)
+                        {
+                            return FALSE;
+                        }
+                        break;
+                    default:
+                        return FALSE;
+                }
+                break;
+
+            case USBPCAP_FILTER_ST:
+            case USBPCAP_FILTER_STX:
+                if (insn->k >= USBPCAP_FILTER_MEMWORDS)
+                {
+                    return FALSE;
+                }
+                break;
+
+            case USBPCAP_FILTER_ALU:
+                switch (USBPCAP_FILTER_OP(insn->code))
+                {
+                    case USBPCAP_FILTER_DIV:
+                    case USBPCAP_FILTER_MOD:
+                        if ((USBPCAP_FILTER_SRC(insn->code) == USBPCAP_FILTER_K) &&
+                            (insn->k == 0))
+                        {
+                            return FALSE;
+                        }
+                        break;
+                    case USBPCAP_FILTER_ADD:
+                    case USBPCAP_FILTER_SUB:
+                    case USBPCAP_FILTER_MUL:
+                    case USBPCAP_FILTER_OR:
+                    case USBPCAP_FILTER_AND:
+                    case USBPCAP_FILTER_LSH:
+                    case USBPCAP_FILTER_RSH:
+                    case USBPCAP_FILTER_NEG:
+                    case USBPCAP_FILTER_XOR:
+                        break;
+                    default:
+                        return FALSE;
+                }
+                break;
+
+            case USBPCAP_FILTER_JMP:
+                switch (USBPCAP_FILTER_OP(insn->code))
+                {
+                    case USBPCAP_FILTER_JA:
+                        if (insn->k >= remaining)
+                        {
+                            return FALSE;
+                        }
+                        break;
+                    case USBPCAP_FILTER_JEQ:
+                    case USBPCAP_FILTER_JGT:
+                    case USBPCAP_FILTER_JGE:
+                    case USBPCAP_FILTER_JSET:
+                        if ((insn->jt >= remaining) || (insn->jf >= remaining))
+                        {
+                            return FALSE;
+                        }
+                        break;
+                    default:
+                        return FALSE;
+                }
+                break;
+
+            case USBPCAP_FILTER_RET:
+                if (USBPCAP_FILTER_RVAL(insn->code) == 0x18)
+                {
+                    return FALSE;
+                }
+                break;
+
+            case USBPCAP_FILTER_MISC:
+                if ((USBPCAP_FILTER_MISCOP(insn->code) != USBPCAP_FILTER_TAX) &&
+                    (USBPCAP_FILTER_MISCOP(insn->code) != USBPCAP_FILTER_TXA))
+                {
+                    return FALSE;
+                }
+                break;
+        }
+    }
+
+    return (USBPCAP_FILTER_CLASS(insns[count - 1].code) == USBPCAP_FILTER_RET) ?
+           TRUE : FALSE;
+}
+
+/*
+ * Loads size bytes (little endian) at offset from packet data.
+ * Returns FALSE if the data is not available.
+ */
+static BOOLEAN
+USBPcapFilterProgramLoad(PUSBPCAP_FILTER_PACKET packet,
+                         UINT32 offset,
+                         UINT32 size,
+                         UINT32 *value)
+{
+    PUSBPCAP_PAYLOAD_ENTRY   segment = packet->payload;
+    PUCHAR                   data;
+    UINT32                   length;
+    UINT32                   result = 0;
+    UINT32                   i;
+
+    if (offset > MAXULONG - size)
+    {
+        return FALSE;
+    }
+
+    /* Most filters look only at the header */
+    if (offset + size <= packet->header->headerLen)
+    {
+        data = (PUCHAR)packet->header;
+        for (i = 0; i < size; i++)
+        {
+            result |= (UINT32)data[offset + i] << (8 * i);
+        }
+        *value = result;
+        return TRUE;
+    }
+
+    if (offset + size > packet->header->headerLen + packet->header->dataLength)
+    {
+        return FALSE;
+    }
+
+    data = (PUCHAR)packet->header;
+    length = packet->header->headerLen;
+    for (i = 0; i < size; i++)
+    {
+        while (offset >= length)
+        {
+            if (segment->buffer == NULL)
+            {
+                return FALSE;
+            }
+            offset -= length;
+            data = (PUCHAR)segment->buffer;
+            length = segment->size;
+            segment++;
+        }
+        result |= (UINT32)data[offset] << (8 * i);
+        offset++;
+    }
+
+    *value = result;
+    return TRUE;
+}
+
+/*
+ * Runs validated program on packet. Returns number of bytes to capture,
+ * 0 if packet should be dropped.
+ */
+UINT32 USBPcapFilterProgramRun(PUSBPCAP_FILTER_INSN insns,
+                               PUSBPCAP_FILTER_PACKET packet)
+{
+    PUSBPCAP_FILTER_INSN  pc = insns;
+    UINT32                mem[USBPCAP_FILTER_MEMWORDS];
+    UINT32                length;
+    UINT32                a = 0;
+    UINT32                x = 0;
+    UINT32                operand;
+    UINT32                size;
+
+    length = packet->header->headerLen + packet->header->dataLength;
+    RtlZeroMemory(mem, sizeof(mem));
+
+    for (;; pc++)
+    {
+        switch (USBPCAP_FILTER_CLASS(pc->code))
+        {
+            case USBPCAP_FILTER_LD:
+                switch (USBPCAP_FILTER_MODE(pc->code))
+                {
+                    case USBPCAP_FILTER_IMM:
+                        a = pc->k;
+                        break;
+                    case USBPCAP_FILTER_LEN:
+                        a = length;
+                        break;
+                    case USBPCAP_FILTER_MEM:
+                        a = mem[pc->k];
+                        break;
+                    default:
+                        size = (USBPCAP_FILTER_SIZE(pc->code) == USBPCAP_FILTER_W) ? 4 :
+                               (USBPCAP_FILTER_SIZE(pc->code) == USBPCAP_FILTER_H) ? 2 : 1;
+                        operand = pc->k;
+                        if (USBPCAP_FILTER_MODE(pc->code) == USBPCAP_FILTER_IND)
+                        {
+                            if (operand > MAXULONG - x)
+                            {
+                                return 0;
+                            }
+                            operand += x;
+                        }
+                        if (!USBPcapFilterProgramLoad(packet, operand, size, &a))
+                        {
+                            return 0;
+                        }
+                        break;
+                }
+                break;
+
+            case USBPCAP_FILTER_LDX:
+                switch (USBPCAP_FILTER_MODE(pc->code))
+                {
+                    case USBPCAP_FILTER_IMM:
+                        x = pc->k;
+                        break;
+                    case USBPCAP_FILTER_LEN:
+                        x = length;
+                        break;
+                    default:
+                        x = mem[pc->k];
+                        break;
+                }
+                break;
+
+            case USBPCAP_FILTER_ST:
+                mem[pc->k] = a;
+                break;
+
+            case USBPCAP_FILTER_STX:
+                mem[pc->k] = x;
+                break;
+
+            case USBPCAP_FILTER_ALU:
+                operand = (USBPCAP_FILTER_SRC(pc->code) == USBPCAP_FILTER_X) ? x : pc->k;
+                switch (USBPCAP_FILTER_OP(pc->code))
+                {
+                    case USBPCAP_FILTER_ADD: a += operand; break;
+                    case USBPCAP_FILTER_SUB: a -= operand; break;
+                    case USBPCAP_FILTER_MUL: a *= operand; break;
+                    case USBPCAP_FILTER_DIV:
+                        if (operand == 0)
+                        {
+                            return 0;
+                        }
+                        a /= operand;
+                        break;
+                    case USBPCAP_FILTER_MOD:
+                        if (operand == 0)
+                        {
+                            return 0;
+                        }
+                        a %= operand;
+                        break;
+                    case USBPCAP_FILTER_OR:  a |= operand; break;
+                    case USBPCAP_FILTER_AND: a &= operand; break;
+                    case USBPCAP_FILTER_LSH: a = (operand < 32) ? (a << operand) : 0; break;
+                    case USBPCAP_FILTER_RSH: a = (operand < 32) ? (a >> operand) : 0; break;
+                    case USBPCAP_FILTER_NEG: a = (UINT32)(-(INT32)a); break;
+                    default:                 a ^= operand; break;
+                }
+                break;
+
+            case USBPCAP_FILTER_JMP:
+                operand = (USBPCAP_FILTER_SRC(pc->code) == USBPCAP_FILTER_X) ? x : pc->k;
+                switch (USBPCAP_FILTER_OP(pc->code))
+                {
+                    case USBPCAP_FILTER_JA:
+                        pc += pc->k;
+                        break;
+                    case USBPCAP_FILTER_JEQ:
+                        pc += (a == operand) ? pc->jt : pc->jf;
+                        break;
+                    case USBPCAP_FILTER_JGT:
+                        pc += (a > operand) ? pc->jt : pc->jf;
+                        break;
+                    case USBPCAP_FILTER_JGE:
+                        pc += (a >= operand) ? pc->jt : pc->jf;
+                        break;
+                    default:
+                        pc += (a & operand) ? pc->jt : pc->jf;
+                        break;
+                }
+                break;
+
+            case USBPCAP_FILTER_RET:
+                return (USBPCAP_FILTER_RVAL(pc->code) == USBPCAP_FILTER_A) ? a : pc->k;
+
+            default:
+                if (USBPCAP_FILTER_MISCOP(pc->code) == USBPCAP_FILTER_TAX)
+                {
+                    x = a;
+                }
+                else
+                {
+                    a = x;
+                }
+                break;
+        }
+    }
+}
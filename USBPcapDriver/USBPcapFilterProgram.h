@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef USBPCAP_FILTER_PROGRAM_H
+#define USBPCAP_FILTER_PROGRAM_H
+
+#include "USBPcapPortable.h"
+#include "USBPcapPayload.h"
+#include "include/USBPcap.h"
+
+/*
+ * Filter program verifier and interpreter. See USBPCAP_FILTER_INSN in
+ * include\USBPcap.h for the instruction set.
+ *
+ * The interpreter does not call any kernel functions and can be called at
+ * any IRQL as long as the program and packet data are resident. Scratch
+ * memory is zeroed at the start of every run, so loads that precede
+ * stores read 0 like in classic BPF.
+ */
+
+/* Packet the program runs on. payload is {0, NULL} terminated array
+ * holding header->dataLength bytes.
+ */
+typedef struct
+{
+    PUSBPCAP_BUFFER_PACKET_HEADER  header;  /* headerLen bytes */
+    PUSBPCAP_PAYLOAD_ENTRY         payload;
+} USBPCAP_FILTER_PACKET, *PUSBPCAP_FILTER_PACKET;
+
+NTSTATUS USBPcapFilterProgramCreate(PUSBPCAP_IOCTL_FILTER_PROGRAM input,
+                                    PUSBPCAP_IOCTL_FILTER_PROGRAM *program);
+VOID USBPcapFilterProgramFree(PUSBPCAP_IOCTL_FILTER_PROGRAM program);
+
+BOOLEAN USBPcapFilterProgramValidate(PUSBPCAP_FILTER_INSN insns,
+                                     UINT32 count);
+UINT32 USBPcapFilterProgramRun(PUSBPCAP_FILTER_INSN insns,
+                               PUSBPCAP_FILTER_PACKET packet);
+
+#endif /* USBPCAP_FILTER_PROGRAM_H */
@@ -6,6 +6,8 @@
 
 #include "USBPcapMain.h"
 #include "USBPcapBuffer.h"
+#include "USBPcapHelperFunctions.h"
+#include "USBPcapFilterProgram.h"
 
 ////////////////////////////////////////////////////////////////////////////
 // Create, close and clean up handlers
@@ -78,9 +80,19 @@ NTSTATUS DkCreateClose(PDEVICE_OBJECT pDevObj, PIRP pIrp)
                     /* Stop filtering */
                     rootExt = (PDEVICE_EXTENSION)pDevExt->context.control.pRootHubObject->DeviceExtension;
                     pRootData = (PUSBPCAP_ROOTHUB_DATA)rootExt->context.usb.pDeviceData->pRootData;
-                    memset(&pRootData->filter, 0, sizeof(USBPCAP_ADDRESS_FILTER));
+                    USBPcapInitEndpointFilter(&pRootData->filter, NULL);
                     /* Free the buffer allocated for this device. */
                     USBPcapBufferRemoveBuffer(pDevExt);
+                    /* Next capture starts with default settings */
+                    pRootData->captureFlags = 0;
+                    USBPcapFilterProgramFree(pRootData->filterProgram);
+                    pRootData->filterProgram = NULL;
+                    USBPcapResetSnaplenTable(pRootData);
+                    USBPcapResetTrigger(pRootData);
+                    USBPcapStatisticsReset(&pRootData->stats);
+                    USBPcapLatencyStop(&pRootData->latency);
+                    USBPcapEndpointStatsStop(&pRootData->endpointStats);
+                    USBPcapSetReadWakeup(pRootData, 0, 0);
                 }
                 break;
 
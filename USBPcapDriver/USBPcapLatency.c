@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include "USBPcapLatency.h"
+
+#define USBPCAP_LATENCY_TAG  (ULONG)'ycaL'
+
+#if (USBPCAP_LATENCY_MAX_ENDPOINTS != USBPCAP_ENDPOINT_SLOTS_MAX)
+#error "Latency histograms do not match endpoint slots"
+#endif
+
+VOID USBPcapLatencyInitialize(PUSBPCAP_LATENCY latency)
+{
+    USBPcapEndpointSlotsInitialize(latency,
+                                   USBPCAP_LATENCY_BUCKETS * sizeof(LONG),
+                                   USBPCAP_LATENCY_TAG);
+}
+
+/*
+ * Frees all memory. To be called only when root hub data is being freed.
+ */
+VOID USBPcapLatencyFree(PUSBPCAP_LATENCY latency)
+{
+    USBPcapEndpointSlotsFree(latency);
+}
+
+/*
+ * Clears the histograms and starts measuring. Allocates the counters
+ * if needed. Must be called at PASSIVE_LEVEL.
+ */
+NTSTATUS USBPcapLatencyStart(PUSBPCAP_LATENCY latency)
+{
+    return USBPcapEndpointSlotsStart(latency);
+}
+
+VOID USBPcapLatencyStop(PUSBPCAP_LATENCY latency)
+{
+    USBPcapEndpointSlotsStop(latency);
+}
+
+/*
+ * Sums the histograms of all processors. Fills all fields except bus.
+ */
+VOID USBPcapLatencyGet(PUSBPCAP_LATENCY latency,
+                       PUSBPCAP_IOCTL_LATENCY out)
+{
+    ULONG index;
+
+    /* Unused histograms must not leak kernel memory */
+    RtlZeroMemory(out, sizeof(USBPCAP_IOCTL_LATENCY));
+    out->untracked = (UINT32)latency->untracked;
+
+    for (index = 0; index < USBPCAP_LATENCY_MAX_ENDPOINTS; index++)
+    {
+        PUSBPCAP_LATENCY_HISTOGRAM histogram = &out->histograms[out->count];
+        ULONG cpu;
+        ULONG bucket;
+
+        if (!USBPcapEndpointSlotsGetKey(latency, index, &histogram->device,
+                                        &histogram->endpoint,
+                                        &histogram->transfer))
+        {
+            continue;
+        }
+        out->count++;
+
+        for (cpu = 0; cpu < latency->count; cpu++)
+        {
+            LONG volatile *counts;
+
+            counts = (LONG volatile *)USBPcapEndpointSlotsGetSlot(latency, cpu, index);
+            for (bucket = 0; bucket < USBPCAP_LATENCY_BUCKETS; bucket++)
+            {
+                histogram->buckets[bucket] += (UINT32)counts[bucket];
+            }
+        }
+    }
+}
+
+/*
+ * Returns histogram bucket of latency given in 100 ns units.
+ */
+ULONG USBPcapLatencyGetBucket(UINT64 latency)
+{
+    UINT64 us = latency / 10;
+    ULONG  bucket = 0;
+
+    while ((us != 0) && (bucket < USBPCAP_LATENCY_BUCKETS - 1))
+    {
+        us >>= 1;
+        bucket++;
+    }
+
+    return bucket;
+}
+
+/*
+ * Counts single URB completion. value is the latency in 100 ns units.
+ * processor is the current processor number.
+ */
+VOID USBPcapLatencyAdd(PUSBPCAP_LATENCY latency,
+                       ULONG processor,
+                       USHORT device,
+                       UCHAR endpoint,
+                       UCHAR transfer,
+                       UINT64 value)
+{
+    LONG volatile *counts;
+
+    counts = (LONG volatile *)USBPcapEndpointSlotsFind(latency, processor,
+                                                       device, endpoint,
+                                                       transfer);
+    if (counts != NULL)
+    {
+        InterlockedIncrement(&counts[USBPcapLatencyGetBucket(value)]);
+    }
+}
+
+/*
+ * Counts URB that could not be measured.
+ */
+VOID USBPcapLatencyUntracked(PUSBPCAP_LATENCY latency)
+{
+    USBPcapEndpointSlotsUntracked(latency);
+}
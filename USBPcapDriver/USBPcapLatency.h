@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef USBPCAP_LATENCY_H
+#define USBPCAP_LATENCY_H
+
+#include "USBPcapEndpointSlots.h"
+
+/*
+ * Submit-to-completion latency histograms. Every endpoint slot holds
+ * USBPCAP_LATENCY_BUCKETS counters.
+ */
+typedef USBPCAP_ENDPOINT_SLOTS USBPCAP_LATENCY, *PUSBPCAP_LATENCY;
+
+VOID USBPcapLatencyInitialize(PUSBPCAP_LATENCY latency);
+VOID USBPcapLatencyFree(PUSBPCAP_LATENCY latency);
+NTSTATUS USBPcapLatencyStart(PUSBPCAP_LATENCY latency);
+VOID USBPcapLatencyStop(PUSBPCAP_LATENCY latency);
+VOID USBPcapLatencyGet(PUSBPCAP_LATENCY latency,
+                       PUSBPCAP_IOCTL_LATENCY out);
+
+ULONG USBPcapLatencyGetBucket(UINT64 latency);
+
+/* Can be called at any IRQL <= DISPATCH_LEVEL */
+VOID USBPcapLatencyAdd(PUSBPCAP_LATENCY latency,
+                       ULONG processor,
+                       USHORT device,
+                       UCHAR endpoint,
+                       UCHAR transfer,
+                       UINT64 value);
+VOID USBPcapLatencyUntracked(PUSBPCAP_LATENCY latency);
+
+#endif /* USBPCAP_LATENCY_H */
@@ -31,24 +31,115 @@
 #define DKPORT_MTAG         (ULONG)'dk3A' // To tag memory allocation if any
 
 #include "USBPcapQueue.h"
+#include "USBPcapRing.h"
+#include "USBPcapCpuRings.h"
+#include "USBPcapSharedBuffer.h"
+#include "USBPcapSnaplen.h"
+#include "USBPcapStatistics.h"
+#include "USBPcapTables.h"
+#include "USBPcapLatency.h"
+#include "USBPcapEndpointStats.h"
+#include "USBPcapWakeup.h"
+#include "USBPcapTrigger.h"
 #include "include\USBPcap.h"
 
 #define USBPCAP_DEFAULT_SNAP_LEN  65535
 
+/* Number of isochronous scratch memory size buckets, see USBPcapURB.c */
+#define USBPCAP_ISOCH_LOOKASIDE_BUCKETS  2
+
 typedef struct _USBPCAP_ROOTHUB_DATA
 {
-    /* Circular-Buffer related variables */
+    /* Circular-Buffer related variables.
+     *
+     * Packets are written to the ring without taking any lock.
+     * bufferLock serializes the ring consumer (read IRP handling) and
+     * buffer reconfiguration.
+     */
     KSPIN_LOCK             bufferLock;
-    PVOID                  buffer;
-    UINT32                 bufferSize;
-    UINT32                 readOffset;
-    UINT32                 writeOffset;
+    USBPCAP_RING           ring;
+    /* Number of already returned bytes of partially read record */
+    UINT32                 recordSkip;
+    /* Held by the consumer while reading and by producers while they evict
+     * the oldest records to make space (see trigger).
+     */
+    KSPIN_LOCK             evictLock;
+
+    /* Non-zero when there may be read IRP waiting in Cancel-Safe queue
+     * and no one is completing it. Writer that commits data clears it with
+     * InterlockedCompareExchange and only then takes bufferLock. Set again
+     * (with bufferLock held) when reads stay queued.
+     * To be used only with InterlockedXXX calls.
+     */
+    volatile LONG          readPending;
+
+    /* Non-zero when there is capture buffer. While zero, URBs are passed
+     * down without completion routine and only the device state changes
+     * are analyzed. Changed only with bufferLock held.
+     */
+    volatile LONG          captureArmed;
+
+    /* Read wakeup policy. wakeupTimer is armed when a read is pending
+     * with less than wakeup.minBytes available.
+     */
+    USBPCAP_WAKEUP_POLICY  wakeup;
+    KTIMER                 wakeupTimer;
+    KDPC                   wakeupDpc;
+    volatile LONG          wakeupTimerArmed;
+
+    /* Per-processor rings. Used instead of ring (which then holds only the
+     * global header) when USBPCAP_CAPTURE_FLAG_PER_CPU_BUFFERS is set.
+     */
+    USBPCAP_CPU_RINGS      cpuRings;
+
+    /* Backing storage of ring when USBPCAP_CAPTURE_FLAG_MAPPED_BUFFER
+     * is set. Allocated from whole pages so it can be mapped to user mode.
+     */
+    USBPCAP_SHARED_BUFFER  shared;
+
+    /* Capture counters. See USBPCAP_IOCTL_STATISTICS. */
+    USBPCAP_STATISTICS     stats;
+
+    /* Submit-to-completion latency. See USBPCAP_IOCTL_LATENCY. */
+    USBPCAP_LATENCY        latency;
+
+    /* Per endpoint traffic counters. See USBPCAP_IOCTL_ENDPOINT_STATS. */
+    USBPCAP_ENDPOINT_STATS endpointStats;
+
+    /* USBPCAP_CAPTURE_FLAG_XXX. Can change only when there is no buffer. */
+    UINT32                 captureFlags;
 
     /* Snapshot length */
     UINT32                 snaplen;
 
-    /* Address filter. See include\USBPcap.h for more information. */
-    USBPCAP_ADDRESS_FILTER filter;
+    /* Per transfer type and endpoint snapshot lengths, limited by snaplen.
+     * Can change only when there is no buffer.
+     */
+    USBPCAP_IOCTL_SNAPLEN_TABLE snaplenTable;
+    /* snaplenTable resolved for per packet lookup */
+    USBPCAP_SNAPLEN_LOOKUP snaplenLookup;
+
+    /* Packet filter program, NULL if all packets are captured.
+     * Can change only when there is no buffer.
+     */
+    PUSBPCAP_IOCTL_FILTER_PROGRAM filterProgram;
+
+    /* Capture trigger, type is USBPCAP_TRIGGER_NONE if not set.
+     * Can change only when there is no buffer.
+     */
+    USBPCAP_IOCTL_TRIGGER  trigger;
+    /* State of the capture around the trigger, see USBPcapTrigger.h */
+    USBPCAP_TRIGGER_PROGRESS triggerProgress;
+
+    /* Device, endpoint and transfer type filter.
+     * See include\USBPcap.h for more information.
+     */
+    USBPCAP_ENDPOINT_FILTER filter;
+
+    /* Scratch memory for isochronous transfer headers.
+     * See USBPcapURB.c for more information.
+     */
+    NPAGED_LOOKASIDE_LIST  isochLookaside[USBPCAP_ISOCH_LOOKASIDE_BUCKETS];
 
     /* Reference count. To be used only with InterlockedXXX calls. */
     volatile LONG          refCount;
@@ -76,8 +167,12 @@ typedef struct _DEVICE_DATA
     USHORT                 deviceAddress;
 
     KSPIN_LOCK             tablesSpinLock;
-    PRTL_GENERIC_TABLE     endpointTable;
-    PRTL_GENERIC_TABLE     URBIrpTable;
+    PUSBPCAP_ENDPOINT_TABLE endpointTable;
+    PUSBPCAP_URB_IRP_TABLE URBIrpTable;
+    /* Submit information of URBs paired with their completion
+     * (USBPCAP_CAPTURE_FLAG_COMPLETION_ONLY and latency measurement)
+     */
+    PUSBPCAP_URB_IRP_TABLE submitTable;
 
     PUSBPCAP_ROOTHUB_DATA  pRootData;
 
@@ -122,6 +217,7 @@ typedef struct DEVICE_EXTENSION_Tag {
             LIST_ENTRY      lePendIrp;       // Used by I/O Cancel-Safe
             IO_CSQ          ioCsq;           // I/O Cancel-Safe object
             KSPIN_LOCK      csqSpinLock;     // Spin lock object for I/O Cancel-Safe
+            volatile LONG   pendingReads;    // Number of IRPs in lePendIrp
         } control;
 
         /* For USBPCAP_MAGIC_ROOTHUB or USBPCAP_MAGIC_DEVICE */
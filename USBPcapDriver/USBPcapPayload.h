@@ -0,0 +1,21 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef USBPCAP_PAYLOAD_H
+#define USBPCAP_PAYLOAD_H
+
+#include "USBPcapPortable.h"
+
+/* Packet data is passed around as {0, NULL} terminated array of entries,
+ * so transfer buffers can be captured without copying them together.
+ */
+typedef struct
+{
+    UINT32  size;
+    PVOID   buffer;
+} USBPCAP_PAYLOAD_ENTRY, *PUSBPCAP_PAYLOAD_ENTRY;
+
+#endif /* USBPCAP_PAYLOAD_H */
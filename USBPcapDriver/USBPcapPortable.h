@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef USBPCAP_PORTABLE_H
+#define USBPCAP_PORTABLE_H
+
+/*
+ * Modules that need no I/O manager services (ring, record codec, lookup
+ * tables, ...) include this header instead of USBPcapMain.h. The driver
+ * build gets Wdm.h. With USBPCAP_HOST_BUILD defined, the modules are built
+ * as ordinary user mode code (see tests directory) and get the handful of
+ * kernel types and primitives they use, implemented with GCC builtins.
+ */
+#ifndef USBPCAP_HOST_BUILD
+
+#include "Wdm.h"
+
+#ifndef DkDbgStr
+#define DkDbgStr(a)    KdPrint(("USBPcap, %s(): %s\n", __FUNCTION__, a))
+#define DkDbgVal(a, b) KdPrint(("USBPcap, %s(): %s ("#b" = 0x%X)\n", __FUNCTION__, a, b))
+#endif
+
+#else /* USBPCAP_HOST_BUILD */
+
+#include <assert.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define VOID void
+#define IN
+#define OUT
+#define __inline inline
+#define TRUE  1
+#define FALSE 0
+
+typedef char               CHAR, *PCHAR;
+typedef unsigned char      UCHAR, *PUCHAR, BOOLEAN, *PBOOLEAN, UINT8, *PUINT8;
+typedef unsigned short     USHORT, *PUSHORT, UINT16, *PUINT16;
+typedef int32_t            LONG, *PLONG, INT32;
+typedef uint32_t           ULONG, *PULONG, UINT32, *PUINT32;
+typedef int64_t            LONG64, *PLONG64, LONGLONG, INT64;
+typedef uint64_t           ULONG64, ULONGLONG, UINT64, *PUINT64;
+typedef uintptr_t          ULONG_PTR, UINT_PTR, SIZE_T;
+typedef void               *PVOID;
+typedef LONG               NTSTATUS;
+/* IRPs are only used as opaque keys */
+typedef struct _IRP        *PIRP;
+
+typedef union _LARGE_INTEGER
+{
+    struct
+    {
+        ULONG LowPart;
+        LONG  HighPart;
+    } u;
+    LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+#define STATUS_SUCCESS                ((NTSTATUS)0x00000000L)
+#define STATUS_UNSUCCESSFUL           ((NTSTATUS)0xC0000001L)
+#define STATUS_INVALID_PARAMETER      ((NTSTATUS)0xC000000DL)
+#define STATUS_INSUFFICIENT_RESOURCES ((NTSTATUS)0xC000009AL)
+#define STATUS_BUFFER_TOO_SMALL       ((NTSTATUS)0xC0000023L)
+#define STATUS_NOT_SUPPORTED          ((NTSTATUS)0xC00000BBL)
+#define STATUS_NO_MATCH               ((NTSTATUS)0xC0000272L)
+#define NT_SUCCESS(status)            (((NTSTATUS)(status)) >= 0)
+
+#define MAXUCHAR   0xff
+#define MAXUSHORT  0xffff
+#define MAXLONG    0x7fffffffL
+#define MAXULONG   0xffffffffUL
+#define MAXULONG64 0xffffffffffffffffULL
+
+#ifndef min
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+#define FIELD_OFFSET(type, field)    ((LONG)offsetof(type, field))
+#define UNREFERENCED_PARAMETER(p)    ((void)(p))
+#define ASSERT(e)                    assert(e)
+
+#define RtlCopyMemory(d, s, l)       memcpy((d), (s), (l))
+#define RtlMoveMemory(d, s, l)       memmove((d), (s), (l))
+#define RtlZeroMemory(d, l)          memset((d), 0, (l))
+
+#define DkDbgStr(a)                  ((void)0)
+#define DkDbgVal(a, b)               ((void)0)
+
+/* Producers wait for each other only for a few instructions in the
+ * driver. User mode threads can be preempted, so give up the processor.
+ */
+#define YieldProcessor()             sched_yield()
+#define KeMemoryBarrier()            __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#define InterlockedIncrement(p)      __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement(p)      __atomic_sub_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedExchange(p, v)    __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd(p, v) __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+
+static inline LONG
+InterlockedCompareExchange(volatile LONG *target, LONG exchange, LONG comparand)
+{
+    __atomic_compare_exchange_n(target, &comparand, exchange, 0,
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return comparand;
+}
+
+static inline PVOID
+InterlockedExchangePointer(PVOID volatile *target, PVOID value)
+{
+    return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST);
+}
+
+static inline PVOID
+InterlockedCompareExchangePointer(PVOID volatile *target, PVOID exchange, PVOID comparand)
+{
+    __atomic_compare_exchange_n(target, &comparand, exchange, 0,
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return comparand;
+}
+
+static inline LONG64
+InterlockedCompareExchange64(volatile LONG64 *target, LONG64 exchange, LONG64 comparand)
+{
+    __atomic_compare_exchange_n(target, &comparand, exchange, 0,
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return comparand;
+}
+
+static inline VOID
+ExInterlockedAddLargeStatistic(PLARGE_INTEGER addend, ULONG increment)
+{
+    __atomic_fetch_add(&addend->QuadPart, increment, __ATOMIC_SEQ_CST);
+}
+
+/* Spin lock for short sections that are rarely contended. IRQL is not
+ * simulated.
+ */
+typedef UCHAR                KIRQL, *PKIRQL;
+typedef volatile LONG        KSPIN_LOCK, *PKSPIN_LOCK;
+
+#define KeInitializeSpinLock(l)      (*(l) = 0)
+
+static inline VOID KeAcquireSpinLock(PKSPIN_LOCK lock, PKIRQL irql)
+{
+    *irql = 0;
+    while (InterlockedCompareExchange(lock, 1, 0) != 0)
+    {
+        YieldProcessor();
+    }
+}
+
+static inline VOID KeReleaseSpinLock(PKSPIN_LOCK lock, KIRQL irql)
+{
+    UNREFERENCED_PARAMETER(irql);
+    __atomic_store_n(lock, 0, __ATOMIC_SEQ_CST);
+}
+
+static inline VOID KeAcquireSpinLockAtDpcLevel(PKSPIN_LOCK lock)
+{
+    KIRQL irql;
+
+    KeAcquireSpinLock(lock, &irql);
+}
+
+#define KeReleaseSpinLockFromDpcLevel(l)  KeReleaseSpinLock((l), 0)
+
+#define NTDDI_VISTA                  0x06000000
+#define NTDDI_WIN7                   0x06010000
+#define NTDDI_VERSION                NTDDI_WIN7
+
+#define NonPagedPool                 0
+#define ExAllocatePoolWithTag(t, s, g) malloc(s)
+#define ExFreePool(p)                free(p)
+
+/* Simulated processors. Test sets the count before initializing modules
+ * and the number in every thread that acts as a processor.
+ */
+extern ULONG UsbpcapHostProcessorCount;
+extern __thread ULONG UsbpcapHostProcessor;
+
+#define ALL_PROCESSOR_GROUPS              0xffff
+#define KeQueryActiveProcessorCount(a)    UsbpcapHostProcessorCount
+#define KeQueryActiveProcessorCountEx(g)  UsbpcapHostProcessorCount
+#define KeGetCurrentProcessorNumber()     UsbpcapHostProcessor
+#define KeGetCurrentProcessorNumberEx(p)  UsbpcapHostProcessor
+
+#endif /* USBPCAP_HOST_BUILD */
+
+#endif /* USBPCAP_PORTABLE_H */
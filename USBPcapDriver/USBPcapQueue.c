@@ -18,15 +18,19 @@ VOID DkCsqInsertIrp(__in PIO_CSQ pCsq, __in PIRP pIrp)
 
     InsertTailList(&pDevExt->context.control.lePendIrp,
                    &pIrp->Tail.Overlay.ListEntry);
+    InterlockedIncrement(&pDevExt->context.control.pendingReads);
 }
 
 VOID DkCsqRemoveIrp(__in PIO_CSQ pCsq, __in PIRP pIrp)
 {
+    PDEVICE_EXTENSION   pDevExt = NULL;
     BOOLEAN  bRes = FALSE;
 
-    UNREFERENCED_PARAMETER(pCsq);
+    pDevExt = CONTAINING_RECORD(pCsq, DEVICE_EXTENSION,
+                                context.control.ioCsq);
 
     bRes = RemoveEntryList(&pIrp->Tail.Overlay.ListEntry);
+    InterlockedDecrement(&pDevExt->context.control.pendingReads);
 }
 
 PIRP DkCsqPeekNextIrp(__in PIO_CSQ pCsq, __in PIRP pIrp, __in PVOID pCtx)
@@ -0,0 +1,529 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include "USBPcapRecord.h"
+
+#define USBPCAP_RECORD_BASE_HEADER  ((UINT32)sizeof(USBPCAP_BUFFER_PACKET_HEADER))
+
+/* Length and timestamp fields */
+#define USBPCAP_RECORD_FIXED_PREFIX (sizeof(UINT32) + sizeof(UINT64))
+
+/* Difference between 1601-01-01 and 1970-01-01 in 100 ns units */
+#define USBPCAP_RECORD_EPOCH_DIFFERENCE  116444736000000000ULL
+
+static UINT32
+USBPcapRecordPutVarint(PUCHAR dest,
+                       UINT64 value)
+{
+    UINT32 length = 0;
+
+    while (value >= 0x80)
+    {
+        dest[length++] = (UCHAR)(value | 0x80);
+        value >>= 7;
+    }
+    dest[length++] = (UCHAR)value;
+
+    return length;
+}
+
+/*
+ * Reads varint at *offset. Fails if the value is larger than max or the
+ * varint does not end before available.
+ */
+static BOOLEAN
+USBPcapRecordGetVarint(PUCHAR src,
+                       UINT32 available,
+                       PUINT32 offset,
+                       UINT64 max,
+                       UINT64 *value)
+{
+    UINT64 result = 0;
+    UINT32 shift = 0;
+    UINT32 i = *offset;
+    UCHAR  byte;
+
+    do
+    {
+        if ((i >= available) || (shift > 63))
+        {
+            return FALSE;
+        }
+        byte = src[i++];
+        result |= (UINT64)(byte & 0x7F) << shift;
+        shift += 7;
+    }
+    while (byte & 0x80);
+
+    if (result > max)
+    {
+        return FALSE;
+    }
+
+    *offset = i;
+    *value = result;
+    return TRUE;
+}
+
+__inline static UINT64
+USBPcapRecordZigZag(UINT64 value)
+{
+    return (value << 1) ^ (UINT64)((INT64)value >> 63);
+}
+
+__inline static UINT64
+USBPcapRecordUnZigZag(UINT64 value)
+{
+    return (value >> 1) ^ (UINT64)(-(INT64)(value & 1));
+}
+
+/*
+ * Returns number of bytes stored after the record prefix.
+ */
+UINT32 USBPcapRecordGetBodyLength(UINT32 captured)
+{
+    return (captured > USBPCAP_RECORD_BASE_HEADER) ?
+           captured - USBPCAP_RECORD_BASE_HEADER : 0;
+}
+
+/*
+ * Encodes record prefix. prefix must be at least USBPCAP_RECORD_MAX_PREFIX
+ * bytes long. Returns the prefix length. The prefix has to be followed by
+ * USBPcapRecordGetBodyLength(captured) bytes: the captured part of header
+ * that follows USBPCAP_BUFFER_PACKET_HEADER and the captured part of data.
+ */
+UINT32 USBPcapRecordEncode(PUSBPCAP_BUFFER_PACKET_HEADER header,
+                           UINT64 timestamp,
+                           UINT32 captured,
+                           PUCHAR prefix)
+{
+    UINT32 offset = sizeof(UINT32);
+    UINT32 length;
+
+    RtlCopyMemory(&prefix[offset], &timestamp, sizeof(UINT64));
+    offset += sizeof(UINT64);
+
+    offset += USBPcapRecordPutVarint(&prefix[offset], header->headerLen);
+    offset += USBPcapRecordPutVarint(&prefix[offset],
+                                     USBPcapRecordZigZag(header->irpId));
+    offset += USBPcapRecordPutVarint(&prefix[offset], (UINT32)header->status);
+    offset += USBPcapRecordPutVarint(&prefix[offset], header->function);
+    prefix[offset++] = header->info;
+    offset += USBPcapRecordPutVarint(&prefix[offset], header->bus);
+    offset += USBPcapRecordPutVarint(&prefix[offset], header->device);
+    prefix[offset++] = header->endpoint;
+    prefix[offset++] = header->transfer;
+    offset += USBPcapRecordPutVarint(&prefix[offset], header->dataLength);
+    offset += USBPcapRecordPutVarint(&prefix[offset], captured);
+
+    length = offset + USBPcapRecordGetBodyLength(captured);
+    RtlCopyMemory(prefix, &length, sizeof(UINT32));
+
+    return offset;
+}
+
+/*
+ * Encodes prefix of raw record holding length bytes. Returns the prefix
+ * length.
+ */
+UINT32 USBPcapRecordEncodeRaw(UINT32 length,
+                              PUCHAR prefix)
+{
+    UINT32 field = ((UINT32)sizeof(UINT32) + length) | USBPCAP_RECORD_RAW;
+
+    RtlCopyMemory(prefix, &field, sizeof(UINT32));
+
+    return sizeof(UINT32);
+}
+
+/*
+ * Decodes packet record. available is the number of record bytes in
+ * record, it must cover at least the whole prefix.
+ *
+ * Returns FALSE if the record is raw or malformed.
+ */
+BOOLEAN USBPcapRecordDecode(PUCHAR record,
+                            UINT32 available,
+                            PUSBPCAP_RECORD_INFO info)
+{
+    UINT32 offset;
+    UINT64 value;
+
+    if (available < USBPCAP_RECORD_FIXED_PREFIX)
+    {
+        return FALSE;
+    }
+
+    RtlCopyMemory(&info->length, record, sizeof(UINT32));
+    if (info->length & USBPCAP_RECORD_RAW)
+    {
+        return FALSE;
+    }
+    if (available > info->length)
+    {
+        available = info->length;
+    }
+
+    RtlCopyMemory(&info->timestamp, &record[sizeof(UINT32)], sizeof(UINT64));
+    offset = USBPCAP_RECORD_FIXED_PREFIX;
+
+#define GET_FIELD(field, max, type) \
+    if (!USBPcapRecordGetVarint(record, available, &offset, (max), &value)) \
+    { \
+        return FALSE; \
+    } \
+    field = (type)value;
+#define GET_BYTE(field) \
+    if (offset >= available) \
+    { \
+        return FALSE; \
+    } \
+    field = record[offset++];
+
+    GET_FIELD(info->header.headerLen, MAXUSHORT, USHORT)
+    GET_FIELD(value, MAXULONG64, UINT64)
+    info->header.irpId = USBPcapRecordUnZigZag(value);
+    GET_FIELD(info->header.status, MAXULONG, USBD_STATUS)
+    GET_FIELD(info->header.function, MAXUSHORT, USHORT)
+    GET_BYTE(info->header.info)
+    GET_FIELD(info->header.bus, MAXUSHORT, USHORT)
+    GET_FIELD(info->header.device, MAXUSHORT, USHORT)
+    GET_BYTE(info->header.endpoint)
+    GET_BYTE(info->header.transfer)
+    GET_FIELD(info->header.dataLength, MAXULONG, UINT32)
+    GET_FIELD(info->captured, MAXULONG, UINT32)
+
+#undef GET_FIELD
+#undef GET_BYTE
+
+    info->dataOffset = offset;
+
+    if ((info->header.headerLen < USBPCAP_RECORD_BASE_HEADER) ||
+        ((UINT64)info->captured >
+         (UINT64)info->header.headerLen + info->header.dataLength) ||
+        (info->length - info->dataOffset != USBPcapRecordGetBodyLength(info->captured)))
+    {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Generates pcap record header (or Enhanced Packet Block header) followed
+ * by the captured part of USBPCAP_BUFFER_PACKET_HEADER. dest must be at
+ * least USBPCAP_RECORD_MAX_EXPANDED_HEAD bytes long.
+ *
+ * Returns number of bytes written.
+ */
+UINT32 USBPcapRecordExpandHead(PUSBPCAP_RECORD_INFO info,
+                               BOOLEAN pcapng,
+                               PUCHAR dest)
+{
+    UINT32 packetLength = (UINT32)info->header.headerLen + info->header.dataLength;
+    UINT32 offset;
+
+    if (pcapng)
+    {
+        pcapng_epb_t  epb;
+        UINT64        ts = info->timestamp - USBPCAP_RECORD_EPOCH_DIFFERENCE;
+        UINT32        padding = (4 - (info->captured & 3)) & 3;
+
+        epb.block_type = PCAPNG_BLOCK_TYPE_EPB;
+        epb.block_total_length = (UINT32)sizeof(pcapng_epb_t) + info->captured +
+                                 padding + (UINT32)sizeof(UINT32);
+        epb.interface_id = 0;
+        epb.timestamp_high = (UINT32)(ts >> 32);
+        epb.timestamp_low = (UINT32)ts;
+        epb.captured_len = info->captured;
+        epb.packet_len = packetLength;
+        RtlCopyMemory(dest, &epb, sizeof(epb));
+        offset = sizeof(epb);
+    }
+    else
+    {
+        pcaprec_hdr_t  header;
+
+        header.ts_sec = (UINT32)(info->timestamp/10000000-11644473600);
+        header.ts_usec = (UINT32)((info->timestamp%10000000)/10);
+        header.incl_len = info->captured;
+        header.orig_len = packetLength;
+        RtlCopyMemory(dest, &header, sizeof(header));
+        offset = sizeof(header);
+    }
+
+    RtlCopyMemory(&dest[offset], &info->header,
+                  min(info->captured, USBPCAP_RECORD_BASE_HEADER));
+
+    return offset + min(info->captured, USBPCAP_RECORD_BASE_HEADER);
+}
+
+/*
+ * Generates data that follows the captured data in expanded record (pcapng
+ * padding and block length). dest must be at least
+ * USBPCAP_RECORD_MAX_EXPANDED_TAIL bytes long.
+ *
+ * Returns number of bytes written.
+ */
+UINT32 USBPcapRecordExpandTail(PUSBPCAP_RECORD_INFO info,
+                               BOOLEAN pcapng,
+                               PUCHAR dest)
+{
+    UINT32 padding;
+    UINT32 blockLength;
+
+    if (!pcapng)
+    {
+        return 0;
+    }
+
+    padding = (4 - (info->captured & 3)) & 3;
+    blockLength = (UINT32)sizeof(pcapng_epb_t) + info->captured +
+                  padding + (UINT32)sizeof(UINT32);
+
+    RtlZeroMemory(dest, padding);
+    RtlCopyMemory(&dest[padding], &blockLength, sizeof(UINT32));
+
+    return padding + sizeof(UINT32);
+}
+
+/*
+ * Returns timestamp of the oldest record in ring. Raw records are treated
+ * as older than any packet.
+ *
+ * Returns FALSE if the ring is empty.
+ */
+BOOLEAN USBPcapRecordPeekTimestamp(PUSBPCAP_RING ring,
+                                   PUINT64 timestamp)
+{
+    UINT32 length;
+
+    if (!USBPcapRingPeek(ring, (PVOID)&length, sizeof(UINT32)))
+    {
+        return FALSE;
+    }
+
+    if (length & USBPCAP_RECORD_RAW)
+    {
+        *timestamp = 0;
+        return TRUE;
+    }
+
+    /* Records are committed as a whole */
+    return USBPcapRingPeekAt(ring, sizeof(UINT32),
+                             (PVOID)timestamp, sizeof(UINT64));
+}
+
+/*
+ * Expands the oldest record in ring starting at *skip. If whole is TRUE,
+ * nothing is copied unless the rest of expanded record fits into dest.
+ */
+static UINT32
+USBPcapRecordExpand(PUSBPCAP_RING ring,
+                    BOOLEAN pcapng,
+                    PUCHAR dest,
+                    UINT32 destSize,
+                    PUINT32 skip,
+                    BOOLEAN whole)
+{
+    UCHAR                prefix[USBPCAP_RECORD_MAX_PREFIX];
+    UCHAR                head[USBPCAP_RECORD_MAX_EXPANDED_HEAD];
+    UCHAR                tail[USBPCAP_RECORD_MAX_EXPANDED_TAIL];
+    USBPCAP_RECORD_INFO  info;
+    UINT32               length;
+    UINT32               headLength;
+    UINT32               bodyOffset;
+    UINT32               bodyLength;
+    UINT32               tailLength;
+    UINT32               position;
+    UINT32               copied = 0;
+    UINT32               tmp;
+
+    if (!USBPcapRingPeek(ring, (PVOID)&length, sizeof(UINT32)))
+    {
+        return 0;
+    }
+
+    if (length & USBPCAP_RECORD_RAW)
+    {
+        length &= USBPCAP_RECORD_LENGTH_MASK;
+        headLength = 0;
+        bodyOffset = sizeof(UINT32);
+        bodyLength = length - sizeof(UINT32);
+        tailLength = 0;
+    }
+    else
+    {
+        tmp = min(length, USBPCAP_RECORD_MAX_PREFIX);
+        if (!USBPcapRingPeek(ring, (PVOID)prefix, tmp) ||
+            !USBPcapRecordDecode(prefix, tmp, &info))
+        {
+            /* Should never happen, drop the record */
+            DkDbgVal("Invalid record", length);
+            USBPcapRingConsume(ring, length);
+            *skip = 0;
+            return 0;
+        }
+
+        headLength = USBPcapRecordExpandHead(&info, pcapng, head);
+        bodyOffset = info.dataOffset;
+        bodyLength = info.length - info.dataOffset;
+        tailLength = USBPcapRecordExpandTail(&info, pcapng, tail);
+    }
+
+    position = *skip;
+
+    if (whole && (headLength + bodyLength + tailLength - position > destSize))
+    {
+        return 0;
+    }
+
+    if (position < headLength)
+    {
+        tmp = min(headLength - position, destSize);
+        RtlCopyMemory(dest, &head[position], tmp);
+        copied += tmp;
+        position += tmp;
+    }
+
+    if ((copied < destSize) && (position < headLength + bodyLength))
+    {
+        tmp = min(headLength + bodyLength - position, destSize - copied);
+        USBPcapRingPeekAt(ring, bodyOffset + (position - headLength),
+                          (PVOID)&dest[copied], tmp);
+        copied += tmp;
+        position += tmp;
+    }
+
+    if ((copied < destSize) && (position < headLength + bodyLength + tailLength))
+    {
+        tmp = min(headLength + bodyLength + tailLength - position,
+                  destSize - copied);
+        RtlCopyMemory(&dest[copied],
+                      &tail[position - headLength - bodyLength], tmp);
+        copied += tmp;
+        position += tmp;
+    }
+
+    if (position == headLength + bodyLength + tailLength)
+    {
+        USBPcapRingConsume(ring, length);
+        *skip = 0;
+    }
+    else
+    {
+        *skip = position;
+    }
+
+    return copied;
+}
+
+/*
+ * Reads the oldest record from ring and expands it. If the expanded record
+ * does not fit into dest, it is split and *skip is set to the number of
+ * bytes returned so far. The record is removed from the ring only after
+ * it was returned completely (*skip is then reset to 0).
+ *
+ * Returns number of bytes written to dest, 0 if the ring is empty.
+ */
+UINT32 USBPcapRecordRead(PUSBPCAP_RING ring,
+                         BOOLEAN pcapng,
+                         PUCHAR dest,
+                         UINT32 destSize,
+                         PUINT32 skip)
+{
+    return USBPcapRecordExpand(ring, pcapng, dest, destSize, skip, FALSE);
+}
+
+/*
+ * Reads the oldest record from ring and expands it. Record is never split,
+ * it stays in the ring if it does not fit into dest.
+ *
+ * Returns number of bytes written to dest, 0 if the ring is empty or the
+ * record does not fit.
+ */
+UINT32 USBPcapRecordReadWhole(PUSBPCAP_RING ring,
+                              BOOLEAN pcapng,
+                              PUCHAR dest,
+                              UINT32 destSize)
+{
+    UINT32 skip = 0;
+
+    return USBPcapRecordExpand(ring, pcapng, dest, destSize, &skip, TRUE);
+}
+
+/*
+ * Evicts the oldest packet records so length bytes can be reserved.
+ * Raw record at the head of the ring (global header) is kept in front of
+ * the remaining records. Nothing is evicted if the head record was
+ * partially read (skip is non-zero) or if evicting all committed records
+ * would not free enough space.
+ *
+ * Returns number of evicted records and sets *evictedBytes to the number
+ * of bytes released.
+ */
+UINT32 USBPcapRecordEvict(PUSBPCAP_RING ring,
+                          UINT32 length,
+                          UINT32 skip,
+                          PUINT32 evictedBytes)
+{
+    UCHAR   raw[USBPCAP_RECORD_MAX_RAW];
+    UINT32  rawLength = 0;
+    UINT32  offset;
+    UINT32  records = 0;
+    UINT32  field;
+
+    *evictedBytes = 0;
+
+    if ((skip != 0) ||
+        !USBPcapRingPeek(ring, (PVOID)&field, sizeof(UINT32)))
+    {
+        return 0;
+    }
+
+    if (field & USBPCAP_RECORD_RAW)
+    {
+        rawLength = field & USBPCAP_RECORD_LENGTH_MASK;
+        if ((rawLength > sizeof(raw)) ||
+            !USBPcapRingPeek(ring, (PVOID)raw, rawLength))
+        {
+            return 0;
+        }
+    }
+
+    /* Walk packet records following the raw record */
+    offset = rawLength;
+    while (USBPcapRingGetFree(ring) + (offset - rawLength) < length)
+    {
+        if (!USBPcapRingPeekAt(ring, offset, (PVOID)&field, sizeof(UINT32)) ||
+            (field & USBPCAP_RECORD_RAW) ||
+            (field < sizeof(UINT32)))
+        {
+            /* Not enough committed packet records */
+            return 0;
+        }
+
+        offset += field;
+        records++;
+    }
+
+    if (records == 0)
+    {
+        return 0;
+    }
+
+    /* Evicted records are committed and unread, so no producer writes
+     * there. Move the raw record so it ends where the kept records start.
+     */
+    if (rawLength > 0)
+    {
+        USBPcapRingReplaceAt(ring, offset - rawLength, (PVOID)raw, rawLength);
+    }
+    USBPcapRingConsume(ring, offset - rawLength);
+
+    *evictedBytes = offset - rawLength;
+    return records;
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef USBPCAP_RECORD_H
+#define USBPCAP_RECORD_H
+
+#include "USBPcapPortable.h"
+#include "USBPcapRing.h"
+#include "include/USBPcap.h"
+
+/*
+ * Compact packet record.
+ *
+ * Unless the ring is mapped to user mode, packets are stored in the ring
+ * in compact form and expanded to pcap records (or pcapng Enhanced Packet
+ * Blocks) only when they are read. This keeps the 64-bit timestamp
+ * conversion out of the URB completion path and fits more packets into
+ * the same buffer.
+ *
+ *   UINT32  length     Total record length, including this field.
+ *                      USBPCAP_RECORD_RAW is set for raw records.
+ *   UINT64  timestamp  System time (100 ns units since 1601-01-01).
+ *   varint  headerLen
+ *   zigzag  irpId      Kernel addresses are "negative"
+ *   varint  status
+ *   varint  function
+ *   UCHAR   info
+ *   varint  bus
+ *   varint  device
+ *   UCHAR   endpoint
+ *   UCHAR   transfer
+ *   varint  dataLength
+ *   varint  captured   Number of packet bytes (header and data) to store
+ *   Captured part of header following USBPCAP_BUFFER_PACKET_HEADER and
+ *   captured part of data.
+ *
+ * Varints are unsigned LEB128. Raw records have the length field followed
+ * by data that is returned unchanged (global header).
+ *
+ * Encoding and decoding functions do not call any system functions.
+ */
+
+#define USBPCAP_RECORD_RAW         0x80000000
+#define USBPCAP_RECORD_LENGTH_MASK 0x7FFFFFFF
+
+/* Maximum length of fields preceding the captured header part and data */
+#define USBPCAP_RECORD_MAX_PREFIX  64
+
+/* Maximum size of data generated when record is expanded (in addition to
+ * the captured header part and data copied from the record)
+ */
+#define USBPCAP_RECORD_MAX_EXPANDED_HEAD  (sizeof(pcapng_epb_t) + \
+                                           sizeof(USBPCAP_BUFFER_PACKET_HEADER))
+#define USBPCAP_RECORD_MAX_EXPANDED_TAIL  (3 + sizeof(UINT32))
+
+/* Maximum length of raw record (global header) */
+#define USBPCAP_RECORD_MAX_RAW  (sizeof(UINT32) + sizeof(USBPCAP_PCAPNG_HEADER))
+
+typedef struct _USBPCAP_RECORD_INFO
+{
+    UINT32                        length;     /* Record length */
+    UINT32                        dataOffset; /* Offset of captured header part */
+    UINT64                        timestamp;
+    UINT32                        captured;
+    USBPCAP_BUFFER_PACKET_HEADER  header;
+} USBPCAP_RECORD_INFO, *PUSBPCAP_RECORD_INFO;
+
+UINT32 USBPcapRecordGetBodyLength(UINT32 captured);
+UINT32 USBPcapRecordEncode(PUSBPCAP_BUFFER_PACKET_HEADER header,
+                           UINT64 timestamp,
+                           UINT32 captured,
+                           PUCHAR prefix);
+UINT32 USBPcapRecordEncodeRaw(UINT32 length,
+                              PUCHAR prefix);
+BOOLEAN USBPcapRecordDecode(PUCHAR record,
+                            UINT32 available,
+                            PUSBPCAP_RECORD_INFO info);
+
+UINT32 USBPcapRecordExpandHead(PUSBPCAP_RECORD_INFO info,
+                               BOOLEAN pcapng,
+                               PUCHAR dest);
+UINT32 USBPcapRecordExpandTail(PUSBPCAP_RECORD_INFO info,
+                               BOOLEAN pcapng,
+                               PUCHAR dest);
+
+/* Consumer side. Caller must be the only ring consumer. */
+BOOLEAN USBPcapRecordPeekTimestamp(PUSBPCAP_RING ring,
+                                   PUINT64 timestamp);
+UINT32 USBPcapRecordRead(PUSBPCAP_RING ring,
+                         BOOLEAN pcapng,
+                         PUCHAR dest,
+                         UINT32 destSize,
+                         PUINT32 skip);
+UINT32 USBPcapRecordReadWhole(PUSBPCAP_RING ring,
+                              BOOLEAN pcapng,
+                              PUCHAR dest,
+                              UINT32 destSize);
+UINT32 USBPcapRecordEvict(PUSBPCAP_RING ring,
+                          UINT32 length,
+                          UINT32 skip,
+                          PUINT32 evictedBytes);
+
+#endif /* USBPCAP_RECORD_H */
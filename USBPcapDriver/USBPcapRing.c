@@ -0,0 +1,450 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include "USBPcapRing.h"
+
+/*
+ * Plain 64-bit reads are not atomic on 32-bit x86, use cmpxchg8b there.
+ */
+__inline static LONG64
+USBPcapRingLoad(volatile LONG64 *value)
+{
+#if defined(_WIN64)
+    return *value;
+#else
+    return InterlockedCompareExchange64(value, 0, 0);
+#endif
+}
+
+__inline static VOID
+USBPcapRingStore(volatile LONG64 *target, LONG64 value)
+{
+    LONG64 old;
+
+    do
+    {
+        old = USBPcapRingLoad(target);
+    }
+    while (InterlockedCompareExchange64(target, value, old) != old);
+}
+
+VOID USBPcapRingInitialize(PUSBPCAP_RING ring)
+{
+    ring->buffer = NULL;
+    ring->size = 0;
+    ring->writers = 0;
+    ring->frozen = 0;
+    ring->reserveOffset = 0;
+    ring->commitOffset = 0;
+    ring->readOffset = 0;
+    ring->commitMirror = NULL;
+}
+
+/*
+ * Sets the backing storage. First used bytes of buffer are treated as
+ * committed data.
+ *
+ * Caller must ensure there are no producers (ring is frozen) and no consumer.
+ */
+VOID USBPcapRingAttachBuffer(PUSBPCAP_RING ring,
+                             PVOID buffer,
+                             UINT32 size,
+                             UINT32 used)
+{
+    ASSERT(used <= size);
+
+    ring->buffer = (PUCHAR)buffer;
+    ring->size = size;
+    USBPcapRingStore(&ring->reserveOffset, (LONG64)used);
+    USBPcapRingStore(&ring->commitOffset, (LONG64)used);
+    USBPcapRingStore(&ring->readOffset, 0);
+    if (ring->commitMirror != NULL)
+    {
+        USBPcapRingStore(ring->commitMirror, (LONG64)used);
+    }
+}
+
+/*
+ * Discards all data. Same requirements as USBPcapRingAttachBuffer.
+ */
+VOID USBPcapRingReset(PUSBPCAP_RING ring)
+{
+    USBPcapRingStore(&ring->reserveOffset, 0);
+    USBPcapRingStore(&ring->commitOffset, 0);
+    USBPcapRingStore(&ring->readOffset, 0);
+    if (ring->commitMirror != NULL)
+    {
+        USBPcapRingStore(ring->commitMirror, 0);
+    }
+}
+
+/*
+ * Sets location that receives copy of commitOffset. Same requirements as
+ * USBPcapRingAttachBuffer.
+ */
+VOID USBPcapRingSetCommitMirror(PUSBPCAP_RING ring,
+                                volatile LONG64 *commitMirror)
+{
+    ring->commitMirror = commitMirror;
+    if (commitMirror != NULL)
+    {
+        USBPcapRingStore(commitMirror, USBPcapRingLoad(&ring->commitOffset));
+    }
+}
+
+/*
+ * Returns number of committed bytes not yet read.
+ */
+UINT32 USBPcapRingGetUsed(PUSBPCAP_RING ring)
+{
+    LONG64 read = USBPcapRingLoad(&ring->readOffset);
+    LONG64 commit = USBPcapRingLoad(&ring->commitOffset);
+
+    return (UINT32)(commit - read);
+}
+
+/*
+ * Returns number of bytes that can be reserved. The value is only a hint
+ * when there are active producers.
+ */
+UINT32 USBPcapRingGetFree(PUSBPCAP_RING ring)
+{
+    LONG64 read = USBPcapRingLoad(&ring->readOffset);
+    LONG64 reserve = USBPcapRingLoad(&ring->reserveOffset);
+
+    if (ring->buffer == NULL)
+    {
+        return 0;
+    }
+
+    return ring->size - (UINT32)(reserve - read);
+}
+
+LONG64 USBPcapRingGetReadOffset(PUSBPCAP_RING ring)
+{
+    return USBPcapRingLoad(&ring->readOffset);
+}
+
+/*
+ * Registers producer. Returns FALSE if the ring must not be written to.
+ * On TRUE, caller must call USBPcapRingLeave when done.
+ */
+BOOLEAN USBPcapRingEnter(PUSBPCAP_RING ring)
+{
+    InterlockedIncrement(&ring->writers);
+    /* InterlockedIncrement is a full barrier - this read cannot be
+     * reordered with it and thus races with USBPcapRingFreeze are safe.
+     */
+    if (ring->frozen != 0 || ring->buffer == NULL)
+    {
+        InterlockedDecrement(&ring->writers);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+VOID USBPcapRingLeave(PUSBPCAP_RING ring)
+{
+    InterlockedDecrement(&ring->writers);
+}
+
+NTSTATUS USBPcapRingReserve(PUSBPCAP_RING ring,
+                            UINT32 length,
+                            PUSBPCAP_RING_RESERVATION reservation)
+{
+    LONG64 start;
+    LONG64 read;
+
+    if (length == 0)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    do
+    {
+        start = USBPcapRingLoad(&ring->reserveOffset);
+        read = USBPcapRingLoad(&ring->readOffset);
+
+        if ((UINT64)(start - read) + length > (UINT64)ring->size)
+        {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+    while (InterlockedCompareExchange64(&ring->reserveOffset,
+                                        start + length,
+                                        start) != start);
+
+    reservation->start = start;
+    reservation->end = start + length;
+    reservation->offset = start;
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Copies length bytes into the ring starting at offset.
+ */
+__inline static VOID
+USBPcapRingCopyIn(PUSBPCAP_RING ring,
+                  LONG64 offset,
+                  PVOID data,
+                  UINT32 length)
+{
+    UINT32 index;
+    UINT32 tmp;
+
+    index = (UINT32)((UINT64)offset % ring->size);
+    tmp = ring->size - index;
+
+    if (tmp >= length)
+    {
+        /* We can write all data without looping */
+        RtlCopyMemory(&ring->buffer[index], data, (SIZE_T)length);
+    }
+    else
+    {
+        /* We need to loop */
+        RtlCopyMemory(&ring->buffer[index], data, (SIZE_T)tmp);
+        RtlCopyMemory(ring->buffer, &((PUCHAR)data)[tmp],
+                      (SIZE_T)(length - tmp));
+    }
+}
+
+/*
+ * Copies data into reserved space. Caller must not write past the
+ * reservation.
+ */
+VOID USBPcapRingWrite(PUSBPCAP_RING ring,
+                      PUSBPCAP_RING_RESERVATION reservation,
+                      PVOID data,
+                      UINT32 length)
+{
+    ASSERT(reservation->offset + length <= reservation->end);
+
+    USBPcapRingCopyIn(ring, reservation->offset, data, length);
+    reservation->offset += length;
+}
+
+/*
+ * Publishes reservation to the consumer. Waits until all earlier
+ * reservations are committed.
+ */
+VOID USBPcapRingCommit(PUSBPCAP_RING ring,
+                       PUSBPCAP_RING_RESERVATION reservation)
+{
+    while (USBPcapRingLoad(&ring->commitOffset) != reservation->start)
+    {
+        YieldProcessor();
+    }
+
+    /* Commits are serialized here, so the mirror never goes backwards.
+     * Interlocked stores act as release barrier for the copied data.
+     */
+    if (ring->commitMirror != NULL)
+    {
+        USBPcapRingStore(ring->commitMirror, reservation->end);
+    }
+    USBPcapRingStore(&ring->commitOffset, reservation->end);
+}
+
+/*
+ * Copies length bytes starting at offset out of the ring.
+ */
+__inline static VOID
+USBPcapRingCopyOut(PUSBPCAP_RING ring,
+                   LONG64 offset,
+                   PVOID destBuffer,
+                   UINT32 length)
+{
+    UINT32 index;
+    UINT32 tmp;
+
+    index = (UINT32)((UINT64)offset % ring->size);
+    tmp = ring->size - index;
+
+    if (tmp >= length)
+    {
+        /* Copy contiguous data */
+        RtlCopyMemory(destBuffer, &ring->buffer[index], (SIZE_T)length);
+    }
+    else
+    {
+        /* Copy non-contiguous data */
+        RtlCopyMemory(destBuffer, &ring->buffer[index], (SIZE_T)tmp);
+        RtlCopyMemory(&((PUCHAR)destBuffer)[tmp], ring->buffer,
+                      (SIZE_T)(length - tmp));
+    }
+}
+
+/*
+ * Reads committed data from the ring.
+ *
+ * Returns number of bytes read.
+ */
+UINT32 USBPcapRingRead(PUSBPCAP_RING ring,
+                       PVOID destBuffer,
+                       UINT32 destBufferSize)
+{
+    LONG64 read;
+    UINT32 available;
+    UINT32 toRead;
+
+    if (ring->buffer == NULL)
+    {
+        return 0;
+    }
+
+    read = USBPcapRingLoad(&ring->readOffset);
+    available = (UINT32)(USBPcapRingLoad(&ring->commitOffset) - read);
+
+    /* No data to be read or empty destination buffer */
+    if (available == 0 || destBufferSize == 0)
+    {
+        return 0;
+    }
+
+    toRead = min(available, destBufferSize);
+    USBPcapRingCopyOut(ring, read, destBuffer, toRead);
+
+    /* Release the space only after the data was copied out */
+    USBPcapRingStore(&ring->readOffset, read + toRead);
+
+    return toRead;
+}
+
+/*
+ * Copies length bytes of committed data starting offset bytes after the
+ * read position without consuming them.
+ *
+ * Returns FALSE if there is less than offset + length bytes available.
+ */
+BOOLEAN USBPcapRingPeekAt(PUSBPCAP_RING ring,
+                          UINT32 offset,
+                          PVOID destBuffer,
+                          UINT32 length)
+{
+    LONG64 read;
+    UINT32 available;
+
+    if (ring->buffer == NULL)
+    {
+        return FALSE;
+    }
+
+    read = USBPcapRingLoad(&ring->readOffset);
+    available = (UINT32)(USBPcapRingLoad(&ring->commitOffset) - read);
+    if ((available < offset) || (available - offset < length))
+    {
+        return FALSE;
+    }
+
+    USBPcapRingCopyOut(ring, read + offset, destBuffer, length);
+    return TRUE;
+}
+
+/*
+ * Overwrites length bytes of committed data starting offset bytes after
+ * the read position.
+ *
+ * Returns FALSE if there is less than offset + length bytes available.
+ */
+BOOLEAN USBPcapRingReplaceAt(PUSBPCAP_RING ring,
+                             UINT32 offset,
+                             PVOID data,
+                             UINT32 length)
+{
+    LONG64 read;
+    UINT32 available;
+
+    if (ring->buffer == NULL)
+    {
+        return FALSE;
+    }
+
+    read = USBPcapRingLoad(&ring->readOffset);
+    available = (UINT32)(USBPcapRingLoad(&ring->commitOffset) - read);
+    if ((available < offset) || (available - offset < length))
+    {
+        return FALSE;
+    }
+
+    USBPcapRingCopyIn(ring, read + offset, data, length);
+    return TRUE;
+}
+
+/*
+ * Copies first length bytes of committed data without consuming them.
+ *
+ * Returns FALSE if there is less than length bytes available.
+ */
+BOOLEAN USBPcapRingPeek(PUSBPCAP_RING ring,
+                        PVOID destBuffer,
+                        UINT32 length)
+{
+    return USBPcapRingPeekAt(ring, 0, destBuffer, length);
+}
+
+/*
+ * Consumes first length bytes of committed data.
+ *
+ * Returns FALSE if there is less than length bytes available.
+ */
+BOOLEAN USBPcapRingConsume(PUSBPCAP_RING ring,
+                           UINT32 length)
+{
+    if ((ring->buffer == NULL) || (length == 0))
+    {
+        return FALSE;
+    }
+
+    return USBPcapRingAdvanceRead(ring,
+                                  USBPcapRingLoad(&ring->readOffset) + length);
+}
+
+/*
+ * Releases space consumed by external consumer. Values that would move
+ * readOffset backwards or past committed data are rejected.
+ *
+ * Safe to call concurrently with producers.
+ */
+BOOLEAN USBPcapRingAdvanceRead(PUSBPCAP_RING ring,
+                               LONG64 readOffset)
+{
+    LONG64 read;
+
+    do
+    {
+        read = USBPcapRingLoad(&ring->readOffset);
+
+        if ((readOffset <= read) ||
+            (readOffset > USBPcapRingLoad(&ring->commitOffset)))
+        {
+            return FALSE;
+        }
+    }
+    while (InterlockedCompareExchange64(&ring->readOffset,
+                                        readOffset,
+                                        read) != read);
+
+    return TRUE;
+}
+
+VOID USBPcapRingFreeze(PUSBPCAP_RING ring)
+{
+    InterlockedExchange(&ring->frozen, 1);
+
+    /* Producers run at DISPATCH_LEVEL and never block, so this ends
+     * as soon as all of them leave.
+     */
+    while (InterlockedCompareExchange(&ring->writers, 0, 0) != 0)
+    {
+        YieldProcessor();
+    }
+}
+
+VOID USBPcapRingThaw(PUSBPCAP_RING ring)
+{
+    InterlockedExchange(&ring->frozen, 0);
+}
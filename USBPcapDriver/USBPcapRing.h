@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef USBPCAP_RING_H
+#define USBPCAP_RING_H
+
+#include "USBPcapPortable.h"
+
+/*
+ * Multi-producer, single-consumer byte ring.
+ *
+ * Producers claim space with a compare-and-swap on reserveOffset, copy their
+ * record without holding any lock and then publish it by advancing
+ * commitOffset. Records are published in reservation order, so a producer
+ * whose reservation follows a still unfinished one waits for it in Commit.
+ * For this reason Reserve, Write and Commit must be called at DISPATCH_LEVEL
+ * so the thread owning an earlier reservation cannot be preempted.
+ *
+ * The consumer only ever looks at commitOffset and readOffset and never
+ * waits for producers. Callers must make sure there is at most one consumer
+ * at a time.
+ *
+ * All offsets grow monotonically and are reduced modulo size only when
+ * addressing the buffer. 64-bit offsets make the wraparound irrelevant.
+ *
+ * The ring core depends only on interlocked primitives and RtlCopyMemory
+ * (see USBPcapPortable.h), so it is also built and tested in user mode.
+ */
+typedef struct _USBPCAP_RING
+{
+    PUCHAR                 buffer;
+    UINT32                 size;
+
+    /* Number of producers between Enter and Leave */
+    volatile LONG          writers;
+    /* Non-zero when Enter must fail (buffer is being resized or freed) */
+    volatile LONG          frozen;
+
+    volatile LONG64        reserveOffset;
+    volatile LONG64        commitOffset;
+    volatile LONG64        readOffset;
+
+    /* If not NULL, commitOffset is copied here before it is published */
+    volatile LONG64        *commitMirror;
+} USBPCAP_RING, *PUSBPCAP_RING;
+
+typedef struct _USBPCAP_RING_RESERVATION
+{
+    LONG64                 start;  /* First reserved byte */
+    LONG64                 end;    /* First byte after reservation */
+    LONG64                 offset; /* Next byte to be written */
+} USBPCAP_RING_RESERVATION, *PUSBPCAP_RING_RESERVATION;
+
+VOID USBPcapRingInitialize(PUSBPCAP_RING ring);
+VOID USBPcapRingAttachBuffer(PUSBPCAP_RING ring,
+                             PVOID buffer,
+                             UINT32 size,
+                             UINT32 used);
+VOID USBPcapRingReset(PUSBPCAP_RING ring);
+VOID USBPcapRingSetCommitMirror(PUSBPCAP_RING ring,
+                                volatile LONG64 *commitMirror);
+
+UINT32 USBPcapRingGetUsed(PUSBPCAP_RING ring);
+UINT32 USBPcapRingGetFree(PUSBPCAP_RING ring);
+LONG64 USBPcapRingGetReadOffset(PUSBPCAP_RING ring);
+
+/* Producer side */
+BOOLEAN USBPcapRingEnter(PUSBPCAP_RING ring);
+VOID USBPcapRingLeave(PUSBPCAP_RING ring);
+NTSTATUS USBPcapRingReserve(PUSBPCAP_RING ring,
+                            UINT32 length,
+                            PUSBPCAP_RING_RESERVATION reservation);
+VOID USBPcapRingWrite(PUSBPCAP_RING ring,
+                      PUSBPCAP_RING_RESERVATION reservation,
+                      PVOID data,
+                      UINT32 length);
+VOID USBPcapRingCommit(PUSBPCAP_RING ring,
+                       PUSBPCAP_RING_RESERVATION reservation);
+
+/* Consumer side */
+UINT32 USBPcapRingRead(PUSBPCAP_RING ring,
+                       PVOID destBuffer,
+                       UINT32 destBufferSize);
+BOOLEAN USBPcapRingPeek(PUSBPCAP_RING ring,
+                        PVOID destBuffer,
+                        UINT32 length);
+BOOLEAN USBPcapRingPeekAt(PUSBPCAP_RING ring,
+                          UINT32 offset,
+                          PVOID destBuffer,
+                          UINT32 length);
+BOOLEAN USBPcapRingReplaceAt(PUSBPCAP_RING ring,
+                             UINT32 offset,
+                             PVOID data,
+                             UINT32 length);
+BOOLEAN USBPcapRingConsume(PUSBPCAP_RING ring,
+                           UINT32 length);
+BOOLEAN USBPcapRingAdvanceRead(PUSBPCAP_RING ring,
+                               LONG64 readOffset);
+
+/* Makes all subsequent Enter calls fail and waits for active producers */
+VOID USBPcapRingFreeze(PUSBPCAP_RING ring);
+VOID USBPcapRingThaw(PUSBPCAP_RING ring);
+
+#endif /* USBPCAP_RING_H */
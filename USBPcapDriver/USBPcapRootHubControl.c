@@ -107,6 +107,7 @@ NTSTATUS USBPcapCreateRootHubControlDevice(IN PDEVICE_EXTENSION hubExt,
 
         KeInitializeSpinLock(&controlExt->context.control.csqSpinLock);
         InitializeListHead(&controlExt->context.control.lePendIrp);
+        controlExt->context.control.pendingReads = 0;
         status = IoCsqInitialize(&controlExt->context.control.ioCsq,
                                  DkCsqInsertIrp, DkCsqRemoveIrp,
                                  DkCsqPeekNextIrp, DkCsqAcquireLock,
@@ -0,0 +1,339 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include "USBPcapMain.h"
+#include "USBPcapSharedBuffer.h"
+
+#define USBPCAP_SHARED_HEADER_SIZE    PAGE_SIZE
+#define USBPCAP_SHARED_CONSUMER_SIZE  PAGE_SIZE
+
+#if (NTDDI_VERSION >= NTDDI_WIN8)
+/* Consumer must not be able to modify the header and data */
+#define USBPCAP_SHARED_PRODUCER_PRIORITY  (NormalPagePriority | MdlMappingNoWrite)
+#else
+#define USBPCAP_SHARED_PRODUCER_PRIORITY  NormalPagePriority
+#endif
+
+VOID USBPcapSharedBufferInitialize(PUSBPCAP_SHARED_BUFFER shared)
+{
+    shared->mdl = NULL;
+    shared->header = NULL;
+    shared->data = NULL;
+    shared->consumer = NULL;
+    shared->size = 0;
+    shared->mapped = 0;
+    shared->userAddress = NULL;
+    shared->userConsumer = NULL;
+    shared->producerMdl = NULL;
+    shared->consumerMdl = NULL;
+    shared->process = NULL;
+    shared->event = NULL;
+}
+
+/*
+ * Allocates header page, dataSize bytes of ring data and consumer page.
+ * Must be called at IRQL <= APC_LEVEL.
+ */
+NTSTATUS USBPcapSharedBufferAllocate(PUSBPCAP_SHARED_BUFFER shared,
+                                     UINT32 dataSize)
+{
+    PHYSICAL_ADDRESS             lowAddress;
+    PHYSICAL_ADDRESS             highAddress;
+    PHYSICAL_ADDRESS             skipBytes;
+    PUSBPCAP_SHARED_RING_HEADER  header;
+    PMDL                         mdl;
+    SIZE_T                       size;
+
+    ASSERT(shared->mdl == NULL);
+
+    size = USBPCAP_SHARED_HEADER_SIZE + ROUND_TO_PAGES(dataSize) +
+           USBPCAP_SHARED_CONSUMER_SIZE;
+
+    lowAddress.QuadPart = 0;
+    highAddress.QuadPart = (LONGLONG)-1;
+    skipBytes.QuadPart = 0;
+
+    mdl = MmAllocatePagesForMdl(lowAddress, highAddress, skipBytes, size);
+    if (mdl == NULL)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    /* MmAllocatePagesForMdl can return less pages than requested */
+    if (MmGetMdlByteCount(mdl) != size)
+    {
+        MmFreePagesFromMdl(mdl);
+        ExFreePool(mdl);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    header = (PUSBPCAP_SHARED_RING_HEADER)
+        MmMapLockedPagesSpecifyCache(mdl, KernelMode, MmCached,
+                                     NULL, FALSE, NormalPagePriority);
+    if (header == NULL)
+    {
+        MmFreePagesFromMdl(mdl);
+        ExFreePool(mdl);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(header, USBPCAP_SHARED_HEADER_SIZE);
+    header->magic = USBPCAP_SHARED_RING_MAGIC;
+    header->version = USBPCAP_SHARED_RING_VERSION;
+    header->dataOffset = USBPCAP_SHARED_HEADER_SIZE;
+    header->dataSize = dataSize;
+
+    shared->mdl = mdl;
+    shared->header = header;
+    shared->data = (PVOID)((PUCHAR)header + USBPCAP_SHARED_HEADER_SIZE);
+    shared->size = (UINT32)(size - USBPCAP_SHARED_CONSUMER_SIZE);
+    shared->consumer = (PUSBPCAP_SHARED_RING_CONSUMER)
+        ((PUCHAR)header + shared->size);
+    RtlZeroMemory(shared->consumer, USBPCAP_SHARED_CONSUMER_SIZE);
+
+    DkDbgVal("Allocated shared buffer", shared->size);
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Frees the buffer. Must be called at IRQL <= APC_LEVEL after the buffer
+ * was unmapped from user process.
+ */
+VOID USBPcapSharedBufferFree(PUSBPCAP_SHARED_BUFFER shared)
+{
+    if (shared->mdl == NULL)
+    {
+        return;
+    }
+
+    ASSERT(shared->userAddress == NULL);
+
+    MmUnmapLockedPages((PVOID)shared->header, shared->mdl);
+    MmFreePagesFromMdl(shared->mdl);
+    ExFreePool((PVOID)shared->mdl);
+
+    USBPcapSharedBufferInitialize(shared);
+}
+
+/*
+ * Builds MDL describing length bytes at offset of the whole buffer.
+ */
+static PMDL USBPcapSharedBufferBuildPartialMdl(PUSBPCAP_SHARED_BUFFER shared,
+                                               UINT32 offset,
+                                               UINT32 length)
+{
+    PUCHAR  va = (PUCHAR)MmGetMdlVirtualAddress(shared->mdl) + offset;
+    PMDL    mdl;
+
+    mdl = IoAllocateMdl((PVOID)va, length, FALSE, FALSE, NULL);
+    if (mdl != NULL)
+    {
+        IoBuildPartialMdl(shared->mdl, mdl, (PVOID)va, length);
+    }
+    return mdl;
+}
+
+/*
+ * Maps mdl into current process. Returns NULL on failure.
+ */
+static PVOID USBPcapSharedBufferMapMdl(PMDL mdl, ULONG priority)
+{
+    PVOID address;
+
+    /* UserMode mapping raises exception on failure */
+    __try
+    {
+        address = MmMapLockedPagesSpecifyCache(mdl, UserMode, MmCached,
+                                               NULL, FALSE,
+                                               (MM_PAGE_PRIORITY)priority);
+    }
+    __except(EXCEPTION_EXECUTE_HANDLER)
+    {
+        address = NULL;
+    }
+
+    return address;
+}
+
+/*
+ * Releases the partial MDLs.
+ */
+static VOID USBPcapSharedBufferFreePartialMdls(PUSBPCAP_SHARED_BUFFER shared)
+{
+    if (shared->producerMdl != NULL)
+    {
+        IoFreeMdl(shared->producerMdl);
+        shared->producerMdl = NULL;
+    }
+    if (shared->consumerMdl != NULL)
+    {
+        IoFreeMdl(shared->consumerMdl);
+        shared->consumerMdl = NULL;
+    }
+}
+
+/*
+ * Maps the buffer into current process and references the event. Header
+ * and data get read-only mapping, consumer page separate writable one.
+ * Must be called at PASSIVE_LEVEL in the context of requesting process.
+ */
+NTSTATUS USBPcapSharedBufferMapToUser(PUSBPCAP_SHARED_BUFFER shared,
+                                      HANDLE event)
+{
+    NTSTATUS  status;
+    PKEVENT   pEvent;
+    PVOID     address;
+    PVOID     consumer;
+
+    if ((shared->mdl == NULL) || (shared->userAddress != NULL))
+    {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    status = ObReferenceObjectByHandle(event,
+                                       EVENT_MODIFY_STATE,
+                                       *ExEventObjectType,
+                                       UserMode,
+                                       (PVOID*)&pEvent,
+                                       NULL);
+    if (!NT_SUCCESS(status))
+    {
+        DkDbgVal("Invalid event handle", status);
+        return status;
+    }
+
+    shared->producerMdl =
+        USBPcapSharedBufferBuildPartialMdl(shared, 0, shared->size);
+    shared->consumerMdl =
+        USBPcapSharedBufferBuildPartialMdl(shared, shared->size,
+                                           USBPCAP_SHARED_CONSUMER_SIZE);
+    if ((shared->producerMdl == NULL) || (shared->consumerMdl == NULL))
+    {
+        USBPcapSharedBufferFreePartialMdls(shared);
+        ObDereferenceObject(pEvent);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    address = USBPcapSharedBufferMapMdl(shared->producerMdl,
+                                        USBPCAP_SHARED_PRODUCER_PRIORITY);
+    consumer = USBPcapSharedBufferMapMdl(shared->consumerMdl,
+                                         NormalPagePriority);
+    if ((address == NULL) || (consumer == NULL))
+    {
+        if (address != NULL)
+        {
+            MmUnmapLockedPages(address, shared->producerMdl);
+        }
+        if (consumer != NULL)
+        {
+            MmUnmapLockedPages(consumer, shared->consumerMdl);
+        }
+        USBPcapSharedBufferFreePartialMdls(shared);
+        ObDereferenceObject(pEvent);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    shared->process = PsGetCurrentProcess();
+    ObReferenceObject(shared->process);
+    shared->userAddress = address;
+    shared->userConsumer = consumer;
+    shared->event = pEvent;
+
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Removes user mode mapping. Caller must make sure there is no producer
+ * that could call USBPcapSharedBufferNotify.
+ * Must be called at PASSIVE_LEVEL.
+ */
+VOID USBPcapSharedBufferUnmapFromUser(PUSBPCAP_SHARED_BUFFER shared)
+{
+    KAPC_STATE  apcState;
+    BOOLEAN     attached = FALSE;
+
+    InterlockedExchange(&shared->mapped, 0);
+
+    if (shared->userAddress == NULL)
+    {
+        return;
+    }
+
+    /* Handle can be closed from other process than the one that
+     * requested the mapping.
+     */
+    if (PsGetCurrentProcess() != shared->process)
+    {
+        KeStackAttachProcess((PRKPROCESS)shared->process, &apcState);
+        attached = TRUE;
+    }
+
+    MmUnmapLockedPages(shared->userAddress, shared->producerMdl);
+    MmUnmapLockedPages(shared->userConsumer, shared->consumerMdl);
+
+    if (attached)
+    {
+        KeUnstackDetachProcess(&apcState);
+    }
+
+    ObDereferenceObject(shared->process);
+    ObDereferenceObject(shared->event);
+    USBPcapSharedBufferFreePartialMdls(shared);
+    shared->userAddress = NULL;
+    shared->userConsumer = NULL;
+    shared->process = NULL;
+    shared->event = NULL;
+}
+
+/*
+ * Returns readOffset as written by consumer. The value is not validated.
+ */
+LONG64 USBPcapSharedBufferGetReadOffset(PUSBPCAP_SHARED_BUFFER shared)
+{
+#if defined(_WIN64)
+    return shared->consumer->readOffset;
+#else
+    return InterlockedCompareExchange64(&shared->consumer->readOffset, 0, 0);
+#endif
+}
+
+/*
+ * Sets initial consumer position. Must be called before the buffer is
+ * marked as mapped.
+ */
+VOID USBPcapSharedBufferSetReadOffset(PUSBPCAP_SHARED_BUFFER shared,
+                                      LONG64 readOffset)
+{
+    LONG64 old;
+
+    do
+    {
+        old = USBPcapSharedBufferGetReadOffset(shared);
+    }
+    while (InterlockedCompareExchange64(&shared->consumer->readOffset,
+                                        readOffset, old) != old);
+}
+
+/*
+ * Wakes up the consumer if it waits for data.
+ * Must be called after writeOffset was updated.
+ */
+VOID USBPcapSharedBufferNotify(PUSBPCAP_SHARED_BUFFER shared)
+{
+    if (shared->mapped == 0)
+    {
+        return;
+    }
+
+    /* Plain read first, so the consumer cache line is written only when
+     * the consumer actually waits.
+     */
+    if ((shared->consumer->consumerWaiting != 0) &&
+        (InterlockedExchange(&shared->consumer->consumerWaiting, 0) != 0))
+    {
+        KeSetEvent(shared->event, IO_NO_INCREMENT, FALSE);
+    }
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef USBPCAP_SHARED_BUFFER_H
+#define USBPCAP_SHARED_BUFFER_H
+
+#include "Wdm.h"
+#include "include\USBPcap.h"
+
+/*
+ * Capture buffer that can be mapped into user mode process.
+ *
+ * The memory is allocated as whole pages (not from pool) so the mapping
+ * does not expose any other kernel data. First page holds
+ * USBPCAP_SHARED_RING_HEADER, ring data follows. The last page holds
+ * USBPCAP_SHARED_RING_CONSUMER. Header and data are mapped to user mode
+ * read-only, only the consumer page is writable.
+ */
+typedef struct _USBPCAP_SHARED_BUFFER
+{
+    PMDL                           mdl;      /* NULL if there is no buffer */
+    PUSBPCAP_SHARED_RING_HEADER    header;   /* System address */
+    PVOID                          data;     /* System address of ring data */
+    PUSBPCAP_SHARED_RING_CONSUMER  consumer; /* System address */
+    UINT32                         size;     /* Size of header and data */
+
+    /* Non-zero when mapped into user process. In such case the process
+     * is the only consumer. To be used only with InterlockedXXX calls.
+     */
+    volatile LONG                  mapped;
+    PVOID                          userAddress;
+    PVOID                          userConsumer;
+    PMDL                           producerMdl; /* Header and data pages */
+    PMDL                           consumerMdl; /* Consumer page */
+    PEPROCESS                      process;
+    PKEVENT                        event;
+} USBPCAP_SHARED_BUFFER, *PUSBPCAP_SHARED_BUFFER;
+
+VOID USBPcapSharedBufferInitialize(PUSBPCAP_SHARED_BUFFER shared);
+NTSTATUS USBPcapSharedBufferAllocate(PUSBPCAP_SHARED_BUFFER shared,
+                                     UINT32 dataSize);
+VOID USBPcapSharedBufferFree(PUSBPCAP_SHARED_BUFFER shared);
+
+NTSTATUS USBPcapSharedBufferMapToUser(PUSBPCAP_SHARED_BUFFER shared,
+                                      HANDLE event);
+VOID USBPcapSharedBufferUnmapFromUser(PUSBPCAP_SHARED_BUFFER shared);
+
+LONG64 USBPcapSharedBufferGetReadOffset(PUSBPCAP_SHARED_BUFFER shared);
+VOID USBPcapSharedBufferSetReadOffset(PUSBPCAP_SHARED_BUFFER shared,
+                                      LONG64 readOffset);
+VOID USBPcapSharedBufferNotify(PUSBPCAP_SHARED_BUFFER shared);
+
+#endif /* USBPCAP_SHARED_BUFFER_H */
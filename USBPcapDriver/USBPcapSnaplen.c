@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include "USBPcapSnaplen.h"
+
+/* Endpoint address (direction in bit 7) to endpoints row index */
+#define USBPCAP_SNAPLEN_ENDPOINT_INDEX(endpoint) \
+    (((endpoint) & 0x0F) | (((endpoint) & 0x80) ? 16 : 0))
+
+/*
+ * Checks that every endpoint entry can match a packet: device must be
+ * a valid USB address and endpoint must be a valid endpoint address.
+ */
+NTSTATUS USBPcapSnaplenValidate(PUSBPCAP_IOCTL_SNAPLEN_TABLE table)
+{
+    UINT32 i;
+
+    if (table->count > USBPCAP_SNAPLEN_MAX_ENDPOINTS)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    for (i = 0; i < table->count; i++)
+    {
+        if ((table->endpoints[i].device > 127) ||
+            (table->endpoints[i].endpoint & 0x70))
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static UINT32 USBPcapSnaplenResolve(UINT32 value, UINT32 snaplen)
+{
+    if ((value == 0) || (value > snaplen))
+    {
+        return snaplen;
+    }
+    return value;
+}
+
+/*
+ * Builds lookup from validated table. First entry for given device and
+ * endpoint wins, like in the table scan it replaces.
+ */
+VOID USBPcapSnaplenBuild(PUSBPCAP_SNAPLEN_LOOKUP lookup,
+                         PUSBPCAP_IOCTL_SNAPLEN_TABLE table,
+                         UINT32 snaplen)
+{
+    UINT32 rows = 0;
+    UINT32 i;
+
+    RtlZeroMemory(lookup, sizeof(USBPCAP_SNAPLEN_LOOKUP));
+    lookup->snaplen = snaplen;
+    for (i = 0; i < 4; i++)
+    {
+        lookup->transfer[i] = USBPcapSnaplenResolve(table->transfer[i],
+                                                    snaplen);
+    }
+
+    for (i = 0; i < table->count; i++)
+    {
+        PUSBPCAP_SNAPLEN_ENDPOINT entry = &table->endpoints[i];
+        PUINT32 slot;
+
+        if (lookup->device[entry->device] == 0)
+        {
+            /* Every entry adds at most one row */
+            rows++;
+            lookup->device[entry->device] = (UCHAR)rows;
+        }
+
+        slot = &lookup->endpoints[lookup->device[entry->device] - 1]
+                                 [USBPCAP_SNAPLEN_ENDPOINT_INDEX(entry->endpoint)];
+        if (*slot == 0)
+        {
+            *slot = USBPcapSnaplenResolve(entry->snaplen, snaplen);
+        }
+    }
+}
+
+/*
+ * Returns snapshot length for packet. Endpoint entry wins over transfer
+ * type. Unknown endpoint (0xFF) never matches an entry.
+ */
+UINT32 USBPcapSnaplenGet(PUSBPCAP_SNAPLEN_LOOKUP lookup,
+                         USHORT device,
+                         UCHAR endpoint,
+                         UCHAR transfer)
+{
+    if ((device < 128) && (lookup->device[device] != 0) &&
+        !(endpoint & 0x70))
+    {
+        UINT32 snaplen;
+
+        snaplen = lookup->endpoints[lookup->device[device] - 1]
+                                   [USBPCAP_SNAPLEN_ENDPOINT_INDEX(endpoint)];
+        if (snaplen != 0)
+        {
+            return snaplen;
+        }
+    }
+
+    if (transfer <= USBPCAP_TRANSFER_BULK)
+    {
+        return lookup->transfer[transfer];
+    }
+    return lookup->snaplen;
+}
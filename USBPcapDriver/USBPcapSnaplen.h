@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef USBPCAP_SNAPLEN_H
+#define USBPCAP_SNAPLEN_H
+
+#include "USBPcapPortable.h"
+#include "include/USBPcap.h"
+
+/*
+ * Snapshot length lookup built from USBPCAP_IOCTL_SNAPLEN_TABLE.
+ *
+ * Every value is resolved (no limit replaced by the root hub snapshot
+ * length, larger values limited by it) when the table or the root hub
+ * snapshot length is set, so getting the snapshot length of a packet
+ * takes at most two array lookups.
+ */
+typedef struct _USBPCAP_SNAPLEN_LOOKUP
+{
+    /* Root hub snapshot length, used for IRP info and unknown transfers */
+    UINT32                 snaplen;
+    /* Indexed by USBPCAP_TRANSFER_XXX */
+    UINT32                 transfer[4];
+    /* Row in endpoints plus one for every device address, 0 if the table
+     * has no entries for the device.
+     */
+    UCHAR                  device[128];
+    /* Indexed by endpoint number, plus 16 for IN endpoints. 0 where the
+     * table has no entry.
+     */
+    UINT32                 endpoints[USBPCAP_SNAPLEN_MAX_ENDPOINTS][32];
+} USBPCAP_SNAPLEN_LOOKUP, *PUSBPCAP_SNAPLEN_LOOKUP;
+
+NTSTATUS USBPcapSnaplenValidate(PUSBPCAP_IOCTL_SNAPLEN_TABLE table);
+VOID USBPcapSnaplenBuild(PUSBPCAP_SNAPLEN_LOOKUP lookup,
+                         PUSBPCAP_IOCTL_SNAPLEN_TABLE table,
+                         UINT32 snaplen);
+UINT32 USBPcapSnaplenGet(PUSBPCAP_SNAPLEN_LOOKUP lookup,
+                         USHORT device,
+                         UCHAR endpoint,
+                         UCHAR transfer);
+
+#endif /* USBPCAP_SNAPLEN_H */
@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include "USBPcapStatistics.h"
+
+#define USBPCAP_STATISTICS_TAG  (ULONG)'tatS'
+
+__inline static UINT64
+USBPcapStatisticsLoad(PLARGE_INTEGER value)
+{
+    /* Plain 64-bit read can be torn on x86 */
+    return (UINT64)InterlockedCompareExchange64(&value->QuadPart, 0, 0);
+}
+
+/*
+ * Allocates the counter slots. Must be called at PASSIVE_LEVEL.
+ *
+ * On failure count is set to 0 and nothing gets counted.
+ */
+NTSTATUS USBPcapStatisticsInitialize(PUSBPCAP_STATISTICS stats)
+{
+    ULONG count;
+
+#if (NTDDI_VERSION >= NTDDI_VISTA)
+    count = KeQueryActiveProcessorCount(NULL);
+#else
+    count = (ULONG)KeNumberProcessors;
+#endif
+
+    stats->count = 0;
+    stats->slots = ExAllocatePoolWithTag((POOL_TYPE)(NonPagedPool | CACHE_ALIGNED_POOL_MASK),
+                                         count * sizeof(USBPCAP_STATISTICS_SLOT),
+                                         USBPCAP_STATISTICS_TAG);
+    if (stats->slots == NULL)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(stats->slots, count * sizeof(USBPCAP_STATISTICS_SLOT));
+    stats->count = count;
+
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Frees all memory. To be called only when root hub data is being freed.
+ */
+VOID USBPcapStatisticsFree(PUSBPCAP_STATISTICS stats)
+{
+    if (stats->slots != NULL)
+    {
+        ExFreePool((PVOID)stats->slots);
+        stats->slots = NULL;
+    }
+    stats->count = 0;
+}
+
+/*
+ * Clears all counters. Caller must make sure that no packet is being
+ * stored, i.e. the capture buffer is removed.
+ */
+VOID USBPcapStatisticsReset(PUSBPCAP_STATISTICS stats)
+{
+    if (stats->count > 0)
+    {
+        RtlZeroMemory(stats->slots,
+                      stats->count * sizeof(USBPCAP_STATISTICS_SLOT));
+    }
+}
+
+/*
+ * Sums the counters of all processors. Fills all fields except
+ * bufferSize and pendingReads.
+ */
+VOID USBPcapStatisticsGet(PUSBPCAP_STATISTICS stats,
+                          PUSBPCAP_IOCTL_STATISTICS out)
+{
+    ULONG i;
+
+    out->packetsCaptured = 0;
+    out->packetsDropped = 0;
+    out->bytesDropped = 0;
+    out->packetsEvicted = 0;
+    out->bytesEvicted = 0;
+    out->urbsUnpaired = 0;
+    out->bufferHighWater = 0;
+
+    for (i = 0; i < stats->count; i++)
+    {
+        PUSBPCAP_STATISTICS_SLOT slot = &stats->slots[i];
+        UINT32 highWater;
+
+        out->packetsCaptured += USBPcapStatisticsLoad(&slot->counters.packetsCaptured);
+        out->packetsDropped += USBPcapStatisticsLoad(&slot->counters.packetsDropped);
+        out->bytesDropped += USBPcapStatisticsLoad(&slot->counters.bytesDropped);
+        out->packetsEvicted += USBPcapStatisticsLoad(&slot->counters.packetsEvicted);
+        out->bytesEvicted += USBPcapStatisticsLoad(&slot->counters.bytesEvicted);
+        out->urbsUnpaired += USBPcapStatisticsLoad(&slot->counters.urbsUnpaired);
+
+        highWater = (UINT32)slot->counters.highWater;
+        if (highWater > out->bufferHighWater)
+        {
+            out->bufferHighWater = highWater;
+        }
+    }
+}
+
+__inline static PUSBPCAP_STATISTICS_SLOT
+USBPcapStatisticsGetCurrent(PUSBPCAP_STATISTICS stats)
+{
+    if (stats->count == 0)
+    {
+        return NULL;
+    }
+
+    return &stats->slots[KeGetCurrentProcessorNumber() % stats->count];
+}
+
+/*
+ * Counts stored packet. bufferUsed is the number of bytes in use in the
+ * capture buffer right after the packet was reserved.
+ */
+VOID USBPcapStatisticsPacketCaptured(PUSBPCAP_STATISTICS stats,
+                                     UINT32 bufferUsed)
+{
+    PUSBPCAP_STATISTICS_SLOT slot = USBPcapStatisticsGetCurrent(stats);
+    LONG highWater;
+
+    if (slot == NULL)
+    {
+        return;
+    }
+
+    ExInterlockedAddLargeStatistic(&slot->counters.packetsCaptured, 1);
+
+    do
+    {
+        highWater = slot->counters.highWater;
+        if ((UINT32)highWater >= bufferUsed)
+        {
+            break;
+        }
+    }
+    while (InterlockedCompareExchange(&slot->counters.highWater,
+                                      (LONG)bufferUsed,
+                                      highWater) != highWater);
+}
+
+/*
+ * Counts packet that did not fit into the capture buffer.
+ */
+VOID USBPcapStatisticsPacketDropped(PUSBPCAP_STATISTICS stats,
+                                    UINT32 bytes)
+{
+    PUSBPCAP_STATISTICS_SLOT slot = USBPcapStatisticsGetCurrent(stats);
+
+    if (slot == NULL)
+    {
+        return;
+    }
+
+    ExInterlockedAddLargeStatistic(&slot->counters.packetsDropped, 1);
+    ExInterlockedAddLargeStatistic(&slot->counters.bytesDropped, bytes);
+}
+
+/*
+ * Counts packets evicted from the capture buffer to make space for new one.
+ */
+VOID USBPcapStatisticsPacketsEvicted(PUSBPCAP_STATISTICS stats,
+                                     UINT32 packets,
+                                     UINT32 bytes)
+{
+    PUSBPCAP_STATISTICS_SLOT slot = USBPcapStatisticsGetCurrent(stats);
+
+    if ((slot == NULL) || (packets == 0))
+    {
+        return;
+    }
+
+    ExInterlockedAddLargeStatistic(&slot->counters.packetsEvicted, packets);
+    ExInterlockedAddLargeStatistic(&slot->counters.bytesEvicted, bytes);
+}
+
+/*
+ * Counts URB whose submission could not be stored for completion-only
+ * capture.
+ */
+VOID USBPcapStatisticsURBUnpaired(PUSBPCAP_STATISTICS stats)
+{
+    PUSBPCAP_STATISTICS_SLOT slot = USBPcapStatisticsGetCurrent(stats);
+
+    if (slot == NULL)
+    {
+        return;
+    }
+
+    ExInterlockedAddLargeStatistic(&slot->counters.urbsUnpaired, 1);
+}
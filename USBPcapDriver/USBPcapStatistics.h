@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef USBPCAP_STATISTICS_H
+#define USBPCAP_STATISTICS_H
+
+#include "USBPcapPortable.h"
+#include "include/USBPcap.h"
+
+#define USBPCAP_CACHE_LINE_SIZE  64
+
+/*
+ * Capture counters of single processor.
+ *
+ * Every slot occupies whole cache line so producers running on different
+ * processors never update the same line. Counters are updated with
+ * interlocked operations because more than one thread can run on the same
+ * processor slot (processor number is relative to group).
+ */
+typedef union _USBPCAP_STATISTICS_SLOT
+{
+    struct
+    {
+        LARGE_INTEGER      packetsCaptured;
+        LARGE_INTEGER      packetsDropped;
+        LARGE_INTEGER      bytesDropped;
+        LARGE_INTEGER      packetsEvicted;
+        LARGE_INTEGER      bytesEvicted;
+        LARGE_INTEGER      urbsUnpaired;
+        volatile LONG      highWater;
+    } counters;
+    UCHAR                  padding[USBPCAP_CACHE_LINE_SIZE];
+} USBPCAP_STATISTICS_SLOT, *PUSBPCAP_STATISTICS_SLOT;
+
+typedef struct _USBPCAP_STATISTICS
+{
+    PUSBPCAP_STATISTICS_SLOT  slots;
+    ULONG                     count;
+} USBPCAP_STATISTICS, *PUSBPCAP_STATISTICS;
+
+NTSTATUS USBPcapStatisticsInitialize(PUSBPCAP_STATISTICS stats);
+VOID USBPcapStatisticsFree(PUSBPCAP_STATISTICS stats);
+VOID USBPcapStatisticsReset(PUSBPCAP_STATISTICS stats);
+VOID USBPcapStatisticsGet(PUSBPCAP_STATISTICS stats,
+                          PUSBPCAP_IOCTL_STATISTICS out);
+
+/* To be called at DISPATCH_LEVEL */
+VOID USBPcapStatisticsPacketCaptured(PUSBPCAP_STATISTICS stats,
+                                     UINT32 bufferUsed);
+VOID USBPcapStatisticsPacketDropped(PUSBPCAP_STATISTICS stats,
+                                    UINT32 bytes);
+VOID USBPcapStatisticsPacketsEvicted(PUSBPCAP_STATISTICS stats,
+                                     UINT32 packets,
+                                     UINT32 bytes);
+VOID USBPcapStatisticsURBUnpaired(PUSBPCAP_STATISTICS stats);
+
+#endif /* USBPCAP_STATISTICS_H */
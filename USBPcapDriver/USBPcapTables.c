@@ -4,143 +4,189 @@
  * SPDX-License-Identifier: GPL-2.0
  */
 
-#include "USBPcapMain.h"
 #include "USBPcapTables.h"
 
 #define USBPCAP_TABLE_TAG ' BAT'
 
-typedef struct _USBPCAP_INTERNAL_ENDPOINT_INFO
-{
-    RTL_SPLAY_LINKS        links;
-    LIST_ENTRY             entry;
-    USBPCAP_ENDPOINT_INFO  info;
-} USBPCAP_INTERNAL_ENDPOINT_INFO, *PUSBPCAP_INTERNAL_ENDPOINT_INFO;
+/* log2 of number of slots in endpoint table */
+#define USBPCAP_ENDPOINT_TABLE_BITS   6
+#define USBPCAP_ENDPOINT_TABLE_SLOTS  (1 << USBPCAP_ENDPOINT_TABLE_BITS)
+#define USBPCAP_ENDPOINT_TABLE_MASK   (USBPCAP_ENDPOINT_TABLE_SLOTS - 1)
 
-VOID USBPcapRemoveEndpointInfo(IN PRTL_GENERIC_TABLE table,
-                               IN USBD_PIPE_HANDLE handle)
+/*
+ * Open addressing (linear probing) hash table keyed by pipe handle.
+ *
+ * Device has at most 32 endpoints (16 in each direction) and only the
+ * most recent pipe handle of every endpoint address is kept, so the table
+ * is never more than half full and never has to grow.
+ *
+ * Modifications are serialized by tablesSpinLock. Readers do not take
+ * any lock and do not write to the table: sequence is incremented before
+ * and after every modification and readers retry if it was odd or has
+ * changed during the lookup.
+ */
+struct _USBPCAP_ENDPOINT_TABLE
 {
-    USBPCAP_INTERNAL_ENDPOINT_INFO  info;
-    BOOLEAN                         deleted;
-
-    info.info.handle = handle;
+    volatile LONG          sequence;
+    USBPCAP_ENDPOINT_INFO  slots[USBPCAP_ENDPOINT_TABLE_SLOTS]; /* handle NULL if empty */
+};
 
-    deleted = RtlDeleteElementGenericTable(table, &info);
+__inline static ULONG
+USBPcapEndpointTableHash(USBD_PIPE_HANDLE handle)
+{
+    UINT64 key = (UINT64)(ULONG_PTR)handle;
+    ULONG  folded;
 
-    if (deleted == TRUE)
-    {
-        DkDbgVal("Successfully removed", handle);
-    }
-    else
-    {
-        DkDbgVal("Failed to remove", handle);
-    }
+    /* Pipe handles are pool allocations, lowest bits are always zero */
+    folded = (ULONG)(key >> 4) ^ (ULONG)(key >> 32);
+    return ((ULONG)(folded * 2654435761UL)) >> (32 - USBPCAP_ENDPOINT_TABLE_BITS);
 }
 
-VOID USBPcapAddEndpointInfo(IN PRTL_GENERIC_TABLE table,
-                            IN PUSBD_PIPE_INFORMATION pipeInfo,
-                            IN USHORT deviceAddress)
+/*
+ * Returns slot index of handle, USBPCAP_ENDPOINT_TABLE_SLOTS if not found.
+ * Number of probes is bounded, so it is safe to call while the table is
+ * being modified.
+ */
+static ULONG
+USBPcapEndpointTableFind(IN PUSBPCAP_ENDPOINT_TABLE table,
+                         IN USBD_PIPE_HANDLE handle)
 {
-    USBPCAP_INTERNAL_ENDPOINT_INFO  info;
-    BOOLEAN                         new;
-    PUSBPCAP_INTERNAL_ENDPOINT_INFO pInfo;
-
-    info.info.handle          = pipeInfo->PipeHandle;
-    info.info.type            = pipeInfo->PipeType;
-    info.info.endpointAddress = pipeInfo->EndpointAddress;
-    info.info.deviceAddress   = deviceAddress;
-
-    pInfo = RtlInsertElementGenericTable(table,
-                                 (PVOID)&info,
-                                 sizeof(USBPCAP_INTERNAL_ENDPOINT_INFO),
-                                 &new);
+    ULONG i = USBPcapEndpointTableHash(handle);
+    ULONG probes;
 
-    if ((new == FALSE) && (pInfo != NULL))
+    for (probes = 0; probes < USBPCAP_ENDPOINT_TABLE_SLOTS; probes++)
     {
-        DkDbgStr("Element already exists in table, updating entry");
-        pInfo->info.type            = pipeInfo->PipeType;
-        pInfo->info.endpointAddress = pipeInfo->EndpointAddress;
-        pInfo->info.deviceAddress   = deviceAddress;
+        USBD_PIPE_HANDLE slotHandle = table->slots[i].handle;
+
+        if (slotHandle == handle)
+        {
+            return i;
+        }
+        if (slotHandle == NULL)
+        {
+            break;
+        }
+        i = (i + 1) & USBPCAP_ENDPOINT_TABLE_MASK;
     }
+
+    return USBPCAP_ENDPOINT_TABLE_SLOTS;
 }
 
 /*
- * Retrieves the USBPCAP_ENDPOINT_INFO information from endpoint table.
- *
- * Returns NULL when no such endpoint information was found
+ * Empties slot i and moves following entries back so that every entry
+ * stays reachable from its home slot.
  */
-PUSBPCAP_ENDPOINT_INFO USBPcapGetEndpointInfo(IN PRTL_GENERIC_TABLE table,
-                                              IN USBD_PIPE_HANDLE handle)
+static VOID
+USBPcapEndpointTableDelete(IN PUSBPCAP_ENDPOINT_TABLE table,
+                           IN ULONG i)
 {
-    PUSBPCAP_INTERNAL_ENDPOINT_INFO pInfo;
-    USBPCAP_INTERNAL_ENDPOINT_INFO  info;
+    ULONG j = i;
 
-    info.info.handle = handle;
-
-    pInfo = RtlLookupElementGenericTable(table, &info);
-
-    if (pInfo == NULL)
+    for (;;)
     {
-        return NULL;
+        ULONG home;
+
+        j = (j + 1) & USBPCAP_ENDPOINT_TABLE_MASK;
+        if (table->slots[j].handle == NULL)
+        {
+            break;
+        }
+
+        /* Entry at j can be moved to i only if its home slot is not
+         * cyclically within (i, j]
+         */
+        home = USBPcapEndpointTableHash(table->slots[j].handle);
+        if ((i <= j) ? ((home <= i) || (home > j)) : ((home <= i) && (home > j)))
+        {
+            table->slots[i] = table->slots[j];
+            i = j;
+        }
     }
 
-    return &pInfo->info;
+    table->slots[i].handle = NULL;
 }
 
-RTL_GENERIC_FREE_ROUTINE USBPcapFreeRoutine;
-static VOID
-USBPcapFreeRoutine(IN PRTL_GENERIC_TABLE table,
-                   IN PVOID buffer)
+__inline static VOID
+USBPcapEndpointTableBeginWrite(IN PUSBPCAP_ENDPOINT_TABLE table)
 {
-    ExFreePool(buffer);
+    /* Interlocked operations are full memory barriers */
+    InterlockedIncrement(&table->sequence);
 }
 
-RTL_GENERIC_ALLOCATE_ROUTINE USBPcapAllocateRoutine;
-static PVOID
-USBPcapAllocateRoutine(IN PRTL_GENERIC_TABLE table,
-                       IN CLONG size)
+__inline static VOID
+USBPcapEndpointTableEndWrite(IN PUSBPCAP_ENDPOINT_TABLE table)
 {
-    return ExAllocatePoolWithTag(NonPagedPool,
-                                 size,
-                                 USBPCAP_TABLE_TAG);
+    InterlockedIncrement(&table->sequence);
 }
 
-RTL_GENERIC_COMPARE_ROUTINE USBPcapCompareEndpointInfo;
-static RTL_GENERIC_COMPARE_RESULTS
-USBPcapCompareEndpointInfo(IN PRTL_GENERIC_TABLE table,
-                           IN PVOID first,
-                           IN PVOID second)
+/*
+ * Removes endpoint information. Caller must hold tablesSpinLock.
+ */
+VOID USBPcapRemoveEndpointInfo(IN PUSBPCAP_ENDPOINT_TABLE table,
+                               IN USBD_PIPE_HANDLE handle)
 {
-    PUSBPCAP_INTERNAL_ENDPOINT_INFO left = first;
-    PUSBPCAP_INTERNAL_ENDPOINT_INFO right = second;
+    ULONG i;
 
-    if (left->info.handle < right->info.handle)
+    i = USBPcapEndpointTableFind(table, handle);
+    if (i == USBPCAP_ENDPOINT_TABLE_SLOTS)
     {
-        return GenericLessThan;
+        DkDbgVal("Failed to remove", handle);
+        return;
     }
-    else if (left->info.handle == right->info.handle)
+
+    USBPcapEndpointTableBeginWrite(table);
+    USBPcapEndpointTableDelete(table, i);
+    USBPcapEndpointTableEndWrite(table);
+
+    DkDbgVal("Successfully removed", handle);
+}
+
+/*
+ * Adds endpoint information. Replaces previous pipe handle of the same
+ * endpoint, if any. Caller must hold tablesSpinLock.
+ */
+VOID USBPcapAddEndpointInfo(IN PUSBPCAP_ENDPOINT_TABLE table,
+                            IN PUSBD_PIPE_INFORMATION pipeInfo,
+                            IN USHORT deviceAddress)
+{
+    ULONG i;
+
+    USBPcapEndpointTableBeginWrite(table);
+
+    /* Old pipe handles become invalid when the endpoint is configured
+     * again (select configuration or interface).
+     */
+    for (i = 0; i < USBPCAP_ENDPOINT_TABLE_SLOTS; i++)
     {
-        return GenericEqual;
+        while ((table->slots[i].handle != NULL) &&
+               ((table->slots[i].handle == pipeInfo->PipeHandle) ||
+                (table->slots[i].endpointAddress == pipeInfo->EndpointAddress)))
+        {
+            DkDbgVal("Replacing endpoint entry", table->slots[i].handle);
+            /* Following entry can be moved here, check the slot again */
+            USBPcapEndpointTableDelete(table, i);
+        }
     }
-    else
+
+    i = USBPcapEndpointTableHash(pipeInfo->PipeHandle);
+    while (table->slots[i].handle != NULL)
     {
-        return GenericGreaterThan;
+        i = (i + 1) & USBPCAP_ENDPOINT_TABLE_MASK;
     }
+
+    table->slots[i].type            = pipeInfo->PipeType;
+    table->slots[i].endpointAddress = pipeInfo->EndpointAddress;
+    table->slots[i].deviceAddress   = deviceAddress;
+    table->slots[i].handle          = pipeInfo->PipeHandle;
+
+    USBPcapEndpointTableEndWrite(table);
 }
 
-VOID USBPcapFreeEndpointTable(IN PRTL_GENERIC_TABLE table)
+VOID USBPcapFreeEndpointTable(IN PUSBPCAP_ENDPOINT_TABLE table)
 {
-    PVOID element;
-
     DkDbgStr("Free endpoint data");
 
-    /* Delete all the elements from table */
-    while (NULL != (element = RtlGetElementGenericTable(table, 0)))
-    {
-        RtlDeleteElementGenericTable(table, element);
-    }
-
-    /* Delete table structure */
-    ExFreePool(table);
+    ExFreePool((PVOID)table);
 }
 
 /*
@@ -149,15 +195,15 @@ VOID USBPcapFreeEndpointTable(IN PRTL_GENERIC_TABLE table)
  *
  * Returned table must be freed using USBPcapFreeEndpointTable()
  */
-PRTL_GENERIC_TABLE USBPcapInitializeEndpointTable(IN PVOID context)
+PUSBPCAP_ENDPOINT_TABLE USBPcapInitializeEndpointTable(VOID)
 {
-    PRTL_GENERIC_TABLE table;
+    PUSBPCAP_ENDPOINT_TABLE table;
 
     DkDbgStr("Initialize endpoint table");
 
-    table = (PRTL_GENERIC_TABLE)
+    table = (PUSBPCAP_ENDPOINT_TABLE)
                 ExAllocatePoolWithTag(NonPagedPool,
-                                      sizeof(RTL_GENERIC_TABLE),
+                                      sizeof(USBPCAP_ENDPOINT_TABLE),
                                       USBPCAP_TABLE_TAG);
 
     if (table == NULL)
@@ -166,31 +212,43 @@ PRTL_GENERIC_TABLE USBPcapInitializeEndpointTable(IN PVOID context)
         return table;
     }
 
-    RtlInitializeGenericTable(table,
-                              USBPcapCompareEndpointInfo,
-                              USBPcapAllocateRoutine,
-                              USBPcapFreeRoutine,
-                              context);
+    RtlZeroMemory(table, sizeof(USBPCAP_ENDPOINT_TABLE));
 
     return table;
 }
 
-BOOLEAN USBPcapRetrieveEndpointInfo(IN PUSBPCAP_DEVICE_DATA pDeviceData,
+BOOLEAN USBPcapRetrieveEndpointInfo(IN PUSBPCAP_ENDPOINT_TABLE table,
                                     IN USBD_PIPE_HANDLE handle,
                                     PUSBPCAP_ENDPOINT_INFO pInfo)
 {
-    KIRQL irql;
-    PUSBPCAP_ENDPOINT_INFO info;
+    LONG sequence;
+    ULONG i;
     BOOLEAN found = FALSE;
 
-    KeAcquireSpinLock(&pDeviceData->tablesSpinLock, &irql);
-    info = USBPcapGetEndpointInfo(pDeviceData->endpointTable, handle);
-    if (info != NULL)
+    if ((table != NULL) && (handle != NULL))
     {
-        found = TRUE;
-        memcpy(pInfo, info, sizeof(USBPCAP_ENDPOINT_INFO));
+        do
+        {
+            sequence = table->sequence;
+            if (sequence & 1)
+            {
+                /* Writer is active */
+                YieldProcessor();
+                continue;
+            }
+            KeMemoryBarrier();
+
+            i = USBPcapEndpointTableFind(table, handle);
+            found = (i < USBPCAP_ENDPOINT_TABLE_SLOTS) ? TRUE : FALSE;
+            if (found == TRUE)
+            {
+                memcpy(pInfo, &table->slots[i], sizeof(USBPCAP_ENDPOINT_INFO));
+            }
+
+            KeMemoryBarrier();
+        }
+        while ((sequence & 1) || (sequence != table->sequence));
     }
-    KeReleaseSpinLock(&pDeviceData->tablesSpinLock, irql);
 
     if (found == TRUE)
     {
@@ -208,116 +266,200 @@ BOOLEAN USBPcapRetrieveEndpointInfo(IN PUSBPCAP_DEVICE_DATA pDeviceData,
 }
 
 
-typedef struct _USBPCAP_INTERNAL_URB_IRP_INFO
+/* Maximum distance of entry from its home slot */
+#define USBPCAP_URB_IRP_TABLE_PROBES  8
+
+/* Key of slot that is being filled */
+#define USBPCAP_URB_IRP_SLOT_BUSY     ((PIRP)(ULONG_PTR)1)
+
+typedef struct _USBPCAP_URB_IRP_SLOT
 {
-    RTL_SPLAY_LINKS        links;
-    LIST_ENTRY             entry;
+    PIRP volatile          key; /* NULL if slot is free */
     USBPCAP_URB_IRP_INFO   info;
-} USBPCAP_INTERNAL_URB_IRP_INFO, *PUSBPCAP_INTERNAL_URB_IRP_INFO;
+} USBPCAP_URB_IRP_SLOT, *PUSBPCAP_URB_IRP_SLOT;
 
-VOID USBPcapRemoveURBIRPInfo(IN PRTL_GENERIC_TABLE table,
-                             IN PIRP irp)
+typedef struct _USBPCAP_URB_IRP_OVERFLOW
 {
-    USBPCAP_INTERNAL_URB_IRP_INFO   info;
-    BOOLEAN                         deleted;
-
-    info.info.irp = irp;
+    struct _USBPCAP_URB_IRP_OVERFLOW *next;
+    USBPCAP_URB_IRP_INFO   info;
+} USBPCAP_URB_IRP_OVERFLOW, *PUSBPCAP_URB_IRP_OVERFLOW;
 
-    deleted = RtlDeleteElementGenericTable(table, &info);
+/*
+ * Lock-free hash table of IRPs with unknown URB function in flight.
+ *
+ * Slot is claimed by changing its key from NULL to busy marker, then the
+ * info is filled and finally the key is set to the IRP. Entry is removed
+ * by changing the key from IRP back to NULL. Every entry is stored at
+ * most USBPCAP_URB_IRP_TABLE_PROBES slots from its home slot, so lookup
+ * does not have to stop at free slots (and no tombstones are needed).
+ *
+ * Entries that do not fit near their home slot go to the overflow list.
+ * The list is protected by overflowLock and is searched only when
+ * overflowCount is not zero, so it costs nothing until there are many
+ * IRPs in flight.
+ *
+ * Number of slots is fixed when the table is created and should be
+ * large enough for all IRPs the table is expected to hold at once.
+ *
+ * Table is almost always empty, count allows to skip the lookup.
+ */
+struct _USBPCAP_URB_IRP_TABLE
+{
+    volatile LONG          count;
+    volatile LONG          overflowCount;
+    KSPIN_LOCK             overflowLock;
+    PUSBPCAP_URB_IRP_OVERFLOW overflow;
+    ULONG                  bits;  /* log2 of number of slots */
+    ULONG                  mask;  /* Number of slots - 1 */
+    USBPCAP_URB_IRP_SLOT   slots[1];
+};
+
+__inline static ULONG
+USBPcapURBIRPTableHash(IN PUSBPCAP_URB_IRP_TABLE table,
+                       IN PIRP irp)
+{
+    UINT64 key = (UINT64)(ULONG_PTR)irp;
+    ULONG  folded;
 
-    if (deleted == TRUE)
-    {
-        DkDbgVal("Successfully removed irp from table", irp);
-    }
+    /* IRPs are pool allocations, lowest bits are always zero */
+    folded = (ULONG)(key >> 4) ^ (ULONG)(key >> 32);
+    return ((ULONG)(folded * 2654435761UL)) >> (32 - table->bits);
 }
 
-VOID USBPcapAddURBIRPInfo(IN PRTL_GENERIC_TABLE table,
-                          IN PUSBPCAP_URB_IRP_INFO irpinfo)
+/*
+ * Adds URB IRP info to table. Can be called concurrently with any
+ * other table operation.
+ *
+ * If there is no free slot near the home slot the info is stored in the
+ * overflow list. Returns FALSE only if the overflow entry could not be
+ * allocated, the completion will then be reported without the submit
+ * information.
+ */
+BOOLEAN USBPcapAddURBIRPInfo(IN PUSBPCAP_URB_IRP_TABLE table,
+                             IN PUSBPCAP_URB_IRP_INFO irpinfo)
 {
-    USBPCAP_INTERNAL_URB_IRP_INFO   info;
-    BOOLEAN                         new;
-
-    info.info = *irpinfo;
-
-    RtlInsertElementGenericTable(table,
-                                 (PVOID)&info,
-                                 sizeof(USBPCAP_INTERNAL_URB_IRP_INFO),
-                                 &new);
+    ULONG i = USBPcapURBIRPTableHash(table, irpinfo->irp);
+    ULONG probes;
+    PUSBPCAP_URB_IRP_OVERFLOW overflow;
+    KIRQL irql;
 
-    if (new == FALSE)
+    for (probes = 0; probes < USBPCAP_URB_IRP_TABLE_PROBES; probes++)
     {
-        DkDbgVal("Element already exists in table", irpinfo->irp);
+        PUSBPCAP_URB_IRP_SLOT slot = &table->slots[i];
+
+        if ((slot->key == NULL) &&
+            (InterlockedCompareExchangePointer((PVOID volatile *)&slot->key,
+                                               USBPCAP_URB_IRP_SLOT_BUSY,
+                                               NULL) == NULL))
+        {
+            slot->info = *irpinfo;
+            InterlockedIncrement(&table->count);
+            /* Publish the info, interlocked exchange is a full barrier */
+            InterlockedExchangePointer((PVOID volatile *)&slot->key,
+                                       irpinfo->irp);
+            return TRUE;
+        }
+
+        i = (i + 1) & table->mask;
     }
-}
 
-static PUSBPCAP_URB_IRP_INFO
-USBPcapGetURBIRPInfo(IN PRTL_GENERIC_TABLE table,
-                     IN PIRP irp)
-{
-    PUSBPCAP_INTERNAL_URB_IRP_INFO  pInfo;
-    USBPCAP_INTERNAL_URB_IRP_INFO   info;
+    DkDbgVal("URB irp table full", irpinfo->irp);
 
-    info.info.irp = irp;
-
-    pInfo = RtlLookupElementGenericTable(table, &info);
-
-    if (pInfo == NULL)
+    overflow = (PUSBPCAP_URB_IRP_OVERFLOW)
+                   ExAllocatePoolWithTag(NonPagedPool,
+                                         sizeof(USBPCAP_URB_IRP_OVERFLOW),
+                                         USBPCAP_TABLE_TAG);
+    if (overflow == NULL)
     {
-        return NULL;
+        DkDbgStr("Unable to allocate URB irp overflow entry");
+        return FALSE;
     }
 
-    return &pInfo->info;
+    overflow->info = *irpinfo;
+    KeAcquireSpinLock(&table->overflowLock, &irql);
+    overflow->next = table->overflow;
+    table->overflow = overflow;
+    InterlockedIncrement(&table->overflowCount);
+    InterlockedIncrement(&table->count);
+    KeReleaseSpinLock(&table->overflowLock, irql);
+    return TRUE;
 }
 
-VOID USBPcapFreeURBIRPInfoTable(IN PRTL_GENERIC_TABLE table)
+/*
+ * Removes irp from the overflow list. Returns TRUE if irp was found.
+ */
+static BOOLEAN
+USBPcapObtainURBIRPOverflow(IN PUSBPCAP_URB_IRP_TABLE table,
+                            IN PIRP irp,
+                            PUSBPCAP_URB_IRP_INFO pInfo)
 {
-    PVOID element;
+    PUSBPCAP_URB_IRP_OVERFLOW *link;
+    PUSBPCAP_URB_IRP_OVERFLOW found = NULL;
+    KIRQL irql;
 
-    DkDbgStr("Free URB irp data");
+    KeAcquireSpinLock(&table->overflowLock, &irql);
+    for (link = &table->overflow; *link != NULL; link = &(*link)->next)
+    {
+        if ((*link)->info.irp == irp)
+        {
+            found = *link;
+            *link = found->next;
+            InterlockedDecrement(&table->overflowCount);
+            InterlockedDecrement(&table->count);
+            break;
+        }
+    }
+    KeReleaseSpinLock(&table->overflowLock, irql);
 
-    /* Delete all the elements from table */
-    while (NULL != (element = RtlGetElementGenericTable(table, 0)))
+    if (found == NULL)
     {
-        RtlDeleteElementGenericTable(table, element);
+        return FALSE;
     }
 
-    /* Delete table structure */
-    ExFreePool(table);
+    memcpy(pInfo, &found->info, sizeof(USBPCAP_URB_IRP_INFO));
+    ExFreePool((PVOID)found);
+
+    DkDbgVal("Found URB irp info in overflow list", irp);
+    return TRUE;
 }
 
-RTL_GENERIC_COMPARE_ROUTINE USBPcapCompareURBIRPInfo;
-static RTL_GENERIC_COMPARE_RESULTS
-USBPcapCompareURBIRPInfo(IN PRTL_GENERIC_TABLE table,
-                         IN PVOID first,
-                         IN PVOID second)
+VOID USBPcapFreeURBIRPInfoTable(IN PUSBPCAP_URB_IRP_TABLE table)
 {
-    PUSBPCAP_INTERNAL_URB_IRP_INFO left = first;
-    PUSBPCAP_INTERNAL_URB_IRP_INFO right = second;
+    DkDbgStr("Free URB irp data");
 
-    if (left->info.irp < right->info.irp)
+    while (table->overflow != NULL)
     {
-        return GenericLessThan;
-    }
-    else if (left->info.irp == right->info.irp)
-    {
-        return GenericEqual;
-    }
-    else
-    {
-        return GenericGreaterThan;
+        PUSBPCAP_URB_IRP_OVERFLOW next = table->overflow->next;
+
+        ExFreePool((PVOID)table->overflow);
+        table->overflow = next;
     }
+
+    ExFreePool((PVOID)table);
 }
 
-PRTL_GENERIC_TABLE USBPcapInitializeURBIRPInfoTable(IN PVOID context)
+/*
+ * Creates URB IRP table with at least slots slots (rounded up to power
+ * of two, at least USBPCAP_URB_IRP_TABLE_PROBES).
+ */
+PUSBPCAP_URB_IRP_TABLE USBPcapInitializeURBIRPInfoTable(IN ULONG slots)
 {
-    PRTL_GENERIC_TABLE table;
+    PUSBPCAP_URB_IRP_TABLE table;
+    ULONG                  bits;
+    SIZE_T                 size;
 
     DkDbgStr("Initialize URB irp table");
 
-    table = (PRTL_GENERIC_TABLE)
-                ExAllocatePoolWithTag(NonPagedPool,
-                                      sizeof(RTL_GENERIC_TABLE),
-                                      USBPCAP_TABLE_TAG);
+    bits = 3;
+    while (((1UL << bits) < slots) && (bits < 16))
+    {
+        bits++;
+    }
+
+    size = FIELD_OFFSET(USBPCAP_URB_IRP_TABLE, slots) +
+           ((SIZE_T)1 << bits) * sizeof(USBPCAP_URB_IRP_SLOT);
+    table = (PUSBPCAP_URB_IRP_TABLE)
+                ExAllocatePoolWithTag(NonPagedPool, size, USBPCAP_TABLE_TAG);
 
     if (table == NULL)
     {
@@ -325,11 +467,10 @@ PRTL_GENERIC_TABLE USBPcapInitializeURBIRPInfoTable(IN PVOID context)
         return table;
     }
 
-    RtlInitializeGenericTable(table,
-                              USBPcapCompareURBIRPInfo,
-                              USBPcapAllocateRoutine,
-                              USBPcapFreeRoutine,
-                              context);
+    RtlZeroMemory(table, size);
+    KeInitializeSpinLock(&table->overflowLock);
+    table->bits = bits;
+    table->mask = (1UL << bits) - 1;
 
     return table;
 }
@@ -340,29 +481,43 @@ PRTL_GENERIC_TABLE USBPcapInitializeURBIRPInfoTable(IN PVOID context)
  *
  * Returns TRUE if irp was found in table, FALSE otherwise.
  */
-BOOLEAN USBPcapObtainURBIRPInfo(IN PUSBPCAP_DEVICE_DATA pDeviceData,
+BOOLEAN USBPcapObtainURBIRPInfo(IN PUSBPCAP_URB_IRP_TABLE table,
                                 IN PIRP irp,
                                 PUSBPCAP_URB_IRP_INFO pInfo)
 {
-    KIRQL irql;
-    PUSBPCAP_URB_IRP_INFO info;
-    BOOLEAN found = FALSE;
+    ULONG i;
+    ULONG probes;
 
-    KeAcquireSpinLock(&pDeviceData->tablesSpinLock, &irql);
-    info = USBPcapGetURBIRPInfo(pDeviceData->URBIrpTable, irp);
-    if (info != NULL)
+    if ((table == NULL) || (table->count == 0))
     {
-        found = TRUE;
-        memcpy(pInfo, info, sizeof(USBPCAP_URB_IRP_INFO));
-        USBPcapRemoveURBIRPInfo(pDeviceData->URBIrpTable, irp);
+        return FALSE;
     }
-    KeReleaseSpinLock(&pDeviceData->tablesSpinLock, irql);
 
-    if (found == TRUE)
+    i = USBPcapURBIRPTableHash(table, irp);
+    for (probes = 0; probes < USBPCAP_URB_IRP_TABLE_PROBES; probes++)
     {
-        DkDbgVal("Found URB irp info", irp);
-        DkDbgVal("", pInfo->function);
+        PUSBPCAP_URB_IRP_SLOT slot = &table->slots[i];
+
+        /* Only the completion of this IRP can free the slot */
+        if (slot->key == irp)
+        {
+            KeMemoryBarrier();
+            memcpy(pInfo, &slot->info, sizeof(USBPCAP_URB_IRP_INFO));
+            InterlockedDecrement(&table->count);
+            InterlockedExchangePointer((PVOID volatile *)&slot->key, NULL);
+
+            DkDbgVal("Found URB irp info", irp);
+            DkDbgVal("", pInfo->function);
+            return TRUE;
+        }
+
+        i = (i + 1) & table->mask;
     }
 
-    return found;
+    if (table->overflowCount != 0)
+    {
+        return USBPcapObtainURBIRPOverflow(table, irp, pInfo);
+    }
+
+    return FALSE;
 }
@@ -7,7 +7,8 @@
 #ifndef USBPCAP_TABLES_H
 #define USBPCAP_TABLES_H
 
-#include "USBPcapMain.h"
+#include "USBPcapPortable.h"
+#include "Usbdi.h"
 
 typedef struct _USBPCAP_ENDPOINT_INFO
 {
@@ -18,20 +19,19 @@ typedef struct _USBPCAP_ENDPOINT_INFO
     USHORT            deviceAddress;
 } USBPCAP_ENDPOINT_INFO, *PUSBPCAP_ENDPOINT_INFO;
 
-VOID USBPcapRemoveEndpointInfo(IN PRTL_GENERIC_TABLE table,
+typedef struct _USBPCAP_ENDPOINT_TABLE USBPCAP_ENDPOINT_TABLE, *PUSBPCAP_ENDPOINT_TABLE;
+
+VOID USBPcapRemoveEndpointInfo(IN PUSBPCAP_ENDPOINT_TABLE table,
                                IN USBD_PIPE_HANDLE handle);
-VOID USBPcapAddEndpointInfo(IN PRTL_GENERIC_TABLE table,
+VOID USBPcapAddEndpointInfo(IN PUSBPCAP_ENDPOINT_TABLE table,
                             IN PUSBD_PIPE_INFORMATION pipeInfo,
                             IN USHORT deviceAddress);
 
-PUSBPCAP_ENDPOINT_INFO USBPcapGetEndpointInfo(IN PRTL_GENERIC_TABLE table,
-                                              IN USBD_PIPE_HANDLE handle);
-
-VOID USBPcapFreeEndpointTable(IN PRTL_GENERIC_TABLE table);
-PRTL_GENERIC_TABLE USBPcapInitializeEndpointTable(IN PVOID context);
+VOID USBPcapFreeEndpointTable(IN PUSBPCAP_ENDPOINT_TABLE table);
+PUSBPCAP_ENDPOINT_TABLE USBPcapInitializeEndpointTable(VOID);
 
 
-BOOLEAN USBPcapRetrieveEndpointInfo(IN PUSBPCAP_DEVICE_DATA pDeviceData,
+BOOLEAN USBPcapRetrieveEndpointInfo(IN PUSBPCAP_ENDPOINT_TABLE table,
                                     IN USBD_PIPE_HANDLE handle,
                                     PUSBPCAP_ENDPOINT_INFO pInfo);
 
@@ -46,17 +46,27 @@ typedef struct _USBPCAP_URB_IRP_INFO
     UCHAR         info;      /* I/O Request info */
     USHORT        bus;       /* bus (RootHub) number */
     USHORT        device;    /* device address */
+    UCHAR         endpoint;  /* endpoint address (latency measurement) */
+    UCHAR         transfer;  /* transfer type (latency measurement) */
 } USBPCAP_URB_IRP_INFO, *PUSBPCAP_URB_IRP_INFO;
 
-VOID USBPcapRemoveURBIRPInfo(IN PRTL_GENERIC_TABLE table,
-                             IN PIRP irp);
-VOID USBPcapAddURBIRPInfo(IN PRTL_GENERIC_TABLE table,
-                          IN PUSBPCAP_URB_IRP_INFO irpinfo);
+typedef struct _USBPCAP_URB_IRP_TABLE USBPCAP_URB_IRP_TABLE, *PUSBPCAP_URB_IRP_TABLE;
+
+/* IRPs with unknown URB function in flight are rare */
+#define USBPCAP_URB_IRP_TABLE_SLOTS   64
+/* Submissions waiting for completion: completion-only capture and latency
+ * measurement pair every bulk, interrupt and isochronous URB, and devices
+ * streaming data keep many of them queued on every endpoint.
+ */
+#define USBPCAP_SUBMIT_TABLE_SLOTS    256
+
+BOOLEAN USBPcapAddURBIRPInfo(IN PUSBPCAP_URB_IRP_TABLE table,
+                             IN PUSBPCAP_URB_IRP_INFO irpinfo);
 
-VOID USBPcapFreeURBIRPInfoTable(IN PRTL_GENERIC_TABLE table);
-PRTL_GENERIC_TABLE USBPcapInitializeURBIRPInfoTable(IN PVOID context);
+VOID USBPcapFreeURBIRPInfoTable(IN PUSBPCAP_URB_IRP_TABLE table);
+PUSBPCAP_URB_IRP_TABLE USBPcapInitializeURBIRPInfoTable(IN ULONG slots);
 
-BOOLEAN USBPcapObtainURBIRPInfo(IN PUSBPCAP_DEVICE_DATA pDeviceData,
+BOOLEAN USBPcapObtainURBIRPInfo(IN PUSBPCAP_URB_IRP_TABLE table,
                                 IN PIRP irp,
                                 PUSBPCAP_URB_IRP_INFO pInfo);
 
@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include "USBPcapTrigger.h"
+
+#define USBPCAP_TRIGGER_SUPPORTED_FLAGS  (USBPCAP_TRIGGER_FLAG_DEVICE | \
+                                          USBPCAP_TRIGGER_FLAG_ENDPOINT)
+
+/* Length of USB SETUP data */
+#define USBPCAP_TRIGGER_SETUP_LENGTH  8
+
+/*
+ * Checks that trigger type and flags are known and pattern fits the
+ * trigger type.
+ */
+BOOLEAN USBPcapTriggerValidate(PUSBPCAP_IOCTL_TRIGGER trigger)
+{
+    if ((trigger->flags & ~USBPCAP_TRIGGER_SUPPORTED_FLAGS) ||
+        (trigger->length > USBPCAP_TRIGGER_MAX_PATTERN))
+    {
+        return FALSE;
+    }
+
+    /* Trigger packet itself is counted together with postCount */
+    if (trigger->postCount >= MAXLONG)
+    {
+        return FALSE;
+    }
+
+    switch (trigger->type)
+    {
+        case USBPCAP_TRIGGER_NONE:
+        case USBPCAP_TRIGGER_STATUS:
+        case USBPCAP_TRIGGER_STALL:
+            return (trigger->length == 0) ? TRUE : FALSE;
+        case USBPCAP_TRIGGER_SETUP:
+            return ((trigger->length <= USBPCAP_TRIGGER_SETUP_LENGTH) &&
+                    (trigger->offset == 0)) ? TRUE : FALSE;
+        case USBPCAP_TRIGGER_PAYLOAD:
+            return ((trigger->length > 0) &&
+                    (trigger->offset <= MAXULONG - trigger->length)) ? TRUE : FALSE;
+        default:
+            return FALSE;
+    }
+}
+
+/*
+ * Compares trigger pattern with payload bytes starting at trigger offset.
+ */
+static BOOLEAN
+USBPcapTriggerMatchPattern(PUSBPCAP_IOCTL_TRIGGER trigger,
+                           PUSBPCAP_FILTER_PACKET packet)
+{
+    PUSBPCAP_PAYLOAD_ENTRY  segment = packet->payload;
+    UINT32                  offset = trigger->offset;
+    UINT32                  i;
+
+    if ((UINT64)offset + trigger->length > (UINT64)packet->header->dataLength)
+    {
+        return FALSE;
+    }
+
+    for (i = 0; i < trigger->length; i++)
+    {
+        /* Move to segment holding the byte */
+        while ((segment->buffer != NULL) && (offset >= segment->size))
+        {
+            offset -= segment->size;
+            segment++;
+        }
+
+        if (segment->buffer == NULL)
+        {
+            return FALSE;
+        }
+
+        if ((((PUCHAR)segment->buffer)[offset] ^ trigger->pattern[i]) &
+            trigger->mask[i])
+        {
+            return FALSE;
+        }
+        offset++;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Returns TRUE if packet fires validated trigger.
+ */
+BOOLEAN USBPcapTriggerMatch(PUSBPCAP_IOCTL_TRIGGER trigger,
+                            PUSBPCAP_FILTER_PACKET packet)
+{
+    PUSBPCAP_BUFFER_PACKET_HEADER header = packet->header;
+    BOOLEAN                       completed;
+
+    if ((trigger->flags & USBPCAP_TRIGGER_FLAG_DEVICE) &&
+        (header->device != trigger->device))
+    {
+        return FALSE;
+    }
+
+    if ((trigger->flags & USBPCAP_TRIGGER_FLAG_ENDPOINT) &&
+        (header->endpoint != trigger->endpoint))
+    {
+        return FALSE;
+    }
+
+    /* Status is valid only on completion */
+    completed = (header->info & USBPCAP_INFO_PDO_TO_FDO) ? TRUE : FALSE;
+
+    switch (trigger->type)
+    {
+        case USBPCAP_TRIGGER_STATUS:
+            return (completed &&
+                    (header->status == (USBD_STATUS)trigger->status)) ? TRUE : FALSE;
+
+        case USBPCAP_TRIGGER_STALL:
+            return (completed &&
+                    ((header->status == USBD_STATUS_STALL_PID) ||
+                     (header->status == USBD_STATUS_ENDPOINT_HALTED))) ? TRUE : FALSE;
+
+        case USBPCAP_TRIGGER_SETUP:
+            /* SETUP data is at the start of SETUP stage payload */
+            if ((header->transfer != USBPCAP_TRANSFER_CONTROL) ||
+                (header->headerLen < sizeof(USBPCAP_BUFFER_CONTROL_HEADER)) ||
+                (((PUSBPCAP_BUFFER_CONTROL_HEADER)header)->stage !=
+                 USBPCAP_CONTROL_STAGE_SETUP) ||
+                (header->dataLength < USBPCAP_TRIGGER_SETUP_LENGTH))
+            {
+                return FALSE;
+            }
+            return USBPcapTriggerMatchPattern(trigger, packet);
+
+        case USBPCAP_TRIGGER_PAYLOAD:
+            return USBPcapTriggerMatchPattern(trigger, packet);
+
+        default:
+            return FALSE;
+    }
+}
+
+/*
+ * Starts waiting for the trigger. Caller must make sure there are no
+ * producers.
+ */
+VOID USBPcapTriggerRearm(PUSBPCAP_TRIGGER_PROGRESS progress,
+                         PUSBPCAP_IOCTL_TRIGGER trigger)
+{
+    InterlockedExchange(&progress->state, USBPCAP_TRIGGER_STATE_WAITING);
+    InterlockedExchange(&progress->remaining, (LONG)trigger->postCount + 1);
+}
+
+LONG USBPcapTriggerGetState(PUSBPCAP_TRIGGER_PROGRESS progress)
+{
+    return progress->state;
+}
+
+/*
+ * To be called before packet is stored. Fires the trigger if the packet
+ * matches it.
+ *
+ * Returns FALSE if the capture has stopped and packet must not be stored.
+ */
+BOOLEAN USBPcapTriggerCheck(PUSBPCAP_TRIGGER_PROGRESS progress,
+                            PUSBPCAP_IOCTL_TRIGGER trigger,
+                            PUSBPCAP_FILTER_PACKET packet)
+{
+    if (progress->state == USBPCAP_TRIGGER_STATE_CLOSED)
+    {
+        return FALSE;
+    }
+
+    if ((progress->state == USBPCAP_TRIGGER_STATE_WAITING) &&
+        USBPcapTriggerMatch(trigger, packet))
+    {
+        DkDbgStr("Trigger fired");
+        InterlockedCompareExchange(&progress->state,
+                                   USBPCAP_TRIGGER_STATE_FIRED,
+                                   USBPCAP_TRIGGER_STATE_WAITING);
+    }
+
+    return TRUE;
+}
+
+/*
+ * To be called after packet was stored. Packets that were not stored
+ * (no space left) do not count.
+ *
+ * Returns TRUE if the packet was the last one of the capture window.
+ */
+BOOLEAN USBPcapTriggerStored(PUSBPCAP_TRIGGER_PROGRESS progress)
+{
+    if ((progress->state == USBPCAP_TRIGGER_STATE_FIRED) &&
+        (InterlockedDecrement(&progress->remaining) == 0))
+    {
+        /* Trigger packet and postCount packets after it are captured */
+        DkDbgStr("Trigger capture complete");
+        InterlockedExchange(&progress->state, USBPCAP_TRIGGER_STATE_CLOSED);
+        return TRUE;
+    }
+
+    return FALSE;
+}
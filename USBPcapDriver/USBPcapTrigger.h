@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef USBPCAP_TRIGGER_H
+#define USBPCAP_TRIGGER_H
+
+#include "USBPcapPortable.h"
+#include "USBPcapFilterProgram.h"
+#include "include/USBPcap.h"
+
+/*
+ * Capture trigger matcher and the capture window state machine. See
+ * USBPCAP_IOCTL_TRIGGER in include\USBPcap.h.
+ *
+ * Matching does not call any kernel functions and looks only at the packet
+ * passed in, so it can be run at any IRQL and on recorded packets as well.
+ */
+
+/* Progress of the capture around the trigger */
+#define USBPCAP_TRIGGER_STATE_WAITING  0 /* No packet matched yet */
+#define USBPCAP_TRIGGER_STATE_FIRED    1 /* Capturing packets after trigger */
+#define USBPCAP_TRIGGER_STATE_CLOSED   2 /* Capture stopped */
+
+/*
+ * Producers on all processors update the progress at once, so it is
+ * changed only with interlocked operations.
+ */
+typedef struct _USBPCAP_TRIGGER_PROGRESS
+{
+    volatile LONG          state;     /* USBPCAP_TRIGGER_STATE_XXX */
+    /* Packets to capture until the capture stops, including trigger packet */
+    volatile LONG          remaining;
+} USBPCAP_TRIGGER_PROGRESS, *PUSBPCAP_TRIGGER_PROGRESS;
+
+BOOLEAN USBPcapTriggerValidate(PUSBPCAP_IOCTL_TRIGGER trigger);
+BOOLEAN USBPcapTriggerMatch(PUSBPCAP_IOCTL_TRIGGER trigger,
+                            PUSBPCAP_FILTER_PACKET packet);
+
+VOID USBPcapTriggerRearm(PUSBPCAP_TRIGGER_PROGRESS progress,
+                         PUSBPCAP_IOCTL_TRIGGER trigger);
+LONG USBPcapTriggerGetState(PUSBPCAP_TRIGGER_PROGRESS progress);
+BOOLEAN USBPcapTriggerCheck(PUSBPCAP_TRIGGER_PROGRESS progress,
+                            PUSBPCAP_IOCTL_TRIGGER trigger,
+                            PUSBPCAP_FILTER_PACKET packet);
+BOOLEAN USBPcapTriggerStored(PUSBPCAP_TRIGGER_PROGRESS progress);
+
+#endif /* USBPCAP_TRIGGER_H */
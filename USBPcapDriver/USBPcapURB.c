@@ -12,6 +12,133 @@
 
 #include <stddef.h> /* Required for offsetof macro */
 
+/*
+ * Isochronous transfer scratch memory holds USBPCAP_BUFFER_ISOCH_HEADER
+ * followed by {0, NULL} terminated array of payload entries (inbound
+ * data is compacted, so there can be one entry per packet).
+ *
+ * Scratch memory comes from per-roothub lookaside lists, one for every
+ * size bucket in USBPcapIsochBucketPackets: up to 32 packets (full speed
+ * audio) and up to 256 packets (high speed video with few frames per
+ * URB). Every packet takes about 28 bytes, so the buckets do not keep
+ * large entries around. Larger transfers are allocated from pool, up to
+ * USBPCAP_ISOCH_MAX_PACKETS. URBs with more packets are not captured, as
+ * their headerLen would not fit on 16 bits.
+ */
+#define USBPCAP_ISOCH_TAG                (ULONG)'COSI'
+
+static const ULONG USBPcapIsochBucketPackets[USBPCAP_ISOCH_LOOKASIDE_BUCKETS] =
+{
+    32,
+    256,
+};
+
+#define USBPCAP_ISOCH_HEADER_SIZE(packets) \
+    (sizeof(USBPCAP_BUFFER_ISOCH_HEADER) + \
+     sizeof(USBPCAP_BUFFER_ISO_PACKET) * ((packets) - 1))
+
+/* Payload entries start at pointer-aligned offset after the header and
+ * the submit timestamp (see USBPCAP_CAPTURE_FLAG_COMPLETION_ONLY)
+ */
+#define USBPCAP_ISOCH_PAYLOAD_OFFSET(packets) \
+    ((USBPCAP_ISOCH_HEADER_SIZE(packets) + sizeof(UINT64) + \
+      sizeof(PVOID) - 1) & ~(sizeof(PVOID) - 1))
+
+#define USBPCAP_ISOCH_SCRATCH_SIZE(packets) \
+    (USBPCAP_ISOCH_PAYLOAD_OFFSET(packets) + \
+     sizeof(USBPCAP_PAYLOAD_ENTRY) * ((packets) + 1))
+
+/* Largest number of packets for which headerLen fits on 16 bits */
+#define USBPCAP_ISOCH_MAX_PACKETS \
+    ((MAXUSHORT - sizeof(USBPCAP_BUFFER_ISOCH_HEADER) - sizeof(UINT64)) / \
+     sizeof(USBPCAP_BUFFER_ISO_PACKET) + 1)
+
+VOID USBPcapInitializeIsochLookaside(PUSBPCAP_ROOTHUB_DATA pRootData)
+{
+    ULONG i;
+
+    for (i = 0; i < USBPCAP_ISOCH_LOOKASIDE_BUCKETS; i++)
+    {
+        ExInitializeNPagedLookasideList(&pRootData->isochLookaside[i],
+                                        NULL,
+                                        NULL,
+                                        0,
+                                        USBPCAP_ISOCH_SCRATCH_SIZE(USBPcapIsochBucketPackets[i]),
+                                        USBPCAP_ISOCH_TAG,
+                                        0);
+    }
+}
+
+VOID USBPcapDeleteIsochLookaside(PUSBPCAP_ROOTHUB_DATA pRootData)
+{
+    ULONG i;
+
+    for (i = 0; i < USBPCAP_ISOCH_LOOKASIDE_BUCKETS; i++)
+    {
+        ExDeleteNPagedLookasideList(&pRootData->isochLookaside[i]);
+    }
+}
+
+/*
+ * Returns index of the smallest bucket that fits packets,
+ * USBPCAP_ISOCH_LOOKASIDE_BUCKETS if scratch must come from pool.
+ */
+__inline static ULONG
+USBPcapIsochBucket(ULONG packets)
+{
+    ULONG i;
+
+    for (i = 0; i < USBPCAP_ISOCH_LOOKASIDE_BUCKETS; i++)
+    {
+        if (packets <= USBPcapIsochBucketPackets[i])
+        {
+            break;
+        }
+    }
+    return i;
+}
+
+static PUSBPCAP_BUFFER_ISOCH_HEADER
+USBPcapAllocateIsochScratch(PUSBPCAP_ROOTHUB_DATA pRootData,
+                            ULONG packets)
+{
+    ULONG bucket = USBPcapIsochBucket(packets);
+
+    if (bucket < USBPCAP_ISOCH_LOOKASIDE_BUCKETS)
+    {
+        return ExAllocateFromNPagedLookasideList(&pRootData->isochLookaside[bucket]);
+    }
+
+    return ExAllocatePoolWithTag(NonPagedPool,
+                                 USBPCAP_ISOCH_SCRATCH_SIZE(packets),
+                                 USBPCAP_ISOCH_TAG);
+}
+
+static VOID
+USBPcapFreeIsochScratch(PUSBPCAP_ROOTHUB_DATA pRootData,
+                        PUSBPCAP_BUFFER_ISOCH_HEADER scratch,
+                        ULONG packets)
+{
+    ULONG bucket = USBPcapIsochBucket(packets);
+
+    if (bucket < USBPCAP_ISOCH_LOOKASIDE_BUCKETS)
+    {
+        ExFreeToNPagedLookasideList(&pRootData->isochLookaside[bucket], scratch);
+    }
+    else
+    {
+        ExFreePool((PVOID)scratch);
+    }
+}
+
+__inline static PUSBPCAP_PAYLOAD_ENTRY
+USBPcapIsochScratchPayload(PUSBPCAP_BUFFER_ISOCH_HEADER scratch,
+                           ULONG packets)
+{
+    return (PUSBPCAP_PAYLOAD_ENTRY)
+        ((PUCHAR)scratch + USBPCAP_ISOCH_PAYLOAD_OFFSET(packets));
+}
+
 #if DBG
 VOID USBPcapPrintChars(PCHAR text, PUCHAR buffer, ULONG length)
 {
@@ -46,14 +173,38 @@ VOID USBPcapPrintChars(PCHAR text, PUCHAR buffer, ULONG length)
 #define USBPcapPrintChars(text, buffer, length) {}
 #endif
 
+/* Enough pages to map default snapshot length at any page offset */
+#define USBPCAP_PARTIAL_MDL_PAGES  (BYTES_TO_PAGES(USBPCAP_DEFAULT_SNAP_LEN) + 1)
+
+/* Describes captured prefix of transfer buffer MDL. Lives on stack. */
+typedef struct
+{
+    MDL         mdl;
+    PFN_NUMBER  pages[USBPCAP_PARTIAL_MDL_PAGES];
+    BOOLEAN     mapped;
+} USBPCAP_PARTIAL_MDL, *PUSBPCAP_PARTIAL_MDL;
+
+/*
+ * Returns pointer to first mapLength bytes of the transfer buffer.
+ *
+ * Transfer buffers that are described only by MDL and are not mapped yet
+ * can be several megabytes long. In such case only the mapLength bytes
+ * are mapped using partial MDL. The mapping must be released with
+ * USBPcapURBReleaseBufferPointer().
+ */
 static PVOID USBPcapURBGetBufferPointer(ULONG length,
                                         PVOID buffer,
-                                        PMDL  bufferMDL)
+                                        PMDL  bufferMDL,
+                                        ULONG mapLength,
+                                        PUSBPCAP_PARTIAL_MDL partial)
 {
     ASSERT((length == 0) ||
            ((length != 0) && (buffer != NULL || bufferMDL != NULL)));
+    ASSERT(mapLength <= length);
 
-    if (length == 0)
+    partial->mapped = FALSE;
+
+    if ((length == 0) || (mapLength == 0))
     {
         return NULL;
     }
@@ -63,8 +214,24 @@ static PVOID USBPcapURBGetBufferPointer(ULONG length,
     }
     else if (bufferMDL != NULL)
     {
-        PVOID address = MmGetSystemAddressForMdlSafe(bufferMDL,
-                                                     NormalPagePriority);
+        PVOID address;
+        PVOID va = MmGetMdlVirtualAddress(bufferMDL);
+
+        if ((mapLength < length) &&
+            ((bufferMDL->MdlFlags & (MDL_MAPPED_TO_SYSTEM_VA |
+                                     MDL_SOURCE_IS_NONPAGED_POOL)) == 0) &&
+            (ADDRESS_AND_SIZE_TO_SPAN_PAGES(va, mapLength) <= USBPCAP_PARTIAL_MDL_PAGES))
+        {
+            MmInitializeMdl(&partial->mdl, va, mapLength);
+            IoBuildPartialMdl(bufferMDL, &partial->mdl, va, mapLength);
+            address = MmGetSystemAddressForMdlSafe(&partial->mdl,
+                                                   NormalPagePriority);
+            partial->mapped = (address != NULL) ? TRUE : FALSE;
+            return address;
+        }
+
+        address = MmGetSystemAddressForMdlSafe(bufferMDL,
+                                               NormalPagePriority);
         return address;
     }
     else
@@ -74,6 +241,16 @@ static PVOID USBPcapURBGetBufferPointer(ULONG length,
     }
 }
 
+static VOID USBPcapURBReleaseBufferPointer(PUSBPCAP_PARTIAL_MDL partial)
+{
+    if (partial->mapped == TRUE)
+    {
+        /* Unmaps the partial MDL */
+        MmPrepareMdlForReuse(&partial->mdl);
+        partial->mapped = FALSE;
+    }
+}
+
 static VOID
 USBPcapParseInterfaceInformation(PUSBPCAP_DEVICE_DATA pDeviceData,
                                  PUSBD_INTERFACE_INFORMATION pInterface,
@@ -178,6 +355,8 @@ USBPcapAnalyzeControlTransfer(struct _URB_CONTROL_TRANSFER* transfer,
     USBPCAP_BUFFER_CONTROL_HEADER  packetHeader;
     PVOID                          dataBuffer;
     UINT32                         dataBufferLength;
+    UINT32                         dataCaptureLength;
+    USBPCAP_PARTIAL_MDL            partial;
 
     if (transfer->TransferFlags & USBD_TRANSFER_DIRECTION_IN)
     {
@@ -214,7 +393,7 @@ USBPcapAnalyzeControlTransfer(struct _URB_CONTROL_TRANSFER* transfer,
         USBPCAP_ENDPOINT_INFO                   info;
         BOOLEAN                                 epFound;
 
-        epFound = USBPcapRetrieveEndpointInfo(pDeviceData,
+        epFound = USBPcapRetrieveEndpointInfo(pDeviceData->endpointTable,
                                               transfer->PipeHandle,
                                               &info);
         if (epFound == TRUE)
@@ -230,18 +409,45 @@ USBPcapAnalyzeControlTransfer(struct _URB_CONTROL_TRANSFER* transfer,
 
     packetHeader.header.transfer = USBPCAP_TRANSFER_CONTROL;
 
-    if (transfer->TransferBufferLength != 0)
+    if (!USBPcapIsEndpointFiltered(&pDeviceData->pRootData->filter,
+                                   (int)packetHeader.header.device,
+                                   packetHeader.header.endpoint,
+                                   USBPCAP_TRANSFER_CONTROL))
+    {
+        return;
+    }
+
+    /* Data is logged with Setup stage for OUT transfers and with
+     * Complete stage for IN transfers. Map only the captured part.
+     */
+    dataBuffer = NULL;
+    dataBufferLength = (UINT32)transfer->TransferBufferLength;
+    dataCaptureLength = 0;
+    partial.mapped = FALSE;
+    if ((dataBufferLength != 0) && (post == transferFromDevice))
     {
+        if (post == FALSE)
+        {
+            packetHeader.header.dataLength = 8 + dataBufferLength;
+            dataCaptureLength =
+                USBPcapBufferGetCaptureLength(pDeviceData->pRootData,
+                                              &packetHeader.header);
+            dataCaptureLength = (dataCaptureLength > 8) ? dataCaptureLength - 8 : 0;
+        }
+        else
+        {
+            packetHeader.header.dataLength = dataBufferLength;
+            dataCaptureLength =
+                USBPcapBufferGetCaptureLength(pDeviceData->pRootData,
+                                              &packetHeader.header);
+        }
+
         dataBuffer =
             USBPcapURBGetBufferPointer(transfer->TransferBufferLength,
                                        transfer->TransferBuffer,
-                                       transfer->TransferBufferMDL);
-        dataBufferLength = (UINT32)transfer->TransferBufferLength;
-    }
-    else
-    {
-        dataBuffer = NULL;
-        dataBufferLength = 0;
+                                       transfer->TransferBufferMDL,
+                                       dataCaptureLength,
+                                       &partial);
     }
 
     /* Add Setup stage to log only when on its way from FDO to PDO. */
@@ -262,7 +468,7 @@ USBPcapAnalyzeControlTransfer(struct _URB_CONTROL_TRANSFER* transfer,
         if (!transferFromDevice)
         {
             packetHeader.header.dataLength += dataBufferLength;
-            payload[1].size = dataBufferLength;
+            payload[1].size = dataCaptureLength;
             payload[1].buffer = dataBuffer;
         }
 
@@ -287,7 +493,7 @@ USBPcapAnalyzeControlTransfer(struct _URB_CONTROL_TRANSFER* transfer,
         if (transferFromDevice)
         {
             packetHeader.header.dataLength += dataBufferLength;
-            payload[0].size = dataBufferLength;
+            payload[0].size = dataCaptureLength;
             payload[0].buffer = dataBuffer;
         }
 
@@ -295,6 +501,296 @@ USBPcapAnalyzeControlTransfer(struct _URB_CONTROL_TRANSFER* transfer,
                                  (PUSBPCAP_BUFFER_PACKET_HEADER)&packetHeader,
                                  payload);
     }
+
+    USBPcapURBReleaseBufferPointer(&partial);
+}
+
+/*
+ * Returns TRUE if URBs of given device can end up in the capture, in
+ * the latency histograms or in the endpoint counters. If FALSE, only URBs
+ * that change device state have to be analyzed.
+ */
+BOOLEAN USBPcapIsCaptureArmed(PUSBPCAP_DEVICE_DATA pDeviceData)
+{
+    PUSBPCAP_ROOTHUB_DATA pRootData = pDeviceData->pRootData;
+
+    return USBPcapIsAddressArmed(&pRootData->filter,
+                                 pRootData->captureArmed |
+                                 pRootData->latency.enabled |
+                                 pRootData->endpointStats.enabled,
+                                 (int)pDeviceData->deviceAddress);
+}
+
+__inline static BOOLEAN
+USBPcapIsCompletionOnly(PUSBPCAP_ROOTHUB_DATA pRootData)
+{
+    return (pRootData->captureFlags & USBPCAP_CAPTURE_FLAG_COMPLETION_ONLY) ? TRUE : FALSE;
+}
+
+/* USBPCAP_URB_IRP_INFO info flags of submitTable entries */
+#define USBPCAP_SUBMIT_DEFERRED  0x01 /* Submission is captured on completion */
+#define USBPCAP_SUBMIT_LATENCY   0x02 /* Completion is counted in histograms */
+
+/*
+ * Obtains the endpoint address (including direction bit) and transfer
+ * type the URB latency and traffic is counted for. Returns FALSE if the
+ * URB is not counted.
+ */
+static BOOLEAN
+USBPcapURBGetEndpointKey(PUSBPCAP_DEVICE_DATA pDeviceData,
+                         PURB pUrb,
+                         PUCHAR endpoint,
+                         PUCHAR transfer)
+{
+    USBPCAP_ENDPOINT_INFO  info;
+    USBD_PIPE_HANDLE       handle;
+    ULONG                  flags;
+
+    switch (pUrb->UrbHeader.Function)
+    {
+        case URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER:
+            handle = ((struct _URB_BULK_OR_INTERRUPT_TRANSFER*)pUrb)->PipeHandle;
+            if (!USBPcapRetrieveEndpointInfo(pDeviceData->endpointTable, handle, &info))
+            {
+                return FALSE;
+            }
+            *endpoint = info.endpointAddress;
+            *transfer = (info.type == UsbdPipeTypeInterrupt) ?
+                        USBPCAP_TRANSFER_INTERRUPT : USBPCAP_TRANSFER_BULK;
+            return TRUE;
+
+        case URB_FUNCTION_ISOCH_TRANSFER:
+            handle = ((struct _URB_ISOCH_TRANSFER*)pUrb)->PipeHandle;
+            if (!USBPcapRetrieveEndpointInfo(pDeviceData->endpointTable, handle, &info))
+            {
+                return FALSE;
+            }
+            *endpoint = info.endpointAddress;
+            *transfer = USBPCAP_TRANSFER_ISOCHRONOUS;
+            return TRUE;
+
+        case URB_FUNCTION_CONTROL_TRANSFER:
+            handle = ((struct _URB_CONTROL_TRANSFER*)pUrb)->PipeHandle;
+            flags = ((struct _URB_CONTROL_TRANSFER*)pUrb)->TransferFlags;
+            break;
+
+#if (_WIN32_WINNT >= 0x0600)
+        case URB_FUNCTION_CONTROL_TRANSFER_EX:
+            handle = ((struct _URB_CONTROL_TRANSFER_EX*)pUrb)->PipeHandle;
+            flags = ((struct _URB_CONTROL_TRANSFER_EX*)pUrb)->TransferFlags;
+            break;
+#endif
+
+        case URB_FUNCTION_VENDOR_DEVICE:
+        case URB_FUNCTION_VENDOR_INTERFACE:
+        case URB_FUNCTION_VENDOR_ENDPOINT:
+        case URB_FUNCTION_VENDOR_OTHER:
+        case URB_FUNCTION_CLASS_DEVICE:
+        case URB_FUNCTION_CLASS_INTERFACE:
+        case URB_FUNCTION_CLASS_ENDPOINT:
+        case URB_FUNCTION_CLASS_OTHER:
+            /* Default control endpoint */
+            handle = NULL;
+            flags = ((struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST*)pUrb)->TransferFlags;
+            break;
+
+        case URB_FUNCTION_GET_DESCRIPTOR_FROM_DEVICE:
+        case URB_FUNCTION_GET_DESCRIPTOR_FROM_ENDPOINT:
+        case URB_FUNCTION_GET_DESCRIPTOR_FROM_INTERFACE:
+        case URB_FUNCTION_GET_STATUS_FROM_DEVICE:
+        case URB_FUNCTION_GET_STATUS_FROM_INTERFACE:
+        case URB_FUNCTION_GET_STATUS_FROM_ENDPOINT:
+        case URB_FUNCTION_GET_STATUS_FROM_OTHER:
+            handle = NULL;
+            flags = USBD_TRANSFER_DIRECTION_IN;
+            break;
+
+        case URB_FUNCTION_SELECT_CONFIGURATION:
+        case URB_FUNCTION_SELECT_INTERFACE:
+        case URB_FUNCTION_SET_DESCRIPTOR_TO_DEVICE:
+        case URB_FUNCTION_SET_DESCRIPTOR_TO_ENDPOINT:
+        case URB_FUNCTION_SET_DESCRIPTOR_TO_INTERFACE:
+            handle = NULL;
+            flags = USBD_TRANSFER_DIRECTION_OUT;
+            break;
+
+        default:
+            return FALSE;
+    }
+
+    *endpoint = 0;
+    *transfer = USBPCAP_TRANSFER_CONTROL;
+    if (!(flags & USBD_DEFAULT_PIPE_TRANSFER) && (handle != NULL) &&
+        USBPcapRetrieveEndpointInfo(pDeviceData->endpointTable, handle, &info))
+    {
+        *endpoint = info.endpointAddress & 0x7F;
+    }
+    if (flags & USBD_TRANSFER_DIRECTION_IN)
+    {
+        *endpoint |= 0x80;
+    }
+    return TRUE;
+}
+
+/*
+ * Returns transfer buffer length of completed URB.
+ */
+static ULONG
+USBPcapURBGetTransferLength(PURB pUrb)
+{
+    switch (pUrb->UrbHeader.Function)
+    {
+        case URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER:
+            return ((struct _URB_BULK_OR_INTERRUPT_TRANSFER*)pUrb)->TransferBufferLength;
+
+        case URB_FUNCTION_ISOCH_TRANSFER:
+            return ((struct _URB_ISOCH_TRANSFER*)pUrb)->TransferBufferLength;
+
+        case URB_FUNCTION_CONTROL_TRANSFER:
+            return ((struct _URB_CONTROL_TRANSFER*)pUrb)->TransferBufferLength;
+
+#if (_WIN32_WINNT >= 0x0600)
+        case URB_FUNCTION_CONTROL_TRANSFER_EX:
+            return ((struct _URB_CONTROL_TRANSFER_EX*)pUrb)->TransferBufferLength;
+#endif
+
+        case URB_FUNCTION_GET_DESCRIPTOR_FROM_DEVICE:
+        case URB_FUNCTION_GET_DESCRIPTOR_FROM_ENDPOINT:
+        case URB_FUNCTION_GET_DESCRIPTOR_FROM_INTERFACE:
+        case URB_FUNCTION_SET_DESCRIPTOR_TO_DEVICE:
+        case URB_FUNCTION_SET_DESCRIPTOR_TO_ENDPOINT:
+        case URB_FUNCTION_SET_DESCRIPTOR_TO_INTERFACE:
+            return ((struct _URB_CONTROL_DESCRIPTOR_REQUEST*)pUrb)->TransferBufferLength;
+
+        case URB_FUNCTION_GET_STATUS_FROM_DEVICE:
+        case URB_FUNCTION_GET_STATUS_FROM_INTERFACE:
+        case URB_FUNCTION_GET_STATUS_FROM_ENDPOINT:
+        case URB_FUNCTION_GET_STATUS_FROM_OTHER:
+            return ((struct _URB_CONTROL_GET_STATUS_REQUEST*)pUrb)->TransferBufferLength;
+
+        case URB_FUNCTION_VENDOR_DEVICE:
+        case URB_FUNCTION_VENDOR_INTERFACE:
+        case URB_FUNCTION_VENDOR_ENDPOINT:
+        case URB_FUNCTION_VENDOR_OTHER:
+        case URB_FUNCTION_CLASS_DEVICE:
+        case URB_FUNCTION_CLASS_INTERFACE:
+        case URB_FUNCTION_CLASS_ENDPOINT:
+        case URB_FUNCTION_CLASS_OTHER:
+            return ((struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST*)pUrb)->TransferBufferLength;
+
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Counts completed URB in per endpoint traffic counters.
+ */
+static VOID
+USBPcapURBCountTraffic(PUSBPCAP_DEVICE_DATA pDeviceData, PURB pUrb)
+{
+    UCHAR endpoint;
+    UCHAR transfer;
+
+    if (!USBPcapURBGetEndpointKey(pDeviceData, pUrb, &endpoint, &transfer))
+    {
+        return;
+    }
+
+    USBPcapEndpointStatsAdd(&pDeviceData->pRootData->endpointStats,
+                            KeGetCurrentProcessorNumber(),
+                            pDeviceData->deviceAddress,
+                            endpoint,
+                            transfer,
+                            USBPcapURBGetTransferLength(pUrb),
+                            pUrb->UrbHeader.Status);
+}
+
+/*
+ * Stores the submit timestamp of URB that has to be paired with its
+ * completion. In completion-only capture these are bulk, interrupt and
+ * isochronous URBs (transfer buffer stays valid until the completion).
+ * While latency is measured these are all URBs with known endpoint.
+ *
+ * Returns TRUE if the URB is going to be captured on completion, FALSE
+ * if it has to be captured now.
+ */
+static BOOLEAN
+USBPcapURBStoreSubmit(PUSBPCAP_DEVICE_DATA pDeviceData,
+                      PIRP pIrp,
+                      PURB pUrb)
+{
+    PUSBPCAP_ROOTHUB_DATA  pRootData = pDeviceData->pRootData;
+    struct _URB_HEADER     *header = (struct _URB_HEADER*)pUrb;
+    USBPCAP_URB_IRP_INFO   info;
+
+    info.info = 0;
+    if ((pRootData->captureArmed != 0) &&
+        USBPcapIsCompletionOnly(pRootData) &&
+        ((header->Function == URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER) ||
+         (header->Function == URB_FUNCTION_ISOCH_TRANSFER)))
+    {
+        info.info |= USBPCAP_SUBMIT_DEFERRED;
+    }
+
+    if ((pRootData->latency.enabled != 0) &&
+        USBPcapURBGetEndpointKey(pDeviceData, pUrb,
+                                 &info.endpoint, &info.transfer))
+    {
+        info.info |= USBPCAP_SUBMIT_LATENCY;
+    }
+
+    if (info.info == 0)
+    {
+        return FALSE;
+    }
+
+    info.irp = pIrp;
+    info.timestamp = USBPcapGetCurrentTimestamp();
+    info.status = header->Status;
+    info.function = header->Function;
+    info.bus = pRootData->busId;
+    info.device = pDeviceData->deviceAddress;
+
+    if ((pDeviceData->submitTable == NULL) ||
+        !USBPcapAddURBIRPInfo(pDeviceData->submitTable, &info))
+    {
+        if (info.info & USBPCAP_SUBMIT_DEFERRED)
+        {
+            USBPcapStatisticsURBUnpaired(&pRootData->stats);
+        }
+        if (info.info & USBPCAP_SUBMIT_LATENCY)
+        {
+            USBPcapLatencyUntracked(&pRootData->latency);
+        }
+        /* Capture the submission as usual */
+        return FALSE;
+    }
+
+    return (info.info & USBPCAP_SUBMIT_DEFERRED) ? TRUE : FALSE;
+}
+
+/*
+ * Counts the submit-to-completion latency of completed URB.
+ */
+static VOID
+USBPcapURBCountLatency(PUSBPCAP_DEVICE_DATA pDeviceData,
+                       PUSBPCAP_URB_IRP_INFO submitInfo)
+{
+    LARGE_INTEGER  now = USBPcapGetCurrentTimestamp();
+    UINT64         latency = 0;
+
+    if (now.QuadPart > submitInfo->timestamp.QuadPart)
+    {
+        latency = (UINT64)(now.QuadPart - submitInfo->timestamp.QuadPart);
+    }
+
+    USBPcapLatencyAdd(&pDeviceData->pRootData->latency,
+                      KeGetCurrentProcessorNumber(),
+                      submitInfo->device,
+                      submitInfo->endpoint,
+                      submitInfo->transfer,
+                      latency);
 }
 
 /*
@@ -309,6 +805,8 @@ VOID USBPcapAnalyzeURB(PIRP pIrp, PURB pUrb, BOOLEAN post,
     struct _URB_HEADER     *header;
     USBPCAP_URB_IRP_INFO    unknownURBSubmitInfo;
     BOOLEAN                 hasUnknownURBSubmitInfo;
+    USBPCAP_URB_IRP_INFO    submitInfo;
+    BOOLEAN                 submitDeferred = FALSE;
 
     ASSERT(pUrb != NULL);
     ASSERT(pDeviceData != NULL);
@@ -320,7 +818,21 @@ VOID USBPcapAnalyzeURB(PIRP pIrp, PURB pUrb, BOOLEAN post,
     if (post)
     {
         hasUnknownURBSubmitInfo =
-            USBPcapObtainURBIRPInfo(pDeviceData, pIrp, &unknownURBSubmitInfo);
+            USBPcapObtainURBIRPInfo(pDeviceData->URBIrpTable, pIrp,
+                                    &unknownURBSubmitInfo);
+        /* Submission paired with the completion */
+        if (USBPcapObtainURBIRPInfo(pDeviceData->submitTable, pIrp,
+                                    &submitInfo))
+        {
+            if (submitInfo.info & USBPCAP_SUBMIT_LATENCY)
+            {
+                USBPcapURBCountLatency(pDeviceData, &submitInfo);
+            }
+            if (submitInfo.info & USBPCAP_SUBMIT_DEFERRED)
+            {
+                submitDeferred = TRUE;
+            }
+        }
     }
     else
     {
@@ -425,13 +937,28 @@ VOID USBPcapAnalyzeURB(PIRP pIrp, PURB pUrb, BOOLEAN post,
             break;
     }
 
-    if (USBPcapIsDeviceFiltered(&pDeviceData->pRootData->filter,
+    if (USBPcapIsDeviceFiltered(&pDeviceData->pRootData->filter.address,
                                 (int)pDeviceData->deviceAddress) == FALSE)
     {
         /* Do not log URBs from devices which are not being filtered */
         return;
     }
 
+    if (post == FALSE)
+    {
+        submitDeferred = USBPcapURBStoreSubmit(pDeviceData, pIrp, pUrb);
+    }
+    else if (pDeviceData->pRootData->endpointStats.enabled != 0)
+    {
+        USBPcapURBCountTraffic(pDeviceData, pUrb);
+    }
+
+    if (pDeviceData->pRootData->captureArmed == 0)
+    {
+        /* Only the latency or traffic is counted */
+        return;
+    }
+
     if (hasUnknownURBSubmitInfo)
     {
         /* Simply log the unknown URB.
@@ -892,9 +1419,14 @@ VOID USBPcapAnalyzeURB(PIRP pIrp, PURB pUrb, BOOLEAN post,
             USBPCAP_ENDPOINT_INFO                   info;
             BOOLEAN                                 epFound;
             USBPCAP_BUFFER_PACKET_HEADER            packetHeader;
-            PVOID                                   transferBuffer;
-
-            packetHeader.headerLen = sizeof(USBPCAP_BUFFER_PACKET_HEADER);
+            USBPCAP_BUFFER_COMPLETION_HEADER        completion;
+            PUSBPCAP_BUFFER_PACKET_HEADER           pPacketHeader;
+            USBPCAP_PAYLOAD_ENTRY                   payload[2];
+            USBPCAP_PARTIAL_MDL                     partial;
+
+            packetHeader.headerLen = submitDeferred ?
+                                     sizeof(USBPCAP_BUFFER_COMPLETION_HEADER) :
+                                     sizeof(USBPCAP_BUFFER_PACKET_HEADER);
             packetHeader.irpId     = (UINT64) pIrp;
             packetHeader.status    = header->Status;
             packetHeader.function  = header->Function;
@@ -910,7 +1442,7 @@ VOID USBPcapAnalyzeURB(PIRP pIrp, PURB pUrb, BOOLEAN post,
 
             DkDbgStr("URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER");
             DkDbgVal("", transfer->PipeHandle);
-            epFound = USBPcapRetrieveEndpointInfo(pDeviceData,
+            epFound = USBPcapRetrieveEndpointInfo(pDeviceData->endpointTable,
                                                   transfer->PipeHandle,
                                                   &info);
             if (epFound == TRUE)
@@ -939,28 +1471,64 @@ VOID USBPcapAnalyzeURB(PIRP pIrp, PURB pUrb, BOOLEAN post,
                 packetHeader.transfer = USBPCAP_TRANSFER_BULK;
             }
 
+            if (!USBPcapIsEndpointFiltered(&pDeviceData->pRootData->filter,
+                                           (int)packetHeader.device,
+                                           packetHeader.endpoint,
+                                           packetHeader.transfer))
+            {
+                break;
+            }
+
+            if ((post == FALSE) && submitDeferred)
+            {
+                /* Will be captured on completion */
+                break;
+            }
+
             /* For IN endpoints, add data to log only when post = TRUE,
              * For OUT endpoints, add data to log only when post = FALSE
+             * or when the submission was deferred.
              */
             if (((packetHeader.endpoint & 0x80) && (post == TRUE)) ||
-                (!(packetHeader.endpoint & 0x80) && (post == FALSE)))
+                (!(packetHeader.endpoint & 0x80) && ((post == FALSE) || submitDeferred)))
             {
                 packetHeader.dataLength = (UINT32)transfer->TransferBufferLength;
 
-                transferBuffer =
+                payload[0].size =
+                    USBPcapBufferGetCaptureLength(pDeviceData->pRootData,
+                                                  &packetHeader);
+                payload[0].buffer =
                     USBPcapURBGetBufferPointer(transfer->TransferBufferLength,
                                                transfer->TransferBuffer,
-                                               transfer->TransferBufferMDL);
+                                               transfer->TransferBufferMDL,
+                                               payload[0].size,
+                                               &partial);
             }
             else
             {
                 packetHeader.dataLength = 0;
-                transferBuffer = NULL;
+                payload[0].size = 0;
+                payload[0].buffer = NULL;
+                partial.mapped = FALSE;
             }
+            payload[1].size = 0;
+            payload[1].buffer = NULL;
 
-            USBPcapBufferWritePacket(pDeviceData->pRootData,
-                                     &packetHeader,
-                                     transferBuffer);
+            if (submitDeferred)
+            {
+                completion.header = packetHeader;
+                completion.submitTimestamp = (UINT64)submitInfo.timestamp.QuadPart;
+                pPacketHeader = &completion.header;
+            }
+            else
+            {
+                pPacketHeader = &packetHeader;
+            }
+
+            USBPcapBufferWritePayload(pDeviceData->pRootData,
+                                      pPacketHeader,
+                                      payload);
+            USBPcapURBReleaseBufferPointer(&partial);
 
             DkDbgVal("", transfer->TransferFlags);
             DkDbgVal("", transfer->TransferBufferLength);
@@ -981,8 +1549,8 @@ VOID USBPcapAnalyzeURB(PIRP pIrp, PURB pUrb, BOOLEAN post,
             USBPCAP_ENDPOINT_INFO         info;
             BOOLEAN                       epFound;
             PUSBPCAP_BUFFER_ISOCH_HEADER  packetHeader;
-            PUSBPCAP_PAYLOAD_ENTRY        compactedPayloadEntries;
-            PVOID                         captureBuffer;
+            PUSBPCAP_PAYLOAD_ENTRY        payloadEntries;
+            USBPCAP_PARTIAL_MDL           partial;
             USHORT                        headerLen;
             ULONG                         i;
 
@@ -993,23 +1561,47 @@ VOID USBPcapAnalyzeURB(PIRP pIrp, PURB pUrb, BOOLEAN post,
             DkDbgVal("", transfer->TransferFlags);
             DkDbgVal("", transfer->NumberOfPackets);
 
-            /* Handle transfers up to maximum of 1024 packets */
-            if (transfer->NumberOfPackets > 1024)
+            /* headerLen must fit on 16 bits */
+            if (transfer->NumberOfPackets > USBPCAP_ISOCH_MAX_PACKETS)
             {
                 DkDbgVal("Too many packets for isochronous transfer",
                          transfer->NumberOfPackets);
                 break;
             }
 
-            /* headerLen will fit on 16 bits for every allowed value of
-             * NumberOfPackets */
-            headerLen = (USHORT)sizeof(USBPCAP_BUFFER_ISOCH_HEADER) +
-                        (USHORT)(sizeof(USBPCAP_BUFFER_ISO_PACKET) *
-                                 (transfer->NumberOfPackets - 1));
+            epFound = USBPcapRetrieveEndpointInfo(pDeviceData->endpointTable,
+                                                  transfer->PipeHandle,
+                                                  &info);
+            if (epFound == FALSE)
+            {
+                info.deviceAddress = pDeviceData->deviceAddress;
+                info.endpointAddress = 0xFF;
+            }
+
+            /* Check before allocating the scratch memory */
+            if (!USBPcapIsEndpointFiltered(&pDeviceData->pRootData->filter,
+                                           (int)info.deviceAddress,
+                                           info.endpointAddress,
+                                           USBPCAP_TRANSFER_ISOCHRONOUS))
+            {
+                break;
+            }
+
+            if ((post == FALSE) && submitDeferred)
+            {
+                /* Will be captured on completion */
+                break;
+            }
+
+            headerLen = (USHORT)USBPCAP_ISOCH_HEADER_SIZE(transfer->NumberOfPackets);
+            if (submitDeferred)
+            {
+                /* Submit timestamp follows the packet descriptors */
+                headerLen += sizeof(UINT64);
+            }
 
-            packetHeader = ExAllocatePoolWithTag(NonPagedPool,
-                                                 (SIZE_T)headerLen,
-                                                 ' RDH');
+            packetHeader = USBPcapAllocateIsochScratch(pDeviceData->pRootData,
+                                                       transfer->NumberOfPackets);
 
             if (packetHeader == NULL)
             {
@@ -1028,26 +1620,17 @@ VOID USBPcapAnalyzeURB(PIRP pIrp, PURB pUrb, BOOLEAN post,
             }
 
             packetHeader->header.bus       = pDeviceData->pRootData->busId;
-
-            epFound = USBPcapRetrieveEndpointInfo(pDeviceData,
-                                                  transfer->PipeHandle,
-                                                  &info);
-            if (epFound == TRUE)
-            {
-                packetHeader->header.device = info.deviceAddress;
-                packetHeader->header.endpoint = info.endpointAddress;
-            }
-            else
-            {
-                packetHeader->header.device = pDeviceData->deviceAddress;
-                packetHeader->header.endpoint = 0xFF;
-            }
+            packetHeader->header.device    = info.deviceAddress;
+            packetHeader->header.endpoint  = info.endpointAddress;
             packetHeader->header.transfer = USBPCAP_TRANSFER_ISOCHRONOUS;
 
             /* Default to no data, will be changed later if data is to be attached to packet */
             packetHeader->header.dataLength = 0;
-            compactedPayloadEntries = NULL;
-            captureBuffer = NULL;
+            payloadEntries = USBPcapIsochScratchPayload(packetHeader,
+                                                        transfer->NumberOfPackets);
+            payloadEntries[0].size = 0;
+            payloadEntries[0].buffer = NULL;
+            partial.mapped = FALSE;
 
             /* Copy the packet headers untouched */
             for (i = 0; i < transfer->NumberOfPackets; i++)
@@ -1060,18 +1643,20 @@ VOID USBPcapAnalyzeURB(PIRP pIrp, PURB pUrb, BOOLEAN post,
             /* For inbound isoch transfers (post), transfer->TransferBufferLength reflects the actual
              * number of bytes received. Rather than copying the entire transfer buffer (which may have
              * empty gaps), we will compact the data, copying only the packets that contain data.
+             *
+             * Only the part of transfer buffer that holds captured data is mapped.
              */
             if (transfer->TransferBufferLength != 0)
             {
-                PUCHAR transferBuffer =
-                        USBPcapURBGetBufferPointer(transfer->TransferBufferLength,
-                                                   transfer->TransferBuffer,
-                                                   transfer->TransferBufferMDL);
+                PUCHAR transferBuffer;
+                ULONG  captureLength;
 
                 if (((transfer->TransferFlags & USBD_TRANSFER_DIRECTION_IN) == USBD_TRANSFER_DIRECTION_IN) && (post == TRUE))
                 {
                     ULONG  compactedOffset;
                     ULONG  compactedLength;
+                    ULONG  mapLength;
+                    ULONG  j;
 
                     compactedLength = 0;
 
@@ -1085,29 +1670,66 @@ VOID USBPcapAnalyzeURB(PIRP pIrp, PURB pUrb, BOOLEAN post,
                     {
                         /* This is a safety check -- the numbers don't add up (this should never happen) */
                         DkDbgStr("Sum of Isochronous transfer packet lengths exceeds transfer buffer length");
-                        ExFreePool((PVOID)packetHeader);
+                        USBPcapFreeIsochScratch(pDeviceData->pRootData,
+                                                packetHeader,
+                                                transfer->NumberOfPackets);
                         break;
                     }
 
                     /* Compact the data to minimize the capture size */
                     packetHeader->header.dataLength = (UINT32)compactedLength;
+                    captureLength =
+                        USBPcapBufferGetCaptureLength(pDeviceData->pRootData,
+                                                      &packetHeader->header);
+
+                    /* Find the transfer buffer prefix that holds captured packets */
+                    compactedOffset = 0;
+                    mapLength = 0;
+                    for (i = 0; (i < transfer->NumberOfPackets) && (compactedOffset < captureLength); i++)
+                    {
+                        ULONG size = min(transfer->IsoPacket[i].Length,
+                                         captureLength - compactedOffset);
+
+                        if (transfer->IsoPacket[i].Offset > transfer->TransferBufferLength - size)
+                        {
+                            mapLength = MAXULONG;
+                            break;
+                        }
+                        mapLength = max(mapLength, transfer->IsoPacket[i].Offset + size);
+                        compactedOffset += transfer->IsoPacket[i].Length;
+                    }
+
+                    if (mapLength > transfer->TransferBufferLength)
+                    {
+                        DkDbgStr("Isochronous transfer packet outside transfer buffer");
+                        USBPcapFreeIsochScratch(pDeviceData->pRootData,
+                                                packetHeader,
+                                                transfer->NumberOfPackets);
+                        break;
+                    }
 
-                    /* Allocate array of payload entries that will point to original data */
-                    compactedPayloadEntries = ExAllocatePoolWithTag(NonPagedPool,
-                        (SIZE_T)(transfer->NumberOfPackets + 1) * sizeof(USBPCAP_PAYLOAD_ENTRY),
-                        'COSI');
-                    if (compactedPayloadEntries == NULL)
+                    transferBuffer =
+                        USBPcapURBGetBufferPointer(transfer->TransferBufferLength,
+                                                   transfer->TransferBuffer,
+                                                   transfer->TransferBufferMDL,
+                                                   mapLength,
+                                                   &partial);
+                    if ((transferBuffer == NULL) && (mapLength != 0))
                     {
-                        DkDbgStr("Insufficient resources for isochronous transfer");
-                        ExFreePool((PVOID)packetHeader);
+                        DkDbgStr("Unable to map isochronous transfer buffer");
+                        USBPcapFreeIsochScratch(pDeviceData->pRootData,
+                                                packetHeader,
+                                                transfer->NumberOfPackets);
                         break;
                     }
 
                     /* Loop through all the isoch packets in the transfer buffer
                      * Store offset and length in payload entries array in a way
                      * that there won't be gaps in the resulting packet.
+                     * Payload entries cover only the captured data.
                      */
                     compactedOffset = 0;
+                    j = 0;
                     for (i = 0; i < transfer->NumberOfPackets; i++)
                     {
                         /* Adjust the offsets */
@@ -1115,17 +1737,38 @@ VOID USBPcapAnalyzeURB(PIRP pIrp, PURB pUrb, BOOLEAN post,
                         packetHeader->packet[i].length = transfer->IsoPacket[i].Length;
                         packetHeader->packet[i].status = transfer->IsoPacket[i].Status;
 
-                        compactedPayloadEntries[i].size = transfer->IsoPacket[i].Length;
-                        compactedPayloadEntries[i].buffer = &transferBuffer[transfer->IsoPacket[i].Offset];
+                        if ((compactedOffset < captureLength) &&
+                            (transfer->IsoPacket[i].Length != 0))
+                        {
+                            payloadEntries[j].size = min(transfer->IsoPacket[i].Length,
+                                                         captureLength - compactedOffset);
+                            payloadEntries[j].buffer = &transferBuffer[transfer->IsoPacket[i].Offset];
+                            j++;
+                        }
                         compactedOffset += transfer->IsoPacket[i].Length;
                     }
-                    compactedPayloadEntries[i].size = 0;
-                    compactedPayloadEntries[i].buffer = NULL;
+                    payloadEntries[j].size = 0;
+                    payloadEntries[j].buffer = NULL;
                 }
-                else if (((transfer->TransferFlags & USBD_TRANSFER_DIRECTION_IN) == USBD_TRANSFER_DIRECTION_OUT) && (post == FALSE))
+                else if (((transfer->TransferFlags & USBD_TRANSFER_DIRECTION_IN) == USBD_TRANSFER_DIRECTION_OUT) &&
+                         ((post == FALSE) || submitDeferred))
                 {
-                    captureBuffer = transferBuffer;
                     packetHeader->header.dataLength = transfer->TransferBufferLength;
+                    captureLength =
+                        USBPcapBufferGetCaptureLength(pDeviceData->pRootData,
+                                                      &packetHeader->header);
+
+                    transferBuffer =
+                        USBPcapURBGetBufferPointer(transfer->TransferBufferLength,
+                                                   transfer->TransferBuffer,
+                                                   transfer->TransferBufferMDL,
+                                                   captureLength,
+                                                   &partial);
+
+                    payloadEntries[0].size = captureLength;
+                    payloadEntries[0].buffer = transferBuffer;
+                    payloadEntries[1].size = 0;
+                    payloadEntries[1].buffer = NULL;
                 }
                 else
                 {
@@ -1137,21 +1780,22 @@ VOID USBPcapAnalyzeURB(PIRP pIrp, PURB pUrb, BOOLEAN post,
             packetHeader->numberOfPackets = transfer->NumberOfPackets;
             packetHeader->errorCount      = transfer->ErrorCount;
 
-            if (compactedPayloadEntries)
+            if (submitDeferred)
             {
-                USBPcapBufferWritePayload(pDeviceData->pRootData,
-                                          (PUSBPCAP_BUFFER_PACKET_HEADER)packetHeader,
-                                          compactedPayloadEntries);
-                ExFreePool((PVOID)compactedPayloadEntries);
-            }
-            else
-            {
-                USBPcapBufferWritePacket(pDeviceData->pRootData,
-                                         (PUSBPCAP_BUFFER_PACKET_HEADER)packetHeader,
-                                         captureBuffer);
+                UINT64 submitTimestamp = (UINT64)submitInfo.timestamp.QuadPart;
+
+                RtlCopyMemory(&((PUCHAR)packetHeader)[USBPCAP_ISOCH_HEADER_SIZE(transfer->NumberOfPackets)],
+                              &submitTimestamp, sizeof(UINT64));
             }
 
-            ExFreePool((PVOID)packetHeader);
+            USBPcapBufferWritePayload(pDeviceData->pRootData,
+                                      (PUSBPCAP_BUFFER_PACKET_HEADER)packetHeader,
+                                      payloadEntries);
+
+            USBPcapURBReleaseBufferPointer(&partial);
+            USBPcapFreeIsochScratch(pDeviceData->pRootData,
+                                    packetHeader,
+                                    transfer->NumberOfPackets);
             break;
         }
 
@@ -1184,7 +1828,7 @@ VOID USBPcapAnalyzeURB(PIRP pIrp, PURB pUrb, BOOLEAN post,
             request = (struct _URB_PIPE_REQUEST*)pUrb;
 
             DkDbgVal("URB PIPE REQUEST", request->PipeHandle);
-            epFound = USBPcapRetrieveEndpointInfo(pDeviceData,
+            epFound = USBPcapRetrieveEndpointInfo(pDeviceData->endpointTable,
                                                   request->PipeHandle,
                                                   &info);
             if (epFound == TRUE)
@@ -1199,6 +1843,13 @@ VOID USBPcapAnalyzeURB(PIRP pIrp, PURB pUrb, BOOLEAN post,
                 packetHeader.transfer = USBPCAP_TRANSFER_UNKNOWN;
             }
 
+            if (!USBPcapIsEndpointFiltered(&pDeviceData->pRootData->filter,
+                                           (int)packetHeader.device,
+                                           packetHeader.endpoint,
+                                           packetHeader.transfer))
+            {
+                break;
+            }
 
             USBPcapBufferWritePacket(pDeviceData->pRootData,
                                      &packetHeader,
@@ -1242,7 +1893,6 @@ VOID USBPcapAnalyzeURB(PIRP pIrp, PURB pUrb, BOOLEAN post,
         {
             if (post == FALSE)
             {
-                KIRQL irql;
                 USBPCAP_URB_IRP_INFO info;
 
                 /* Record unknown URB function to table.
@@ -1259,9 +1909,10 @@ VOID USBPcapAnalyzeURB(PIRP pIrp, PURB pUrb, BOOLEAN post,
                 info.bus = pDeviceData->pRootData->busId;
                 info.device = pDeviceData->deviceAddress;
 
-                KeAcquireSpinLock(&pDeviceData->tablesSpinLock, &irql);
-                USBPcapAddURBIRPInfo(pDeviceData->URBIrpTable, &info);
-                KeReleaseSpinLock(&pDeviceData->tablesSpinLock, irql);
+                if (pDeviceData->URBIrpTable != NULL)
+                {
+                    USBPcapAddURBIRPInfo(pDeviceData->URBIrpTable, &info);
+                }
             }
             else /* if (post == TRUE) */
             {
@@ -9,6 +9,11 @@
 
 #include "USBPcapMain.h"
 
+VOID USBPcapInitializeIsochLookaside(PUSBPCAP_ROOTHUB_DATA pRootData);
+VOID USBPcapDeleteIsochLookaside(PUSBPCAP_ROOTHUB_DATA pRootData);
+
+BOOLEAN USBPcapIsCaptureArmed(PUSBPCAP_DEVICE_DATA pDeviceData);
+
 VOID USBPcapAnalyzeURB(PIRP pIrp, PURB pUrb, BOOLEAN post,
                        PUSBPCAP_DEVICE_DATA pDeviceData);
 
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include "USBPcapWakeup.h"
+
+VOID USBPcapWakeupInitialize(PUSBPCAP_WAKEUP_POLICY policy)
+{
+    policy->minBytes = 0;
+    policy->maxLatencyUs = 0;
+}
+
+/*
+ * Validates and stores new policy. Threshold without latency bound could
+ * leave the read pending forever, so it is rejected.
+ */
+NTSTATUS USBPcapWakeupSet(PUSBPCAP_WAKEUP_POLICY policy,
+                          UINT32 minBytes,
+                          UINT32 maxLatencyUs)
+{
+    if ((maxLatencyUs > USBPCAP_WAKEUP_MAX_LATENCY) ||
+        ((minBytes > 1) && (maxLatencyUs == 0)))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    policy->minBytes = minBytes;
+    policy->maxLatencyUs = maxLatencyUs;
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Decides what to do with pending read when used bytes are available.
+ * expired is TRUE when the latency timer fired (or caller wants any data).
+ */
+USBPCAP_WAKEUP_ACTION USBPcapWakeupCheck(PUSBPCAP_WAKEUP_POLICY policy,
+                                         UINT32 used,
+                                         BOOLEAN expired)
+{
+    if (used == 0)
+    {
+        return USBPCAP_WAKEUP_WAIT;
+    }
+
+    if (expired || (used >= policy->minBytes))
+    {
+        return USBPCAP_WAKEUP_COMPLETE;
+    }
+
+    return USBPCAP_WAKEUP_ARM_TIMER;
+}
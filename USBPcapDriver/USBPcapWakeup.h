@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef USBPCAP_WAKEUP_H
+#define USBPCAP_WAKEUP_H
+
+#include "USBPcapPortable.h"
+
+/* Maximum read wakeup latency, 10 seconds */
+#define USBPCAP_WAKEUP_MAX_LATENCY  10000000
+
+/*
+ * Read wakeup policy, see USBPCAP_IOCTL_READ_WAKEUP. A pending read is
+ * completed once at least minBytes are available, or when maxLatencyUs
+ * passed since data below the threshold was noticed. minBytes of 0 or 1
+ * completes the read as soon as there is any data.
+ */
+typedef struct _USBPCAP_WAKEUP_POLICY
+{
+    UINT32                 minBytes;
+    UINT32                 maxLatencyUs;
+} USBPCAP_WAKEUP_POLICY, *PUSBPCAP_WAKEUP_POLICY;
+
+typedef enum _USBPCAP_WAKEUP_ACTION
+{
+    USBPCAP_WAKEUP_WAIT,      /* No data, keep the read pending */
+    USBPCAP_WAKEUP_ARM_TIMER, /* Below threshold, complete on timeout */
+    USBPCAP_WAKEUP_COMPLETE   /* Complete the read now */
+} USBPCAP_WAKEUP_ACTION;
+
+VOID USBPcapWakeupInitialize(PUSBPCAP_WAKEUP_POLICY policy);
+NTSTATUS USBPcapWakeupSet(PUSBPCAP_WAKEUP_POLICY policy,
+                          UINT32 minBytes,
+                          UINT32 maxLatencyUs);
+USBPCAP_WAKEUP_ACTION USBPcapWakeupCheck(PUSBPCAP_WAKEUP_POLICY policy,
+                                         UINT32 used,
+                                         BOOLEAN expired);
+
+#endif /* USBPCAP_WAKEUP_H */
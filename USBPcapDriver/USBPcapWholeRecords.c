@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include "USBPcapWholeRecords.h"
+#include "USBPcapRecord.h"
+
+/*
+ * Reads whole records from ring, and then from cpuRings (if not NULL)
+ * once ring is empty. ring holds the global header that must be read
+ * before any packet. destBufferSize must be at least
+ * USBPCAP_WHOLE_RECORDS_MIN_READ(snaplen).
+ *
+ * If producers evict records from ring, evictLock is the lock they hold
+ * while evicting. It is held only while single record is read, so the
+ * oldest records can be evicted between the records of one read. Must
+ * be called at DISPATCH_LEVEL then.
+ *
+ * Caller must be the only consumer. Returns number of bytes read, 0 if
+ * there is no record to read.
+ */
+UINT32 USBPcapWholeRecordsRead(PUSBPCAP_RING ring,
+                               PUSBPCAP_CPU_RINGS cpuRings,
+                               PKSPIN_LOCK evictLock,
+                               BOOLEAN pcapng,
+                               PVOID destBuffer,
+                               UINT32 destBufferSize)
+{
+    USBPCAP_READ_TRAILER  trailer;
+    PUCHAR                dest = (PUCHAR)destBuffer;
+    UINT32                size;
+    UINT32                bytes = 0;
+    UINT32                tmp;
+
+    if (destBufferSize < sizeof(USBPCAP_READ_TRAILER))
+    {
+        return 0;
+    }
+
+    size = destBufferSize - sizeof(USBPCAP_READ_TRAILER);
+    trailer.records = 0;
+
+    do
+    {
+        if (evictLock != NULL)
+        {
+            KeAcquireSpinLockAtDpcLevel(evictLock);
+        }
+        tmp = USBPcapRecordReadWhole(ring, pcapng, &dest[bytes], size - bytes);
+        if (evictLock != NULL)
+        {
+            KeReleaseSpinLockFromDpcLevel(evictLock);
+        }
+
+        if (tmp > 0)
+        {
+            bytes += tmp;
+            trailer.records++;
+        }
+    }
+    while (tmp > 0);
+
+    if ((cpuRings != NULL) && (USBPcapRingGetUsed(ring) == 0))
+    {
+        bytes += USBPcapCpuRingsReadWhole(cpuRings, pcapng,
+                                          &dest[bytes],
+                                          size - bytes,
+                                          &trailer.records);
+    }
+
+    if (trailer.records == 0)
+    {
+        return 0;
+    }
+
+    trailer.length = bytes;
+    RtlCopyMemory(&dest[bytes], &trailer, sizeof(USBPCAP_READ_TRAILER));
+
+    return bytes + sizeof(USBPCAP_READ_TRAILER);
+}
@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef USBPCAP_WHOLE_RECORDS_H
+#define USBPCAP_WHOLE_RECORDS_H
+
+#include "USBPcapPortable.h"
+#include "USBPcapRing.h"
+#include "USBPcapCpuRings.h"
+#include "include/USBPcap.h"
+
+/*
+ * Read framing of USBPCAP_CAPTURE_FLAG_WHOLE_RECORDS.
+ *
+ * Every read returns only whole records followed by USBPCAP_READ_TRAILER.
+ * Records stay in the rings until there is enough space for them, so none
+ * is lost. Records are counted as captured or dropped when they are
+ * stored, the framing does not change the statistics.
+ */
+UINT32 USBPcapWholeRecordsRead(PUSBPCAP_RING ring,
+                               PUSBPCAP_CPU_RINGS cpuRings,
+                               PKSPIN_LOCK evictLock,
+                               BOOLEAN pcapng,
+                               PVOID destBuffer,
+                               UINT32 destBufferSize);
+
+#endif /* USBPCAP_WHOLE_RECORDS_H */
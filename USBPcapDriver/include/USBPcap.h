@@ -18,6 +18,444 @@ typedef struct
     UINT32  size;
 } USBPCAP_IOCTL_SIZE, *PUSBPCAP_IOCTL_SIZE;
 
+/* USBPCAP_IOCTL_READ_WAKEUP is parameter structure to
+ * IOCTL_USBPCAP_SET_READ_WAKEUP.
+ *
+ * Pending read is completed once there is at least minBytes of data or
+ * when the oldest unread data waits for maxLatencyUs microseconds,
+ * whichever comes first. minBytes values 0 and 1 complete the read as soon
+ * as any data is available (default). maxLatencyUs must be non-zero if
+ * minBytes is larger than 1.
+ */
+typedef struct
+{
+    UINT32  minBytes;
+    UINT32  maxLatencyUs;
+} USBPCAP_IOCTL_READ_WAKEUP, *PUSBPCAP_IOCTL_READ_WAKEUP;
+
+/* USBPCAP_IOCTL_CAPTURE_FLAGS is parameter structure to
+ * IOCTL_USBPCAP_SET_CAPTURE_FLAGS. Flags can be changed only before
+ * the buffer is set up with IOCTL_USBPCAP_SETUP_BUFFER.
+ */
+typedef struct
+{
+    UINT32  flags;
+} USBPCAP_IOCTL_CAPTURE_FLAGS, *PUSBPCAP_IOCTL_CAPTURE_FLAGS;
+
+#define USBPCAP_SNAPLEN_MAX_ENDPOINTS  32
+
+typedef struct
+{
+    UINT16  device;
+    UINT8   endpoint;  /* Endpoint address, including direction bit */
+    UINT8   reserved;
+    UINT32  snaplen;
+} USBPCAP_SNAPLEN_ENDPOINT, *PUSBPCAP_SNAPLEN_ENDPOINT;
+
+/* USBPCAP_IOCTL_SNAPLEN_TABLE is parameter structure to
+ * IOCTL_USBPCAP_SET_SNAPLEN_TABLE. Table can be changed only before
+ * the buffer is set up with IOCTL_USBPCAP_SETUP_BUFFER.
+ *
+ * Snapshot length of a packet is taken from the first matching entry in
+ * endpoints, otherwise from transfer[] for its transfer type. 0 in
+ * transfer[] means no limit. All values count the USBPcap header and are
+ * limited by IOCTL_USBPCAP_SET_SNAPLEN_SIZE. Entries with device above
+ * 127 or endpoint with any of bits 4-6 set are rejected.
+ */
+typedef struct
+{
+    UINT32                    transfer[4]; /* Indexed by USBPCAP_TRANSFER_XXX */
+    UINT32                    count;       /* Number of used endpoints */
+    USBPCAP_SNAPLEN_ENDPOINT  endpoints[USBPCAP_SNAPLEN_MAX_ENDPOINTS];
+} USBPCAP_IOCTL_SNAPLEN_TABLE, *PUSBPCAP_IOCTL_SNAPLEN_TABLE;
+
+/* Every processor writes packets to its own staging buffer. Buffer size
+ * set with IOCTL_USBPCAP_SETUP_BUFFER is split between processors.
+ * Packets are merged by timestamp when read. Buffer cannot be resized.
+ */
+#define USBPCAP_CAPTURE_FLAG_PER_CPU_BUFFERS  0x00000001
+/* Buffer is allocated so it can be mapped into the capturing process with
+ * IOCTL_USBPCAP_MAP_BUFFER. Cannot be combined with per-CPU buffers.
+ * Buffer cannot be resized.
+ */
+#define USBPCAP_CAPTURE_FLAG_MAPPED_BUFFER    0x00000002
+/* Data is written in pcapng format instead of classic pcap. Capture
+ * starts with USBPCAP_PCAPNG_HEADER and every packet is stored in Enhanced
+ * Packet Block with timestamp in 100 ns units.
+ */
+#define USBPCAP_CAPTURE_FLAG_PCAPNG           0x00000004
+/* Every completed read contains only whole records (global header is
+ * a record too) followed by USBPCAP_READ_TRAILER. Read buffer must be at
+ * least USBPCAP_WHOLE_RECORDS_MIN_READ(snaplen) bytes long, shorter reads
+ * fail with STATUS_BUFFER_TOO_SMALL. Cannot be combined with mapped buffer.
+ */
+#define USBPCAP_CAPTURE_FLAG_WHOLE_RECORDS    0x00000008
+/* Bulk, interrupt and isochronous URBs are captured only on completion
+ * (with USBPCAP_INFO_PDO_TO_FDO set), together with the data in both
+ * directions. Transfer specific header is then followed by UINT64 submit
+ * timestamp (system time in 100 ns units since 1601-01-01) included in
+ * headerLen. URBs that could not be paired with their submission are
+ * captured as usual.
+ */
+#define USBPCAP_CAPTURE_FLAG_COMPLETION_ONLY  0x00000010
+/* When the capture buffer is full, the oldest whole records are evicted
+ * to make space for the new packet instead of dropping the new packet.
+ * Global header is kept, so data read is always valid capture file.
+ * Packet is still dropped if it does not fit even after evicting all
+ * unread records or if the oldest record was partially read. Cannot be
+ * combined with per-CPU buffers or mapped buffer.
+ */
+#define USBPCAP_CAPTURE_FLAG_OVERWRITE_OLDEST 0x00000020
+
+/* USBPCAP_READ_TRAILER ends every read when USBPCAP_CAPTURE_FLAG_WHOLE_RECORDS
+ * is set. Records start at the beginning of read buffer.
+ */
+typedef struct
+{
+    UINT32  records; /* Number of records preceding the trailer */
+    UINT32  length;  /* Number of bytes preceding the trailer */
+} USBPCAP_READ_TRAILER, *PUSBPCAP_READ_TRAILER;
+
+/* USBPCAP_IOCTL_MAP_BUFFER is input parameter structure to
+ * IOCTL_USBPCAP_MAP_BUFFER.
+ */
+typedef struct
+{
+    UINT64  event;   /* Auto-reset event HANDLE signalled when new data
+                      * is available and consumer is waiting.
+                      */
+} USBPCAP_IOCTL_MAP_BUFFER, *PUSBPCAP_IOCTL_MAP_BUFFER;
+
+/* USBPCAP_IOCTL_MAPPED_BUFFER is output parameter structure of
+ * IOCTL_USBPCAP_MAP_BUFFER.
+ */
+typedef struct
+{
+    UINT64  address;  /* USBPCAP_SHARED_RING_HEADER in the calling process */
+    UINT32  size;     /* Size of the producer mapping in bytes */
+    UINT32  reserved;
+    UINT64  consumer; /* USBPCAP_SHARED_RING_CONSUMER in the calling process */
+} USBPCAP_IOCTL_MAPPED_BUFFER, *PUSBPCAP_IOCTL_MAPPED_BUFFER;
+
+/* USBPCAP_IOCTL_STATISTICS is output parameter structure of
+ * IOCTL_USBPCAP_GET_STATISTICS.
+ *
+ * Counters are reset when the capture handle is closed.
+ * Packet is counted as dropped when there was no space left for it in the
+ * capture buffer. bufferHighWater is the maximum number of bytes that were
+ * in use in the capture buffer. When per-CPU buffers are used, both
+ * bufferHighWater and bufferSize refer to the single processor buffer.
+ * Packet is counted as evicted when it was captured but removed from the
+ * capture buffer before it was read (USBPCAP_CAPTURE_FLAG_OVERWRITE_OLDEST
+ * or IOCTL_USBPCAP_SET_TRIGGER). Evicted packets are counted as captured
+ * too. bytesDropped and bytesEvicted count the bytes the packets took in
+ * the capture buffer. urbsUnpaired counts URBs that were to be captured
+ * only on completion (USBPCAP_CAPTURE_FLAG_COMPLETION_ONLY), but whose
+ * submission could not be stored and was captured as separate record.
+ */
+typedef struct
+{
+    UINT64  packetsCaptured;
+    UINT64  packetsDropped;
+    UINT64  bytesDropped;
+    UINT32  bufferHighWater;
+    UINT32  bufferSize;
+    UINT32  pendingReads;    /* Read requests waiting for data */
+    UINT32  reserved;
+    UINT64  packetsEvicted;
+    UINT64  bytesEvicted;
+    UINT64  urbsUnpaired;
+} USBPCAP_IOCTL_STATISTICS, *PUSBPCAP_IOCTL_STATISTICS;
+
+/*
+ * Shared capture ring layout, version 2.
+ *
+ * The buffer is mapped twice. The producer mapping starts with
+ * USBPCAP_SHARED_RING_HEADER and is read-only (on Windows 8 and newer,
+ * earlier systems cannot map it read-only). Ring data starts dataOffset
+ * bytes from the start of the producer mapping and is dataSize bytes
+ * long. The consumer mapping is a single writable page that starts with
+ * USBPCAP_SHARED_RING_CONSUMER; it holds the only fields the consumer
+ * writes. Data is the same byte stream ReadFile() would return: global pcap
+ * header followed by packet records.
+ *
+ * writeOffset and readOffset are monotonic byte counters. Byte at counter
+ * value X is stored at data[X % dataSize]. Bytes from readOffset up to
+ * writeOffset are ready to be consumed. Driver only increases writeOffset.
+ * Consumer only increases readOffset, once it no longer needs the data.
+ * Driver validates readOffset and ignores values outside of the valid
+ * range. Nothing else is ever read back from the mapping.
+ *
+ * Once the buffer is mapped, read requests fail and the only way to get
+ * the data is via the mapping.
+ *
+ * When there is no data, consumer sets consumerWaiting to non-zero value,
+ * checks writeOffset again and, if it is still unchanged, waits for the
+ * event passed in USBPCAP_IOCTL_MAP_BUFFER. Driver signals the event after
+ * increasing writeOffset if consumerWaiting is non-zero. Consumer clears
+ * consumerWaiting after wakeup.
+ *
+ * Fields updated by driver and by consumer are in separate pages.
+ */
+#define USBPCAP_SHARED_RING_MAGIC    0x53504355 /* "UCPS" */
+#define USBPCAP_SHARED_RING_VERSION  2
+
+/* Written only by driver */
+typedef struct _USBPCAP_SHARED_RING_HEADER
+{
+    UINT32           magic;       /* USBPCAP_SHARED_RING_MAGIC */
+    UINT32           version;     /* USBPCAP_SHARED_RING_VERSION */
+    UINT32           dataOffset;
+    UINT32           dataSize;
+    UINT8            reserved1[48];
+
+    volatile INT64   writeOffset;
+} USBPCAP_SHARED_RING_HEADER, *PUSBPCAP_SHARED_RING_HEADER;
+
+/* Written by consumer */
+typedef struct _USBPCAP_SHARED_RING_CONSUMER
+{
+    volatile INT64   readOffset;
+    volatile LONG    consumerWaiting;
+} USBPCAP_SHARED_RING_CONSUMER, *PUSBPCAP_SHARED_RING_CONSUMER;
+
+/*
+ * Packet filter program, see IOCTL_USBPCAP_SET_FILTER_PROGRAM.
+ *
+ * Instructions use classic BPF encoding and semantics with accumulator A,
+ * index register X and USBPCAP_FILTER_MEMWORDS scratch memory words. A, X
+ * and scratch memory are zero when the program starts.
+ * Packet data is USBPCAP_BUFFER_PACKET_HEADER (headerLen bytes, including
+ * transfer specific header) followed by the packet payload, exactly as
+ * stored in the capture. Unlike BPF, multi-byte loads are little endian
+ * as all USBPcap header fields are. Length (USBPCAP_FILTER_LEN) is the
+ * packet length before snaplen is applied.
+ *
+ * Program returns the number of packet bytes to capture: 0 drops the
+ * packet, values larger than snaplen are limited to snaplen. Loads outside
+ * packet data end the program with 0.
+ *
+ * Jumps go only forward and the last instruction must be return, so every
+ * program terminates.
+ */
+#define USBPCAP_FILTER_MAX_INSNS  512
+#define USBPCAP_FILTER_MEMWORDS   16
+
+/* Instruction classes */
+#define USBPCAP_FILTER_CLASS(code) ((code) & 0x07)
+#define USBPCAP_FILTER_LD         0x00
+#define USBPCAP_FILTER_LDX        0x01
+#define USBPCAP_FILTER_ST         0x02
+#define USBPCAP_FILTER_STX        0x03
+#define USBPCAP_FILTER_ALU        0x04
+#define USBPCAP_FILTER_JMP        0x05
+#define USBPCAP_FILTER_RET        0x06
+#define USBPCAP_FILTER_MISC       0x07
+
+/* Load size */
+#define USBPCAP_FILTER_SIZE(code) ((code) & 0x18)
+#define USBPCAP_FILTER_W          0x00
+#define USBPCAP_FILTER_H          0x08
+#define USBPCAP_FILTER_B          0x10
+
+/* Load mode */
+#define USBPCAP_FILTER_MODE(code) ((code) & 0xe0)
+#define USBPCAP_FILTER_IMM        0x00
+#define USBPCAP_FILTER_ABS        0x20
+#define USBPCAP_FILTER_IND        0x40
+#define USBPCAP_FILTER_MEM        0x60
+#define USBPCAP_FILTER_LEN        0x80
+
+/* ALU and jump operations */
+#define USBPCAP_FILTER_OP(code)   ((code) & 0xf0)
+#define USBPCAP_FILTER_ADD        0x00
+#define USBPCAP_FILTER_SUB        0x10
+#define USBPCAP_FILTER_MUL        0x20
+#define USBPCAP_FILTER_DIV        0x30
+#define USBPCAP_FILTER_OR         0x40
+#define USBPCAP_FILTER_AND        0x50
+#define USBPCAP_FILTER_LSH        0x60
+#define USBPCAP_FILTER_RSH        0x70
+#define USBPCAP_FILTER_NEG        0x80
+#define USBPCAP_FILTER_MOD        0x90
+#define USBPCAP_FILTER_XOR        0xa0
+
+#define USBPCAP_FILTER_JA         0x00
+#define USBPCAP_FILTER_JEQ        0x10
+#define USBPCAP_FILTER_JGT        0x20
+#define USBPCAP_FILTER_JGE        0x30
+#define USBPCAP_FILTER_JSET       0x40
+
+/* Operand source */
+#define USBPCAP_FILTER_SRC(code)  ((code) & 0x08)
+#define USBPCAP_FILTER_K          0x00
+#define USBPCAP_FILTER_X          0x08
+
+/* Return value */
+#define USBPCAP_FILTER_RVAL(code) ((code) & 0x18)
+#define USBPCAP_FILTER_A          0x10
+
+/* Register transfer */
+#define USBPCAP_FILTER_MISCOP(code) ((code) & 0xf8)
+#define USBPCAP_FILTER_TAX        0x00
+#define USBPCAP_FILTER_TXA        0x80
+
+typedef struct
+{
+    UINT16  code;
+    UINT8   jt;    /* Instructions to skip if condition is true */
+    UINT8   jf;    /* Instructions to skip if condition is false */
+    UINT32  k;
+} USBPCAP_FILTER_INSN, *PUSBPCAP_FILTER_INSN;
+
+/* USBPCAP_IOCTL_FILTER_PROGRAM is parameter structure to
+ * IOCTL_USBPCAP_SET_FILTER_PROGRAM. Input buffer length must be exactly
+ * FIELD_OFFSET(USBPCAP_IOCTL_FILTER_PROGRAM, insns) +
+ * count * sizeof(USBPCAP_FILTER_INSN). count 0 removes the program.
+ * Program can be changed only before the buffer is set up with
+ * IOCTL_USBPCAP_SETUP_BUFFER.
+ */
+typedef struct
+{
+    UINT32               count;
+    UINT32               reserved;
+    USBPCAP_FILTER_INSN  insns[1];
+} USBPCAP_IOCTL_FILTER_PROGRAM, *PUSBPCAP_IOCTL_FILTER_PROGRAM;
+
+/*
+ * Submit-to-completion latency histograms, see IOCTL_USBPCAP_GET_LATENCY.
+ *
+ * Latency is the time between the URB being passed down to the bus driver
+ * and its completion. Bucket 0 counts URBs completed in less than 1
+ * microsecond, bucket N counts URBs completed in [2^(N-1), 2^N)
+ * microseconds. The last bucket counts all longer ones as well.
+ */
+#define USBPCAP_LATENCY_BUCKETS        32
+#define USBPCAP_LATENCY_MAX_ENDPOINTS  64
+
+typedef struct
+{
+    UINT16  device;
+    UINT8   endpoint;  /* Endpoint address */
+    UINT8   transfer;  /* USBPCAP_TRANSFER_XXX */
+    UINT32  buckets[USBPCAP_LATENCY_BUCKETS];
+} USBPCAP_LATENCY_HISTOGRAM, *PUSBPCAP_LATENCY_HISTOGRAM;
+
+/* USBPCAP_IOCTL_LATENCY is output parameter structure of
+ * IOCTL_USBPCAP_GET_LATENCY.
+ *
+ * IOCTL_USBPCAP_START_LATENCY clears the histograms and starts measuring
+ * the URBs of devices selected with IOCTL_USBPCAP_START_FILTERING. Capture
+ * buffer is not required. Measurement stops when the capture handle is
+ * closed. URBs that did not fit into the histograms or into the in-flight
+ * URB table are counted in untracked.
+ */
+typedef struct
+{
+    UINT16                     bus;
+    UINT16                     count;      /* Number of valid histograms */
+    UINT32                     untracked;
+    USBPCAP_LATENCY_HISTOGRAM  histograms[USBPCAP_LATENCY_MAX_ENDPOINTS];
+} USBPCAP_IOCTL_LATENCY, *PUSBPCAP_IOCTL_LATENCY;
+
+/*
+ * Per endpoint traffic counters, see IOCTL_USBPCAP_GET_ENDPOINT_STATS.
+ *
+ * Counters are updated when URB completes. Control endpoint is counted
+ * separately for each direction.
+ *
+ * Failed URBs (stalls included) are also counted by USBD_STATUS. Up to
+ * USBPCAP_ENDPOINT_STATUSES different statuses are kept per endpoint,
+ * failures with any other status are counted in otherFailed.
+ */
+#define USBPCAP_ENDPOINT_STATS_MAX  64
+#define USBPCAP_ENDPOINT_STATUSES   4
+
+typedef struct
+{
+    UINT32  status;     /* USBD_STATUS */
+    UINT32  count;      /* Failed URBs, 0 if entry is unused */
+} USBPCAP_ENDPOINT_STATUS_COUNT, *PUSBPCAP_ENDPOINT_STATUS_COUNT;
+
+typedef struct
+{
+    UINT16  device;
+    UINT8   endpoint;   /* Endpoint address, including direction bit */
+    UINT8   transfer;   /* USBPCAP_TRANSFER_XXX */
+    UINT32  otherFailed; /* Failed URBs with status not in failed */
+    UINT64  urbs;       /* Completed URBs */
+    UINT64  bytes;      /* Transfer buffer length of completed URBs */
+    UINT32  errors;     /* Failed URBs, excluding stalls */
+    UINT32  stalls;     /* URBs failed with stall or halted endpoint */
+    USBPCAP_ENDPOINT_STATUS_COUNT  failed[USBPCAP_ENDPOINT_STATUSES];
+} USBPCAP_ENDPOINT_COUNTERS, *PUSBPCAP_ENDPOINT_COUNTERS;
+
+/* USBPCAP_IOCTL_ENDPOINT_STATS is output parameter structure of
+ * IOCTL_USBPCAP_GET_ENDPOINT_STATS.
+ *
+ * IOCTL_USBPCAP_START_ENDPOINT_STATS clears the counters and starts
+ * counting URBs of devices selected with IOCTL_USBPCAP_START_FILTERING.
+ * Capture buffer is not required, so the URBs can be counted without
+ * capturing any packets. Counting stops when the capture handle is
+ * closed. timestamp is the system time (100 ns units since 1601-01-01)
+ * the counters were read at. URBs of endpoints that did not fit into the
+ * table are counted in untracked.
+ */
+typedef struct
+{
+    UINT16                     bus;
+    UINT16                     count;      /* Number of valid endpoints */
+    UINT32                     untracked;
+    UINT64                     timestamp;
+    USBPCAP_ENDPOINT_COUNTERS  endpoints[USBPCAP_ENDPOINT_STATS_MAX];
+} USBPCAP_IOCTL_ENDPOINT_STATS, *PUSBPCAP_IOCTL_ENDPOINT_STATS;
+
+/*
+ * Capture trigger, see IOCTL_USBPCAP_SET_TRIGGER.
+ *
+ * While trigger is set, packets are captured continuously and, when the
+ * buffer is full, the oldest packets are evicted to make space for new
+ * ones. Reads are held until a packet matching the trigger is captured,
+ * followed by postCount more packets. Capture then stops and the buffer
+ * holds the packets around the trigger, starting with the global header.
+ * Once the buffer is read completely, reads complete with 0 bytes.
+ */
+#define USBPCAP_TRIGGER_NONE     0
+#define USBPCAP_TRIGGER_STATUS   1 /* URB completed with status */
+#define USBPCAP_TRIGGER_STALL    2 /* URB completed with stall or halted endpoint */
+#define USBPCAP_TRIGGER_SETUP    3 /* Control SETUP packet matches pattern */
+#define USBPCAP_TRIGGER_PAYLOAD  4 /* Payload at offset matches pattern */
+
+/* Match only packets of given device or endpoint */
+#define USBPCAP_TRIGGER_FLAG_DEVICE    0x00000001
+#define USBPCAP_TRIGGER_FLAG_ENDPOINT  0x00000002
+
+#define USBPCAP_TRIGGER_MAX_PATTERN  16
+
+/* USBPCAP_IOCTL_TRIGGER is parameter structure to IOCTL_USBPCAP_SET_TRIGGER.
+ * Trigger can be changed only before the buffer is set up with
+ * IOCTL_USBPCAP_SETUP_BUFFER and cannot be combined with per-CPU or mapped
+ * buffer. Type USBPCAP_TRIGGER_NONE removes the trigger.
+ *
+ * Pattern bytes are compared under mask. SETUP pattern is compared with
+ * the 8 bytes of SETUP data and must not be longer, offset must be 0.
+ * PAYLOAD pattern is compared with packet payload (data following the
+ * USBPcap header) starting at offset.
+ */
+typedef struct
+{
+    UINT32  type;       /* USBPCAP_TRIGGER_XXX */
+    UINT32  flags;      /* USBPCAP_TRIGGER_FLAG_XXX */
+    UINT32  postCount;  /* Packets captured after the trigger packet */
+    UINT32  status;     /* USBD_STATUS, only for USBPCAP_TRIGGER_STATUS */
+    UINT16  device;     /* With USBPCAP_TRIGGER_FLAG_DEVICE */
+    UINT8   endpoint;   /* With USBPCAP_TRIGGER_FLAG_ENDPOINT, including direction bit */
+    UINT8   length;     /* Pattern length */
+    UINT32  offset;     /* Payload offset of the pattern */
+    UINT8   pattern[USBPCAP_TRIGGER_MAX_PATTERN];
+    UINT8   mask[USBPCAP_TRIGGER_MAX_PATTERN];
+} USBPCAP_IOCTL_TRIGGER, *PUSBPCAP_IOCTL_TRIGGER;
+
 #pragma pack(push)
 #pragma pack(1)
 /* USBPCAP_ADDRESS_FILTER is parameter structure to IOCTL_USBPCAP_START_FILTERING. */
@@ -39,8 +477,46 @@ typedef struct _USBPCAP_ADDRESS_FILTER
     /* Filter all devices */
     BOOLEAN filterAll;
 } USBPCAP_ADDRESS_FILTER, *PUSBPCAP_ADDRESS_FILTER;
+
+/* USBPCAP_ENDPOINT_FILTER is extended parameter structure to
+ * IOCTL_USBPCAP_START_FILTERING. Driver recognizes it by input buffer
+ * length. Devices are selected by address filter, endpoints and transfer
+ * types narrow down what is captured from selected devices.
+ *
+ * USBPCAP_ADDRESS_FILTER alone is equivalent to all endpoint bits and all
+ * transfer types set.
+ */
+typedef struct _USBPCAP_ENDPOINT_FILTER
+{
+    USBPCAP_ADDRESS_FILTER address;
+
+    /* Captured transfer types, USBPCAP_TRANSFER_MASK(USBPCAP_TRANSFER_XXX).
+     * Only isochronous, interrupt, control and bulk can be masked.
+     */
+    UINT32 transferTypes;
+
+    /* Endpoint bit array, indexed by device address:
+     *
+     * endpoints[address] bits 0 - 15  - OUT endpoints 0 - 15
+     * endpoints[address] bits 16 - 31 - IN endpoints 0 - 15
+     *
+     * Control endpoint 0 packets are captured if bit of endpoint 0 in the
+     * transfer direction is set. Packets for endpoints not known to the
+     * driver are captured regardless of endpoint bits.
+     */
+    UINT32 endpoints[128];
+} USBPCAP_ENDPOINT_FILTER, *PUSBPCAP_ENDPOINT_FILTER;
 #pragma pack(pop)
 
+#define USBPCAP_TRANSFER_MASK(transfer)  (1 << (transfer))
+#define USBPCAP_TRANSFER_MASK_ALL        0x0000000F
+
+/* Bit of endpoint (USB endpoint address, direction in bit 7) in
+ * USBPCAP_ENDPOINT_FILTER endpoints array element.
+ */
+#define USBPCAP_ENDPOINT_BIT(endpoint) \
+    (1UL << (((endpoint) & 0x0F) | (((endpoint) & 0x80) ? 16 : 0)))
+
 #define IOCTL_USBPCAP_SETUP_BUFFER \
     CTL_CODE(FILE_DEVICE_UNKNOWN, 0x800, METHOD_BUFFERED, FILE_READ_ACCESS)
 
@@ -56,6 +532,39 @@ typedef struct _USBPCAP_ADDRESS_FILTER
 #define IOCTL_USBPCAP_SET_SNAPLEN_SIZE \
     CTL_CODE(FILE_DEVICE_UNKNOWN, 0x804, METHOD_BUFFERED, FILE_READ_ACCESS)
 
+#define IOCTL_USBPCAP_SET_READ_WAKEUP \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x807, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define IOCTL_USBPCAP_SET_CAPTURE_FLAGS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x805, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define IOCTL_USBPCAP_MAP_BUFFER \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x806, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define IOCTL_USBPCAP_GET_STATISTICS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x808, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define IOCTL_USBPCAP_SET_FILTER_PROGRAM \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x809, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define IOCTL_USBPCAP_SET_SNAPLEN_TABLE \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80A, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define IOCTL_USBPCAP_START_LATENCY \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80B, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define IOCTL_USBPCAP_GET_LATENCY \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80C, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define IOCTL_USBPCAP_START_ENDPOINT_STATS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80D, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define IOCTL_USBPCAP_GET_ENDPOINT_STATS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80E, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define IOCTL_USBPCAP_SET_TRIGGER \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80F, METHOD_BUFFERED, FILE_READ_ACCESS)
+
 /* USB packets, beginning with a USBPcap header */
 #define DLT_USBPCAP         249
 
@@ -80,6 +589,98 @@ typedef struct pcaprec_hdr_s {
 } pcaprec_hdr_t;
 #pragma pack(pop)
 
+/* pcapng blocks. Every block is padded to 32 bits and ends with
+ * UINT32 copy of block_total_length.
+ */
+#define PCAPNG_BLOCK_TYPE_SHB    0x0A0D0D0A /* Section Header Block */
+#define PCAPNG_BLOCK_TYPE_IDB    0x00000001 /* Interface Description Block */
+#define PCAPNG_BLOCK_TYPE_ISB    0x00000005 /* Interface Statistics Block */
+#define PCAPNG_BLOCK_TYPE_EPB    0x00000006 /* Enhanced Packet Block */
+
+#define PCAPNG_BYTE_ORDER_MAGIC  0x1A2B3C4D
+
+#define PCAPNG_OPT_ENDOFOPT      0
+#define PCAPNG_OPT_COMMENT       1
+#define PCAPNG_IF_NAME           2
+#define PCAPNG_IF_TSRESOL        9
+#define PCAPNG_ISB_STARTTIME     2
+#define PCAPNG_ISB_ENDTIME       3
+#define PCAPNG_ISB_IFRECV        4
+#define PCAPNG_ISB_IFDROP        5
+
+/* if_tsresol of USBPcap interfaces, timestamps are in 100 ns units
+ * since 1970-01-01 00:00:00 UTC.
+ */
+#define USBPCAP_PCAPNG_TSRESOL   7
+
+#pragma pack(push, 1)
+typedef struct pcapng_shb_s {
+    UINT32 block_type;         /* PCAPNG_BLOCK_TYPE_SHB */
+    UINT32 block_total_length;
+    UINT32 byte_order_magic;   /* PCAPNG_BYTE_ORDER_MAGIC */
+    UINT16 version_major;      /* 1 */
+    UINT16 version_minor;      /* 0 */
+    INT64  section_length;     /* -1 if not specified */
+} pcapng_shb_t;
+
+typedef struct pcapng_idb_s {
+    UINT32 block_type;         /* PCAPNG_BLOCK_TYPE_IDB */
+    UINT32 block_total_length;
+    UINT16 linktype;
+    UINT16 reserved;
+    UINT32 snaplen;
+} pcapng_idb_t;
+
+typedef struct pcapng_epb_s {
+    UINT32 block_type;         /* PCAPNG_BLOCK_TYPE_EPB */
+    UINT32 block_total_length;
+    UINT32 interface_id;
+    UINT32 timestamp_high;
+    UINT32 timestamp_low;
+    UINT32 captured_len;       /* number of octets of packet saved in file */
+    UINT32 packet_len;         /* actual length of packet */
+} pcapng_epb_t;
+
+typedef struct pcapng_isb_s {
+    UINT32 block_type;         /* PCAPNG_BLOCK_TYPE_ISB */
+    UINT32 block_total_length;
+    UINT32 interface_id;
+    UINT32 timestamp_high;
+    UINT32 timestamp_low;
+} pcapng_isb_t;
+
+typedef struct pcapng_option_s {
+    UINT16 option_code;
+    UINT16 option_length;      /* value length without padding */
+} pcapng_option_t;
+#pragma pack(pop)
+
+/* Global header written by driver when USBPCAP_CAPTURE_FLAG_PCAPNG is set:
+ * Section Header Block followed by single Interface Description Block
+ * with if_tsresol option.
+ */
+#pragma pack(push, 1)
+typedef struct
+{
+    pcapng_shb_t     shb;
+    UINT32           shbTotalLength;
+    pcapng_idb_t     idb;
+    pcapng_option_t  tsresolOption;
+    UINT8            tsresol;        /* USBPCAP_PCAPNG_TSRESOL */
+    UINT8            tsresolPadding[3];
+    pcapng_option_t  endOfOptions;
+    UINT32           idbTotalLength;
+} USBPCAP_PCAPNG_HEADER, *PUSBPCAP_PCAPNG_HEADER;
+#pragma pack(pop)
+
+/* Minimum read length when USBPCAP_CAPTURE_FLAG_WHOLE_RECORDS is set.
+ * Large enough for the global header and the largest packet record
+ * in either format.
+ */
+#define USBPCAP_WHOLE_RECORDS_MIN_READ(snaplen) \
+    (sizeof(USBPCAP_PCAPNG_HEADER) + sizeof(pcapng_epb_t) + \
+     (((snaplen) + 3) & ~3) + sizeof(UINT32) + sizeof(USBPCAP_READ_TRAILER))
+
 /* All multi-byte fields are stored in .pcap file in little endian */
 
 #define USBPCAP_TRANSFER_ISOCHRONOUS 0
@@ -176,6 +777,17 @@ typedef struct
 } USBPCAP_BUFFER_ISOCH_HEADER, *PUSBPCAP_BUFFER_ISOCH_HEADER;
 #pragma pack(pop)
 
+/* Bulk and interrupt completion header when the URB was paired with its
+ * submission (see USBPCAP_CAPTURE_FLAG_COMPLETION_ONLY)
+ */
+#pragma pack(push, 1)
+typedef struct
+{
+    USBPCAP_BUFFER_PACKET_HEADER  header;
+    UINT64                        submitTimestamp;
+} USBPCAP_BUFFER_COMPLETION_HEADER, *PUSBPCAP_BUFFER_COMPLETION_HEADER;
+#pragma pack(pop)
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/*
+ * Device address and endpoint filter bitmaps, checked against a plain
+ * model for every address, endpoint and transfer type.
+ */
+
+#include "USBPcapCaptureFilter.h"
+#include "test.h"
+
+static void test_address(void)
+{
+    USBPCAP_ADDRESS_FILTER filter;
+    int address;
+
+    memset(&filter, 0, sizeof(filter));
+    for (address = 0; address < 128; address++)
+    {
+        CHECK(!USBPcapIsDeviceFiltered(&filter, address));
+    }
+
+    /* Word boundaries */
+    CHECK(USBPcapSetDeviceFiltered(&filter, 0));
+    CHECK(USBPcapSetDeviceFiltered(&filter, 31));
+    CHECK(USBPcapSetDeviceFiltered(&filter, 32));
+    CHECK(USBPcapSetDeviceFiltered(&filter, 127));
+    CHECK(!USBPcapSetDeviceFiltered(&filter, -1));
+    CHECK(!USBPcapSetDeviceFiltered(&filter, 128));
+    CHECK_EQ(filter.addresses[0], 0x80000001);
+    CHECK_EQ(filter.addresses[1], 0x00000001);
+    CHECK_EQ(filter.addresses[2], 0);
+    CHECK_EQ(filter.addresses[3], 0x80000000);
+
+    for (address = 0; address < 128; address++)
+    {
+        BOOLEAN expected = (address == 0 || address == 31 ||
+                            address == 32 || address == 127);
+        CHECK_EQ(USBPcapIsDeviceFiltered(&filter, address), expected);
+    }
+
+    /* Invalid addresses are assumed to be filtered */
+    CHECK(USBPcapIsDeviceFiltered(&filter, -1));
+    CHECK(USBPcapIsDeviceFiltered(&filter, 128));
+
+    memset(&filter, 0, sizeof(filter));
+    filter.filterAll = TRUE;
+    for (address = 0; address < 128; address++)
+    {
+        CHECK(USBPcapIsDeviceFiltered(&filter, address));
+    }
+
+    TEST_PASS("address");
+}
+
+static void test_init(void)
+{
+    USBPCAP_ADDRESS_FILTER address;
+    USBPCAP_ENDPOINT_FILTER filter;
+    int i;
+
+    memset(&address, 0, sizeof(address));
+    address.addresses[1] = 0x1234;
+    address.filterAll = TRUE;
+
+    memset(&filter, 0x5A, sizeof(filter));
+    USBPcapInitEndpointFilter(&filter, &address);
+    CHECK(memcmp(&filter.address, &address, sizeof(address)) == 0);
+    CHECK_EQ(filter.transferTypes, USBPCAP_TRANSFER_MASK_ALL);
+    for (i = 0; i < 128; i++)
+    {
+        CHECK_EQ(filter.endpoints[i], 0xFFFFFFFF);
+    }
+
+    USBPcapInitEndpointFilter(&filter, NULL);
+    CHECK(!filter.address.filterAll);
+    for (i = 0; i < 4; i++)
+    {
+        CHECK_EQ(filter.address.addresses[i], 0);
+    }
+
+    TEST_PASS("init");
+}
+
+/* What USBPCAP_ENDPOINT_FILTER documentation says */
+static BOOLEAN model(PUSBPCAP_ENDPOINT_FILTER filter, int address,
+                     int endpoint, int transfer)
+{
+    int bit;
+
+    if (transfer <= USBPCAP_TRANSFER_BULK &&
+        !((filter->transferTypes >> transfer) & 1))
+    {
+        return FALSE;
+    }
+    if (endpoint == 0xFF || address < 0 || address > 127)
+    {
+        return TRUE;
+    }
+    bit = (endpoint & 0x0F) + ((endpoint & 0x80) ? 16 : 0);
+    return ((filter->endpoints[address] >> bit) & 1) ? TRUE : FALSE;
+}
+
+static void test_endpoints(void)
+{
+    static const int transfers[] =
+    {
+        USBPCAP_TRANSFER_ISOCHRONOUS, USBPCAP_TRANSFER_INTERRUPT,
+        USBPCAP_TRANSFER_CONTROL, USBPCAP_TRANSFER_BULK,
+        USBPCAP_TRANSFER_IRP_INFO, USBPCAP_TRANSFER_UNKNOWN,
+    };
+    USBPCAP_ENDPOINT_FILTER filter;
+    uint32_t seed = 0xe9d;
+    int round;
+
+    for (round = 0; round < 20; round++)
+    {
+        int address, i;
+
+        USBPcapInitEndpointFilter(&filter, NULL);
+        if (round > 0)
+        {
+            filter.transferTypes = test_random(&seed) &
+                                   USBPCAP_TRANSFER_MASK_ALL;
+            for (i = 0; i < 128; i++)
+            {
+                filter.endpoints[i] = (round == 1) ? 0 : test_random(&seed);
+            }
+        }
+
+        for (address = -1; address <= 128; address++)
+        {
+            int endpoint;
+
+            for (endpoint = 0; endpoint <= 0xFF; endpoint++)
+            {
+                /* Direction bit and endpoint number only, or unknown */
+                if ((endpoint & 0x70) && endpoint != 0xFF)
+                {
+                    continue;
+                }
+                for (i = 0; i < (int)(sizeof(transfers) / sizeof(transfers[0])); i++)
+                {
+                    CHECK_EQ(USBPcapIsEndpointFiltered(&filter, address,
+                                                       (UCHAR)endpoint,
+                                                       (UCHAR)transfers[i]),
+                             model(&filter, address, endpoint, transfers[i]));
+                }
+            }
+        }
+    }
+
+    /* IN and OUT endpoints with the same number are separate */
+    USBPcapInitEndpointFilter(&filter, NULL);
+    filter.endpoints[5] = USBPCAP_ENDPOINT_BIT(0x81);
+    CHECK(USBPcapIsEndpointFiltered(&filter, 5, 0x81, USBPCAP_TRANSFER_BULK));
+    CHECK(!USBPcapIsEndpointFiltered(&filter, 5, 0x01, USBPCAP_TRANSFER_BULK));
+    CHECK(!USBPcapIsEndpointFiltered(&filter, 5, 0x82, USBPCAP_TRANSFER_BULK));
+    CHECK(USBPcapIsEndpointFiltered(&filter, 6, 0x01, USBPCAP_TRANSFER_BULK));
+
+    TEST_PASS("endpoints");
+}
+
+static void test_armed(void)
+{
+    USBPCAP_ENDPOINT_FILTER filter;
+
+    USBPcapInitEndpointFilter(&filter, NULL);
+    USBPcapSetDeviceFiltered(&filter.address, 5);
+    CHECK(!USBPcapIsAddressArmed(&filter, 0, 5));
+    CHECK(USBPcapIsAddressArmed(&filter, 1, 5));
+    CHECK(!USBPcapIsAddressArmed(&filter, 1, 6));
+
+    filter.address.filterAll = TRUE;
+    CHECK(!USBPcapIsAddressArmed(&filter, 0, 6));
+    CHECK(USBPcapIsAddressArmed(&filter, 1, 6));
+
+    TEST_PASS("armed");
+}
+
+int main(void)
+{
+    test_address();
+    test_init();
+    test_endpoints();
+    test_armed();
+    return 0;
+}
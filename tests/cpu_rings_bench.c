@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/*
+ * Single shared ring versus per-CPU staging rings merged by the reader,
+ * at 1 to 64 simulated processors. Every simulated processor is a thread
+ * storing compact records; the reader drains pcapng blocks in whole
+ * records like an application read does.
+ */
+
+#include <pthread.h>
+
+#include "USBPcapCpuRings.h"
+#include "test.h"
+#include "records.h"
+
+#define BUFFER_BYTES  (4 * 1024 * 1024)
+#define PAYLOAD       64
+#define MAX_CPUS      64
+
+static USBPCAP_RING      ring;
+static USBPCAP_CPU_RINGS cpuRings;
+static int               perCpu;
+static unsigned          recordsPerCpu;
+static volatile UINT64   timeSource;
+
+static void *producer_thread(void *arg)
+{
+    UCHAR data[PAYLOAD];
+    unsigned i;
+
+    UsbpcapHostProcessor = (ULONG)(uintptr_t)arg;
+    memset(data, 0x5A, sizeof(data));
+
+    for (i = 0; i < recordsPerCpu; )
+    {
+        PUSBPCAP_RING target = perCpu ? USBPcapCpuRingsGetCurrent(&cpuRings) :
+                                        &ring;
+        UINT64 timestamp;
+
+        USBPcapRingEnter(target);
+        timestamp = __atomic_add_fetch(&timeSource, 1, __ATOMIC_RELAXED);
+        if (NT_SUCCESS(test_store_record(target, timestamp, i,
+                                         data, sizeof(data))))
+        {
+            i++;
+        }
+        else
+        {
+            sched_yield();
+        }
+        USBPcapRingLeave(target);
+    }
+    return NULL;
+}
+
+static UINT32 drain(PUCHAR dest, UINT32 size, PUINT32 records)
+{
+    UINT32 total = 0;
+    UINT32 bytes;
+
+    if (perCpu)
+    {
+        return USBPcapCpuRingsReadWhole(&cpuRings, TRUE, dest, size, records);
+    }
+
+    while ((bytes = USBPcapRecordReadWhole(&ring, TRUE, &dest[total],
+                                           size - total)) > 0)
+    {
+        total += bytes;
+        (*records)++;
+    }
+    return total;
+}
+
+static void run(ULONG cpus, int mode)
+{
+    static UCHAR dest[256 * 1024];
+    pthread_t threads[MAX_CPUS];
+    UINT64 expected;
+    UINT64 total = 0;
+    uint64_t start, elapsed;
+    ULONG i;
+
+    perCpu = mode;
+    recordsPerCpu = 400000 * test_bench_scale() / cpus;
+    expected = (UINT64)recordsPerCpu * cpus;
+
+    if (perCpu)
+    {
+        UsbpcapHostProcessorCount = cpus;
+        CHECK(NT_SUCCESS(USBPcapCpuRingsInitialize(&cpuRings)));
+        CHECK(NT_SUCCESS(USBPcapCpuRingsSetUpBuffers(&cpuRings, BUFFER_BYTES)));
+        USBPcapCpuRingsThaw(&cpuRings);
+    }
+    else
+    {
+        USBPcapRingReset(&ring);
+    }
+
+    start = test_now_ns();
+    for (i = 0; i < cpus; i++)
+    {
+        pthread_create(&threads[i], NULL, producer_thread,
+                       (void *)(uintptr_t)i);
+    }
+    while (total < expected)
+    {
+        UINT32 records = 0;
+
+        drain(dest, sizeof(dest), &records);
+        if (records == 0)
+        {
+            sched_yield();
+        }
+        total += records;
+    }
+    for (i = 0; i < cpus; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    elapsed = test_now_ns() - start;
+
+    printf("%-8s cpus %2lu: %7.2f Mrec/s\n", perCpu ? "per-cpu" : "single",
+           (unsigned long)cpus, (double)expected * 1e3 / (double)elapsed);
+
+    if (perCpu)
+    {
+        USBPcapCpuRingsFree(&cpuRings);
+    }
+}
+
+int main(void)
+{
+    ULONG cpus;
+
+    USBPcapRingInitialize(&ring);
+    USBPcapRingAttachBuffer(&ring, malloc(BUFFER_BYTES), BUFFER_BYTES, 0);
+
+    for (cpus = 1; cpus <= MAX_CPUS; cpus *= 2)
+    {
+        run(cpus, 0);
+        run(cpus, 1);
+    }
+    return 0;
+}
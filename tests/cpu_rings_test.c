@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/*
+ * Per-CPU staging rings: merge order, in-flight producers and sizes.
+ */
+
+#include <pthread.h>
+
+#include "USBPcapCpuRings.h"
+#include "test.h"
+#include "records.h"
+
+#define CPUS          4
+#define RING_BYTES    (CPUS * 16 * 1024)
+
+static USBPCAP_CPU_RINGS cpuRings;
+
+static void setup(ULONG cpus, UINT32 bytes)
+{
+    UsbpcapHostProcessorCount = cpus;
+    CHECK(NT_SUCCESS(USBPcapCpuRingsInitialize(&cpuRings)));
+    CHECK(NT_SUCCESS(USBPcapCpuRingsSetUpBuffers(&cpuRings, bytes)));
+    USBPcapCpuRingsThaw(&cpuRings);
+}
+
+static void teardown(void)
+{
+    USBPcapCpuRingsFree(&cpuRings);
+}
+
+static void store(ULONG cpu, UINT64 timestamp, UINT64 irpId)
+{
+    PUSBPCAP_RING ring = &cpuRings.rings[cpu];
+    UCHAR data[64];
+
+    memset(data, (int)irpId, sizeof(data));
+    CHECK(USBPcapRingEnter(ring));
+    CHECK(NT_SUCCESS(test_store_record(ring, timestamp, irpId,
+                                       data, (UINT32)(irpId % sizeof(data)))));
+    USBPcapRingLeave(ring);
+}
+
+/* Committed records come out in global timestamp order, even when read
+ * in small pieces that split the records.
+ */
+static void test_merge_order(void)
+{
+    static UCHAR stream[RING_BYTES * 2];
+    UINT32 rnd = 7;
+    UINT32 filled = 0;
+    UINT32 pos = 0;
+    UINT64 stored = 0;
+    UINT64 expected = 0;
+    UINT64 clock = 1000;
+
+    setup(CPUS, RING_BYTES);
+
+    while (expected < 5000)
+    {
+        UINT32 burst = test_random(&rnd) % 32;
+
+        while ((burst-- > 0) && (stored < 5000) &&
+               (USBPcapCpuRingsGetUsed(&cpuRings) < RING_BYTES / 2))
+        {
+            clock += 1 + test_random(&rnd) % 3;
+            store(test_random(&rnd) % CPUS, clock, stored++);
+        }
+
+        filled += USBPcapCpuRingsRead(&cpuRings, TRUE, &stream[filled],
+                                      1 + test_random(&rnd) % 300);
+        for (;;)
+        {
+            USBPCAP_BUFFER_PACKET_HEADER header;
+            UINT64 timestamp;
+
+            if (!test_parse_epb(stream, filled, &pos, &timestamp, &header))
+            {
+                break;
+            }
+            CHECK_EQ(header.irpId, expected);
+            expected++;
+        }
+        memmove(stream, &stream[pos], filled - pos);
+        filled -= pos;
+        pos = 0;
+    }
+
+    CHECK_EQ(USBPcapCpuRingsGetUsed(&cpuRings), 0);
+    teardown();
+    TEST_PASS("merge_order");
+}
+
+/* Read stops before newer record when a producer is still writing to an
+ * empty ring, but never returns nothing while there is data.
+ */
+static void test_hold_in_flight(void)
+{
+    static UCHAR out[4096];
+    USBPCAP_BUFFER_PACKET_HEADER header;
+    UINT64 timestamp;
+    UINT32 bytes;
+    UINT32 pos = 0;
+
+    setup(2, 2 * 4096);
+
+    store(0, 100, 0);
+    store(0, 200, 2);
+
+    /* Producer on CPU 1 entered the ring, its record is not there yet */
+    CHECK(USBPcapRingEnter(&cpuRings.rings[1]));
+
+    bytes = USBPcapCpuRingsRead(&cpuRings, TRUE, out, sizeof(out));
+    CHECK(test_parse_epb(out, bytes, &pos, &timestamp, &header));
+    CHECK_EQ(header.irpId, 0);
+    CHECK_EQ(pos, bytes);
+
+    CHECK(NT_SUCCESS(test_store_record(&cpuRings.rings[1], 150, 1, NULL, 0)));
+    USBPcapRingLeave(&cpuRings.rings[1]);
+
+    bytes = USBPcapCpuRingsRead(&cpuRings, TRUE, out, sizeof(out));
+    pos = 0;
+    CHECK(test_parse_epb(out, bytes, &pos, &timestamp, &header));
+    CHECK_EQ(header.irpId, 1);
+    CHECK(test_parse_epb(out, bytes, &pos, &timestamp, &header));
+    CHECK_EQ(header.irpId, 2);
+    CHECK_EQ(pos, bytes);
+
+    teardown();
+    TEST_PASS("hold_in_flight");
+}
+
+static void test_size(void)
+{
+    setup(CPUS, RING_BYTES);
+    CHECK_EQ(USBPcapCpuRingsGetSize(&cpuRings), RING_BYTES);
+    teardown();
+
+    /* Every ring has at least minimum size */
+    setup(CPUS, 1024);
+    CHECK_EQ(USBPcapCpuRingsGetSize(&cpuRings), CPUS * 4096);
+    teardown();
+    TEST_PASS("size");
+}
+
+#define CONCURRENT_RECORDS 20000
+
+static volatile UINT64 concurrentClock;
+
+static void *producer_thread(void *arg)
+{
+    ULONG cpu = (ULONG)(uintptr_t)arg;
+    UCHAR data[32];
+    UINT32 seq = 0;
+
+    memset(data, 0, sizeof(data));
+    UsbpcapHostProcessor = cpu;
+
+    while (seq < CONCURRENT_RECORDS)
+    {
+        PUSBPCAP_RING ring = USBPcapCpuRingsGetCurrent(&cpuRings);
+        UINT64 timestamp;
+
+        CHECK(USBPcapRingEnter(ring));
+        /* Like USBPcapBufferStorePacket, timestamp after entering */
+        timestamp = __atomic_add_fetch(&concurrentClock, 1, __ATOMIC_SEQ_CST);
+        if (NT_SUCCESS(test_store_record(ring, timestamp,
+                                         ((UINT64)cpu << 32) | seq,
+                                         data, seq % sizeof(data))))
+        {
+            seq++;
+        }
+        USBPcapRingLeave(ring);
+        if ((seq & 15) == 0)
+        {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+/* Producers on simulated processors race with the reader. Each read
+ * returns records in timestamp order and every processor's records come
+ * out complete and in sequence.
+ */
+static void test_concurrent(void)
+{
+    static UCHAR out[16 * 1024];
+    pthread_t threads[CPUS];
+    UINT32 expected[CPUS] = { 0 };
+    UINT64 total = 0;
+    ULONG i;
+
+    setup(CPUS, RING_BYTES);
+    for (i = 0; i < CPUS; i++)
+    {
+        pthread_create(&threads[i], NULL, producer_thread,
+                       (void *)(uintptr_t)i);
+    }
+
+    while (total < (UINT64)CPUS * CONCURRENT_RECORDS)
+    {
+        UINT32 records = 0;
+        UINT32 bytes = USBPcapCpuRingsReadWhole(&cpuRings, TRUE, out,
+                                                sizeof(out), &records);
+        UINT32 pos = 0;
+        UINT64 last = 0;
+        USBPCAP_BUFFER_PACKET_HEADER header;
+        UINT64 timestamp;
+
+        while (test_parse_epb(out, bytes, &pos, &timestamp, &header))
+        {
+            ULONG cpu = (ULONG)(header.irpId >> 32);
+
+            CHECK(timestamp >= last);
+            last = timestamp;
+            CHECK(cpu < CPUS);
+            CHECK_EQ((UINT32)header.irpId, expected[cpu]);
+            expected[cpu]++;
+            total++;
+            records--;
+        }
+        CHECK_EQ(pos, bytes);
+        CHECK_EQ(records, 0);
+        if (bytes == 0)
+        {
+            sched_yield();
+        }
+    }
+
+    for (i = 0; i < CPUS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    teardown();
+    TEST_PASS("concurrent");
+}
+
+int main(void)
+{
+    test_merge_order();
+    test_hold_in_flight();
+    test_size();
+    test_concurrent();
+    return 0;
+}
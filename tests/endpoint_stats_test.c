@@ -0,0 +1,355 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/*
+ * Per endpoint traffic counters of USBPcapEndpointStats.c: counters of
+ * different processors are summed, failures are kept by status,
+ * endpoints that do not fit are untracked, snapshots hold exactly what
+ * was counted and concurrent completions lose no count.
+ */
+
+#include <pthread.h>
+
+#include "USBPcapEndpointStats.h"
+#include "test.h"
+
+#define CPUS  4
+
+static USBPCAP_ENDPOINT_STATS stats;
+static USBPCAP_IOCTL_ENDPOINT_STATS out;
+
+static void setup(ULONG cpus)
+{
+    UsbpcapHostProcessorCount = cpus;
+    USBPcapEndpointStatsInitialize(&stats);
+    CHECK(NT_SUCCESS(USBPcapEndpointStatsStart(&stats)));
+}
+
+static PUSBPCAP_ENDPOINT_COUNTERS find(PUSBPCAP_IOCTL_ENDPOINT_STATS snapshot,
+                                       USHORT device, UCHAR endpoint,
+                                       UCHAR transfer)
+{
+    UINT16 i;
+
+    for (i = 0; i < snapshot->count; i++)
+    {
+        PUSBPCAP_ENDPOINT_COUNTERS c = &snapshot->endpoints[i];
+
+        if ((c->device == device) && (c->endpoint == endpoint) &&
+            (c->transfer == transfer))
+        {
+            return c;
+        }
+    }
+    return NULL;
+}
+
+/* Returns failed URB count of given status, otherFailed for 0 */
+static UINT32 failed(PUSBPCAP_ENDPOINT_COUNTERS c, USBD_STATUS status)
+{
+    ULONG i;
+
+    if (status == 0)
+    {
+        return c->otherFailed;
+    }
+    for (i = 0; i < USBPCAP_ENDPOINT_STATUSES; i++)
+    {
+        if ((c->failed[i].count != 0) && (c->failed[i].status == (UINT32)status))
+        {
+            return c->failed[i].count;
+        }
+    }
+    return 0;
+}
+
+/* Counters of different processors are summed per endpoint */
+static void test_counters(void)
+{
+    PUSBPCAP_ENDPOINT_COUNTERS c;
+
+    setup(CPUS);
+    USBPcapEndpointStatsAdd(&stats, 0, 7, 0x81, USBPCAP_TRANSFER_BULK,
+                            512, USBD_STATUS_SUCCESS);
+    USBPcapEndpointStatsAdd(&stats, 3, 7, 0x81, USBPCAP_TRANSFER_BULK,
+                            100, USBD_STATUS_SUCCESS);
+    USBPcapEndpointStatsAdd(&stats, 6, 7, 0x81, USBPCAP_TRANSFER_BULK,
+                            0, USBD_STATUS_STALL_PID);
+    USBPcapEndpointStatsAdd(&stats, 1, 7, 0x81, USBPCAP_TRANSFER_BULK,
+                            0, USBD_STATUS_ENDPOINT_HALTED);
+    USBPcapEndpointStatsAdd(&stats, 2, 7, 0x81, USBPCAP_TRANSFER_BULK,
+                            0, USBD_STATUS_CANCELED);
+    /* Same endpoint address, other direction and transfer type */
+    USBPcapEndpointStatsAdd(&stats, 0, 7, 0x01, USBPCAP_TRANSFER_BULK,
+                            31, USBD_STATUS_SUCCESS);
+    USBPcapEndpointStatsAdd(&stats, 0, 0x7FFF, 0x00, USBPCAP_TRANSFER_CONTROL,
+                            8, USBD_STATUS_SUCCESS);
+
+    USBPcapEndpointStatsGet(&stats, &out);
+    CHECK_EQ(out.count, 3);
+    CHECK_EQ(out.untracked, 0);
+
+    c = find(&out, 7, 0x81, USBPCAP_TRANSFER_BULK);
+    CHECK(c != NULL);
+    CHECK_EQ(c->urbs, 5);
+    CHECK_EQ(c->bytes, 612);
+    CHECK_EQ(c->stalls, 2);
+    CHECK_EQ(c->errors, 1);
+    CHECK_EQ(failed(c, USBD_STATUS_STALL_PID), 1);
+    CHECK_EQ(failed(c, USBD_STATUS_ENDPOINT_HALTED), 1);
+    CHECK_EQ(failed(c, USBD_STATUS_CANCELED), 1);
+    CHECK_EQ(failed(c, 0), 0);
+    c = find(&out, 7, 0x01, USBPCAP_TRANSFER_BULK);
+    CHECK(c != NULL);
+    CHECK_EQ(c->urbs, 1);
+    CHECK_EQ(c->bytes, 31);
+    CHECK_EQ(c->errors + c->stalls, 0);
+    c = find(&out, 0x7FFF, 0x00, USBPCAP_TRANSFER_CONTROL);
+    CHECK(c != NULL);
+    CHECK_EQ(c->bytes, 8);
+
+    USBPcapEndpointStatsFree(&stats);
+    TEST_PASS("counters");
+}
+
+/* Statuses that do not fit, on single processor or once the processors
+ * are summed, are counted as other.
+ */
+static void test_statuses(void)
+{
+    PUSBPCAP_ENDPOINT_COUNTERS c;
+    ULONG i;
+
+    setup(2);
+    /* Processor 0 fills its entries, the fifth status is other */
+    for (i = 0; i <= USBPCAP_ENDPOINT_STATUSES; i++)
+    {
+        USBPcapEndpointStatsAdd(&stats, 0, 1, 0x81, USBPCAP_TRANSFER_BULK,
+                                0, (USBD_STATUS)(0xC0000100 + i));
+    }
+    USBPcapEndpointStatsAdd(&stats, 0, 1, 0x81, USBPCAP_TRANSFER_BULK,
+                            0, (USBD_STATUS)0xC0000100);
+    /* Processor 1 has one known and one new status */
+    USBPcapEndpointStatsAdd(&stats, 1, 1, 0x81, USBPCAP_TRANSFER_BULK,
+                            0, (USBD_STATUS)0xC0000101);
+    USBPcapEndpointStatsAdd(&stats, 1, 1, 0x81, USBPCAP_TRANSFER_BULK,
+                            0, (USBD_STATUS)0xC0000200);
+    USBPcapEndpointStatsAdd(&stats, 1, 1, 0x81, USBPCAP_TRANSFER_BULK,
+                            0, (USBD_STATUS)0xC0000200);
+    /* Success is not failure */
+    USBPcapEndpointStatsAdd(&stats, 1, 1, 0x81, USBPCAP_TRANSFER_BULK,
+                            0, USBD_STATUS_SUCCESS);
+
+    USBPcapEndpointStatsGet(&stats, &out);
+    c = find(&out, 1, 0x81, USBPCAP_TRANSFER_BULK);
+    CHECK(c != NULL);
+    CHECK_EQ(c->urbs, 10);
+    CHECK_EQ(c->errors, 9);
+    CHECK_EQ(failed(c, (USBD_STATUS)0xC0000100), 2);
+    CHECK_EQ(failed(c, (USBD_STATUS)0xC0000101), 2);
+    CHECK_EQ(failed(c, (USBD_STATUS)0xC0000102), 1);
+    CHECK_EQ(failed(c, (USBD_STATUS)0xC0000103), 1);
+    CHECK_EQ(failed(c, (USBD_STATUS)0xC0000200), 0);
+    /* 0xC0000104 did not fit on processor 0, 0xC0000200 in the reply */
+    CHECK_EQ(failed(c, 0), 3);
+
+    USBPcapEndpointStatsFree(&stats);
+    TEST_PASS("statuses");
+}
+
+/* Endpoints that do not fit are untracked, known ones still count,
+ * nothing is counted while stopped and start clears everything.
+ */
+static void test_table_full(void)
+{
+    USHORT device;
+
+    setup(1);
+    for (device = 1; device <= USBPCAP_ENDPOINT_STATS_MAX + 5; device++)
+    {
+        USBPcapEndpointStatsAdd(&stats, 0, device, 0x82,
+                                USBPCAP_TRANSFER_INTERRUPT, 8,
+                                USBD_STATUS_SUCCESS);
+    }
+    USBPcapEndpointStatsGet(&stats, &out);
+    CHECK_EQ(out.count, USBPCAP_ENDPOINT_STATS_MAX);
+    CHECK_EQ(out.untracked, 5);
+    for (device = 1; device <= USBPCAP_ENDPOINT_STATS_MAX; device++)
+    {
+        CHECK(find(&out, device, 0x82, USBPCAP_TRANSFER_INTERRUPT) != NULL);
+    }
+
+    USBPcapEndpointStatsAdd(&stats, 0, 1, 0x82, USBPCAP_TRANSFER_INTERRUPT,
+                            8, USBD_STATUS_SUCCESS);
+    USBPcapEndpointStatsAdd(&stats, 0, 1, 0x83, USBPCAP_TRANSFER_INTERRUPT,
+                            8, USBD_STATUS_SUCCESS);
+    USBPcapEndpointStatsGet(&stats, &out);
+    CHECK_EQ(out.untracked, 6);
+    CHECK_EQ(find(&out, 1, 0x82, USBPCAP_TRANSFER_INTERRUPT)->urbs, 2);
+
+    USBPcapEndpointStatsStop(&stats);
+    USBPcapEndpointStatsAdd(&stats, 0, 1, 0x82, USBPCAP_TRANSFER_INTERRUPT,
+                            8, USBD_STATUS_SUCCESS);
+    USBPcapEndpointStatsAdd(&stats, 0, 1, 0x84, USBPCAP_TRANSFER_INTERRUPT,
+                            8, USBD_STATUS_SUCCESS);
+    USBPcapEndpointStatsGet(&stats, &out);
+    CHECK_EQ(out.untracked, 6);
+    CHECK_EQ(find(&out, 1, 0x82, USBPCAP_TRANSFER_INTERRUPT)->urbs, 2);
+
+    CHECK(NT_SUCCESS(USBPcapEndpointStatsStart(&stats)));
+    USBPcapEndpointStatsGet(&stats, &out);
+    CHECK_EQ(out.count, 0);
+    CHECK_EQ(out.untracked, 0);
+
+    USBPcapEndpointStatsFree(&stats);
+    TEST_PASS("table full");
+}
+
+/* Snapshot is complete and deterministic: unused entries are zeroed
+ * whatever the output buffer held and reading again without new
+ * completions returns the same bytes.
+ */
+static void test_snapshot(void)
+{
+    static USBPCAP_IOCTL_ENDPOINT_STATS again;
+    uint32_t seed = 0x5EED;
+    UINT64 urbs[16] = { 0 };
+    UINT64 bytes[16] = { 0 };
+    unsigned n;
+    UINT16 i;
+
+    setup(CPUS);
+    for (n = 0; n < 10000; n++)
+    {
+        ULONG key = test_random(&seed) % 16;
+        ULONG length = test_random(&seed) % 4096;
+
+        USBPcapEndpointStatsAdd(&stats, test_random(&seed), (USHORT)key,
+                                (UCHAR)(0x80 | key), USBPCAP_TRANSFER_ISOCHRONOUS,
+                                length, USBD_STATUS_SUCCESS);
+        urbs[key]++;
+        bytes[key] += length;
+    }
+
+    memset(&out, 0xA5, sizeof(out));
+    USBPcapEndpointStatsGet(&stats, &out);
+    memset(&again, 0x5A, sizeof(again));
+    USBPcapEndpointStatsGet(&stats, &again);
+    CHECK(memcmp(&out, &again, sizeof(out)) == 0);
+
+    CHECK_EQ(out.count, 16);
+    CHECK_EQ(out.bus, 0);
+    CHECK_EQ(out.timestamp, 0);
+    for (n = 0; n < 16; n++)
+    {
+        PUSBPCAP_ENDPOINT_COUNTERS c;
+
+        c = find(&out, (USHORT)n, (UCHAR)(0x80 | n), USBPCAP_TRANSFER_ISOCHRONOUS);
+        CHECK(c != NULL);
+        CHECK_EQ(c->urbs, urbs[n]);
+        CHECK_EQ(c->bytes, bytes[n]);
+    }
+    for (i = out.count; i < USBPCAP_ENDPOINT_STATS_MAX; i++)
+    {
+        static const USBPCAP_ENDPOINT_COUNTERS zero;
+
+        CHECK(memcmp(&out.endpoints[i], &zero, sizeof(zero)) == 0);
+    }
+
+    USBPcapEndpointStatsFree(&stats);
+    TEST_PASS("snapshot");
+}
+
+#define THREADS      CPUS
+#define ADDS         200000
+#define KEYS         24
+
+static USBD_STATUS status_of(ULONG thread, ULONG n)
+{
+    switch ((n * 7 + thread) % 16)
+    {
+        case 0:
+            return USBD_STATUS_STALL_PID;
+        case 1:
+            return USBD_STATUS_CANCELED;
+        default:
+            return USBD_STATUS_SUCCESS;
+    }
+}
+
+static void *adder(void *arg)
+{
+    ULONG thread = (ULONG)(uintptr_t)arg;
+    ULONG n;
+
+    for (n = 0; n < ADDS; n++)
+    {
+        /* Two threads share every processor slot */
+        USBPcapEndpointStatsAdd(&stats, (thread + n) % (THREADS / 2),
+                                (USHORT)(n % KEYS), 0x81, USBPCAP_TRANSFER_BULK,
+                                n % 1000, status_of(thread, n));
+    }
+    return NULL;
+}
+
+/* Concurrent completions lose no count */
+static void test_concurrent(void)
+{
+    static UINT64 urbs[KEYS], bytes[KEYS], stalls[KEYS], errors[KEYS];
+    pthread_t threads[THREADS];
+    ULONG i;
+    ULONG n;
+
+    setup(THREADS / 2);
+    for (i = 0; i < THREADS; i++)
+    {
+        for (n = 0; n < ADDS; n++)
+        {
+            USBD_STATUS status = status_of(i, n);
+
+            urbs[n % KEYS]++;
+            bytes[n % KEYS] += n % 1000;
+            stalls[n % KEYS] += (status == USBD_STATUS_STALL_PID) ? 1 : 0;
+            errors[n % KEYS] += (status == USBD_STATUS_CANCELED) ? 1 : 0;
+        }
+        pthread_create(&threads[i], NULL, adder, (void *)(uintptr_t)i);
+    }
+    for (i = 0; i < THREADS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    USBPcapEndpointStatsGet(&stats, &out);
+    CHECK_EQ(out.count, KEYS);
+    CHECK_EQ(out.untracked, 0);
+    for (n = 0; n < KEYS; n++)
+    {
+        PUSBPCAP_ENDPOINT_COUNTERS c = find(&out, (USHORT)n, 0x81,
+                                            USBPCAP_TRANSFER_BULK);
+
+        CHECK(c != NULL);
+        CHECK_EQ(c->urbs, urbs[n]);
+        CHECK_EQ(c->bytes, bytes[n]);
+        CHECK_EQ(c->stalls, stalls[n]);
+        CHECK_EQ(c->errors, errors[n]);
+        CHECK_EQ(failed(c, USBD_STATUS_STALL_PID), stalls[n]);
+        CHECK_EQ(failed(c, USBD_STATUS_CANCELED), errors[n]);
+        CHECK_EQ(failed(c, 0), 0);
+    }
+
+    USBPcapEndpointStatsFree(&stats);
+    TEST_PASS("concurrent");
+}
+
+int main(void)
+{
+    test_counters();
+    test_statuses();
+    test_table_full();
+    test_snapshot();
+    test_concurrent();
+    return 0;
+}
@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/*
+ * Endpoint lookup cost: the lock-free hash table of USBPcapTables.c
+ * against the splay tree (RTL_GENERIC_TABLE) it replaced. As in the
+ * driver, every splay tree lookup takes a lock and restructures the
+ * tree. The lock is a mutex here, a spinning user mode thread could be
+ * waiting for a preempted lock holder.
+ */
+
+#include <pthread.h>
+
+#include "USBPcapTables.h"
+#include "test.h"
+
+#define MAX_THREADS 8
+#define ENDPOINTS   32
+
+#define HANDLE(n)  ((USBD_PIPE_HANDLE)(ULONG_PTR)(0x7f3a0000 + (n) * 0x90))
+
+typedef struct _SPLAY_NODE
+{
+    struct _SPLAY_NODE    *left;
+    struct _SPLAY_NODE    *right;
+    USBPCAP_ENDPOINT_INFO  info;
+} SPLAY_NODE;
+
+static SPLAY_NODE  nodes[ENDPOINTS];
+static SPLAY_NODE  *root;
+static pthread_mutex_t splayLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Top-down splay, brings node with key (or last node on its path) to root */
+static SPLAY_NODE *splay(SPLAY_NODE *t, USBD_PIPE_HANDLE key)
+{
+    SPLAY_NODE header, *l, *r, *y;
+
+    if (t == NULL)
+    {
+        return NULL;
+    }
+    header.left = header.right = NULL;
+    l = r = &header;
+
+    for (;;)
+    {
+        if (key < t->info.handle)
+        {
+            if (t->left == NULL)
+            {
+                break;
+            }
+            if (key < t->left->info.handle)
+            {
+                y = t->left;
+                t->left = y->right;
+                y->right = t;
+                t = y;
+                if (t->left == NULL)
+                {
+                    break;
+                }
+            }
+            r->left = t;
+            r = t;
+            t = t->left;
+        }
+        else if (key > t->info.handle)
+        {
+            if (t->right == NULL)
+            {
+                break;
+            }
+            if (key > t->right->info.handle)
+            {
+                y = t->right;
+                t->right = y->left;
+                y->left = t;
+                t = y;
+                if (t->right == NULL)
+                {
+                    break;
+                }
+            }
+            l->right = t;
+            l = t;
+            t = t->right;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    l->right = t->left;
+    r->left = t->right;
+    t->left = header.right;
+    t->right = header.left;
+    return t;
+}
+
+static void splay_insert(SPLAY_NODE *node)
+{
+    node->left = node->right = NULL;
+    if (root != NULL)
+    {
+        root = splay(root, node->info.handle);
+        if (node->info.handle < root->info.handle)
+        {
+            node->left = root->left;
+            node->right = root;
+            root->left = NULL;
+        }
+        else
+        {
+            node->right = root->right;
+            node->left = root;
+            root->right = NULL;
+        }
+    }
+    root = node;
+}
+
+static BOOLEAN splay_lookup(USBD_PIPE_HANDLE handle, PUSBPCAP_ENDPOINT_INFO info)
+{
+    BOOLEAN found = FALSE;
+
+    pthread_mutex_lock(&splayLock);
+    root = splay(root, handle);
+    if ((root != NULL) && (root->info.handle == handle))
+    {
+        *info = root->info;
+        found = TRUE;
+    }
+    pthread_mutex_unlock(&splayLock);
+    return found;
+}
+
+static PUSBPCAP_ENDPOINT_TABLE table;
+static unsigned lookupsPerThread;
+
+typedef struct
+{
+    BOOLEAN   useSplay;
+    uint32_t  seed;
+    unsigned  sum;
+} WORKER;
+
+static void *worker_thread(void *arg)
+{
+    WORKER *w = (WORKER *)arg;
+    unsigned i;
+
+    for (i = 0; i < lookupsPerThread; i++)
+    {
+        /* Most URBs go to a few endpoints of a device */
+        unsigned n = test_random(&w->seed) % ((i & 7) ? 4 : ENDPOINTS);
+        USBPCAP_ENDPOINT_INFO info;
+        BOOLEAN found;
+
+        if (w->useSplay)
+        {
+            found = splay_lookup(HANDLE(n), &info);
+        }
+        else
+        {
+            found = USBPcapRetrieveEndpointInfo(table, HANDLE(n), &info);
+        }
+        CHECK(found);
+        CHECK_EQ(info.endpointAddress, nodes[n].info.endpointAddress);
+        w->sum += info.endpointAddress;
+    }
+    return NULL;
+}
+
+static double run(BOOLEAN useSplay, unsigned threads)
+{
+    pthread_t tid[MAX_THREADS];
+    WORKER workers[MAX_THREADS];
+    uint64_t start, elapsed;
+    unsigned i;
+
+    lookupsPerThread = 4000000 * test_bench_scale() / threads;
+    start = test_now_ns();
+    for (i = 0; i < threads; i++)
+    {
+        workers[i].useSplay = useSplay;
+        workers[i].seed = 0x51ab + i;
+        workers[i].sum = 0;
+        pthread_create(&tid[i], NULL, worker_thread, &workers[i]);
+    }
+    for (i = 0; i < threads; i++)
+    {
+        pthread_join(tid[i], NULL);
+    }
+    elapsed = test_now_ns() - start;
+
+    return (double)elapsed / ((double)lookupsPerThread * threads);
+}
+
+int main(void)
+{
+    static const unsigned threadCounts[] = { 1, 2, 4, 8 };
+    unsigned i;
+
+    table = USBPcapInitializeEndpointTable();
+    for (i = 0; i < ENDPOINTS; i++)
+    {
+        USBD_PIPE_INFORMATION pipe;
+
+        memset(&pipe, 0, sizeof(pipe));
+        pipe.PipeHandle = HANDLE(i);
+        pipe.EndpointAddress = (UCHAR)((i & 0x0F) | ((i & 0x10) << 3));
+        pipe.PipeType = UsbdPipeTypeBulk;
+        USBPcapAddEndpointInfo(table, &pipe, 5);
+
+        nodes[i].info.handle = pipe.PipeHandle;
+        nodes[i].info.endpointAddress = pipe.EndpointAddress;
+        nodes[i].info.deviceAddress = 5;
+        nodes[i].info.type = pipe.PipeType;
+        splay_insert(&nodes[i]);
+    }
+
+    printf("threads  splay+lock ns/lookup  hash ns/lookup\n");
+    for (i = 0; i < sizeof(threadCounts) / sizeof(threadCounts[0]); i++)
+    {
+        double splayNs = run(TRUE, threadCounts[i]);
+        double hashNs = run(FALSE, threadCounts[i]);
+
+        printf("%7u  %20.1f  %14.1f\n", threadCounts[i], splayNs, hashNs);
+    }
+
+    USBPcapFreeEndpointTable(table);
+    return 0;
+}
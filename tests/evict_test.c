@@ -0,0 +1,579 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/*
+ * Overwrite-oldest eviction of USBPcapRecordEvict: random rings are
+ * compared with a model queue of records, the global header always stays
+ * in front, partially read or foreign records are never evicted, and
+ * concurrent producers evicting while the consumer reads lose nothing.
+ * The consumer holds the eviction lock only while single record is read.
+ */
+
+#include <pthread.h>
+
+#include "USBPcapRecord.h"
+#include "USBPcapWholeRecords.h"
+#include "test.h"
+#include "records.h"
+
+#define MAX_DATA     300
+#define MAX_RING     (32 * 1024)
+#define MAX_RECORDS  (MAX_RING / 4)
+#define PCAP_RECORD  (sizeof(pcaprec_hdr_t) + sizeof(USBPCAP_BUFFER_PACKET_HEADER))
+/* Longest compact record of a packet */
+#define MAX_RECORD   (USBPCAP_RECORD_MAX_PREFIX + MAX_DATA)
+
+static USBPCAP_RING ring;
+static UCHAR ringBuffer[MAX_RING];
+
+/* Records stored in the ring, oldest first */
+static struct
+{
+    UINT64  irpId;
+    UINT32  length;
+} model[MAX_RECORDS];
+static UINT32 modelHead;
+static UINT32 modelTail;
+
+static const UCHAR globalHeader[sizeof(pcap_hdr_t)] = {
+    0xD4, 0xC3, 0xB2, 0xA1, 0x02, 0x00, 0x04, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0xFF, 0xFF, 0x00, 0x00, 0xF9, 0x00, 0x00, 0x00,
+};
+
+static void fill_data(UCHAR *data, UINT64 irpId, UINT32 length)
+{
+    UINT32 i;
+
+    for (i = 0; i < length; i++)
+    {
+        data[i] = (UCHAR)(irpId * 31 + i);
+    }
+}
+
+static UINT32 data_length(UINT64 irpId)
+{
+    return (UINT32)((irpId * 2654435761UL) >> 8) % MAX_DATA;
+}
+
+static void store_raw(void)
+{
+    USBPCAP_RING_RESERVATION reservation;
+    UCHAR record[sizeof(UINT32) + sizeof(globalHeader)];
+
+    CHECK_EQ(USBPcapRecordEncodeRaw(sizeof(globalHeader), record),
+             sizeof(UINT32));
+    memcpy(&record[sizeof(UINT32)], globalHeader, sizeof(globalHeader));
+    CHECK(USBPcapRingEnter(&ring));
+    CHECK(NT_SUCCESS(USBPcapRingReserve(&ring, sizeof(record), &reservation)));
+    USBPcapRingWrite(&ring, &reservation, record, sizeof(record));
+    USBPcapRingCommit(&ring, &reservation);
+    USBPcapRingLeave(&ring);
+}
+
+/* Stores packet and adds it to the model, FALSE if it does not fit */
+static BOOLEAN store_packet(UINT64 irpId)
+{
+    UCHAR data[MAX_DATA];
+    UINT32 used = USBPcapRingGetUsed(&ring);
+    NTSTATUS status;
+
+    fill_data(data, irpId, data_length(irpId));
+    CHECK(USBPcapRingEnter(&ring));
+    status = test_store_record(&ring, irpId * 1000, irpId, data,
+                               data_length(irpId));
+    USBPcapRingLeave(&ring);
+    if (!NT_SUCCESS(status))
+    {
+        return FALSE;
+    }
+
+    model[modelTail % MAX_RECORDS].irpId = irpId;
+    model[modelTail % MAX_RECORDS].length = USBPcapRingGetUsed(&ring) - used;
+    modelTail++;
+    return TRUE;
+}
+
+/* Checks expanded pcap packet record */
+static UINT64 check_packet(const UCHAR *record, UINT32 length)
+{
+    USBPCAP_BUFFER_PACKET_HEADER header;
+    UCHAR data[MAX_DATA];
+
+    CHECK(length >= PCAP_RECORD);
+    memcpy(&header, &record[sizeof(pcaprec_hdr_t)], sizeof(header));
+    CHECK_EQ(header.dataLength, data_length(header.irpId));
+    CHECK_EQ(length, PCAP_RECORD + header.dataLength);
+    fill_data(data, header.irpId, header.dataLength);
+    CHECK(memcmp(&record[PCAP_RECORD], data, header.dataLength) == 0);
+    return header.irpId;
+}
+
+/* Reads the whole ring, it must hold the model records */
+static void check_ring(BOOLEAN raw)
+{
+    UCHAR record[PCAP_RECORD + MAX_DATA];
+    UINT32 length;
+
+    if (raw)
+    {
+        CHECK_EQ(USBPcapRecordReadWhole(&ring, FALSE, record, sizeof(record)),
+                 sizeof(globalHeader));
+        CHECK(memcmp(record, globalHeader, sizeof(globalHeader)) == 0);
+    }
+
+    for (; modelHead != modelTail; modelHead++)
+    {
+        length = USBPcapRecordReadWhole(&ring, FALSE, record, sizeof(record));
+        CHECK_EQ(check_packet(record, length),
+                 model[modelHead % MAX_RECORDS].irpId);
+    }
+    CHECK_EQ(USBPcapRingGetUsed(&ring), 0);
+}
+
+/*
+ * Random ring sizes, read positions and requested lengths. Eviction
+ * removes the fewest oldest records that make the length fit, or nothing
+ * if the length fits already or cannot fit at all.
+ */
+static void test_model(void)
+{
+    UCHAR record[PCAP_RECORD + MAX_DATA];
+    uint32_t seed = 0xE71C;
+    UINT64 irpId = 1;
+    unsigned round;
+
+    for (round = 0; round < 20000; round++)
+    {
+        UINT32 size = 1024 + test_random(&seed) % (MAX_RING - 1024 + 1);
+        BOOLEAN raw = (test_random(&seed) % 2) ? TRUE : FALSE;
+        UINT32 skipRecords = test_random(&seed) % 16;
+        UINT32 length;
+        UINT32 records;
+        UINT32 bytes;
+        UINT32 expectedRecords = 0;
+        UINT32 expectedBytes = 0;
+        UINT32 freeBytes;
+        UINT32 used;
+        UINT32 i;
+
+        USBPcapRingInitialize(&ring);
+        USBPcapRingAttachBuffer(&ring, ringBuffer, size, 0);
+        modelHead = modelTail = 0;
+
+        /* Start at random position so records wrap around */
+        for (i = 0; i < skipRecords; i++)
+        {
+            CHECK(store_packet(irpId++));
+            USBPcapRecordReadWhole(&ring, FALSE, record, sizeof(record));
+            modelHead++;
+        }
+
+        if (raw)
+        {
+            store_raw();
+        }
+        while (store_packet(irpId))
+        {
+            irpId++;
+        }
+        /* Leave some space free now and then, raw record stays at head */
+        if (!raw && ((test_random(&seed) % 4) == 0))
+        {
+            for (i = test_random(&seed) % 4; i > 0; i--)
+            {
+                USBPcapRecordReadWhole(&ring, FALSE, record, sizeof(record));
+                modelHead++;
+            }
+        }
+
+        freeBytes = USBPcapRingGetFree(&ring);
+        used = USBPcapRingGetUsed(&ring);
+        length = 1 + test_random(&seed) % (size + 64);
+        if (length > freeBytes)
+        {
+            UINT32 released = 0;
+
+            for (i = modelHead; i != modelTail; i++)
+            {
+                released += model[i % MAX_RECORDS].length;
+                if (freeBytes + released >= length)
+                {
+                    expectedRecords = i - modelHead + 1;
+                    expectedBytes = released;
+                    break;
+                }
+            }
+        }
+
+        bytes = 0xCCCCCCCC;
+        records = USBPcapRecordEvict(&ring, length, 0, &bytes);
+        CHECK_EQ(records, expectedRecords);
+        CHECK_EQ(bytes, expectedBytes);
+        CHECK_EQ(USBPcapRingGetUsed(&ring), used - bytes);
+        if (records > 0)
+        {
+            CHECK(USBPcapRingGetFree(&ring) >= length);
+        }
+        modelHead += records;
+        check_ring(raw);
+    }
+    TEST_PASS("model");
+}
+
+/* Records that remain after eviction read back intact */
+static void test_remaining(void)
+{
+    uint32_t seed = 0x4E11;
+    UINT64 irpId = 1;
+    unsigned round;
+
+    for (round = 0; round < 5000; round++)
+    {
+        UINT32 size = 1024 + test_random(&seed) % (MAX_RING - 1024 + 1);
+        BOOLEAN raw = (test_random(&seed) % 2) ? TRUE : FALSE;
+        UINT32 bytes;
+        UINT32 records;
+
+        USBPcapRingInitialize(&ring);
+        USBPcapRingAttachBuffer(&ring, ringBuffer, size, 0);
+        modelHead = modelTail = 0;
+        if (raw)
+        {
+            store_raw();
+        }
+
+        /* Overwrite-oldest: evict for every packet that does not fit */
+        for (; irpId % 500 != 0; irpId++)
+        {
+            UINT32 length = MAX_RECORD;
+
+            if (store_packet(irpId))
+            {
+                continue;
+            }
+            records = USBPcapRecordEvict(&ring, length, 0, &bytes);
+            CHECK(records > 0);
+            while (records-- > 0)
+            {
+                bytes -= model[modelHead++ % MAX_RECORDS].length;
+            }
+            CHECK_EQ(bytes, 0);
+            CHECK(store_packet(irpId));
+        }
+        irpId++;
+        check_ring(raw);
+    }
+    TEST_PASS("remaining");
+}
+
+/* Nothing is evicted while the head record is partially read */
+static void test_skip(void)
+{
+    UCHAR part[PCAP_RECORD + MAX_DATA];
+    UINT32 skip = 0;
+    UINT32 bytes;
+    UINT32 used;
+    UINT64 irpId = 1;
+
+    USBPcapRingInitialize(&ring);
+    USBPcapRingAttachBuffer(&ring, ringBuffer, 4096, 0);
+    modelHead = modelTail = 0;
+    store_raw();
+    while (store_packet(irpId))
+    {
+        irpId++;
+    }
+
+    /* Global header read in part */
+    CHECK_EQ(USBPcapRecordRead(&ring, FALSE, part, 10, &skip), 10);
+    CHECK(skip != 0);
+    used = USBPcapRingGetUsed(&ring);
+    CHECK_EQ(USBPcapRecordEvict(&ring, 4096, skip, &bytes), 0);
+    CHECK_EQ(bytes, 0);
+    CHECK_EQ(USBPcapRingGetUsed(&ring), used);
+    CHECK_EQ(USBPcapRecordRead(&ring, FALSE, part, sizeof(globalHeader) - 10,
+                               &skip), sizeof(globalHeader) - 10);
+    CHECK_EQ(skip, 0);
+
+    /* Packet read in part */
+    CHECK_EQ(USBPcapRecordRead(&ring, FALSE, part, PCAP_RECORD - 1, &skip),
+             PCAP_RECORD - 1);
+    CHECK(skip != 0);
+    used = USBPcapRingGetUsed(&ring);
+    CHECK_EQ(USBPcapRecordEvict(&ring, 4096, skip, &bytes), 0);
+    CHECK_EQ(USBPcapRingGetUsed(&ring), used);
+    while (skip != 0)
+    {
+        USBPcapRecordRead(&ring, FALSE, part, sizeof(part), &skip);
+    }
+
+    /* Once the record is finished eviction works again */
+    modelHead++;
+    CHECK_EQ(USBPcapRecordEvict(&ring, USBPcapRingGetFree(&ring) + 1, 0,
+                                &bytes), 1);
+    CHECK_EQ(bytes, model[modelHead % MAX_RECORDS].length);
+    modelHead++;
+    check_ring(FALSE);
+    TEST_PASS("skip");
+}
+
+/* Raw record after packets stops the walk */
+static void test_raw_barrier(void)
+{
+    UINT32 bytes;
+    UINT32 first;
+
+    USBPcapRingInitialize(&ring);
+    USBPcapRingAttachBuffer(&ring, ringBuffer, 4096, 0);
+    modelHead = modelTail = 0;
+    store_packet(1);
+    store_packet(2);
+    first = model[0].length;
+    store_raw();
+
+    CHECK_EQ(USBPcapRecordEvict(&ring, USBPcapRingGetFree(&ring) + first, 0,
+                                &bytes), 1);
+    CHECK_EQ(bytes, first);
+    CHECK_EQ(USBPcapRecordEvict(&ring, USBPcapRingGetFree(&ring) +
+                                model[1].length + 1, 0, &bytes), 0);
+    CHECK_EQ(bytes, 0);
+    TEST_PASS("raw barrier");
+}
+
+#define PRODUCERS         4
+#define PRODUCER_PACKETS  50000
+#define RING_BYTES        8192
+#define WHOLE_MIN_READ \
+    USBPCAP_WHOLE_RECORDS_MIN_READ(MAX_DATA + \
+                                   sizeof(USBPCAP_BUFFER_PACKET_HEADER))
+
+static KSPIN_LOCK evictLock;
+static UINT32 consumerSkip;
+static volatile LONG finished;
+static UINT64 stored[PRODUCERS];
+/* Evicted by the producer, records of any producer */
+static UINT64 evicted[PRODUCERS];
+
+/* Producer side of USBPcapBufferStorePacket with overwrite-oldest */
+static void *producer(void *arg)
+{
+    ULONG id = (ULONG)(uintptr_t)arg;
+    UCHAR data[MAX_DATA];
+    UINT64 seq;
+
+    for (seq = 1; seq <= PRODUCER_PACKETS; seq++)
+    {
+        UINT64 irpId = ((UINT64)id << 32) | seq;
+        UINT32 length = data_length(irpId);
+        NTSTATUS status;
+
+        fill_data(data, irpId, length);
+        CHECK(USBPcapRingEnter(&ring));
+        status = test_store_record(&ring, seq, irpId, data, length);
+        if (!NT_SUCCESS(status))
+        {
+            UINT32 records;
+            UINT32 bytes;
+
+            KeAcquireSpinLockAtDpcLevel(&evictLock);
+            do
+            {
+                records = USBPcapRecordEvict(&ring, MAX_RECORD,
+                                             consumerSkip, &bytes);
+                evicted[id] += records;
+                status = test_store_record(&ring, seq, irpId, data, length);
+            }
+            while (!NT_SUCCESS(status) && (records > 0));
+            KeReleaseSpinLockFromDpcLevel(&evictLock);
+        }
+        USBPcapRingLeave(&ring);
+
+        if (NT_SUCCESS(status))
+        {
+            stored[id]++;
+        }
+    }
+    InterlockedIncrement(&finished);
+    return NULL;
+}
+
+static UCHAR stream[RING_BYTES * 4];
+static UINT32 streamLength;
+static UINT64 lastSeq[PRODUCERS];
+static UINT64 received[PRODUCERS];
+
+/* Parses complete pcap records out of stream */
+static void parse_stream(BOOLEAN *header)
+{
+    UINT32 pos = 0;
+
+    if (!*header)
+    {
+        if (streamLength < sizeof(globalHeader))
+        {
+            return;
+        }
+        CHECK(memcmp(stream, globalHeader, sizeof(globalHeader)) == 0);
+        pos = sizeof(globalHeader);
+        *header = TRUE;
+    }
+
+    while (streamLength - pos >= sizeof(pcaprec_hdr_t))
+    {
+        pcaprec_hdr_t rec;
+        UINT64 irpId;
+        ULONG id;
+
+        memcpy(&rec, &stream[pos], sizeof(rec));
+        if (streamLength - pos < sizeof(rec) + rec.incl_len)
+        {
+            break;
+        }
+        irpId = check_packet(&stream[pos], sizeof(rec) + rec.incl_len);
+        id = (ULONG)(irpId >> 32);
+        CHECK(id < PRODUCERS);
+        /* Packets of a producer come in order, evicted ones are missing */
+        CHECK((irpId & 0xFFFFFFFF) > lastSeq[id]);
+        lastSeq[id] = irpId & 0xFFFFFFFF;
+        received[id]++;
+        pos += (UINT32)sizeof(rec) + rec.incl_len;
+    }
+
+    memmove(stream, &stream[pos], streamLength - pos);
+    streamLength -= pos;
+}
+
+/*
+ * Consumer side of USBPcapBufferReadRecords: records are read in pieces
+ * and the lock is held only while single record is read.
+ */
+static UINT32 read_pieces(PUCHAR dest, UINT32 size)
+{
+    UINT32 bytes = 0;
+    UINT32 tmp;
+
+    do
+    {
+        KeAcquireSpinLockAtDpcLevel(&evictLock);
+        tmp = USBPcapRecordRead(&ring, FALSE, &dest[bytes], size - bytes,
+                                &consumerSkip);
+        KeReleaseSpinLockFromDpcLevel(&evictLock);
+        bytes += tmp;
+    }
+    while ((tmp > 0) && (bytes < size));
+
+    return bytes;
+}
+
+/* Whole records read, returns the record bytes without the trailer */
+static UINT32 read_whole(PUCHAR dest, UINT32 size)
+{
+    USBPCAP_READ_TRAILER trailer;
+    UINT32 bytes;
+
+    bytes = USBPcapWholeRecordsRead(&ring, NULL, &evictLock, FALSE,
+                                    dest, size);
+    if (bytes == 0)
+    {
+        return 0;
+    }
+
+    CHECK(bytes >= sizeof(trailer));
+    memcpy(&trailer, &dest[bytes - sizeof(trailer)], sizeof(trailer));
+    CHECK_EQ(trailer.length, bytes - sizeof(trailer));
+    CHECK(trailer.records > 0);
+    return trailer.length;
+}
+
+/*
+ * Concurrent producers evicting while the consumer reads in random
+ * sizes under the same lock, like USBPcapBufferRead does.
+ */
+static void test_concurrent(BOOLEAN wholeRecords)
+{
+    static UCHAR buffer[RING_BYTES];
+    pthread_t threads[PRODUCERS];
+    BOOLEAN header = FALSE;
+    uint32_t seed = 0xC0C0;
+    ULONG i;
+
+    KeInitializeSpinLock(&evictLock);
+    consumerSkip = 0;
+    finished = 0;
+    streamLength = 0;
+    memset(stored, 0, sizeof(stored));
+    memset(evicted, 0, sizeof(evicted));
+    memset(lastSeq, 0, sizeof(lastSeq));
+    memset(received, 0, sizeof(received));
+
+    USBPcapRingInitialize(&ring);
+    USBPcapRingAttachBuffer(&ring, buffer, sizeof(buffer), 0);
+    store_raw();
+
+    for (i = 0; i < PRODUCERS; i++)
+    {
+        pthread_create(&threads[i], NULL, producer, (void *)(uintptr_t)i);
+    }
+
+    for (;;)
+    {
+        UINT32 size = 1 + test_random(&seed) % 2000;
+        UINT32 bytes;
+        BOOLEAN done = (finished == PRODUCERS) ? TRUE : FALSE;
+
+        if (wholeRecords)
+        {
+            /* Shorter whole records read could return nothing forever */
+            size += WHOLE_MIN_READ;
+            bytes = read_whole(&stream[streamLength], size);
+        }
+        else
+        {
+            bytes = read_pieces(&stream[streamLength], size);
+        }
+        streamLength += bytes;
+        parse_stream(&header);
+
+        if (done && (bytes == 0))
+        {
+            break;
+        }
+        if (bytes == 0)
+        {
+            sched_yield();
+        }
+    }
+
+    for (i = 0; i < PRODUCERS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    CHECK(header);
+    CHECK_EQ(streamLength, 0);
+    CHECK_EQ(USBPcapRingGetUsed(&ring), 0);
+    for (i = 1; i < PRODUCERS; i++)
+    {
+        stored[0] += stored[i];
+        received[0] += received[i];
+        evicted[0] += evicted[i];
+    }
+    CHECK(evicted[0] > 0);
+    CHECK_EQ(stored[0], received[0] + evicted[0]);
+    TEST_PASS(wholeRecords ? "concurrent whole records" : "concurrent");
+}
+
+int main(void)
+{
+    test_model();
+    test_remaining();
+    test_skip();
+    test_raw_barrier();
+    test_concurrent(FALSE);
+    test_concurrent(TRUE);
+    return 0;
+}
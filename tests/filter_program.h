@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef USBPCAP_TEST_FILTER_PROGRAM_H
+#define USBPCAP_TEST_FILTER_PROGRAM_H
+
+#include "USBPcapFilterProgram.h"
+
+/* Instruction constructors, same as BPF_STMT and BPF_JUMP */
+#define STMT(code, k)         { (UINT16)(code), 0, 0, (UINT32)(k) }
+#define JUMP(code, k, jt, jf) { (UINT16)(code), (jt), (jf), (UINT32)(k) }
+
+#define LD_B_ABS   (USBPCAP_FILTER_LD | USBPCAP_FILTER_B | USBPCAP_FILTER_ABS)
+#define LD_H_ABS   (USBPCAP_FILTER_LD | USBPCAP_FILTER_H | USBPCAP_FILTER_ABS)
+#define LD_W_ABS   (USBPCAP_FILTER_LD | USBPCAP_FILTER_W | USBPCAP_FILTER_ABS)
+#define LD_B_IND   (USBPCAP_FILTER_LD | USBPCAP_FILTER_B | USBPCAP_FILTER_IND)
+#define JEQ_K      (USBPCAP_FILTER_JMP | USBPCAP_FILTER_JEQ | USBPCAP_FILTER_K)
+#define RET_K      (USBPCAP_FILTER_RET | USBPCAP_FILTER_K)
+#define RET_A      (USBPCAP_FILTER_RET | USBPCAP_FILTER_A)
+
+#define OFFSET(field)  FIELD_OFFSET(USBPCAP_BUFFER_PACKET_HEADER, field)
+
+/* Packet with the payload split into segments of given sizes */
+struct test_packet
+{
+    USBPCAP_BUFFER_PACKET_HEADER header;
+    USBPCAP_PAYLOAD_ENTRY payload[5];
+    USBPCAP_FILTER_PACKET packet;
+};
+
+static inline void
+test_packet_init(struct test_packet *p, UCHAR endpoint, UCHAR transfer,
+                 PUCHAR data, const UINT32 *segments)
+{
+    UINT32 offset = 0;
+    int i;
+
+    memset(p, 0, sizeof(*p));
+    p->header.headerLen = sizeof(p->header);
+    p->header.irpId = 0x1122334455667788ULL;
+    p->header.bus = 1;
+    p->header.device = 5;
+    p->header.endpoint = endpoint;
+    p->header.transfer = transfer;
+
+    for (i = 0; segments != NULL && segments[i] != 0; i++)
+    {
+        p->payload[i].size = segments[i];
+        p->payload[i].buffer = &data[offset];
+        offset += segments[i];
+    }
+    p->header.dataLength = offset;
+
+    p->packet.header = &p->header;
+    p->packet.payload = p->payload;
+}
+
+#endif /* USBPCAP_TEST_FILTER_PROGRAM_H */
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/*
+ * Filter program interpreter throughput on typical programs: endpoint
+ * match, endpoint and transfer type match with a payload byte check, and
+ * a long chain of comparisons (as generated for a list of devices).
+ */
+
+#include "test.h"
+#include "filter_program.h"
+
+#define PACKETS 256
+#define CHAIN   64
+
+static struct test_packet packets[PACKETS];
+static UCHAR payload[PACKETS][64];
+
+static void bench(const char *name, USBPCAP_FILTER_INSN *insns, UINT32 count)
+{
+    unsigned long long runs = 2000000ull * test_bench_scale();
+    unsigned long long accepted = 0;
+    unsigned long long i;
+    uint64_t start, elapsed;
+
+    CHECK(USBPcapFilterProgramValidate(insns, count));
+
+    start = test_now_ns();
+    for (i = 0; i < runs; i++)
+    {
+        if (USBPcapFilterProgramRun(insns, &packets[i % PACKETS].packet) != 0)
+        {
+            accepted++;
+        }
+    }
+    elapsed = test_now_ns() - start;
+
+    printf("%-20s %4u insns %8.1f Mpackets/s %6.1f ns/packet %5.1f%% accepted\n",
+           name, count, runs / ((double)elapsed / 1e3),
+           (double)elapsed / runs, 100.0 * accepted / runs);
+}
+
+int main(void)
+{
+    static USBPCAP_FILTER_INSN endpoint[] =
+    {
+        STMT(LD_B_ABS, OFFSET(endpoint)),
+        JUMP(JEQ_K, 0x81, 0, 1),
+        STMT(RET_K, 0xFFFF),
+        STMT(RET_K, 0),
+    };
+    static USBPCAP_FILTER_INSN payload_check[] =
+    {
+        STMT(LD_B_ABS, OFFSET(endpoint)),
+        JUMP(JEQ_K, 0x81, 0, 6),
+        STMT(LD_B_ABS, OFFSET(transfer)),
+        JUMP(JEQ_K, USBPCAP_TRANSFER_BULK, 0, 4),
+        STMT(USBPCAP_FILTER_LDX | USBPCAP_FILTER_IMM,
+             sizeof(USBPCAP_BUFFER_PACKET_HEADER)),
+        STMT(LD_B_IND, 0),
+        JUMP(JEQ_K, 0x55, 0, 1),
+        STMT(RET_K, 0xFFFF),
+        STMT(RET_K, 0),
+    };
+    static USBPCAP_FILTER_INSN chain[2 + 2 * CHAIN];
+    static const UINT32 segments[] = { 32, 32, 0 };
+    uint32_t seed = 0xb9f;
+    UINT32 i;
+
+    for (i = 0; i < PACKETS; i++)
+    {
+        memset(payload[i], (test_random(&seed) & 1) ? 0x55 : 0xAA,
+               sizeof(payload[i]));
+        test_packet_init(&packets[i],
+                         (UCHAR)(0x80 | (test_random(&seed) % 4)),
+                         (UCHAR)(test_random(&seed) % 4),
+                         payload[i], segments);
+        packets[i].header.device = (USHORT)(test_random(&seed) % 128);
+    }
+
+    /* device == 0 || device == 2 || ... */
+    chain[0] = (USBPCAP_FILTER_INSN)STMT(LD_H_ABS, OFFSET(device));
+    for (i = 0; i < CHAIN; i++)
+    {
+        chain[1 + i] = (USBPCAP_FILTER_INSN)
+            JUMP(JEQ_K, 2 * i, (UINT8)(CHAIN - i), 0);
+    }
+    chain[1 + CHAIN] = (USBPCAP_FILTER_INSN)STMT(RET_K, 0);
+    chain[2 + CHAIN] = (USBPCAP_FILTER_INSN)STMT(RET_K, 0xFFFF);
+
+    bench("endpoint", endpoint, sizeof(endpoint) / sizeof(endpoint[0]));
+    bench("payload byte", payload_check,
+          sizeof(payload_check) / sizeof(payload_check[0]));
+    bench("device list", chain, CHAIN + 3);
+    return 0;
+}
@@ -0,0 +1,383 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/*
+ * Filter program verifier and interpreter.
+ */
+
+#include "test.h"
+#include "filter_program.h"
+
+#define COUNT(insns) (sizeof(insns) / sizeof(insns[0]))
+
+static BOOLEAN validate(USBPCAP_FILTER_INSN *insns, UINT32 count)
+{
+    return USBPcapFilterProgramValidate(insns, count);
+}
+
+static void test_validate(void)
+{
+    static USBPCAP_FILTER_INSN valid[] =
+    {
+        STMT(LD_B_ABS, OFFSET(endpoint)),
+        JUMP(JEQ_K, 0x81, 0, 1),
+        STMT(RET_K, 0xFFFF),
+        STMT(RET_K, 0),
+    };
+    static USBPCAP_FILTER_INSN big[USBPCAP_FILTER_MAX_INSNS + 1];
+    USBPCAP_FILTER_INSN insn[2];
+    UINT32 i;
+
+    CHECK(validate(valid, COUNT(valid)));
+    CHECK(!validate(valid, 0));
+    /* Last instruction must be return */
+    CHECK(!validate(valid, 2));
+    /* Jump past the end */
+    CHECK(!validate(valid, 3));
+
+    for (i = 0; i < COUNT(big); i++)
+    {
+        big[i].code = RET_K;
+    }
+    CHECK(validate(big, USBPCAP_FILTER_MAX_INSNS));
+    CHECK(!validate(big, USBPCAP_FILTER_MAX_INSNS + 1));
+
+#define REJECT(code, k) \
+    do \
+    { \
+        insn[0] = (USBPCAP_FILTER_INSN)STMT(code, k); \
+        insn[1] = (USBPCAP_FILTER_INSN)STMT(RET_K, 0); \
+        CHECK(!validate(insn, 2)); \
+    } while (0)
+#define ACCEPT(code, k) \
+    do \
+    { \
+        insn[0] = (USBPCAP_FILTER_INSN)STMT(code, k); \
+        insn[1] = (USBPCAP_FILTER_INSN)STMT(RET_K, 0); \
+        CHECK(validate(insn, 2)); \
+    } while (0)
+
+    ACCEPT(USBPCAP_FILTER_LD | USBPCAP_FILTER_MEM, USBPCAP_FILTER_MEMWORDS - 1);
+    REJECT(USBPCAP_FILTER_LD | USBPCAP_FILTER_MEM, USBPCAP_FILTER_MEMWORDS);
+    REJECT(USBPCAP_FILTER_LDX | USBPCAP_FILTER_MEM, USBPCAP_FILTER_MEMWORDS);
+    REJECT(USBPCAP_FILTER_ST, USBPCAP_FILTER_MEMWORDS);
+    REJECT(USBPCAP_FILTER_STX, USBPCAP_FILTER_MEMWORDS);
+    REJECT(USBPCAP_FILTER_LDX | USBPCAP_FILTER_B | USBPCAP_FILTER_ABS, 0);
+    REJECT(USBPCAP_FILTER_LD | 0x18 | USBPCAP_FILTER_ABS, 0);
+    REJECT(USBPCAP_FILTER_LD | 0xa0, 0);
+    REJECT(USBPCAP_FILTER_ALU | USBPCAP_FILTER_DIV | USBPCAP_FILTER_K, 0);
+    REJECT(USBPCAP_FILTER_ALU | USBPCAP_FILTER_MOD | USBPCAP_FILTER_K, 0);
+    ACCEPT(USBPCAP_FILTER_ALU | USBPCAP_FILTER_DIV | USBPCAP_FILTER_X, 0);
+    REJECT(USBPCAP_FILTER_ALU | 0xb0, 0);
+    REJECT(USBPCAP_FILTER_JMP | 0x50, 0);
+    REJECT(USBPCAP_FILTER_JMP | USBPCAP_FILTER_JA, 1);
+    ACCEPT(USBPCAP_FILTER_JMP | USBPCAP_FILTER_JA, 0);
+    REJECT(USBPCAP_FILTER_RET | 0x18, 0);
+    REJECT(USBPCAP_FILTER_MISC | 0x40, 0);
+    ACCEPT(USBPCAP_FILTER_MISC | USBPCAP_FILTER_TAX, 0);
+    ACCEPT(USBPCAP_FILTER_MISC | USBPCAP_FILTER_TXA, 0);
+
+    TEST_PASS("validate");
+}
+
+static UINT32 run(USBPCAP_FILTER_INSN *insns, UINT32 count,
+                  struct test_packet *p)
+{
+    CHECK(validate(insns, count));
+    return USBPcapFilterProgramRun(insns, &p->packet);
+}
+
+static void test_header(void)
+{
+    static USBPCAP_FILTER_INSN endpoint[] =
+    {
+        STMT(LD_B_ABS, OFFSET(endpoint)),
+        JUMP(JEQ_K, 0x81, 0, 3),
+        STMT(LD_B_ABS, OFFSET(transfer)),
+        JUMP(JEQ_K, USBPCAP_TRANSFER_BULK, 0, 1),
+        STMT(RET_K, 0xFFFF),
+        STMT(RET_K, 0),
+    };
+    static USBPCAP_FILTER_INSN fields[] =
+    {
+        STMT(LD_W_ABS, OFFSET(irpId)),
+        JUMP(JEQ_K, 0x55667788, 0, 5),
+        STMT(LD_H_ABS, OFFSET(device)),
+        JUMP(JEQ_K, 5, 0, 3),
+        STMT(USBPCAP_FILTER_LD | USBPCAP_FILTER_LEN, 0),
+        JUMP(JEQ_K, sizeof(USBPCAP_BUFFER_PACKET_HEADER) + 10, 0, 1),
+        STMT(RET_A, 0),
+        STMT(RET_K, 0),
+    };
+    static UCHAR data[10];
+    static const UINT32 segments[] = { 10, 0 };
+    struct test_packet p;
+
+    test_packet_init(&p, 0x81, USBPCAP_TRANSFER_BULK, data, NULL);
+    CHECK_EQ(run(endpoint, COUNT(endpoint), &p), 0xFFFF);
+    test_packet_init(&p, 0x82, USBPCAP_TRANSFER_BULK, data, NULL);
+    CHECK_EQ(run(endpoint, COUNT(endpoint), &p), 0);
+    test_packet_init(&p, 0x81, USBPCAP_TRANSFER_INTERRUPT, data, NULL);
+    CHECK_EQ(run(endpoint, COUNT(endpoint), &p), 0);
+
+    test_packet_init(&p, 0x81, USBPCAP_TRANSFER_BULK, data, segments);
+    CHECK_EQ(run(fields, COUNT(fields), &p),
+             sizeof(USBPCAP_BUFFER_PACKET_HEADER) + 10);
+
+    TEST_PASS("header");
+}
+
+static void test_payload(void)
+{
+    static USBPCAP_FILTER_INSN word[] =
+    {
+        STMT(LD_W_ABS, 0),
+        STMT(RET_A, 0),
+    };
+    static USBPCAP_FILTER_INSN indirect[] =
+    {
+        STMT(USBPCAP_FILTER_LDX | USBPCAP_FILTER_IMM, 0),
+        STMT(LD_B_IND, 0),
+        STMT(RET_A, 0),
+    };
+    static const UINT32 segments[] = { 1, 2, 3, 10, 0 };
+    UCHAR data[16];
+    UINT32 hdr = sizeof(USBPCAP_BUFFER_PACKET_HEADER);
+    struct test_packet p;
+    UINT32 i;
+
+    for (i = 0; i < sizeof(data); i++)
+    {
+        data[i] = (UCHAR)(0xA0 + i);
+    }
+    test_packet_init(&p, 0x02, USBPCAP_TRANSFER_BULK, data, segments);
+
+    /* Every byte, every load size, across header and segment boundaries */
+    for (i = 0; i + 4 <= hdr + sizeof(data); i++)
+    {
+        UCHAR expected[4];
+        UINT32 value, j;
+
+        for (j = 0; j < 4; j++)
+        {
+            expected[j] = (i + j < hdr) ? ((PUCHAR)&p.header)[i + j] :
+                                          data[i + j - hdr];
+        }
+        memcpy(&value, expected, 4);
+
+        word[0].code = LD_W_ABS;
+        word[0].k = i;
+        CHECK_EQ(run(word, COUNT(word), &p), value);
+        word[0].code = LD_H_ABS;
+        CHECK_EQ(run(word, COUNT(word), &p), value & 0xFFFF);
+        word[0].code = LD_B_ABS;
+        CHECK_EQ(run(word, COUNT(word), &p), value & 0xFF);
+
+        indirect[0].k = i;
+        indirect[1].k = 1;
+        CHECK_EQ(run(indirect, COUNT(indirect), &p), expected[1]);
+    }
+
+    /* Loads outside packet end the program with 0 */
+    word[0].code = LD_W_ABS;
+    word[0].k = hdr + sizeof(data) - 3;
+    CHECK_EQ(run(word, COUNT(word), &p), 0);
+    word[0].k = 0xFFFFFFFE;
+    CHECK_EQ(run(word, COUNT(word), &p), 0);
+    indirect[0].k = 0xFFFFFFFF;
+    indirect[1].k = 1;
+    CHECK_EQ(run(indirect, COUNT(indirect), &p), 0);
+
+    TEST_PASS("payload");
+}
+
+static void test_alu(void)
+{
+    static const struct
+    {
+        UINT16 op;
+        UINT32 a;
+        UINT32 operand;
+        UINT32 result;
+    } cases[] =
+    {
+        { USBPCAP_FILTER_ADD, 0xFFFFFFFF, 2, 1 },
+        { USBPCAP_FILTER_SUB, 1, 2, 0xFFFFFFFF },
+        { USBPCAP_FILTER_MUL, 0x10000, 0x10000, 0 },
+        { USBPCAP_FILTER_DIV, 100, 7, 14 },
+        { USBPCAP_FILTER_MOD, 100, 7, 2 },
+        { USBPCAP_FILTER_OR, 0xF0, 0x0F, 0xFF },
+        { USBPCAP_FILTER_AND, 0xF0, 0x3C, 0x30 },
+        { USBPCAP_FILTER_LSH, 1, 31, 0x80000000 },
+        { USBPCAP_FILTER_LSH, 1, 32, 0 },
+        { USBPCAP_FILTER_RSH, 0x80000000, 31, 1 },
+        { USBPCAP_FILTER_RSH, 0x80000000, 40, 0 },
+        { USBPCAP_FILTER_NEG, 1, 0, 0xFFFFFFFF },
+        { USBPCAP_FILTER_XOR, 0xFF, 0x0F, 0xF0 },
+    };
+    USBPCAP_FILTER_INSN prog[] =
+    {
+        STMT(USBPCAP_FILTER_LD | USBPCAP_FILTER_IMM, 0),
+        STMT(USBPCAP_FILTER_LDX | USBPCAP_FILTER_IMM, 0),
+        STMT(USBPCAP_FILTER_ALU, 0),
+        STMT(RET_A, 0),
+    };
+    struct test_packet p;
+    size_t i;
+
+    test_packet_init(&p, 0x81, USBPCAP_TRANSFER_BULK, NULL, NULL);
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        prog[0].k = cases[i].a;
+        prog[1].k = cases[i].operand;
+        prog[2].code = USBPCAP_FILTER_ALU | cases[i].op | USBPCAP_FILTER_K;
+        prog[2].k = cases[i].operand;
+        CHECK_EQ(run(prog, COUNT(prog), &p), cases[i].result);
+        prog[2].code = USBPCAP_FILTER_ALU | cases[i].op | USBPCAP_FILTER_X;
+        prog[2].k = 0;
+        CHECK_EQ(run(prog, COUNT(prog), &p), cases[i].result);
+    }
+
+    /* Division by X equal to zero drops the packet */
+    prog[0].k = 5;
+    prog[1].k = 0;
+    prog[2].code = USBPCAP_FILTER_ALU | USBPCAP_FILTER_DIV | USBPCAP_FILTER_X;
+    CHECK_EQ(run(prog, COUNT(prog), &p), 0);
+    prog[2].code = USBPCAP_FILTER_ALU | USBPCAP_FILTER_MOD | USBPCAP_FILTER_X;
+    CHECK_EQ(run(prog, COUNT(prog), &p), 0);
+
+    TEST_PASS("alu");
+}
+
+static void test_jumps(void)
+{
+    static const struct
+    {
+        UINT16 op;
+        UINT32 a;
+        UINT32 k;
+        BOOLEAN taken;
+    } cases[] =
+    {
+        { USBPCAP_FILTER_JEQ, 5, 5, TRUE },
+        { USBPCAP_FILTER_JEQ, 5, 6, FALSE },
+        { USBPCAP_FILTER_JGT, 6, 5, TRUE },
+        { USBPCAP_FILTER_JGT, 5, 5, FALSE },
+        { USBPCAP_FILTER_JGE, 5, 5, TRUE },
+        { USBPCAP_FILTER_JGE, 4, 5, FALSE },
+        { USBPCAP_FILTER_JSET, 6, 2, TRUE },
+        { USBPCAP_FILTER_JSET, 6, 1, FALSE },
+    };
+    USBPCAP_FILTER_INSN prog[] =
+    {
+        STMT(USBPCAP_FILTER_LD | USBPCAP_FILTER_IMM, 0),
+        STMT(USBPCAP_FILTER_LDX | USBPCAP_FILTER_IMM, 0),
+        JUMP(USBPCAP_FILTER_JMP, 0, 1, 2),
+        STMT(RET_K, 1),
+        STMT(RET_K, 2),
+        STMT(RET_K, 3),
+    };
+    USBPCAP_FILTER_INSN ja[] =
+    {
+        STMT(USBPCAP_FILTER_JMP | USBPCAP_FILTER_JA, 2),
+        STMT(RET_K, 1),
+        STMT(RET_K, 2),
+        STMT(USBPCAP_FILTER_MISC | USBPCAP_FILTER_TXA, 0),
+        STMT(RET_A, 0),
+    };
+    struct test_packet p;
+    size_t i;
+
+    test_packet_init(&p, 0x81, USBPCAP_TRANSFER_BULK, NULL, NULL);
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        prog[0].k = cases[i].a;
+        prog[1].k = cases[i].k;
+        prog[2].code = USBPCAP_FILTER_JMP | cases[i].op | USBPCAP_FILTER_K;
+        prog[2].k = cases[i].k;
+        CHECK_EQ(run(prog, COUNT(prog), &p), cases[i].taken ? 2 : 3);
+        prog[2].code = USBPCAP_FILTER_JMP | cases[i].op | USBPCAP_FILTER_X;
+        prog[2].k = 0;
+        CHECK_EQ(run(prog, COUNT(prog), &p), cases[i].taken ? 2 : 3);
+    }
+
+    CHECK_EQ(run(ja, COUNT(ja), &p), 0);
+
+    TEST_PASS("jumps");
+}
+
+static void test_memory(void)
+{
+    static USBPCAP_FILTER_INSN store[] =
+    {
+        STMT(USBPCAP_FILTER_LD | USBPCAP_FILTER_IMM, 0xDEAD),
+        STMT(USBPCAP_FILTER_ST, 3),
+        STMT(USBPCAP_FILTER_LDX | USBPCAP_FILTER_IMM, 0xBEEF),
+        STMT(USBPCAP_FILTER_STX, 15),
+        STMT(USBPCAP_FILTER_LDX | USBPCAP_FILTER_MEM, 3),
+        STMT(USBPCAP_FILTER_LD | USBPCAP_FILTER_MEM, 15),
+        STMT(USBPCAP_FILTER_ALU | USBPCAP_FILTER_ADD | USBPCAP_FILTER_X, 0),
+        STMT(RET_A, 0),
+    };
+    USBPCAP_FILTER_INSN load[] =
+    {
+        STMT(USBPCAP_FILTER_LD | USBPCAP_FILTER_MEM, 0),
+        STMT(RET_A, 0),
+    };
+    struct test_packet p;
+    UINT32 i;
+
+    test_packet_init(&p, 0x81, USBPCAP_TRANSFER_BULK, NULL, NULL);
+    CHECK_EQ(run(store, COUNT(store), &p), 0xDEAD + 0xBEEF);
+
+    /* Scratch memory does not keep values from previous runs */
+    for (i = 0; i < USBPCAP_FILTER_MEMWORDS; i++)
+    {
+        CHECK_EQ(run(store, COUNT(store), &p), 0xDEAD + 0xBEEF);
+        load[0].k = i;
+        CHECK_EQ(run(load, COUNT(load), &p), 0);
+    }
+
+    TEST_PASS("memory");
+}
+
+static void test_create(void)
+{
+    UCHAR buffer[FIELD_OFFSET(USBPCAP_IOCTL_FILTER_PROGRAM, insns) +
+                 2 * sizeof(USBPCAP_FILTER_INSN)];
+    PUSBPCAP_IOCTL_FILTER_PROGRAM input = (PUSBPCAP_IOCTL_FILTER_PROGRAM)buffer;
+    PUSBPCAP_IOCTL_FILTER_PROGRAM program;
+
+    memset(buffer, 0, sizeof(buffer));
+    input->count = 2;
+    input->insns[0].code = USBPCAP_FILTER_LD | USBPCAP_FILTER_IMM;
+    input->insns[0].k = 7;
+    input->insns[1].code = RET_A;
+
+    CHECK(NT_SUCCESS(USBPcapFilterProgramCreate(input, &program)));
+    CHECK(program != NULL && program != input);
+    CHECK(memcmp(program, input, sizeof(buffer)) == 0);
+    USBPcapFilterProgramFree(program);
+
+    input->insns[1].code = USBPCAP_FILTER_LD | USBPCAP_FILTER_IMM;
+    CHECK_EQ(USBPcapFilterProgramCreate(input, &program),
+             STATUS_INVALID_PARAMETER);
+    CHECK(program == NULL);
+
+    TEST_PASS("create");
+}
+
+int main(void)
+{
+    test_validate();
+    test_header();
+    test_payload();
+    test_alu();
+    test_jumps();
+    test_memory();
+    test_create();
+    return 0;
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Output throughput with different flush policies. Data is written in
+ * read sized chunks to a temporary file (in $TMPDIR, /tmp by default)
+ * and fsync() is called whenever the policy asks for flush, like
+ * FlushFileBuffers() in USBPcapCMD. "1b" flushes after every write.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "flush.h"
+#include "test.h"
+
+#define CHUNK_SIZE (64 * 1024)
+
+static DWORD tick_count(void)
+{
+    return (DWORD)(test_now_ns() / 1000000);
+}
+
+static void run(int fd, const char *arg, UINT64 total)
+{
+    static unsigned char chunk[CHUNK_SIZE];
+    struct flush_policy policy;
+    struct flush_state state;
+    unsigned long flushes = 0;
+    uint64_t start, elapsed;
+    UINT64 written;
+
+    CHECK(flush_policy_parse(arg, &policy));
+    CHECK(ftruncate(fd, 0) == 0);
+    CHECK(lseek(fd, 0, SEEK_SET) == 0);
+    CHECK(fsync(fd) == 0);
+    memset(chunk, 0x5A, sizeof(chunk));
+
+    start = test_now_ns();
+    flush_init(&state, &policy, tick_count());
+    for (written = 0; written < total; written += CHUNK_SIZE)
+    {
+        CHECK(write(fd, chunk, CHUNK_SIZE) == CHUNK_SIZE);
+        if (flush_written(&state, CHUNK_SIZE, tick_count()))
+        {
+            CHECK(fsync(fd) == 0);
+            flush_done(&state, tick_count());
+            flushes++;
+        }
+    }
+    if (flush_on_close(&state) && flush_needed(&state))
+    {
+        CHECK(fsync(fd) == 0);
+        flushes++;
+    }
+    elapsed = test_now_ns() - start;
+
+    printf("%-10s %10.1f MB/s %8lu flushes\n", arg,
+           (double)total / (1024 * 1024) / ((double)elapsed / 1e9),
+           flushes);
+}
+
+int main(void)
+{
+    static const char *policies[] =
+    {
+        "1b", "1048576b", "16777216b", "100ms", "1000ms", "exit", "never",
+    };
+    const char *tmpdir = getenv("TMPDIR");
+    char path[4096];
+    UINT64 total = (UINT64)64 * 1024 * 1024 * test_bench_scale();
+    size_t i;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/usbpcap_flush_XXXXXX",
+             tmpdir ? tmpdir : "/tmp");
+    fd = mkstemp(path);
+    CHECK(fd >= 0);
+    unlink(path);
+
+    printf("%llu MB in %d KB writes\n",
+           (unsigned long long)(total / (1024 * 1024)), CHUNK_SIZE / 1024);
+    for (i = 0; i < sizeof(policies) / sizeof(policies[0]); i++)
+    {
+        run(fd, policies[i], total);
+    }
+
+    close(fd);
+    return 0;
+}
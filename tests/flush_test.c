@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * USBPcapCMD output flush policy: --flush-interval parsing and decisions.
+ */
+
+#include "flush.h"
+#include "test.h"
+
+static void test_parse(void)
+{
+    struct flush_policy policy;
+
+    CHECK(flush_policy_parse("never", &policy));
+    CHECK_EQ(policy.type, FLUSH_POLICY_NEVER);
+    CHECK(flush_policy_parse("exit", &policy));
+    CHECK_EQ(policy.type, FLUSH_POLICY_ON_EXIT);
+    CHECK(flush_policy_parse("250ms", &policy));
+    CHECK_EQ(policy.type, FLUSH_POLICY_TIME);
+    CHECK_EQ(policy.interval, 250);
+    CHECK(flush_policy_parse("1048576B", &policy));
+    CHECK_EQ(policy.type, FLUSH_POLICY_BYTES);
+    CHECK_EQ(policy.interval, 1048576);
+
+    CHECK(!flush_policy_parse("", &policy));
+    CHECK(!flush_policy_parse("ms", &policy));
+    CHECK(!flush_policy_parse("0ms", &policy));
+    CHECK(!flush_policy_parse("10", &policy));
+    CHECK(!flush_policy_parse("10s", &policy));
+    CHECK(!flush_policy_parse("4294967296b", &policy));
+
+    TEST_PASS("parse");
+}
+
+static void test_bytes(void)
+{
+    struct flush_policy policy = { FLUSH_POLICY_BYTES, 1000 };
+    struct flush_state state;
+
+    flush_init(&state, &policy, 0);
+    CHECK(!flush_needed(&state));
+    CHECK(!flush_written(&state, 600, 0));
+    CHECK_EQ(flush_timeout(&state, 0), INFINITE);
+    CHECK(flush_written(&state, 400, 0));
+    CHECK(flush_needed(&state));
+    flush_done(&state, 0);
+    CHECK(!flush_needed(&state));
+    CHECK(flush_written(&state, 5000, 0));
+    CHECK(flush_on_close(&state));
+
+    TEST_PASS("bytes");
+}
+
+static void test_time(void)
+{
+    struct flush_policy policy = { FLUSH_POLICY_TIME, 100 };
+    struct flush_state state;
+
+    /* Tick count wraps around every 49.7 days */
+    flush_init(&state, &policy, 0xFFFFFFF0);
+    CHECK_EQ(flush_timeout(&state, 0xFFFFFFF0), INFINITE);
+
+    CHECK(!flush_written(&state, 10, 0xFFFFFFFF));
+    CHECK_EQ(flush_timeout(&state, 0xFFFFFFFF), 85);
+    CHECK_EQ(flush_timeout(&state, 83), 1);
+    CHECK_EQ(flush_timeout(&state, 84), 0);
+    CHECK(flush_written(&state, 10, 200));
+
+    flush_done(&state, 200);
+    CHECK_EQ(flush_timeout(&state, 5000), INFINITE);
+
+    TEST_PASS("time");
+}
+
+static void test_exit_never(void)
+{
+    struct flush_policy exit_policy = { FLUSH_POLICY_ON_EXIT, 0 };
+    struct flush_policy never_policy = { FLUSH_POLICY_NEVER, 0 };
+    struct flush_state state;
+
+    flush_init(&state, &exit_policy, 0);
+    CHECK(!flush_written(&state, 0xFFFFFFFF, 0));
+    CHECK_EQ(flush_timeout(&state, 0), INFINITE);
+    CHECK(flush_on_close(&state));
+
+    flush_init(&state, &never_policy, 0);
+    CHECK(!flush_written(&state, 0xFFFFFFFF, 0));
+    CHECK(!flush_on_close(&state));
+
+    TEST_PASS("exit_never");
+}
+
+int main(void)
+{
+    test_parse();
+    test_bytes();
+    test_time();
+    test_exit_never();
+    return 0;
+}
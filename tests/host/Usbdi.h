@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/* Stand-in for the DDK Usbdi.h, only the pipe information is needed */
+
+#ifndef USBPCAP_HOST_USBDI_H
+#define USBPCAP_HOST_USBDI_H
+
+#include "usb.h"
+
+typedef PVOID USBD_PIPE_HANDLE;
+
+typedef enum _USBD_PIPE_TYPE
+{
+    UsbdPipeTypeControl,
+    UsbdPipeTypeIsochronous,
+    UsbdPipeTypeBulk,
+    UsbdPipeTypeInterrupt
+} USBD_PIPE_TYPE;
+
+typedef struct _USBD_PIPE_INFORMATION
+{
+    USHORT            MaximumPacketSize;
+    UCHAR             EndpointAddress;
+    UCHAR             Interval;
+    USBD_PIPE_TYPE    PipeType;
+    USBD_PIPE_HANDLE  PipeHandle;
+    ULONG             MaximumTransferSize;
+    ULONG             PipeFlags;
+} USBD_PIPE_INFORMATION, *PUSBD_PIPE_INFORMATION;
+
+#endif /* USBPCAP_HOST_USBDI_H */
@@ -0,0 +1,12 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/* State behind the kernel stand-ins of USBPcapPortable.h */
+
+#include "USBPcapPortable.h"
+
+ULONG UsbpcapHostProcessorCount = 1;
+__thread ULONG UsbpcapHostProcessor;
@@ -0,0 +1,23 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/* Stand-in for the DDK usb.h: USBD_STATUS for include/USBPcap.h and the
+ * status codes the trigger matcher and endpoint counters look for.
+ */
+
+#ifndef USBPCAP_HOST_USB_H
+#define USBPCAP_HOST_USB_H
+
+typedef LONG USBD_STATUS;
+
+#define USBD_STATUS_SUCCESS           ((USBD_STATUS)0x00000000L)
+#define USBD_STATUS_STALL_PID         ((USBD_STATUS)0xC0000004L)
+#define USBD_STATUS_ENDPOINT_HALTED   ((USBD_STATUS)0xC0000030L)
+#define USBD_STATUS_CANCELED          ((USBD_STATUS)0xC0010000L)
+
+#define USBD_ERROR(Status)            ((USBD_STATUS)(Status) < 0)
+
+#endif /* USBPCAP_HOST_USB_H */
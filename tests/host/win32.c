@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Win32 events and semaphores on top of pthreads. Only the semantics the
+ * USBPcapCMD modules rely on are implemented: single object waits and
+ * events/semaphores created without name.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <windows.h>
+
+struct host_object
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    BOOL semaphore;
+    BOOL manual;  /* Event only: manual reset */
+    LONG count;   /* Event: signalled state, semaphore: current count */
+    LONG maximum; /* Semaphore only */
+};
+
+static HANDLE host_create_object(BOOL semaphore, BOOL manual,
+                                 LONG count, LONG maximum)
+{
+    struct host_object *obj = calloc(1, sizeof(struct host_object));
+
+    if (obj == NULL)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_init(&obj->mutex, NULL);
+    pthread_cond_init(&obj->cond, NULL);
+    obj->semaphore = semaphore;
+    obj->manual = manual;
+    obj->count = count;
+    obj->maximum = maximum;
+    return obj;
+}
+
+HANDLE host_create_event(BOOL manual, BOOL initial)
+{
+    return host_create_object(FALSE, manual, initial ? 1 : 0, 1);
+}
+
+HANDLE host_create_semaphore(LONG initial, LONG maximum)
+{
+    if ((initial < 0) || (maximum <= 0) || (initial > maximum))
+    {
+        return NULL;
+    }
+    return host_create_object(TRUE, FALSE, initial, maximum);
+}
+
+BOOL SetEvent(HANDLE handle)
+{
+    struct host_object *obj = handle;
+
+    pthread_mutex_lock(&obj->mutex);
+    obj->count = 1;
+    pthread_cond_broadcast(&obj->cond);
+    pthread_mutex_unlock(&obj->mutex);
+    return TRUE;
+}
+
+BOOL ResetEvent(HANDLE handle)
+{
+    struct host_object *obj = handle;
+
+    pthread_mutex_lock(&obj->mutex);
+    obj->count = 0;
+    pthread_mutex_unlock(&obj->mutex);
+    return TRUE;
+}
+
+BOOL ReleaseSemaphore(HANDLE handle, LONG count, LONG *previous)
+{
+    struct host_object *obj = handle;
+    BOOL success = FALSE;
+
+    pthread_mutex_lock(&obj->mutex);
+    if ((count > 0) && (count <= obj->maximum - obj->count))
+    {
+        if (previous != NULL)
+        {
+            *previous = obj->count;
+        }
+        obj->count += count;
+        pthread_cond_broadcast(&obj->cond);
+        success = TRUE;
+    }
+    pthread_mutex_unlock(&obj->mutex);
+    return success;
+}
+
+DWORD WaitForSingleObject(HANDLE handle, DWORD milliseconds)
+{
+    struct host_object *obj = handle;
+    struct timespec deadline;
+    DWORD result = WAIT_OBJECT_0;
+
+    if (milliseconds != INFINITE)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += milliseconds / 1000;
+        deadline.tv_nsec += (long)(milliseconds % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    pthread_mutex_lock(&obj->mutex);
+    while (obj->count == 0)
+    {
+        if (milliseconds == INFINITE)
+        {
+            pthread_cond_wait(&obj->cond, &obj->mutex);
+        }
+        else if (pthread_cond_timedwait(&obj->cond, &obj->mutex,
+                                        &deadline) == ETIMEDOUT)
+        {
+            result = WAIT_TIMEOUT;
+            break;
+        }
+    }
+    if ((result == WAIT_OBJECT_0) && (obj->semaphore || !obj->manual))
+    {
+        obj->count--;
+    }
+    pthread_mutex_unlock(&obj->mutex);
+    return result;
+}
+
+BOOL CloseHandle(HANDLE handle)
+{
+    struct host_object *obj = handle;
+
+    pthread_cond_destroy(&obj->cond);
+    pthread_mutex_destroy(&obj->mutex);
+    free(obj);
+    return TRUE;
+}
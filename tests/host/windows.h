@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Stand-in for the SDK windows.h. USBPcapCMD modules that do not call any
+ * system functions (flush policy, pcapng encoder, merge heap, rotation,
+ * ...) need only the basic types, which USBPcapPortable.h already has.
+ * The read pipeline additionally uses events and semaphores, these are
+ * implemented with pthreads in win32.c.
+ */
+
+#ifndef USBPCAP_HOST_WINDOWS_H
+#define USBPCAP_HOST_WINDOWS_H
+
+#include <strings.h>
+
+#include "USBPcapPortable.h"
+
+typedef int                BOOL;
+typedef unsigned short     WORD;
+typedef uint32_t           DWORD, *LPDWORD;
+typedef void               *HANDLE;
+
+typedef struct _OVERLAPPED
+{
+    ULONG_PTR Internal;
+    ULONG_PTR InternalHigh;
+    DWORD     Offset;
+    DWORD     OffsetHigh;
+    HANDLE    hEvent;
+} OVERLAPPED, *LPOVERLAPPED;
+
+#define MAXDWORD           0xFFFFFFFF
+#define INFINITE           0xFFFFFFFF
+#define WAIT_OBJECT_0      0x00000000
+#define WAIT_TIMEOUT       0x00000102
+#define WAIT_FAILED        0xFFFFFFFF
+
+#define _stricmp(a, b)     strcasecmp((a), (b))
+
+/* Security attributes and names are not supported, pass NULL */
+#define CreateEvent(sa, manual, initial, name) \
+    host_create_event((manual), (initial))
+#define CreateSemaphore(sa, initial, maximum, name) \
+    host_create_semaphore((initial), (maximum))
+
+HANDLE host_create_event(BOOL manual, BOOL initial);
+HANDLE host_create_semaphore(LONG initial, LONG maximum);
+BOOL SetEvent(HANDLE handle);
+BOOL ResetEvent(HANDLE handle);
+BOOL ReleaseSemaphore(HANDLE handle, LONG count, LONG *previous);
+DWORD WaitForSingleObject(HANDLE handle, DWORD milliseconds);
+BOOL CloseHandle(HANDLE handle);
+
+#endif /* USBPCAP_HOST_WINDOWS_H */
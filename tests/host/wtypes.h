@@ -0,0 +1,9 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/* Stand-in for the SDK wtypes.h, see windows.h */
+
+#include <windows.h>
@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/*
+ * Per URB cost of the filter in idle and armed state. Every simulated
+ * bulk IN URB goes through the same module calls the driver makes:
+ *
+ *   idle:  USBPcapIsAddressArmed() only, the IRP is passed down with
+ *          IoSkipCurrentIrpStackLocation.
+ *   armed: the same check, then on submit and on completion the endpoint
+ *          lookup, the endpoint filter and a record stored in the ring;
+ *          on completion also the URB IRP table check.
+ *
+ * I/O manager work (completion routine, stack location copy) is not part
+ * of the model, it only adds to the armed cost.
+ */
+
+#include "USBPcapCaptureFilter.h"
+#include "USBPcapTables.h"
+#include "test.h"
+#include "records.h"
+
+#define RING_SIZE    (4 * 1024 * 1024)
+#define ENDPOINTS    8
+#define DEVICE       5
+#define PAYLOAD      64
+
+#define HANDLE(n)  ((USBD_PIPE_HANDLE)(ULONG_PTR)(0x7f3a0000 + (n) * 0x90))
+#define IRP(n)     ((PIRP)(ULONG_PTR)(0x20000 + (n) * 16))
+
+static USBPCAP_RING            ring;
+static USBPCAP_ENDPOINT_FILTER filter;
+static PUSBPCAP_ENDPOINT_TABLE endpointTable;
+static PUSBPCAP_URB_IRP_TABLE  urbIrpTable;
+static LONG                    armed;
+static UCHAR                   payload[PAYLOAD];
+static unsigned long long      records;
+
+/* One pass of DkTgtInDevCtl or DkTgtInDevCtlCompletion */
+static void urb_pass(unsigned n, BOOLEAN post)
+{
+    USBPCAP_ENDPOINT_INFO info;
+    USBPCAP_URB_IRP_INFO  irpInfo;
+
+    if (!post && !USBPcapIsAddressArmed(&filter, armed, DEVICE))
+    {
+        /* Passed down without completion routine */
+        return;
+    }
+
+    if (post)
+    {
+        USBPcapObtainURBIRPInfo(urbIrpTable, IRP(n), &irpInfo);
+    }
+    if (!USBPcapIsDeviceFiltered(&filter.address, DEVICE) ||
+        !USBPcapRetrieveEndpointInfo(endpointTable, HANDLE(n % ENDPOINTS), &info) ||
+        !USBPcapIsEndpointFiltered(&filter, DEVICE, info.endpointAddress,
+                                   USBPCAP_TRANSFER_BULK))
+    {
+        return;
+    }
+
+    USBPcapRingEnter(&ring);
+    if (USBPcapRingGetFree(&ring) < 4096)
+    {
+        /* Reader is not part of the measurement */
+        USBPcapRingReset(&ring);
+    }
+    /* IN transfer: data is captured on completion only */
+    CHECK(NT_SUCCESS(test_store_record(&ring, n, n, payload,
+                                       post ? PAYLOAD : 0)));
+    USBPcapRingLeave(&ring);
+    records++;
+}
+
+static double run(LONG state, unsigned urbs)
+{
+    uint64_t start;
+    unsigned i;
+
+    armed = state;
+    records = 0;
+    start = test_now_ns();
+    for (i = 0; i < urbs; i++)
+    {
+        urb_pass(i, FALSE);
+        if (armed)
+        {
+            /* Idle URBs get no completion routine */
+            urb_pass(i, TRUE);
+        }
+    }
+    return (double)(test_now_ns() - start) / urbs;
+}
+
+int main(void)
+{
+    static UCHAR buffer[RING_SIZE];
+    unsigned urbs = 5000000 * test_bench_scale();
+    double idleNs, armedNs;
+    unsigned i;
+
+    USBPcapRingInitialize(&ring);
+    USBPcapRingAttachBuffer(&ring, buffer, sizeof(buffer), 0);
+    USBPcapInitEndpointFilter(&filter, NULL);
+    filter.address.filterAll = TRUE;
+    endpointTable = USBPcapInitializeEndpointTable();
+    urbIrpTable = USBPcapInitializeURBIRPInfoTable(USBPCAP_URB_IRP_TABLE_SLOTS);
+    memset(payload, 0x5A, sizeof(payload));
+
+    for (i = 0; i < ENDPOINTS; i++)
+    {
+        USBD_PIPE_INFORMATION pipe;
+
+        memset(&pipe, 0, sizeof(pipe));
+        pipe.PipeHandle = HANDLE(i);
+        pipe.EndpointAddress = (UCHAR)(0x81 + i);
+        pipe.PipeType = UsbdPipeTypeBulk;
+        USBPcapAddEndpointInfo(endpointTable, &pipe, DEVICE);
+    }
+
+    idleNs = run(0, urbs);
+    CHECK_EQ(records, 0);
+    armedNs = run(1, urbs);
+    CHECK_EQ(records, 2ULL * urbs);
+
+    printf("state  ns/URB  records/URB\n");
+    printf("idle   %6.1f  0\n", idleNs);
+    printf("armed  %6.1f  2\n", armedNs);
+
+    USBPcapFreeURBIRPInfoTable(urbIrpTable);
+    USBPcapFreeEndpointTable(endpointTable);
+    return 0;
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * USBPcapCMD filter argument parsing: --devices, --endpoints and
+ * --transfer-types lists turned into the filter bitmaps.
+ */
+
+#include "iocontrol.h"
+#include "test.h"
+
+static void test_address_list(void)
+{
+    USBPCAP_ADDRESS_FILTER filter;
+    char list[] = "1,31,32,,127";
+    char bad[] = "1,x";
+    char invalid[] = "128";
+
+    CHECK(USBPcapInitAddressFilter(&filter, list, FALSE));
+    CHECK_EQ(filter.addresses[0], 0x80000002);
+    CHECK_EQ(filter.addresses[1], 0x00000001);
+    CHECK_EQ(filter.addresses[2], 0);
+    CHECK_EQ(filter.addresses[3], 0x80000000);
+    CHECK(!filter.filterAll);
+
+    CHECK(USBPcapInitAddressFilter(&filter, NULL, TRUE));
+    CHECK(filter.filterAll);
+
+    /* Filter is left untouched on error */
+    CHECK(!USBPcapInitAddressFilter(&filter, bad, FALSE));
+    CHECK(!USBPcapInitAddressFilter(&filter, invalid, FALSE));
+    CHECK(filter.filterAll);
+
+    TEST_PASS("address_list");
+}
+
+static void test_endpoint_list(void)
+{
+    USBPCAP_ENDPOINT_FILTER filter;
+    char endpoints[] = "5:0x81,5:2,127:0x8F,7:0";
+    char types[] = "bulk,control";
+    char bad_types[] = "bulk,iso";
+    char bad_address[] = "128:1";
+    char bad_endpoint[] = "5:0x11";
+    char bad_separator[] = "5:1;6:1";
+    int i;
+
+    CHECK(USBPcapInitEndpointFilter(&filter, NULL, NULL));
+    CHECK_EQ(filter.transferTypes, USBPCAP_TRANSFER_MASK_ALL);
+    for (i = 0; i < 128; i++)
+    {
+        CHECK_EQ(filter.endpoints[i], 0xFFFFFFFF);
+    }
+
+    CHECK(USBPcapInitEndpointFilter(&filter, endpoints, types));
+    CHECK_EQ(filter.transferTypes,
+             USBPCAP_TRANSFER_MASK(USBPCAP_TRANSFER_BULK) |
+             USBPCAP_TRANSFER_MASK(USBPCAP_TRANSFER_CONTROL));
+    for (i = 0; i < 128; i++)
+    {
+        UINT32 expected = 0xFFFFFFFF;
+
+        if (i == 5)
+        {
+            expected = (1u << 17) | (1u << 2);
+        }
+        else if (i == 7)
+        {
+            expected = 1u << 0;
+        }
+        else if (i == 127)
+        {
+            expected = 1u << 31;
+        }
+        CHECK_EQ(filter.endpoints[i], expected);
+        CHECK_EQ(filter.endpoints[i] & USBPCAP_ENDPOINT_BIT(0x81),
+                 (i == 5 || expected == 0xFFFFFFFF) ? (1u << 17) : 0);
+    }
+
+    CHECK(!USBPcapInitEndpointFilter(&filter, NULL, bad_types));
+    CHECK(!USBPcapInitEndpointFilter(&filter, bad_address, NULL));
+    CHECK(!USBPcapInitEndpointFilter(&filter, bad_endpoint, NULL));
+    CHECK(!USBPcapInitEndpointFilter(&filter, bad_separator, NULL));
+
+    TEST_PASS("endpoint_list");
+}
+
+int main(void)
+{
+    test_address_list();
+    test_endpoint_list();
+    return 0;
+}
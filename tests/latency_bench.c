@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/*
+ * Cost of counting URB completion in the latency histograms with N
+ * simulated processors. Every processor counts into its own histograms
+ * (per-CPU); for comparison all of them are also made to count into the
+ * histograms of processor 0 (shared), which is what single set of
+ * counters would cost.
+ */
+
+#include <pthread.h>
+
+#include "USBPcapLatency.h"
+#include "test.h"
+
+#define MAX_THREADS  8
+#define ENDPOINTS    8
+
+static USBPCAP_LATENCY latency;
+static unsigned addsPerThread;
+static BOOLEAN shared;
+
+static void *adder(void *arg)
+{
+    ULONG processor = (ULONG)(uintptr_t)arg;
+    UINT64 value = 10 + processor;
+    unsigned n;
+
+    UsbpcapHostProcessor = processor;
+    for (n = 0; n < addsPerThread; n++)
+    {
+        USBPcapLatencyAdd(&latency, shared ? 0 : processor,
+                          5, (UCHAR)(0x81 + n % ENDPOINTS),
+                          USBPCAP_TRANSFER_BULK, value);
+        value = (value * 7 + 3) % 50000;
+    }
+    return NULL;
+}
+
+static void run(unsigned threads, BOOLEAN sharedCounters)
+{
+    pthread_t thread[MAX_THREADS];
+    uint64_t start, elapsed;
+    unsigned i;
+
+    shared = sharedCounters;
+    addsPerThread = 2000000 * test_bench_scale() / threads;
+    CHECK(NT_SUCCESS(USBPcapLatencyStart(&latency)));
+
+    start = test_now_ns();
+    for (i = 0; i < threads; i++)
+    {
+        pthread_create(&thread[i], NULL, adder, (void *)(uintptr_t)i);
+    }
+    for (i = 0; i < threads; i++)
+    {
+        pthread_join(thread[i], NULL);
+    }
+    elapsed = test_now_ns() - start;
+
+    printf("threads %u %-7s: %6.1f ns/URB %8.2f MURB/s\n",
+           threads, sharedCounters ? "shared" : "per-CPU",
+           (double)elapsed / ((double)addsPerThread * threads),
+           (double)addsPerThread * threads * 1e3 / (double)elapsed);
+}
+
+int main(void)
+{
+    unsigned threads;
+
+    UsbpcapHostProcessorCount = MAX_THREADS;
+    USBPcapLatencyInitialize(&latency);
+
+    for (threads = 1; threads <= MAX_THREADS; threads *= 2)
+    {
+        run(threads, FALSE);
+        run(threads, TRUE);
+    }
+
+    USBPcapLatencyFree(&latency);
+    return 0;
+}
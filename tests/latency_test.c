@@ -0,0 +1,237 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/*
+ * Latency histograms of USBPcapLatency.c: bucket boundaries, histogram
+ * keys, untracked URBs and per-processor counters updated concurrently.
+ */
+
+#include <pthread.h>
+
+#include "USBPcapLatency.h"
+#include "test.h"
+
+#define CPUS  4
+
+static USBPCAP_LATENCY latency;
+static USBPCAP_IOCTL_LATENCY out;
+
+static void setup(ULONG cpus)
+{
+    UsbpcapHostProcessorCount = cpus;
+    USBPcapLatencyInitialize(&latency);
+    CHECK(NT_SUCCESS(USBPcapLatencyStart(&latency)));
+}
+
+static PUSBPCAP_LATENCY_HISTOGRAM find(USHORT device, UCHAR endpoint,
+                                       UCHAR transfer)
+{
+    UINT16 i;
+
+    for (i = 0; i < out.count; i++)
+    {
+        PUSBPCAP_LATENCY_HISTOGRAM h = &out.histograms[i];
+
+        if ((h->device == device) && (h->endpoint == endpoint) &&
+            (h->transfer == transfer))
+        {
+            return h;
+        }
+    }
+    return NULL;
+}
+
+static UINT64 total(PUSBPCAP_LATENCY_HISTOGRAM h)
+{
+    UINT64 sum = 0;
+    ULONG b;
+
+    for (b = 0; b < USBPCAP_LATENCY_BUCKETS; b++)
+    {
+        sum += h->buckets[b];
+    }
+    return sum;
+}
+
+/* Bucket N holds [2^(N-1), 2^N) microseconds, latency is in 100 ns */
+static void test_buckets(void)
+{
+    ULONG b;
+
+    CHECK_EQ(USBPcapLatencyGetBucket(0), 0);
+    CHECK_EQ(USBPcapLatencyGetBucket(9), 0);
+    CHECK_EQ(USBPcapLatencyGetBucket(10), 1);
+    CHECK_EQ(USBPcapLatencyGetBucket(19), 1);
+    CHECK_EQ(USBPcapLatencyGetBucket(20), 2);
+    for (b = 1; b < USBPCAP_LATENCY_BUCKETS - 1; b++)
+    {
+        UINT64 low = 10ULL << (b - 1);
+
+        CHECK_EQ(USBPcapLatencyGetBucket(low), b);
+        CHECK_EQ(USBPcapLatencyGetBucket(2 * low - 1), b);
+    }
+    CHECK_EQ(USBPcapLatencyGetBucket(10ULL << 40), USBPCAP_LATENCY_BUCKETS - 1);
+    CHECK_EQ(USBPcapLatencyGetBucket(MAXULONG64), USBPCAP_LATENCY_BUCKETS - 1);
+    TEST_PASS("buckets");
+}
+
+/* Histograms of different processors are summed, keys come back intact */
+static void test_keys(void)
+{
+    PUSBPCAP_LATENCY_HISTOGRAM h;
+    UINT16 i;
+
+    setup(CPUS);
+    USBPcapLatencyAdd(&latency, 0, 127, 0x81, USBPCAP_TRANSFER_BULK, 15);
+    USBPcapLatencyAdd(&latency, 3, 127, 0x81, USBPCAP_TRANSFER_BULK, 15);
+    USBPcapLatencyAdd(&latency, 5, 127, 0x81, USBPCAP_TRANSFER_BULK, 1000);
+    USBPcapLatencyAdd(&latency, 1, 127, 0x01, USBPCAP_TRANSFER_BULK, 0);
+    USBPcapLatencyAdd(&latency, 1, 1, 0x00, USBPCAP_TRANSFER_CONTROL, 25);
+    USBPcapLatencyAdd(&latency, 2, 0x7FFF, 0xFF, 0xFF, 25);
+
+    memset(&out, 0xCC, sizeof(out));
+    USBPcapLatencyGet(&latency, &out);
+    CHECK_EQ(out.count, 4);
+    CHECK_EQ(out.untracked, 0);
+
+    h = find(127, 0x81, USBPCAP_TRANSFER_BULK);
+    CHECK(h != NULL);
+    CHECK_EQ(h->buckets[1], 2);
+    CHECK_EQ(h->buckets[USBPcapLatencyGetBucket(1000)], 1);
+    CHECK_EQ(total(h), 3);
+    CHECK(find(127, 0x01, USBPCAP_TRANSFER_BULK) != NULL);
+    CHECK_EQ(find(127, 0x01, USBPCAP_TRANSFER_BULK)->buckets[0], 1);
+    CHECK_EQ(find(1, 0x00, USBPCAP_TRANSFER_CONTROL)->buckets[2], 1);
+    CHECK_EQ(find(0x7FFF, 0xFF, 0xFF)->buckets[2], 1);
+
+    /* Unused histograms are zeroed */
+    for (i = out.count; i < USBPCAP_LATENCY_MAX_ENDPOINTS; i++)
+    {
+        CHECK_EQ(out.histograms[i].device, 0);
+        CHECK_EQ(total(&out.histograms[i]), 0);
+    }
+
+    USBPcapLatencyFree(&latency);
+    TEST_PASS("keys");
+}
+
+/* Endpoints that do not fit and URBs that could not be paired are
+ * untracked, nothing is counted while stopped, start clears everything.
+ */
+static void test_untracked(void)
+{
+    USHORT device;
+
+    setup(1);
+    for (device = 1; device <= USBPCAP_LATENCY_MAX_ENDPOINTS + 10; device++)
+    {
+        USBPcapLatencyAdd(&latency, 0, device, 0x81,
+                          USBPCAP_TRANSFER_INTERRUPT, 100);
+    }
+    USBPcapLatencyUntracked(&latency);
+    USBPcapLatencyGet(&latency, &out);
+    CHECK_EQ(out.count, USBPCAP_LATENCY_MAX_ENDPOINTS);
+    CHECK_EQ(out.untracked, 11);
+
+    /* Known keys still count when the table is full */
+    USBPcapLatencyAdd(&latency, 0, 1, 0x81, USBPCAP_TRANSFER_INTERRUPT, 100);
+    USBPcapLatencyGet(&latency, &out);
+    CHECK_EQ(out.untracked, 11);
+    CHECK_EQ(total(find(1, 0x81, USBPCAP_TRANSFER_INTERRUPT)), 2);
+
+    USBPcapLatencyStop(&latency);
+    USBPcapLatencyAdd(&latency, 0, 1, 0x81, USBPCAP_TRANSFER_INTERRUPT, 100);
+    USBPcapLatencyUntracked(&latency);
+    USBPcapLatencyGet(&latency, &out);
+    CHECK_EQ(out.untracked, 11);
+    CHECK_EQ(total(find(1, 0x81, USBPCAP_TRANSFER_INTERRUPT)), 2);
+
+    CHECK(NT_SUCCESS(USBPcapLatencyStart(&latency)));
+    USBPcapLatencyGet(&latency, &out);
+    CHECK_EQ(out.count, 0);
+    CHECK_EQ(out.untracked, 0);
+
+    USBPcapLatencyFree(&latency);
+    TEST_PASS("untracked");
+}
+
+#define THREADS      CPUS
+#define ADDS         200000
+#define KEYS         16
+
+/* Value added by thread for n-th URB */
+static UINT64 value(ULONG thread, ULONG n)
+{
+    return ((UINT64)(n * 2654435761UL + thread) >> (n % 24)) % 100000000;
+}
+
+static void *adder(void *arg)
+{
+    ULONG thread = (ULONG)(uintptr_t)arg;
+    ULONG n;
+
+    UsbpcapHostProcessor = thread;
+    for (n = 0; n < ADDS; n++)
+    {
+        USBPcapLatencyAdd(&latency, UsbpcapHostProcessor,
+                          (USHORT)(n % KEYS), 0x82, USBPCAP_TRANSFER_BULK,
+                          value(thread, n));
+        /* Two threads share every processor slot */
+        UsbpcapHostProcessor = (thread + n) % (THREADS / 2);
+    }
+    return NULL;
+}
+
+/* Concurrent completions lose no count */
+static void test_concurrent(void)
+{
+    static UINT32 expected[KEYS][USBPCAP_LATENCY_BUCKETS];
+    pthread_t threads[THREADS];
+    ULONG i;
+    ULONG n;
+    ULONG b;
+
+    setup(THREADS / 2);
+    for (i = 0; i < THREADS; i++)
+    {
+        for (n = 0; n < ADDS; n++)
+        {
+            expected[n % KEYS][USBPcapLatencyGetBucket(value(i, n))]++;
+        }
+        pthread_create(&threads[i], NULL, adder, (void *)(uintptr_t)i);
+    }
+    for (i = 0; i < THREADS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    USBPcapLatencyGet(&latency, &out);
+    CHECK_EQ(out.count, KEYS);
+    CHECK_EQ(out.untracked, 0);
+    for (n = 0; n < KEYS; n++)
+    {
+        PUSBPCAP_LATENCY_HISTOGRAM h = find((USHORT)n, 0x82,
+                                            USBPCAP_TRANSFER_BULK);
+
+        CHECK(h != NULL);
+        for (b = 0; b < USBPCAP_LATENCY_BUCKETS; b++)
+        {
+            CHECK_EQ(h->buckets[b], expected[n][b]);
+        }
+    }
+
+    USBPcapLatencyFree(&latency);
+    TEST_PASS("concurrent");
+}
+
+int main(void)
+{
+    test_buckets();
+    test_keys();
+    test_untracked();
+    test_concurrent();
+    return 0;
+}
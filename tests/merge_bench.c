@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * k-way merge of synthetic per-hub streams. Every hub produces records
+ * with random gaps between timestamps (including equal timestamps on
+ * different hubs). The heap merge is compared with picking the oldest
+ * record by scanning all sources, and every merged stream is checked to
+ * be in timestamp order, with ties in hub order.
+ */
+
+#include "merge.h"
+#include "test.h"
+
+#define MAX_HUBS 64
+
+struct stream
+{
+    UINT64 *timestamps;
+    unsigned count;
+    unsigned next;
+};
+
+static struct stream streams[MAX_HUBS];
+
+static void generate(int hubs, unsigned per_hub)
+{
+    uint32_t seed = 0x4ea9;
+    int h;
+
+    for (h = 0; h < hubs; h++)
+    {
+        UINT64 ts = 1000;
+        unsigned i;
+
+        streams[h].timestamps = realloc(streams[h].timestamps,
+                                        per_hub * sizeof(UINT64));
+        CHECK(streams[h].timestamps != NULL);
+        streams[h].count = per_hub;
+        streams[h].next = 0;
+        for (i = 0; i < per_hub; i++)
+        {
+            /* Bursts with small gaps, sometimes a long idle period */
+            ts += (test_random(&seed) % 64 == 0) ?
+                  test_random(&seed) % 100000 : test_random(&seed) % 16;
+            streams[h].timestamps[i] = ts;
+        }
+    }
+}
+
+static void check_order(UINT64 *last, int *last_source,
+                        UINT64 timestamp, int source)
+{
+    CHECK(timestamp >= *last);
+    CHECK(timestamp != *last || source >= *last_source);
+    *last = timestamp;
+    *last_source = source;
+}
+
+static unsigned long long merge_heap_run(int hubs)
+{
+    struct merge_heap heap;
+    unsigned long long merged = 0;
+    UINT64 last = 0;
+    int last_source = 0;
+    UINT64 timestamp;
+    int source;
+    int h;
+
+    CHECK(merge_init(&heap, hubs));
+    for (h = 0; h < hubs; h++)
+    {
+        merge_push(&heap, h, streams[h].timestamps[0]);
+        streams[h].next = 1;
+    }
+
+    while (merge_peek(&heap, &source, &timestamp))
+    {
+        struct stream *s = &streams[source];
+
+        check_order(&last, &last_source, timestamp, source);
+        merge_pop(&heap);
+        merged++;
+        if (s->next < s->count)
+        {
+            merge_push(&heap, source, s->timestamps[s->next++]);
+        }
+        CHECK(heap.count <= hubs);
+    }
+
+    merge_free(&heap);
+    return merged;
+}
+
+static unsigned long long merge_scan_run(int hubs)
+{
+    unsigned long long merged = 0;
+    UINT64 last = 0;
+    int last_source = 0;
+    int h;
+
+    for (h = 0; h < hubs; h++)
+    {
+        streams[h].next = 0;
+    }
+
+    for (;;)
+    {
+        int oldest = -1;
+
+        for (h = 0; h < hubs; h++)
+        {
+            struct stream *s = &streams[h];
+
+            if ((s->next < s->count) &&
+                ((oldest < 0) || (s->timestamps[s->next] <
+                                  streams[oldest].timestamps[streams[oldest].next])))
+            {
+                oldest = h;
+            }
+        }
+        if (oldest < 0)
+        {
+            break;
+        }
+        check_order(&last, &last_source,
+                    streams[oldest].timestamps[streams[oldest].next], oldest);
+        streams[oldest].next++;
+        merged++;
+    }
+
+    return merged;
+}
+
+int main(void)
+{
+    static const int hub_counts[] = { 2, 4, 8, 16, 32, 64 };
+    unsigned total = 2000000 * test_bench_scale();
+    size_t i;
+    int h;
+
+    printf("%u records per run\n", total);
+    printf("%6s %16s %16s\n", "hubs", "heap Mrec/s", "scan Mrec/s");
+    for (i = 0; i < sizeof(hub_counts) / sizeof(hub_counts[0]); i++)
+    {
+        int hubs = hub_counts[i];
+        unsigned long long merged;
+        uint64_t start, heap_ns, scan_ns;
+
+        generate(hubs, total / hubs);
+
+        start = test_now_ns();
+        merged = merge_heap_run(hubs);
+        heap_ns = test_now_ns() - start;
+        CHECK_EQ(merged, (unsigned long long)(total / hubs) * hubs);
+
+        start = test_now_ns();
+        merged = merge_scan_run(hubs);
+        scan_ns = test_now_ns() - start;
+        CHECK_EQ(merged, (unsigned long long)(total / hubs) * hubs);
+
+        printf("%6d %16.1f %16.1f\n", hubs,
+               merged / ((double)heap_ns / 1e3),
+               merged / ((double)scan_ns / 1e3));
+    }
+
+    for (h = 0; h < MAX_HUBS; h++)
+    {
+        free(streams[h].timestamps);
+    }
+    return 0;
+}
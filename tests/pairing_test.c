@@ -0,0 +1,389 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/*
+ * Pairing of URB submissions with completions in completion-only capture.
+ * Synthetic streams of submit and complete events, modelled on devices
+ * that keep URBs queued on several endpoints and reuse their IRPs, are
+ * run through the submit table the same way USBPcapURBStoreSubmit and
+ * USBPcapAnalyzeURB do.
+ */
+
+#include <pthread.h>
+
+#include "USBPcapTables.h"
+#include "USBPcapStatistics.h"
+#include "test.h"
+
+typedef struct
+{
+    UCHAR     address;
+    UCHAR     transfer;
+    unsigned  depth;     /* URBs the class driver keeps queued */
+} ENDPOINT;
+
+/* 8 + 32 + 32 + 16 + 64 + 64 + 2 = 218 URBs in flight at most */
+static const ENDPOINT endpoints[] =
+{
+    { 0x00, USBPCAP_TRANSFER_CONTROL,     8 },
+    { 0x81, USBPCAP_TRANSFER_BULK,       32 },
+    { 0x02, USBPCAP_TRANSFER_BULK,       32 },
+    { 0x83, USBPCAP_TRANSFER_INTERRUPT,  16 },
+    { 0x84, USBPCAP_TRANSFER_ISOCHRONOUS, 64 },
+    { 0x05, USBPCAP_TRANSFER_ISOCHRONOUS, 64 },
+    { 0x86, USBPCAP_TRANSFER_INTERRUPT,   2 },
+};
+
+#define ENDPOINTS    (sizeof(endpoints) / sizeof(endpoints[0]))
+#define MAX_DEPTH    64
+
+/* IRP of the class driver, resubmitted after every completion */
+typedef struct
+{
+    UCHAR                 stack[0x118];  /* Realistic IRP allocation size */
+    BOOLEAN               deferred;      /* Submission was not captured */
+    USBPCAP_URB_IRP_INFO  submitted;
+} TEST_IRP;
+
+typedef struct
+{
+    TEST_IRP   *irps[MAX_DEPTH];
+    unsigned   head;       /* Oldest URB in flight, endpoints complete in order */
+    unsigned   inFlight;
+} ENDPOINT_QUEUE;
+
+typedef struct
+{
+    UINT64  urbs;
+    UINT64  deferred;
+    UINT64  paired;
+    UINT64  records;
+} STREAM_COUNTS;
+
+static USBPCAP_STATISTICS stats;
+
+/* Mirrors USBPcapURBStoreSubmit */
+static void submit(PUSBPCAP_URB_IRP_TABLE table, TEST_IRP *irp,
+                   const ENDPOINT *ep, UINT64 clock, STREAM_COUNTS *counts)
+{
+    USBPCAP_URB_IRP_INFO *info = &irp->submitted;
+
+    counts->urbs++;
+    irp->deferred = FALSE;
+    if (ep->transfer == USBPCAP_TRANSFER_CONTROL)
+    {
+        /* Captured on submission */
+        counts->records++;
+        return;
+    }
+
+    counts->deferred++;
+    memset(info, 0, sizeof(*info));
+    info->irp = (PIRP)irp;
+    info->timestamp.QuadPart = (LONGLONG)clock;
+    info->info = 0x01;
+    info->endpoint = ep->address;
+    info->transfer = ep->transfer;
+    info->device = (USHORT)(clock % 127 + 1);
+
+    if ((table == NULL) || !USBPcapAddURBIRPInfo(table, info))
+    {
+        USBPcapStatisticsURBUnpaired(&stats);
+        counts->records++;
+        return;
+    }
+    irp->deferred = TRUE;
+}
+
+/* Mirrors the completion side of USBPcapAnalyzeURB */
+static void complete(PUSBPCAP_URB_IRP_TABLE table, TEST_IRP *irp,
+                     STREAM_COUNTS *counts)
+{
+    USBPCAP_URB_IRP_INFO info;
+
+    if (USBPcapObtainURBIRPInfo(table, (PIRP)irp, &info))
+    {
+        CHECK(irp->deferred);
+        CHECK_EQ(memcmp(&info, &irp->submitted, sizeof(info)), 0);
+        counts->paired++;
+    }
+    else
+    {
+        CHECK(!irp->deferred);
+    }
+    irp->deferred = FALSE;
+    counts->records++;
+}
+
+static void check_counts(const STREAM_COUNTS *counts, UINT64 unpaired)
+{
+    USBPCAP_IOCTL_STATISTICS out;
+
+    USBPcapStatisticsGet(&stats, &out);
+    CHECK_EQ(out.urbsUnpaired, unpaired);
+    CHECK_EQ(counts->paired + out.urbsUnpaired, counts->deferred);
+    /* Paired URBs are captured as single record, all others as two */
+    CHECK_EQ(counts->records, 2 * counts->urbs - counts->paired);
+}
+
+/*
+ * Runs random stream of submit and complete events on all endpoints of
+ * single device. Returns the maximum number of URBs in flight.
+ */
+static unsigned run_stream(PUSBPCAP_URB_IRP_TABLE table, uint32_t seed,
+                           unsigned events, STREAM_COUNTS *counts)
+{
+    static ENDPOINT_QUEUE queues[ENDPOINTS];
+    static TEST_IRP *pool[ENDPOINTS][MAX_DEPTH];
+    UINT64 clock = 1;
+    unsigned inFlight = 0;
+    unsigned maxInFlight = 0;
+    unsigned e;
+    unsigned i;
+
+    memset(queues, 0, sizeof(queues));
+    for (e = 0; e < ENDPOINTS; e++)
+    {
+        for (i = 0; i < endpoints[e].depth; i++)
+        {
+            pool[e][i] = (TEST_IRP *)malloc(sizeof(TEST_IRP));
+            CHECK(pool[e][i] != NULL);
+        }
+    }
+
+    while (events-- > 0)
+    {
+        ENDPOINT_QUEUE *q;
+
+        e = test_random(&seed) % ENDPOINTS;
+        q = &queues[e];
+        clock += 1 + test_random(&seed) % 8;
+
+        /* Class drivers keep their queues full, favour submissions */
+        if ((q->inFlight < endpoints[e].depth) &&
+            ((q->inFlight == 0) || (test_random(&seed) % 8 != 0)))
+        {
+            /* Every IRP slot of the queue owns one IRP and reuses it */
+            unsigned slot = (q->head + q->inFlight) % endpoints[e].depth;
+
+            q->irps[slot] = pool[e][slot];
+            submit(table, q->irps[slot], &endpoints[e], clock, counts);
+            q->inFlight++;
+            inFlight++;
+            maxInFlight = max(maxInFlight, inFlight);
+        }
+        else if (q->inFlight > 0)
+        {
+            complete(table, q->irps[q->head], counts);
+            q->head = (q->head + 1) % endpoints[e].depth;
+            q->inFlight--;
+            inFlight--;
+        }
+    }
+
+    /* Device is removed, pending URBs complete */
+    for (e = 0; e < ENDPOINTS; e++)
+    {
+        while (queues[e].inFlight > 0)
+        {
+            complete(table, queues[e].irps[queues[e].head], counts);
+            queues[e].head = (queues[e].head + 1) % endpoints[e].depth;
+            queues[e].inFlight--;
+        }
+        for (i = 0; i < endpoints[e].depth; i++)
+        {
+            free(pool[e][i]);
+        }
+    }
+
+    return maxInFlight;
+}
+
+static void setup(ULONG cpus)
+{
+    UsbpcapHostProcessorCount = cpus;
+    UsbpcapHostProcessor = 0;
+    CHECK(NT_SUCCESS(USBPcapStatisticsInitialize(&stats)));
+}
+
+/* All queues full most of the time: submit table holds every deferred
+ * URB, nothing is unpaired.
+ */
+static void test_stream(void)
+{
+    PUSBPCAP_URB_IRP_TABLE table;
+    STREAM_COUNTS counts = { 0 };
+    unsigned maxInFlight;
+
+    setup(1);
+    table = USBPcapInitializeURBIRPInfoTable(USBPCAP_SUBMIT_TABLE_SLOTS);
+    CHECK(table != NULL);
+
+    maxInFlight = run_stream(table, 0x1234, 1000000, &counts);
+    CHECK(maxInFlight > 200);
+    CHECK(maxInFlight <= USBPCAP_SUBMIT_TABLE_SLOTS);
+    check_counts(&counts, 0);
+    CHECK(counts.paired > 0);
+
+    USBPcapFreeURBIRPInfoTable(table);
+    USBPcapStatisticsFree(&stats);
+    TEST_PASS("stream");
+}
+
+/* Table far smaller than the number of URBs in flight still pairs all
+ * of them (overflow list).
+ */
+static void test_small_table(void)
+{
+    PUSBPCAP_URB_IRP_TABLE table;
+    STREAM_COUNTS counts = { 0 };
+
+    setup(1);
+    table = USBPcapInitializeURBIRPInfoTable(8);
+    CHECK(table != NULL);
+
+    run_stream(table, 0x777, 200000, &counts);
+    check_counts(&counts, 0);
+
+    USBPcapFreeURBIRPInfoTable(table);
+    USBPcapStatisticsFree(&stats);
+    TEST_PASS("small table");
+}
+
+/* Without submit table every deferred URB is unpaired, counted and
+ * captured as two records.
+ */
+static void test_no_table(void)
+{
+    STREAM_COUNTS counts = { 0 };
+
+    setup(4);
+    run_stream(NULL, 0x99, 100000, &counts);
+    CHECK_EQ(counts.paired, 0);
+    check_counts(&counts, counts.deferred);
+
+    USBPcapStatisticsFree(&stats);
+    TEST_PASS("no table");
+}
+
+#define SUBMITTERS        3
+#define CONCURRENT_URBS   200000
+#define QUEUE_SIZE        64
+
+/* URBs submitted on one processor and completed on another */
+typedef struct
+{
+    TEST_IRP          irps[QUEUE_SIZE];
+    volatile LONG     submitted;
+    volatile LONG     completed;
+    STREAM_COUNTS     counts;
+    STREAM_COUNTS     completeCounts;
+} SUBMIT_QUEUE;
+
+static SUBMIT_QUEUE submitQueues[SUBMITTERS];
+static PUSBPCAP_URB_IRP_TABLE sharedTable;
+
+static void *submitter(void *arg)
+{
+    ULONG index = (ULONG)(uintptr_t)arg;
+    SUBMIT_QUEUE *q = &submitQueues[index];
+    uint32_t seed = 0x51 + index;
+    LONG n;
+
+    UsbpcapHostProcessor = index;
+    for (n = 0; n < CONCURRENT_URBS; n++)
+    {
+        const ENDPOINT *ep = &endpoints[test_random(&seed) % ENDPOINTS];
+
+        while (n - __atomic_load_n(&q->completed, __ATOMIC_ACQUIRE) >= QUEUE_SIZE)
+        {
+            sched_yield();
+        }
+        submit(sharedTable, &q->irps[n % QUEUE_SIZE], ep, (UINT64)n,
+               &q->counts);
+        __atomic_store_n(&q->submitted, n + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void *completer(void *arg)
+{
+    ULONG done = 0;
+    uint32_t seed = 0xc0;
+
+    UNREFERENCED_PARAMETER(arg);
+    UsbpcapHostProcessor = SUBMITTERS;
+    while (done < SUBMITTERS)
+    {
+        SUBMIT_QUEUE *q = &submitQueues[test_random(&seed) % SUBMITTERS];
+        LONG completed = q->completed;
+
+        if (completed == CONCURRENT_URBS)
+        {
+            continue;
+        }
+        if (completed == __atomic_load_n(&q->submitted, __ATOMIC_ACQUIRE))
+        {
+            sched_yield();
+            continue;
+        }
+
+        complete(sharedTable, &q->irps[completed % QUEUE_SIZE],
+                 &q->completeCounts);
+        __atomic_store_n(&q->completed, completed + 1, __ATOMIC_RELEASE);
+        if (completed + 1 == CONCURRENT_URBS)
+        {
+            done++;
+        }
+    }
+    return NULL;
+}
+
+static void test_concurrent(void)
+{
+    pthread_t threads[SUBMITTERS + 1];
+    STREAM_COUNTS counts = { 0 };
+    ULONG i;
+
+    setup(SUBMITTERS + 1);
+    sharedTable = USBPcapInitializeURBIRPInfoTable(USBPCAP_SUBMIT_TABLE_SLOTS);
+    CHECK(sharedTable != NULL);
+    memset(submitQueues, 0, sizeof(submitQueues));
+
+    for (i = 0; i < SUBMITTERS; i++)
+    {
+        pthread_create(&threads[i], NULL, submitter, (void *)(uintptr_t)i);
+    }
+    pthread_create(&threads[SUBMITTERS], NULL, completer, NULL);
+    for (i = 0; i <= SUBMITTERS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (i = 0; i < SUBMITTERS; i++)
+    {
+        counts.urbs += submitQueues[i].counts.urbs;
+        counts.deferred += submitQueues[i].counts.deferred;
+        counts.records += submitQueues[i].counts.records +
+                          submitQueues[i].completeCounts.records;
+        counts.paired += submitQueues[i].completeCounts.paired;
+    }
+    CHECK_EQ(counts.urbs, (UINT64)SUBMITTERS * CONCURRENT_URBS);
+    check_counts(&counts, 0);
+
+    USBPcapFreeURBIRPInfoTable(sharedTable);
+    USBPcapStatisticsFree(&stats);
+    TEST_PASS("concurrent");
+}
+
+int main(void)
+{
+    test_stream();
+    test_small_table();
+    test_no_table();
+    test_concurrent();
+    return 0;
+}
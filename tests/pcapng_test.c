@@ -0,0 +1,385 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/*
+ * pcapng round trip. Files are built with the USBPcapCMD block encoder and
+ * with the driver record expansion, then read back with a reader that
+ * applies the same structural checks as libpcap (block length alignment
+ * and trailer, byte order magic, version, option framing, interface ids,
+ * captured length against snaplen) and compared with the input.
+ *
+ *   pcapng_test [file]
+ *
+ * With file argument, the generated capture is also saved so it can be
+ * opened with libpcap based tools (tcpdump -r, capinfos, Wireshark).
+ */
+
+#include "test.h"
+#include "records.h"
+#include "pcapng.h"
+
+#define MAX_INTERFACES 8
+#define MAX_PACKETS    512
+#define FILE_SIZE      (1024 * 1024)
+
+struct interface
+{
+    UINT16 linktype;
+    UINT32 snaplen;
+    UINT8 tsresol;
+    char name[64];
+};
+
+struct packet
+{
+    UINT32 interface_id;
+    UINT64 timestamp;
+    UINT32 captured_len;
+    UINT32 packet_len;
+    const UCHAR *data; /* Points into the parsed file */
+};
+
+struct capture
+{
+    struct interface interfaces[MAX_INTERFACES];
+    UINT32 interface_count;
+    struct packet packets[MAX_PACKETS];
+    UINT32 packet_count;
+    UINT32 statistics_count;
+    UINT64 ifrecv;
+    UINT64 ifdrop;
+};
+
+static UINT32 read_u32(const UCHAR *p)
+{
+    UINT32 value;
+
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+/*
+ * Walks options at data[0..length). Returns FALSE on framing error.
+ */
+static BOOLEAN parse_options(const UCHAR *data, UINT32 length,
+                             struct interface *idb, struct capture *isb)
+{
+    UINT32 pos = 0;
+
+    while (pos < length)
+    {
+        pcapng_option_t opt;
+        const UCHAR *value;
+
+        if (length - pos < sizeof(opt))
+        {
+            return FALSE;
+        }
+        memcpy(&opt, &data[pos], sizeof(opt));
+        pos += sizeof(opt);
+        if (opt.option_code == PCAPNG_OPT_ENDOFOPT)
+        {
+            return (opt.option_length == 0) ? TRUE : FALSE;
+        }
+        if (length - pos < ((opt.option_length + 3u) & ~3u))
+        {
+            return FALSE;
+        }
+        value = &data[pos];
+        pos += (opt.option_length + 3u) & ~3u;
+
+        if (idb != NULL && opt.option_code == PCAPNG_IF_TSRESOL)
+        {
+            CHECK_EQ(opt.option_length, 1);
+            idb->tsresol = value[0];
+        }
+        else if (idb != NULL && opt.option_code == PCAPNG_IF_NAME)
+        {
+            CHECK(opt.option_length < sizeof(idb->name));
+            memcpy(idb->name, value, opt.option_length);
+            idb->name[opt.option_length] = '\0';
+        }
+        else if (isb != NULL && opt.option_code == PCAPNG_ISB_IFRECV)
+        {
+            CHECK_EQ(opt.option_length, sizeof(UINT64));
+            memcpy(&isb->ifrecv, value, sizeof(UINT64));
+        }
+        else if (isb != NULL && opt.option_code == PCAPNG_ISB_IFDROP)
+        {
+            CHECK_EQ(opt.option_length, sizeof(UINT64));
+            memcpy(&isb->ifdrop, value, sizeof(UINT64));
+        }
+    }
+
+    /* Options without opt_endofopt are valid if they fill the block */
+    return (pos == length) ? TRUE : FALSE;
+}
+
+static void parse_file(const UCHAR *data, UINT32 length, struct capture *cap)
+{
+    pcapng_shb_t shb;
+    UINT32 pos;
+
+    memset(cap, 0, sizeof(*cap));
+
+    CHECK(length >= sizeof(shb) + sizeof(UINT32));
+    memcpy(&shb, data, sizeof(shb));
+    CHECK_EQ(shb.block_type, PCAPNG_BLOCK_TYPE_SHB);
+    CHECK_EQ(shb.byte_order_magic, PCAPNG_BYTE_ORDER_MAGIC);
+    CHECK_EQ(shb.version_major, 1);
+    CHECK_EQ(shb.version_minor, 0);
+    CHECK(shb.section_length == -1);
+
+    pos = 0;
+    while (pos < length)
+    {
+        UINT32 type, total;
+        const UCHAR *block;
+
+        CHECK(length - pos >= 12);
+        block = &data[pos];
+        type = read_u32(block);
+        total = read_u32(block + 4);
+        CHECK(total >= 12);
+        CHECK_EQ(total % 4, 0);
+        CHECK(total <= length - pos);
+        CHECK_EQ(read_u32(block + total - 4), total);
+
+        if (type == PCAPNG_BLOCK_TYPE_SHB)
+        {
+            CHECK_EQ(pos, 0);
+            CHECK(parse_options(block + sizeof(pcapng_shb_t),
+                                total - sizeof(pcapng_shb_t) - 4,
+                                NULL, NULL));
+        }
+        else if (type == PCAPNG_BLOCK_TYPE_IDB)
+        {
+            pcapng_idb_t idb;
+            struct interface *iface;
+
+            CHECK(cap->interface_count < MAX_INTERFACES);
+            CHECK(total >= sizeof(idb) + 4);
+            memcpy(&idb, block, sizeof(idb));
+            iface = &cap->interfaces[cap->interface_count++];
+            iface->linktype = idb.linktype;
+            iface->snaplen = idb.snaplen;
+            iface->tsresol = 6; /* Default */
+            CHECK(parse_options(block + sizeof(idb),
+                                total - sizeof(idb) - 4, iface, NULL));
+        }
+        else if (type == PCAPNG_BLOCK_TYPE_EPB)
+        {
+            pcapng_epb_t epb;
+            struct packet *pkt;
+
+            CHECK(cap->packet_count < MAX_PACKETS);
+            CHECK(total >= sizeof(epb) + 4);
+            memcpy(&epb, block, sizeof(epb));
+            CHECK(epb.interface_id < cap->interface_count);
+            CHECK(epb.captured_len <= epb.packet_len);
+            CHECK(epb.captured_len <=
+                  cap->interfaces[epb.interface_id].snaplen);
+            CHECK(((epb.captured_len + 3u) & ~3u) <=
+                  total - sizeof(epb) - 4);
+            CHECK(parse_options(block + sizeof(epb) +
+                                ((epb.captured_len + 3u) & ~3u),
+                                total - sizeof(epb) - 4 -
+                                ((epb.captured_len + 3u) & ~3u),
+                                NULL, NULL));
+
+            pkt = &cap->packets[cap->packet_count++];
+            pkt->interface_id = epb.interface_id;
+            pkt->timestamp = ((UINT64)epb.timestamp_high << 32) |
+                             epb.timestamp_low;
+            pkt->captured_len = epb.captured_len;
+            pkt->packet_len = epb.packet_len;
+            pkt->data = block + sizeof(epb);
+        }
+        else if (type == PCAPNG_BLOCK_TYPE_ISB)
+        {
+            pcapng_isb_t isb;
+
+            CHECK(total >= sizeof(isb) + 4);
+            memcpy(&isb, block, sizeof(isb));
+            CHECK(isb.interface_id < cap->interface_count);
+            CHECK(parse_options(block + sizeof(isb),
+                                total - sizeof(isb) - 4, NULL, cap));
+            cap->statistics_count++;
+        }
+        else
+        {
+            fprintf(stderr, "unexpected block type 0x%08x at %u\n",
+                    type, pos);
+            exit(1);
+        }
+
+        pos += total;
+    }
+    CHECK_EQ(pos, length);
+}
+
+static void save(const char *path, const UCHAR *data, UINT32 length)
+{
+    FILE *f;
+
+    if (path == NULL)
+    {
+        return;
+    }
+    f = fopen(path, "wb");
+    CHECK(f != NULL);
+    CHECK_EQ(fwrite(data, 1, length, f), length);
+    CHECK(fclose(f) == 0);
+}
+
+/*
+ * One IDB per root hub, packets of every length around the padding
+ * boundaries, timestamps that need full 100 ns resolution.
+ */
+static void test_encoder(const char *path)
+{
+    static UCHAR file[FILE_SIZE];
+    static UCHAR payload[300];
+    static struct capture cap;
+    static const char *names[] =
+    {
+        "\\\\.\\USBPcap1", "\\\\.\\USBPcap2", "\\\\.\\USBPcap10",
+    };
+    UINT32 interfaces = sizeof(names) / sizeof(names[0]);
+    UINT64 base = pcapng_timestamp_from_filetime(TEST_UNIX_EPOCH) +
+                  15500000001234567ULL;
+    UINT32 length = 0;
+    UINT32 i;
+
+    for (i = 0; i < sizeof(payload); i++)
+    {
+        payload[i] = (UCHAR)(i * 7 + 1);
+    }
+
+    CHECK_EQ(pcapng_timestamp_from_filetime(TEST_UNIX_EPOCH + 1), 1);
+
+    length += pcapng_write_shb(&file[length]);
+    for (i = 0; i < interfaces; i++)
+    {
+        UINT32 written = pcapng_write_idb(&file[length], 249, 256,
+                                          USBPCAP_PCAPNG_TSRESOL, names[i]);
+        CHECK_EQ(written, pcapng_idb_length(names[i]));
+        length += written;
+    }
+    length += pcapng_write_idb(&file[length], 249, 65535,
+                               USBPCAP_PCAPNG_TSRESOL, NULL);
+
+    for (i = 0; i < 260; i++)
+    {
+        UINT32 written = pcapng_write_epb(&file[length], i % interfaces,
+                                          base + i, payload, i % 257,
+                                          i % 257 + i);
+        CHECK_EQ(written, pcapng_epb_length(i % 257));
+        length += written;
+    }
+    length += pcapng_write_isb(&file[length], 1, base + i, 260, 3);
+
+    save(path, file, length);
+    parse_file(file, length, &cap);
+
+    CHECK_EQ(cap.interface_count, interfaces + 1);
+    for (i = 0; i < interfaces; i++)
+    {
+        CHECK_EQ(cap.interfaces[i].linktype, 249);
+        CHECK_EQ(cap.interfaces[i].snaplen, 256);
+        CHECK_EQ(cap.interfaces[i].tsresol, USBPCAP_PCAPNG_TSRESOL);
+        CHECK(strcmp(cap.interfaces[i].name, names[i]) == 0);
+    }
+    CHECK_EQ(cap.interfaces[interfaces].name[0], '\0');
+
+    CHECK_EQ(cap.packet_count, 260);
+    for (i = 0; i < cap.packet_count; i++)
+    {
+        struct packet *pkt = &cap.packets[i];
+
+        CHECK_EQ(pkt->interface_id, i % interfaces);
+        CHECK_EQ(pkt->timestamp, base + i);
+        CHECK_EQ(pkt->captured_len, i % 257);
+        CHECK_EQ(pkt->packet_len, i % 257 + i);
+        CHECK(memcmp(pkt->data, payload, pkt->captured_len) == 0);
+    }
+
+    CHECK_EQ(cap.statistics_count, 1);
+    CHECK_EQ(cap.ifrecv, 260);
+    CHECK_EQ(cap.ifdrop, 3);
+
+    TEST_PASS("encoder");
+}
+
+/*
+ * Enhanced Packet Blocks expanded by the driver from compact records,
+ * behind the header written by the encoder.
+ */
+static void test_driver_records(void)
+{
+    static UCHAR ringBuffer[256 * 1024];
+    static UCHAR file[FILE_SIZE];
+    static UCHAR payload[200];
+    static struct capture cap;
+    USBPCAP_RING ring;
+    UINT32 length = 0;
+    UINT32 skip = 0;
+    UINT32 read;
+    UINT32 i;
+
+    for (i = 0; i < sizeof(payload); i++)
+    {
+        payload[i] = (UCHAR)(0xFF - i);
+    }
+
+    USBPcapRingInitialize(&ring);
+    USBPcapRingAttachBuffer(&ring, ringBuffer, sizeof(ringBuffer), 0);
+    CHECK(USBPcapRingEnter(&ring));
+    for (i = 0; i < 100; i++)
+    {
+        CHECK(NT_SUCCESS(test_store_record(&ring, 15500000000000000ULL +
+                                           i * 3, i, payload, i * 2)));
+    }
+    USBPcapRingLeave(&ring);
+
+    length += pcapng_write_shb(&file[length]);
+    length += pcapng_write_idb(&file[length], 249, 65535,
+                               USBPCAP_PCAPNG_TSRESOL, NULL);
+    while ((read = USBPcapRecordRead(&ring, TRUE, &file[length],
+                                     sizeof(file) - length, &skip)) > 0)
+    {
+        CHECK_EQ(skip, 0);
+        length += read;
+    }
+    CHECK_EQ(USBPcapRingGetUsed(&ring), 0);
+
+    parse_file(file, length, &cap);
+    CHECK_EQ(cap.packet_count, 100);
+    for (i = 0; i < cap.packet_count; i++)
+    {
+        struct packet *pkt = &cap.packets[i];
+        USBPCAP_BUFFER_PACKET_HEADER header;
+
+        CHECK_EQ(pkt->timestamp, 15500000000000000ULL + i * 3);
+        CHECK_EQ(pkt->captured_len, sizeof(header) + i * 2);
+        CHECK_EQ(pkt->packet_len, sizeof(header) + i * 2);
+
+        memcpy(&header, pkt->data, sizeof(header));
+        CHECK_EQ(header.headerLen, sizeof(header));
+        CHECK_EQ(header.irpId, i);
+        CHECK_EQ(header.dataLength, i * 2);
+        CHECK(memcmp(pkt->data + sizeof(header), payload, i * 2) == 0);
+    }
+
+    TEST_PASS("driver_records");
+}
+
+int main(int argc, char *argv[])
+{
+    test_encoder(argc > 1 ? argv[1] : NULL);
+    test_driver_records();
+    return 0;
+}
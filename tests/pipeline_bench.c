@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * USBPcapCMD read pipeline with a synthetic producer. The producer stands
+ * in for the driver: every read completes after a fixed delay. The writer
+ * stands in for the disk: every write takes a random delay with the same
+ * mean. Serial run reads and writes in turns, like read_thread did with
+ * a single outstanding read. Pipeline runs use pipeline.c with reader and
+ * writer threads, for different buffer counts.
+ */
+
+#include <pthread.h>
+
+#include "pipeline.h"
+#include "test.h"
+
+#define BUFFER_SIZE (64 * 1024)
+#define READ_US     200 /* Time the driver takes to fill a buffer */
+#define WRITE_US    200 /* Mean time to write a buffer out */
+
+static unsigned buffers_total;
+
+static void sleep_us(unsigned us)
+{
+    struct timespec ts;
+
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = (long)(us % 1000000) * 1000;
+    nanosleep(&ts, NULL);
+}
+
+static DWORD produce(unsigned char *data, UINT32 sequence)
+{
+    sleep_us(READ_US);
+    memcpy(data, &sequence, sizeof(sequence));
+    return BUFFER_SIZE;
+}
+
+static void consume(const unsigned char *data, DWORD length,
+                    UINT32 expected, uint32_t *seed)
+{
+    UINT32 sequence;
+
+    CHECK_EQ(length, BUFFER_SIZE);
+    memcpy(&sequence, data, sizeof(sequence));
+    CHECK_EQ(sequence, expected);
+
+    /* Disk writes are not uniform, sometimes they take much longer */
+    sleep_us(test_random(seed) % (2 * WRITE_US));
+}
+
+static void *writer_thread(void *arg)
+{
+    struct pipeline *pipeline = arg;
+    uint32_t seed = 0xd15c;
+    unsigned i;
+
+    for (i = 0; i < buffers_total; i++)
+    {
+        struct pipeline_buffer *buffer;
+
+        CHECK_EQ(WaitForSingleObject(pipeline->filled_sem, INFINITE),
+                 WAIT_OBJECT_0);
+        buffer = pipeline_get_filled(pipeline);
+        consume(buffer->data, buffer->length, i, &seed);
+        pipeline_release(pipeline);
+    }
+    return NULL;
+}
+
+static void report(const char *name, uint64_t elapsed)
+{
+    double seconds = (double)elapsed / 1e9;
+
+    printf("%-12s %8.1f MB/s %8.0f reads/s\n", name,
+           (double)buffers_total * BUFFER_SIZE / (1024 * 1024) / seconds,
+           buffers_total / seconds);
+}
+
+static void run_serial(void)
+{
+    static unsigned char data[BUFFER_SIZE];
+    uint32_t seed = 0xd15c;
+    uint64_t start = test_now_ns();
+    unsigned i;
+
+    for (i = 0; i < buffers_total; i++)
+    {
+        DWORD length = produce(data, i);
+        consume(data, length, i, &seed);
+    }
+    report("serial", test_now_ns() - start);
+}
+
+static void run_pipeline(int count)
+{
+    struct pipeline pipeline;
+    pthread_t writer;
+    uint64_t start;
+    unsigned i;
+    char name[32];
+
+    CHECK(pipeline_init(&pipeline, count, BUFFER_SIZE));
+
+    start = test_now_ns();
+    CHECK(pthread_create(&writer, NULL, writer_thread, &pipeline) == 0);
+    for (i = 0; i < buffers_total; i++)
+    {
+        struct pipeline_buffer *buffer;
+
+        CHECK_EQ(WaitForSingleObject(pipeline.free_sem, INFINITE),
+                 WAIT_OBJECT_0);
+        buffer = pipeline_start_read(&pipeline);
+        CHECK(pipeline_pending_read(&pipeline) == buffer);
+        pipeline_complete_read(&pipeline, produce(buffer->data, i));
+    }
+    CHECK(pipeline_pending_read(&pipeline) == NULL);
+    pthread_join(writer, NULL);
+
+    snprintf(name, sizeof(name), "pipeline %d", count);
+    report(name, test_now_ns() - start);
+    pipeline_free(&pipeline);
+}
+
+int main(void)
+{
+    static const int counts[] = { 1, 2, 4, 8, 16 };
+    size_t i;
+
+    buffers_total = 2000 * test_bench_scale();
+    printf("%u reads of %d KB, read %d us, write %d us mean\n",
+           buffers_total, BUFFER_SIZE / 1024, READ_US, WRITE_US);
+
+    run_serial();
+    for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+    {
+        run_pipeline(counts[i]);
+    }
+    return 0;
+}
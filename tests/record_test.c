@@ -0,0 +1,382 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/*
+ * Compact record codec: encode/decode round trips over random and
+ * extreme header values, rejection of malformed records, and expansion
+ * to pcap and pcapng compared against records built independently,
+ * read back in pieces of every size.
+ */
+
+#include "USBPcapRecord.h"
+#include "test.h"
+
+#define BASE_HEADER  ((UINT32)sizeof(USBPCAP_BUFFER_PACKET_HEADER))
+#define MAX_PACKET   600
+#define RING_SIZE    (64 * 1024)
+
+/* Difference between 1601-01-01 and 1970-01-01 in seconds */
+#define EPOCH_SECONDS  11644473600ULL
+
+typedef struct
+{
+    USBPCAP_BUFFER_PACKET_HEADER  header;
+    UINT64                        timestamp;
+    UINT32                        captured;
+    /* Whole packet: header (headerLen bytes) followed by data */
+    UCHAR                         packet[MAX_PACKET];
+} TEST_PACKET;
+
+static UINT64 random64(uint32_t *seed)
+{
+    UINT64 value = ((UINT64)test_random(seed) << 32) | test_random(seed);
+
+    /* Favour values around varint length boundaries */
+    switch (test_random(seed) % 4)
+    {
+        case 0:
+            return value >> (test_random(seed) % 64);
+        case 1:
+            return (UINT64)1 << (test_random(seed) % 64);
+        case 2:
+            return ((UINT64)1 << (test_random(seed) % 64)) - 1;
+        default:
+            return value;
+    }
+}
+
+static void random_packet(TEST_PACKET *p, uint32_t *seed)
+{
+    UINT32 total;
+    UINT32 i;
+
+    memset(p, 0, sizeof(*p));
+    p->header.headerLen = (USHORT)(BASE_HEADER + test_random(seed) % 40);
+    p->header.irpId = random64(seed);
+    p->header.status = (USBD_STATUS)random64(seed);
+    p->header.function = (USHORT)random64(seed);
+    p->header.info = (UCHAR)test_random(seed);
+    p->header.bus = (USHORT)random64(seed);
+    p->header.device = (USHORT)random64(seed);
+    p->header.endpoint = (UCHAR)test_random(seed);
+    p->header.transfer = (UCHAR)test_random(seed);
+    p->header.dataLength = test_random(seed) % (MAX_PACKET - p->header.headerLen);
+    /* Timestamps after 1970, system time of year 2100 fits in 57 bits */
+    p->timestamp = EPOCH_SECONDS * 10000000ULL +
+                   random64(seed) % (4102444800ULL * 10000000ULL);
+
+    total = p->header.headerLen + p->header.dataLength;
+    p->captured = (test_random(seed) % 4) ? total : test_random(seed) % (total + 1);
+
+    memcpy(p->packet, &p->header, BASE_HEADER);
+    for (i = BASE_HEADER; i < total; i++)
+    {
+        p->packet[i] = (UCHAR)test_random(seed);
+    }
+}
+
+/* Builds compact record, returns its length */
+static UINT32 encode(TEST_PACKET *p, PUCHAR record)
+{
+    UINT32 prefix;
+    UINT32 body = USBPcapRecordGetBodyLength(p->captured);
+
+    prefix = USBPcapRecordEncode(&p->header, p->timestamp, p->captured, record);
+    CHECK(prefix <= USBPCAP_RECORD_MAX_PREFIX);
+    if (body > 0)
+    {
+        memcpy(&record[prefix], &p->packet[BASE_HEADER], body);
+    }
+    return prefix + body;
+}
+
+static void check_decoded(TEST_PACKET *p, PUSBPCAP_RECORD_INFO info, UINT32 length)
+{
+    CHECK_EQ(info->length, length);
+    CHECK_EQ(info->timestamp, p->timestamp);
+    CHECK_EQ(info->captured, p->captured);
+    CHECK(memcmp(&info->header, &p->header, BASE_HEADER) == 0);
+    CHECK_EQ(info->length - info->dataOffset,
+             USBPcapRecordGetBodyLength(p->captured));
+}
+
+static void test_round_trip(void)
+{
+    uint32_t seed = 0x2ec0;
+    unsigned n;
+
+    for (n = 0; n < 200000; n++)
+    {
+        TEST_PACKET p;
+        USBPCAP_RECORD_INFO info;
+        UCHAR record[USBPCAP_RECORD_MAX_PREFIX + MAX_PACKET];
+        UINT32 length;
+        UINT32 prefix;
+
+        random_packet(&p, &seed);
+        length = encode(&p, record);
+        prefix = length - USBPcapRecordGetBodyLength(p.captured);
+
+        memset(&info, 0xA5, sizeof(info));
+        CHECK(USBPcapRecordDecode(record, length, &info));
+        check_decoded(&p, &info, length);
+
+        /* The prefix alone is enough */
+        memset(&info, 0xA5, sizeof(info));
+        CHECK(USBPcapRecordDecode(record, prefix, &info));
+        check_decoded(&p, &info, length);
+        CHECK_EQ(info.dataOffset, prefix);
+
+        /* Anything shorter is not */
+        CHECK(!USBPcapRecordDecode(record, prefix - 1, &info));
+    }
+
+    TEST_PASS("round_trip");
+}
+
+static void test_extremes(void)
+{
+    TEST_PACKET p;
+    USBPCAP_RECORD_INFO info;
+    UCHAR record[USBPCAP_RECORD_MAX_PREFIX + MAX_PACKET];
+    UINT32 length;
+
+    memset(&p, 0, sizeof(p));
+    p.header.headerLen = MAXUSHORT;
+    p.header.irpId = 0x8000000000000000ULL;
+    p.header.status = (USBD_STATUS)0xC0000004;
+    p.header.function = MAXUSHORT;
+    p.header.info = 0xFF;
+    p.header.bus = MAXUSHORT;
+    p.header.device = MAXUSHORT;
+    p.header.endpoint = 0xFF;
+    p.header.transfer = 0xFF;
+    p.header.dataLength = MAXULONG - MAXUSHORT;
+    p.timestamp = MAXULONG64;
+    p.captured = 0;
+    length = encode(&p, record);
+    CHECK(USBPcapRecordDecode(record, length, &info));
+    check_decoded(&p, &info, length);
+
+    /* Smallest record: base header only, nothing captured after it */
+    memset(&p, 0, sizeof(p));
+    p.header.headerLen = BASE_HEADER;
+    p.captured = BASE_HEADER;
+    length = encode(&p, record);
+    CHECK(length < sizeof(pcaprec_hdr_t) + BASE_HEADER);
+    CHECK(USBPcapRecordDecode(record, length, &info));
+    check_decoded(&p, &info, length);
+
+    TEST_PASS("extremes");
+}
+
+static void test_malformed(void)
+{
+    TEST_PACKET p;
+    USBPCAP_RECORD_INFO info;
+    UCHAR record[USBPCAP_RECORD_MAX_PREFIX + MAX_PACKET];
+    UCHAR bad[USBPCAP_RECORD_MAX_PREFIX + MAX_PACKET];
+    UINT32 length;
+    UINT32 field;
+    uint32_t seed = 0xbad;
+
+    random_packet(&p, &seed);
+    p.header.headerLen = BASE_HEADER;
+    p.header.dataLength = 10;
+    p.captured = BASE_HEADER + 10;
+    length = encode(&p, record);
+    CHECK(USBPcapRecordDecode(record, length, &info));
+
+    /* Raw record */
+    CHECK_EQ(USBPcapRecordEncodeRaw(24, bad), sizeof(UINT32));
+    CHECK(!USBPcapRecordDecode(bad, 28, &info));
+
+    /* Length field does not match the captured bytes */
+    memcpy(bad, record, length);
+    field = length + 1;
+    memcpy(bad, &field, sizeof(field));
+    CHECK(!USBPcapRecordDecode(bad, length + 1, &info));
+    field = length - 1;
+    memcpy(bad, &field, sizeof(field));
+    CHECK(!USBPcapRecordDecode(bad, length, &info));
+
+    /* Captured more than the packet has */
+    p.captured = BASE_HEADER + 11;
+    USBPcapRecordEncode(&p.header, p.timestamp, p.captured, bad);
+    CHECK(!USBPcapRecordDecode(bad, USBPCAP_RECORD_MAX_PREFIX, &info));
+
+    /* headerLen below the base header */
+    p.header.headerLen = BASE_HEADER - 1;
+    p.captured = 0;
+    length = USBPcapRecordEncode(&p.header, p.timestamp, p.captured, bad);
+    CHECK(!USBPcapRecordDecode(bad, length, &info));
+
+    /* Varint that never ends */
+    memcpy(bad, record, length);
+    memset(&bad[sizeof(UINT32) + sizeof(UINT64)], 0xFF, 20);
+    field = 40;
+    memcpy(bad, &field, sizeof(field));
+    CHECK(!USBPcapRecordDecode(bad, 40, &info));
+
+    /* headerLen that does not fit USHORT */
+    memset(&bad[sizeof(UINT32) + sizeof(UINT64)], 0xFF, 2);
+    bad[sizeof(UINT32) + sizeof(UINT64) + 2] = 0x7F;
+    CHECK(!USBPcapRecordDecode(bad, 40, &info));
+
+    TEST_PASS("malformed");
+}
+
+/* Expected expansion built without the codec */
+static UINT32 expected_expansion(TEST_PACKET *p, BOOLEAN pcapng, PUCHAR dest)
+{
+    UINT32 packetLength = p->header.headerLen + p->header.dataLength;
+    UINT32 offset;
+
+    if (pcapng)
+    {
+        pcapng_epb_t epb;
+        UINT64 ts = p->timestamp - EPOCH_SECONDS * 10000000ULL;
+        UINT32 padded = (p->captured + 3) & ~3u;
+
+        epb.block_type = PCAPNG_BLOCK_TYPE_EPB;
+        epb.block_total_length = sizeof(epb) + padded + 4;
+        epb.interface_id = 0;
+        epb.timestamp_high = (UINT32)(ts >> 32);
+        epb.timestamp_low = (UINT32)ts;
+        epb.captured_len = p->captured;
+        epb.packet_len = packetLength;
+        memcpy(dest, &epb, sizeof(epb));
+        offset = sizeof(epb);
+        memcpy(&dest[offset], p->packet, p->captured);
+        memset(&dest[offset + p->captured], 0, padded - p->captured);
+        offset += padded;
+        memcpy(&dest[offset], &epb.block_total_length, 4);
+        return offset + 4;
+    }
+    else
+    {
+        pcaprec_hdr_t rec;
+        UINT64 us = p->timestamp / 10 - EPOCH_SECONDS * 1000000ULL;
+
+        rec.ts_sec = (UINT32)(us / 1000000);
+        rec.ts_usec = (UINT32)(us % 1000000);
+        rec.incl_len = p->captured;
+        rec.orig_len = packetLength;
+        memcpy(dest, &rec, sizeof(rec));
+        memcpy(&dest[sizeof(rec)], p->packet, p->captured);
+        return sizeof(rec) + p->captured;
+    }
+}
+
+static void store(PUSBPCAP_RING ring, PUCHAR record, UINT32 length)
+{
+    USBPCAP_RING_RESERVATION reservation;
+
+    CHECK(USBPcapRingEnter(ring));
+    CHECK(NT_SUCCESS(USBPcapRingReserve(ring, length, &reservation)));
+    USBPcapRingWrite(ring, &reservation, record, length);
+    USBPcapRingCommit(ring, &reservation);
+    USBPcapRingLeave(ring);
+}
+
+static void test_expand(void)
+{
+    static UCHAR buffer[RING_SIZE];
+    USBPCAP_RING ring;
+    uint32_t seed = 0xe4a;
+    unsigned n;
+
+    USBPcapRingInitialize(&ring);
+    USBPcapRingAttachBuffer(&ring, buffer, sizeof(buffer), 0);
+
+    for (n = 0; n < 20000; n++)
+    {
+        TEST_PACKET p;
+        UCHAR record[USBPCAP_RECORD_MAX_PREFIX + MAX_PACKET];
+        UCHAR expected[sizeof(pcapng_epb_t) + MAX_PACKET + 8];
+        UCHAR got[sizeof(expected)];
+        BOOLEAN pcapng = (BOOLEAN)(n & 1);
+        UINT32 expectedLength;
+        UINT32 length;
+        UINT32 chunk;
+        UINT32 total = 0;
+        UINT32 skip = 0;
+
+        random_packet(&p, &seed);
+        length = encode(&p, record);
+        expectedLength = expected_expansion(&p, pcapng, expected);
+
+        /* Whole read into too small buffer leaves the record alone */
+        store(&ring, record, length);
+        CHECK_EQ(USBPcapRecordReadWhole(&ring, pcapng, got, expectedLength - 1), 0);
+        CHECK_EQ(USBPcapRingGetUsed(&ring), length);
+        CHECK_EQ(USBPcapRecordReadWhole(&ring, pcapng, got, sizeof(got)),
+                 expectedLength);
+        CHECK(memcmp(got, expected, expectedLength) == 0);
+        CHECK_EQ(USBPcapRingGetUsed(&ring), 0);
+
+        /* Split reads, every chunk size from 1 byte up */
+        store(&ring, record, length);
+        chunk = 1 + n % 97;
+        do
+        {
+            UINT32 copied = USBPcapRecordRead(&ring, pcapng, &got[total],
+                                              min(chunk, expectedLength - total),
+                                              &skip);
+
+            CHECK(copied > 0);
+            total += copied;
+        }
+        while (skip != 0);
+        CHECK_EQ(total, expectedLength);
+        CHECK(memcmp(got, expected, expectedLength) == 0);
+        CHECK_EQ(USBPcapRingGetUsed(&ring), 0);
+    }
+
+    TEST_PASS("expand");
+}
+
+static void test_raw(void)
+{
+    static UCHAR buffer[RING_SIZE];
+    USBPCAP_RING ring;
+    UCHAR record[sizeof(UINT32) + sizeof(pcap_hdr_t)];
+    UCHAR got[sizeof(pcap_hdr_t)];
+    pcap_hdr_t header;
+    UINT64 timestamp;
+    UINT32 skip = 0;
+
+    USBPcapRingInitialize(&ring);
+    USBPcapRingAttachBuffer(&ring, buffer, sizeof(buffer), 0);
+
+    memset(&header, 0x3C, sizeof(header));
+    CHECK_EQ(USBPcapRecordEncodeRaw(sizeof(header), record), sizeof(UINT32));
+    memcpy(&record[sizeof(UINT32)], &header, sizeof(header));
+    store(&ring, record, sizeof(record));
+
+    /* Raw records are older than any packet */
+    CHECK(USBPcapRecordPeekTimestamp(&ring, &timestamp));
+    CHECK_EQ(timestamp, 0);
+
+    /* Returned unchanged, in any format */
+    CHECK_EQ(USBPcapRecordRead(&ring, TRUE, got, sizeof(got), &skip),
+             sizeof(header));
+    CHECK_EQ(skip, 0);
+    CHECK(memcmp(got, &header, sizeof(header)) == 0);
+    CHECK(!USBPcapRecordPeekTimestamp(&ring, &timestamp));
+
+    TEST_PASS("raw");
+}
+
+int main(void)
+{
+    test_round_trip();
+    test_extremes();
+    test_malformed();
+    test_expand();
+    test_raw();
+    return 0;
+}
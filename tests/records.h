@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef USBPCAP_TEST_RECORDS_H
+#define USBPCAP_TEST_RECORDS_H
+
+#include "USBPcapRecord.h"
+
+/* System time of 1970-01-01, timestamps passed to the helpers are
+ * relative to it so they read back unchanged from pcapng blocks.
+ */
+#define TEST_UNIX_EPOCH  116444736000000000ULL
+
+/*
+ * Stores packet as compact record, the same way USBPcapBufferStorePacket
+ * does. Caller must have entered the ring.
+ */
+static inline NTSTATUS
+test_store_record(PUSBPCAP_RING ring, UINT64 timestamp, UINT64 irpId,
+                  const void *data, UINT32 dataLength)
+{
+    USBPCAP_BUFFER_PACKET_HEADER  header;
+    USBPCAP_RING_RESERVATION      reservation;
+    UCHAR                         prefix[USBPCAP_RECORD_MAX_PREFIX];
+    UINT32                        captured;
+    UINT32                        prefixLength;
+    NTSTATUS                      status;
+
+    memset(&header, 0, sizeof(header));
+    header.headerLen = sizeof(header);
+    header.irpId = irpId;
+    header.endpoint = 0x81;
+    header.transfer = USBPCAP_TRANSFER_BULK;
+    header.dataLength = dataLength;
+
+    captured = (UINT32)sizeof(header) + dataLength;
+    prefixLength = USBPcapRecordEncode(&header, TEST_UNIX_EPOCH + timestamp,
+                                       captured, prefix);
+
+    status = USBPcapRingReserve(ring,
+                                prefixLength + USBPcapRecordGetBodyLength(captured),
+                                &reservation);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    USBPcapRingWrite(ring, &reservation, prefix, prefixLength);
+    if (dataLength > 0)
+    {
+        USBPcapRingWrite(ring, &reservation, (PVOID)data, dataLength);
+    }
+    USBPcapRingCommit(ring, &reservation);
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Parses pcapng Enhanced Packet Block at data[*pos]. Returns 0 if there is
+ * not enough data for whole block.
+ */
+static inline int
+test_parse_epb(const UCHAR *data, UINT32 length, UINT32 *pos,
+               UINT64 *timestamp, PUSBPCAP_BUFFER_PACKET_HEADER header)
+{
+    pcapng_epb_t epb;
+
+    if (length - *pos < sizeof(epb))
+    {
+        return 0;
+    }
+    memcpy(&epb, &data[*pos], sizeof(epb));
+    if (length - *pos < epb.block_total_length)
+    {
+        return 0;
+    }
+    if ((epb.block_type != PCAPNG_BLOCK_TYPE_EPB) ||
+        (epb.captured_len < sizeof(*header)))
+    {
+        fprintf(stderr, "invalid block at %u\n", *pos);
+        exit(1);
+    }
+
+    *timestamp = ((UINT64)epb.timestamp_high << 32) | epb.timestamp_low;
+    memcpy(header, &data[*pos + sizeof(epb)], sizeof(*header));
+    *pos += epb.block_total_length;
+    return 1;
+}
+
+#endif /* USBPCAP_TEST_RECORDS_H */
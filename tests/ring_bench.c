@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/*
+ * USBPcapRing throughput: N producers push fixed size records through
+ * the reserve/write/commit path while a single consumer drains the ring.
+ */
+
+#include <pthread.h>
+
+#include "USBPcapRing.h"
+#include "test.h"
+
+#define RING_SIZE     (1024 * 1024)
+#define MAX_PRODUCERS 8
+
+static USBPCAP_RING ring;
+static UINT32 recordSize;
+static unsigned recordsPerProducer;
+
+static void *producer_thread(void *arg)
+{
+    UCHAR record[4096];
+    unsigned i;
+
+    (void)arg;
+    memset(record, 0xA5, sizeof(record));
+
+    for (i = 0; i < recordsPerProducer; i++)
+    {
+        USBPCAP_RING_RESERVATION res;
+
+        USBPcapRingEnter(&ring);
+        while (!NT_SUCCESS(USBPcapRingReserve(&ring, recordSize, &res)))
+        {
+            sched_yield();
+        }
+        USBPcapRingWrite(&ring, &res, record, recordSize);
+        USBPcapRingCommit(&ring, &res);
+        USBPcapRingLeave(&ring);
+    }
+    return NULL;
+}
+
+static void run(unsigned producers, UINT32 size)
+{
+    static UCHAR dest[256 * 1024];
+    pthread_t threads[MAX_PRODUCERS];
+    unsigned long long expected;
+    unsigned long long total = 0;
+    uint64_t start, elapsed;
+    unsigned i;
+
+    recordSize = size;
+    recordsPerProducer = 200000 * test_bench_scale() / producers;
+    expected = (unsigned long long)recordsPerProducer * producers * size;
+    USBPcapRingReset(&ring);
+
+    start = test_now_ns();
+    for (i = 0; i < producers; i++)
+    {
+        pthread_create(&threads[i], NULL, producer_thread, NULL);
+    }
+    while (total < expected)
+    {
+        UINT32 got = USBPcapRingRead(&ring, dest, sizeof(dest));
+
+        if (got == 0)
+        {
+            sched_yield();
+        }
+        total += got;
+    }
+    for (i = 0; i < producers; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    elapsed = test_now_ns() - start;
+
+    printf("producers %u record %5u B: %8.2f Mrec/s %8.1f MB/s\n",
+           producers, size,
+           (double)(expected / size) * 1e3 / (double)elapsed,
+           (double)expected * 1e3 / (double)elapsed);
+}
+
+int main(void)
+{
+    static UCHAR buffer[RING_SIZE];
+    static const UINT32 sizes[] = { 64, 512, 4096 };
+    unsigned producers;
+    unsigned i;
+
+    USBPcapRingInitialize(&ring);
+    USBPcapRingAttachBuffer(&ring, buffer, sizeof(buffer), 0);
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        for (producers = 1; producers <= MAX_PRODUCERS; producers *= 2)
+        {
+            run(producers, sizes[i]);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/*
+ * Multi-producer stress test of USBPcapRing.
+ *
+ * Every producer writes records carrying its id, a per-producer sequence
+ * number and a checksum of the payload. The single consumer reads the byte
+ * stream in random sized chunks, reassembles the records and verifies that
+ * nothing was lost, duplicated, reordered within a producer or torn.
+ * A third party periodically freezes and thaws the ring, like the driver
+ * does when the buffer is resized.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "USBPcapRing.h"
+#include "test.h"
+
+#define RING_SIZE        (64 * 1024)
+#define MAX_PAYLOAD      1500
+#define MAX_PRODUCERS    16
+
+typedef struct
+{
+    UINT32 length;    /* Whole record, including this header */
+    UINT32 producer;
+    UINT32 sequence;
+    UINT32 checksum;
+} STRESS_RECORD;
+
+static USBPCAP_RING ring;
+static unsigned producers = 4;
+static unsigned records = 50000;
+static volatile int producersDone;
+static volatile int freezerStop;
+
+static UINT32 checksum(const UCHAR *data, UINT32 length, UINT32 seed)
+{
+    UINT32 hash = 2166136261u ^ seed;
+    UINT32 i;
+
+    for (i = 0; i < length; i++)
+    {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static void *producer_thread(void *arg)
+{
+    UINT32 id = (UINT32)(uintptr_t)arg;
+    UINT32 rnd = 0x9e3779b9u * (id + 1);
+    UCHAR payload[MAX_PAYLOAD];
+    unsigned seq;
+
+    for (seq = 0; seq < records; seq++)
+    {
+        STRESS_RECORD hdr;
+        USBPCAP_RING_RESERVATION res;
+        UINT32 length = test_random(&rnd) % MAX_PAYLOAD;
+        UINT32 split;
+        UINT32 i;
+
+        for (i = 0; i < length; i++)
+        {
+            payload[i] = (UCHAR)test_random(&rnd);
+        }
+
+        hdr.length = sizeof(hdr) + length;
+        hdr.producer = id;
+        hdr.sequence = seq;
+        hdr.checksum = checksum(payload, length, id ^ seq);
+
+        for (;;)
+        {
+            if (!USBPcapRingEnter(&ring))
+            {
+                sched_yield();
+                continue;
+            }
+            if (NT_SUCCESS(USBPcapRingReserve(&ring, hdr.length, &res)))
+            {
+                break;
+            }
+            /* Ring full, let the consumer catch up */
+            USBPcapRingLeave(&ring);
+            sched_yield();
+        }
+
+        /* Write in pieces so partially written records get exposed if
+         * Commit ever publishes too early.
+         */
+        split = length / 2;
+        USBPcapRingWrite(&ring, &res, &hdr, sizeof(hdr));
+        USBPcapRingWrite(&ring, &res, payload, split);
+        if ((test_random(&rnd) & 7) == 0)
+        {
+            /* Widen the window for other producers even on single CPU */
+            sched_yield();
+        }
+        USBPcapRingWrite(&ring, &res, &payload[split], length - split);
+        USBPcapRingCommit(&ring, &res);
+        USBPcapRingLeave(&ring);
+    }
+
+    __atomic_add_fetch(&producersDone, 1, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+static void *freezer_thread(void *arg)
+{
+    (void)arg;
+
+    while (!__atomic_load_n(&freezerStop, __ATOMIC_SEQ_CST))
+    {
+        USBPcapRingFreeze(&ring);
+        CHECK_EQ(ring.writers, 0);
+        USBPcapRingThaw(&ring);
+        usleep(100);
+    }
+    return NULL;
+}
+
+static void consume(void)
+{
+    static UCHAR stream[RING_SIZE + sizeof(STRESS_RECORD) + MAX_PAYLOAD];
+    UINT32 expected[MAX_PRODUCERS];
+    UINT32 rnd = 12345;
+    UINT32 filled = 0;
+    unsigned long long total = 0;
+    unsigned long long expectedTotal = (unsigned long long)producers * records;
+
+    memset(expected, 0, sizeof(expected));
+
+    while (total < expectedTotal)
+    {
+        UINT32 chunk = 1 + test_random(&rnd) % 8192;
+        UINT32 got;
+        UINT32 pos = 0;
+
+        got = USBPcapRingRead(&ring, &stream[filled],
+                              min(chunk, (UINT32)sizeof(stream) - filled));
+        if (got == 0)
+        {
+            /* All producers finished, yet records are missing */
+            CHECK(!(__atomic_load_n(&producersDone, __ATOMIC_SEQ_CST) ==
+                    (int)producers && USBPcapRingGetUsed(&ring) == 0));
+            sched_yield();
+            continue;
+        }
+        filled += got;
+
+        while (filled - pos >= sizeof(STRESS_RECORD))
+        {
+            STRESS_RECORD hdr;
+
+            memcpy(&hdr, &stream[pos], sizeof(hdr));
+            CHECK(hdr.length >= sizeof(hdr));
+            CHECK(hdr.length < sizeof(hdr) + MAX_PAYLOAD);
+            if (filled - pos < hdr.length)
+            {
+                break;
+            }
+            CHECK(hdr.producer < producers);
+            CHECK_EQ(hdr.sequence, expected[hdr.producer]);
+            CHECK_EQ(hdr.checksum,
+                     checksum(&stream[pos + sizeof(hdr)],
+                              hdr.length - sizeof(hdr),
+                              hdr.producer ^ hdr.sequence));
+            expected[hdr.producer]++;
+            total++;
+            pos += hdr.length;
+        }
+
+        memmove(stream, &stream[pos], filled - pos);
+        filled -= pos;
+    }
+
+    CHECK_EQ(filled, 0);
+    CHECK_EQ(USBPcapRingGetUsed(&ring), 0);
+}
+
+int main(int argc, char **argv)
+{
+    static UCHAR buffer[RING_SIZE];
+    pthread_t threads[MAX_PRODUCERS];
+    pthread_t freezer;
+    unsigned i;
+
+    if (argc > 1)
+    {
+        producers = (unsigned)atoi(argv[1]);
+    }
+    if (argc > 2)
+    {
+        records = (unsigned)atoi(argv[2]);
+    }
+    CHECK(producers > 0 && producers <= MAX_PRODUCERS);
+
+    USBPcapRingInitialize(&ring);
+    USBPcapRingAttachBuffer(&ring, buffer, sizeof(buffer), 0);
+
+    pthread_create(&freezer, NULL, freezer_thread, NULL);
+    for (i = 0; i < producers; i++)
+    {
+        pthread_create(&threads[i], NULL, producer_thread,
+                       (void *)(uintptr_t)i);
+    }
+
+    consume();
+
+    for (i = 0; i < producers; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    __atomic_store_n(&freezerStop, 1, __ATOMIC_SEQ_CST);
+    pthread_join(freezer, NULL);
+
+    TEST_PASS("ring_stress");
+    return 0;
+}
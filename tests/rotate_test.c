@@ -0,0 +1,387 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Output file rotation with a synthetic packet source. A synthetic stream
+ * of pcap records or pcapng blocks is fed in random sized chunks (so
+ * record headers get split) through rotate.c the same way writer.c does
+ * it, into in-memory files. Every file must start with the preamble and
+ * hold whole records only, limits must be respected and the records of
+ * all files together must be the original stream.
+ */
+
+#include "pcapng.h"
+#include "rotate.h"
+#include "test.h"
+
+#define MAX_FILES   4096
+#define STREAM_SIZE (1024 * 1024)
+
+struct memfile
+{
+    char *name;
+    unsigned char *data;
+    size_t length;
+    UINT32 opened; /* Tick count */
+    BOOL removed;
+};
+
+struct memfs
+{
+    struct memfile files[MAX_FILES];
+    int count;
+};
+
+struct stream
+{
+    unsigned char preamble[512];
+    UINT32 preamble_len;
+    unsigned char *records;
+    UINT32 records_len;
+    UINT32 packets;
+};
+
+static struct memfs fs;
+static struct stream stream;
+
+static void memfs_reset(void)
+{
+    int i;
+
+    for (i = 0; i < fs.count; i++)
+    {
+        free(fs.files[i].name);
+        free(fs.files[i].data);
+    }
+    memset(&fs, 0, sizeof(fs));
+}
+
+static void memfs_append(const void *data, UINT32 length)
+{
+    struct memfile *f = &fs.files[fs.count - 1];
+
+    f->data = realloc(f->data, f->length + length);
+    CHECK(f->data != NULL);
+    memcpy(&f->data[f->length], data, length);
+    f->length += length;
+}
+
+/* writer_open_rotated() */
+static void memfs_open_next(struct rotate_state *rotate, UINT32 now)
+{
+    char *removed;
+    char *name;
+    int i;
+
+    name = rotate_next_file(rotate, "20190102030405", now, &removed);
+    CHECK(name != NULL);
+    if (removed != NULL)
+    {
+        /* Always the oldest file that still exists */
+        for (i = 0; fs.files[i].removed; i++)
+        {
+            CHECK(i + 1 < fs.count);
+        }
+        CHECK(strcmp(fs.files[i].name, removed) == 0);
+        fs.files[i].removed = TRUE;
+        free(removed);
+    }
+
+    CHECK(fs.count < MAX_FILES);
+    fs.files[fs.count].name = name;
+    fs.files[fs.count].opened = now;
+    fs.count++;
+}
+
+/* writer_write() */
+static void write_chunk(struct rotate_state *rotate, const unsigned char *data,
+                        UINT32 bytes, UINT32 *now, uint32_t *seed)
+{
+    if (!rotate->in_records)
+    {
+        CHECK(rotate_add_preamble(rotate, data, bytes));
+        memfs_append(data, bytes);
+        return;
+    }
+
+    while (bytes > 0)
+    {
+        BOOL next;
+        UINT32 length;
+
+        /* Time goes on while data is written */
+        *now += test_random(seed) % 20;
+
+        length = rotate_scan(rotate, data, bytes, *now, &next);
+        CHECK(length <= bytes);
+        if (length > 0)
+        {
+            memfs_append(data, length);
+        }
+        data += length;
+        bytes -= length;
+
+        if (next)
+        {
+            memfs_open_next(rotate, *now);
+            memfs_append(rotate->preamble, rotate->preamble_len);
+        }
+        else
+        {
+            CHECK_EQ(bytes, 0);
+        }
+    }
+}
+
+static void generate(BOOL pcapng, uint32_t *seed)
+{
+    static unsigned char payload[1500];
+    UINT32 i;
+
+    memset(&stream, 0, sizeof(stream));
+    free(stream.records);
+    stream.records = malloc(STREAM_SIZE);
+    CHECK(stream.records != NULL);
+
+    for (i = 0; i < sizeof(payload); i++)
+    {
+        payload[i] = (unsigned char)i;
+    }
+
+    if (pcapng)
+    {
+        stream.preamble_len = pcapng_write_shb(stream.preamble);
+        stream.preamble_len += pcapng_write_idb(&stream.preamble[stream.preamble_len],
+                                                249, 65535,
+                                                USBPCAP_PCAPNG_TSRESOL,
+                                                "\\\\.\\USBPcap1");
+    }
+    else
+    {
+        pcap_hdr_t hdr;
+
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.magic_number = 0xa1b2c3d4;
+        hdr.version_major = 2;
+        hdr.version_minor = 4;
+        hdr.snaplen = 65535;
+        hdr.network = 249;
+        memcpy(stream.preamble, &hdr, sizeof(hdr));
+        stream.preamble_len = sizeof(hdr);
+    }
+
+    while (stream.records_len < STREAM_SIZE - 2048)
+    {
+        UINT32 len = test_random(seed) % 1024;
+
+        if (pcapng)
+        {
+            stream.records_len += pcapng_write_epb(&stream.records[stream.records_len],
+                                                   0, stream.packets, payload,
+                                                   len, len);
+        }
+        else
+        {
+            pcaprec_hdr_t rec;
+
+            rec.ts_sec = stream.packets;
+            rec.ts_usec = 0;
+            rec.incl_len = len;
+            rec.orig_len = len;
+            memcpy(&stream.records[stream.records_len], &rec, sizeof(rec));
+            memcpy(&stream.records[stream.records_len + sizeof(rec)],
+                   payload, len);
+            stream.records_len += sizeof(rec) + len;
+        }
+        stream.packets++;
+    }
+}
+
+/*
+ * Returns number of records in data, which must hold whole records only.
+ * Sets last to the length of the last record.
+ */
+static UINT32 count_records(const unsigned char *data, size_t length,
+                            BOOL pcapng, UINT32 *last)
+{
+    size_t pos = 0;
+    UINT32 count = 0;
+
+    *last = 0;
+    while (pos < length)
+    {
+        UINT32 record;
+
+        if (pcapng)
+        {
+            CHECK(length - pos >= 8);
+            memcpy(&record, &data[pos + 4], sizeof(record));
+        }
+        else
+        {
+            pcaprec_hdr_t rec;
+
+            CHECK(length - pos >= sizeof(rec));
+            memcpy(&rec, &data[pos], sizeof(rec));
+            record = sizeof(rec) + rec.incl_len;
+        }
+        CHECK(record <= length - pos);
+        pos += record;
+        *last = record;
+        count++;
+    }
+    return count;
+}
+
+static void run(const char *arg, BOOL pcapng, uint32_t seed)
+{
+    struct rotate_policy policy;
+    struct rotate_state rotate;
+    UINT32 now = 0xFFFFF000; /* Tick count wraps during the run */
+    UINT32 offset;
+    UINT32 packets = 0;
+    UINT32 kept = 0;
+    size_t records_offset = 0;
+    int i;
+
+    CHECK(rotate_policy_parse(arg, &policy));
+    generate(pcapng, &seed);
+    memfs_reset();
+
+    CHECK(rotate_init(&rotate, &policy, "C:\\capture.dir\\usb.pcap", pcapng));
+    memfs_open_next(&rotate, now);
+
+    /* Global header and injected descriptors go in separate writes */
+    write_chunk(&rotate, stream.preamble, 24, &now, &seed);
+    write_chunk(&rotate, &stream.preamble[24], stream.preamble_len - 24,
+                &now, &seed);
+    rotate_start_records(&rotate);
+
+    for (offset = 0; offset < stream.records_len;)
+    {
+        UINT32 chunk = 1 + test_random(&seed) % 8192;
+
+        chunk = min(chunk, stream.records_len - offset);
+        write_chunk(&rotate, &stream.records[offset], chunk, &now, &seed);
+        offset += chunk;
+    }
+
+    CHECK(fs.count > 1);
+    for (i = 0; i < fs.count; i++)
+    {
+        struct memfile *f = &fs.files[i];
+        char expected[64];
+        UINT32 records, last;
+
+        snprintf(expected, sizeof(expected),
+                 "C:\\capture.dir\\usb_%05d_20190102030405.pcap", i + 1);
+        CHECK(strcmp(f->name, expected) == 0);
+
+        CHECK(f->length >= stream.preamble_len);
+        CHECK(memcmp(f->data, stream.preamble, stream.preamble_len) == 0);
+        records = count_records(&f->data[stream.preamble_len],
+                                f->length - stream.preamble_len,
+                                pcapng, &last);
+        CHECK(memcmp(&f->data[stream.preamble_len],
+                     &stream.records[records_offset],
+                     f->length - stream.preamble_len) == 0);
+        records_offset += f->length - stream.preamble_len;
+        packets += records;
+
+        if (i < fs.count - 1)
+        {
+            /* Switched right after the record that reached the limit */
+            if (policy.max_packets != 0 && policy.max_bytes == 0)
+            {
+                CHECK_EQ(records, policy.max_packets);
+            }
+            if (policy.max_bytes != 0 && policy.max_packets == 0)
+            {
+                CHECK(f->length >= policy.max_bytes);
+                CHECK(f->length - last < policy.max_bytes);
+            }
+            if (policy.max_seconds != 0 && policy.max_bytes == 0 &&
+                policy.max_packets == 0)
+            {
+                CHECK(fs.files[i + 1].opened - f->opened >=
+                      policy.max_seconds * 1000);
+            }
+        }
+        else
+        {
+            if (policy.max_packets != 0)
+            {
+                CHECK(records <= policy.max_packets);
+            }
+        }
+
+        if (!f->removed)
+        {
+            kept++;
+        }
+    }
+    CHECK_EQ(records_offset, stream.records_len);
+    CHECK_EQ(packets, stream.packets);
+    if (policy.max_files != 0)
+    {
+        CHECK_EQ(kept, min((UINT32)fs.count, policy.max_files));
+    }
+    else
+    {
+        CHECK_EQ(kept, fs.count);
+    }
+
+    rotate_free(&rotate);
+    printf("%s %s: %d files, %u packets: OK\n",
+           pcapng ? "pcapng" : "pcap", arg, fs.count, packets);
+}
+
+static void test_parse(void)
+{
+    struct rotate_policy policy;
+
+    CHECK(rotate_policy_parse("filesize:10,files:3", &policy));
+    CHECK_EQ(policy.max_bytes, 10240);
+    CHECK_EQ(policy.max_files, 3);
+    CHECK(rotate_policy_parse("duration:60,packets:100", &policy));
+    CHECK_EQ(policy.max_seconds, 60);
+    CHECK_EQ(policy.max_packets, 100);
+
+    /* Nothing to switch on */
+    CHECK(!rotate_policy_parse("files:3", &policy));
+    CHECK(!rotate_policy_parse("", &policy));
+    CHECK(!rotate_policy_parse("filesize:0", &policy));
+    CHECK(!rotate_policy_parse("size:10", &policy));
+    CHECK(!rotate_policy_parse("duration:2000001", &policy));
+
+    TEST_PASS("parse");
+}
+
+int main(void)
+{
+    static const char *policies[] =
+    {
+        "packets:1",
+        "packets:1000",
+        "filesize:64",
+        "filesize:1,files:5",
+        "duration:1",
+        "duration:2,files:2",
+        "filesize:256,packets:700,duration:5,files:3",
+    };
+    size_t i;
+
+    test_parse();
+    for (i = 0; i < sizeof(policies) / sizeof(policies[0]); i++)
+    {
+        run(policies[i], FALSE, 0x1000 + (uint32_t)i);
+        run(policies[i], TRUE, 0x2000 + (uint32_t)i);
+    }
+
+    memfs_reset();
+    free(stream.records);
+    return 0;
+}
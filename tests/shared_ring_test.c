@@ -0,0 +1,296 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/*
+ * Producer/consumer protocol of the mapped capture buffer (layout
+ * version 2, see include/USBPcap.h) over a shared mmap.
+ *
+ * Parent process is the driver: USBPcapRing with commitMirror pointing at
+ * writeOffset, read position picked up from the consumer page when the
+ * ring is full and the consumer woken up the way USBPcapSharedBufferNotify
+ * does it. Child process is USBPcapCMD: it sees header and data read-only,
+ * like the driver maps them, and writes only the consumer page.
+ */
+
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "USBPcapRing.h"
+#include "include/USBPcap.h"
+#include "test.h"
+
+#define PAGE          4096
+#define DATA_SIZE     (16 * PAGE)
+#define MAPPING_SIZE  (PAGE + DATA_SIZE + PAGE)
+#define RECORDS       200000
+
+typedef struct
+{
+    UINT32 length;
+    UINT32 sequence;
+    UINT32 checksum;
+} SHARED_RECORD;
+
+static PUSBPCAP_SHARED_RING_HEADER   header;
+static PUCHAR                        data;
+static PUSBPCAP_SHARED_RING_CONSUMER consumer;
+static sem_t                         *event;
+
+static UINT32 checksum(const UCHAR *bytes, UINT32 length, UINT32 seed)
+{
+    UINT32 hash = 2166136261u ^ seed;
+    UINT32 i;
+
+    for (i = 0; i < length; i++)
+    {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static void map_buffer(void)
+{
+    PUCHAR base = mmap(NULL, MAPPING_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    CHECK(base != MAP_FAILED);
+    header = (PUSBPCAP_SHARED_RING_HEADER)base;
+    data = base + PAGE;
+    consumer = (PUSBPCAP_SHARED_RING_CONSUMER)(base + PAGE + DATA_SIZE);
+
+    header->magic = USBPCAP_SHARED_RING_MAGIC;
+    header->version = USBPCAP_SHARED_RING_VERSION;
+    header->dataOffset = PAGE;
+    header->dataSize = DATA_SIZE;
+
+    /* Auto-reset event stand-in */
+    event = mmap(NULL, sizeof(sem_t), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    CHECK(event != MAP_FAILED);
+    CHECK(sem_init(event, 1, 0) == 0);
+}
+
+/* Same as USBPcapSharedBufferNotify */
+static void notify(void)
+{
+    if ((consumer->consumerWaiting != 0) &&
+        (InterlockedExchange(&consumer->consumerWaiting, 0) != 0))
+    {
+        sem_post(event);
+    }
+}
+
+/* Same as USBPcapSharedBufferGetReadOffset */
+static LONG64 get_read_offset(void)
+{
+    return __atomic_load_n(&consumer->readOffset, __ATOMIC_SEQ_CST);
+}
+
+static void set_read_offset(LONG64 value)
+{
+    __atomic_store_n(&consumer->readOffset, value, __ATOMIC_SEQ_CST);
+}
+
+/* Consumer writes garbage to readOffset, driver must not accept it */
+static void test_read_offset_validation(void)
+{
+    USBPCAP_RING ring;
+    USBPCAP_RING_RESERVATION res;
+    UCHAR record[100];
+
+    memset(record, 0, sizeof(record));
+    USBPcapRingInitialize(&ring);
+    USBPcapRingSetCommitMirror(&ring, &header->writeOffset);
+    USBPcapRingAttachBuffer(&ring, data, DATA_SIZE, 0);
+
+    CHECK(USBPcapRingEnter(&ring));
+    CHECK(NT_SUCCESS(USBPcapRingReserve(&ring, sizeof(record), &res)));
+    USBPcapRingWrite(&ring, &res, record, sizeof(record));
+    USBPcapRingCommit(&ring, &res);
+    USBPcapRingLeave(&ring);
+    CHECK_EQ(header->writeOffset, sizeof(record));
+
+    set_read_offset(-1);
+    CHECK(!USBPcapRingAdvanceRead(&ring, get_read_offset()));
+    set_read_offset(sizeof(record) + 1);
+    CHECK(!USBPcapRingAdvanceRead(&ring, get_read_offset()));
+    set_read_offset(0x7fffffffffffffffLL);
+    CHECK(!USBPcapRingAdvanceRead(&ring, get_read_offset()));
+    CHECK_EQ(USBPcapRingGetUsed(&ring), sizeof(record));
+
+    set_read_offset(40);
+    CHECK(USBPcapRingAdvanceRead(&ring, get_read_offset()));
+    /* Going backwards is rejected */
+    set_read_offset(20);
+    CHECK(!USBPcapRingAdvanceRead(&ring, get_read_offset()));
+    CHECK_EQ(USBPcapRingGetUsed(&ring), sizeof(record) - 40);
+
+    set_read_offset(0);
+    header->writeOffset = 0;
+    TEST_PASS("read_offset_validation");
+}
+
+/* Child of consumer: any write to the producer mapping must fault */
+static void check_read_only(void)
+{
+    pid_t pid = fork();
+    int status;
+
+    CHECK(pid >= 0);
+    if (pid == 0)
+    {
+        LONG64 expected = 0;
+
+        signal(SIGSEGV, SIG_DFL);
+        /* Even failing compare-exchange writes */
+        __atomic_compare_exchange_n(&header->writeOffset, &expected, 1, 0,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+        _exit(0);
+    }
+    CHECK(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFSIGNALED(status) && (WTERMSIG(status) == SIGSEGV));
+}
+
+/* Consumer loop of USBPcapCMD process_mapped_data() */
+static int run_consumer(void)
+{
+    static UCHAR stream[DATA_SIZE + sizeof(SHARED_RECORD) + 2048];
+    UINT32 filled = 0;
+    UINT32 expected = 0;
+    LONG64 read = get_read_offset();
+
+    CHECK(mprotect(header, PAGE + DATA_SIZE, PROT_READ) == 0);
+    check_read_only();
+
+    while (expected < RECORDS)
+    {
+        /* Plain atomic load, the page is read-only */
+        LONG64 write = __atomic_load_n(&header->writeOffset, __ATOMIC_SEQ_CST);
+        UINT32 pos = 0;
+
+        if (write == read)
+        {
+            InterlockedExchange(&consumer->consumerWaiting, 1);
+            write = __atomic_load_n(&header->writeOffset, __ATOMIC_SEQ_CST);
+            if (write == read)
+            {
+                while (sem_wait(event) != 0)
+                {
+                }
+                continue;
+            }
+            InterlockedExchange(&consumer->consumerWaiting, 0);
+        }
+
+        while (read != write)
+        {
+            UINT32 index = (UINT32)(read % header->dataSize);
+            UINT32 bytes = header->dataSize - index;
+
+            if ((LONG64)bytes > write - read)
+            {
+                bytes = (UINT32)(write - read);
+            }
+            CHECK(filled + bytes <= sizeof(stream));
+            memcpy(&stream[filled], &data[index], bytes);
+            filled += bytes;
+            read += bytes;
+        }
+        set_read_offset(read);
+
+        while (filled - pos >= sizeof(SHARED_RECORD))
+        {
+            SHARED_RECORD rec;
+
+            memcpy(&rec, &stream[pos], sizeof(rec));
+            if (filled - pos < rec.length)
+            {
+                break;
+            }
+            CHECK_EQ(rec.sequence, expected);
+            CHECK_EQ(rec.checksum,
+                     checksum(&stream[pos + sizeof(rec)],
+                              rec.length - sizeof(rec), rec.sequence));
+            expected++;
+            pos += rec.length;
+        }
+        memmove(stream, &stream[pos], filled - pos);
+        filled -= pos;
+    }
+
+    CHECK_EQ(filled, 0);
+    return 0;
+}
+
+/* Driver side of USBPcapBufferStorePacket for mapped buffer */
+static void run_producer(void)
+{
+    USBPCAP_RING ring;
+    UCHAR payload[1024];
+    UINT32 rnd = 99;
+    UINT32 seq;
+
+    USBPcapRingInitialize(&ring);
+    USBPcapRingSetCommitMirror(&ring, &header->writeOffset);
+    USBPcapRingAttachBuffer(&ring, data, DATA_SIZE, 0);
+
+    for (seq = 0; seq < RECORDS; seq++)
+    {
+        SHARED_RECORD rec;
+        USBPCAP_RING_RESERVATION res;
+        UINT32 length = test_random(&rnd) % sizeof(payload);
+        UINT32 i;
+
+        for (i = 0; i < length; i++)
+        {
+            payload[i] = (UCHAR)test_random(&rnd);
+        }
+        rec.length = sizeof(rec) + length;
+        rec.sequence = seq;
+        rec.checksum = checksum(payload, length, seq);
+
+        CHECK(USBPcapRingEnter(&ring));
+        while (!NT_SUCCESS(USBPcapRingReserve(&ring, rec.length, &res)))
+        {
+            /* Consumer does not tell the driver when it reads the data */
+            if (!USBPcapRingAdvanceRead(&ring, get_read_offset()))
+            {
+                sched_yield();
+            }
+        }
+        USBPcapRingWrite(&ring, &res, &rec, sizeof(rec));
+        USBPcapRingWrite(&ring, &res, payload, length);
+        USBPcapRingCommit(&ring, &res);
+        USBPcapRingLeave(&ring);
+        notify();
+    }
+}
+
+int main(void)
+{
+    pid_t pid;
+    int status;
+
+    map_buffer();
+    test_read_offset_validation();
+
+    pid = fork();
+    CHECK(pid >= 0);
+    if (pid == 0)
+    {
+        _exit(run_consumer());
+    }
+
+    run_producer();
+    CHECK(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && (WEXITSTATUS(status) == 0));
+
+    TEST_PASS("shared_ring");
+    return 0;
+}
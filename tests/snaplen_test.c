@@ -0,0 +1,205 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/*
+ * Snaplen lookup checked against a scan over the table, which is how
+ * USBPCAP_IOCTL_SNAPLEN_TABLE is documented.
+ */
+
+#include "USBPcapSnaplen.h"
+#include "test.h"
+
+static UINT32 model(PUSBPCAP_IOCTL_SNAPLEN_TABLE table, UINT32 rootSnaplen,
+                    USHORT device, UCHAR endpoint, UCHAR transfer)
+{
+    UINT32 snaplen = 0;
+    UINT32 i;
+
+    for (i = 0; i < table->count; i++)
+    {
+        if ((table->endpoints[i].device == device) &&
+            (table->endpoints[i].endpoint == endpoint))
+        {
+            snaplen = table->endpoints[i].snaplen;
+            break;
+        }
+    }
+
+    if ((i == table->count) && (transfer <= USBPCAP_TRANSFER_BULK))
+    {
+        snaplen = table->transfer[transfer];
+    }
+
+    if ((snaplen == 0) || (snaplen > rootSnaplen))
+    {
+        return rootSnaplen;
+    }
+    return snaplen;
+}
+
+static const UCHAR transfers[] =
+{
+    USBPCAP_TRANSFER_ISOCHRONOUS, USBPCAP_TRANSFER_INTERRUPT,
+    USBPCAP_TRANSFER_CONTROL, USBPCAP_TRANSFER_BULK,
+    USBPCAP_TRANSFER_IRP_INFO, USBPCAP_TRANSFER_UNKNOWN,
+};
+
+static void compare(PUSBPCAP_IOCTL_SNAPLEN_TABLE table, UINT32 rootSnaplen)
+{
+    USBPCAP_SNAPLEN_LOOKUP lookup;
+    int device;
+
+    CHECK_EQ(USBPcapSnaplenValidate(table), STATUS_SUCCESS);
+    memset(&lookup, 0xA5, sizeof(lookup));
+    USBPcapSnaplenBuild(&lookup, table, rootSnaplen);
+
+    for (device = 0; device <= 130; device++)
+    {
+        int endpoint;
+
+        for (endpoint = 0; endpoint <= 0xFF; endpoint++)
+        {
+            int i;
+
+            for (i = 0; i < (int)sizeof(transfers); i++)
+            {
+                CHECK_EQ(USBPcapSnaplenGet(&lookup, (USHORT)device,
+                                           (UCHAR)endpoint, transfers[i]),
+                         model(table, rootSnaplen, (USHORT)device,
+                               (UCHAR)endpoint, transfers[i]));
+            }
+        }
+    }
+}
+
+static void test_empty(void)
+{
+    USBPCAP_IOCTL_SNAPLEN_TABLE table;
+
+    memset(&table, 0, sizeof(table));
+    compare(&table, 65535);
+    compare(&table, 1);
+    TEST_PASS("empty");
+}
+
+static void test_transfer(void)
+{
+    USBPCAP_IOCTL_SNAPLEN_TABLE table;
+
+    memset(&table, 0, sizeof(table));
+    table.transfer[USBPCAP_TRANSFER_CONTROL] = 100;
+    table.transfer[USBPCAP_TRANSFER_BULK] = 70000;
+    compare(&table, 65535);
+    compare(&table, 50);
+    TEST_PASS("transfer");
+}
+
+static void test_endpoints(void)
+{
+    USBPCAP_IOCTL_SNAPLEN_TABLE table;
+    USBPCAP_SNAPLEN_LOOKUP lookup;
+
+    memset(&table, 0, sizeof(table));
+    table.transfer[USBPCAP_TRANSFER_BULK] = 64;
+    table.endpoints[0].device = 5;
+    table.endpoints[0].endpoint = 0x81;
+    table.endpoints[0].snaplen = 512;
+    /* Duplicate, first entry wins */
+    table.endpoints[1].device = 5;
+    table.endpoints[1].endpoint = 0x81;
+    table.endpoints[1].snaplen = 1024;
+    /* No limit for this endpoint, even though bulk is limited */
+    table.endpoints[2].device = 5;
+    table.endpoints[2].endpoint = 0x02;
+    table.endpoints[2].snaplen = 0;
+    table.endpoints[3].device = 127;
+    table.endpoints[3].endpoint = 0x8F;
+    table.endpoints[3].snaplen = 100000;
+    table.endpoints[4].device = 0;
+    table.endpoints[4].endpoint = 0x00;
+    table.endpoints[4].snaplen = 8;
+    table.count = 5;
+    compare(&table, 65535);
+
+    USBPcapSnaplenBuild(&lookup, &table, 65535);
+    CHECK_EQ(USBPcapSnaplenGet(&lookup, 5, 0x81, USBPCAP_TRANSFER_BULK), 512);
+    CHECK_EQ(USBPcapSnaplenGet(&lookup, 5, 0x01, USBPCAP_TRANSFER_BULK), 64);
+    CHECK_EQ(USBPcapSnaplenGet(&lookup, 5, 0x02, USBPCAP_TRANSFER_BULK), 65535);
+    CHECK_EQ(USBPcapSnaplenGet(&lookup, 127, 0x8F, USBPCAP_TRANSFER_BULK), 65535);
+    CHECK_EQ(USBPcapSnaplenGet(&lookup, 5, 0xFF, USBPCAP_TRANSFER_IRP_INFO), 65535);
+
+    /* Root hub snaplen limits resolved values */
+    USBPcapSnaplenBuild(&lookup, &table, 256);
+    CHECK_EQ(USBPcapSnaplenGet(&lookup, 5, 0x81, USBPCAP_TRANSFER_BULK), 256);
+    CHECK_EQ(USBPcapSnaplenGet(&lookup, 0, 0x00, USBPCAP_TRANSFER_CONTROL), 8);
+
+    TEST_PASS("endpoints");
+}
+
+static void test_random_tables(void)
+{
+    uint32_t seed = 0x5a91;
+    int round;
+
+    for (round = 0; round < 200; round++)
+    {
+        USBPCAP_IOCTL_SNAPLEN_TABLE table;
+        /* Few devices, so rows and duplicates are shared */
+        UINT32 devices = 1 + test_random(&seed) % 40;
+        UINT32 i;
+
+        memset(&table, 0, sizeof(table));
+        for (i = 0; i < 4; i++)
+        {
+            table.transfer[i] = (test_random(&seed) % 3 == 0) ? 0 :
+                                test_random(&seed) % 2000;
+        }
+        table.count = test_random(&seed) % (USBPCAP_SNAPLEN_MAX_ENDPOINTS + 1);
+        for (i = 0; i < table.count; i++)
+        {
+            table.endpoints[i].device = (UINT16)(test_random(&seed) % devices);
+            table.endpoints[i].endpoint = (UINT8)(test_random(&seed) & 0x8F);
+            table.endpoints[i].snaplen = test_random(&seed) % 2000;
+        }
+        compare(&table, 1 + test_random(&seed) % 1500);
+    }
+
+    TEST_PASS("random_tables");
+}
+
+static void test_validate(void)
+{
+    USBPCAP_IOCTL_SNAPLEN_TABLE table;
+
+    memset(&table, 0, sizeof(table));
+    table.count = USBPCAP_SNAPLEN_MAX_ENDPOINTS;
+    CHECK_EQ(USBPcapSnaplenValidate(&table), STATUS_SUCCESS);
+    table.count = USBPCAP_SNAPLEN_MAX_ENDPOINTS + 1;
+    CHECK_EQ(USBPcapSnaplenValidate(&table), STATUS_INVALID_PARAMETER);
+
+    table.count = 1;
+    table.endpoints[0].device = 128;
+    CHECK_EQ(USBPcapSnaplenValidate(&table), STATUS_INVALID_PARAMETER);
+    table.endpoints[0].device = 127;
+    table.endpoints[0].endpoint = 0x90;
+    CHECK_EQ(USBPcapSnaplenValidate(&table), STATUS_INVALID_PARAMETER);
+    table.endpoints[0].endpoint = 0xFF;
+    CHECK_EQ(USBPcapSnaplenValidate(&table), STATUS_INVALID_PARAMETER);
+    table.endpoints[0].endpoint = 0x8F;
+    CHECK_EQ(USBPcapSnaplenValidate(&table), STATUS_SUCCESS);
+
+    TEST_PASS("validate");
+}
+
+int main(void)
+{
+    test_empty();
+    test_transfer();
+    test_endpoints();
+    test_random_tables();
+    test_validate();
+    return 0;
+}
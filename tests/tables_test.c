@@ -0,0 +1,364 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/*
+ * Endpoint and URB IRP tables of USBPcapTables.c: random operations
+ * checked against a plain model, and lock-free readers running while
+ * the table is modified.
+ */
+
+#include <pthread.h>
+
+#include "USBPcapTables.h"
+#include "test.h"
+
+/* Pipe handles are pool allocations, keep the low bits clear */
+#define HANDLE(n)  ((USBD_PIPE_HANDLE)(ULONG_PTR)(0x10000 + (n) * 16))
+
+static void pipe_info(PUSBD_PIPE_INFORMATION pipe, unsigned n, UCHAR endpoint)
+{
+    memset(pipe, 0, sizeof(*pipe));
+    pipe->PipeHandle = HANDLE(n);
+    pipe->EndpointAddress = endpoint;
+    pipe->PipeType = (USBD_PIPE_TYPE)(n % 4);
+}
+
+static void test_endpoint_basic(void)
+{
+    PUSBPCAP_ENDPOINT_TABLE table = USBPcapInitializeEndpointTable();
+    USBD_PIPE_INFORMATION pipe;
+    USBPCAP_ENDPOINT_INFO info;
+
+    CHECK(table != NULL);
+    CHECK(!USBPcapRetrieveEndpointInfo(table, HANDLE(1), &info));
+    CHECK(!USBPcapRetrieveEndpointInfo(table, NULL, &info));
+    CHECK(!USBPcapRetrieveEndpointInfo(NULL, HANDLE(1), &info));
+
+    pipe_info(&pipe, 1, 0x81);
+    USBPcapAddEndpointInfo(table, &pipe, 7);
+    CHECK(USBPcapRetrieveEndpointInfo(table, HANDLE(1), &info));
+    CHECK(info.handle == HANDLE(1));
+    CHECK_EQ(info.endpointAddress, 0x81);
+    CHECK_EQ(info.deviceAddress, 7);
+    CHECK_EQ(info.type, 1);
+
+    /* New handle of the same endpoint replaces the old one */
+    pipe_info(&pipe, 2, 0x81);
+    USBPcapAddEndpointInfo(table, &pipe, 7);
+    CHECK(!USBPcapRetrieveEndpointInfo(table, HANDLE(1), &info));
+    CHECK(USBPcapRetrieveEndpointInfo(table, HANDLE(2), &info));
+
+    /* Same handle, different endpoint */
+    pipe_info(&pipe, 2, 0x02);
+    USBPcapAddEndpointInfo(table, &pipe, 7);
+    CHECK(USBPcapRetrieveEndpointInfo(table, HANDLE(2), &info));
+    CHECK_EQ(info.endpointAddress, 0x02);
+
+    USBPcapRemoveEndpointInfo(table, HANDLE(2));
+    CHECK(!USBPcapRetrieveEndpointInfo(table, HANDLE(2), &info));
+    /* Removing missing handle is harmless */
+    USBPcapRemoveEndpointInfo(table, HANDLE(2));
+
+    USBPcapFreeEndpointTable(table);
+    TEST_PASS("endpoint_basic");
+}
+
+/* Model: handle of every endpoint address, 0 if none */
+static unsigned model[256];
+
+static void test_endpoint_random(void)
+{
+    PUSBPCAP_ENDPOINT_TABLE table = USBPcapInitializeEndpointTable();
+    uint32_t seed = 0x7ab1e;
+    unsigned op;
+
+    memset(model, 0, sizeof(model));
+    for (op = 0; op < 200000; op++)
+    {
+        /* Few distinct handles, so both replacement rules are exercised
+         * and many handles collide in their home slots.
+         */
+        unsigned n = 1 + test_random(&seed) % 200;
+        UCHAR endpoint = (UCHAR)(test_random(&seed) & 0x8F);
+        unsigned i;
+
+        if (test_random(&seed) % 3)
+        {
+            USBD_PIPE_INFORMATION pipe;
+
+            pipe_info(&pipe, n, endpoint);
+            USBPcapAddEndpointInfo(table, &pipe, (USHORT)n);
+            for (i = 0; i < 256; i++)
+            {
+                if (model[i] == n)
+                {
+                    model[i] = 0;
+                }
+            }
+            model[endpoint] = n;
+        }
+        else
+        {
+            USBPcapRemoveEndpointInfo(table, HANDLE(n));
+            for (i = 0; i < 256; i++)
+            {
+                if (model[i] == n)
+                {
+                    model[i] = 0;
+                }
+            }
+        }
+
+        if ((op % 64) == 0)
+        {
+            for (n = 1; n <= 200; n++)
+            {
+                USBPCAP_ENDPOINT_INFO info;
+                BOOLEAN expected = FALSE;
+
+                for (i = 0; i < 256; i++)
+                {
+                    if (model[i] == n)
+                    {
+                        expected = TRUE;
+                        break;
+                    }
+                }
+
+                CHECK_EQ(USBPcapRetrieveEndpointInfo(table, HANDLE(n), &info),
+                         expected);
+                if (expected)
+                {
+                    CHECK_EQ(info.endpointAddress, i);
+                    CHECK_EQ(info.deviceAddress, n);
+                }
+            }
+        }
+    }
+
+    USBPcapFreeEndpointTable(table);
+    TEST_PASS("endpoint_random");
+}
+
+#define READERS 3
+
+static PUSBPCAP_ENDPOINT_TABLE sharedTable;
+static volatile int stop;
+static unsigned long long readerFound[READERS];
+
+static void *endpoint_reader(void *arg)
+{
+    unsigned long long *found = (unsigned long long *)arg;
+    uint32_t seed = 0x1234 + (uint32_t)(found - readerFound);
+
+    while (!stop)
+    {
+        unsigned n = 1 + test_random(&seed) % 64;
+        USBPCAP_ENDPOINT_INFO info;
+
+        if (USBPcapRetrieveEndpointInfo(sharedTable, HANDLE(n), &info))
+        {
+            /* Every field must come from the same add */
+            CHECK(info.handle == HANDLE(n));
+            CHECK_EQ(info.deviceAddress, n);
+            CHECK_EQ(info.endpointAddress, n & 0x8F);
+            CHECK_EQ(info.type, n % 4);
+            (*found)++;
+        }
+    }
+    return NULL;
+}
+
+static void test_endpoint_concurrent(void)
+{
+    pthread_t threads[READERS];
+    uint32_t seed = 0xc0ffee;
+    unsigned i;
+
+    sharedTable = USBPcapInitializeEndpointTable();
+    stop = 0;
+    for (i = 0; i < READERS; i++)
+    {
+        pthread_create(&threads[i], NULL, endpoint_reader, &readerFound[i]);
+    }
+
+    for (i = 0; i < 300000; i++)
+    {
+        unsigned n = 1 + test_random(&seed) % 64;
+
+        /* Writers are serialized by tablesSpinLock in the driver */
+        if (test_random(&seed) & 1)
+        {
+            USBD_PIPE_INFORMATION pipe;
+
+            pipe_info(&pipe, n, (UCHAR)(n & 0x8F));
+            USBPcapAddEndpointInfo(sharedTable, &pipe, (USHORT)n);
+        }
+        else
+        {
+            USBPcapRemoveEndpointInfo(sharedTable, HANDLE(n));
+        }
+        if ((i % 1024) == 0)
+        {
+            sched_yield();
+        }
+    }
+
+    stop = 1;
+    for (i = 0; i < READERS; i++)
+    {
+        pthread_join(threads[i], NULL);
+        CHECK(readerFound[i] > 0);
+    }
+    USBPcapFreeEndpointTable(sharedTable);
+    TEST_PASS("endpoint_concurrent");
+}
+
+#define IRP(n)  ((PIRP)(ULONG_PTR)(0x20000 + (n) * 16))
+
+static void irp_info(PUSBPCAP_URB_IRP_INFO info, unsigned n)
+{
+    memset(info, 0, sizeof(*info));
+    info->irp = IRP(n);
+    info->timestamp.QuadPart = (LONGLONG)n * 1000;
+    info->function = (USHORT)n;
+    info->device = (USHORT)(n % 128);
+    info->endpoint = (UCHAR)(n & 0x8F);
+}
+
+static void check_irp_info(PUSBPCAP_URB_IRP_INFO info, unsigned n)
+{
+    CHECK(info->irp == IRP(n));
+    CHECK_EQ(info->timestamp.QuadPart, (LONGLONG)n * 1000);
+    CHECK_EQ(info->function, (USHORT)n);
+    CHECK_EQ(info->device, n % 128);
+    CHECK_EQ(info->endpoint, n & 0x8F);
+}
+
+static void test_irp_overflow(void)
+{
+    PUSBPCAP_URB_IRP_TABLE table;
+    USBPCAP_URB_IRP_INFO info;
+    unsigned n;
+
+    table = USBPcapInitializeURBIRPInfoTable(USBPCAP_URB_IRP_TABLE_SLOTS);
+    CHECK(table != NULL);
+    CHECK(!USBPcapObtainURBIRPInfo(table, IRP(1), &info));
+    CHECK(!USBPcapObtainURBIRPInfo(NULL, IRP(1), &info));
+
+    /* Far more IRPs in flight than there are slots */
+    for (n = 0; n < 2000; n++)
+    {
+        irp_info(&info, n);
+        CHECK(USBPcapAddURBIRPInfo(table, &info));
+    }
+    for (n = 0; n < 2000; n += 2)
+    {
+        CHECK(USBPcapObtainURBIRPInfo(table, IRP(n), &info));
+        check_irp_info(&info, n);
+        CHECK(!USBPcapObtainURBIRPInfo(table, IRP(n), &info));
+    }
+    for (n = 1999; n < 2000; n -= 2)
+    {
+        CHECK(USBPcapObtainURBIRPInfo(table, IRP(n), &info));
+        check_irp_info(&info, n);
+    }
+    CHECK(!USBPcapObtainURBIRPInfo(table, IRP(1), &info));
+
+    /* Table is freed with entries in both slots and overflow list */
+    for (n = 0; n < 500; n++)
+    {
+        irp_info(&info, n);
+        CHECK(USBPcapAddURBIRPInfo(table, &info));
+    }
+    USBPcapFreeURBIRPInfoTable(table);
+    TEST_PASS("irp_overflow");
+}
+
+#define IRP_THREADS       4
+#define IRPS_PER_THREAD   512
+
+static PUSBPCAP_URB_IRP_TABLE sharedIrpTable;
+
+/* Every thread submits a random batch of its own IRPs, then completes
+ * them in random order, while the other threads do the same.
+ */
+static void *irp_worker(void *arg)
+{
+    unsigned base = (unsigned)(ULONG_PTR)arg * IRPS_PER_THREAD;
+    uint32_t seed = 0x9e37 + base;
+    unsigned order[IRPS_PER_THREAD];
+    unsigned round;
+
+    for (round = 0; round < 400; round++)
+    {
+        unsigned count = 1 + test_random(&seed) % IRPS_PER_THREAD;
+        unsigned i;
+
+        for (i = 0; i < count; i++)
+        {
+            USBPCAP_URB_IRP_INFO info;
+
+            order[i] = base + i;
+            irp_info(&info, base + i);
+            CHECK(USBPcapAddURBIRPInfo(sharedIrpTable, &info));
+        }
+        for (i = count - 1; i > 0; i--)
+        {
+            unsigned j = test_random(&seed) % (i + 1);
+            unsigned tmp = order[i];
+
+            order[i] = order[j];
+            order[j] = tmp;
+        }
+        for (i = 0; i < count; i++)
+        {
+            USBPCAP_URB_IRP_INFO info;
+
+            CHECK(USBPcapObtainURBIRPInfo(sharedIrpTable, IRP(order[i]), &info));
+            check_irp_info(&info, order[i]);
+        }
+        if ((round % 16) == 0)
+        {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void test_irp_concurrent(void)
+{
+    pthread_t threads[IRP_THREADS];
+    USBPCAP_URB_IRP_INFO info;
+    unsigned n;
+
+    sharedIrpTable = USBPcapInitializeURBIRPInfoTable(USBPCAP_URB_IRP_TABLE_SLOTS);
+    for (n = 0; n < IRP_THREADS; n++)
+    {
+        pthread_create(&threads[n], NULL, irp_worker, (void *)(ULONG_PTR)n);
+    }
+    for (n = 0; n < IRP_THREADS; n++)
+    {
+        pthread_join(threads[n], NULL);
+    }
+
+    for (n = 0; n < IRP_THREADS * IRPS_PER_THREAD; n++)
+    {
+        CHECK(!USBPcapObtainURBIRPInfo(sharedIrpTable, IRP(n), &info));
+    }
+    USBPcapFreeURBIRPInfoTable(sharedIrpTable);
+    TEST_PASS("irp_concurrent");
+}
+
+int main(void)
+{
+    test_endpoint_basic();
+    test_endpoint_random();
+    test_endpoint_concurrent();
+    test_irp_overflow();
+    test_irp_concurrent();
+    return 0;
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef USBPCAP_TEST_H
+#define USBPCAP_TEST_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+ * Minimal helpers shared by the host tests and benchmarks. A failed CHECK
+ * aborts the whole test binary, so tests do not need any cleanup paths.
+ */
+#define CHECK(cond)                                                     \
+    do                                                                  \
+    {                                                                   \
+        if (!(cond))                                                    \
+        {                                                               \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                \
+                    __FILE__, __LINE__, #cond);                         \
+            exit(1);                                                    \
+        }                                                               \
+    } while (0)
+
+#define CHECK_EQ(a, b)                                                  \
+    do                                                                  \
+    {                                                                   \
+        unsigned long long _a = (unsigned long long)(a);                \
+        unsigned long long _b = (unsigned long long)(b);                \
+        if (_a != _b)                                                   \
+        {                                                               \
+            fprintf(stderr, "%s:%d: %s == %s failed (%llu != %llu)\n",  \
+                    __FILE__, __LINE__, #a, #b, _a, _b);                \
+            exit(1);                                                    \
+        }                                                               \
+    } while (0)
+
+#define TEST_PASS(name) printf("%s: OK\n", name)
+
+/* Deterministic xorshift generator, tests must be reproducible */
+static inline uint32_t test_random(uint32_t *state)
+{
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static inline uint64_t test_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* Benchmarks take iteration scale from USBPCAP_BENCH_SCALE (default 1) */
+static inline unsigned test_bench_scale(void)
+{
+    const char *env = getenv("USBPCAP_BENCH_SCALE");
+    int scale = env ? atoi(env) : 1;
+
+    return scale > 0 ? (unsigned)scale : 1;
+}
+
+#endif /* USBPCAP_TEST_H */
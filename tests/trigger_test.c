@@ -0,0 +1,670 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/*
+ * Trigger matcher and capture window of USBPcapTrigger.c replayed over
+ * USBPcap pcap traces. The built-in trace models a mass storage device
+ * hitting a stall next to a polled HID device; any recorded trace can be
+ * replayed with
+ *
+ *   trigger_test <file.pcap> [postCount]
+ *
+ * which prints the window a stall trigger would capture.
+ */
+
+#include <pthread.h>
+
+#include "USBPcapTrigger.h"
+#include "test.h"
+
+#define TRACE_SIZE   (4 * 1024 * 1024)
+#define MAX_PACKETS  65536
+#define MAX_DATA     65536
+
+/* Packet layout of the built-in trace */
+#define STORAGE      3   /* Mass storage device address */
+#define HID          5   /* HID device address */
+#define COMMANDS     400
+
+typedef struct
+{
+    UCHAR   *data;
+    UINT32  length;
+    UINT32  packets;
+} TRACE;
+
+/* Packets of interest in the built-in trace */
+static struct
+{
+    UINT32  firstCbw;       /* First READ(10) CBW */
+    UINT32  hidStall;       /* HID interrupt IN stalled */
+    UINT32  cancelSubmit;   /* Submission carrying the CANCELED value */
+    UINT32  cancelComplete; /* Bulk IN completed as canceled */
+    UINT32  storageStall;   /* Bulk IN data stage stalled */
+    UINT32  clearHalt;      /* CLEAR_FEATURE(ENDPOINT_HALT) SETUP */
+    UINT32  failedCsw;      /* CSW with status 1 */
+} marks;
+
+static UCHAR traceData[TRACE_SIZE];
+static TRACE trace = { traceData, 0, 0 };
+
+static void trace_begin(TRACE *t)
+{
+    pcap_hdr_t header;
+
+    memset(&header, 0, sizeof(header));
+    header.magic_number = 0xA1B2C3D4;
+    header.version_major = 2;
+    header.version_minor = 4;
+    header.snaplen = 65535;
+    header.network = DLT_USBPCAP;
+    memcpy(t->data, &header, sizeof(header));
+    t->length = sizeof(header);
+    t->packets = 0;
+}
+
+/* Appends packet, stage is USBPCAP_CONTROL_STAGE_XXX for control
+ * transfers. Returns packet index.
+ */
+static UINT32 trace_add(TRACE *t, BOOLEAN completion, USBD_STATUS status,
+                        USHORT device, UCHAR endpoint, UCHAR transfer,
+                        UCHAR stage, const void *data, UINT32 length)
+{
+    USBPCAP_BUFFER_CONTROL_HEADER header;
+    pcaprec_hdr_t rec;
+    UINT32 headerLen = (transfer == USBPCAP_TRANSFER_CONTROL) ?
+                       sizeof(USBPCAP_BUFFER_CONTROL_HEADER) :
+                       sizeof(USBPCAP_BUFFER_PACKET_HEADER);
+
+    memset(&header, 0, sizeof(header));
+    header.header.headerLen = (USHORT)headerLen;
+    header.header.irpId = 0xFFFFFA8000000000ULL + t->packets / 2 * 0x100;
+    header.header.status = status;
+    header.header.info = completion ? USBPCAP_INFO_PDO_TO_FDO : 0;
+    header.header.bus = 1;
+    header.header.device = device;
+    header.header.endpoint = endpoint;
+    header.header.transfer = transfer;
+    header.header.dataLength = length;
+    header.stage = stage;
+
+    rec.ts_sec = 1500000000 + t->packets / 1000;
+    rec.ts_usec = (t->packets % 1000) * 1000;
+    rec.incl_len = headerLen + length;
+    rec.orig_len = rec.incl_len;
+
+    CHECK(t->length + sizeof(rec) + rec.incl_len <= TRACE_SIZE);
+    memcpy(&t->data[t->length], &rec, sizeof(rec));
+    memcpy(&t->data[t->length + sizeof(rec)], &header, headerLen);
+    memcpy(&t->data[t->length + sizeof(rec) + headerLen], data, length);
+    t->length += (UINT32)sizeof(rec) + rec.incl_len;
+    return t->packets++;
+}
+
+/* Bulk transfer: submission with OUT data, completion with IN data */
+static UINT32 bulk(TRACE *t, UCHAR endpoint, USBD_STATUS status,
+                   const void *data, UINT32 length)
+{
+    BOOLEAN in = (endpoint & 0x80) ? TRUE : FALSE;
+
+    trace_add(t, FALSE, USBD_STATUS_SUCCESS, STORAGE, endpoint,
+              USBPCAP_TRANSFER_BULK, 0, data, in ? 0 : length);
+    return trace_add(t, TRUE, status, STORAGE, endpoint,
+                     USBPCAP_TRANSFER_BULK, 0, data, in ? length : 0);
+}
+
+static void hid_poll(TRACE *t, USBD_STATUS status)
+{
+    static const UCHAR report[8] = { 0, 0, 4, 0, 0, 0, 0, 0 };
+    UINT32 index;
+
+    trace_add(t, FALSE, USBD_STATUS_SUCCESS, HID, 0x81,
+              USBPCAP_TRANSFER_INTERRUPT, 0, report, 0);
+    index = trace_add(t, TRUE, status, HID, 0x81, USBPCAP_TRANSFER_INTERRUPT,
+                      0, report, (status == USBD_STATUS_SUCCESS) ? 8 : 0);
+    if (status != USBD_STATUS_SUCCESS)
+    {
+        marks.hidStall = index;
+    }
+}
+
+/*
+ * Mass storage READ(10) commands (CBW, data, CSW) with HID polls in
+ * between. One command is canceled, one data stage stalls and is
+ * followed by CLEAR_FEATURE(ENDPOINT_HALT) and a failed CSW.
+ */
+static void build_trace(TRACE *t)
+{
+    static UCHAR sector[512];
+    UCHAR cbw[31] = { 'U', 'S', 'B', 'C' };
+    UCHAR csw[13] = { 'U', 'S', 'B', 'S' };
+    static const UCHAR clearHalt[8] = { 0x02, 0x01, 0x00, 0x00,
+                                        0x81, 0x00, 0x00, 0x00 };
+    UINT32 index;
+    UINT32 i;
+
+    trace_begin(t);
+    memset(sector, 0x5A, sizeof(sector));
+    for (i = 0; i < COMMANDS; i++)
+    {
+        USBD_STATUS dataStatus = USBD_STATUS_SUCCESS;
+
+        cbw[4] = csw[4] = (UCHAR)i;
+        cbw[15] = 0x28;
+        csw[12] = 0;
+        if ((i % 7) == 0)
+        {
+            hid_poll(t, (i == 70) ? USBD_STATUS_STALL_PID : USBD_STATUS_SUCCESS);
+        }
+
+        index = bulk(t, 0x02, USBD_STATUS_SUCCESS, cbw, sizeof(cbw));
+        if (i == 0)
+        {
+            /* CBW is the submission just before its completion */
+            marks.firstCbw = index - 1;
+        }
+
+        if (i == 150)
+        {
+            /* Status in submission header is only a leftover value */
+            marks.cancelSubmit =
+                trace_add(t, FALSE, USBD_STATUS_CANCELED, STORAGE, 0x81,
+                          USBPCAP_TRANSFER_BULK, 0, sector, 0);
+            marks.cancelComplete =
+                trace_add(t, TRUE, USBD_STATUS_CANCELED, STORAGE, 0x81,
+                          USBPCAP_TRANSFER_BULK, 0, sector, 0);
+            continue;
+        }
+
+        if (i == 300)
+        {
+            dataStatus = USBD_STATUS_STALL_PID;
+        }
+        if (dataStatus == USBD_STATUS_SUCCESS)
+        {
+            bulk(t, 0x81, dataStatus, sector, sizeof(sector));
+        }
+        else
+        {
+            marks.storageStall = bulk(t, 0x81, dataStatus, sector, 0);
+            marks.clearHalt =
+                trace_add(t, FALSE, USBD_STATUS_SUCCESS, STORAGE, 0x00,
+                          USBPCAP_TRANSFER_CONTROL, USBPCAP_CONTROL_STAGE_SETUP,
+                          clearHalt, sizeof(clearHalt));
+            trace_add(t, TRUE, USBD_STATUS_SUCCESS, STORAGE, 0x00,
+                      USBPCAP_TRANSFER_CONTROL, USBPCAP_CONTROL_STAGE_STATUS,
+                      NULL, 0);
+            csw[12] = 1;
+        }
+        index = bulk(t, 0x81, USBD_STATUS_SUCCESS, csw, sizeof(csw));
+        if (i == 300)
+        {
+            marks.failedCsw = index;
+        }
+    }
+}
+
+typedef struct
+{
+    const TRACE *trace;
+    UINT32      offset;
+    uint32_t    seed;
+    UCHAR       header[sizeof(USBPCAP_BUFFER_CONTROL_HEADER)];
+    USBPCAP_PAYLOAD_ENTRY payload[4];
+    /* Payload copy, segments are separated by a poisoned byte */
+    UCHAR       segments[MAX_DATA + 3];
+} TRACE_READER;
+
+static void reader_init(TRACE_READER *r, const TRACE *t, uint32_t seed)
+{
+    pcap_hdr_t header;
+
+    CHECK(t->length >= sizeof(header));
+    memcpy(&header, t->data, sizeof(header));
+    CHECK_EQ(header.magic_number, 0xA1B2C3D4);
+    CHECK_EQ(header.network, DLT_USBPCAP);
+    r->trace = t;
+    r->offset = sizeof(header);
+    r->seed = seed;
+}
+
+/*
+ * Returns next packet of the trace. Payload is split into up to three
+ * segments that are not adjacent in memory, like transfer buffer of URB
+ * and its chained MDLs.
+ */
+static BOOLEAN reader_next(TRACE_READER *r, PUSBPCAP_FILTER_PACKET packet)
+{
+    pcaprec_hdr_t rec;
+    PUSBPCAP_BUFFER_PACKET_HEADER header;
+    UCHAR *data;
+    UCHAR *copy;
+    UINT32 length;
+    UINT32 i;
+
+    if (r->trace->length - r->offset < sizeof(rec))
+    {
+        return FALSE;
+    }
+    memcpy(&rec, &r->trace->data[r->offset], sizeof(rec));
+    data = &r->trace->data[r->offset + sizeof(rec)];
+    CHECK(r->trace->length - r->offset - sizeof(rec) >= rec.incl_len);
+    r->offset += (UINT32)sizeof(rec) + rec.incl_len;
+
+    CHECK(rec.incl_len >= sizeof(USBPCAP_BUFFER_PACKET_HEADER));
+    header = (PUSBPCAP_BUFFER_PACKET_HEADER)r->header;
+    memset(r->header, 0, sizeof(r->header));
+    memcpy(r->header, data, min(rec.incl_len, (UINT32)sizeof(r->header)));
+    CHECK(header->headerLen <= rec.incl_len);
+    data += header->headerLen;
+    length = rec.incl_len - header->headerLen;
+    /* Snapshot length may have cut the payload */
+    header->dataLength = length;
+    CHECK(length <= MAX_DATA);
+
+    copy = r->segments;
+    for (i = 0; (i < 3) && (length > 0); i++)
+    {
+        UINT32 size = (i == 2) ? length : test_random(&r->seed) % (length + 1);
+
+        memcpy(copy, data, size);
+        copy[size] = 0xEE;
+        r->payload[i].size = size;
+        r->payload[i].buffer = copy;
+        copy += size + 1;
+        data += size;
+        length -= size;
+    }
+    r->payload[i].size = 0;
+    r->payload[i].buffer = NULL;
+
+    packet->header = header;
+    packet->payload = r->payload;
+    return TRUE;
+}
+
+typedef struct
+{
+    UINT32  fired;     /* Index of trigger packet, MAXULONG if none */
+    UINT32  first;     /* Oldest packet kept in the window */
+    UINT32  last;      /* Newest packet kept in the window */
+    UINT32  rejected;  /* Packets offered after the capture stopped */
+    LONG    state;
+} WINDOW;
+
+/*
+ * Replays trace the way USBPcapBufferStorePacket handles packets in
+ * overwrite-oldest buffer that holds capacity packets.
+ */
+static void replay(const TRACE *t, PUSBPCAP_IOCTL_TRIGGER trigger,
+                   UINT32 capacity, WINDOW *window)
+{
+    USBPCAP_TRIGGER_PROGRESS progress;
+    USBPCAP_FILTER_PACKET packet;
+    TRACE_READER reader;
+    UINT32 index = 0;
+    UINT32 stored = 0;
+    UINT32 closed = 0;
+
+    CHECK(USBPcapTriggerValidate(trigger));
+    USBPcapTriggerRearm(&progress, trigger);
+    reader_init(&reader, t, 0xABC + capacity);
+
+    window->fired = MAXULONG;
+    window->rejected = 0;
+    window->first = 0;
+    window->last = MAXULONG;
+    for (; reader_next(&reader, &packet); index++)
+    {
+        LONG before = USBPcapTriggerGetState(&progress);
+
+        if (!USBPcapTriggerCheck(&progress, trigger, &packet))
+        {
+            window->rejected++;
+            continue;
+        }
+        if ((before == USBPCAP_TRIGGER_STATE_WAITING) &&
+            (USBPcapTriggerGetState(&progress) == USBPCAP_TRIGGER_STATE_FIRED))
+        {
+            window->fired = index;
+        }
+
+        /* Oldest packet is evicted when the buffer is full */
+        stored++;
+        window->last = index;
+        if (stored > capacity)
+        {
+            window->first = window->last + 1 - capacity;
+        }
+        if (USBPcapTriggerStored(&progress))
+        {
+            closed++;
+        }
+    }
+
+    CHECK(closed <= 1);
+    window->state = USBPcapTriggerGetState(&progress);
+    CHECK_EQ(closed, (window->state == USBPCAP_TRIGGER_STATE_CLOSED) ? 1 : 0);
+}
+
+static void trigger_init(PUSBPCAP_IOCTL_TRIGGER trigger, UINT32 type,
+                         UINT32 postCount)
+{
+    memset(trigger, 0, sizeof(*trigger));
+    trigger->type = type;
+    trigger->postCount = postCount;
+}
+
+static void set_pattern(PUSBPCAP_IOCTL_TRIGGER trigger, UINT32 offset,
+                        const UCHAR *pattern, const UCHAR *mask, UINT8 length)
+{
+    UINT8 i;
+
+    trigger->offset = offset;
+    trigger->length = length;
+    for (i = 0; i < length; i++)
+    {
+        trigger->pattern[i] = pattern[i];
+        trigger->mask[i] = mask ? mask[i] : 0xFF;
+    }
+}
+
+/* Trigger fires at expected packet and the window holds the packets
+ * before it and exactly postCount packets after it.
+ */
+static void expect_window(PUSBPCAP_IOCTL_TRIGGER trigger, UINT32 capacity,
+                          UINT32 expected)
+{
+    WINDOW w;
+
+    replay(&trace, trigger, capacity, &w);
+    CHECK_EQ(w.fired, expected);
+    CHECK_EQ(w.state, USBPCAP_TRIGGER_STATE_CLOSED);
+    CHECK_EQ(w.last, expected + trigger->postCount);
+    CHECK_EQ(w.first, (capacity > trigger->postCount + expected) ?
+                      0 : expected + trigger->postCount + 1 - capacity);
+    CHECK_EQ(w.rejected, trace.packets - 1 - w.last);
+}
+
+static void test_stall(void)
+{
+    USBPCAP_IOCTL_TRIGGER trigger;
+
+    /* Any device: the HID stall comes first */
+    trigger_init(&trigger, USBPCAP_TRIGGER_STALL, 20);
+    expect_window(&trigger, 100, marks.hidStall);
+
+    trigger.flags = USBPCAP_TRIGGER_FLAG_DEVICE;
+    trigger.device = STORAGE;
+    expect_window(&trigger, 100, marks.storageStall);
+    expect_window(&trigger, 5000, marks.storageStall);
+
+    trigger.flags |= USBPCAP_TRIGGER_FLAG_ENDPOINT;
+    trigger.endpoint = 0x02;
+    {
+        WINDOW w;
+
+        replay(&trace, &trigger, 100, &w);
+        CHECK_EQ(w.fired, MAXULONG);
+        CHECK_EQ(w.state, USBPCAP_TRIGGER_STATE_WAITING);
+        CHECK_EQ(w.last, trace.packets - 1);
+        CHECK_EQ(w.first, trace.packets - 100);
+        CHECK_EQ(w.rejected, 0);
+    }
+
+    /* Halted endpoint counts as stall too */
+    trigger_init(&trigger, USBPCAP_TRIGGER_STATUS, 0);
+    trigger.status = (UINT32)USBD_STATUS_STALL_PID;
+    trigger.flags = USBPCAP_TRIGGER_FLAG_DEVICE;
+    trigger.device = STORAGE;
+    expect_window(&trigger, 10, marks.storageStall);
+    TEST_PASS("stall");
+}
+
+/* Status is compared only on completion */
+static void test_status(void)
+{
+    USBPCAP_IOCTL_TRIGGER trigger;
+
+    trigger_init(&trigger, USBPCAP_TRIGGER_STATUS, 3);
+    trigger.status = (UINT32)USBD_STATUS_CANCELED;
+    CHECK(marks.cancelSubmit < marks.cancelComplete);
+    expect_window(&trigger, 50, marks.cancelComplete);
+    TEST_PASS("status");
+}
+
+static void test_setup(void)
+{
+    static const UCHAR clearFeature[2] = { 0x02, 0x01 };
+    static const UCHAR endpointHalt[8] = { 0x02, 0x01, 0x00, 0x00,
+                                           0x81, 0x00, 0x00, 0x00 };
+    static const UCHAR anyEndpoint[8] = { 0xFF, 0xFF, 0xFF, 0xFF,
+                                          0x00, 0xFF, 0xFF, 0xFF };
+    USBPCAP_IOCTL_TRIGGER trigger;
+    WINDOW w;
+
+    trigger_init(&trigger, USBPCAP_TRIGGER_SETUP, 0);
+    set_pattern(&trigger, 0, clearFeature, NULL, sizeof(clearFeature));
+    expect_window(&trigger, 1, marks.clearHalt);
+
+    set_pattern(&trigger, 0, endpointHalt, anyEndpoint, sizeof(endpointHalt));
+    trigger.postCount = 40;
+    expect_window(&trigger, 1000, marks.clearHalt);
+
+    /* SETUP trigger ignores the same bytes in bulk payload */
+    set_pattern(&trigger, 0, (const UCHAR *)"USBC", NULL, 4);
+    replay(&trace, &trigger, 10, &w);
+    CHECK_EQ(w.fired, MAXULONG);
+    TEST_PASS("setup");
+}
+
+static void test_payload(void)
+{
+    static const UCHAR failedCsw[13] = { 'U', 'S', 'B', 'S', 0, 0, 0, 0,
+                                         0, 0, 0, 0, 1 };
+    static const UCHAR cswMask[13] = { 0xFF, 0xFF, 0xFF, 0xFF, 0, 0, 0, 0,
+                                       0, 0, 0, 0, 0xFF };
+    static const UCHAR status = 1;
+    static const UCHAR read10 = 0x28;
+    USBPCAP_IOCTL_TRIGGER trigger;
+    WINDOW w;
+
+    trigger_init(&trigger, USBPCAP_TRIGGER_PAYLOAD, 7);
+    set_pattern(&trigger, 0, failedCsw, cswMask, sizeof(failedCsw));
+    expect_window(&trigger, 64, marks.failedCsw);
+
+    /* Single byte at offset, pattern split over payload segments */
+    set_pattern(&trigger, 12, &status, NULL, 1);
+    expect_window(&trigger, 64, marks.failedCsw);
+
+    /* Operation code of the first CBW, trigger packet alone */
+    set_pattern(&trigger, 15, &read10, NULL, 1);
+    trigger.postCount = 0;
+    expect_window(&trigger, 3, marks.firstCbw);
+
+    /* Pattern past the end of every payload never matches */
+    set_pattern(&trigger, 512, &status, NULL, 1);
+    replay(&trace, &trigger, 64, &w);
+    CHECK_EQ(w.fired, MAXULONG);
+    CHECK_EQ(w.state, USBPCAP_TRIGGER_STATE_WAITING);
+    TEST_PASS("payload");
+}
+
+/* Trigger near the end: window is still open when the trace ends */
+static void test_open_window(void)
+{
+    USBPCAP_IOCTL_TRIGGER trigger;
+    WINDOW w;
+
+    trigger_init(&trigger, USBPCAP_TRIGGER_STALL, 1000000);
+    replay(&trace, &trigger, 256, &w);
+    CHECK_EQ(w.fired, marks.hidStall);
+    CHECK_EQ(w.state, USBPCAP_TRIGGER_STATE_FIRED);
+    CHECK_EQ(w.last, trace.packets - 1);
+    CHECK_EQ(w.rejected, 0);
+    TEST_PASS("open window");
+}
+
+static void test_validate(void)
+{
+    USBPCAP_IOCTL_TRIGGER trigger;
+    static const UCHAR byte = 0;
+
+    trigger_init(&trigger, USBPCAP_TRIGGER_NONE, 0);
+    CHECK(USBPcapTriggerValidate(&trigger));
+    trigger.type = 5;
+    CHECK(!USBPcapTriggerValidate(&trigger));
+
+    trigger_init(&trigger, USBPCAP_TRIGGER_STALL, MAXLONG - 1);
+    CHECK(USBPcapTriggerValidate(&trigger));
+    trigger.postCount = MAXLONG;
+    CHECK(!USBPcapTriggerValidate(&trigger));
+    trigger.postCount = 0;
+    trigger.flags = 0x4;
+    CHECK(!USBPcapTriggerValidate(&trigger));
+    trigger.flags = 0;
+    trigger.length = 1;
+    CHECK(!USBPcapTriggerValidate(&trigger));
+
+    trigger_init(&trigger, USBPCAP_TRIGGER_SETUP, 0);
+    trigger.length = 9;
+    CHECK(!USBPcapTriggerValidate(&trigger));
+    trigger.length = 8;
+    CHECK(USBPcapTriggerValidate(&trigger));
+    trigger.offset = 1;
+    CHECK(!USBPcapTriggerValidate(&trigger));
+
+    trigger_init(&trigger, USBPCAP_TRIGGER_PAYLOAD, 0);
+    CHECK(!USBPcapTriggerValidate(&trigger));
+    set_pattern(&trigger, MAXULONG, &byte, NULL, 1);
+    CHECK(!USBPcapTriggerValidate(&trigger));
+    trigger.offset = MAXULONG - 1;
+    CHECK(USBPcapTriggerValidate(&trigger));
+    trigger.length = USBPCAP_TRIGGER_MAX_PATTERN + 1;
+    CHECK(!USBPcapTriggerValidate(&trigger));
+    TEST_PASS("validate");
+}
+
+#define THREADS       4
+#define POST_COUNT    1000
+
+static USBPCAP_TRIGGER_PROGRESS sharedProgress;
+static USBPCAP_IOCTL_TRIGGER sharedTrigger;
+static volatile LONG storedAfterFire;
+static volatile LONG closes;
+
+/* Every thread replays the trace as if its packets were captured on
+ * a different processor.
+ */
+static void *replay_thread(void *arg)
+{
+    USBPCAP_FILTER_PACKET packet;
+    TRACE_READER reader;
+
+    reader_init(&reader, &trace, (uint32_t)(uintptr_t)arg + 1);
+    while (reader_next(&reader, &packet))
+    {
+        if (!USBPcapTriggerCheck(&sharedProgress, &sharedTrigger, &packet))
+        {
+            continue;
+        }
+        if (USBPcapTriggerGetState(&sharedProgress) != USBPCAP_TRIGGER_STATE_WAITING)
+        {
+            InterlockedIncrement(&storedAfterFire);
+        }
+        if (USBPcapTriggerStored(&sharedProgress))
+        {
+            InterlockedIncrement(&closes);
+        }
+    }
+    return NULL;
+}
+
+/* Concurrent producers close the window exactly once */
+static void test_concurrent(void)
+{
+    pthread_t threads[THREADS];
+    unsigned round;
+    ULONG i;
+
+    for (round = 0; round < 50; round++)
+    {
+        trigger_init(&sharedTrigger, USBPCAP_TRIGGER_STALL, POST_COUNT);
+        USBPcapTriggerRearm(&sharedProgress, &sharedTrigger);
+        storedAfterFire = 0;
+        closes = 0;
+
+        for (i = 0; i < THREADS; i++)
+        {
+            pthread_create(&threads[i], NULL, replay_thread,
+                           (void *)(uintptr_t)(round * THREADS + i));
+        }
+        for (i = 0; i < THREADS; i++)
+        {
+            pthread_join(threads[i], NULL);
+        }
+
+        CHECK_EQ(closes, 1);
+        CHECK_EQ(USBPcapTriggerGetState(&sharedProgress),
+                 USBPCAP_TRIGGER_STATE_CLOSED);
+        /* Packets already past the check when the window closed are
+         * stored as well, at most one per producer.
+         */
+        CHECK(storedAfterFire >= POST_COUNT + 1);
+        CHECK(storedAfterFire <= POST_COUNT + THREADS);
+    }
+    TEST_PASS("concurrent");
+}
+
+/* Prints the window a stall trigger would capture from recorded trace */
+static int replay_file(const char *path, UINT32 postCount)
+{
+    static UCHAR data[TRACE_SIZE];
+    TRACE recorded = { data, 0, 0 };
+    USBPCAP_IOCTL_TRIGGER trigger;
+    WINDOW w;
+    FILE *f = fopen(path, "rb");
+
+    if (f == NULL)
+    {
+        perror(path);
+        return 1;
+    }
+    recorded.length = (UINT32)fread(data, 1, sizeof(data), f);
+    fclose(f);
+
+    trigger_init(&trigger, USBPCAP_TRIGGER_STALL, postCount);
+    replay(&recorded, &trigger, MAX_PACKETS, &w);
+    if (w.fired == MAXULONG)
+    {
+        printf("%s: no stall\n", path);
+    }
+    else
+    {
+        printf("%s: stall at packet %u, window packets %u-%u%s\n", path,
+               w.fired + 1, w.first + 1, w.last + 1,
+               (w.state == USBPCAP_TRIGGER_STATE_CLOSED) ? "" : " (open)");
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1)
+    {
+        return replay_file(argv[1], (argc > 2) ? (UINT32)atol(argv[2]) : 100);
+    }
+
+    build_trace(&trace);
+    test_validate();
+    test_stall();
+    test_status();
+    test_setup();
+    test_payload();
+    test_open_window();
+    test_concurrent();
+    return 0;
+}
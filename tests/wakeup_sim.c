@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/*
+ * Replays a timestamped packet trace through the read wakeup policy and
+ * reports reader wakeups per second and the latency the coalescing adds.
+ *
+ * The reader is modelled as always having a read pending: it reissues the
+ * read as soon as the previous one completes. The latency timer is armed
+ * by the first packet that does not meet the threshold and is not rearmed
+ * until it fires or the read completes, exactly as in USBPcapBuffer.c.
+ *
+ *   wakeup_sim [trace]
+ *
+ * Trace file has one packet per line: "<timestamp in us> <length>", with
+ * non-decreasing timestamps. Without a file, a synthetic trace of bulk
+ * bursts over periodic interrupt traffic is used.
+ */
+
+#include "USBPcapWakeup.h"
+#include "test.h"
+
+typedef struct
+{
+    uint64_t timestamp; /* in microseconds */
+    uint32_t length;
+} trace_packet;
+
+typedef struct
+{
+    trace_packet *packets;
+    size_t count;
+    size_t allocated;
+} trace;
+
+typedef struct
+{
+    unsigned long long wakeups;
+    unsigned long long latencySum;
+    uint64_t latencyMax;
+} sim_result;
+
+static void trace_add(trace *t, uint64_t timestamp, uint32_t length)
+{
+    if (t->count == t->allocated)
+    {
+        t->allocated = t->allocated ? t->allocated * 2 : 4096;
+        t->packets = realloc(t->packets, t->allocated * sizeof(trace_packet));
+        CHECK(t->packets != NULL);
+    }
+    t->packets[t->count].timestamp = timestamp;
+    t->packets[t->count].length = length;
+    t->count++;
+}
+
+static void trace_load(trace *t, const char *path)
+{
+    unsigned long long timestamp;
+    unsigned length;
+    FILE *f = fopen(path, "r");
+
+    CHECK(f != NULL);
+    while (fscanf(f, "%llu %u", &timestamp, &length) == 2)
+    {
+        CHECK(t->count == 0 ||
+              timestamp >= t->packets[t->count - 1].timestamp);
+        trace_add(t, timestamp, length);
+    }
+    fclose(f);
+    CHECK(t->count > 0);
+}
+
+/*
+ * 10 seconds (times bench scale) of 8 byte interrupt transfers every 1 ms,
+ * with 100 ms bursts of 512 byte bulk transfers at 8000/s starting on
+ * average every 0.6 s.
+ */
+static void trace_synthetic(trace *t)
+{
+    uint64_t duration = 10000000ull * test_bench_scale();
+    uint64_t interrupt = 0;
+    uint64_t burst = 0;
+    uint64_t burstEnd = 0;
+    uint32_t seed = 0x57a7e;
+
+    while (interrupt < duration)
+    {
+        if (burst < burstEnd && burst < interrupt)
+        {
+            trace_add(t, burst, 512 + 27);
+            burst += 125;
+            continue;
+        }
+        if (burst >= burstEnd && burstEnd <= interrupt)
+        {
+            burst = interrupt + test_random(&seed) % 1000000;
+            burstEnd = burst + 100000;
+        }
+        trace_add(t, interrupt, 8 + 27);
+        interrupt += 1000;
+    }
+}
+
+static void complete(sim_result *r, const trace *t, size_t first,
+                     size_t end, uint64_t now)
+{
+    size_t i;
+
+    r->wakeups++;
+    for (i = first; i < end; i++)
+    {
+        uint64_t latency = now - t->packets[i].timestamp;
+
+        r->latencySum += latency;
+        if (latency > r->latencyMax)
+        {
+            r->latencyMax = latency;
+        }
+    }
+}
+
+static void simulate(const trace *t, PUSBPCAP_WAKEUP_POLICY policy,
+                     sim_result *r)
+{
+    size_t first = 0; /* First packet not yet read */
+    size_t i;
+    UINT32 used = 0;
+    BOOLEAN armed = FALSE;
+    uint64_t deadline = 0;
+
+    memset(r, 0, sizeof(*r));
+
+    for (i = 0; i < t->count; i++)
+    {
+        const trace_packet *p = &t->packets[i];
+
+        if (armed && deadline <= p->timestamp)
+        {
+            armed = FALSE;
+            if (USBPcapWakeupCheck(policy, used, TRUE) ==
+                USBPCAP_WAKEUP_COMPLETE)
+            {
+                complete(r, t, first, i, deadline);
+                first = i;
+                used = 0;
+            }
+        }
+
+        used += p->length;
+        switch (USBPcapWakeupCheck(policy, used, FALSE))
+        {
+            case USBPCAP_WAKEUP_COMPLETE:
+                complete(r, t, first, i + 1, p->timestamp);
+                first = i + 1;
+                used = 0;
+                armed = FALSE;
+                break;
+            case USBPCAP_WAKEUP_ARM_TIMER:
+                if (!armed)
+                {
+                    armed = TRUE;
+                    deadline = p->timestamp + policy->maxLatencyUs;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    if (armed)
+    {
+        complete(r, t, first, t->count, deadline);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    static const UINT32 policies[][2] =
+    {
+        /* minBytes, maxLatencyUs */
+        {      0,      0 },
+        {   4096,   1000 },
+        {  65536,  10000 },
+        { 262144,  50000 },
+        { 262144, 100000 },
+    };
+    trace t = { NULL, 0, 0 };
+    double seconds;
+    size_t i;
+
+    if (argc > 1)
+    {
+        trace_load(&t, argv[1]);
+    }
+    else
+    {
+        trace_synthetic(&t);
+    }
+
+    seconds = (double)(t.packets[t.count - 1].timestamp -
+                       t.packets[0].timestamp) / 1e6;
+    if (seconds <= 0)
+    {
+        seconds = 1e-6;
+    }
+    printf("%zu packets over %.3f s\n", t.count, seconds);
+    printf("%10s %10s %12s %14s %14s\n",
+           "minBytes", "latencyUs", "wakeups/s", "mean added us",
+           "max added us");
+
+    for (i = 0; i < sizeof(policies) / sizeof(policies[0]); i++)
+    {
+        USBPCAP_WAKEUP_POLICY policy;
+        sim_result r;
+
+        CHECK(NT_SUCCESS(USBPcapWakeupSet(&policy, policies[i][0],
+                                          policies[i][1])));
+        simulate(&t, &policy, &r);
+
+        /* Latency bound is the whole point of the policy */
+        CHECK(r.latencyMax <= policy.maxLatencyUs);
+
+        printf("%10u %10u %12.1f %14.1f %14llu\n",
+               policy.minBytes, policy.maxLatencyUs,
+               r.wakeups / seconds,
+               (double)r.latencySum / t.count,
+               (unsigned long long)r.latencyMax);
+    }
+
+    free(t.packets);
+    return 0;
+}
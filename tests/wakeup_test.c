@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/*
+ * Read wakeup policy: parameter validation and completion decisions.
+ */
+
+#include "USBPcapWakeup.h"
+#include "test.h"
+
+static void test_set(void)
+{
+    USBPCAP_WAKEUP_POLICY policy;
+
+    USBPcapWakeupInitialize(&policy);
+    CHECK_EQ(policy.minBytes, 0);
+    CHECK_EQ(policy.maxLatencyUs, 0);
+
+    CHECK(NT_SUCCESS(USBPcapWakeupSet(&policy, 0, 0)));
+    CHECK(NT_SUCCESS(USBPcapWakeupSet(&policy, 1, 0)));
+    CHECK(NT_SUCCESS(USBPcapWakeupSet(&policy, 4096,
+                                      USBPCAP_WAKEUP_MAX_LATENCY)));
+    CHECK_EQ(policy.minBytes, 4096);
+    CHECK_EQ(policy.maxLatencyUs, USBPCAP_WAKEUP_MAX_LATENCY);
+
+    /* Rejected values leave the policy untouched */
+    CHECK_EQ(USBPcapWakeupSet(&policy, 2, 0), STATUS_INVALID_PARAMETER);
+    CHECK_EQ(USBPcapWakeupSet(&policy, 0, USBPCAP_WAKEUP_MAX_LATENCY + 1),
+             STATUS_INVALID_PARAMETER);
+    CHECK_EQ(policy.minBytes, 4096);
+    CHECK_EQ(policy.maxLatencyUs, USBPCAP_WAKEUP_MAX_LATENCY);
+
+    TEST_PASS("set");
+}
+
+static void test_check(void)
+{
+    USBPCAP_WAKEUP_POLICY policy;
+
+    /* Default policy completes on any data */
+    USBPcapWakeupInitialize(&policy);
+    CHECK_EQ(USBPcapWakeupCheck(&policy, 0, FALSE), USBPCAP_WAKEUP_WAIT);
+    CHECK_EQ(USBPcapWakeupCheck(&policy, 0, TRUE), USBPCAP_WAKEUP_WAIT);
+    CHECK_EQ(USBPcapWakeupCheck(&policy, 1, FALSE), USBPCAP_WAKEUP_COMPLETE);
+
+    CHECK(NT_SUCCESS(USBPcapWakeupSet(&policy, 1000, 500)));
+    CHECK_EQ(USBPcapWakeupCheck(&policy, 0, FALSE), USBPCAP_WAKEUP_WAIT);
+    CHECK_EQ(USBPcapWakeupCheck(&policy, 1, FALSE), USBPCAP_WAKEUP_ARM_TIMER);
+    CHECK_EQ(USBPcapWakeupCheck(&policy, 999, FALSE), USBPCAP_WAKEUP_ARM_TIMER);
+    CHECK_EQ(USBPcapWakeupCheck(&policy, 1000, FALSE), USBPCAP_WAKEUP_COMPLETE);
+    CHECK_EQ(USBPcapWakeupCheck(&policy, 5000, FALSE), USBPCAP_WAKEUP_COMPLETE);
+
+    /* Expired timer completes with whatever is there */
+    CHECK_EQ(USBPcapWakeupCheck(&policy, 1, TRUE), USBPCAP_WAKEUP_COMPLETE);
+
+    TEST_PASS("check");
+}
+
+int main(void)
+{
+    test_set();
+    test_check();
+    return 0;
+}
@@ -0,0 +1,459 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/*
+ * Whole record read framing: every read holds only complete records and
+ * a matching trailer, no record is lost or duplicated and drop counters
+ * add up with what the reader gets.
+ */
+
+#include <pthread.h>
+
+#include "USBPcapWholeRecords.h"
+#include "USBPcapStatistics.h"
+#include "test.h"
+#include "records.h"
+
+#define PRODUCERS        4
+#define PRODUCER_RECORDS 20000
+#define MAX_DATA         200
+#define SNAPLEN          (sizeof(USBPCAP_BUFFER_PACKET_HEADER) + MAX_DATA)
+#define MIN_READ         USBPCAP_WHOLE_RECORDS_MIN_READ(SNAPLEN)
+#define RING_BYTES       4096
+
+static USBPCAP_RING       ring;
+static UCHAR              ringBuffer[RING_BYTES];
+static USBPCAP_STATISTICS stats;
+
+static UCHAR              dropped[PRODUCERS][PRODUCER_RECORDS];
+static UINT64             droppedBytes[PRODUCERS];
+static volatile LONG      running;
+
+static void setup(void)
+{
+    UsbpcapHostProcessorCount = PRODUCERS;
+    UsbpcapHostProcessor = 0;
+    USBPcapRingInitialize(&ring);
+    USBPcapRingAttachBuffer(&ring, ringBuffer, sizeof(ringBuffer), 0);
+    CHECK(NT_SUCCESS(USBPcapStatisticsInitialize(&stats)));
+    memset(dropped, 0, sizeof(dropped));
+    memset(droppedBytes, 0, sizeof(droppedBytes));
+}
+
+static void teardown(void)
+{
+    USBPcapStatisticsFree(&stats);
+}
+
+static UINT32 data_length(ULONG producer, UINT32 seq)
+{
+    return (seq * 37 + producer) % (MAX_DATA + 1);
+}
+
+/* Length of the compact record test_store_record writes */
+static UINT32 record_length(UINT64 timestamp, UINT64 irpId, UINT32 length)
+{
+    USBPCAP_BUFFER_PACKET_HEADER header;
+    UCHAR prefix[USBPCAP_RECORD_MAX_PREFIX];
+    UINT32 captured = (UINT32)sizeof(header) + length;
+
+    memset(&header, 0, sizeof(header));
+    header.headerLen = sizeof(header);
+    header.irpId = irpId;
+    header.endpoint = 0x81;
+    header.transfer = USBPCAP_TRANSFER_BULK;
+    header.dataLength = length;
+
+    return USBPcapRecordEncode(&header, TEST_UNIX_EPOCH + timestamp,
+                               captured, prefix) +
+           USBPcapRecordGetBodyLength(captured);
+}
+
+/* Stores packet and counts it the same way USBPcapBufferStorePacket does */
+static void produce(PUSBPCAP_RING target, ULONG producer, UINT32 seq,
+                    UINT64 timestamp)
+{
+    UCHAR    data[MAX_DATA];
+    UINT64   irpId = ((UINT64)producer << 32) | seq;
+    UINT32   length = data_length(producer, seq);
+    NTSTATUS status;
+
+    memset(data, (int)seq, length);
+    CHECK(USBPcapRingEnter(target));
+    status = test_store_record(target, timestamp, irpId, data, length);
+    if (NT_SUCCESS(status))
+    {
+        USBPcapStatisticsPacketCaptured(&stats, USBPcapRingGetUsed(target));
+    }
+    else
+    {
+        UINT32 bytes = record_length(timestamp, irpId, length);
+
+        USBPcapStatisticsPacketDropped(&stats, bytes);
+        droppedBytes[producer] += bytes;
+        __atomic_store_n(&dropped[producer][seq], 1, __ATOMIC_RELEASE);
+    }
+    USBPcapRingLeave(target);
+}
+
+/* Parses single pcap record or pcapng block at data[*pos] and checks
+ * the data written by produce().
+ */
+static UINT64 parse(const UCHAR *data, UINT32 length, UINT32 *pos,
+                    BOOLEAN pcapng, PUINT64 timestamp)
+{
+    USBPCAP_BUFFER_PACKET_HEADER header;
+    UINT32 offset;
+    UINT32 i;
+
+    if (pcapng)
+    {
+        CHECK(test_parse_epb(data, length, pos, timestamp, &header));
+        return header.irpId;
+    }
+
+    {
+        pcaprec_hdr_t rec;
+
+        CHECK(length - *pos >= sizeof(rec));
+        memcpy(&rec, &data[*pos], sizeof(rec));
+        CHECK(rec.incl_len >= sizeof(header));
+        CHECK(length - *pos - sizeof(rec) >= rec.incl_len);
+        CHECK_EQ(rec.incl_len, rec.orig_len);
+        offset = *pos + (UINT32)sizeof(rec);
+        memcpy(&header, &data[offset], sizeof(header));
+        CHECK_EQ(rec.incl_len, sizeof(header) + header.dataLength);
+        for (i = 0; i < header.dataLength; i++)
+        {
+            CHECK_EQ(data[offset + sizeof(header) + i],
+                     (UCHAR)header.irpId);
+        }
+        *timestamp = (UINT64)rec.ts_sec * 1000000 + rec.ts_usec;
+        *pos = offset + rec.incl_len;
+    }
+    return header.irpId;
+}
+
+/* Reads once and checks the framing. Returns number of packet records
+ * delivered, each checked against expected[] and the drop flags.
+ */
+static UINT32 consume(PUSBPCAP_CPU_RINGS cpuRings, BOOLEAN pcapng,
+                      UINT32 readSize, UINT32 expected[PRODUCERS],
+                      UINT32 *headerLength)
+{
+    static UCHAR buffer[8 * 1024 + MIN_READ];
+    USBPCAP_READ_TRAILER trailer;
+    UINT32 bytes;
+    UINT32 pos = 0;
+    UINT32 records = 0;
+    UINT32 headers = 0;
+    UINT64 last = 0;
+
+    memset(buffer, 0xCC, readSize);
+    bytes = USBPcapWholeRecordsRead(&ring, cpuRings, NULL, pcapng,
+                                    buffer, readSize);
+    if (bytes == 0)
+    {
+        return 0;
+    }
+
+    CHECK(bytes <= readSize);
+    CHECK(bytes >= sizeof(trailer));
+    memcpy(&trailer, &buffer[bytes - sizeof(trailer)], sizeof(trailer));
+    CHECK_EQ(trailer.length, bytes - sizeof(trailer));
+    CHECK(trailer.records > 0);
+
+    if (*headerLength > 0)
+    {
+        /* Global header (filled with 0x5A) comes first, in its own record */
+        CHECK(trailer.length >= *headerLength);
+        for (; pos < *headerLength; pos++)
+        {
+            CHECK_EQ(buffer[pos], 0x5A);
+        }
+        *headerLength = 0;
+        headers++;
+    }
+
+    while (pos < trailer.length)
+    {
+        UINT64 timestamp;
+        UINT64 irpId = parse(buffer, trailer.length, &pos, pcapng, &timestamp);
+        ULONG producer = (ULONG)(irpId >> 32);
+        UINT32 seq = (UINT32)irpId;
+
+        CHECK(producer < PRODUCERS);
+        CHECK(seq < PRODUCER_RECORDS);
+        if (cpuRings != NULL)
+        {
+            CHECK(timestamp >= last);
+            last = timestamp;
+        }
+
+        /* Everything the producer stored in between was dropped */
+        CHECK(seq >= expected[producer]);
+        while (expected[producer] < seq)
+        {
+            CHECK(__atomic_load_n(&dropped[producer][expected[producer]],
+                                  __ATOMIC_ACQUIRE));
+            expected[producer]++;
+        }
+        CHECK(!dropped[producer][seq]);
+        expected[producer]++;
+        records++;
+    }
+    CHECK_EQ(pos, trailer.length);
+    CHECK_EQ(headers + records, trailer.records);
+
+    return records;
+}
+
+/* After the last read every record not delivered must have been dropped
+ * and the counters must add up.
+ */
+static void check_totals(UINT32 expected[PRODUCERS], ULONG producers,
+                         UINT64 delivered)
+{
+    USBPCAP_IOCTL_STATISTICS out;
+    UINT64 bytes = 0;
+    ULONG p;
+
+    USBPcapStatisticsGet(&stats, &out);
+    for (p = 0; p < producers; p++)
+    {
+        for (; expected[p] < PRODUCER_RECORDS; expected[p]++)
+        {
+            CHECK(dropped[p][expected[p]]);
+        }
+        bytes += droppedBytes[p];
+    }
+
+    CHECK(out.packetsDropped > 0);
+    CHECK_EQ(out.packetsCaptured + out.packetsDropped,
+             (UINT64)producers * PRODUCER_RECORDS);
+    CHECK_EQ(out.packetsCaptured, delivered);
+    CHECK_EQ(out.bytesDropped, bytes);
+    CHECK(out.bufferHighWater <= RING_BYTES);
+}
+
+/* Single thread interleaves bursts of packets with reads of random size,
+ * the ring is small so part of the packets is dropped.
+ */
+static void test_sequential(BOOLEAN pcapng)
+{
+    UINT32 expected[PRODUCERS] = { 0 };
+    UINT32 headerLength = 0;
+    UINT32 rnd = pcapng ? 11 : 5;
+    UINT32 seq = 0;
+    UINT64 delivered = 0;
+    UINT32 got;
+
+    setup();
+    while (seq < PRODUCER_RECORDS)
+    {
+        UINT32 burst = test_random(&rnd) % 64;
+
+        while ((burst-- > 0) && (seq < PRODUCER_RECORDS))
+        {
+            produce(&ring, 0, seq, seq);
+            seq++;
+        }
+        delivered += consume(NULL, pcapng,
+                             MIN_READ + test_random(&rnd) % (2 * MIN_READ),
+                             expected, &headerLength);
+    }
+    while ((got = consume(NULL, pcapng, MIN_READ, expected,
+                          &headerLength)) > 0)
+    {
+        delivered += got;
+    }
+
+    check_totals(expected, 1, delivered);
+    teardown();
+    TEST_PASS(pcapng ? "sequential pcapng" : "sequential pcap");
+}
+
+/* Record that does not fit into the read stays in the ring */
+static void test_short_read(void)
+{
+    UCHAR buffer[MIN_READ];
+    UINT32 expected[PRODUCERS] = { 0 };
+    UINT32 headerLength = 0;
+    UINT32 recordLength;
+
+    setup();
+    produce(&ring, 0, MAX_DATA - 1, 0);
+    recordLength = sizeof(pcapng_epb_t) + sizeof(USBPCAP_BUFFER_PACKET_HEADER) +
+                   data_length(0, MAX_DATA - 1);
+    recordLength = ((recordLength + 3) & ~3) + sizeof(UINT32);
+
+    CHECK_EQ(USBPcapWholeRecordsRead(&ring, NULL, NULL, TRUE, buffer,
+                                     sizeof(USBPCAP_READ_TRAILER)), 0);
+    CHECK_EQ(USBPcapWholeRecordsRead(&ring, NULL, NULL, TRUE, buffer,
+                                     recordLength +
+                                     sizeof(USBPCAP_READ_TRAILER) - 1), 0);
+    CHECK_EQ(USBPcapWholeRecordsRead(&ring, NULL, NULL, TRUE, buffer, 3), 0);
+    CHECK(USBPcapRingGetUsed(&ring) > 0);
+
+    expected[0] = MAX_DATA - 1;
+    CHECK_EQ(consume(NULL, TRUE, recordLength + sizeof(USBPCAP_READ_TRAILER),
+                     expected, &headerLength), 1);
+    CHECK_EQ(USBPcapRingGetUsed(&ring), 0);
+    CHECK_EQ(USBPcapWholeRecordsRead(&ring, NULL, NULL, TRUE, buffer,
+                                     sizeof(buffer)), 0);
+    teardown();
+    TEST_PASS("short read");
+}
+
+static void *producer_thread(void *arg)
+{
+    ULONG producer = (ULONG)(uintptr_t)arg;
+    UINT32 seq;
+
+    UsbpcapHostProcessor = producer;
+    for (seq = 0; seq < PRODUCER_RECORDS; seq++)
+    {
+        produce(&ring, producer, seq, seq);
+        if ((seq % 16) == 0)
+        {
+            sched_yield();
+        }
+    }
+    InterlockedDecrement(&running);
+    return NULL;
+}
+
+/* Producers race with the reader */
+static void test_concurrent(void)
+{
+    pthread_t threads[PRODUCERS];
+    UINT32 expected[PRODUCERS] = { 0 };
+    UINT32 headerLength = 0;
+    UINT32 rnd = 3;
+    UINT64 delivered = 0;
+    UINT32 got;
+    ULONG i;
+
+    setup();
+    running = PRODUCERS;
+    for (i = 0; i < PRODUCERS; i++)
+    {
+        pthread_create(&threads[i], NULL, producer_thread,
+                       (void *)(uintptr_t)i);
+    }
+
+    while (running > 0)
+    {
+        got = consume(NULL, TRUE, MIN_READ + test_random(&rnd) % MIN_READ,
+                      expected, &headerLength);
+        delivered += got;
+        if (got == 0)
+        {
+            sched_yield();
+        }
+    }
+    for (i = 0; i < PRODUCERS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    while ((got = consume(NULL, TRUE, MIN_READ, expected,
+                          &headerLength)) > 0)
+    {
+        delivered += got;
+    }
+
+    check_totals(expected, PRODUCERS, delivered);
+    teardown();
+    TEST_PASS("concurrent");
+}
+
+/* Per-CPU buffers: global header in the main ring comes out first, then
+ * the packets merged by timestamp.
+ */
+static void test_per_cpu(void)
+{
+    USBPCAP_CPU_RINGS cpuRings;
+    USBPCAP_PCAPNG_HEADER pcapngHeader;
+    USBPCAP_RING_RESERVATION reservation;
+    UCHAR prefix[USBPCAP_RECORD_MAX_PREFIX];
+    UINT32 prefixLength;
+    UINT32 expected[PRODUCERS] = { 0 };
+    UINT32 headerLength = sizeof(pcapngHeader);
+    UINT32 rnd = 9;
+    UINT32 seq[PRODUCERS] = { 0 };
+    UINT64 clock = 0;
+    UINT64 delivered = 0;
+    UINT32 got;
+    ULONG cpu;
+
+    setup();
+    CHECK(NT_SUCCESS(USBPcapCpuRingsInitialize(&cpuRings)));
+    CHECK(NT_SUCCESS(USBPcapCpuRingsSetUpBuffers(&cpuRings,
+                                                 PRODUCERS * RING_BYTES)));
+    USBPcapCpuRingsThaw(&cpuRings);
+
+    memset(&pcapngHeader, 0x5A, sizeof(pcapngHeader));
+    prefixLength = USBPcapRecordEncodeRaw(sizeof(pcapngHeader), prefix);
+    CHECK(NT_SUCCESS(USBPcapRingReserve(&ring,
+                                        prefixLength + sizeof(pcapngHeader),
+                                        &reservation)));
+    USBPcapRingWrite(&ring, &reservation, prefix, prefixLength);
+    USBPcapRingWrite(&ring, &reservation, &pcapngHeader, sizeof(pcapngHeader));
+    USBPcapRingCommit(&ring, &reservation);
+
+    /* Packets stored before the first read must not overtake the header,
+     * header and packets together must fit the read.
+     */
+    for (got = 0; got < 16; got++)
+    {
+        cpu = got % PRODUCERS;
+        UsbpcapHostProcessor = cpu;
+        produce(&cpuRings.rings[cpu], cpu, seq[cpu]++, ++clock);
+    }
+    got = consume(&cpuRings, TRUE, 2 * MIN_READ, expected, &headerLength);
+    CHECK(got > 0);
+    CHECK_EQ(headerLength, 0);
+    delivered += got;
+
+    while ((seq[0] < PRODUCER_RECORDS) || (seq[1] < PRODUCER_RECORDS) ||
+           (seq[2] < PRODUCER_RECORDS) || (seq[3] < PRODUCER_RECORDS))
+    {
+        UINT32 burst = test_random(&rnd) % 128;
+
+        while (burst-- > 0)
+        {
+            cpu = test_random(&rnd) % PRODUCERS;
+            if (seq[cpu] < PRODUCER_RECORDS)
+            {
+                UsbpcapHostProcessor = cpu;
+                produce(&cpuRings.rings[cpu], cpu, seq[cpu]++, ++clock);
+            }
+        }
+        delivered += consume(&cpuRings, TRUE,
+                             MIN_READ + test_random(&rnd) % (4 * MIN_READ),
+                             expected, &headerLength);
+    }
+    while ((got = consume(&cpuRings, TRUE, MIN_READ, expected,
+                          &headerLength)) > 0)
+    {
+        delivered += got;
+    }
+
+    check_totals(expected, PRODUCERS, delivered);
+    USBPcapCpuRingsFree(&cpuRings);
+    teardown();
+    TEST_PASS("per-CPU");
+}
+
+int main(void)
+{
+    test_sequential(FALSE);
+    test_sequential(TRUE);
+    test_short_read();
+    test_concurrent();
+    test_per_cpu();
+    return 0;
+}